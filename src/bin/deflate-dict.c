@@ -0,0 +1,673 @@
+/*
+ * deflate-dict -- trains a preset deflate dictionary from Gnutella dumps.
+ *
+ * Copyright (c) 2026 gtk-gnutella developers
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the authors nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * The input files are the message dumps written by core/dump.c when the
+ * "dump_received_gnutella_packets" or "dump_transmitted_gnutella_packets"
+ * properties are set.
+ *
+ * Training counts, for every 8-byte string, the amount of messages in
+ * which it appears.  Message excerpts are then scored by the popularity
+ * of the strings they contain and greedily selected, best first, until
+ * the dictionary is full.  The best excerpts are written last since zlib
+ * encodes closer matches more cheaply.
+ *
+ * Evaluation replays the messages of each connection through a deflate
+ * stream, flushing after each message as tx_deflate does, with and without
+ * the dictionary, and reports the compression gain.
+ */
+
+#include "common.h"
+
+#include <zlib.h>
+
+#include "if/core/gnutella.h"
+
+#include "lib/endian.h"
+#include "lib/halloc.h"
+#include "lib/hevset.h"
+#include "lib/log.h"
+#include "lib/misc.h"
+#include "lib/parse.h"
+#include "lib/progname.h"
+#include "lib/sha1.h"
+#include "lib/stringify.h"
+#include "lib/walloc.h"
+#include "lib/xsort.h"
+
+#include "lib/override.h"
+
+#define DICT_MAXLEN		32768	/* Only the last 32 KiB are used by zlib */
+#define DUMP_HDR_LEN	19		/* Dump record header, see core/dump.c */
+#define DUMP_F_UDP		0x01	/* Message sent or received via UDP */
+#define DUMP_F_TO		0x10	/* Transmitted message, two headers */
+#define DUMP_F_CTRL		0x20	/* Control message */
+#define GRAM_LEN		8		/* Length of counted strings */
+#define SEGMENT_LEN		48		/* Length of message excerpts */
+
+struct message {
+	const uchar *data;			/* Full message, including header */
+	size_t len;					/* Message length */
+	uint peer;					/* Connection ID */
+	uint idx;					/* Order of appearance in dumps */
+};
+
+struct peer {
+	uchar key[DUMP_HDR_LEN];	/* Dump header identifying connection */
+	uint id;
+};
+
+struct gram {
+	uint64 key;
+	uint count;					/* Amount of messages containing string */
+	uint last;					/* Last message where string was seen */
+};
+
+struct segment {
+	const uchar *data;
+	size_t len;
+	uint64 score;
+	uint idx;
+};
+
+static struct message *msgs;
+static size_t msgs_count, msgs_capacity;
+static hevset_t *peers;
+static uint peers_count;
+static hevset_t *grams;
+
+static bool opt_u, opt_v;
+static uint opt_l = Z_BEST_COMPRESSION;
+static uint opt_m = 2;
+static uint opt_s = DICT_MAXLEN;
+
+static void G_NORETURN
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-huv] [-e dict] [-l level] [-m min] [-o dict] [-s size]\n"
+		"       dump ...\n"
+		"  -e : evaluate existing dictionary instead of training one\n"
+		"  -h : prints this help message\n"
+		"  -l : compression level to use for evaluation (default %u)\n"
+		"  -m : minimum amount of messages sharing a string (default %u)\n"
+		"  -o : file where trained dictionary is written\n"
+		"  -s : dictionary size (default %u, max %u)\n"
+		"  -u : also consider messages sent or received via UDP\n"
+		"  -v : verbose, report on training progress\n"
+		, getprogname(), opt_l, opt_m, opt_s, DICT_MAXLEN);
+	exit(EXIT_FAILURE);
+}
+
+static uint
+get_number(const char *arg, int opt, uint min, uint max)
+{
+	int error;
+	uint32 val;
+
+	val = parse_uint32(arg, NULL, 10, &error);
+	if (error != 0 || val < min || val > max) {
+		s_fatal_exit(EXIT_FAILURE, "invalid -%c argument \"%s\" "
+			"(must be within [%u, %u])", opt, arg, min, max);
+	}
+
+	return val;
+}
+
+/**
+ * Map dump header to the ID of the connection it belongs to.
+ */
+static uint
+peer_id(const uchar *header)
+{
+	struct peer *p;
+	uchar key[DUMP_HDR_LEN];
+
+	memcpy(key, header, sizeof key);
+	key[0] &= ~DUMP_F_CTRL;			/* Same connection for all priorities */
+
+	p = hevset_lookup(peers, key);
+	if (NULL == p) {
+		WALLOC(p);
+		memcpy(p->key, key, sizeof key);
+		p->id = peers_count++;
+		hevset_insert(peers, p);
+	}
+
+	return p->id;
+}
+
+static void
+message_add(const uchar *data, size_t len, uint peer)
+{
+	struct message *m;
+
+	if (msgs_count == msgs_capacity) {
+		msgs_capacity = MAX(1024, msgs_capacity * 2);
+		HREALLOC_ARRAY(msgs, msgs_capacity);
+	}
+
+	m = &msgs[msgs_count];
+	m->data = data;
+	m->len = len;
+	m->peer = peer;
+	m->idx = msgs_count++;
+}
+
+/**
+ * Load all the messages held in the dump file.
+ *
+ * The file content is kept around for the whole run since messages point
+ * directly into it.
+ */
+static void
+dump_load(const char *path)
+{
+	FILE *f;
+	filestat_t buf;
+	uchar *data;
+	const uchar *p, *end;
+	size_t count = msgs_count;
+
+	f = fopen(path, "rb");
+	if (NULL == f)
+		s_fatal_exit(EXIT_FAILURE, "cannot open \"%s\": %m", path);
+
+	if (-1 == fstat(fileno(f), &buf))
+		s_fatal_exit(EXIT_FAILURE, "cannot stat \"%s\": %m", path);
+
+	if (0 == buf.st_size) {
+		fclose(f);
+		return;
+	}
+
+	data = halloc(buf.st_size);
+	if (1 != fread(data, buf.st_size, 1, f))
+		s_fatal_exit(EXIT_FAILURE, "cannot read \"%s\": %m", path);
+
+	fclose(f);
+
+	for (p = data, end = data + buf.st_size; p < end; /* empty */) {
+		const uchar *header = p;
+		size_t len;
+
+		if (end - p < DUMP_HDR_LEN)
+			goto truncated;
+
+		p += DUMP_HDR_LEN;
+
+		if (header[0] & DUMP_F_TO) {
+			if (end - p < DUMP_HDR_LEN)
+				goto truncated;
+			p += DUMP_HDR_LEN;		/* Skip origin of relayed message */
+		}
+
+		if (end - p < GTA_HEADER_SIZE)
+			goto truncated;
+
+		len = GTA_HEADER_SIZE + (gnutella_header_get_size(p) & GTA_SIZE_MASK);
+
+		if (UNSIGNED(end - p) < len)
+			goto truncated;
+
+		if (opt_u || 0 == (header[0] & DUMP_F_UDP))
+			message_add(p, len, peer_id(header));
+
+		p += len;
+	}
+
+	goto done;
+
+truncated:
+	s_warning("%s: truncated record at offset %zu",
+		path, (size_t) (p - data));
+
+done:
+	if (opt_v) {
+		s_info("%s: loaded %zu message%s",
+			path, PLURAL(msgs_count - count));
+	}
+}
+
+static inline uint64
+gram_key(const uchar *p)
+{
+	return peek_le64(p);
+}
+
+/**
+ * Count in how many messages each string appears.
+ *
+ * Message headers are skipped: they mostly hold random GUIDs and are
+ * already compressed fine by the stream itself.
+ */
+static void
+grams_count(void)
+{
+	size_t i;
+
+	for (i = 0; i < msgs_count; i++) {
+		const struct message *m = &msgs[i];
+		const uchar *p, *end;
+
+		if (m->len < GTA_HEADER_SIZE + GRAM_LEN)
+			continue;
+
+		end = m->data + m->len - GRAM_LEN;
+
+		for (p = m->data + GTA_HEADER_SIZE; p <= end; p++) {
+			uint64 key = gram_key(p);
+			struct gram *g = hevset_lookup(grams, &key);
+
+			if (NULL == g) {
+				WALLOC(g);
+				g->key = key;
+				g->count = 1;
+				g->last = i;
+				hevset_insert(grams, g);
+			} else if (g->last != i) {
+				g->count++;
+				g->last = i;
+			}
+		}
+	}
+
+	if (opt_v)
+		s_info("counted %zu distinct strings", hevset_count(grams));
+}
+
+/**
+ * Score segment by the popularity of the strings it contains.
+ *
+ * When ``consume'' is set, the strings are accounted as being present in
+ * the dictionary and will no longer contribute to any score.
+ */
+static uint64
+segment_score(const uchar *data, size_t len, bool consume)
+{
+	const uchar *p;
+	uint64 score = 0;
+
+	if (len < GRAM_LEN)
+		return 0;
+
+	for (p = data; p <= data + len - GRAM_LEN; p++) {
+		uint64 key = gram_key(p);
+		struct gram *g = hevset_lookup(grams, &key);
+
+		if (NULL == g || g->count < opt_m)
+			continue;
+
+		score += g->count - 1;
+		if (consume)
+			g->count = 0;
+	}
+
+	return score;
+}
+
+static int
+segment_cmp(const void *a, const void *b)
+{
+	const struct segment *sa = a, *sb = b;
+
+	if (sa->score != sb->score)
+		return CMP(sb->score, sa->score);		/* Highest score first */
+
+	return CMP(sa->idx, sb->idx);
+}
+
+/**
+ * Train dictionary of at most ``size'' bytes from the loaded messages.
+ *
+ * @return the dictionary, with its length written in ``len''.
+ */
+static uchar *
+dict_train(size_t size, size_t *len)
+{
+	struct segment *segs = NULL, **picked;
+	size_t nsegs = 0, capacity = 0, npicked = 0, total = 0, i;
+	uchar *dict, *p;
+
+	grams = hevset_create(offsetof(struct gram, key),
+		HASH_KEY_FIXED, sizeof(uint64));
+
+	grams_count();
+
+	/*
+	 * Candidate segments overlap by half their length, so that strings
+	 * straddling a segment boundary still get a chance.
+	 */
+
+	for (i = 0; i < msgs_count; i++) {
+		const struct message *m = &msgs[i];
+		size_t off;
+
+		for (
+			off = GTA_HEADER_SIZE;
+			off + GRAM_LEN <= m->len;
+			off += SEGMENT_LEN / 2
+		) {
+			struct segment *s;
+			size_t n = MIN(SEGMENT_LEN, m->len - off);
+			uint64 score = segment_score(&m->data[off], n, FALSE);
+
+			if (0 == score)
+				continue;
+
+			if (nsegs == capacity) {
+				capacity = MAX(1024, capacity * 2);
+				HREALLOC_ARRAY(segs, capacity);
+			}
+
+			s = &segs[nsegs];
+			s->data = &m->data[off];
+			s->len = n;
+			s->score = score;
+			s->idx = nsegs++;
+		}
+	}
+
+	xqsort(segs, nsegs, sizeof segs[0], segment_cmp);
+
+	/*
+	 * Greedy selection: once a segment is picked, the strings it holds no
+	 * longer add to the score of other segments.  Segments that lost more
+	 * than half of their initial score are redundant and skipped.
+	 */
+
+	HALLOC_ARRAY(picked, MAX(nsegs, 1));
+
+	for (i = 0; i < nsegs && total < size; i++) {
+		struct segment *s = &segs[i];
+		uint64 score = segment_score(s->data, s->len, FALSE);
+
+		if (0 == score || 2 * score < s->score)
+			continue;
+
+		segment_score(s->data, s->len, TRUE);
+		picked[npicked++] = s;
+		total += s->len;
+	}
+
+	if (opt_v) {
+		s_info("picked %zu out of %zu segment%s",
+			npicked, PLURAL(nsegs));
+	}
+
+	/*
+	 * Lay out the best segments at the end of the dictionary, and trim the
+	 * least useful bytes when we overshot.
+	 */
+
+	*len = MIN(total, size);
+	dict = halloc(MAX(*len, 1));
+	p = dict + *len;
+
+	for (i = 0; i < npicked && p > dict; i++) {
+		const struct segment *s = picked[i];
+		size_t n = MIN(s->len, UNSIGNED(p - dict));
+
+		p -= n;
+		memcpy(p, s->data + s->len - n, n);
+	}
+
+	hfree(picked);
+	hfree(segs);
+
+	return dict;
+}
+
+static size_t
+deflate_message(z_streamp z, const void *data, size_t len)
+{
+	static char buf[16 * 1024];
+	size_t total = 0;
+
+	z->next_in = deconstify_pointer(data);
+	z->avail_in = len;
+
+	do {
+		int ret;
+
+		z->next_out = (void *) buf;
+		z->avail_out = sizeof buf;
+
+		ret = deflate(z, Z_SYNC_FLUSH);
+		if (Z_OK != ret && Z_BUF_ERROR != ret)
+			s_fatal_exit(EXIT_FAILURE, "deflate() error %d", ret);
+
+		total += sizeof buf - z->avail_out;
+	} while (0 == z->avail_out);
+
+	return total;
+}
+
+static void
+stream_init(z_streamp z, const void *dict, size_t len)
+{
+	ZERO(z);
+
+	if (Z_OK != deflateInit2(z, opt_l, Z_DEFLATED,
+			MAX_WBITS, MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY))
+		s_fatal_exit(EXIT_FAILURE, "deflateInit2() failed");
+
+	if (dict != NULL && Z_OK != deflateSetDictionary(z, dict, len))
+		s_fatal_exit(EXIT_FAILURE, "deflateSetDictionary() failed");
+}
+
+static int
+message_cmp(const void *a, const void *b)
+{
+	const struct message *ma = a, *mb = b;
+
+	if (ma->peer != mb->peer)
+		return CMP(ma->peer, mb->peer);
+
+	return CMP(ma->idx, mb->idx);
+}
+
+/**
+ * Replay each connection through deflate, with and without dictionary.
+ */
+static void
+dict_evaluate(const void *dict, size_t len)
+{
+	struct message *sorted;
+	uint64 raw = 0, plain = 0, primed = 0;
+	z_stream zp, zd;
+	size_t i;
+	struct sha1 digest;
+	SHA1_context ctx;
+
+	SHA1_reset(&ctx);
+	SHA1_input(&ctx, dict, len);
+	SHA1_result(&ctx, &digest);
+
+	sorted = HCOPY_ARRAY(msgs, MAX(msgs_count, 1));
+	xqsort(sorted, msgs_count, sizeof sorted[0], message_cmp);
+
+	for (i = 0; i < msgs_count; i++) {
+		const struct message *m = &sorted[i];
+
+		if (0 == i || m->peer != sorted[i - 1].peer) {
+			if (i != 0) {
+				deflateEnd(&zp);
+				deflateEnd(&zd);
+			}
+			stream_init(&zp, NULL, 0);
+			stream_init(&zd, dict, len);
+		}
+
+		raw += m->len;
+		plain += deflate_message(&zp, m->data, m->len);
+		primed += deflate_message(&zd, m->data, m->len);
+	}
+
+	if (msgs_count != 0) {
+		deflateEnd(&zp);
+		deflateEnd(&zd);
+	}
+
+	hfree(sorted);
+
+	printf("dictionary %s, %zu byte%s\n", sha1_base32(&digest), PLURAL(len));
+	printf("%zu message%s", PLURAL(msgs_count));
+	printf(" over %u connection%s", PLURAL(peers_count));
+	printf(", %s bytes\n", uint64_to_string(raw));
+
+	if (0 == raw || 0 == plain)
+		return;
+
+	printf("without dictionary: %s bytes (%.2f%%)\n",
+		uint64_to_string(plain), 100.0 * plain / raw);
+	printf("with dictionary:    %s bytes (%.2f%%)\n",
+		uint64_to_string(primed), 100.0 * primed / raw);
+	printf("gain: %.2f%% of compressed output\n",
+		100.0 * ((double) plain - (double) primed) / plain);
+}
+
+static void *
+dict_load(const char *path, size_t *len)
+{
+	FILE *f;
+	filestat_t buf;
+	void *dict;
+
+	f = fopen(path, "rb");
+	if (NULL == f)
+		s_fatal_exit(EXIT_FAILURE, "cannot open \"%s\": %m", path);
+
+	if (-1 == fstat(fileno(f), &buf))
+		s_fatal_exit(EXIT_FAILURE, "cannot stat \"%s\": %m", path);
+
+	if (0 == buf.st_size || buf.st_size > DICT_MAXLEN) {
+		s_fatal_exit(EXIT_FAILURE, "\"%s\" must hold between 1 and %u bytes",
+			path, DICT_MAXLEN);
+	}
+
+	dict = halloc(buf.st_size);
+	if (1 != fread(dict, buf.st_size, 1, f))
+		s_fatal_exit(EXIT_FAILURE, "cannot read \"%s\": %m", path);
+
+	fclose(f);
+	*len = buf.st_size;
+
+	return dict;
+}
+
+static void
+dict_save(const char *path, const void *dict, size_t len)
+{
+	FILE *f;
+
+	f = fopen(path, "wb");
+	if (NULL == f)
+		s_fatal_exit(EXIT_FAILURE, "cannot create \"%s\": %m", path);
+
+	if (len != 0 && 1 != fwrite(dict, len, 1, f))
+		s_fatal_exit(EXIT_FAILURE, "cannot write \"%s\": %m", path);
+
+	if (0 != fclose(f))
+		s_fatal_exit(EXIT_FAILURE, "cannot flush \"%s\": %m", path);
+}
+
+int
+main(int argc, char **argv)
+{
+	int c;
+	const char *eval = NULL, *output = NULL;
+	void *dict;
+	size_t len;
+	/* getopt() variables: */
+	extern int optind;
+	extern char *optarg;
+
+	progstart(argc, argv);
+
+	while ((c = getopt(argc, argv, "e:hl:m:o:s:uv")) != EOF) {
+		switch (c) {
+		case 'e':			/* evaluate existing dictionary */
+			eval = optarg;
+			break;
+		case 'l':			/* compression level */
+			opt_l = get_number(optarg, c, Z_BEST_SPEED, Z_BEST_COMPRESSION);
+			break;
+		case 'm':			/* minimum string popularity */
+			opt_m = get_number(optarg, c, 2, MAX_INT_VAL(uint32));
+			break;
+		case 'o':			/* output file */
+			output = optarg;
+			break;
+		case 's':			/* dictionary size */
+			opt_s = get_number(optarg, c, GRAM_LEN, DICT_MAXLEN);
+			break;
+		case 'u':			/* include UDP traffic */
+			opt_u = TRUE;
+			break;
+		case 'v':			/* verbose */
+			opt_v = TRUE;
+			break;
+		case 'h':			/* show help */
+		default:
+			usage();
+			break;
+		}
+	}
+
+	if ((argc -= optind) < 1)
+		usage();
+
+	if ((NULL == eval) == (NULL == output))
+		usage();			/* Need exactly one of -e or -o */
+
+	argv += optind;
+
+	peers = hevset_create(offsetof(struct peer, key),
+		HASH_KEY_FIXED, DUMP_HDR_LEN);
+
+	while (argc-- > 0)
+		dump_load(*argv++);
+
+	if (eval != NULL) {
+		dict = dict_load(eval, &len);
+	} else {
+		dict = dict_train(opt_s, &len);
+		dict_save(output, dict, len);
+	}
+
+	dict_evaluate(dict, len);
+
+	return 0;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -526,6 +526,8 @@ browse_host_dl_receive(
 		struct rx_inflate_args args;
 
 		args.cb = &browse_rx_inflate_cb;
+		args.dict = NULL;
+		args.dict_len = 0;
 
 		bc->rx = rx_make_above(bc->rx, rx_inflate_get_ops(), &args);
 	}
@@ -34,6 +34,7 @@
 #include "common.h"
 
 #include "bogons.h"
+#include "ipclass.h"
 #include "settings.h"
 
 #include "lib/ascii.h"
@@ -119,6 +120,7 @@ bogons_load(FILE *f)
 	}
 
 	iprange_sync(bogons_db);
+	ipclass_set_source(IPCLASS_SRC_BOGONS, bogons_db);
 
 	if (GNET_PROPERTY(reload_debug)) {
 		g_debug("loaded %u bogus IP ranges (%u hosts)",
@@ -208,6 +210,7 @@ bogons_init(void)
 void
 bogons_close(void)
 {
+	ipclass_set_source(IPCLASS_SRC_BOGONS, NULL);
 	iprange_free(&bogons_db);
 }
 
@@ -232,7 +235,7 @@ bogons_check(const host_addr_t ha)
 	if (delta_time(tm_time(), bogons_mtime) > 15552000)	/* ~6 months */
 		return !host_addr_is_routable(ha);
 
-	return 0 != iprange_get_addr(bogons_db, ha);
+	return 0 != (ipclass_lookup(ha) & IPCLASS_BOGON);
 }
 
 /* vi: set ts=4 sw=4 cindent: */
@@ -43,6 +43,7 @@
 #include "if/gnet_property_priv.h"
 
 #include "lib/compat_sendfile.h"
+#include "lib/cq.h"
 #include "lib/entropy.h"
 #include "lib/halloc.h"
 #include "lib/hstrfn.h"
@@ -51,6 +52,8 @@
 #include "lib/plist.h"
 #include "lib/pslist.h"
 #include "lib/stringify.h"
+#include "lib/tbucket.h"
+#include "lib/tm.h"
 #include "lib/vmm.h"
 #include "lib/walloc.h"
 
@@ -114,6 +117,15 @@ enum bsched_magic {
  * of the period, any amount of bandwidth that has been unused will be
  * given as "stolen" bandwidth to some of the schedulers stealing from us.
  * Priority is given to schedulers that used up all their bandwidth.
+ *
+ * When the "bw_htb_scheduler" property is set, bandwidth is instead metered
+ * by a token bucket per scheduler, refilled continuously at the configured
+ * rate.  The buckets of all the reading (resp. writing) schedulers hang
+ * under a common root, through which unused tokens are lent to schedulers
+ * in need, according to per-class weights: this replaces stealing.  Sources
+ * get their share of the bucket through deficit round-robin, and are
+ * throttled individually when they must wait, instead of disabling all the
+ * sources until the next period.
  */
 
 struct bsched {
@@ -146,6 +158,9 @@ struct bsched {
 	int last_used;				/**< Nb of active sources last period */
 	int current_used;			/**< Nb of active sources this period */
 	uint io_favours;			/**< Amount of sources wanting favours */
+	tbucket_t *tb;				/**< Token bucket, for HTB scheduling */
+	cevent_t *htb_ev;			/**< Resumes throttled sources */
+	uint htb_round;				/**< Last round-robin round seen */
 	unsigned looped:1;			/**< True when looped once over sources */
 };
 
@@ -160,6 +175,7 @@ static pslist_t *bws_out_list = NULL;
 static pslist_t *bws_in_list = NULL;
 static int64 bws_out_ema = 0;
 static int64 bws_in_ema = 0;
+static tbucket_t *bws_htb_root[2];		/* Indexed by bsched_htb_dir() */
 
 #define BW_SLOT_MIN		256	 /**< Minimum bandwidth/slot for realloc */
 
@@ -188,6 +204,41 @@ bio_check(const bio_source_t * const bio)
 	g_assert(BIO_SOURCE_MAGIC == bio->magic);
 }
 
+/**
+ * @return index of the root token bucket for schedulers of given mode.
+ */
+static inline uint
+bsched_htb_dir(uint32 mode)
+{
+	return (mode & BS_F_WRITE) ? 1 : 0;
+}
+
+/**
+ * @return the root token bucket for schedulers of given mode.
+ */
+static tbucket_t *
+bsched_htb_root(uint32 mode)
+{
+	uint i = bsched_htb_dir(mode);
+
+	if (NULL == bws_htb_root[i])
+		bws_htb_root[i] = tbucket_make(NULL, 0, 1);
+
+	return bws_htb_root[i];
+}
+
+/**
+ * @return current time for token buckets, in nanoseconds.
+ */
+static inline uint64
+bsched_htb_now(void)
+{
+	tm_nano_t now;
+
+	tm_precise_time(&now);
+	return tmn2ns(&now);
+}
+
 /**
  * Create a new bandwidth scheduler.
  *
@@ -226,6 +277,7 @@ bsched_make(const char *name, property_t account, uint type, uint32 mode,
 	bs->period_ema = period;
 	bs->bw_per_second = bandwidth;
 	bs->bw_max = (int64) (bandwidth / 1000.0 * period);
+	bs->tb = tbucket_make(bsched_htb_root(mode), bandwidth, 1);
 
 	return bs;
 }
@@ -264,6 +316,8 @@ bsched_free(bsched_t *bs)
 
 	plist_free_null(&bs->sources);
 	pslist_free_null(&bs->stealers);
+	cq_cancel(&bs->htb_ev);
+	tbucket_free_null(&bs->tb);
 	HFREE_NULL(bs->name);
 	bs->magic = 0;
 	WFREE(bs);
@@ -466,6 +520,87 @@ bsched_config_steal_gnet(void)
 	bsched_dht_cross_stealing();
 }
 
+/**
+ * Set the token bucket flags of the scheduler, mirroring its stealing
+ * configuration: it lends its unused tokens when others can steal from it,
+ * and borrows when it can steal from others.
+ */
+static void
+bsched_htb_flags(bsched_t *bs)
+{
+	uint32 flags = 0;
+	bool stealer = FALSE;
+	pslist_t *iter;
+
+	if (NULL == bs->stealers || (bs->flags & BS_F_NO_STEALING))
+		flags |= TBUCKET_F_NO_LEND;
+
+	PSLIST_FOREACH(bws_list, iter) {
+		bsched_t *xbs = bsched_get(pointer_to_uint(iter->data));
+
+		if (xbs != bs && NULL != pslist_find(xbs->stealers, bs)) {
+			stealer = TRUE;
+			break;
+		}
+	}
+
+	if (!stealer || (bs->flags & BS_F_STOLEN_IGN))
+		flags |= TBUCKET_F_NO_BORROW;
+
+	tbucket_set_flags(bs->tb, flags);
+}
+
+/**
+ * @return the configured weight of the traffic class handled by scheduler.
+ */
+static uint
+bsched_htb_weight(bsched_bws_t bws)
+{
+	switch (bws) {
+	case BSCHED_BWS_GIN:
+	case BSCHED_BWS_GOUT:
+	case BSCHED_BWS_GLIN:
+	case BSCHED_BWS_GLOUT:
+		return GNET_PROPERTY(bw_htb_weight_gnet);
+	case BSCHED_BWS_GIN_UDP:
+	case BSCHED_BWS_GOUT_UDP:
+		return GNET_PROPERTY(bw_htb_weight_udp);
+	case BSCHED_BWS_DHT_IN:
+	case BSCHED_BWS_DHT_OUT:
+		return GNET_PROPERTY(bw_htb_weight_dht);
+	case BSCHED_BWS_IN:
+	case BSCHED_BWS_OUT:
+		return GNET_PROPERTY(bw_htb_weight_http);
+	case BSCHED_BWS_LOOPBACK_IN:
+	case BSCHED_BWS_LOOPBACK_OUT:
+	case BSCHED_BWS_PRIVATE_IN:
+	case BSCHED_BWS_PRIVATE_OUT:
+		return 1;
+	case NUM_BSCHED_BWS:
+		break;
+	}
+
+	g_assert_not_reached();
+}
+
+/**
+ * Configure the token bucket hierarchy: per-class weights and lending
+ * between schedulers.
+ */
+void G_COLD
+bsched_config_htb(void)
+{
+	pslist_t *iter;
+
+	PSLIST_FOREACH(bws_list, iter) {
+		bsched_bws_t bws = pointer_to_uint(iter->data);
+		bsched_t *bs = bsched_get(bws);
+
+		tbucket_set_weight(bs->tb, bsched_htb_weight(bws));
+		bsched_htb_flags(bs);
+	}
+}
+
 /**
  * Configure bandwidth stealing.
  */
@@ -476,6 +611,8 @@ bsched_config_stealing(void)
 		bsched_config_steal_http_gnet();
 	else
 		bsched_config_steal_gnet();
+
+	bsched_config_htb();
 }
 
 /**
@@ -605,11 +742,7 @@ bsched_init(void)
 	 * two traffic types.
 	 */
 
-	if (GNET_PROPERTY(bw_allow_stealing))
-		bsched_config_steal_http_gnet();
-	else
-		bsched_config_steal_gnet();
-
+	bsched_config_stealing();
 	bsched_set_peermode(GNET_PROPERTY(current_peermode));
 }
 
@@ -634,6 +767,10 @@ bsched_close(void)
 	for (i = 0; i < NUM_BSCHED_BWS; i++) {
 		bws_set[i] = NULL;
 	}
+
+	for (i = 0; i < N_ITEMS(bws_htb_root); i++) {
+		tbucket_free_null(&bws_htb_root[i]);
+	}
 }
 
 /**
@@ -1217,6 +1354,7 @@ bsched_bio_remove(bsched_bws_t bws, bio_source_t *bio)
 
 	bs->sources = plist_remove(bs->sources, bio);
 	bs->count--;
+	tbucket_flow_remove(bs->tb, &bio->flow);
 
 	if (bs->count)
 		bs->bw_slot = (bs->bw_max + bs->bw_stolen) / bs->count;
@@ -1316,6 +1454,7 @@ bsched_set_bandwidth(bsched_bws_t bws, int64 bandwidth)
 
 	bs->bw_per_second = bandwidth;
 	bs->bw_max = (int64) (bandwidth / 1000.0 * bs->period);
+	tbucket_set_rate(bs->tb, bandwidth);
 
 	/*
 	 * If `bandwidth' is 0, then we're disabling bandwidth scheduling and
@@ -1341,6 +1480,137 @@ bsched_set_bandwidth(bsched_bws_t bws, int64 bandwidth)
 }
 
 
+/**
+ * Resume sources that were throttled by the token bucket scheduler.
+ */
+static void
+bsched_htb_resume(cqueue_t *cq, void *obj)
+{
+	bsched_t *bs = obj;
+	pslist_t *trigger = NULL;
+	plist_t *iter;
+
+	bsched_check(bs);
+	cq_zero(cq, &bs->htb_ev);
+
+	bs->htb_round = tbucket_round(bs->tb);
+
+	PLIST_FOREACH(bs->sources, iter) {
+		bio_source_t *bio = iter->data;
+
+		bio_check(bio);
+
+		if (!(bio->flags & BIO_F_THROTTLED))
+			continue;
+
+		bio->flags &= ~BIO_F_THROTTLED;
+
+		if (NULL == bio->io_callback)
+			continue;
+
+		if (bio->flags & BIO_F_PASSIVE)
+			trigger = pslist_prepend(trigger, bio);
+		else if (0 == bio->io_tag)
+			bio_enable(bio);
+	}
+
+	while (trigger != NULL) {
+		bio_source_t *bio = trigger->data;
+
+		trigger = pslist_remove(trigger, bio);
+		bio_trigger(bio);
+	}
+}
+
+/**
+ * Schedule resuming of throttled sources after the specified delay.
+ *
+ * When resuming is already scheduled, the pending event is only moved
+ * if the new deadline is earlier: a later one is taken care of when the
+ * sources are throttled again after being resumed.
+ *
+ * @param bs	the scheduler
+ * @param ns	delay in nanoseconds
+ */
+static void
+bsched_htb_schedule(bsched_t *bs, uint64 ns)
+{
+	int delay = MAX(1, (ns + 999999) / 1000000);	/* Round up, in ms */
+
+	if (NULL == bs->htb_ev)
+		bs->htb_ev = cq_main_insert(delay, bsched_htb_resume, bs);
+	else if (UNSIGNED(delay) < cq_remaining(bs->htb_ev))
+		cq_resched(bs->htb_ev, delay);
+}
+
+/**
+ * Token bucket version of bw_available().
+ *
+ * Sources are granted bandwidth through deficit round-robin from the token
+ * bucket of the scheduler.  A source which must wait is throttled until
+ * the bucket has tokens again or a new round starts, without disturbing
+ * the other sources.
+ *
+ * @returns the bandwidth available for the source.
+ */
+static size_t
+bw_available_htb(bsched_t *bs, bio_source_t *bio, int len)
+{
+	uint64 now, result;
+
+	/*
+	 * Source is already disabled if there is a callback and no tag on a
+	 * non-passive source.
+	 */
+
+	if (bio->io_callback && !bio->io_tag && !(bio->flags & BIO_F_PASSIVE))
+		return 0;
+
+	if (0 != bio->bw_cap && bio->bw_actual >= (int64) bio->bw_cap) {
+		if (bio->io_tag)
+			bio_disable(bio);		/* Until next timeslice */
+		return 0;
+	}
+
+	/*
+	 * The penalty factor reduces the quantum of the source in each round,
+	 * the same way it reduces its slot in the period scheduler.
+	 */
+
+	now = bsched_htb_now();
+	bio->flow.shift = bio->bw_penalty_factor;
+	result = tbucket_flow_grant(bs->tb, &bio->flow, len, now);
+
+	if (0 != bio->bw_cap)
+		result = MIN(result, bio->bw_cap - UNSIGNED(bio->bw_actual));
+
+	if (0 == result) {
+		if (bio->io_tag)
+			bio_disable(bio);
+		bio->flags |= BIO_F_THROTTLED;
+		bsched_htb_schedule(bs, tbucket_next_event(bs->tb, now));
+	}
+
+	/*
+	 * Sources throttled because they had used their quantum can resume
+	 * as soon as a new round starts.
+	 */
+
+	if (tbucket_round(bs->tb) != bs->htb_round) {
+		bs->htb_round = tbucket_round(bs->tb);
+		bsched_htb_schedule(bs, 0);
+	}
+
+	if (GNET_PROPERTY(bsched_debug) > 5) {
+		g_debug("BSCHED %s: \"%s\" [fd #%d] len=%d, deficit=%s => "
+			"returning %s",
+			G_STRFUNC, bs->name, bio->wio->fd(bio->wio), len,
+			int64_to_string(bio->flow.deficit), uint64_to_string(result));
+	}
+
+	return result;		/* Fits, since result <= len */
+}
+
 /**
  * @param `bio' no brief description.
  * @param `len' is the amount of bytes requested by the application.
@@ -1369,6 +1639,9 @@ bw_available(bio_source_t *bio, int len)
 	if (bs->flags & BS_F_NOBW)				/* No more bandwidth */
 		return 0;							/* Grant nothing */
 
+	if (GNET_PROPERTY(bw_htb_scheduler))
+		return bw_available_htb(bs, bio, len);
+
 	/*
 	 * Source is already disabled if there is a callback and no tag on a
 	 * non-passive source.
@@ -1755,6 +2028,16 @@ bsched_bw_update(bsched_t *bs, ssize_t used, size_t requested)
 	if (!(bs->flags & BS_F_ENABLED))		/* Scheduler disabled */
 		return;								/* Nothing to update */
 
+	/*
+	 * With token buckets, sources are throttled individually when they
+	 * need to wait, there is no "no more bandwidth" condition.
+	 */
+
+	if (GNET_PROPERTY(bw_htb_scheduler)) {
+		tbucket_consume(bs->tb, used, bsched_htb_now());
+		return;
+	}
+
 	/*
 	 * For writing schedulers, sum-up the difference between the amount of
 	 * data that we originally wished to write and the amount that got
@@ -1782,6 +2065,13 @@ bio_bw_update(bio_source_t *bio, ssize_t used)
 
 	if G_UNLIKELY(0 != bio->bw_allocated)
 		bio->bw_allocated -= MIN(bio->bw_allocated, used);
+
+	if (GNET_PROPERTY(bw_htb_scheduler)) {
+		const bsched_t *bs = bsched_get(bio->bws);
+
+		if (bs->flags & BS_F_ENABLED)
+			tbucket_flow_charge(bs->tb, &bio->flow, used);
+	}
 }
 
 /**
@@ -2513,6 +2803,47 @@ bio_readv(bio_source_t *bio, iovec_t *iov, int iovcnt)
 	return r;
 }
 
+/**
+ * Grant bandwidth to a passive reading source whose reads are performed
+ * by another thread, which cannot call bio_read() since the scheduler is
+ * only accessed from the main thread.
+ *
+ * This is the first half of bio_read(): the amount actually read out of
+ * the grant must then be accounted for with bio_read_charge().
+ *
+ * @return the amount of bytes that can be read, at most `len'.
+ */
+size_t
+bio_read_grant(bio_source_t *bio, size_t len)
+{
+	bio_check(bio);
+	g_assert(bio->flags & BIO_F_READ);
+	g_assert(NULL == bio->io_callback);
+
+	len = MIN(len, MAX_INT_VAL(int));
+	return MIN(len, bw_available(bio, len));
+}
+
+/**
+ * Account for `used' bytes read by a passive source out of the `granted'
+ * amount returned by bio_read_grant().
+ */
+void
+bio_read_charge(bio_source_t *bio, size_t used, size_t granted)
+{
+	bio_check(bio);
+	g_assert(bio->flags & BIO_F_READ);
+	g_assert(used <= granted);
+
+	if (used != 0) {
+		bsched_t *bs = bsched_get(bio->bws);
+
+		bsched_bw_update(bs, used, granted);
+		bio_bw_update(bio, used);
+		bs->flags |= BS_F_DATA_READ;
+	}
+}
+
 /**
  * Write at most `len' bytes from `buf' to specified fd, and account the
  * bandwidth used.  Any overused bandwidth will be tracked, so that on
@@ -2600,6 +2931,8 @@ bws_allow_stealing(bsched_bws_t bws, bool allow)
 	else
 		bs->flags |= BS_F_NO_STEALING;
 
+	bsched_htb_flags(bs);
+
 	return !was_disabled;
 }
 
@@ -2622,6 +2955,8 @@ bws_ignore_stolen(bsched_bws_t bws, bool ignore)
 	else
 		bs->flags &= ~BS_F_STOLEN_IGN;
 
+	bsched_htb_flags(bs);
+
 	return was_ignoring;
 }
 
@@ -85,6 +85,8 @@ ssize_t bio_sendfile(sendfile_ctx_t *ctx, bio_source_t *bio, int in_fd,
 	fileoffset_t *offset, size_t len);
 ssize_t bio_read(bio_source_t *bio, void *data, size_t len);
 ssize_t bio_readv(bio_source_t *bio, iovec_t *iov, int iovcnt);
+size_t bio_read_grant(bio_source_t *bio, size_t len);
+void bio_read_charge(bio_source_t *bio, size_t used, size_t granted);
 ssize_t bws_write(bsched_bws_t bs, wrap_io_t *wio,
 			const void *data, size_t len);
 ssize_t bws_read(bsched_bws_t bs, wrap_io_t *wio, void *data, size_t len);
@@ -115,6 +117,7 @@ int64 bsched_urgent(bsched_bws_t bws);
 void bsched_set_urgent(bsched_bws_t bws, int64 amount);
 
 void bsched_config_stealing(void);
+void bsched_config_htb(void);
 
 bsched_bws_t bsched_out_select_by_addr(const host_addr_t);
 bsched_bws_t bsched_in_select_by_addr(const host_addr_t);
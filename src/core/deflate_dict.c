@@ -0,0 +1,260 @@
+/*
+ * Copyright (c) 2026, gtk-gnutella developers
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup core
+ * @file
+ *
+ * Preset dictionary for Gnutella link compression.
+ *
+ * Gnutella messages are small and highly repetitive: GGEP keys, vendor
+ * codes, URN prefixes, common file extensions.  A freshly initialized
+ * deflate stream has to learn all of these from the traffic itself, which
+ * means the first few KiB on each connection compress poorly.
+ *
+ * Priming both ends of the link with a preset dictionary removes most of
+ * that warm-up cost.  The dictionary is identified by the base32 SHA-1 of
+ * its content, which is advertised during the handshake: it is only used
+ * on a link when both sides claim the very same dictionary.
+ *
+ * A built-in dictionary is always available.  It can be superseded by a
+ * "deflate.dict" file, usually trained from captured traffic with the
+ * deflate-dict tool from src/bin.  Since zlib only looks at the last 32 KiB
+ * of the dictionary, and matches closer to the end are cheaper to encode,
+ * the most frequent strings must come last.
+ *
+ * @author gtk-gnutella developers
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "deflate_dict.h"
+#include "settings.h"
+
+#include "lib/file.h"
+#include "lib/halloc.h"
+#include "lib/misc.h"
+#include "lib/sha1.h"
+#include "lib/stringify.h"
+
+#include "if/gnet_property_priv.h"
+
+#include "lib/override.h"		/* Must be the last header included */
+
+static const char deflate_dict_file[] = "deflate.dict";
+static const char deflate_dict_what[] = "Deflate dictionary";
+
+/**
+ * Built-in dictionary, used when no "deflate.dict" file is found.
+ *
+ * Strings are roughly sorted by increasing frequency in the Gnutella
+ * traffic, so that the most common ones end up closest to the data.
+ */
+static const char deflate_dict_builtin[] =
+	".doc.pdf.txt.rar.zip.iso.exe.jpg.png.gif.avi.mkv.mpg.wmv.ogg.flac.mp4"
+	".mp3.wma.m4a.mov.epub"
+	"LIMEBEARRAZAGNUCMUTEPHEXSNOWSHAREGTKG"
+	"HNAMEDHTIPPGTKGV1GTKGVGTKGIPV6IPV6GUEUDPHCSCPVCEXLFPRUCTDUALTPUSH"
+	"http://urn:bitprint:urn:tree:tiger/:"
+	"urn:sha1:urn:sha1:";
+
+static char *deflate_dict_loaded;		/**< Dictionary read from file */
+static size_t deflate_dict_len;			/**< Length of active dictionary */
+static const char *deflate_dict_ptr;	/**< Active dictionary */
+static char deflate_dict_sid[SHA1_BASE32_SIZE + 1];	/**< Dictionary ID */
+
+/**
+ * Get the preset dictionary to use on compressed Gnutella links.
+ *
+ * This must only be called for links where the dictionary was negotiated
+ * during the handshake.  The "gnet_deflate_dictionary" property is not
+ * checked again here: it may have changed since, and both sides must keep
+ * using what they agreed upon.
+ *
+ * @param len		where the length of the dictionary is written
+ *
+ * @return the dictionary data, NULL if none was loaded.
+ */
+const void *
+deflate_dict_data(size_t *len)
+{
+	g_assert(len != NULL);
+
+	if (NULL == deflate_dict_ptr) {
+		*len = 0;
+		return NULL;
+	}
+
+	*len = deflate_dict_len;
+	return deflate_dict_ptr;
+}
+
+/**
+ * @return the ID of the preset dictionary we advertise, NULL if dictionaries
+ * are disabled.
+ */
+const char *
+deflate_dict_id(void)
+{
+	if (!GNET_PROPERTY(gnet_deflate_dictionary) || NULL == deflate_dict_ptr)
+		return NULL;
+
+	return deflate_dict_sid;
+}
+
+/**
+ * Check whether the dictionary advertised by the remote side is ours.
+ *
+ * @param id		the value of the remote "X-Deflate-Dictionary" header
+ *
+ * @return TRUE if both sides can use our preset dictionary.
+ */
+bool
+deflate_dict_matches(const char *id)
+{
+	const char *ours = deflate_dict_id();
+
+	if (NULL == id || NULL == ours)
+		return FALSE;
+
+	return 0 == strcmp(id, ours);
+}
+
+/**
+ * Load dictionary from supplied file.
+ *
+ * Only the trailing DEFLATE_DICT_MAXLEN bytes are kept, since this is all
+ * zlib can make use of.
+ *
+ * @return TRUE if we loaded a non-empty dictionary.
+ */
+static bool G_COLD
+deflate_dict_load(FILE *f)
+{
+	filestat_t buf;
+	size_t len, n;
+	char *data;
+
+	if (-1 == fstat(fileno(f), &buf)) {
+		g_warning("cannot stat %s: %m", deflate_dict_file);
+		return FALSE;
+	}
+
+	if (0 == buf.st_size)
+		return FALSE;
+
+	len = MIN(buf.st_size, DEFLATE_DICT_MAXLEN);
+
+	if (buf.st_size > DEFLATE_DICT_MAXLEN) {
+		g_warning("%s: only using the trailing %zu bytes out of %s",
+			deflate_dict_file, len, filesize_to_string(buf.st_size));
+
+		if (0 != fseek(f, buf.st_size - len, SEEK_SET)) {
+			g_warning("cannot seek in %s: %m", deflate_dict_file);
+			return FALSE;
+		}
+	}
+
+	data = halloc(len);
+	n = fread(data, 1, len, f);
+
+	if (n != len) {
+		g_warning("%s: short read (%zu out of %zu bytes)",
+			deflate_dict_file, n, len);
+		hfree(data);
+		return FALSE;
+	}
+
+	deflate_dict_loaded = data;
+	deflate_dict_ptr = data;
+	deflate_dict_len = len;
+
+	return TRUE;
+}
+
+/**
+ * Locate and load the "deflate.dict" file, if any.
+ */
+static void G_COLD
+deflate_dict_retrieve(void)
+{
+	FILE *f;
+	int idx;
+	file_path_t fp[4];
+	unsigned length;
+
+	length = settings_file_path_load(fp, deflate_dict_file, SFP_DFLT);
+
+	g_assert(length <= N_ITEMS(fp));
+
+	f = file_config_open_read_norename_chosen(deflate_dict_what,
+			fp, length, &idx);
+
+	if (NULL == f)
+		return;
+
+	deflate_dict_load(f);
+	fclose(f);
+}
+
+/**
+ * Initialize the preset dictionary.
+ */
+void G_COLD
+deflate_dict_init(void)
+{
+	struct sha1 digest;
+	SHA1_context ctx;
+
+	deflate_dict_retrieve();
+
+	if (NULL == deflate_dict_ptr) {
+		deflate_dict_ptr = deflate_dict_builtin;
+		deflate_dict_len = CONST_STRLEN(deflate_dict_builtin);
+	}
+
+	SHA1_reset(&ctx);
+	SHA1_input(&ctx, deflate_dict_ptr, deflate_dict_len);
+	SHA1_result(&ctx, &digest);
+	sha1_to_base32_buf(&digest, ARYLEN(deflate_dict_sid));
+
+	if (GNET_PROPERTY(reload_debug)) {
+		g_debug("using %s%zu-byte deflate dictionary %s",
+			NULL == deflate_dict_loaded ? "built-in " : "",
+			deflate_dict_len, deflate_dict_sid);
+	}
+}
+
+/**
+ * Discard the preset dictionary.
+ */
+void G_COLD
+deflate_dict_close(void)
+{
+	deflate_dict_ptr = NULL;
+	deflate_dict_len = 0;
+	HFREE_NULL(deflate_dict_loaded);
+}
+
+/* vi: set ts=4 sw=4 cindent: */
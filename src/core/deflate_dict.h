@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2026, gtk-gnutella developers
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup core
+ * @file
+ *
+ * Preset dictionary for Gnutella link compression.
+ *
+ * @author gtk-gnutella developers
+ * @date 2026
+ */
+
+#ifndef _core_deflate_dict_h_
+#define _core_deflate_dict_h_
+
+#include "common.h"
+
+#define DEFLATE_DICT_MAXLEN		32768	/**< Largest usable deflate window */
+
+const void *deflate_dict_data(size_t *len);
+const char *deflate_dict_id(void);
+bool deflate_dict_matches(const char *id);
+
+void deflate_dict_init(void);
+void deflate_dict_close(void);
+
+#endif /* _core_deflate_dict_h_ */
+
+/* vi: set ts=4 sw=4 cindent: */
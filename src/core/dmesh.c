@@ -71,6 +71,7 @@
 #include "lib/hikset.h"
 #include "lib/hstrfn.h"
 #include "lib/htable.h"
+#include "lib/memtag.h"
 #include "lib/parse.h"
 #include "lib/pslist.h"
 #include "lib/shuffle.h"
@@ -163,6 +164,8 @@ static htable_t *ban_mesh_by_sha1 = NULL;
 
 static const char dmesh_ban_file[] = "dmesh_ban";
 
+static memtag_t dmesh_tag;			/**< Memory accounting domain */
+
 static void dmesh_retrieve(void);
 static void dmesh_ban_retrieve(void);
 static char *dmesh_urlinfo_to_string(const dmesh_urlinfo_t *info);
@@ -204,8 +207,10 @@ urlinfo_eq(const void *a, const void *b)
 void G_COLD
 dmesh_init(void)
 {
+	dmesh_tag = memtag_register("dmesh");
 	mesh = hikset_create(offsetof(struct dmesh, sha1),
 		HASH_KEY_FIXED, SHA1_RAW_SIZE);
+	hikset_group_probing(mesh);		/* Entries come and go */
 	ban_mesh = hikset_create_any(offsetof(struct dmesh_banned, info),
 		urlinfo_hash, urlinfo_eq);
 	ban_mesh_by_sha1 = htable_create(HASH_KEY_FIXED, SHA1_RAW_SIZE);
@@ -230,7 +235,7 @@ dmesh_entry_free(struct dmesh_entry *dme)
 			atom_str_free(dme->e.url.name);
 	}
 	hash_list_free_all(&dme->bad, wfree_host_addr1);
-	WFREE(dme);
+	WFREE_TAG(dmesh_tag, dme);
 }
 
 /**
@@ -268,7 +273,7 @@ dmesh_urlinfo_free(dmesh_urlinfo_t *info)
 	g_assert(info);
 
 	atom_str_free(info->name);
-	WFREE(info);
+	WFREE_TAG(dmesh_tag, info);
 }
 
 /**
@@ -308,7 +313,7 @@ dmesh_ban_remove_entry(struct dmesh_banned *dmb)
 
 	hikset_remove(ban_mesh, dmb->info);
 	dmesh_urlinfo_free(dmb->info);
-	WFREE(dmb);
+	WFREE_TAG(dmesh_tag, dmb);
 }
 
 /**
@@ -357,13 +362,13 @@ dmesh_ban_add(const struct sha1 *sha1,
 	if (dmb == NULL) {
 		dmesh_urlinfo_t *ui;
 
-		WALLOC(ui);
+		WALLOC_TAG(dmesh_tag, ui);
 		ui->addr = info->addr;
 		ui->port = info->port;
 		ui->idx = info->idx;
 		ui->name = atom_str_get(info->name);
 
-		WALLOC(dmb);
+		WALLOC_TAG(dmesh_tag, dmb);
 		dmb->info = ui;
 		dmb->created = stamp;
 		dmb->cq_ev = cq_insert(dmesh_cq, lifetime*1000, dmesh_ban_expire, dmb);
@@ -585,7 +590,7 @@ dm_alloc(const struct sha1 *sha1)
 {
 	struct dmesh *dm;
 
-	WALLOC(dm);
+	WALLOC_TAG(dmesh_tag, dm);
 	dm->last_update = 0;
 	dm->entries = list_new();
 	dm->sha1 = atom_sha1_get(sha1);
@@ -617,7 +622,7 @@ dm_free(struct dmesh *dm)
 	htable_free_null(&dm->by_guid);
 
 	atom_sha1_free_null(&dm->sha1);
-	WFREE(dm);
+	WFREE_TAG(dmesh_tag, dm);
 }
 
 /**
@@ -1029,7 +1034,7 @@ dmesh_raw_add(const struct sha1 *sha1, const dmesh_urlinfo_t *info,
 		 * Allocate new entry.
 		 */
 
-		WALLOC(dme);
+		WALLOC_TAG(dmesh_tag, dme);
 
 		dme->inserted = now;
 		dme->stamp = stamp;
@@ -1165,7 +1170,7 @@ dmesh_raw_fw_add(const struct sha1 *sha1, const dmesh_fwinfo_t *info,
 		 * Allocate new entry.
 		 */
 
-		WALLOC(dme);
+		WALLOC_TAG(dmesh_tag, dme);
 
 		dme->inserted = now;
 		dme->stamp = stamp;
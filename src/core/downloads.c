@@ -13017,6 +13017,8 @@ http_version_nofix:
 		struct rx_inflate_args args;
 
 		args.cb = &download_rx_inflate_cb;
+		args.dict = NULL;
+		args.dict_len = 0;
 		d->rx = rx_make_above(d->rx, rx_inflate_get_ops(), &args);
 		d->flags |= DL_F_NO_PIPELINE;	/* Disabled for this request */
 	}
@@ -15723,7 +15725,7 @@ download_verify_sha1_error(struct download *d)
 }
 
 static bool
-download_verify_sha1_callback(const struct verify *ctx,
+download_verify_sha1_callback(const struct verify_job *job,
 	enum verify_status status, void *user_data)
 {
 	struct download *d = user_data;
@@ -15737,12 +15739,12 @@ download_verify_sha1_callback(const struct verify *ctx,
 		download_verify_sha1_start(d);
 		return TRUE;
 	case VERIFY_PROGRESS:
-		download_verify_sha1_progress(d, verify_hashed(ctx));
+		download_verify_sha1_progress(d, verify_hashed(job));
 		return TRUE;
 	case VERIFY_DONE:
 		gnet_prop_set_boolean_val(PROP_SHA1_VERIFYING, FALSE);
 		download_verify_sha1_done(d,
-			verify_sha1_digest(ctx), verify_elapsed(ctx));
+			verify_sha1_digest(job), verify_elapsed(job));
 		return TRUE;
 	case VERIFY_ERROR:
 		gnet_prop_set_boolean_val(PROP_SHA1_VERIFYING, FALSE);
@@ -16013,7 +16015,7 @@ download_verify_tigertree_error(struct download *d)
 }
 
 static bool
-download_verify_tigertree_callback(const struct verify *ctx,
+download_verify_tigertree_callback(const struct verify_job *job,
 	enum verify_status status, void *user_data)
 {
 	struct download *d = user_data;
@@ -16025,13 +16027,13 @@ download_verify_tigertree_callback(const struct verify *ctx,
 		download_verify_tigertree_start(d);
 		return TRUE;
 	case VERIFY_PROGRESS:
-		download_verify_tigertree_progress(d, verify_hashed(ctx));
+		download_verify_tigertree_progress(d, verify_hashed(job));
 		return TRUE;
 	case VERIFY_DONE:
 		gnet_prop_set_boolean_val(PROP_TTH_VERIFYING, FALSE);
 		download_verify_tigertree_done(d,
-			verify_tth_digest(ctx), verify_elapsed(ctx),
-			verify_tth_leaves(ctx), verify_tth_leave_count(ctx));
+			verify_tth_digest(job), verify_elapsed(job),
+			verify_tth_leaves(job), verify_tth_leave_count(job));
 		return TRUE;
 	case VERIFY_ERROR:
 		gnet_prop_set_boolean_val(PROP_TTH_VERIFYING, FALSE);
@@ -66,6 +66,7 @@
 #include "lib/hikset.h"
 #include "lib/hset.h"
 #include "lib/htable.h"
+#include "lib/memtag.h"
 #include "lib/nid.h"
 #include "lib/pslist.h"
 #include "lib/stringify.h"
@@ -219,6 +220,8 @@ static htable_t *by_muid;
  */
 static hikset_t *by_leaf_muid;
 
+static memtag_t dq_tag;			/**< Memory accounting domain */
+
 /**
  * Information about query messages sent.
  *
@@ -411,7 +414,7 @@ dq_pmi_alloc(dquery_t *dq, uint16 degree, uint8 ttl,
 	dquery_check(dq);
 	g_assert(ttl != 0);
 
-	WALLOC(pmi);
+	WALLOC_TAG(dq_tag, pmi);
 	pmi->qid = dq->qid;
 	pmi->degree = degree;
 	pmi->ttl = ttl;
@@ -442,7 +445,7 @@ static void
 dq_pmi_free(struct dq_pmsg_info *pmi)
 {
 	nid_unref(pmi->node_id);
-	WFREE(pmi);
+	WFREE_TAG(dq_tag, pmi);
 }
 
 /**
@@ -1036,7 +1039,7 @@ dq_free(dquery_t *dq)
 
 	nid_unref(dq->node_id);
 	dq->magic = 0;
-	WFREE(dq);
+	WFREE_TAG(dq_tag, dq);
 }
 
 /**
@@ -1914,7 +1917,7 @@ dq_launch_net(
 
 	memcpy(&orig_muid, gnutella_header_get_muid(&n->header), GUID_RAW_SIZE);
 
-	WALLOC0(dq);
+	WALLOC0_TAG(dq_tag, dq);
 	dq->magic = DQUERY_MAGIC;
 
 	flags = sri->flags;
@@ -2194,7 +2197,7 @@ oob_proxy_conflict:
 	 */
 
 	dq->magic = 0;
-	WFREE(dq);
+	WFREE_TAG(dq_tag, dq);
 }
 
 /**
@@ -2227,7 +2230,7 @@ dq_launch_local(gnet_search_t handle, pmsg_t *mb, query_hashvec_t *qhv)
 	 * OK, create the local dynamic query.
 	 */
 
-	WALLOC0(dq);
+	WALLOC0_TAG(dq_tag, dq);
 	dq->magic = DQUERY_MAGIC;
 
 	dq->node_id = nid_ref(NODE_ID_SELF);
@@ -2698,12 +2701,15 @@ dq_get_results_wanted(const struct guid *muid, uint32 *wanted)
 void G_COLD
 dq_init(void)
 {
+	dq_tag = memtag_register("dq");
 	dqueries = hevset_create_any(
 		offsetof(struct dquery, qid), nid_hash, nid_hash2, nid_equal);
+	hevset_group_probing(dqueries);
 	by_node_id = htable_create_any(nid_hash, nid_hash2, nid_equal);
 	by_muid = htable_create(HASH_KEY_FIXED, GUID_RAW_SIZE);
 	by_leaf_muid = hikset_create(
 		offsetof(struct dquery, lmuid), HASH_KEY_FIXED, GUID_RAW_SIZE);
+	hikset_group_probing(by_leaf_muid);
 	fill_hosts();
 }
 
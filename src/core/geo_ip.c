@@ -34,6 +34,7 @@
 #include "common.h"
 
 #include "geo_ip.h"
+#include "ipclass.h"
 #include "settings.h"
 
 #include "lib/ascii.h"
@@ -460,6 +461,7 @@ gip_load(FILE *f, unsigned idx, const char *filename, bool initial)
 	}
 
 	iprange_sync(geo_db);
+	ipclass_set_source(IPCLASS_SRC_GEO, geo_db);
 
 	if (GNET_PROPERTY(reload_debug) || initial) {
 		if (GIP_IPV4 == idx) {
@@ -559,6 +561,7 @@ gip_init(void)
 void
 gip_close(void)
 {
+	ipclass_set_source(IPCLASS_SRC_GEO, NULL);
 	iprange_free(&geo_db);
 }
 
@@ -577,7 +580,7 @@ gip_country(const host_addr_t ha)
 	if G_UNLIKELY(NULL == geo_db)
 		return ISO3166_INVALID;
 
-	code = iprange_get_addr(geo_db, ha);
+	code = ipclass_geo(ipclass_lookup(ha));
 
 	return 0 == code ? ISO3166_INVALID : (code >> 1) - 1;
 }
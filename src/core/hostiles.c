@@ -39,6 +39,7 @@
 #include "common.h"
 
 #include "hostiles.h"
+#include "ipclass.h"
 #include "settings.h"
 #include "nodes.h"
 #include "gnet_stats.h"
@@ -86,6 +87,11 @@ static const char * const hostiles_what[NUM_HOSTILES] = {
 
 static struct iprange_db *hostile_db[NUM_HOSTILES];	/**< The hostile database */
 
+static const enum ipclass_source hostiles_ipclass[NUM_HOSTILES] = {
+	IPCLASS_SRC_HOSTILES_GLOBAL,
+	IPCLASS_SRC_HOSTILES_PRIVATE,
+};
+
 /**
  * Hostile addresses dynamically collected at runtime for duration of a
  * session. If the hashtable reaches a certain size, we could create
@@ -272,6 +278,7 @@ hostiles_close_one(hostiles_t which)
 	uint i = which;
 
 	g_assert(i < NUM_HOSTILES);
+	ipclass_set_source(hostiles_ipclass[i], NULL);
 	iprange_free(&hostile_db[i]);
 }
 
@@ -334,6 +341,7 @@ hostiles_load(FILE *f, hostiles_t which)
 	}
 
 	iprange_sync(hostile_db[which]);
+	ipclass_set_source(hostiles_ipclass[which], hostile_db[which]);
 
 	if (GNET_PROPERTY(reload_debug)) {
 		g_debug("loaded %u addresses/netmasks from %s (%u hosts)",
@@ -672,15 +680,14 @@ hostiles_dynamic_add_ipv6(const uint8 *ipv6, hostiles_flags_t flags)
 static hostiles_flags_t
 hostiles_static_check_ipv4(uint32 ipv4)
 {
-	int i;
+	ipclass_t c = ipclass_lookup_ipv4(ipv4);
 
-	for (i = 0; i < NUM_HOSTILES; i++) {
-		if (i == HOSTILE_GLOBAL && !GNET_PROPERTY(use_global_hostiles_txt))
-			continue;
+	if (c & IPCLASS_HOSTILE_PRIVATE)
+		return HSTL_STATIC;
+
+	if ((c & IPCLASS_HOSTILE_GLOBAL) && GNET_PROPERTY(use_global_hostiles_txt))
+		return HSTL_STATIC;
 
-		if (NULL != hostile_db[i] && 0 != iprange_get(hostile_db[i], ipv4))
-			return HSTL_STATIC;
-	}
 	return HSTL_CLEAN;
 }
 
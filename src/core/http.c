@@ -2733,6 +2733,8 @@ http_got_header(http_async_t *ha, header_t *header)
 		struct rx_inflate_args args;
 
 		args.cb = &http_async_rx_inflate_cb;
+		args.dict = NULL;
+		args.dict_len = 0;
 		ha->rx = rx_make_above(ha->rx, rx_inflate_get_ops(), &args);
 
 		if (GNET_PROPERTY(http_debug) > 1)
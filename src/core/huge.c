@@ -48,25 +48,36 @@
 #include "settings.h"
 #include "share.h"
 #include "spam.h"
-#include "verify_sha1.h"
+#include "tth_cache.h"
+#include "verify_huge.h"
 #include "verify_tth.h"
 #include "version.h"
 
 #include "lib/atoms.h"
 #include "lib/base32.h"
+#include "lib/bit_array.h"
+#include "lib/compat_pio.h"
 #include "lib/cq.h"
+#include "lib/endian.h"
+#include "lib/fd.h"
 #include "lib/file.h"
 #include "lib/gnet_host.h"
 #include "lib/halloc.h"
 #include "lib/hashing.h"
 #include "lib/header.h"
 #include "lib/hikset.h"
+#include "lib/hstrfn.h"
+#include "lib/htable.h"
+#include "lib/mutex.h"
 #include "lib/parse.h"
 #include "lib/pattern.h"
+#include "lib/pow2.h"
 #include "lib/sha1.h"
+#include "lib/str.h"
 #include "lib/stringify.h"
 #include "lib/tm.h"
 #include "lib/urn.h"
+#include "lib/vmm.h"
 #include "lib/walloc.h"
 
 #include "if/gnet_property.h"
@@ -76,15 +87,40 @@
 
 #define HUGE_SHA1_CACHE_FREQ	60	/* seconds, for SHA1 cache dumps */
 
+#define SHA1_STORE_FILE		"sha1_store"	/**< Binary SHA1 cache */
+#define SHA1_JOURNAL_FILE	"sha1_cache"	/**< Text journal, legacy cache */
+
+#define SHA1_STORE_MAGIC	0x53484131U		/**< "SHA1": store header */
+#define SHA1_STORE_VERSION	1
+
+#define SHA1_STORE_HDR_SIZE	32		/**< magic, version, counts, strings size */
+#define SHA1_STORE_REC_SIZE	80		/**< Fixed-size file record */
+#define SHA1_STORE_SLOT_SIZE 4		/**< Hash index slot: record number + 1 */
+#define SHA1_STORE_SLOT_MIN	16		/**< Minimum amount of hash index slots */
+
+/*
+ * Offsets within a store record, all integers being stored big-endian.
+ */
+
+#define SHA1_REC_HASH		0		/**< Hash of full path (uint32) */
+#define SHA1_REC_FLAGS		4		/**< Record flags (uint32) */
+#define SHA1_REC_DIR		8		/**< Offset of directory string (uint32) */
+#define SHA1_REC_NAME		12		/**< Offset of base name string (uint32) */
+#define SHA1_REC_SIZE		16		/**< File size (uint64) */
+#define SHA1_REC_MTIME		24		/**< File modification time (uint64) */
+#define SHA1_REC_SHA1		32		/**< SHA1 (binary) */
+#define SHA1_REC_TTH		52		/**< TTH (binary), if SHA1_F_TTH */
+
+#define SHA1_F_TTH			(1U << 0)	/**< Record holds a TTH */
+
 /**
  * There's an in-core cache (the hash table ``sha1_cache''), and a
- * persistent copy (normally in ~/.gtk-gnutella/sha1_cache). The
- * in-core cache is filled with the persistent one at launch. When the
+ * persistent copy (normally in ~/.gtk-gnutella/sha1_store). When the
  * "shared_file" (the records describing the shared files, see
  * share.h) are created, a call is made to sha1_set_digest to fill the
  * SHA1 digest part of the shared_file. If the digest isn't found in
- * the in-core cache, it's computed, stored in the in-core cache and
- * appended at the end of the persistent cache. If the digest is found
+ * the caches, it's computed, stored in the in-core cache and
+ * appended at the end of the persistent journal. If the digest is found
  * in the cache, a check is made based on the file size and last
  * modification time. If they're identical to the ones in the cache,
  * the digest is considered to be accurate, and is used. If the file
@@ -93,6 +129,20 @@
  * persistent one. Instead, the cache is marked as dirty, and will be
  * entirely overwritten by dump_cache, called when everything has been
  * computed.
+ *
+ * The persistent copy is a binary file that is mapped in memory and
+ * never parsed: it holds fixed-size records, a hash index on the full
+ * path of the files and a string table where directory names are only
+ * stored once, whatever the amount of files they hold.  Lookups probe the
+ * mapped index directly, so that startup does not depend on the size of
+ * the library.  The in-core cache only holds the entries created or
+ * updated since the store was last written, and shadows the store.
+ *
+ * New entries are appended to a text journal (~/.gtk-gnutella/sha1_cache),
+ * which is replayed into the in-core cache at startup and removed each time
+ * the store is rewritten.  Since the journal uses the format of the text
+ * cache of older versions, a legacy cache is simply imported as a large
+ * journal the first time we start.
  */
 
 struct sha1_cache_entry {
@@ -107,6 +157,44 @@ struct sha1_cache_entry {
 
 static hikset_t *sha1_cache;
 
+/*
+ * The cache is looked up by the share thread whilst the library is scanned
+ * and updated by the main thread as hashes get computed.  Since dumping the
+ * cache reloads the persistent store and drops the in-core entries, both
+ * must only be accessed with this lock held.
+ */
+static mutex_t sha1_cache_mtx = MUTEX_INIT;
+
+#define SHA1_CACHE_LOCK		mutex_lock(&sha1_cache_mtx)
+#define SHA1_CACHE_UNLOCK	mutex_unlock(&sha1_cache_mtx)
+
+/**
+ * The mapped persistent store.
+ */
+static struct sha1_store {
+	const char *base;			/**< Start of store data */
+	size_t len;					/**< Length of store data */
+	const char *records;		/**< Start of fixed-size records */
+	const char *index;			/**< Start of hash index */
+	const char *strings;		/**< Start of string table */
+	uint32 count;				/**< Amount of records */
+	uint32 slots;				/**< Amount of hash index slots (power of 2) */
+	uint32 strings_len;			/**< Size of string table */
+	bit_array_t *shared;		/**< Records known to be in the library */
+	bit_array_t *dead;			/**< Records superseded or pruned */
+	bool mapped;				/**< Whether ``base'' is a memory mapping */
+} sha1_store;
+
+/**
+ * Lookup result, from the in-core cache or from the persistent store.
+ */
+struct sha1_cache_hit {
+	struct sha1_cache_entry *item;	/**< In-core entry, NULL if from store */
+	uint32 idx;						/**< Store record, when ``item'' is NULL */
+	filesize_t size;				/**< File size */
+	time_t mtime;					/**< Last modification time */
+};
+
 /**
  * cache_dirty = TRUE means that in-core cache is different from the disk one.
  */
@@ -116,9 +204,289 @@ static time_t cache_dumped;
 static cpattern_t *has_http_urls;
 
 /**
- ** Handling of persistent buffer
+ ** Handling of persistent store
  **/
 
+/**
+ * @return the base of the store record ``i''.
+ */
+static inline const char *
+sha1_store_record(uint32 i)
+{
+	g_assert(i < sha1_store.count);
+
+	return &sha1_store.records[(size_t) i * SHA1_STORE_REC_SIZE];
+}
+
+/**
+ * @return string held at offset ``o'' in the string table, NULL if invalid.
+ */
+static inline const char *
+sha1_store_string(uint32 o)
+{
+	return o < sha1_store.strings_len ? &sha1_store.strings[o] : NULL;
+}
+
+/**
+ * Check whether store record has the given full path.
+ *
+ * Paths are stored as a directory, shared by all the files it holds, and a
+ * base name.  An empty directory means the base name is the full path.
+ */
+static bool
+sha1_store_path_eq(const char *rec, const char *path)
+{
+	const char *dir, *name;
+	size_t dlen;
+
+	dir = sha1_store_string(peek_be32(&rec[SHA1_REC_DIR]));
+	name = sha1_store_string(peek_be32(&rec[SHA1_REC_NAME]));
+
+	if G_UNLIKELY(NULL == dir || NULL == name)
+		return FALSE;
+
+	dlen = strlen(dir);
+
+	if (0 == dlen)
+		return 0 == strcmp(name, path);
+
+	return 0 == memcmp(dir, path, dlen) && '/' == path[dlen] &&
+		0 == strcmp(name, &path[dlen + 1]);
+}
+
+/**
+ * Lookup path in the persistent store, probing its hash index.
+ *
+ * @return TRUE if found, with the record number in ``idx''.
+ */
+static bool
+sha1_store_find(const char *path, uint32 *idx)
+{
+	uint32 h, mask, s, n;
+
+	if (0 == sha1_store.count)
+		return FALSE;
+
+	h = string_mix_hash(path);
+	mask = sha1_store.slots - 1;
+
+	for (s = h & mask, n = 0; n < sha1_store.slots; s = (s + 1) & mask, n++) {
+		uint32 v = peek_be32(&sha1_store.index[s * SHA1_STORE_SLOT_SIZE]);
+		const char *rec;
+
+		if (0 == v)
+			break;			/* Empty slot, path not in the store */
+
+		if G_UNLIKELY(v > sha1_store.count)
+			break;			/* Corrupted index */
+
+		rec = sha1_store_record(v - 1);
+
+		if (
+			peek_be32(&rec[SHA1_REC_HASH]) == h &&
+			!bit_array_get(sha1_store.dead, v - 1) &&
+			sha1_store_path_eq(rec, path)
+		) {
+			*idx = v - 1;
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/**
+ * Forget about the persistent store.
+ */
+static void
+sha1_store_unload(void)
+{
+	if (sha1_store.base != NULL) {
+#ifdef HAS_MMAP
+		if (sha1_store.mapped)
+			vmm_munmap(deconstify_pointer(sha1_store.base), sha1_store.len);
+		else
+#endif	/* HAS_MMAP */
+			hfree(deconstify_pointer(sha1_store.base));
+	}
+	HFREE_NULL(sha1_store.shared);
+	HFREE_NULL(sha1_store.dead);
+	ZERO(&sha1_store);
+}
+
+/**
+ * Load the persistent store, mapping it in memory when possible.
+ *
+ * Nothing is parsed: we only check that the header is consistent with the
+ * size of the file, so that we can later access it safely.
+ */
+static void G_COLD
+sha1_store_load(void)
+{
+	char *path;
+	filestat_t sb;
+	const char *p = NULL;
+	bool mapped = FALSE;
+	uint32 count, slots, slen;
+	uint64 expected;
+	int fd;
+
+	g_assert(NULL == sha1_store.base);
+
+	path = make_pathname(settings_config_dir(), SHA1_STORE_FILE);
+	fd = file_open_missing(path, O_RDONLY);
+
+	if (-1 == fd)
+		goto done;
+
+	if (-1 == fstat(fd, &sb)) {
+		g_warning("%s(): cannot stat \"%s\": %m", G_STRFUNC, path);
+		goto done;
+	}
+
+	if (sb.st_size < SHA1_STORE_HDR_SIZE || sb.st_size > MAX_INT_VAL(uint32)) {
+		g_warning("%s(): ignoring \"%s\": bad size (%s bytes)",
+			G_STRFUNC, path, filesize_to_string(sb.st_size));
+		goto done;
+	}
+
+#ifdef HAS_MMAP
+	p = vmm_mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (MAP_FAILED == p) {
+		g_warning("%s(): cannot map \"%s\", will read it: %m",
+			G_STRFUNC, path);
+		p = NULL;
+	} else {
+		mapped = TRUE;
+	}
+#endif	/* HAS_MMAP */
+
+	if (NULL == p) {
+		char *buf = halloc(sb.st_size);
+
+		if (sb.st_size != compat_pread(fd, buf, sb.st_size, 0)) {
+			g_warning("%s(): cannot read \"%s\": %m", G_STRFUNC, path);
+			hfree(buf);
+			goto done;
+		}
+		p = buf;
+	}
+
+	sha1_store.base = p;
+	sha1_store.len = sb.st_size;
+	sha1_store.mapped = mapped;
+
+	count = peek_be32(&p[8]);
+	slots = peek_be32(&p[12]);
+	slen  = peek_be32(&p[16]);
+
+	expected = SHA1_STORE_HDR_SIZE +
+		(uint64) count * SHA1_STORE_REC_SIZE +
+		(uint64) slots * SHA1_STORE_SLOT_SIZE + slen;
+
+	if (
+		SHA1_STORE_MAGIC != peek_be32(&p[0]) ||
+		SHA1_STORE_VERSION != peek_be32(&p[4]) ||
+		!is_pow2(slots) || slots < count ||
+		0 == slen || expected != UNSIGNED(sb.st_size) ||
+		'\0' != p[sb.st_size - 1]
+	) {
+		g_warning("%s(): ignoring corrupted \"%s\"", G_STRFUNC, path);
+		sha1_store_unload();
+		goto done;
+	}
+
+	sha1_store.count = count;
+	sha1_store.slots = slots;
+	sha1_store.strings_len = slen;
+	sha1_store.records = &p[SHA1_STORE_HDR_SIZE];
+	sha1_store.index = &sha1_store.records[(size_t) count * SHA1_STORE_REC_SIZE];
+	sha1_store.strings = &sha1_store.index[(size_t) slots * SHA1_STORE_SLOT_SIZE];
+
+	bit_array_resize(&sha1_store.shared, 0, MAX(1, count));
+	bit_array_resize(&sha1_store.dead, 0, MAX(1, count));
+
+	if (GNET_PROPERTY(share_debug)) {
+		g_debug("%s(): %s SHA1 store with %u entr%s (%s)",
+			G_STRFUNC, mapped ? "mapped" : "loaded", count, plural_y(count),
+			compact_size(sb.st_size, GNET_PROPERTY(display_metric_units)));
+	}
+
+	/* FALL THROUGH */
+
+done:
+	fd_forget_and_close(&fd);
+	HFREE_NULL(path);
+}
+
+/**
+ * Fill cache hit from store record.
+ */
+static void
+sha1_store_hit(struct sha1_cache_hit *h, uint32 idx)
+{
+	const char *rec = sha1_store_record(idx);
+
+	h->item = NULL;
+	h->idx = idx;
+	h->size = peek_be64(&rec[SHA1_REC_SIZE]);
+	h->mtime = peek_be64(&rec[SHA1_REC_MTIME]);
+}
+
+/**
+ * @return SHA1 of store record.
+ */
+static inline const struct sha1 *
+sha1_store_sha1(uint32 idx)
+{
+	return (const struct sha1 *) &sha1_store_record(idx)[SHA1_REC_SHA1];
+}
+
+/**
+ * @return TTH of store record, NULL if none is known.
+ */
+static inline const struct tth *
+sha1_store_tth(uint32 idx)
+{
+	const char *rec = sha1_store_record(idx);
+
+	return (peek_be32(&rec[SHA1_REC_FLAGS]) & SHA1_F_TTH) ?
+		(const struct tth *) &rec[SHA1_REC_TTH] : NULL;
+}
+
+/**
+ * Lookup path in the in-core cache, then in the persistent store.
+ *
+ * @return TRUE if found, with information filled in ``h''.
+ */
+static bool
+sha1_cache_lookup(const char *path, struct sha1_cache_hit *h)
+{
+	struct sha1_cache_entry *item;
+	uint32 idx;
+
+	assert_mutex_is_owned(&sha1_cache_mtx);
+
+	if G_UNLIKELY(NULL == sha1_cache)
+		return FALSE;		/* Shutdown occurred */
+
+	item = hikset_lookup(sha1_cache, path);
+
+	if (item != NULL) {
+		h->item = item;
+		h->size = item->size;
+		h->mtime = item->mtime;
+		return TRUE;
+	}
+
+	if (sha1_store_find(path, &idx)) {
+		sha1_store_hit(h, idx);
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
 /* In-memory cache */
 
 /**
@@ -142,12 +510,28 @@ static void update_volatile_cache(
 
 /**
  * Add a new entry to the in-memory cache.
+ *
+ * The entry supersedes any entry the persistent store has for that file.
  */
 static void
 add_volatile_cache_entry(const char *filename, filesize_t size, time_t mtime,
 	const struct sha1 *sha1, const struct tth *tth, bool known_to_be_shared)
 {
 	struct sha1_cache_entry *item;
+	uint32 idx;
+
+	assert_mutex_is_owned(&sha1_cache_mtx);
+
+	item = hikset_lookup(sha1_cache, filename);
+
+	if G_UNLIKELY(item != NULL) {
+		update_volatile_cache(item, size, mtime, sha1, tth);
+		item->shared = known_to_be_shared;
+		return;
+	}
+
+	if (sha1_store_find(filename, &idx))
+		bit_array_set(sha1_store.dead, idx);
 
 	WALLOC(item);
 	item->file_name = atom_str_get(filename);
@@ -159,6 +543,32 @@ add_volatile_cache_entry(const char *filename, filesize_t size, time_t mtime,
 	hikset_insert_key(sha1_cache, &item->file_name);
 }
 
+/**
+ * Free SHA1 cache entry.
+ */
+static void
+cache_free_entry(void *v, void *unused_udata)
+{
+	struct sha1_cache_entry *e = v;
+
+	(void) unused_udata;
+
+	atom_str_free_null(&e->file_name);
+	atom_sha1_free_null(&e->sha1);
+	atom_tth_free_null(&e->tth);
+	WFREE(e);
+}
+
+/**
+ * Free SHA1 cache entry, removing it from the cache.
+ */
+static bool
+cache_free_entry_remove(void *v, void *unused_udata)
+{
+	cache_free_entry(v, unused_udata);
+	return TRUE;
+}
+
 /* Disk cache */
 
 static const char sha1_persistent_cache_file_header[] =
@@ -190,7 +600,7 @@ cache_entry_print(FILE *f, const char *filename,
 }
 
 /**
- * Add an entry to the persistent cache.
+ * Add an entry to the persistent journal.
  */
 static void
 add_persistent_cache_entry(const char *filename, filesize_t size,
@@ -199,7 +609,7 @@ add_persistent_cache_entry(const char *filename, filesize_t size,
 	char *pathname;
 	FILE *f;
 
-	pathname = make_pathname(settings_config_dir(), "sha1_cache");
+	pathname = make_pathname(settings_config_dir(), SHA1_JOURNAL_FILE);
 	f = file_fopen(pathname, "a");
 	if (f) {
 		filestat_t sb;
@@ -223,64 +633,335 @@ add_persistent_cache_entry(const char *filename, filesize_t size,
 	HFREE_NULL(pathname);
 }
 
-struct dump_cache_context {
-	FILE *f;
-	bool forced;
+/**
+ * Remove the journal and its ".orig" copy, once their entries are safely
+ * held in the persistent store.
+ */
+static void
+sha1_journal_remove(void)
+{
+	char *pathname, *orig;
+
+	pathname = make_pathname(settings_config_dir(), SHA1_JOURNAL_FILE);
+	orig = h_strconcat(pathname, ".orig", NULL_PTR);
+
+	if (-1 == unlink(pathname) && ENOENT != errno)
+		g_warning("%s(): cannot unlink \"%s\": %m", G_STRFUNC, pathname);
+	if (-1 == unlink(orig) && ENOENT != errno)
+		g_warning("%s(): cannot unlink \"%s\": %m", G_STRFUNC, orig);
+
+	HFREE_NULL(orig);
+	HFREE_NULL(pathname);
+}
+
+/**
+ * Context used to build a new persistent store.
+ */
+struct sha1_store_writer {
+	char *records;				/**< Fixed-size records */
+	uint32 *hashes;				/**< Path hash of each record */
+	bit_array_t *shared;		/**< Shared status of each record */
+	str_t *strings;				/**< String table */
+	htable_t *dirs;				/**< Directory -> offset + 1 in table */
+	uint32 count;				/**< Amount of records written */
+	uint32 max;					/**< Amount of records allocated */
+	bool forced;				/**< Whether to keep unshared entries */
+	bool overflow;				/**< String table grew past 4 GiB */
 };
 
 /**
- * Dump one (in-memory) cache into the persistent cache. This is a callback
- * called by dump_cache to dump the whole in-memory cache onto disk.
+ * Intern string in the string table of the store being written.
+ *
+ * @return offset of the string in the table.
+ */
+static uint32
+sha1_store_writer_string(struct sha1_store_writer *w, const char *s, size_t len)
+{
+	size_t o = str_len(w->strings);
+
+	if G_UNLIKELY(o + len + 1 > MAX_INT_VAL(uint32)) {
+		w->overflow = TRUE;
+		return 0;
+	}
+
+	str_cat_len(w->strings, s, len);
+	str_putc(w->strings, '\0');
+
+	return o;
+}
+
+/**
+ * Intern directory name, only storing it once in the string table.
+ *
+ * @return offset of the directory in the table.
+ */
+static uint32
+sha1_store_writer_dir(struct sha1_store_writer *w, const char *dir, size_t len)
+{
+	char *key = h_strndup(dir, len);
+	void *v = htable_lookup(w->dirs, key);
+	uint32 o;
+
+	if (v != NULL) {
+		hfree(key);
+		return pointer_to_uint(v) - 1;
+	}
+
+	o = sha1_store_writer_string(w, dir, len);
+	htable_insert(w->dirs, key, uint_to_pointer(o + 1));
+
+	return o;
+}
+
+/**
+ * Add an entry to the store being written.
+ */
+static void
+sha1_store_writer_add(struct sha1_store_writer *w,
+	const char *path, uint32 hash, filesize_t size, time_t mtime,
+	const struct sha1 *sha1, const struct tth *tth, bool shared)
+{
+	const char *name = strrchr(path, '/');
+	char *rec;
+	uint32 dir;
+
+	g_assert(w->count < w->max);
+
+	if (NULL == name || name == path) {
+		dir = sha1_store_writer_string(w, "", 0);
+		name = path;
+	} else {
+		dir = sha1_store_writer_dir(w, path, name - path);
+		name++;
+	}
+
+	rec = &w->records[(size_t) w->count * SHA1_STORE_REC_SIZE];
+	memset(rec, 0, SHA1_STORE_REC_SIZE);
+
+	poke_be32(&rec[SHA1_REC_HASH], hash);
+	poke_be32(&rec[SHA1_REC_FLAGS], NULL == tth ? 0 : SHA1_F_TTH);
+	poke_be32(&rec[SHA1_REC_DIR], dir);
+	poke_be32(&rec[SHA1_REC_NAME],
+		sha1_store_writer_string(w, name, strlen(name)));
+	poke_be64(&rec[SHA1_REC_SIZE], size);
+	poke_be64(&rec[SHA1_REC_MTIME], mtime);
+	memcpy(&rec[SHA1_REC_SHA1], sha1, SHA1_RAW_SIZE);
+	if (tth != NULL)
+		memcpy(&rec[SHA1_REC_TTH], tth, TTH_RAW_SIZE);
+
+	w->hashes[w->count] = hash;
+	if (shared)
+		bit_array_set(w->shared, w->count);
+	w->count++;
+}
+
+/**
+ * Write one in-memory cache entry into the store being written.
  */
 static void
 dump_cache_one_entry(void *value, void *udata)
 {
 	struct sha1_cache_entry *e = value;
-	struct dump_cache_context *ctx = udata;
+	struct sha1_store_writer *w = udata;
+
+	if (w->forced || e->shared) {
+		sha1_store_writer_add(w, e->file_name, string_mix_hash(e->file_name),
+			e->size, e->mtime, e->sha1, e->tth, e->shared);
+	}
+}
+
+/**
+ * Write live records of the current store into the store being written.
+ */
+static void
+dump_cache_store_entries(struct sha1_store_writer *w)
+{
+	uint32 i;
+	str_t *path = str_new(256);
+
+	for (i = 0; i < sha1_store.count; i++) {
+		const char *rec, *dir, *name;
+		bool shared;
+
+		if (bit_array_get(sha1_store.dead, i))
+			continue;
+
+		shared = bit_array_get(sha1_store.shared, i);
+
+		if (!w->forced && !shared)
+			continue;
 
-	if (ctx->forced || e->shared) {
-		cache_entry_print(ctx->f,
-			e->file_name, e->sha1, e->tth, e->size, e->mtime);
+		rec = sha1_store_record(i);
+		dir = sha1_store_string(peek_be32(&rec[SHA1_REC_DIR]));
+		name = sha1_store_string(peek_be32(&rec[SHA1_REC_NAME]));
+
+		if G_UNLIKELY(NULL == dir || NULL == name)
+			continue;
+
+		str_reset(path);
+		if ('\0' != *dir) {
+			str_cat(path, dir);
+			str_putc(path, '/');
+		}
+		str_cat(path, name);
+
+		sha1_store_writer_add(w, str_2c(path), peek_be32(&rec[SHA1_REC_HASH]),
+			peek_be64(&rec[SHA1_REC_SIZE]), peek_be64(&rec[SHA1_REC_MTIME]),
+			sha1_store_sha1(i), sha1_store_tth(i), shared);
+	}
+
+	str_destroy(path);
+}
+
+static void
+dump_cache_free_dir(const void *key, void *unused_value, void *unused_data)
+{
+	(void) unused_value;
+	(void) unused_data;
+
+	hfree(deconstify_pointer(key));
+}
+
+/**
+ * Write the store held in the writer context to the opened file.
+ *
+ * @return TRUE on success.
+ */
+static bool
+dump_cache_write(FILE *f, const struct sha1_store_writer *w)
+{
+	char hdr[SHA1_STORE_HDR_SIZE];
+	char *index;
+	uint32 i, slots, mask;
+	size_t index_len;
+	bool ok;
+
+	slots = next_pow2(MAX(SHA1_STORE_SLOT_MIN, 2 * w->count));
+	mask = slots - 1;
+	index_len = (size_t) slots * SHA1_STORE_SLOT_SIZE;
+	index = halloc0(index_len);
+
+	for (i = 0; i < w->count; i++) {
+		uint32 s = w->hashes[i] & mask;
+
+		while (0 != peek_be32(&index[s * SHA1_STORE_SLOT_SIZE]))
+			s = (s + 1) & mask;
+
+		poke_be32(&index[s * SHA1_STORE_SLOT_SIZE], i + 1);
 	}
+
+	ZERO(&hdr);
+	poke_be32(&hdr[0], SHA1_STORE_MAGIC);
+	poke_be32(&hdr[4], SHA1_STORE_VERSION);
+	poke_be32(&hdr[8], w->count);
+	poke_be32(&hdr[12], slots);
+	poke_be32(&hdr[16], str_len(w->strings));
+
+	ok = 1 == fwrite(ARYLEN(hdr), 1, f) &&
+		(0 == w->count ||
+		 1 == fwrite(w->records, (size_t) w->count * SHA1_STORE_REC_SIZE, 1, f))
+		&& 1 == fwrite(index, index_len, 1, f) &&
+		1 == fwrite(str_2c(w->strings), str_len(w->strings), 1, f);
+
+	hfree(index);
+	return ok;
 }
 
 /**
- * Dump the whole in-memory cache onto disk.
+ * Dump the whole cache onto disk, rewriting the persistent store.
+ *
+ * Once written, the new store replaces the current one and all the
+ * in-memory entries are dropped, along with the journal.
  */
 static void
 dump_cache(bool force)
 {
 	FILE *f;
 	file_path_t fp;
+	struct sha1_store_writer w;
+	size_t max;
+
+	SHA1_CACHE_LOCK;
 
 	if (!force && !cache_dirty)
-		return;
+		goto unlock;
+
+	max = hikset_count(sha1_cache) + sha1_store.count;
 
-	file_path_set(&fp, settings_config_dir(), "sha1_cache");
+	if G_UNLIKELY(max >= MAX_INT_VAL(uint32) / 2) {
+		g_warning("%s(): too many SHA1 cache entries (%zu)", G_STRFUNC, max);
+		goto done;
+	}
+
+	file_path_set(&fp, settings_config_dir(), SHA1_STORE_FILE);
 	f = file_config_open_write("SHA-1 cache", &fp);
-	if (f) {
-		struct dump_cache_context ctx;
-
-		fputs(sha1_persistent_cache_file_header, f);
-		ctx.f = f;
-		ctx.forced = force;
-		hikset_foreach(sha1_cache, dump_cache_one_entry, &ctx);
-		if (file_config_close(f, &fp)) {
-			cache_dirty = FALSE;
+	if (NULL == f)
+		goto done;
+
+	ZERO(&w);
+	w.max = max;
+	w.forced = force;
+	w.records = halloc(MAX(1, max) * SHA1_STORE_REC_SIZE);
+	HALLOC_ARRAY(w.hashes, MAX(1, max));
+	bit_array_resize(&w.shared, 0, MAX(1, max));
+	w.strings = str_new(4096);
+	w.dirs = htable_create(HASH_KEY_STRING, 0);
+
+	hikset_foreach(sha1_cache, dump_cache_one_entry, &w);
+	dump_cache_store_entries(&w);
+
+	if G_UNLIKELY(w.overflow)
+		g_warning("%s(): SHA-1 cache string table too large", G_STRFUNC);
+
+	if (w.overflow || !dump_cache_write(f, &w)) {
+		fclose(f);			/* Leave the current store untouched */
+	} else if (file_config_close(f, &fp)) {
+		sha1_store_unload();
+		hikset_foreach_remove(sha1_cache, cache_free_entry_remove, NULL);
+		sha1_journal_remove();
+		sha1_store_load();
+
+		/*
+		 * Carry over the shared status of the entries we wrote, records
+		 * being laid out in the order we added them.
+		 */
+
+		if (sha1_store.count == w.count) {
+			uint32 i;
+
+			for (i = 0; i < w.count; i++) {
+				if (bit_array_get(w.shared, i))
+					bit_array_set(sha1_store.shared, i);
+			}
 		}
+
+		cache_dirty = FALSE;
 	}
 
+	htable_foreach(w.dirs, dump_cache_free_dir, NULL);
+	htable_free_null(&w.dirs);
+	str_destroy_null(&w.strings);
+	HFREE_NULL(w.shared);
+	HFREE_NULL(w.hashes);
+	HFREE_NULL(w.records);
+
+	/* FALL THROUGH */
+
+done:
 	/*
 	 * Update the timestamp even on failure to avoid that we retry this
 	 * too frequently.
 	 */
 	cache_dumped = tm_time();
+
+unlock:
+	SHA1_CACHE_UNLOCK;
 }
 
 /**
- * This function is used to read the disk cache into memory.
+ * This function is used to replay the journal into memory.
  *
- * It must be passed one line from the cache (ending with '\n'). It
+ * It must be passed one line from the journal (ending with '\n'). It
  * performs all the syntactic processing to extract the fields from
  * the line and calls add_volatile_cache_entry() to append the record
  * to the in-memory cache.
@@ -385,7 +1066,11 @@ failure:
 }
 
 /**
- * Read the whole persistent cache into memory.
+ * Map the persistent store and replay the journal into memory.
+ *
+ * When there is a journal, which is the case when upgrading from a
+ * version that used the text cache, the store is rewritten to hold its
+ * entries and the journal is removed.
  */
 static void G_COLD
 sha1_read_cache(void)
@@ -396,8 +1081,10 @@ sha1_read_cache(void)
 
 	g_return_if_fail(settings_config_dir());
 
-	file_path_set(fp, settings_config_dir(), "sha1_cache");
-	f = file_config_open_read("SHA-1 cache", fp, N_ITEMS(fp));
+	sha1_store_load();
+
+	file_path_set(fp, settings_config_dir(), SHA1_JOURNAL_FILE);
+	f = file_config_open_read("SHA-1 journal", fp, N_ITEMS(fp));
 	if (f) {
 		for (;;) {
 			char buffer[4096];
@@ -458,7 +1145,9 @@ cache_dump_schedule(void)
 {
 	time_delta_t t;
 
+	SHA1_CACHE_LOCK;
 	cache_dirty = TRUE;
+	SHA1_CACHE_UNLOCK;
 
 	if G_UNLIKELY(0 == cache_dumped) {
 		t = 0;
@@ -480,16 +1169,19 @@ cache_dump_schedule(void)
  ** Asynchronous computation of hash value
  **/
 
-bool
-huge_update_hashes(shared_file_t *sf,
-	const struct sha1 *sha1, const struct tth *tth)
+/**
+ * Make sure freshly computed hashes still apply to the shared file, i.e.
+ * that it was not modified during the computation and is not spam.
+ *
+ * When the file changed, a new computation is requested.  Spam is removed
+ * from the library.
+ *
+ * @return TRUE if the hashes can be recorded.
+ */
+static bool
+huge_hashes_valid(shared_file_t *sf, const struct sha1 *sha1)
 {
-	struct sha1_cache_entry *cached;
 	filestat_t sb;
-	const sha1_t *osha1;
-
-	shared_file_check(sf);
-	g_return_val_if_fail(sha1, FALSE);
 
 	/*
 	 * Make sure the file's timestamp is still accurate.
@@ -499,7 +1191,7 @@ huge_update_hashes(shared_file_t *sf,
 		g_warning("discarding SHA1 for file \"%s\": can't stat(): %m",
 			shared_file_path(sf));
 		shared_file_remove(sf);
-		return TRUE;
+		return FALSE;
 	}
 
 	if (sb.st_mtime != shared_file_modification_time(sf)) {
@@ -507,7 +1199,7 @@ huge_update_hashes(shared_file_t *sf,
 			shared_file_path(sf));
 		shared_file_set_modification_time(sf, sb.st_mtime);
 		request_sha1(sf);					/* Retry! */
-		return TRUE;
+		return FALSE;
 	}
 
 	if (huge_spam_check(sf, sha1)) {
@@ -515,6 +1207,20 @@ huge_update_hashes(shared_file_t *sf,
 		return FALSE;
 	}
 
+	return TRUE;
+}
+
+/**
+ * Record the hashes of the shared file and update the SHA1 cache.
+ */
+static void
+huge_record_hashes(shared_file_t *sf,
+	const struct sha1 *sha1, const struct tth *tth)
+{
+	struct sha1_cache_hit cached;
+	const sha1_t *osha1;
+	bool updated;
+
 	/*
 	 * Testing for the SHA1 already being present avoids problems when
 	 * we are coming here simply to update the TTH of a completed file.
@@ -532,13 +1238,16 @@ huge_update_hashes(shared_file_t *sf,
 
 	/* Update cache */
 
-	cached = hikset_lookup(sha1_cache, shared_file_path(sf));
+	SHA1_CACHE_LOCK;
 
-	if (cached) {
-		update_volatile_cache(cached, shared_file_size(sf),
-			shared_file_modification_time(sf), sha1, tth);
+	if (!sha1_cache_lookup(shared_file_path(sf), &cached))
+		cached.item = NULL;
 
-		cache_dump_schedule(); 	/* Dump cache once per minute */
+	updated = cached.item != NULL;
+
+	if (updated) {
+		update_volatile_cache(cached.item, shared_file_size(sf),
+			shared_file_modification_time(sf), sha1, tth);
 	} else {
 		add_volatile_cache_entry(shared_file_path(sf),
 			shared_file_size(sf), shared_file_modification_time(sf),
@@ -547,6 +1256,30 @@ huge_update_hashes(shared_file_t *sf,
 			shared_file_size(sf), shared_file_modification_time(sf),
 			sha1, tth);
 	}
+
+	SHA1_CACHE_UNLOCK;
+
+	if (updated)
+		cache_dump_schedule(); 	/* Dump cache once per minute */
+}
+
+/**
+ * Record the freshly computed hashes of a shared file, provided the file
+ * did not change during the computation.
+ *
+ * @return TRUE if the hashes were recorded.
+ */
+bool
+huge_update_hashes(shared_file_t *sf,
+	const struct sha1 *sha1, const struct tth *tth)
+{
+	shared_file_check(sf);
+	g_return_val_if_fail(sha1, FALSE);
+
+	if (!huge_hashes_valid(sf, sha1))
+		return FALSE;
+
+	huge_record_hashes(sf, sha1, tth);
 	return TRUE;
 }
 
@@ -562,7 +1295,8 @@ huge_update_hashes(shared_file_t *sf,
 static bool
 huge_need_sha1(shared_file_t *sf)
 {
-	struct sha1_cache_entry *cached;
+	struct sha1_cache_hit cached;
+	bool found;
 
 	shared_file_check(sf);
 
@@ -577,9 +1311,11 @@ huge_need_sha1(shared_file_t *sf)
 	if G_UNLIKELY(NULL == sha1_cache)
 		return FALSE;		/* Shutdown occurred (processing TEQ event?) */
 
-	cached = hikset_lookup(sha1_cache, shared_file_path(sf));
+	SHA1_CACHE_LOCK;
+	found = sha1_cache_lookup(shared_file_path(sf), &cached);
+	SHA1_CACHE_UNLOCK;
 
-	if (cached != NULL) {
+	if (found) {
 		filestat_t sb;
 
 		if (-1 == stat(shared_file_path(sf), &sb)) {
@@ -588,8 +1324,8 @@ huge_need_sha1(shared_file_t *sf)
 			return FALSE;
 		}
 		if (
-			cached->size + (fileoffset_t) 0 == sb.st_size + (filesize_t) 0 &&
-			cached->mtime == sb.st_mtime
+			cached.size + (fileoffset_t) 0 == sb.st_size + (filesize_t) 0 &&
+			cached.mtime == sb.st_mtime
 		) {
 			if (GNET_PROPERTY(share_debug) > 1) {
 				g_warning("ignoring duplicate SHA1 work for \"%s\"",
@@ -613,7 +1349,7 @@ huge_need_sha1(shared_file_t *sf)
  */
 
 static bool
-huge_verify_callback(const struct verify *ctx, enum verify_status status,
+huge_verify_callback(const struct verify_job *job, enum verify_status status,
 	void *user_data)
 {
 	shared_file_t *sf = user_data;
@@ -624,13 +1360,37 @@ huge_verify_callback(const struct verify *ctx, enum verify_status status,
 	case VERIFY_START:
 		if (!huge_need_sha1(sf))
 			return FALSE;
+		/* Leave PROP_TTH_REBUILDING to the TTH context, which runs in parallel */
 		gnet_prop_set_boolean_val(PROP_SHA1_REBUILDING, TRUE);
 		return TRUE;
 	case VERIFY_PROGRESS:
 		return shared_file_indexed(sf);
 	case VERIFY_DONE:
-		huge_update_hashes(sf, verify_sha1_digest(ctx), NULL);
-		request_tigertree(sf, TRUE);
+		{
+			const struct tth *tth = verify_huge_tth(job);
+			size_t n_leaves = verify_huge_leave_count(job);
+
+			if (GNET_PROPERTY(verify_debug)) {
+				g_debug("%s(): computed SHA1 %s and TTH %s (%zu lea%s) for %s",
+					G_STRFUNC, sha1_base32(verify_huge_sha1(job)),
+					tth_base32(tth), n_leaves, plural_f(n_leaves),
+					shared_file_path(sf));
+			}
+
+			/*
+			 * Do not persist leaves for a file that changed whilst it was
+			 * hashed or that turns out to be spam.
+			 *
+			 * As in request_tigertree_callback(), persist the TTH leaves
+			 * before recording the hashes, so that the fileinfo layer can
+			 * probe the cache for the THEX depth.
+			 */
+
+			if (huge_hashes_valid(sf, verify_huge_sha1(job))) {
+				tth_cache_insert(tth, verify_huge_leaves(job), n_leaves);
+				huge_record_hashes(sf, verify_huge_sha1(job), tth);
+			}
+		}
 		/* FALL THROUGH */
 	case VERIFY_ERROR:
 	case VERIFY_SHUTDOWN:
@@ -647,17 +1407,17 @@ huge_verify_callback(const struct verify *ctx, enum verify_status status,
 /**
  * Put the shared file on the stack of the things to do.
  *
- * We first begin with the computation of the SHA1, and when completed we
- * will continue with the TTH computation.
+ * The SHA1 and the TTH are computed in a single pass over the file, so
+ * that a new file is only read once from disk.
  */
 static void
 queue_shared_file_for_sha1_computation(shared_file_t *sf)
 {
-	int inserted;
+	bool inserted;
 
  	shared_file_check(sf);
 
-	inserted = verify_sha1_enqueue(FALSE, shared_file_path(sf),
+	inserted = verify_huge_enqueue(FALSE, shared_file_path(sf),
 					shared_file_size(sf), huge_verify_callback,
 					shared_file_ref(sf));
 
@@ -666,12 +1426,12 @@ queue_shared_file_for_sha1_computation(shared_file_t *sf)
 }
 
 /**
- * Check to see if an (in-memory) entry cache is up to date.
+ * Check to see if a cache entry is up to date.
  *
  * @return true (in the C sense) if it is, or false otherwise.
  */
 static bool
-cached_entry_up_to_date(const struct sha1_cache_entry *cache_entry,
+cached_entry_up_to_date(const struct sha1_cache_hit *cache_entry,
 	const shared_file_t *sf)
 {
 	return cache_entry->size == shared_file_size(sf)
@@ -684,10 +1444,14 @@ cached_entry_up_to_date(const struct sha1_cache_entry *cache_entry,
 bool
 sha1_is_cached(const shared_file_t *sf)
 {
-	const struct sha1_cache_entry *cached;
+	struct sha1_cache_hit cached;
+	bool found;
 
-	cached = hikset_lookup(sha1_cache, shared_file_path(sf));
-	return cached && cached_entry_up_to_date(cached, sf);
+	SHA1_CACHE_LOCK;
+	found = sha1_cache_lookup(shared_file_path(sf), &cached);
+	SHA1_CACHE_UNLOCK;
+
+	return found && cached_entry_up_to_date(&cached, sf);
 }
 
 /**
@@ -705,12 +1469,14 @@ sha1_is_cached(const shared_file_t *sf)
 bool
 huge_cached_is_uptodate(const char *path, filesize_t size, time_t mtime)
 {
-	const struct sha1_cache_entry *cached = hikset_lookup(sha1_cache, path);
+	struct sha1_cache_hit cached;
+	bool found;
 
-	if (NULL == cached)
-		return FALSE;
+	SHA1_CACHE_LOCK;
+	found = sha1_cache_lookup(path, &cached);
+	SHA1_CACHE_UNLOCK;
 
-	return cached->size == size && cached->mtime == mtime;
+	return found && cached.size == size && cached.mtime == mtime;
 }
 
 /**
@@ -719,39 +1485,72 @@ huge_cached_is_uptodate(const char *path, filesize_t size, time_t mtime)
 void
 request_sha1(shared_file_t *sf)
 {
-	struct sha1_cache_entry *cached;
+	struct sha1_cache_hit cached;
+	struct sha1 sha1;
+	struct tth tth_buf;
+	const struct tth *tth = NULL;
+	bool found, uptodate;
 
 	shared_file_check(sf);
 
 	if (!shared_file_indexed(sf))
 		return;		/* "stale" shared file, has been superseded or removed */
 
-	cached = hikset_lookup(sha1_cache, shared_file_path(sf));
+	/*
+	 * Copy the hashes whilst holding the lock: the entry or the store
+	 * record can vanish as soon as we release it, should the cache be
+	 * dumped concurrently.
+	 */
+
+	SHA1_CACHE_LOCK;
+
+	found = sha1_cache_lookup(shared_file_path(sf), &cached);
+	uptodate = found && cached_entry_up_to_date(&cached, sf);
+
+	if (uptodate) {
+		const struct tth *ctth;
 
-	if (cached && cached_entry_up_to_date(cached, sf)) {
 		cache_dirty = TRUE;
-		cached->shared = TRUE;
-		shared_file_set_sha1(sf, cached->sha1);
-		shared_file_set_tth(sf, cached->tth);
 
-		if (NULL == cached->tth || !shared_file_tth_is_available(sf)) {
+		if (cached.item != NULL) {
+			cached.item->shared = TRUE;
+			sha1 = *cached.item->sha1;
+			ctth = cached.item->tth;
+		} else {
+			bit_array_set(sha1_store.shared, cached.idx);
+			sha1 = *sha1_store_sha1(cached.idx);
+			ctth = sha1_store_tth(cached.idx);
+		}
+		if (ctth != NULL) {
+			tth_buf = *ctth;
+			tth = &tth_buf;
+		}
+	}
+
+	SHA1_CACHE_UNLOCK;
+
+	if (uptodate) {
+		shared_file_set_sha1(sf, &sha1);
+		shared_file_set_tth(sf, tth);
+
+		if (NULL == tth || !shared_file_tth_is_available(sf)) {
 			if (GNET_PROPERTY(share_debug) > 1) {
-				if (NULL == cached->tth)
+				if (NULL == tth)
 					g_debug("no known TTH entry for \"%s\"", shared_file_path(sf));
 				else
 					g_debug("no TTH %s entry cached for \"%s\"",
-						tth_base32(cached->tth), shared_file_path(sf));
+						tth_base32(tth), shared_file_path(sf));
 			}
 
-			request_tigertree(sf, NULL == cached->tth);
+			request_tigertree(sf, NULL == tth);
 		}
 	} else {
 		if (GNET_PROPERTY(share_debug) > 1) {
-			if (cached)
+			if (found)
 				g_debug("cached SHA1 entry for \"%s\" outdated: "
 					"had mtime %lu, now %lu",
 					shared_file_path(sf),
-					(ulong) cached->mtime,
+					(ulong) cached.mtime,
 					(ulong) shared_file_modification_time(sf));
 			else
 				g_debug("queuing \"%s\" for SHA1 computation",
@@ -1031,6 +1830,40 @@ cache_entry_is_shared(void *v, void *unused_udata)
 	return FALSE;
 }
 
+/**
+ * Mark as dead the records of the persistent store holding a SHA1 that is
+ * not currently being shared.
+ *
+ * @return amount of records pruned.
+ */
+static size_t
+sha1_store_prune(void)
+{
+	size_t pruned = 0;
+	uint32 i;
+
+	for (i = 0; i < sha1_store.count; i++) {
+		shared_file_t *sf;
+
+		if (bit_array_get(sha1_store.dead, i))
+			continue;
+
+		sf = shared_file_by_sha1(sha1_store_sha1(i));
+
+		if G_UNLIKELY(SHARE_REBUILDING == sf)
+			break;		/* Cannot decide */
+
+		if (NULL == sf) {
+			bit_array_set(sha1_store.dead, i);
+			pruned++;
+		} else {
+			shared_file_unref(&sf);
+		}
+	}
+
+	return pruned;
+}
+
 /**
  * Purge the SHA1 cache.
  *
@@ -1053,7 +1886,10 @@ huge_sha1_cache_prune(void)
 {
 	size_t pruned;
 
+	SHA1_CACHE_LOCK;
 	pruned = hikset_foreach_remove(sha1_cache, cache_entry_is_shared, NULL);
+	pruned += sha1_store_prune();
+	SHA1_CACHE_UNLOCK;
 
 	if (GNET_PROPERTY(share_debug)) {
 		g_info("%s(): pruned %zu entr%s from SHA1 cache",
@@ -1070,28 +1906,14 @@ huge_sha1_cache_prune(void)
 void
 huge_init(void)
 {
+	SHA1_CACHE_LOCK;
 	sha1_cache = hikset_create(		/* Keys are atoms */
 		offsetof(struct sha1_cache_entry, file_name), HASH_KEY_SELF, 0);
 	sha1_read_cache();
+	SHA1_CACHE_UNLOCK;
 	has_http_urls = pattern_compile("http://", FALSE);
 }
 
-/**
- * Free SHA1 cache entry.
- */
-static void
-cache_free_entry(void *v, void *unused_udata)
-{
-	struct sha1_cache_entry *e = v;
-
-	(void) unused_udata;
-
-	atom_str_free_null(&e->file_name);
-	atom_sha1_free_null(&e->sha1);
-	atom_tth_free_null(&e->tth);
-	WFREE(e);
-}
-
 /**
  * Called when servent is shutdown.
  */
@@ -1100,8 +1922,11 @@ huge_close(void)
 {
 	dump_cache(FALSE);
 
+	SHA1_CACHE_LOCK;
 	hikset_foreach(sha1_cache, cache_free_entry, NULL);
 	hikset_free_null(&sha1_cache);
+	sha1_store_unload();
+	SHA1_CACHE_UNLOCK;
 
 	pattern_free(has_http_urls);
 	has_http_urls = NULL;
@@ -0,0 +1,747 @@
+/*
+ * Copyright (c) 2026, gtk-gnutella developers
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup core
+ * @file
+ *
+ * Compiled IP address classification.
+ *
+ * The bogons, hostiles and geographic databases, along with the whitelist,
+ * are compiled into a single table of disjoint address intervals, each
+ * carrying the classification record gathering the attributes from all
+ * the sources.  A single lookup therefore answers all the questions we can
+ * ask about an address.
+ *
+ * For IPv4, the intervals are indexed by the leading 16 bits of the address,
+ * leaving a binary search over a handful of intervals at most.  The IPv6
+ * intervals are few and only searched by dichotomy.
+ *
+ * Sources signal changes from the main thread, where the table is rebuilt
+ * from scratch right away.  The new table is published by swapping a pointer
+ * whilst lookups, which can happen from any thread, read the current table
+ * from within a read-side section of ``ipclass_epoch'', through which the
+ * previous table is retired.
+ *
+ * @author gtk-gnutella developers
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "ipclass.h"
+
+#include "whitelist.h"
+
+#include "if/gnet_property_priv.h"
+
+#include "lib/atomic.h"
+#include "lib/epoch.h"
+#include "lib/halloc.h"
+#include "lib/iprange.h"
+#include "lib/random.h"
+#include "lib/stringify.h"
+#include "lib/thread.h"
+#include "lib/tm.h"
+#include "lib/vsort.h"
+#include "lib/walloc.h"
+
+#include "lib/override.h"		/* Must be the last header included */
+
+#define IPCLASS_INDEX4_BITS		16
+#define IPCLASS_INDEX4_SIZE		(1U << IPCLASS_INDEX4_BITS)
+#define IPCLASS_SRC_WHITELIST	IPCLASS_SRC_COUNT	/* Internal source */
+#define IPCLASS_SOURCES			(IPCLASS_SRC_COUNT + 1)
+#define IPCLASS_BENCH_LOOKUPS	(1U << 20)
+
+#define ipclass_debugging(lvl)	G_UNLIKELY(GNET_PROPERTY(ipclass_debug) > (lvl))
+
+/**
+ * Flag contributed by each source, 0 for the geographic one which brings
+ * its value instead.
+ */
+static const ipclass_t ipclass_flag[IPCLASS_SOURCES] = {
+	IPCLASS_BOGON,				/* IPCLASS_SRC_BOGONS */
+	IPCLASS_HOSTILE_GLOBAL,		/* IPCLASS_SRC_HOSTILES_GLOBAL */
+	IPCLASS_HOSTILE_PRIVATE,	/* IPCLASS_SRC_HOSTILES_PRIVATE */
+	0,							/* IPCLASS_SRC_GEO */
+	IPCLASS_WHITELIST,			/* IPCLASS_SRC_WHITELIST */
+};
+
+struct ipclass_addr6 {
+	uint8 b[16];
+};
+
+/**
+ * A compiled classification table.
+ *
+ * Interval i covers addresses from start[i] up to start[i + 1] (excluded),
+ * the last one extending to the end of the address space.
+ */
+struct ipclass_table {
+	uint32 *start4;					/**< Start of IPv4 intervals */
+	ipclass_t *class4;				/**< Classification of IPv4 intervals */
+	uint32 *index4;					/**< Last interval starting before /16 */
+	struct ipclass_addr6 *start6;	/**< Start of IPv6 intervals */
+	ipclass_t *class6;				/**< Classification of IPv6 intervals */
+	size_t count4;					/**< Amount of IPv4 intervals */
+	size_t count6;					/**< Amount of IPv6 intervals */
+};
+
+/**
+ * Range boundaries collected from the sources.
+ */
+struct ipclass_event4 {
+	uint64 point;		/**< Address where the event occurs */
+	ipclass_t attr;		/**< Flag or geographic value */
+	uint8 src;			/**< Source of the range */
+	int8 delta;			/**< +1 when range starts, -1 after it ends */
+};
+
+struct ipclass_event6 {
+	struct ipclass_addr6 point;
+	ipclass_t attr;
+	uint8 src;
+	int8 delta;
+};
+
+struct ipclass_build {
+	struct ipclass_event4 *ev4;
+	struct ipclass_event6 *ev6;
+	size_t n4, size4;
+	size_t n6, size6;
+	uint8 src;			/**< Source being collected */
+};
+
+static const struct iprange_db *ipclass_db[IPCLASS_SRC_COUNT];
+static struct ipclass_table *ipclass_table;
+static epoch_t *ipclass_epoch;
+
+/**
+ * Record an IPv4 boundary.
+ */
+static void
+ipclass_event4_add(struct ipclass_build *b,
+	uint64 point, ipclass_t attr, int delta)
+{
+	struct ipclass_event4 *e;
+
+	if (b->n4 == b->size4) {
+		b->size4 = MAX(64, b->size4 * 2);
+		HREALLOC_ARRAY(b->ev4, b->size4);
+	}
+
+	e = &b->ev4[b->n4++];
+	e->point = point;
+	e->attr = attr;
+	e->src = b->src;
+	e->delta = delta;
+}
+
+/**
+ * Record an IPv6 boundary.
+ */
+static void
+ipclass_event6_add(struct ipclass_build *b,
+	const uint8 *point, ipclass_t attr, int delta)
+{
+	struct ipclass_event6 *e;
+
+	if (b->n6 == b->size6) {
+		b->size6 = MAX(64, b->size6 * 2);
+		HREALLOC_ARRAY(b->ev6, b->size6);
+	}
+
+	e = &b->ev6[b->n6++];
+	memcpy(e->point.b, point, sizeof e->point.b);
+	e->attr = attr;
+	e->src = b->src;
+	e->delta = delta;
+}
+
+/**
+ * @return attribute brought by source for a range with the given value.
+ */
+static inline ipclass_t
+ipclass_attr(uint8 src, uint16 value)
+{
+	return IPCLASS_SRC_GEO == src ? value : ipclass_flag[src];
+}
+
+/**
+ * Record an IPv4 network -- iprange_foreach4() callback.
+ */
+static void
+ipclass_add_net4(uint32 net, uint bits, uint16 value, void *data)
+{
+	struct ipclass_build *b = data;
+	ipclass_t attr = ipclass_attr(b->src, value);
+
+	g_assert(bits <= 32);
+
+	ipclass_event4_add(b, net, attr, +1);
+	ipclass_event4_add(b,
+		(uint64) net + ((uint64) 1 << (32 - bits)), attr, -1);
+}
+
+/**
+ * Record an IPv6 network -- iprange_foreach6() callback.
+ */
+static void
+ipclass_add_net6(const uint8 *net, uint bits, uint16 value, void *data)
+{
+	struct ipclass_build *b = data;
+	ipclass_t attr = ipclass_attr(b->src, value);
+	uint8 end[16];
+	bool carry = TRUE;
+	int i;
+
+	g_assert(bits <= 128);
+
+	ipclass_event6_add(b, net, attr, +1);
+
+	/*
+	 * Compute the address following the network: set all the host bits
+	 * then add one.  There is none when the network ends the address space.
+	 */
+
+	for (i = 0; i < 16; i++) {
+		uint nbits = bits > 8U * i ? MIN(8, bits - 8U * i) : 0;
+		end[i] = net[i] | (0xffU >> nbits);
+	}
+
+	for (i = 15; carry && i >= 0; i--) {
+		end[i]++;
+		carry = 0 == end[i];
+	}
+
+	if (!carry)
+		ipclass_event6_add(b, end, attr, -1);
+}
+
+/**
+ * Record a whitelisted network -- whitelist_foreach_range() callback.
+ */
+static void
+ipclass_add_whitelist(const host_addr_t addr, uint bits, void *data)
+{
+	switch (host_addr_net(addr)) {
+	case NET_TYPE_IPV4:
+		ipclass_add_net4(host_addr_ipv4(addr) & cidr_to_netmask(bits),
+			bits, 1, data);
+		break;
+	case NET_TYPE_IPV6:
+		{
+			uint8 net[16];
+			uint i;
+
+			memcpy(net, host_addr_ipv6(&addr), sizeof net);
+			for (i = 0; i < 16; i++) {
+				uint nbits = bits > 8 * i ? MIN(8, bits - 8 * i) : 0;
+				net[i] &= ~(0xffU >> nbits);
+			}
+			ipclass_add_net6(net, bits, 1, data);
+		}
+		break;
+	case NET_TYPE_LOCAL:
+	case NET_TYPE_NONE:
+		break;
+	}
+}
+
+static int
+ipclass_event4_cmp(const void *p, const void *q)
+{
+	const struct ipclass_event4 *a = p, *b = q;
+
+	/* Ranges ending at a point must be handled before those starting there */
+
+	return a->point == b->point ?
+		CMP(a->delta, b->delta) : CMP(a->point, b->point);
+}
+
+static int
+ipclass_event6_cmp(const void *p, const void *q)
+{
+	const struct ipclass_event6 *a = p, *b = q;
+	int c = memcmp(a->point.b, b->point.b, sizeof a->point.b);
+
+	return 0 == c ? CMP(a->delta, b->delta) : c;
+}
+
+/**
+ * Tracks which sources cover the current address during the sweep.
+ */
+struct ipclass_sweep {
+	uint count[IPCLASS_SOURCES];	/**< Amount of covering ranges */
+	uint16 geo;						/**< Current geographic value */
+};
+
+static void
+ipclass_sweep_apply(struct ipclass_sweep *s,
+	uint8 src, ipclass_t attr, int delta)
+{
+	g_assert(src < IPCLASS_SOURCES);
+	g_assert(delta > 0 || s->count[src] != 0);
+
+	s->count[src] += delta;
+
+	if (IPCLASS_SRC_GEO == src)
+		s->geo = 0 == s->count[src] ? 0 : (delta > 0 ? attr : s->geo);
+}
+
+static ipclass_t
+ipclass_sweep_record(const struct ipclass_sweep *s)
+{
+	ipclass_t c = s->geo;
+	uint i;
+
+	for (i = 0; i < N_ITEMS(s->count); i++) {
+		if (s->count[i] != 0)
+			c |= ipclass_flag[i];
+	}
+
+	return c;
+}
+
+/**
+ * Compile the IPv4 boundaries into disjoint intervals.
+ */
+static void
+ipclass_compile4(struct ipclass_table *t, struct ipclass_build *b)
+{
+	struct ipclass_sweep s;
+	size_t i, n = 0, p;
+
+	ZERO(&s);
+	vsort(b->ev4, b->n4, sizeof b->ev4[0], ipclass_event4_cmp);
+
+	HALLOC_ARRAY(t->start4, b->n4 + 1);
+	HALLOC_ARRAY(t->class4, b->n4 + 1);
+	t->start4[n] = 0;
+	t->class4[n++] = 0;
+
+	for (i = 0; i < b->n4; /* empty */) {
+		uint64 point = b->ev4[i].point;
+		ipclass_t c;
+
+		for (; i < b->n4 && b->ev4[i].point == point; i++) {
+			const struct ipclass_event4 *e = &b->ev4[i];
+			ipclass_sweep_apply(&s, e->src, e->attr, e->delta);
+		}
+
+		if (point > MAX_INT_VAL(uint32))
+			break;
+
+		c = ipclass_sweep_record(&s);
+
+		if (c == t->class4[n - 1])
+			continue;
+
+		if (t->start4[n - 1] == point) {
+			t->class4[n - 1] = c;		/* Only possible for address 0 */
+		} else {
+			t->start4[n] = point;
+			t->class4[n++] = c;
+		}
+	}
+
+	t->count4 = n;
+	HREALLOC_ARRAY(t->start4, n);
+	HREALLOC_ARRAY(t->class4, n);
+
+	/*
+	 * Index the intervals by the leading bits of the addresses.
+	 */
+
+	HALLOC_ARRAY(t->index4, IPCLASS_INDEX4_SIZE + 1);
+
+	for (p = 0, i = 0; p < IPCLASS_INDEX4_SIZE; p++) {
+		uint32 base = p << (32 - IPCLASS_INDEX4_BITS);
+
+		while (i + 1 < n && t->start4[i + 1] <= base)
+			i++;
+		t->index4[p] = i;
+	}
+	t->index4[IPCLASS_INDEX4_SIZE] = n - 1;
+}
+
+/**
+ * Compile the IPv6 boundaries into disjoint intervals.
+ */
+static void
+ipclass_compile6(struct ipclass_table *t, struct ipclass_build *b)
+{
+	struct ipclass_sweep s;
+	size_t i, n = 0;
+
+	ZERO(&s);
+	vsort(b->ev6, b->n6, sizeof b->ev6[0], ipclass_event6_cmp);
+
+	HALLOC_ARRAY(t->start6, b->n6 + 1);
+	HALLOC_ARRAY(t->class6, b->n6 + 1);
+	ZERO(&t->start6[n]);
+	t->class6[n++] = 0;
+
+	for (i = 0; i < b->n6; /* empty */) {
+		struct ipclass_addr6 point = b->ev6[i].point;
+		ipclass_t c;
+
+		for (
+			/* empty */;
+			i < b->n6 && 0 == memcmp(b->ev6[i].point.b, point.b, 16);
+			i++
+		) {
+			const struct ipclass_event6 *e = &b->ev6[i];
+			ipclass_sweep_apply(&s, e->src, e->attr, e->delta);
+		}
+
+		c = ipclass_sweep_record(&s);
+
+		if (c == t->class6[n - 1])
+			continue;
+
+		if (0 == memcmp(t->start6[n - 1].b, point.b, 16)) {
+			t->class6[n - 1] = c;		/* Only possible for address 0 */
+		} else {
+			t->start6[n] = point;
+			t->class6[n++] = c;
+		}
+	}
+
+	t->count6 = n;
+	HREALLOC_ARRAY(t->start6, n);
+	HREALLOC_ARRAY(t->class6, n);
+}
+
+/**
+ * Free classification table, once lock-free readers can no longer see it.
+ */
+static void
+ipclass_table_free(void *p)
+{
+	struct ipclass_table *t = p;
+
+	HFREE_NULL(t->start4);
+	HFREE_NULL(t->class4);
+	HFREE_NULL(t->index4);
+	HFREE_NULL(t->start6);
+	HFREE_NULL(t->class6);
+	WFREE(t);
+}
+
+static ipclass_t
+ipclass_table_lookup4(const struct ipclass_table *t, uint32 ip)
+{
+	uint32 p = ip >> (32 - IPCLASS_INDEX4_BITS);
+	size_t lo = t->index4[p], hi = t->index4[p + 1];
+
+	/* Find last interval starting at or before the address */
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo + 1) / 2;
+
+		if (t->start4[mid] <= ip)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	return t->class4[lo];
+}
+
+static ipclass_t
+ipclass_table_lookup6(const struct ipclass_table *t, const uint8 *ip6)
+{
+	size_t lo = 0, hi = t->count6 - 1;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo + 1) / 2;
+
+		if (memcmp(t->start6[mid].b, ip6, 16) <= 0)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	return t->class6[lo];
+}
+
+/**
+ * Classify an IPv4 address by querying each source database in turn.
+ */
+static ipclass_t
+ipclass_chain_lookup4(uint32 ip)
+{
+	ipclass_t c = 0;
+	uint i;
+
+	for (i = 0; i < N_ITEMS(ipclass_db); i++) {
+		uint16 value;
+
+		if (NULL == ipclass_db[i])
+			continue;
+
+		value = iprange_get(ipclass_db[i], ip);
+		if (value != 0)
+			c |= ipclass_attr(i, value);
+	}
+
+	return c;
+}
+
+/**
+ * Measure lookup speed of the compiled table against querying each of the
+ * source databases, and check that they agree.
+ *
+ * The whitelist is left out of the comparison since it is not held in an
+ * IP range database.
+ */
+static void
+ipclass_benchmark(const struct ipclass_table *t)
+{
+	uint32 *ips;
+	tm_nano_t t0, t1, t2;
+	volatile ipclass_t sink = 0;
+	uint i, mismatches = 0;
+	double compiled, chain;
+
+	HALLOC_ARRAY(ips, IPCLASS_BENCH_LOOKUPS);
+
+	for (i = 0; i < IPCLASS_BENCH_LOOKUPS; i++) {
+		ips[i] = random_u32();
+	}
+
+	tm_precise_time(&t0);
+	for (i = 0; i < IPCLASS_BENCH_LOOKUPS; i++) {
+		sink ^= ipclass_table_lookup4(t, ips[i]);
+	}
+	tm_precise_time(&t1);
+	for (i = 0; i < IPCLASS_BENCH_LOOKUPS; i++) {
+		sink ^= ipclass_chain_lookup4(ips[i]);
+	}
+	tm_precise_time(&t2);
+
+	for (i = 0; i < IPCLASS_BENCH_LOOKUPS; i++) {
+		ipclass_t c = ipclass_table_lookup4(t, ips[i]) & ~IPCLASS_WHITELIST;
+
+		if (c != ipclass_chain_lookup4(ips[i]))
+			mismatches++;
+	}
+
+	compiled = tm_precise_elapsed_f(&t1, &t0);
+	chain = tm_precise_elapsed_f(&t2, &t1);
+
+	g_debug("IPCLASS %u IPv4 lookups: %.0f/s compiled, %.0f/s chained "
+		"(%u mismatch%s)",
+		IPCLASS_BENCH_LOOKUPS,
+		0 == compiled ? 0.0 : IPCLASS_BENCH_LOOKUPS / compiled,
+		0 == chain ? 0.0 : IPCLASS_BENCH_LOOKUPS / chain,
+		PLURAL_ES(mismatches));
+
+	(void) sink;
+	HFREE_NULL(ips);
+}
+
+/**
+ * Compile all the sources into a new table, replacing the current one.
+ */
+static void
+ipclass_rebuild(void)
+{
+	struct ipclass_build b;
+	struct ipclass_table *t, *old;
+	tm_nano_t start, end;
+	uint i;
+
+	g_assert(thread_is_main());
+
+	if G_UNLIKELY(NULL == ipclass_epoch)
+		return;			/* Not initialized yet, or already closed */
+
+	tm_precise_time(&start);
+	ZERO(&b);
+
+	for (i = 0; i < N_ITEMS(ipclass_db); i++) {
+		if (NULL == ipclass_db[i])
+			continue;
+		b.src = i;
+		iprange_foreach4(ipclass_db[i], ipclass_add_net4, &b);
+		iprange_foreach6(ipclass_db[i], ipclass_add_net6, &b);
+	}
+
+	b.src = IPCLASS_SRC_WHITELIST;
+	whitelist_foreach_range(ipclass_add_whitelist, &b);
+
+	WALLOC0(t);
+	ipclass_compile4(t, &b);
+	ipclass_compile6(t, &b);
+
+	HFREE_NULL(b.ev4);
+	HFREE_NULL(b.ev6);
+
+	old = ipclass_table;
+	atomic_mb();		/* New table is complete before being visible */
+	ipclass_table = t;
+
+	if (old != NULL)
+		epoch_retire(ipclass_epoch, old, ipclass_table_free);
+
+	if (ipclass_debugging(0)) {
+		tm_precise_time(&end);
+		g_debug("IPCLASS compiled %zu IPv4 and %zu IPv6 interval%s in %.3f ms",
+			t->count4, PLURAL(t->count6),
+			tm_precise_elapsed_f(&end, &start) * 1000.0);
+	}
+
+	if (ipclass_debugging(1))
+		ipclass_benchmark(t);
+}
+
+/**
+ * Install or remove an IP range database as classification source.
+ *
+ * This must be called again each time the database is modified, and with
+ * a NULL database before it is freed.
+ *
+ * @param src	the classification source
+ * @param db	the synchronized database, NULL to remove the source
+ */
+void
+ipclass_set_source(enum ipclass_source src, const struct iprange_db *db)
+{
+	g_assert(UNSIGNED(src) < IPCLASS_SRC_COUNT);
+
+	ipclass_db[src] = db;
+	ipclass_rebuild();
+}
+
+/**
+ * Signal that some source changed, forcing recompilation of the table.
+ */
+void
+ipclass_changed(void)
+{
+	ipclass_rebuild();
+}
+
+/**
+ * Classify an IPv4 address.
+ */
+ipclass_t
+ipclass_lookup_ipv4(uint32 ip)
+{
+	const struct ipclass_table *t;
+	ipclass_t c = 0;
+
+	if G_UNLIKELY(NULL == ipclass_epoch)
+		return 0;		/* Not initialized yet, or already closed */
+
+	epoch_enter(ipclass_epoch);
+
+	t = ipclass_table;
+	if G_LIKELY(t != NULL)
+		c = ipclass_table_lookup4(t, ip);
+
+	epoch_leave(ipclass_epoch);
+
+	return c;
+}
+
+/**
+ * Classify an IPv6 address.
+ */
+ipclass_t
+ipclass_lookup_ipv6(const uint8 *ip6)
+{
+	const struct ipclass_table *t;
+	ipclass_t c = 0;
+
+	if G_UNLIKELY(NULL == ipclass_epoch)
+		return 0;		/* Not initialized yet, or already closed */
+
+	epoch_enter(ipclass_epoch);
+
+	t = ipclass_table;
+	if G_LIKELY(t != NULL)
+		c = ipclass_table_lookup6(t, ip6);
+
+	epoch_leave(ipclass_epoch);
+
+	return c;
+}
+
+/**
+ * Classify an address.
+ *
+ * IPv4-mapped and tunneled IPv6 addresses are classified using the IPv4
+ * address they carry.
+ *
+ * @return the classification record of the address, 0 if nothing is known.
+ */
+ipclass_t
+ipclass_lookup(const host_addr_t ha)
+{
+	host_addr_t to;
+
+	if (
+		host_addr_convert(ha, &to, NET_TYPE_IPV4) ||
+		host_addr_tunnel_client(ha, &to)
+	) {
+		return ipclass_lookup_ipv4(host_addr_ipv4(to));
+	} else if (host_addr_is_ipv6(ha)) {
+		return ipclass_lookup_ipv6(host_addr_ipv6(&ha));
+	}
+	return 0;
+}
+
+/**
+ * Initialize the classification, compiling an initial table from the
+ * sources already known.
+ */
+void G_COLD
+ipclass_init(void)
+{
+	ipclass_epoch = epoch_make("ipclass");
+	ipclass_rebuild();
+}
+
+/**
+ * Discard the classification table.
+ */
+void G_COLD
+ipclass_close(void)
+{
+	struct ipclass_table *t = ipclass_table;
+
+	ZERO(&ipclass_db);
+	ipclass_table = NULL;
+
+	if (t != NULL)
+		epoch_retire(ipclass_epoch, t, ipclass_table_free);
+
+	epoch_synchronize(ipclass_epoch);
+	epoch_free_null(&ipclass_epoch);
+}
+
+/* vi: set ts=4 sw=4 cindent: */
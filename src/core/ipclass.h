@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2026, gtk-gnutella developers
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup core
+ * @file
+ *
+ * Compiled IP address classification.
+ *
+ * @author gtk-gnutella developers
+ * @date 2026
+ */
+
+#ifndef _core_ipclass_h_
+#define _core_ipclass_h_
+
+#include "common.h"
+
+#include "lib/host_addr.h"
+
+/**
+ * Classification record of an address, gathering the attributes given
+ * by all the sources in a single value.
+ */
+typedef uint32 ipclass_t;
+
+#define IPCLASS_GEO_MASK		0xffffU		/**< Raw geo-ip.txt value, 0 if none */
+#define IPCLASS_BOGON			(1U << 16)	/**< Listed in bogons.txt */
+#define IPCLASS_HOSTILE_GLOBAL	(1U << 17)	/**< Listed in global hostiles.txt */
+#define IPCLASS_HOSTILE_PRIVATE	(1U << 18)	/**< Listed in private hostiles.txt */
+#define IPCLASS_WHITELIST		(1U << 19)	/**< Listed in the whitelist */
+
+/**
+ * Sources of the classification.
+ */
+enum ipclass_source {
+	IPCLASS_SRC_BOGONS = 0,
+	IPCLASS_SRC_HOSTILES_GLOBAL,
+	IPCLASS_SRC_HOSTILES_PRIVATE,
+	IPCLASS_SRC_GEO,
+
+	IPCLASS_SRC_COUNT
+};
+
+struct iprange_db;
+
+/*
+ * Public interface.
+ */
+
+void ipclass_init(void);
+void ipclass_close(void);
+
+void ipclass_set_source(enum ipclass_source src, const struct iprange_db *db);
+void ipclass_changed(void);
+
+ipclass_t ipclass_lookup_ipv4(uint32 ip);
+ipclass_t ipclass_lookup_ipv6(const uint8 *ip6);
+ipclass_t ipclass_lookup(const host_addr_t ha);
+
+/**
+ * @return the raw value from geo-ip.txt held in the classification record.
+ */
+static inline uint16
+ipclass_geo(const ipclass_t c)
+{
+	return c & IPCLASS_GEO_MASK;
+}
+
+#endif /* _core_ipclass_h_ */
+
+/* vi: set ts=4 sw=4 cindent: */
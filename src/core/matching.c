@@ -35,7 +35,6 @@
 
 #include "lib/ascii.h"
 #include "lib/atomic.h"
-#include "lib/atoms.h"
 #include "lib/halloc.h"
 #include "lib/hset.h"
 #include "lib/pattern.h"
@@ -87,22 +86,35 @@ typedef uint64 st_mask_t;
  */
 
 #define ST_MIN_BIN_SIZE		4
+#define ST_MIN_ENTRIES		64
+#define ST_MIN_ARENA		4096
 
-struct st_entry {
-	const char *string;				/* atom */
-	shared_file_t *sf;
-	st_mask_t mask;
-};
+/*
+ * The entries of a set are not allocated individually: they are stored as
+ * parallel arrays indexed by the entry number, and their names are packed
+ * in a single string arena.  Bins only list entry numbers.
+ *
+ * When scanning a bin, most entries are discarded by only looking at their
+ * mask and name length, which are densely packed, so we do not chase
+ * pointers to scattered entries, shared files or name atoms.
+ */
 
 struct st_bin {
 	uint nslots, nvals;
-	struct st_entry **vals;
+	uint32 *vals;				/* Entry numbers */
 };
 
 struct st_set {
 	uint nentries, nchars, nbins;
+	uint nslots;				/* Allocated entries */
 	struct st_bin **bins;
-	struct st_bin all_entries;
+	st_mask_t *masks;			/* Entry mask, see mask_hash() */
+	uint32 *lengths;			/* Entry name length */
+	uint32 *offsets;			/* Entry name offset within the arena */
+	shared_file_t **files;		/* Entry file (ref-counted) */
+	char *arena;				/* Entry names, NUL-terminated */
+	size_t arena_len;			/* Used bytes in arena */
+	size_t arena_size;			/* Allocated bytes for arena */
 	uchar index_map[MAX_INT_VAL(uchar)];
 	uchar fold_map[MAX_INT_VAL(uchar)];
 };
@@ -123,16 +135,6 @@ search_table_check(const struct search_table * const st)
 	g_assert(SEARCH_TABLE_MAGIC == st->magic);
 }
 
-static void
-destroy_entry(struct st_entry *entry)
-{
-	g_assert(entry != NULL);
-
-	atom_str_free_null(&entry->string);
-	shared_file_unref(&entry->sf);
-	WFREE(entry);
-}
-
 /**
  * Initialize a bin.
  */
@@ -146,7 +148,7 @@ bin_initialize(struct st_bin *bin, int size)
 
 	HALLOC_ARRAY(bin->vals, bin->nslots);
 	for (i = 0; i < bin->nslots; i++)
-		bin->vals[i] = NULL;
+		bin->vals[i] = 0;
 }
 
 /**
@@ -165,7 +167,7 @@ bin_allocate(void)
 /**
  * Destroy a bin.
  *
- * @note Do NOT destroy the st_entry's, since they may be shared.
+ * @note Entries are owned by the set, not by the bins referring to them.
  */
 static void
 bin_destroy(struct st_bin *bin)
@@ -179,7 +181,7 @@ bin_destroy(struct st_bin *bin)
  * Inserts an item into a bin.
  */
 static void
-bin_insert_item(struct st_bin *bin, struct st_entry *entry)
+bin_insert_item(struct st_bin *bin, uint32 entry)
 {
 	if (bin->nvals == bin->nslots) {
 		bin->nslots *= 2;
@@ -261,7 +263,13 @@ st_set_initialize(struct st_set *set)
 	set->nchars = cur_char;
 	set->nbins = set->nchars * set->nchars;
 	set->bins = NULL;
-	set->all_entries.vals = 0;
+	set->nslots = 0;
+	set->masks = NULL;
+	set->lengths = NULL;
+	set->offsets = NULL;
+	set->files = NULL;
+	set->arena = NULL;
+	set->arena_len = set->arena_size = 0;
 
 	if (GNET_PROPERTY(matching_debug)) {
 		static bool done;
@@ -301,8 +309,6 @@ st_set_recreate(struct st_set *set)
 	HALLOC_ARRAY(set->bins, set->nbins);
 	for (i = 0; i < set->nbins; i++)
 		set->bins[i] = NULL;
-
-    bin_initialize(&set->all_entries, ST_MIN_BIN_SIZE);
 }
 
 /**
@@ -337,13 +343,17 @@ st_set_destroy(struct st_set *set)
 		HFREE_NULL(set->bins);
 	}
 
-	if (set->all_entries.vals) {
-		for (i = 0; i < set->all_entries.nvals; i++) {
-			destroy_entry(set->all_entries.vals[i]);
-			set->all_entries.vals[i] = NULL;
-		}
-		bin_destroy(&set->all_entries);
+	for (i = 0; i < set->nentries; i++) {
+		shared_file_unref(&set->files[i]);
 	}
+
+	HFREE_NULL(set->masks);
+	HFREE_NULL(set->lengths);
+	HFREE_NULL(set->offsets);
+	HFREE_NULL(set->files);
+	HFREE_NULL(set->arena);
+	set->nentries = set->nslots = 0;
+	set->arena_len = set->arena_size = 0;
 }
 
 /**
@@ -434,7 +444,7 @@ st_count(const search_table_t *table, enum match_set which)
 
 	g_assert(set != NULL);
 
-	return set->all_entries.nvals;
+	return set->nentries;
 }
 
 /**
@@ -477,6 +487,49 @@ st_key(struct st_set *set, const char k[2])
 		set->index_map[(uchar) k[1]];
 }
 
+/**
+ * Resize the entry arrays of the set to hold `n' entries.
+ */
+static void
+st_set_resize(struct st_set *set, uint n)
+{
+	g_assert(n >= set->nentries);
+
+	HREALLOC_ARRAY(set->masks, n);
+	HREALLOC_ARRAY(set->lengths, n);
+	HREALLOC_ARRAY(set->offsets, n);
+	HREALLOC_ARRAY(set->files, n);
+	set->nslots = n;
+}
+
+/**
+ * Copy string into the name arena of the set.
+ *
+ * @return offset of the string within the arena.
+ */
+static uint32
+st_set_arena_add(struct st_set *set, const char *s, size_t len)
+{
+	size_t offset = set->arena_len;
+	size_t needed = offset + len + 1;
+
+	g_assert(needed <= MAX_INT_VAL(uint32));
+
+	if (needed > set->arena_size) {
+		size_t size = set->arena_size + set->arena_size / 2;
+
+		size = MAX(size, ST_MIN_ARENA);
+		size = MAX(size, needed);
+		HREALLOC_ARRAY(set->arena, size);
+		set->arena_size = size;
+	}
+
+	memcpy(&set->arena[offset], s, len + 1);
+	set->arena_len = needed;
+
+	return offset;
+}
+
 /**
  * Insert an item into the search_table
  * one-char strings are silently ignored.
@@ -488,7 +541,8 @@ st_insert_item(search_table_t *table,
 	enum match_set which, const char *s, const shared_file_t *sf)
 {
 	size_t i, len;
-	struct st_entry *entry;
+	uint32 entry;
+	const char *name;
 	hset_t *seen_keys;
 	struct st_set *set = NULL;
 
@@ -507,14 +561,19 @@ st_insert_item(search_table_t *table,
 
 	seen_keys = hset_create(HASH_KEY_SELF, 0);
 
-	WALLOC(entry);
-	entry->string = atom_str_get(s);
-	entry->sf = shared_file_ref(sf);
-	entry->mask = mask_hash(entry->string);
+	if (set->nentries == set->nslots)
+		st_set_resize(set, MAX(ST_MIN_ENTRIES, set->nslots * 2));
+
+	len = vstrlen(s);
+	entry = set->nentries;
+	set->masks[entry] = mask_hash(s);
+	set->lengths[entry] = len;
+	set->offsets[entry] = st_set_arena_add(set, s, len);
+	set->files[entry] = shared_file_ref(sf);
+	name = &set->arena[set->offsets[entry]];
 
-	len = vstrlen(entry->string);
 	for (i = 0; i < len - 1; i++) {
-		uint key = st_key(set, &entry->string[i]);
+		uint key = st_key(set, &name[i]);
 
 		/* don't insert item into same bin twice */
 		if (hset_contains(seen_keys, int_to_pointer(key)))
@@ -528,7 +587,6 @@ st_insert_item(search_table_t *table,
 
 		bin_insert_item(set->bins[key], entry);
 	}
-	bin_insert_item(&set->all_entries, entry);
 	set->nentries++;
 
 	hset_free_null(&seen_keys);
@@ -543,10 +601,12 @@ st_set_compact(struct st_set *set)
 {
 	uint i;
 
-	if (!set->all_entries.nvals)
+	if (0 == set->nentries)
 		return;			/* Nothing in set */
 
-	bin_compact(&set->all_entries);
+	st_set_resize(set, set->nentries);
+	HREALLOC_ARRAY(set->arena, set->arena_len);
+	set->arena_size = set->arena_len;
 
 	for (i = 0; i < set->nbins; i++) {
 		if (set->bins[i])
@@ -661,8 +721,6 @@ enum search_mode {
 	SEARCH_ALIAS		/* Query mangled with normalized aliases */
 };
 
-typedef size_t (*st_filename_len_fn_t)(const shared_file_t *sf);
-
 /**
  * Perform search.
  *
@@ -694,14 +752,15 @@ st_run_search(
 	word_vec_t *wovec;
 	uint wocnt;
 	cpattern_t **pattern;
-	struct st_entry **vals;
+	const uint32 *vals;
+	const st_mask_t *masks;
+	const uint32 *lengths;
 	uint vcnt;
 	int scanned = 0;		/* measure search mask efficiency */
 	pslist_t *local;
 	st_mask_t search_mask;
 	size_t minlen;
 	hset_t *already_matched = NULL;	/* entries that are already in the list */
-	st_filename_len_fn_t flen;
 
 	g_assert(implies(SEARCH_ALIAS == mode, NULL == qhv));
 
@@ -836,20 +895,19 @@ st_run_search(
 	minlen--;
 	g_assert(minlen <= INT_MAX);		/* No overflows */
 
-	flen = SEARCH_NORMAL == mode ?
-		shared_file_name_canonic_len : shared_file_name_normalized_len;
-
 	/*
 	 * Search through the smallest bin
 	 */
 
 	vcnt = best_bin->nvals;
 	vals = best_bin->vals;
+	masks = set->masks;
+	lengths = set->lengths;
 
 	nres = 0;
 	local = *result;
 	for (i = 0; i < vcnt; i++) {
-		const struct st_entry *e = vals[i];
+		uint32 e = vals[i];
 		const shared_file_t *sf;
 		size_t filename_len;
 
@@ -862,10 +920,15 @@ st_run_search(
 		 * when they repeat the search over time.
 		 */
 
-		if ((e->mask & search_mask) != search_mask)
+		if ((masks[e] & search_mask) != search_mask)
+			continue;		/* Can't match */
+
+		filename_len = lengths[e];
+
+		if (filename_len < minlen)
 			continue;		/* Can't match */
 
-		sf = e->sf;
+		sf = set->files[e];
 
 		if (already_matched != NULL && hset_contains(already_matched, sf))
 			continue;
@@ -873,17 +936,15 @@ st_run_search(
 		if (!shared_file_is_shareable(sf))
 			continue;		/* Cannot be shared */
 
-		filename_len = (*flen)(sf);
-
-		if (filename_len < minlen)
-			continue;		/* Can't match */
-
 		if (!search_apply_limits(sf, sri))
 			continue;		/* Does not pass limits the queryier has set */
 
 		scanned++;
 
-		if (entry_match(e->string, filename_len, pattern, wovec, wocnt)) {
+		if (
+			entry_match(&set->arena[set->offsets[e]], filename_len,
+				pattern, wovec, wocnt)
+		) {
 			if (GNET_PROPERTY(matching_debug) > 3) {
 				g_debug("MATCH \"%s\" matches %s",
 					search, shared_file_name_nfc(sf));
@@ -34,13 +34,13 @@
  *  entries which have a certain sequence of two characters in a row, plus
  *  some metadata.
  *
- *    Each bin is a simple array, without repetitions, of items.  Each item
- *  consists of a string to which a certain mapping of characters onto
- *  characters has been applied, plus a void * representing the actual data
- *  mapped to.  (I used void * to make this code reasonably generic, so that
- *  in any project I or someone else wants to use code like this for, they
- *  can just use it.)  The same mapping is also applied to each search before
- *  running it.  This maps uppercase and lowercase letters to match one
+ *    Each bin is a simple array, without repetitions, of entry numbers.  An
+ *  entry is a string to which a certain mapping of characters onto
+ *  characters has been applied, plus the shared file it maps to.  Entries
+ *  are kept in parallel arrays indexed by their number, and their strings
+ *  are packed in a per-table arena, so that scanning a bin does not need
+ *  to dereference the shared files until a match is found.  The same
+ *  mapping is also applied to each search before running it.  This maps uppercase and lowercase letters to match one
  *  another, maps all whitespace and punctuation to a simple space, etc.
  *  This mechanism is very flexible and could easily be adapted to match
  *  accented characters, etc.
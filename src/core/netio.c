@@ -0,0 +1,395 @@
+/*
+ * Copyright (c) 2026, gtk-gnutella developers
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup core
+ * @file
+ *
+ * Network I/O worker threads.
+ *
+ * When enabled through the "net_io_workers" property, a small pool of
+ * threads each runs its own event loop on a private inputevt context.
+ * Receiving drivers can then attach their sockets to one of these workers
+ * to have reading, decompression and message framing performed outside of
+ * the main thread, which only sees complete message batches.
+ *
+ * Workers are assigned to connections on a least-loaded basis.  Sources
+ * are added to and removed from a worker's context from any thread, since
+ * the inputevt layer serializes accesses to its contexts.
+ *
+ * Events are edge-triggered when the polling method supports it, hence
+ * handlers must read until EAGAIN.
+ *
+ * Since a handler can be running in the worker whilst the main thread
+ * tears down the object it refers to, netio_defer() lets the caller
+ * schedule the final release of such objects from within the worker,
+ * after its current dispatching round, when no handler can be active.
+ *
+ * @author gtk-gnutella developers
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "netio.h"
+
+#include "if/gnet_property_priv.h"
+
+#include "lib/constants.h"
+#include "lib/eslist.h"
+#include "lib/inputevt.h"
+#include "lib/spinlock.h"
+#include "lib/str.h"
+#include "lib/stringify.h"
+#include "lib/thread.h"
+#include "lib/waiter.h"
+#include "lib/walloc.h"
+#include "lib/xmalloc.h"
+
+#include "lib/override.h"		/* Must be the last header included */
+
+#define NETIO_WORKERS_MAX	32		/**< Maximum amount of worker threads */
+#define NETIO_POLL_MS		1000	/**< Maximum time spent waiting for I/O */
+
+enum netio_worker_magic { NETIO_WORKER_MAGIC = 0x1c5e3a07 };
+
+/**
+ * A network I/O worker thread.
+ */
+struct netio_worker {
+	enum netio_worker_magic magic;
+	inputevt_ctx_t *ctx;		/**< Private event loop */
+	waiter_t *waiter;			/**< To wake up the worker */
+	eslist_t deferred;			/**< Deferred callbacks */
+	spinlock_t lock;			/**< Protects deferred list */
+	unsigned waiter_id;			/**< Event source ID of waiter */
+	unsigned streams;			/**< Amount of assigned streams */
+	unsigned index;				/**< Index within the pool */
+	int stid;					/**< Worker thread ID */
+	volatile bool exiting;		/**< Set when worker must exit */
+};
+
+static inline void
+netio_worker_check(const struct netio_worker * const w)
+{
+	g_assert(w != NULL);
+	g_assert(NETIO_WORKER_MAGIC == w->magic);
+}
+
+/**
+ * A deferred callback.
+ */
+struct netio_deferred {
+	notify_fn_t cb;				/**< Callback to invoke */
+	void *arg;					/**< Callback argument */
+	slink_t lk;					/**< Embedded link */
+};
+
+static struct netio_worker *netio_workers;
+static unsigned netio_count;
+static spinlock_t netio_assign_slk = SPINLOCK_INIT;
+
+#define NETIO_ASSIGN_LOCK		spinlock(&netio_assign_slk)
+#define NETIO_ASSIGN_UNLOCK		spinunlock(&netio_assign_slk)
+
+/**
+ * @return whether network I/O workers are running.
+ */
+bool
+netio_enabled(void)
+{
+	return netio_count != 0;
+}
+
+/**
+ * Waiter callback, invoked when the worker was signalled.
+ */
+static void
+netio_wakeup(void *data, int unused_source, inputevt_cond_t unused_cond)
+{
+	waiter_t *w = data;
+
+	(void) unused_source;
+	(void) unused_cond;
+
+	waiter_ack(w);
+}
+
+/**
+ * Run all the pending deferred callbacks of the worker.
+ */
+static void
+netio_run_deferred(struct netio_worker *w)
+{
+	eslist_t list;
+	struct netio_deferred *d;
+
+	if (0 == eslist_count(&w->deferred))
+		return;
+
+	eslist_init(&list, offsetof(struct netio_deferred, lk));
+
+	spinlock(&w->lock);
+	eslist_append_list(&list, &w->deferred);
+	spinunlock(&w->lock);
+
+	while (NULL != (d = eslist_shift(&list))) {
+		(*d->cb)(d->arg);
+		WFREE(d);
+	}
+}
+
+/**
+ * Main loop of a worker thread.
+ */
+static void *
+netio_worker_main(void *arg)
+{
+	struct netio_worker *w = arg;
+
+	netio_worker_check(w);
+
+	thread_set_name(constant_str(str_smsg("netio #%u", w->index)));
+
+	while (!w->exiting) {
+		inputevt_ctx_run(w->ctx, NETIO_POLL_MS);
+
+		/*
+		 * Since all the handlers triggered by the round have now returned,
+		 * this is the safe point where deferred callbacks can be run.
+		 */
+
+		netio_run_deferred(w);
+		thread_check_suspended();
+	}
+
+	netio_run_deferred(w);
+
+	return NULL;
+}
+
+/**
+ * Wake up worker, so that it sees changes in its event loop promptly.
+ */
+static inline void
+netio_wake(struct netio_worker *w)
+{
+	waiter_signal(w->waiter);
+}
+
+/**
+ * Pick the worker thread that will handle a new stream.
+ *
+ * @return the least loaded worker, which must be released later through
+ * netio_release().
+ */
+struct netio_worker *
+netio_assign(void)
+{
+	struct netio_worker *w = NULL;
+	unsigned i;
+
+	g_assert(netio_enabled());
+
+	NETIO_ASSIGN_LOCK;
+
+	for (i = 0; i < netio_count; i++) {
+		struct netio_worker *nw = &netio_workers[i];
+
+		if (NULL == w || nw->streams < w->streams)
+			w = nw;
+	}
+
+	w->streams++;
+
+	NETIO_ASSIGN_UNLOCK;
+
+	return w;
+}
+
+/**
+ * Release a stream previously assigned to a worker.
+ */
+void
+netio_release(struct netio_worker *w)
+{
+	netio_worker_check(w);
+
+	NETIO_ASSIGN_LOCK;
+	g_assert(w->streams != 0);
+	w->streams--;
+	NETIO_ASSIGN_UNLOCK;
+}
+
+/**
+ * Monitor file descriptor for reading from the worker's event loop.
+ *
+ * @param w			the worker
+ * @param fd		the file descriptor to monitor
+ * @param handler	the handler to invoke, from the worker thread
+ * @param data		the handler argument
+ *
+ * @return the ID of the event source, to be given to netio_remove().
+ */
+unsigned
+netio_add(struct netio_worker *w, int fd,
+	inputevt_handler_t handler, void *data)
+{
+	unsigned id;
+
+	netio_worker_check(w);
+
+	id = inputevt_ctx_add(w->ctx, fd, INPUT_EVENT_RX, handler, data);
+
+	/*
+	 * The worker may be blocked collecting events, in which case the
+	 * new source is only monitored when the collection ends.
+	 */
+
+	if (thread_small_id() != (unsigned) w->stid)
+		netio_wake(w);
+
+	return id;
+}
+
+/**
+ * Remove an event source from the worker's event loop, nullifying its ID.
+ *
+ * Even when called from another thread, the handler of the source will no
+ * longer be invoked once this returns, unless it is already running.
+ */
+void
+netio_remove(struct netio_worker *w, unsigned *id_ptr)
+{
+	netio_worker_check(w);
+
+	if (*id_ptr != 0)
+		inputevt_ctx_remove(w->ctx, id_ptr);
+}
+
+/**
+ * Have callback invoked by the worker, after all the handlers that could
+ * be running at the time of the call have returned.
+ */
+void
+netio_defer(struct netio_worker *w, notify_fn_t cb, void *arg)
+{
+	struct netio_deferred *d;
+
+	netio_worker_check(w);
+	g_assert(cb != NULL);
+
+	WALLOC0(d);
+	d->cb = cb;
+	d->arg = arg;
+
+	spinlock(&w->lock);
+	eslist_append(&w->deferred, d);
+	spinunlock(&w->lock);
+
+	if (thread_small_id() != (unsigned) w->stid)
+		netio_wake(w);
+}
+
+/**
+ * Launch the network I/O worker threads, if configured.
+ */
+void G_COLD
+netio_init(void)
+{
+	unsigned i, n;
+
+	n = MIN(GNET_PROPERTY(net_io_workers), NETIO_WORKERS_MAX);
+	if (0 == n)
+		return;
+
+	XMALLOC0_ARRAY(netio_workers, n);
+
+	for (i = 0; i < n; i++) {
+		struct netio_worker *w = &netio_workers[i];
+
+		w->magic = NETIO_WORKER_MAGIC;
+		w->index = i;
+		w->ctx = inputevt_ctx_new(FALSE);
+		inputevt_ctx_set_edge_triggered(w->ctx);
+		w->waiter = waiter_make(w);
+		w->waiter_id = inputevt_ctx_add(w->ctx, waiter_fd(w->waiter),
+			INPUT_EVENT_RX, netio_wakeup, w->waiter);
+		spinlock_init(&w->lock);
+		eslist_init(&w->deferred, offsetof(struct netio_deferred, lk));
+
+		w->stid = thread_create(netio_worker_main, w,
+			THREAD_F_NO_CANCEL | THREAD_F_NO_POOL | THREAD_F_PANIC, 0);
+	}
+
+	netio_count = n;
+
+	g_info("started %u network I/O worker%s using %s",
+		n, plural(n), inputevt_ctx_method(netio_workers[0].ctx));
+}
+
+/**
+ * Stop the network I/O worker threads.
+ *
+ * All the streams must have been released at this point, and all the
+ * deferred callbacks are run before the workers exit.
+ */
+void G_COLD
+netio_close(void)
+{
+	unsigned i;
+
+	if (0 == netio_count)
+		return;
+
+	for (i = 0; i < netio_count; i++) {
+		struct netio_worker *w = &netio_workers[i];
+
+		w->exiting = TRUE;
+		netio_wake(w);
+	}
+
+	for (i = 0; i < netio_count; i++) {
+		struct netio_worker *w = &netio_workers[i];
+
+		if (-1 == thread_join(w->stid, NULL)) {
+			s_warning("%s(): cannot join with netio #%u: %m",
+				G_STRFUNC, w->index);
+		}
+
+		g_assert_log(0 == w->streams,
+			"%s(): netio #%u still has %u stream%s",
+			G_STRFUNC, w->index, PLURAL(w->streams));
+
+		inputevt_ctx_remove(w->ctx, &w->waiter_id);
+		waiter_destroy_null(&w->waiter);
+		inputevt_ctx_free_null(&w->ctx);
+		spinlock_destroy(&w->lock);
+		w->magic = 0;
+	}
+
+	XFREE_NULL(netio_workers);
+	netio_count = 0;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2026, gtk-gnutella developers
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup core
+ * @file
+ *
+ * Network I/O worker threads.
+ *
+ * @author gtk-gnutella developers
+ * @date 2026
+ */
+
+#ifndef _core_netio_h_
+#define _core_netio_h_
+
+#include "common.h"
+
+#include "lib/inputevt.h"
+
+struct netio_worker;
+
+/*
+ * Public interface.
+ */
+
+void netio_init(void);
+void netio_close(void);
+bool netio_enabled(void);
+
+struct netio_worker *netio_assign(void);
+void netio_release(struct netio_worker *w);
+unsigned netio_add(struct netio_worker *w, int fd,
+	inputevt_handler_t handler, void *data);
+void netio_remove(struct netio_worker *w, unsigned *id_ptr);
+void netio_defer(struct netio_worker *w, notify_fn_t cb, void *arg);
+
+#endif /* _core_netio_h_ */
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -45,6 +45,7 @@
 #include "bsched.h"
 #include "clock.h"
 #include "ctl.h"
+#include "deflate_dict.h"
 #include "dh.h"
 #include "dq.h"
 #include "dump.h"
@@ -65,6 +66,7 @@
 #include "mq.h"
 #include "mq_tcp.h"
 #include "mq_udp.h"
+#include "netio.h"
 #include "oob_proxy.h"
 #include "pcache.h"
 #include "pdht.h"
@@ -74,6 +76,7 @@
 #include "rx.h"
 #include "rx_inflate.h"
 #include "rx_link.h"
+#include "rx_netio.h"
 #include "rx_ut.h"
 #include "rxbuf.h"
 #include "search.h"
@@ -3976,10 +3979,44 @@ node_tx_deflate_flowc(void *o, size_t amount)
 		bio_add_allocated(mq_bio(n->outq), amount);
 }
 
+static void
+node_add_tx_deflate_cputime(void *o, uint64 ns)
+{
+	gnutella_node_t *n = o;
+
+	node_check(n);
+
+	n->tx_deflate_ns += ns;
+}
+
+static void
+node_tx_deflate_level(void *o, int level)
+{
+	gnutella_node_t *n = o;
+
+	node_check(n);
+
+	n->tx_deflate_level = level;
+}
+
+static bool
+node_tx_deflate_congested(void *o)
+{
+	gnutella_node_t *n = o;
+
+	node_check(n);
+
+	return n->outq != NULL &&
+		(mq_is_flow_controlled(n->outq) || mq_is_swift_controlled(n->outq));
+}
+
 static struct tx_deflate_cb node_tx_deflate_cb = {
 	node_add_tx_deflated,		/* add_tx_deflated */
 	node_tx_shutdown,			/* shutdown */
 	node_tx_deflate_flowc,		/* flow_control */
+	node_add_tx_deflate_cputime,	/* add_tx_cputime */
+	node_tx_deflate_level,		/* level_changed */
+	node_tx_deflate_congested,	/* congested */
 };
 
 /***
@@ -4277,6 +4314,14 @@ static struct rx_link_cb node_rx_link_cb = {
 	node_rx_got_eof,			/* got_eof */
 };
 
+static struct rx_netio_cb node_rx_netio_cb = {
+	node_add_rx_given,			/* add_rx_given */
+	node_add_rx_inflated,		/* add_rx_inflated */
+	node_rx_read_error,			/* read_error */
+	node_rx_inflate_error,		/* inflate_error */
+	node_rx_got_eof,			/* got_eof */
+};
+
 static struct rx_ut_cb node_rx_ut_cb = {
 	node_add_rx_given,			/* add_rx_given */
 };
@@ -4923,6 +4968,44 @@ node_net_stack_create(gnutella_node_t *n)
 
 	gnet_host_set(&host, n->addr, n->port);
 
+	/*
+	 * Plain Gnutella connections can be read, decompressed and split into
+	 * messages by the network I/O workers, when configured.
+	 */
+
+	if (
+		netio_enabled() &&
+		!NODE_TALKS_G2(n) &&
+		!socket_uses_tls(n->socket)
+	) {
+		struct rx_netio_args args;
+
+		args.cb = &node_rx_netio_cb;
+		args.wio = &n->socket->wio;
+		args.bws = n->peermode == NODE_P_LEAF
+				? BSCHED_BWS_GLIN : BSCHED_BWS_GIN;
+		args.inflate = booleanize(n->attrs & NODE_A_RX_INFLATE);
+		args.dict = NULL;
+		args.dict_len = 0;
+
+		if (n->attrs2 & NODE_A2_DEFLATE_DICT)
+			args.dict = deflate_dict_data(&args.dict_len);
+
+		n->rx = rx_make(n, &host, rx_netio_get_ops(), &args);
+
+		if (NULL == n->rx)
+			goto link_stack;
+
+		if (n->attrs & NODE_A_RX_INFLATE) {
+			if (n->flags & NODE_F_LEAF)
+				compressed_leaf_cnt++;
+			compressed_node_cnt++;
+		}
+
+		goto rx_stack_created;
+	}
+
+link_stack:
 	{
 		struct rx_link_args args;
 
@@ -4941,6 +5024,11 @@ node_net_stack_create(gnutella_node_t *n)
 			g_debug("receiving compressed data from %s", node_infostr(n));
 
 		args.cb = &node_rx_inflate_cb;
+		args.dict = NULL;
+		args.dict_len = 0;
+
+		if (n->attrs2 & NODE_A2_DEFLATE_DICT)
+			args.dict = deflate_dict_data(&args.dict_len);
 
 		n->rx = rx_make_above(n->rx, rx_inflate_get_ops(), &args);
 
@@ -4949,6 +5037,7 @@ node_net_stack_create(gnutella_node_t *n)
         compressed_node_cnt++;
 	}
 
+rx_stack_created:
 	rx_set_data_ind(n->rx, NODE_TALKS_G2(n) ? node_g2_data_ind : node_data_ind);
 	rx_enable(n->rx);
 	n->flags |= NODE_F_READABLE;
@@ -4984,8 +5073,14 @@ node_net_stack_create(gnutella_node_t *n)
 		args.nagle = TRUE;
 		args.gzip = FALSE;
 		args.reduced = settings_is_ultra() && NODE_IS_LEAF(n);
+		args.adaptive = GNET_PROPERTY(tx_deflate_adaptive);
 		args.buffer_size = NODE_TX_BUFSIZ;
 		args.buffer_flush = NODE_TX_FLUSH;
+		args.dict = NULL;
+		args.dict_len = 0;
+
+		if (n->attrs2 & NODE_A2_DEFLATE_DICT)
+			args.dict = deflate_dict_data(&args.dict_len);
 
 		ctx = tx_make_above(tx, tx_deflate_get_ops(), &args);
 		if (ctx == NULL) {
@@ -6236,6 +6331,27 @@ node_process_handshake_ack(gnutella_node_t *n, header_t *head)
 	node_is_now_connected(n);
 }
 
+/**
+ * @return the header string advertising our preset deflate dictionary, as a
+ * pointer to static data, or an empty string if we do not use one.
+ */
+static const char *
+node_deflate_dict_header(void)
+{
+	static char buf[64];
+	const char *id;
+
+	if (!GNET_PROPERTY(gnet_deflate_enabled))
+		return "";
+
+	id = deflate_dict_id();
+	if (NULL == id)
+		return "";
+
+	str_bprintf(ARYLEN(buf), "X-Deflate-Dictionary: %s\r\n", id);
+	return buf;
+}
+
 /**
  * @return the header string that should be used to advertise our QRP version
  * in the reply to their handshake, as a pointer to static data.
@@ -6768,6 +6884,14 @@ node_process_handshake_header(gnutella_node_t *n, header_t *head)
 		if (field && strtok_has(field, ",", "deflate")) {
 			n->attrs |= NODE_A_RX_INFLATE;	/* We shall decompress input */
 		}
+
+		/*
+		 * X-Deflate-Dictionary -- preset dictionary known to the remote side
+		 */
+
+		field = header_get(head, "X-Deflate-Dictionary");
+		if (field != NULL && deflate_dict_matches(field))
+			n->attrs2 |= NODE_A2_DEFLATE_DICT;
 	}
 
 	/*
@@ -7410,6 +7534,7 @@ check_protocol:
 				"%s"		/* Content-Type (if needed) */
 				"%s"		/* Accept-Encoding */
 				"%s"		/* Content-Encoding */
+				"%s"		/* X-Deflate-Dictionary */
 				"%s"		/* X-Ultrapeer-Needed */
 				"%s"		/* X-Query-Routing */
 				"%s"		/* X-Ultrapeer-Query-Routing */
@@ -7432,6 +7557,7 @@ check_protocol:
 				(GNET_PROPERTY(gnet_deflate_enabled)
 					&& (n->attrs & NODE_A_TX_DEFLATE)) ?
 						CONTENT_ENCODING_DEFLATE : "",
+				node_deflate_dict_header(),
 				settings_is_leaf() ? "" :
 				GNET_PROPERTY(node_ultra_count) < ultra_max
 					? "X-Ultrapeer-Needed: True\r\n"
@@ -10248,6 +10374,7 @@ node_init_outgoing(gnutella_node_t *n)
 				"X-Requeries: False\r\n"
 				"%s"		/* Upgrade: TLS/1.0 */
 				"%s"		/* Accept-Encoding: deflate */
+				"%s"		/* X-Deflate-Dictionary */
 				"X-Token: %s\r\n"
 				"X-Live-Since: %s\r\n"
 				"X-Ultrapeer: %s\r\n"
@@ -10265,6 +10392,7 @@ node_init_outgoing(gnutella_node_t *n)
 					UPGRADE_TLS : "",
 				GNET_PROPERTY(gnet_deflate_enabled) ?
 					ACCEPT_ENCODING_DEFLATE : "",
+				node_deflate_dict_header(),
 				tok_version(),
 				start_rfc822_date,
 				settings_is_leaf() ? "False" : "True",
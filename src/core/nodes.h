@@ -155,6 +155,7 @@ typedef struct gnutella_node {
 	uint8 hops_flow;			/**< Don't send queries with a >= hop count */
 	uint8 max_ttl;				/**< Value of their advertised X-Max-TTL */
 	uint16 degree;				/**< Value of their advertised X-Degree */
+	uint8 tx_deflate_level;		/**< Current TX compression level */
 
 	htable_t *qseen;			/**< Queries seen from this leaf node */
 	hset_t *qrelayed;			/**< Queries relayed from this node */
@@ -259,6 +260,7 @@ typedef struct gnutella_node {
 
 	uint64 tx_given;		/**< Bytes fed to the TX stack (from top) */
 	uint64 tx_deflated;		/**< Bytes deflated by the TX stack */
+	uint64 tx_deflate_ns;	/**< Time spent deflating (ns) by the TX stack */
 	uint64 tx_written;		/**< Bytes written by the TX stack */
 
 	uint64 rx_given;		/**< Bytes fed to the RX stack (from bottom) */
@@ -367,6 +369,7 @@ enum {
  * Second attributes.
  */
 enum {
+	NODE_A2_DEFLATE_DICT= 1 << 11,	/**< Same preset deflate dictionary */
 	NODE_A2_G2_HUB		= 1 << 10,	/**< Node is a G2 hub */
 	NODE_A2_SWITCH_TLS	= 1 << 9,	/**< Node will switch to TLS */
 	NODE_A2_UPGRADE_TLS	= 1 << 8,	/**< Node wants to upgrade to TLS */
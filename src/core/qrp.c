@@ -76,9 +76,11 @@
 #include "lib/spinlock.h"
 #include "lib/str.h"
 #include "lib/stringify.h"
+#include "lib/thread.h"
 #include "lib/tm.h"
 #include "lib/unsigned.h"
 #include "lib/utf8.h"
+#include "lib/vmm.h"
 #include "lib/walloc.h"
 #include "lib/wordvec.h"
 #include "lib/zlib_util.h"
@@ -497,6 +499,43 @@ qrt_patch_slot(struct routing_table *rt, uint i, uint8 v)
 	}
 }
 
+/**
+ * Allocate a zeroed arena of ``len'' bytes holding one byte per slot, for a
+ * table that is not compacted yet or for the slot counts of the local table.
+ *
+ * Such arenas reach 2 MiB for the largest tables.  The slot counts are hit
+ * at random by the hashed substrings and the tables are swept several times
+ * whilst they are filled, merged and compacted, hence these arenas are
+ * backed by huge pages when they are large enough.
+ *
+ * @return arena to be freed with qrp_arena_free().
+ */
+static void *
+qrp_arena_alloc(size_t len)
+{
+	return vmm_huge_size(len) ? vmm_alloc_huge(len) : halloc0(len);
+}
+
+/**
+ * Free arena of ``len'' bytes allocated by qrp_arena_alloc().
+ */
+static void
+qrp_arena_free(void *arena, size_t len)
+{
+	if (vmm_huge_size(len))
+		vmm_free_huge(arena, len);
+	else
+		hfree(arena);
+}
+
+#define QRP_ARENA_FREE_NULL(p, len) \
+G_STMT_START { \
+	if (p) { \
+		qrp_arena_free((p), (len)); \
+		p = NULL; \
+	} \
+} G_STMT_END
+
 /**
  * Compact routing table in place so that only one bit of information is used
  * per entry, reducing memory requirements by a factor of 8.
@@ -556,7 +595,7 @@ qrt_compact(struct routing_table *rt)
 	 * Install new compacted arena in place of the non-compacted one.
 	 */
 
-	HFREE_NULL(rt->arena);
+	QRP_ARENA_FREE_NULL(rt->arena, rt->slots);
 	rt->arena = (uchar *) narena;
 	rt->len = nsize;
 	rt->compacted = TRUE;
@@ -861,12 +900,12 @@ qrt_diff_1(struct routing_table *old, struct routing_table *new, bool reverse)
 enum qrt_compress_magic {
 	QRT_COMPRESS_MAGIC = 0x4bb0a7ac
 };
-#define QRT_TICK_CHUNK		256			/**< Chunk size per tick */
 
 struct qrt_compress_context {
 	enum qrt_compress_magic magic;	/**< Magic number */
 	struct routing_patch *rp;		/**< Routing table being compressed */
-	zlib_deflater_t *zd;			/**< Incremental deflater */
+	zlib_deflater_t *zd;			/**< Deflater */
+	int status;						/**< Deflating status */
 	bgdone_cb_t usr_done;			/**< User-defined callback */
 	void *usr_arg;					/**< Arg for user-defined callback */
 	uint allocated:1;				/**< Whether context was allocated */
@@ -902,73 +941,83 @@ qrt_compress_free(void *u)
 }
 
 /**
- * Perform incremental compression.
+ * Compress the whole patch, from the thread pool.
  */
-static bgret_t
-qrt_step_compress(struct bgtask *h, void *u, int ticks)
+static void
+qrt_compress_deflate(void *u, size_t unused_idx)
 {
 	struct qrt_compress_context *ctx = u;
-	int ret;
-	int chunklen;
-	int status = 0;
 
+	(void) unused_idx;
 	g_assert(ctx->magic == QRT_COMPRESS_MAGIC);
 
-	chunklen = ticks * QRT_TICK_CHUNK;
+	ctx->status = zlib_deflate_all(ctx->zd);
+}
 
-	if (qrp_debugging(4)) {
-		g_debug("QRP qrt_step_compress: ticks = %d => chunk = %d bytes",
-			ticks, chunklen);
-	}
+/**
+ * Perform compression.
+ *
+ * Compression is CPU-intensive, hence it runs in the thread pool, where
+ * patches for several nodes can be compressed concurrently.
+ */
+static bgret_t
+qrt_step_compress(struct bgtask *h, void *u, int unused_ticks)
+{
+	struct qrt_compress_context *ctx = u;
 
-	ret = zlib_deflate(ctx->zd, chunklen);
+	(void) unused_ticks;
+	g_assert(ctx->magic == QRT_COMPRESS_MAGIC);
 
-	switch (ret) {
-	case -1:					/* Error occurred */
-		status = -1;
-		goto done;
-		/* NOTREACHED */
-	case 0:						/* Finished */
-		/*
-		 * Install compressed routing patch if it's smaller than the original.
-		 */
+	return bg_task_parallel(h, qrt_compress_deflate, 1);
+}
 
-		if (qrp_debugging(1)) {
-			g_debug(
-				"QRP %s %p: len=%d, compressed=%d (ratio %.2f%%)",
-				qrp_patch_to_string(ctx->rp), ctx->rp, ctx->rp->len,
-				zlib_deflater_outlen(ctx->zd),
-				100.0 * (ctx->rp->len - zlib_deflater_outlen(ctx->zd)) /
-					ctx->rp->len);
-		}
+/**
+ * Install compressed patch.
+ */
+static bgret_t
+qrt_step_compress_install(struct bgtask *h, void *u, int unused_ticks)
+{
+	struct qrt_compress_context *ctx = u;
+
+	(void) unused_ticks;
+	g_assert(ctx->magic == QRT_COMPRESS_MAGIC);
 
-		if (zlib_deflater_outlen(ctx->zd) < ctx->rp->len) {
-			struct routing_patch *rp = ctx->rp;
+	if (-1 == ctx->status)
+		bg_task_exit(h, -1);
 
-			g_assert(ROUTING_PATCH_MAGIC == rp->magic);
-			HFREE_NULL(rp->arena);
-			rp->len = zlib_deflater_outlen(ctx->zd);
-			rp->arena = hcopy(zlib_deflater_out(ctx->zd), rp->len);
-			rp->compressed = TRUE;
-		}
-		zlib_deflater_free(ctx->zd, TRUE);
-		ctx->zd = NULL;
-		goto done;
-		/* NOTREACHED */
-	case 1:						/* More work required */
-		break;
-	default:
-		g_assert_not_reached();	/* Bug in zlib_deflate() */
+	/*
+	 * Install compressed routing patch if it's smaller than the original.
+	 */
+
+	if (qrp_debugging(1)) {
+		g_debug(
+			"QRP %s %p: len=%d, compressed=%d (ratio %.2f%%)",
+			qrp_patch_to_string(ctx->rp), ctx->rp, ctx->rp->len,
+			zlib_deflater_outlen(ctx->zd),
+			100.0 * (ctx->rp->len - zlib_deflater_outlen(ctx->zd)) /
+				ctx->rp->len);
 	}
 
-	return BGR_MORE;		/* More work required */
+	if (zlib_deflater_outlen(ctx->zd) < ctx->rp->len) {
+		struct routing_patch *rp = ctx->rp;
 
-done:
-	bg_task_exit(h, status);
+		g_assert(ROUTING_PATCH_MAGIC == rp->magic);
+		HFREE_NULL(rp->arena);
+		rp->len = zlib_deflater_outlen(ctx->zd);
+		rp->arena = hcopy(zlib_deflater_out(ctx->zd), rp->len);
+		rp->compressed = TRUE;
+	}
+	zlib_deflater_free(ctx->zd, TRUE);
+	ctx->zd = NULL;
 
-	return BGR_ERROR;		/* Not reached */
+	return BGR_DONE;
 }
 
+static bgstep_cb_t qrt_compress_steps[] = {
+	qrt_step_compress,
+	qrt_step_compress_install,
+};
+
 /**
  * Called when the compress task is finished.
  *
@@ -1023,7 +1072,6 @@ qrt_patch_compress(struct routing_patch *rp, bgtask_t *bt,
 	struct qrt_compress_context *ctx;
 	zlib_deflater_t *zd;
 	struct bgtask *task;
-	bgstep_cb_t step = qrt_step_compress;
 
 	g_assert(rp != NULL);
 	g_assert(ROUTING_PATCH_MAGIC == rp->magic);
@@ -1035,8 +1083,8 @@ qrt_patch_compress(struct routing_patch *rp, bgtask_t *bt,
 
 	/*
 	 * Because compression is possibly a CPU-intensive operation, it
-	 * is dealt with a background task that will be scheduled at regular
-	 * intervals.
+	 * is dealt with a background task that runs the compression in the
+	 * thread pool.
 	 */
 
 	if (NULL == cp) {
@@ -1054,7 +1102,8 @@ qrt_patch_compress(struct routing_patch *rp, bgtask_t *bt,
 	ctx->usr_arg = arg;
 
 	task = bg_task_create_stopped(NULL, "QRP patch compression",
-		&step, 1, ctx, qrt_compress_free, qrt_patch_compress_done, bt);
+		qrt_compress_steps, N_ITEMS(qrt_compress_steps),
+		ctx, qrt_compress_free, qrt_patch_compress_done, bt);
 
 	return task;		/* Can be NULL if bg task layer was shutdown already */
 }
@@ -1062,6 +1111,8 @@ qrt_patch_compress(struct routing_patch *rp, bgtask_t *bt,
 /**
  * Create a new query routing table, with supplied `arena' and `slots'.
  * The value used for infinity is given as `max'.
+ *
+ * The arena, allocated with qrp_arena_alloc(), is owned by the table.
  */
 static struct routing_table *
 qrt_create(const char *name, char *arena, int slots, int max)
@@ -1113,7 +1164,7 @@ qrt_empty_table(const char *name)
 {
 	char *arena;
 
-	arena = halloc(EMPTY_TABLE_SIZE);
+	arena = qrp_arena_alloc(EMPTY_TABLE_SIZE);
 	memset(arena, LOCAL_INFINITY, EMPTY_TABLE_SIZE);
 
 	return qrt_create(name, arena, EMPTY_TABLE_SIZE, LOCAL_INFINITY);
@@ -1142,6 +1193,9 @@ qrt_free(struct routing_table *rt)
  * Shrink arena inplace to use only `new_slots' instead of `old_slots'.
  * The memory area is also shrunk and the new location of the arena is
  * returned.
+ *
+ * The arena must have been allocated with qrp_arena_alloc(): since huge
+ * page regions cannot be resized, the shrunk data is moved to a new arena.
  */
 static void *
 qrt_shrink_arena(char *arena, int old_slots, int new_slots, int inf_val)
@@ -1149,6 +1203,7 @@ qrt_shrink_arena(char *arena, int old_slots, int new_slots, int inf_val)
 	int factor;		/* Shrink factor */
 	int ratio;
 	int i, j;
+	char *narena;
 
 	g_assert(old_slots > new_slots);
 	g_assert(is_pow2(old_slots));
@@ -1177,7 +1232,11 @@ qrt_shrink_arena(char *arena, int old_slots, int new_slots, int inf_val)
 		arena[i] = set ? 0 : inf_val;
 	}
 
-	return hrealloc(arena, new_slots);
+	narena = qrp_arena_alloc(new_slots);
+	memcpy(narena, arena, new_slots);
+	qrp_arena_free(arena, old_slots);
+
+	return narena;
 }
 
 /**
@@ -1273,11 +1332,26 @@ enum merge_magic {
 	MERGE_MAGIC	= 0x639ee39eU
 };
 
+#define MERGE_CHUNK_SLOTS	65536	/* Arena slots merged by each sub-step */
+
+/*
+ * Received tables are patched and relocated in place, hence we merge private
+ * copies of their compacted arena.
+ */
+struct merge_table {
+	uint8 *arena;				/* Copy of the compacted arena */
+	int slots;					/* Amount of slots in table */
+};
+
 struct merge_context {
 	enum merge_magic magic;
 	pslist_t *tables;			/* Leaf routing tables */
+	struct merge_table *copies;	/* Copies of leaf routing tables */
+	size_t count;				/* Amount of copies */
+	size_t capacity;			/* Allocated size of the `copies' array */
 	uchar *arena;				/* Working arena (not compacted) */
 	int slots;					/* Amount of slots used for merged table */
+	int chunk;					/* Amount of slots merged by sub-steps */
 };
 
 static struct merge_context *merge_ctx;
@@ -1307,7 +1381,11 @@ merge_context_free(void *p)
 	}
 	pslist_free_null(&ctx->tables);
 
-	HFREE_NULL(ctx->arena);
+	while (ctx->count != 0)
+		HFREE_NULL(ctx->copies[--ctx->count].arena);
+	HFREE_NULL(ctx->copies);
+
+	QRP_ARENA_FREE_NULL(ctx->arena, ctx->slots);
 	ctx->magic = 0;
 	WFREE(ctx);
 }
@@ -1372,28 +1450,38 @@ mrg_step_get_list(struct bgtask *unused_h, void *u, int unused_ticks)
 
 	ctx->slots = max_size;
 	if (max_size > 0) {
-		ctx->arena = halloc(max_size);
+		ctx->arena = qrp_arena_alloc(max_size);
 		memset(ctx->arena, LOCAL_INFINITY, max_size);
+		ctx->chunk = MIN(max_size, MERGE_CHUNK_SLOTS);
 	}
 
+	ctx->capacity = pslist_length(ctx->tables);
+	HALLOC_ARRAY(ctx->copies, ctx->capacity);
+
 	return BGR_NEXT;
 }
 
 /**
- * Merge routing table into specified arena.
+ * Merge routing table into specified arena range.
+ *
+ * The range bounds must be multiples of a power of 2, so that each byte of
+ * the table either falls entirely within the range or covers all of it.
  *
- * @param rt is the routing table to merge
+ * @param rt is the copy of the routing table to merge
  * @param arena is a non-compacted arena
  * @param slots is the number of slots in the arena
+ * @param start is the first arena slot to update
+ * @param end is the first arena slot past the range to update
  */
 static void
-merge_table_into_arena(struct routing_table *rt, uchar *arena, int slots)
+merge_table_into_arena(const struct merge_table *rt, uchar *arena, int slots,
+	int start, int end)
 {
 	int ratio;
 	int expand;
 	int i;
 	int b;
-	int bytes;
+	int first, last;
 
 	/*
 	 * By construction, the size of the arena is the max of all the sizes
@@ -1402,7 +1490,6 @@ merge_table_into_arena(struct routing_table *rt, uchar *arena, int slots)
 	 */
 
 	g_assert(rt->slots <= slots);
-	g_assert(rt->compacted);
 	g_assert(is_pow2(slots));
 	g_assert(is_pow2(rt->slots));
 	g_assert(rt->slots >= 8);
@@ -1412,9 +1499,33 @@ merge_table_into_arena(struct routing_table *rt, uchar *arena, int slots)
 	g_assert(ratio >= 0);
 
 	expand = 1 << ratio;
-	bytes = rt->slots / 8;
 
 	g_assert(rt->slots * expand <= slots);	/* Won't overflow */
+	g_assert(start >= 0 && start < end && end <= slots);
+
+	/*
+	 * When a byte of the table covers more than the whole range, which
+	 * only happens with very small tables, go through each slot.
+	 */
+
+	if (8 * expand > end - start) {
+		for (i = start / expand; i * expand < end; i++) {
+			if (rt->arena[i >> 3] & (0x80 >> (i & 0x7))) {
+				int from = MAX(i * expand, start);
+				int to = MIN((i + 1) * expand, end);
+
+				/* 0 is less than "infinity" => indicates presence */
+				memset(&arena[from], 0, to - from);
+			}
+		}
+		return;
+	}
+
+	g_assert(0 == start % (8 * expand));
+	g_assert(0 == end % (8 * expand));
+
+	first = start / (8 * expand);
+	last = end / (8 * expand);
 
 	/*
 	 * Loop over the supplied QRT, and expand each slot `expand' times into
@@ -1428,7 +1539,7 @@ merge_table_into_arena(struct routing_table *rt, uchar *arena, int slots)
 	 */
 
 #define RT_FOR_EACH_BIT_SET(ON_CHANGE)				\
-for (b = 0, i = 0; b < bytes; b++) {				\
+for (b = first, i = first * 8; b < last; b++) {	\
 	uint8 entry = rt->arena[b];						\
 	unsigned mask = 0x80;							\
 													\
@@ -1501,10 +1612,10 @@ for (b = 0, i = 0; b < bytes; b++) {				\
 }
 
 /**
- * Merge next leaf QRT table if node is still there.
+ * Copy next leaf QRT table if node is still there.
  */
 static bgret_t
-mrg_step_merge_one(struct bgtask *unused_h, void *u, int ticks)
+mrg_step_copy_one(struct bgtask *unused_h, void *u, int ticks)
 {
 	struct merge_context *ctx = u;
 	int ticks_used = 0;
@@ -1531,7 +1642,14 @@ mrg_step_merge_one(struct bgtask *unused_h, void *u, int ticks)
 		 */
 
 		if (rt->refcnt > 1) {
-			merge_table_into_arena(rt, ctx->arena, ctx->slots);
+			struct merge_table *mt;
+
+			g_assert(rt->compacted);
+			g_assert(ctx->count < ctx->capacity);
+
+			mt = &ctx->copies[ctx->count++];
+			mt->arena = hcopy(rt->arena, rt->slots / 8);
+			mt->slots = rt->slots;
 			ticks_used++;
 		}
 
@@ -1541,6 +1659,45 @@ mrg_step_merge_one(struct bgtask *unused_h, void *u, int ticks)
 	return (ctx->tables == NULL) ? BGR_NEXT : BGR_MORE;
 }
 
+/**
+ * Merge all the copied tables into one chunk of the arena.
+ *
+ * Going through all the tables for each chunk keeps the chunk being updated
+ * in the CPU cache.
+ */
+static void
+mrg_merge_chunk(void *u, size_t idx)
+{
+	struct merge_context *ctx = u;
+	int start = idx * ctx->chunk;
+	size_t i;
+
+	g_assert(MERGE_MAGIC == ctx->magic);
+
+	for (i = 0; i < ctx->count; i++) {
+		merge_table_into_arena(&ctx->copies[i],
+			ctx->arena, ctx->slots, start, start + ctx->chunk);
+	}
+}
+
+/**
+ * Merge the copied tables into the arena, each chunk of the arena being
+ * updated from the thread pool.
+ */
+static bgret_t
+mrg_step_merge(struct bgtask *h, void *u, int unused_ticks)
+{
+	struct merge_context *ctx = u;
+
+	(void) unused_ticks;
+	g_assert(MERGE_MAGIC == ctx->magic);
+
+	if (0 == ctx->count)
+		return BGR_NEXT;
+
+	return bg_task_parallel(h, mrg_merge_chunk, ctx->slots / ctx->chunk);
+}
+
 /**
  * Create and install the table.
  */
@@ -1576,7 +1733,8 @@ mrg_step_install_table(struct bgtask *unused_h, void *u, int unused_ticks)
 
 static bgstep_cb_t merge_steps[] = {
 	mrg_step_get_list,
-	mrg_step_merge_one,
+	mrg_step_copy_one,
+	mrg_step_merge,
 	mrg_step_install_table,
 };
 
@@ -1667,6 +1825,7 @@ static struct {
 } buffer;
 
 static void qrp_cancel_computation(void);
+static void qrp_builder_discard(void);
 
 /**
  * This routine must be called to initialize the computation of the new QRP
@@ -1677,40 +1836,36 @@ qrp_prepare_computation(void)
 {
 	qrp_cancel_computation();			/* Cancel any running computation */
 
+	/*
+	 * A full recomputation invalidates the incremental builder: files may
+	 * be added or removed whilst we collect the words of the library.
+	 */
+
+	qrp_builder_discard();
+
 	if (buffer.arena == NULL) {
 		buffer.arena = halloc(DEFAULT_BUF_SIZE);
 		buffer.len = DEFAULT_BUF_SIZE;
 	}
 }
 
+typedef void (*qrp_word_cb_t)(const char *word, void *udata);
+
 /**
- * Add shared file to our QRP.
+ * Invoke callback on each word (and alias) making up the name of a file.
+ *
+ * The same file always yields the same words, in the same amount, which is
+ * what allows the incremental builder to count additions and removals
+ * symmetrically.
  */
-void
-qrp_add_file(const shared_file_t *sf, htable_t *words)
+static void
+qrp_file_foreach_word(const shared_file_t *sf, qrp_word_cb_t cb, void *udata)
 {
 	word_vec_t *wovec;
 	uint wocnt;
 	uint i;
 	char **aliases, **a;
 
-	g_assert(sf != NULL);
-	g_assert(words != NULL);
-
-	g_assert(utf8_is_valid_data(shared_file_name_nfc(sf),
-				shared_file_name_nfc_len(sf)));
-	g_assert(utf8_is_valid_data(shared_file_name_canonic(sf),
-				shared_file_name_canonic_len(sf)));
-
-	if (qrp_debugging(1)) {
-		bool completed = shared_file_is_finished(sf);
-		g_debug("QRP adding %sfile \"%s\"%s",
-			shared_file_is_partial(sf) ?
-				(completed ? "seeded " : "partial ") : "",
-			shared_file_name_canonic(sf),
-			shared_file_needs_aliasing(sf) ?  " (with aliases)" : "");
-	}
-
 	/*
 	 * The words in the QRP must be lowercased, but the pre-computed canonic
 	 * representation of the filename is already in lowercase form.
@@ -1721,32 +1876,12 @@ qrp_add_file(const shared_file_t *sf, htable_t *words)
 	if (0 == wocnt)
 		return;
 
-	/*
-	 * Identify unique words we have not already seen in `words'.
-	 */
-
 	for (i = 0; i < wocnt; i++) {
 		const char *word = wovec[i].word;
 
 		g_assert(word[0] != '\0');
 
-		/*
-		 * Record word if we haven't seen it yet.
-		 */
-
-		if (htable_contains(words, word)) {
-			continue;
-		} else {
-			size_t word_len = vstrlen(word);
-			size_t n = 1 + word_len;
-
-			htable_insert(words, wcopy(word, n), size_to_pointer(n));
-		}
-
-		if (qrp_debugging(8)) {
-			g_debug("new QRP word \"%s\" [from %s]",
-				word, shared_file_name_nfc(sf));
-		}
+		(*cb)(word, udata);
 	}
 
 	word_vec_free(wovec, wocnt);
@@ -1763,24 +1898,58 @@ qrp_add_file(const shared_file_t *sf, htable_t *words)
 	g_assert(NULL != aliases);		/* Normalized form is different */
 
 	for (a = aliases; *a != NULL; a++) {
-		const char *word = *a;
+		(*cb)(*a, udata);
+	}
 
-		if (htable_contains(words, word)) {
-			continue;
-		} else {
-			size_t word_len = vstrlen(word);
-			size_t n = 1 + word_len;
+	h_strfreev(aliases);
+}
 
-			htable_insert(words, wcopy(word, n), size_to_pointer(n));
-		}
+/**
+ * Record word in the `words' table, counting how many times we saw it.
+ */
+static void
+qrp_word_record(const char *word, void *udata)
+{
+	htable_t *words = udata;
+	const void *key;
+	void *value;
 
-		if (qrp_debugging(8)) {
-			g_debug("new QRP word \"%s\" [alias from %s]",
-				word, shared_file_name_nfc(sf));
-		}
+	if (htable_lookup_extended(words, word, &key, &value)) {
+		htable_insert_const(words, key,
+			uint_to_pointer(1 + pointer_to_uint(value)));
+		return;
 	}
 
-	h_strfreev(aliases);
+	htable_insert(words, wcopy(word, 1 + vstrlen(word)), uint_to_pointer(1));
+
+	if (qrp_debugging(8))
+		g_debug("new QRP word \"%s\"", word);
+}
+
+/**
+ * Add shared file to our QRP.
+ */
+void
+qrp_add_file(const shared_file_t *sf, htable_t *words)
+{
+	g_assert(sf != NULL);
+	g_assert(words != NULL);
+
+	g_assert(utf8_is_valid_data(shared_file_name_nfc(sf),
+				shared_file_name_nfc_len(sf)));
+	g_assert(utf8_is_valid_data(shared_file_name_canonic(sf),
+				shared_file_name_canonic_len(sf)));
+
+	if (qrp_debugging(1)) {
+		bool completed = shared_file_is_finished(sf);
+		g_debug("QRP adding %sfile \"%s\"%s",
+			shared_file_is_partial(sf) ?
+				(completed ? "seeded " : "partial ") : "",
+			shared_file_name_canonic(sf),
+			shared_file_needs_aliasing(sf) ?  " (with aliases)" : "");
+	}
+
+	qrp_file_foreach_word(sf, qrp_word_record, words);
 }
 
 /*
@@ -1790,54 +1959,32 @@ qrp_add_file(const shared_file_t *sf, htable_t *words)
 static void
 free_word(const void *key, void *value, void *unused_udata)
 {
-	g_assert(size_is_positive(pointer_to_size(value)));
+	g_assert(pointer_to_uint(value) != 0);
 
 	(void) unused_udata;
-	wfree(deconstify_pointer(key), pointer_to_size(value));
+	wfree(deconstify_pointer(key), 1 + vstrlen(key));
 }
 
-struct unique_substrings {		/* User data for unique_subtr() callback */
-	hset_t *unique;
-	pslist_t *head;
-};
-
-static inline void
-insert_substr(struct unique_substrings *u, const char *word, size_t size)
-{
-	if (!hset_contains(u->unique, word)) {
-		void *s;
-
-		s = wcopy(word, size);
-		hset_insert(u->unique, s);
-		u->head = pslist_prepend(u->head, s);
-	}
-}
+typedef void (*qrp_substr_cb_t)(const char *s, size_t size, void *udata);
 
 /**
- * Iteration callback on the hashtable containing keywords.
+ * Invoke callback on all the substrings of word that we insert in the QRP,
+ * all anchored at the start, whose length range from QRP_MIN_WORD_LENGTH
+ * to the word length.
  */
 static void
-unique_substr(const void *key, void *value, void *udata)
+qrp_foreach_substring(const char *word, qrp_substr_cb_t cb, void *udata)
 {
-	struct unique_substrings *u = udata;
-	const char *word = key;
 	char *s;
 	size_t len, size, i;
 
-	g_assert(size_is_positive(pointer_to_size(value)));
-
-	/*
-	 * Add all unique (i.e. not already seen) substrings from word, all
-	 * anchored at the start, whose length range from 3 to the word length.
-	 */
-
-	size = pointer_to_size(value);
+	size = 1 + vstrlen(word);
 	s = wcopy(word, size);
 	len = size - 1;				/* Trailing NUL included in size */
 
 	for (i = 0; i <= QRP_MAX_CUT_CHARS; i++) {
 
-		insert_substr(u, s, len + 1);
+		(*cb)(s, len + 1, udata);
 
 		while (len > QRP_MIN_WORD_LENGTH) {
 			uint retlen;
@@ -1854,22 +2001,63 @@ unique_substr(const void *key, void *value, void *udata)
 	WFREE_NULL(s, size);
 }
 
+struct unique_substrings {		/* User data for unique_subtr() callback */
+	htable_t *unique;
+	pslist_t *head;
+};
+
+/**
+ * Substring callback, counting how many words produce each substring.
+ */
+static void
+insert_substr(const char *word, size_t size, void *udata)
+{
+	struct unique_substrings *u = udata;
+	const void *key;
+	void *value;
+
+	if (htable_lookup_extended(u->unique, word, &key, &value)) {
+		htable_insert_const(u->unique, key,
+			uint_to_pointer(1 + pointer_to_uint(value)));
+	} else {
+		void *s;
+
+		s = wcopy(word, size);
+		htable_insert(u->unique, s, uint_to_pointer(1));
+		u->head = pslist_prepend(u->head, s);
+	}
+}
+
+/**
+ * Iteration callback on the hashtable containing keywords.
+ */
+static void
+unique_substr(const void *key, void *value, void *udata)
+{
+	g_assert(pointer_to_uint(value) != 0);
+
+	qrp_foreach_substring(key, insert_substr, udata);
+}
+
 /**
  * Create a list of all unique substrings at least QRP_MIN_WORD_LENGTH long,
- * from words held in `ht' (keys are words, values are the word's length plus
- * the trailing NUL).
+ * from words held in `ht' (keys are words, values are the amount of times
+ * each word was seen).
+ *
+ * The substrings are owned by the table returned in `subs', which maps each
+ * of them to the amount of words yielding it.  The list only refers to them.
  *
  * @returns created list, and count in `retcount'.
  */
 static pslist_t *
-unique_substrings(htable_t *ht, int *retcount)
+unique_substrings(htable_t *ht, htable_t **subs, int *retcount)
 {
 	struct unique_substrings u = { NULL, NULL };		/* Callback args */
 
-	u.unique = hset_create(HASH_KEY_STRING, 0);
+	u.unique = htable_create(HASH_KEY_STRING, 0);
 	htable_foreach(ht, unique_substr, &u);
-	*retcount = hset_count(u.unique);
-	hset_free_null(&u.unique);		/* Created words ref'ed by u.head */
+	*retcount = htable_count(u.unique);
+	*subs = u.unique;
 
 	return u.head;
 }
@@ -1893,10 +2081,13 @@ struct qrp_context {
 	struct routing_patch **rpp;	/**< Points to routing patch variable to fill */
 	pslist_t *sl_substrings;	/**< List of all substrings */
 	htable_t *words;			/**< Words making up the files */
+	htable_t *subs;				/**< Substrings, owning the list items */
+	uint8 *counts;				/**< Per-slot substring counts */
 	bgtask_t *compress_bt;		/**< Task launched to compress patch */
 	int substrings;				/**< Amount of substrings */
 	char *table;				/**< Computed routing table */
 	int slots;					/**< Amount of slots in table */
+	int filled;					/**< Amount of non-empty slots */
 	struct routing_table *rt;	/**< The routing table object we computed */
 	struct routing_table *st;	/**< Smaller table */
 	struct routing_table *lt;	/**< Larger table for merging (destination) */
@@ -1910,6 +2101,44 @@ struct qrp_context {
 static struct bgtask *qrp_comp;	/**< Background computation handle */
 static struct bgtask *qrp_merge;/**< Background merging handle */
 
+enum qrp_builder_magic { QRP_BUILDER_MAGIC = 0x7c1f2e6bU };
+
+/**
+ * Incremental builder for the local table.
+ *
+ * It keeps what the last full computation derived from the library: how many
+ * times each word was seen, how many words yield each substring and how many
+ * substrings hash to each slot.  Adding or removing a file then only touches
+ * the slots of the substrings that appear or disappear.
+ *
+ * Slot counters saturate at 255 and then stick: such a slot is never cleared
+ * again, which only leaves a false positive until the next full computation.
+ *
+ * The builder is only valid between two full computations and is accessed
+ * under the QRP_TASK_LOCK.
+ */
+struct qrp_builder {
+	enum qrp_builder_magic magic;
+	htable_t *words;		/**< word -> amount of references */
+	htable_t *subs;			/**< substring -> amount of words yielding it */
+	uint8 *counts;			/**< Per-slot substring counts (saturating) */
+	int bits;				/**< Table size, in bits */
+	int slots;				/**< Amount of slots, 1 << bits */
+	int filled;				/**< Amount of non-zero slots */
+	int changes;			/**< Slots which flipped during an update */
+};
+
+static struct qrp_builder *qrp_builder;
+
+#define QRP_SLOT_STICKY		MAX_INT_VAL(uint8)
+
+static inline void
+qrp_builder_check(const struct qrp_builder * const b)
+{
+	g_assert(b != NULL);
+	g_assert(QRP_BUILDER_MAGIC == b->magic);
+}
+
 /**
  * Free the "seen words" hash table we're filling up in qrp_add_file()
  * and perusing in qrp_finalize_computation(), then nullify pointer.
@@ -1932,23 +2161,15 @@ static void
 qrp_context_free(void *p)
 {
 	struct qrp_context *ctx = p;
-	pslist_t *sl;
 
 	g_assert(ctx->magic == QRP_MAGIC);
 
 	qrp_dispose_words(&ctx->words);
+	pslist_free_null(&ctx->sl_substrings);	/* Items owned by ctx->subs */
+	qrp_dispose_words(&ctx->subs);
 
-	PSLIST_FOREACH(ctx->sl_substrings, sl) {
-		char *word = sl->data;
-		size_t size;
-
-		size = 1 + vstrlen(word);
-		g_assert(size_is_positive(size));
-		wfree(word, size);
-	}
-	pslist_free_null(&ctx->sl_substrings);
-
-	HFREE_NULL(ctx->table);
+	QRP_ARENA_FREE_NULL(ctx->table, ctx->slots);
+	QRP_ARENA_FREE_NULL(ctx->counts, ctx->slots);
 
 	if (ctx->rt)
 		qrt_unref(ctx->rt);
@@ -1961,6 +2182,212 @@ qrp_context_free(void *p)
 	WFREE(ctx);
 }
 
+/**
+ * Free incremental builder and nullify its pointer.
+ */
+static void
+qrp_builder_free_null(struct qrp_builder **b_ptr)
+{
+	struct qrp_builder *b = *b_ptr;
+
+	if (b != NULL) {
+		qrp_builder_check(b);
+
+		qrp_dispose_words(&b->words);
+		qrp_dispose_words(&b->subs);
+		QRP_ARENA_FREE_NULL(b->counts, b->slots);
+		b->magic = 0;
+		WFREE(b);
+		*b_ptr = NULL;
+	}
+}
+
+/**
+ * Discard the incremental builder, if any.
+ */
+static void
+qrp_builder_discard(void)
+{
+	QRP_TASK_LOCK;
+	qrp_builder_free_null(&qrp_builder);
+	QRP_TASK_UNLOCK;
+}
+
+/**
+ * Expand per-slot counts into a routing table arena.
+ *
+ * @return new arena, to be freed with qrp_arena_free().
+ */
+static char *
+qrp_counts_to_table(const uint8 *counts, int slots)
+{
+	char *table;
+	int i;
+
+	table = qrp_arena_alloc(slots);
+
+	for (i = 0; i < slots; i++) {
+		table[i] = 0 == counts[i] ? LOCAL_INFINITY : 1;
+	}
+
+	return table;
+}
+
+/**
+ * Substring callback: account for a new substring in the builder.
+ */
+static void
+qrp_builder_substr_ref(const char *word, size_t size, void *udata)
+{
+	struct qrp_builder *b = udata;
+	const void *key;
+	void *value;
+	uint idx;
+
+	if (htable_lookup_extended(b->subs, word, &key, &value)) {
+		htable_insert_const(b->subs, key,
+			uint_to_pointer(1 + pointer_to_uint(value)));
+		return;
+	}
+
+	htable_insert(b->subs, wcopy(word, size), uint_to_pointer(1));
+
+	idx = qrp_hash(word, b->bits);
+
+	if (0 == b->counts[idx]) {
+		b->filled++;
+		b->changes++;
+	}
+	if (b->counts[idx] != QRP_SLOT_STICKY)
+		b->counts[idx]++;
+}
+
+/**
+ * Substring callback: account for a substring no longer needed by a word.
+ */
+static void
+qrp_builder_substr_unref(const char *word, size_t unused_size, void *udata)
+{
+	struct qrp_builder *b = udata;
+	const void *key;
+	void *value;
+	uint n, idx;
+
+	(void) unused_size;
+
+	if (!htable_lookup_extended(b->subs, word, &key, &value)) {
+		g_carp("%s(): unknown substring \"%s\"", G_STRFUNC, word);
+		return;
+	}
+
+	n = pointer_to_uint(value);
+	g_assert(n != 0);
+
+	if (n > 1) {
+		htable_insert_const(b->subs, key, uint_to_pointer(n - 1));
+		return;
+	}
+
+	htable_remove(b->subs, key);
+	wfree(deconstify_pointer(key), 1 + vstrlen(key));
+
+	idx = qrp_hash(word, b->bits);
+
+	g_assert(b->counts[idx] != 0);
+
+	if (QRP_SLOT_STICKY == b->counts[idx])
+		return;
+
+	if (0 == --b->counts[idx]) {
+		b->filled--;
+		b->changes++;
+	}
+}
+
+/**
+ * Word callback: account for a word from a file added to the library.
+ */
+static void
+qrp_builder_word_ref(const char *word, void *udata)
+{
+	struct qrp_builder *b = udata;
+	const void *key;
+	void *value;
+	char *w;
+
+	if (htable_lookup_extended(b->words, word, &key, &value)) {
+		htable_insert_const(b->words, key,
+			uint_to_pointer(1 + pointer_to_uint(value)));
+		return;
+	}
+
+	w = wcopy(word, 1 + vstrlen(word));
+	htable_insert(b->words, w, uint_to_pointer(1));
+	qrp_foreach_substring(w, qrp_builder_substr_ref, b);
+}
+
+/**
+ * Word callback: account for a word from a file removed from the library.
+ */
+static void
+qrp_builder_word_unref(const char *word, void *udata)
+{
+	struct qrp_builder *b = udata;
+	const void *key;
+	void *value;
+	uint n;
+
+	if (!htable_lookup_extended(b->words, word, &key, &value)) {
+		g_carp("%s(): unknown word \"%s\"", G_STRFUNC, word);
+		return;
+	}
+
+	n = pointer_to_uint(value);
+	g_assert(n != 0);
+
+	if (n > 1) {
+		htable_insert_const(b->words, key, uint_to_pointer(n - 1));
+		return;
+	}
+
+	htable_remove(b->words, key);
+	qrp_foreach_substring(key, qrp_builder_substr_unref, b);
+	wfree(deconstify_pointer(key), 1 + vstrlen(key));
+}
+
+/**
+ * Install a new incremental builder from the state of the full computation
+ * held in the context, provided the computing task was not superseded.
+ *
+ * The builder takes ownership of the words, substrings and slot counts.
+ */
+static void
+qrp_builder_install(bgtask_t *bt, struct qrp_context *ctx, int bits)
+{
+	struct qrp_builder *b;
+
+	QRP_TASK_LOCK;
+
+	if (qrp_comp == bt) {
+		qrp_builder_free_null(&qrp_builder);
+
+		WALLOC0(b);
+		b->magic = QRP_BUILDER_MAGIC;
+		b->words = ctx->words;
+		b->subs = ctx->subs;
+		b->counts = ctx->counts;
+		b->bits = bits;
+		b->slots = ctx->slots;
+		b->filled = ctx->filled;
+
+		ctx->words = ctx->subs = NULL;
+		ctx->counts = NULL;
+		qrp_builder = b;
+	}
+
+	QRP_TASK_UNLOCK;
+}
+
 /**
  * Called when the QRP recomputation is done to free the context.
  */
@@ -2017,8 +2444,8 @@ qrp_step_substring(struct bgtask *unused_h, void *u, int unused_ticks)
 	g_assert(ctx->magic == QRP_MAGIC);
 	g_assert(ctx->words != NULL);
 
-	ctx->sl_substrings = unique_substrings(ctx->words, &ctx->substrings);
-	qrp_dispose_words(&ctx->words);
+	ctx->sl_substrings =
+		unique_substrings(ctx->words, &ctx->subs, &ctx->substrings);
 
 	if (qrp_debugging(1))
 		g_debug("QRP unique subwords: %d", ctx->substrings);
@@ -2065,6 +2492,7 @@ qrp_step_compute(struct bgtask *h, void *u, int unused_ticks)
 {
 	struct qrp_context *ctx = u;
 	char *table = NULL;
+	uint8 *counts;
 	int slots;
 	int bits;
 	const pslist_t *sl;
@@ -2088,8 +2516,13 @@ qrp_step_compute(struct bgtask *h, void *u, int unused_ticks)
 
 	upper_thresh = MIN_SPARSE_RATIO * slots;
 
-	table = halloc(slots);
-	memset(table, LOCAL_INFINITY, slots);
+	/*
+	 * We count the substrings hashing to each slot so that the table we
+	 * keep can be incrementally updated afterwards, without rehashing the
+	 * whole set of substrings.
+	 */
+
+	counts = qrp_arena_alloc(slots);
 
 	PSLIST_FOREACH(ctx->sl_substrings, sl) {
 		const char *word = sl->data;
@@ -2097,12 +2530,13 @@ qrp_step_compute(struct bgtask *h, void *u, int unused_ticks)
 
 		hashed++;
 
-		if (table[idx] == LOCAL_INFINITY) {
-			table[idx] = 1;
+		if (0 == counts[idx]) {
 			filled++;
 			if (qrp_debugging(7))
 				g_debug("QRP added subword: \"%s\"", word);
 		}
+		if (counts[idx] != QRP_SLOT_STICKY)
+			counts[idx]++;
 
 		/*
 		 * We won't be removing the slot we already filled, so if we
@@ -2146,6 +2580,18 @@ qrp_step_compute(struct bgtask *h, void *u, int unused_ticks)
 		gnet_prop_set_guint32_val(PROP_QRP_CONFLICT_RATIO,
 			(uint32) conflict_ratio);
 
+		/*
+		 * Keep the counts to incrementally update the table later on,
+		 * even if it turns out to be the same as the one we had: the
+		 * words may still have changed.
+		 */
+
+		table = qrp_counts_to_table(counts, slots);
+		ctx->counts = counts;
+		ctx->slots = slots;
+		ctx->filled = filled;
+		qrp_builder_install(h, ctx, bits);
+
 		/*
 		 * If we had already a table, compare it to the one we just built.
 		 * If they are identical, discard the new one.
@@ -2174,7 +2620,7 @@ qrp_step_compute(struct bgtask *h, void *u, int unused_ticks)
 					g_debug("QRP no change in table, keeping generation #%d",
 						routing_table->generation);
 				}
-				HFREE_NULL(table);
+				QRP_ARENA_FREE_NULL(table, slots);
 				bg_task_exit(h, 0);	/* Abort processing */
 			}
 		}
@@ -2184,12 +2630,11 @@ qrp_step_compute(struct bgtask *h, void *u, int unused_ticks)
 		 */
 
 		ctx->table = table;
-		ctx->slots = slots;
 
 		return BGR_NEXT;		/* Done! */
 	}
 
-	HFREE_NULL(table);
+	qrp_arena_free(counts, slots);
 
 	return BGR_MORE;			/* More work required */
 }
@@ -2472,7 +2917,7 @@ qrp_step_wait_for_merged_table(struct bgtask *h, void *u, int unused_ticks)
 
 	g_assert(ctx->table == NULL);
 
-	ctx->table = halloc(ctx->slots);
+	ctx->table = qrp_arena_alloc(ctx->slots);
 	memset(ctx->table, LOCAL_INFINITY, ctx->slots);
 
 	/* Ready for iterating */
@@ -2602,6 +3047,15 @@ static bgstep_cb_t qrp_compute_steps[] = {
 	qrp_step_install_ultra,
 };
 
+static bgstep_cb_t qrp_update_steps[] = {
+	qrp_step_create_table,
+	qrp_step_create_patches,
+	qrp_step_install_leaf,
+	qrp_step_wait_for_merged_table,
+	qrp_step_merge_with_leaves,
+	qrp_step_install_ultra,
+};
+
 static bgstep_cb_t qrp_merge_steps[] = {
 	qrp_step_wait_for_merged_table,
 	qrp_step_merge_with_leaves,
@@ -2680,6 +3134,149 @@ qrp_finalize_computation(htable_t *words)
 	QRP_TASK_UNLOCK;
 }
 
+/**
+ * Incrementally update the local table after files were added to or removed
+ * from the library since the last full computation.
+ *
+ * Only the slots of the substrings appearing or disappearing are updated.
+ * When no slot changed, nothing happens.  Otherwise the new table is
+ * installed and propagated through the same steps as a full computation.
+ *
+ * @param added		list of shared_file_t added to the library
+ * @param removed	list of shared_file_t removed from the library
+ *
+ * @return TRUE if the table was updated, FALSE if a full computation is
+ * required instead (no builder available or table needing to be resized).
+ */
+bool
+qrp_update_files(const pslist_t *added, const pslist_t *removed)
+{
+	struct qrp_context *ctx;
+	struct qrp_builder *b;
+	const pslist_t *sl;
+	char *table;
+	int slots, filled, changes, substrings, conflict_ratio;
+
+	g_assert(thread_is_main());
+
+	QRP_TASK_LOCK;
+
+	if (NULL == (b = qrp_builder)) {
+		QRP_TASK_UNLOCK;
+		return FALSE;
+	}
+
+	qrp_builder_check(b);
+
+	b->changes = 0;
+
+	PSLIST_FOREACH(added, sl) {
+		qrp_file_foreach_word(sl->data, qrp_builder_word_ref, b);
+	}
+
+	PSLIST_FOREACH(removed, sl) {
+		qrp_file_foreach_word(sl->data, qrp_builder_word_unref, b);
+	}
+
+	slots = b->slots;
+	filled = b->filled;
+	changes = b->changes;
+	substrings = htable_count(b->subs);
+
+	conflict_ratio = 0 == substrings ? 0 :
+		(int) (100.0 * (substrings - filled) / substrings);
+
+	if (qrp_debugging(1)) {
+		g_debug("QRP incremental update (+%zu/-%zu files): size=%d, "
+			"filled=%d, flipped=%d, ratio=%d%%, conflicts=%d%%",
+			pslist_length(added), pslist_length(removed), slots, filled,
+			changes, (int) (100.0 * filled / slots), conflict_ratio);
+	}
+
+	/*
+	 * Use the same criteria as qrp_step_compute() to decide whether the
+	 * table still has the proper size.  When it became way too sparse,
+	 * a smaller one would do and we also fall back to a full computation.
+	 */
+
+	if (
+		(
+			b->bits < MAX_TABLE_BITS && (
+				100 * filled > MIN_SPARSE_RATIO * slots ||
+				conflict_ratio >= MAX_CONFLICT_RATIO
+			)
+		) ||
+		(b->bits > MIN_TABLE_BITS && 400 * filled < MIN_SPARSE_RATIO * slots)
+	) {
+		if (qrp_debugging(0))
+			g_debug("QRP table needs resizing, requesting full computation");
+		qrp_builder_free_null(&qrp_builder);
+		QRP_TASK_UNLOCK;
+		return FALSE;
+	}
+
+	table = 0 == changes ? NULL : qrp_counts_to_table(b->counts, slots);
+
+	QRP_TASK_UNLOCK;
+
+	gnet_prop_set_guint32_val(PROP_QRP_SLOTS_FILLED, (uint32) filled);
+	gnet_prop_set_guint32_val(PROP_QRP_HASHED_KEYWORDS, (uint32) substrings);
+	gnet_prop_set_guint32_val(PROP_QRP_FILL_RATIO,
+		(uint32) (100.0 * filled / slots));
+	gnet_prop_set_guint32_val(PROP_QRP_CONFLICT_RATIO, (uint32) conflict_ratio);
+
+	if (NULL == table)
+		return TRUE;		/* No slot changed */
+
+	/*
+	 * Slots can flip back and forth within the same update, so make sure
+	 * the table really changed before propagating a new generation.
+	 */
+
+	if (
+		local_table != NULL && !local_table->cancelled &&
+		qrt_eq(local_table, table, slots)
+	) {
+		if (qrp_debugging(1)) {
+			g_debug("QRP no change in table, keeping generation #%d",
+				local_table->generation);
+		}
+		QRP_ARENA_FREE_NULL(table, slots);
+		return TRUE;
+	}
+
+	/*
+	 * Supersede any running computation: the builder already accounts for
+	 * all the changes it could have been propagating.
+	 */
+
+	qrp_cancel_computation();
+
+	WALLOC0(ctx);
+	ctx->magic = QRP_MAGIC;
+	ctx->rtp = &local_table;
+	ctx->table = table;
+	ctx->slots = slots;
+
+	gnet_prop_set_timestamp_val(PROP_QRP_TIMESTAMP, tm_time());
+
+	QRP_TASK_LOCK;
+
+	g_soft_assert(NULL == qrp_comp);
+
+	qrp_comp = bg_task_create_stopped(NULL, "QRP update",
+		qrp_update_steps, N_ITEMS(qrp_update_steps),
+		ctx, qrp_comp_context_free,
+		qrp_comp_done, NULL);
+
+	if (qrp_comp != NULL)
+		bg_task_run(qrp_comp);
+
+	QRP_TASK_UNLOCK;
+
+	return TRUE;
+}
+
 static void
 qrp_merge_done(bgtask_t *bt, void *u_ctx, bgstatus_t u_status, void *u_arg)
 {
@@ -5102,6 +5699,7 @@ void G_COLD
 qrp_close(void)
 {
 	qrp_cancel_computation();
+	qrp_builder_discard();
 	cq_periodic_remove(&qrp_monitor_ev);
 
 	if (routing_table)
@@ -68,6 +68,7 @@ struct routing_table;
 struct shared_file;
 struct query_hashvec;
 struct htable;
+struct pslist;
 
 typedef struct query_hashvec query_hashvec_t;
 
@@ -81,6 +82,7 @@ void qrp_prepare_computation(void);
 void qrp_add_file(const struct shared_file *sf, struct htable *words);
 void qrp_finalize_computation(struct htable *words);
 void qrp_dispose_words(struct htable **h_ptr);
+bool qrp_update_files(const struct pslist *added, const struct pslist *removed);
 
 struct qrt_update *qrt_update_create(struct gnutella_node *n,
 						struct routing_table *);
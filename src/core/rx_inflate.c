@@ -55,6 +55,8 @@
 struct attr {
 	const struct rx_inflate_cb *cb;	/**< Layer-specific callbacks */
 	z_streamp inz;					/**< Decompressing stream */
+	const void *dict;				/**< Preset dictionary, NULL if none */
+	size_t dict_len;				/**< Length of preset dictionary */
 	size_t processed;				/**< Input bytes decompressed so far */
 	int flags;
 };
@@ -97,6 +99,18 @@ inflate_data(rxdrv_t *rx, pmsg_t *mb)
 
 	ret = inflate(inz, Z_SYNC_FLUSH);
 
+	/*
+	 * The remote end primed its compressor with a preset dictionary: supply
+	 * ours, which zlib will validate against the dictionary checksum held
+	 * in the stream header, then resume decompression.
+	 */
+
+	if (Z_NEED_DICT == ret && attr->dict != NULL) {
+		ret = inflateSetDictionary(inz, attr->dict, attr->dict_len);
+		if (Z_OK == ret && inz->avail_in != 0)
+			ret = inflate(inz, Z_SYNC_FLUSH);
+	}
+
 	if (ret != Z_OK && ret != Z_STREAM_END) {
 		str_t *s;
 
@@ -199,6 +213,8 @@ rx_inflate_init(rxdrv_t *rx, const void *args)
 	WALLOC0(attr);
 	attr->cb = rargs->cb;
 	attr->inz = inz;
+	attr->dict = rargs->dict;
+	attr->dict_len = rargs->dict_len;
 
 	rx->opaque = attr;
 
@@ -54,6 +54,8 @@ struct rx_inflate_cb {
  */
 struct rx_inflate_args {
 	const struct rx_inflate_cb *cb;		/**< Callbacks */
+	const void *dict;					/**< Preset dictionary, NULL if none */
+	size_t dict_len;					/**< Length of preset dictionary */
 };
 
 #endif	/* _core_rx_inflate_h_ */
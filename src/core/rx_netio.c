@@ -0,0 +1,887 @@
+/*
+ * Copyright (c) 2026, gtk-gnutella developers
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup core
+ * @file
+ *
+ * Network driver -- threaded link level with optional decompression.
+ *
+ * This driver is a replacement for the rx_link and rx_inflate stack when
+ * network I/O workers are enabled.  Reading from the socket, inflating the
+ * data and splitting the stream into Gnutella messages is done from one
+ * of the netio workers.  Complete messages are gathered into batches that
+ * are handed over to the main thread through its event queue, where they
+ * are given to the upper layer on the "interrupt stack" as usual.
+ *
+ * Since a whole batch only contains complete messages, the upper layer
+ * does not need to stitch messages spanning several reads, and the main
+ * thread is spared all the system calls and the decompression work.
+ *
+ * Since the bandwidth schedulers can only be used from the main thread,
+ * the worker reads out of a credit granted by the main thread from the
+ * node's I/O source.  What was actually read is charged when the credit is
+ * renewed, at each delivery: when the worker exhausts its credit, it stops
+ * monitoring the socket until it is granted more bandwidth.
+ *
+ * @author gtk-gnutella developers
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include <zlib.h>
+
+#include "rx_netio.h"
+
+#include "bsched.h"
+#include "gmsg.h"
+#include "gnutella.h"
+#include "netio.h"
+#include "rx.h"
+
+#include "if/core/wrap.h"
+
+#include "lib/cq.h"
+#include "lib/mutex.h"
+#include "lib/pmsg.h"
+#include "lib/pslist.h"
+#include "lib/teq.h"
+#include "lib/thread.h"
+#include "lib/walloc.h"
+#include "lib/zlib_util.h"
+
+#include "lib/override.h"		/* Must be the last header included */
+
+#define RX_NETIO_BUFSIZE	16384	/**< Size of reading buffers */
+#define RX_NETIO_BATCH		32768	/**< Default size of message batches */
+#define RX_NETIO_READS		8		/**< Reads between two deliveries */
+#define RX_NETIO_CREDIT		(RX_NETIO_BUFSIZE * RX_NETIO_READS)	/**< Per grant */
+#define RX_NETIO_RETRY		100		/**< ms, delay before asking more bandwidth */
+
+/**
+ * Reasons for which reading stopped.
+ */
+enum rx_netio_end {
+	RX_NETIO_RUNNING = 0,		/**< Still reading */
+	RX_NETIO_EOF,				/**< Got EOF */
+	RX_NETIO_READ_ERROR,		/**< Read error, errno saved */
+	RX_NETIO_INFLATE_ERROR,		/**< Decompression error */
+	RX_NETIO_INVALID			/**< Got invalid message header */
+};
+
+/**
+ * Private attributes for the driver.
+ *
+ * Unless otherwise noted, fields are protected by the mutex, since the
+ * structure is shared between the main thread and the worker.
+ */
+struct attr {
+	mutex_t lock;				/**< Thread-safe access */
+	rxdrv_t *rx;				/**< Driver, NULL when destroyed */
+	const struct rx_netio_cb *cb;	/**< Layer-specific callbacks */
+	wrap_io_t *wio;				/**< Cached wrapped IO object */
+	bio_source_t *bio;			/**< Bandwidth-limited source (main thread) */
+	bsched_bws_t bws;			/**< Scheduler to attach I/O source to */
+	cevent_t *grant_ev;			/**< Retry granting bandwidth (main thread) */
+	size_t granted;				/**< Bandwidth last granted to worker */
+	size_t credit;				/**< Bytes worker can still read from grant */
+	struct netio_worker *worker;/**< Worker thread reading for us */
+	z_streamp inz;				/**< Decompressing stream, NULL if none */
+	const void *dict;			/**< Preset dictionary, NULL if none */
+	size_t dict_len;			/**< Length of preset dictionary */
+	pmsg_t *batch;				/**< Batch being filled (worker only) */
+	size_t complete;			/**< Complete bytes in batch (worker only) */
+	size_t need;				/**< Length of current message (worker only) */
+	pslist_t *ready;			/**< Batches ready for delivery, reversed */
+	size_t given;				/**< Bytes read, not yet accounted */
+	size_t inflated;			/**< Bytes inflated, not yet accounted */
+	const char *zerror;			/**< Decompression error string */
+	enum rx_netio_end end;		/**< Why reading stopped */
+	int error;					/**< Saved errno on read error */
+	int refcnt;					/**< Reference count */
+	unsigned id;				/**< Event source ID in worker */
+	unsigned enabled:1;			/**< Reception enabled */
+	unsigned posted:1;			/**< Delivery event posted */
+	unsigned have_header:1;		/**< Current message length known */
+	unsigned reported:1;		/**< End of reading reported */
+	unsigned started:1;			/**< Initial enabling done */
+	unsigned starved:1;			/**< Worker exhausted its credit */
+};
+
+#define ATTR_LOCK(a)	mutex_lock(&(a)->lock)
+#define ATTR_UNLOCK(a)	mutex_unlock(&(a)->lock)
+
+/**
+ * Release reference on the attributes, freeing them when the last
+ * reference is gone.
+ */
+static void
+rx_netio_unref(void *p)
+{
+	struct attr *attr = p;
+	pslist_t *sl;
+
+	ATTR_LOCK(attr);
+	g_assert(attr->refcnt > 0);
+
+	if (0 != --attr->refcnt) {
+		ATTR_UNLOCK(attr);
+		return;
+	}
+
+	g_assert(NULL == attr->rx);
+	g_assert(0 == attr->id);
+
+	PSLIST_FOREACH(attr->ready, sl) {
+		pmsg_free(sl->data);
+	}
+	pslist_free_null(&attr->ready);
+
+	if (attr->batch != NULL)
+		pmsg_free_null(&attr->batch);
+
+	if (attr->inz != NULL) {
+		int ret = inflateEnd(attr->inz);
+		if (ret != Z_OK)
+			g_warning("%s(): while freeing decompressor: %s",
+				G_STRFUNC, zlib_strerror(ret));
+		WFREE_TYPE_NULL(attr->inz);
+	}
+
+	mutex_destroy(&attr->lock);
+	WFREE(attr);
+}
+
+/**
+ * @return a new empty message batch of specified size.
+ */
+static pmsg_t *
+rx_netio_batch_new(size_t size)
+{
+	return pmsg_alloc(PMSG_P_DATA, pdata_new(size), 0, 0);
+}
+
+/**
+ * Move the complete messages held in the current batch to the list of
+ * batches ready for delivery, keeping any partial message in a new batch
+ * large enough to hold that message entirely.
+ *
+ * This is the only place where data is copied, and only for messages
+ * straddling the end of a batch.
+ */
+static void
+rx_netio_ship(struct attr *attr)
+{
+	pmsg_t *mb = attr->batch, *tail = NULL;
+	size_t fill, size;
+
+	if (NULL == mb)
+		return;
+
+	fill = pmsg_size(mb);
+	size = MAX(RX_NETIO_BATCH, attr->need);
+
+	if (fill > attr->complete) {
+		size_t partial = fill - attr->complete;
+
+		tail = rx_netio_batch_new(size);
+		pmsg_write(tail, pmsg_start(mb) + attr->complete, partial);
+		mb->m_wptr -= partial;
+	}
+
+	attr->batch = tail;
+
+	if (0 == attr->complete) {
+		pmsg_free(mb);
+		return;
+	}
+
+	attr->complete = 0;
+	attr->ready = pslist_prepend(attr->ready, mb);
+}
+
+/**
+ * Split the incoming stream into messages, appending data to the batch.
+ *
+ * @return FALSE if an invalid message header was seen, in which case all
+ * the data up to and including that header were made available for
+ * delivery so that the upper layer can deal with it.
+ */
+static bool
+rx_netio_frame(struct attr *attr, const char *data, size_t len)
+{
+	while (len != 0) {
+		pmsg_t *mb = attr->batch;
+		size_t fill, end, n;
+
+		if (NULL == mb)
+			mb = attr->batch = rx_netio_batch_new(
+				MAX(RX_NETIO_BATCH, attr->need));
+
+		/*
+		 * If the current message does not fit in the batch, ship the
+		 * complete messages and move the start of the partial message
+		 * into a new batch able to hold it.
+		 */
+
+		end = attr->complete + attr->need;
+
+		if (end > pdata_len(mb->m_data)) {
+			rx_netio_ship(attr);
+			continue;
+		}
+
+		fill = pmsg_size(mb);
+		n = MIN(len, end - fill);
+		pmsg_write(mb, data, n);
+		data += n;
+		len -= n;
+
+		if (fill + n < end)
+			break;		/* Need more data, hence len is 0 */
+
+		if (!attr->have_header) {
+			uint16 size;
+
+			if (
+				GMSG_INVALID == gmsg_size_valid(
+					pmsg_start(mb) + attr->complete, &size)
+			) {
+				attr->complete = end;
+				attr->end = RX_NETIO_INVALID;
+				return FALSE;
+			}
+
+			if (size != 0) {
+				attr->have_header = TRUE;
+				attr->need = GTA_HEADER_SIZE + size;
+				continue;
+			}
+		}
+
+		attr->complete = end;
+		attr->have_header = FALSE;
+		attr->need = GTA_HEADER_SIZE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Process data read from the network.
+ *
+ * @return FALSE if we must stop reading.
+ */
+static bool
+rx_netio_input(struct attr *attr, const char *data, size_t len)
+{
+	z_streamp inz = attr->inz;
+	char buf[RX_NETIO_BUFSIZE];
+
+	if (NULL == inz)
+		return rx_netio_frame(attr, data, len);
+
+	inz->next_in = (void *) data;
+	inz->avail_in = len;
+
+	do {
+		size_t inflated;
+		int ret;
+
+		inz->next_out = (void *) buf;
+		inz->avail_out = sizeof buf;
+
+		ret = inflate(inz, Z_SYNC_FLUSH);
+
+		if (Z_NEED_DICT == ret && attr->dict != NULL) {
+			ret = inflateSetDictionary(inz, attr->dict, attr->dict_len);
+			if (Z_OK == ret)
+				continue;
+		}
+
+		if (Z_BUF_ERROR == ret)
+			break;			/* No progress possible, need more input */
+
+		if (ret != Z_OK && ret != Z_STREAM_END) {
+			attr->zerror = zlib_strerror(ret);
+			attr->end = RX_NETIO_INFLATE_ERROR;
+			return FALSE;
+		}
+
+		inflated = sizeof buf - inz->avail_out;
+		attr->inflated += inflated;
+
+		if (!rx_netio_frame(attr, buf, inflated))
+			return FALSE;
+
+		if (Z_STREAM_END == ret)
+			break;
+	} while (inz->avail_in != 0 || 0 == inz->avail_out);
+
+	return TRUE;
+}
+
+static void rx_netio_grant(struct attr *attr);
+
+/**
+ * Main thread callback delivering the batches of messages to the upper layer.
+ */
+static void
+rx_netio_deliver(void *p)
+{
+	struct attr *attr = p;
+	pslist_t *ready, *sl;
+	size_t given, inflated;
+	enum rx_netio_end end = RX_NETIO_RUNNING;
+	rxdrv_t *rx;
+
+	ATTR_LOCK(attr);
+
+	attr->posted = FALSE;
+	rx = attr->rx;
+
+	if (NULL == rx || !attr->enabled) {
+		ATTR_UNLOCK(attr);
+		goto done;			/* Batches kept until re-enabled or destroyed */
+	}
+
+	/*
+	 * Charge what the worker read so far and renew its credit.
+	 */
+
+	rx_netio_grant(attr);
+
+	ready = pslist_reverse(attr->ready);
+	attr->ready = NULL;
+	given = attr->given;
+	inflated = attr->inflated;
+	attr->given = attr->inflated = 0;
+
+	if (attr->end != RX_NETIO_RUNNING && !attr->reported) {
+		end = attr->end;
+		attr->reported = TRUE;
+	}
+
+	ATTR_UNLOCK(attr);
+
+	if (given != 0 && attr->cb->add_rx_given != NULL)
+		attr->cb->add_rx_given(rx->owner, given);
+	if (inflated != 0 && attr->cb->add_rx_inflated != NULL)
+		attr->cb->add_rx_inflated(rx->owner, inflated);
+
+	/*
+	 * The upper layer can disable reception whilst processing a batch, so
+	 * we check before each one: the remaining batches, and the end of
+	 * reading, are put back to be delivered once reception is enabled again.
+	 *
+	 * NB: each `mb' is expected to be freed by the last layer using it.
+	 */
+
+	for (;;) {
+		pmsg_t *mb;
+
+		ATTR_LOCK(attr);
+		if (NULL == attr->rx || !attr->enabled) {
+			attr->ready = pslist_concat(attr->ready, pslist_reverse(ready));
+			if (end != RX_NETIO_RUNNING)
+				attr->reported = FALSE;
+			ATTR_UNLOCK(attr);
+			goto done;
+		}
+		ATTR_UNLOCK(attr);
+
+		mb = pslist_shift(&ready);
+		if (NULL == mb)
+			break;
+
+		if (!(*rx->data.ind)(rx, mb)) {
+			PSLIST_FOREACH(ready, sl) {
+				pmsg_free(sl->data);
+			}
+			pslist_free(ready);
+			goto done;
+		}
+	}
+
+	switch (end) {
+	case RX_NETIO_RUNNING:
+	case RX_NETIO_INVALID:		/* Upper layer saw the header */
+		break;
+	case RX_NETIO_EOF:
+		attr->cb->got_eof(rx->owner);
+		break;
+	case RX_NETIO_READ_ERROR:
+		errno = attr->error;
+		attr->cb->read_error(rx->owner, _("Read error: %s"),
+			g_strerror(attr->error));
+		break;
+	case RX_NETIO_INFLATE_ERROR:
+		attr->cb->inflate_error(rx->owner,
+			"Decompression failed: %s", attr->zerror);
+		break;
+	}
+
+done:
+	rx_netio_unref(attr);
+}
+
+/**
+ * Post delivery to the main thread, if not already done.
+ */
+static void
+rx_netio_post(struct attr *attr)
+{
+	g_assert(mutex_is_owned(&attr->lock));
+
+	if (attr->posted)
+		return;
+
+	if (
+		NULL == attr->ready && attr->end == RX_NETIO_RUNNING &&
+		!attr->starved
+	)
+		return;
+
+	attr->posted = TRUE;
+	attr->refcnt++;
+	teq_safe_post(THREAD_MAIN_ID, rx_netio_deliver, attr);
+}
+
+/**
+ * Stop reading, making all the data gathered so far available for delivery,
+ * along with the reason why we stopped.
+ */
+static void
+rx_netio_stop(struct attr *attr)
+{
+	g_assert(mutex_is_owned(&attr->lock));
+	g_assert(attr->end != RX_NETIO_RUNNING);
+
+	if (attr->batch != NULL) {
+		attr->complete = pmsg_size(attr->batch);
+		rx_netio_ship(attr);
+	}
+	netio_remove(attr->worker, &attr->id);
+	rx_netio_post(attr);
+}
+
+/**
+ * Invoked from the worker when the input file descriptor has more data.
+ */
+static void
+rx_netio_is_readable(void *data, int unused_source, inputevt_cond_t cond)
+{
+	struct attr *attr = data;
+	char buf[RX_NETIO_BUFSIZE];
+	uint i;
+
+	(void) unused_source;
+
+	ATTR_LOCK(attr);
+
+	if (!attr->enabled || attr->end != RX_NETIO_RUNNING)
+		goto done;			/* Raced with rx_netio_disable() */
+
+	if (cond & INPUT_EVENT_EXCEPTION) {
+		attr->error = EIO;
+		attr->end = RX_NETIO_READ_ERROR;
+		goto stop;
+	}
+
+	/*
+	 * Events may be edge-triggered, so we must read until the kernel has
+	 * no more data for us.  To limit latency on fast streams, we post what
+	 * we have to the main thread every RX_NETIO_READS reads.  Reading also
+	 * stops when our credit is exhausted, until the main thread grants more.
+	 */
+
+	for (i = 1; /* empty */; i++) {
+		size_t len = MIN(sizeof buf, attr->credit);
+		ssize_t r;
+
+		if (0 == len) {
+			netio_remove(attr->worker, &attr->id);
+			attr->starved = TRUE;		/* Until granted more bandwidth */
+			break;
+		}
+
+		r = (*attr->wio->read)(attr->wio, buf, len);
+
+		if (0 == r) {
+			attr->end = RX_NETIO_EOF;
+			goto stop;
+		} else if ((ssize_t) -1 == r) {
+			if (is_temporary_error(errno))
+				break;
+			attr->error = errno;
+			attr->end = RX_NETIO_READ_ERROR;
+			goto stop;
+		}
+
+		attr->given += r;
+		attr->credit -= r;
+
+		if (!rx_netio_input(attr, buf, r))
+			goto stop;
+
+		if ((size_t) r < len)
+			break;		/* Drained the socket buffer */
+
+		if (0 == i % RX_NETIO_READS) {
+			rx_netio_ship(attr);
+			rx_netio_post(attr);
+		}
+	}
+
+	rx_netio_ship(attr);
+	rx_netio_post(attr);
+	goto done;
+
+stop:
+	rx_netio_stop(attr);
+
+	/* FALL THROUGH */
+
+done:
+	ATTR_UNLOCK(attr);
+}
+
+/**
+ * Have the worker monitor the socket, if reception is enabled and it has
+ * bandwidth to read.
+ */
+static void
+rx_netio_watch(struct attr *attr)
+{
+	g_assert(mutex_is_owned(&attr->lock));
+
+	if (
+		attr->enabled && RX_NETIO_RUNNING == attr->end &&
+		0 == attr->id && attr->credit != 0
+	) {
+		attr->id = netio_add(attr->worker, attr->wio->fd(attr->wio),
+			rx_netio_is_readable, attr);
+	}
+}
+
+/**
+ * Charge the I/O source for the bandwidth used by the worker out of the
+ * last grant, revoking whatever credit is left.
+ */
+static void
+rx_netio_charge(struct attr *attr)
+{
+	g_assert(mutex_is_owned(&attr->lock));
+	g_assert(thread_is_main());
+
+	if (attr->bio != NULL)
+		bio_read_charge(attr->bio, attr->granted - attr->credit, attr->granted);
+
+	attr->granted = attr->credit = 0;
+}
+
+/**
+ * Callout queue callback to retry granting bandwidth to the worker.
+ */
+static void
+rx_netio_grant_retry(cqueue_t *cq, void *p)
+{
+	struct attr *attr = p;
+
+	ATTR_LOCK(attr);
+	cq_zero(cq, &attr->grant_ev);		/* Callback has fired */
+	if (attr->rx != NULL)
+		rx_netio_grant(attr);
+	ATTR_UNLOCK(attr);
+
+	rx_netio_unref(attr);
+}
+
+/**
+ * Charge the bandwidth used by the worker and grant it a new credit,
+ * resuming the monitoring of the socket if it was starved.
+ *
+ * When no bandwidth is available, we retry later.
+ */
+static void
+rx_netio_grant(struct attr *attr)
+{
+	g_assert(mutex_is_owned(&attr->lock));
+	g_assert(thread_is_main());
+
+	if (NULL == attr->bio)
+		return;				/* Reception disabled */
+
+	rx_netio_charge(attr);
+	attr->granted = attr->credit = bio_read_grant(attr->bio, RX_NETIO_CREDIT);
+	attr->starved = FALSE;
+
+	if (attr->credit != 0) {
+		rx_netio_watch(attr);
+		return;
+	}
+
+	netio_remove(attr->worker, &attr->id);
+
+	if (NULL == attr->grant_ev) {
+		attr->refcnt++;		/* For the callout */
+		attr->grant_ev =
+			cq_main_insert(RX_NETIO_RETRY, rx_netio_grant_retry, attr);
+	}
+}
+
+/**
+ * Main thread callback starting the monitoring of the socket.
+ */
+static void
+rx_netio_start(void *p)
+{
+	struct attr *attr = p;
+
+	ATTR_LOCK(attr);
+	if (attr->rx != NULL)
+		rx_netio_grant(attr);
+	ATTR_UNLOCK(attr);
+
+	rx_netio_unref(attr);
+}
+
+/***
+ *** Polymorphic routines.
+ ***/
+
+/**
+ * Initialize the driver.
+ */
+static void *
+rx_netio_init(rxdrv_t *rx, const void *args)
+{
+	const struct rx_netio_args *rargs = args;
+	struct attr *attr;
+
+	rx_check(rx);
+	g_assert(rargs != NULL);
+	g_assert(rargs->cb != NULL);
+	g_assert(netio_enabled());
+
+	WALLOC0(attr);
+
+	if (rargs->inflate) {
+		z_streamp inz;
+		int ret;
+
+		WALLOC(inz);
+		inz->zalloc = zlib_alloc_func;
+		inz->zfree = zlib_free_func;
+		inz->opaque = NULL;
+
+		ret = inflateInit(inz);
+
+		if (ret != Z_OK) {
+			WFREE(inz);
+			WFREE(attr);
+			g_warning("unable to initialize decompressor for peer %s: %s",
+				gnet_host_to_string(&rx->host), zlib_strerror(ret));
+			return NULL;
+		}
+
+		attr->inz = inz;
+		attr->dict = rargs->dict;
+		attr->dict_len = rargs->dict_len;
+	}
+
+	mutex_init(&attr->lock);
+	attr->rx = rx;
+	attr->cb = rargs->cb;
+	attr->wio = rargs->wio;
+	attr->bws = rargs->bws;
+	attr->need = GTA_HEADER_SIZE;
+	attr->refcnt = 1;
+	attr->worker = netio_assign();
+
+	rx->opaque = attr;
+
+	return rx;		/* OK */
+}
+
+/**
+ * Enable reception of data.
+ */
+static void
+rx_netio_enable(rxdrv_t *rx)
+{
+	struct attr *attr = rx->opaque;
+
+	ATTR_LOCK(attr);
+
+	attr->enabled = TRUE;
+
+	g_assert(NULL == attr->bio);
+
+	attr->bio = bsched_source_add(attr->bws, attr->wio, BIO_F_READ,
+					NULL, NULL);
+
+	/*
+	 * The first time, data already read from the socket can still be
+	 * injected at the bottom of the stack by our caller, through
+	 * rx_netio_recv(): the worker must not start reading before these
+	 * data have been processed, so we defer the monitoring of the socket.
+	 */
+
+	if (!attr->started) {
+		attr->started = TRUE;
+		attr->refcnt++;
+		teq_safe_post(THREAD_MAIN_ID, rx_netio_start, attr);
+	} else {
+		rx_netio_grant(attr);
+	}
+
+	rx_netio_post(attr);		/* Deliver what was held whilst disabled */
+
+	ATTR_UNLOCK(attr);
+}
+
+/**
+ * Disable reception of data.
+ */
+static void
+rx_netio_disable(rxdrv_t *rx)
+{
+	struct attr *attr = rx->opaque;
+
+	/*
+	 * Like rx_link_disable(), this is blindly called when the RX stack
+	 * is freed, regardless of whether the stack is enabled or not.
+	 */
+
+	ATTR_LOCK(attr);
+
+	attr->enabled = FALSE;
+	netio_remove(attr->worker, &attr->id);
+	rx_netio_charge(attr);
+
+	if (attr->bio != NULL) {
+		bsched_source_remove(attr->bio);
+		attr->bio = NULL;
+	}
+
+	if (attr->grant_ev != NULL) {
+		cq_cancel(&attr->grant_ev);
+		g_assert(attr->refcnt > 1);		/* Driver still holds a reference */
+		attr->refcnt--;
+	}
+
+	ATTR_UNLOCK(attr);
+}
+
+/**
+ * Get rid of the driver's private data.
+ *
+ * The worker can be running rx_netio_is_readable() at this very moment,
+ * so the final release of the attributes is deferred to the worker.
+ */
+static void
+rx_netio_destroy(rxdrv_t *rx)
+{
+	struct attr *attr = rx->opaque;
+	struct netio_worker *w = attr->worker;
+
+	rx_netio_disable(rx);
+
+	ATTR_LOCK(attr);
+	attr->rx = NULL;
+	attr->refcnt++;		/* For the deferred release */
+	ATTR_UNLOCK(attr);
+
+	netio_defer(w, rx_netio_unref, attr);
+	netio_release(w);
+	rx_netio_unref(attr);
+	rx->opaque = NULL;
+}
+
+/**
+ * Inject data into driver.
+ *
+ * The data are processed as if they had been read from the network, and
+ * will be given to the upper layer asynchronously, before anything the
+ * worker can read afterwards.
+ *
+ * @return TRUE, since errors are reported asynchronously.
+ */
+static bool
+rx_netio_recv(rxdrv_t *rx, pmsg_t *mb)
+{
+	struct attr *attr = rx->opaque;
+
+	rx_check(rx);
+	g_assert(mb);
+
+	ATTR_LOCK(attr);
+
+	if (RX_NETIO_RUNNING == attr->end) {
+		attr->given += pmsg_size(mb);
+
+		if (rx_netio_input(attr, pmsg_start(mb), pmsg_size(mb))) {
+			rx_netio_ship(attr);
+			rx_netio_post(attr);
+		} else {
+			rx_netio_stop(attr);
+		}
+	}
+
+	ATTR_UNLOCK(attr);
+	pmsg_free(mb);
+
+	return TRUE;
+}
+
+/**
+ * @return I/O source of the lower level, against which the worker reads
+ * are charged, NULL when reception is disabled.
+ */
+static struct bio_source *
+rx_netio_bio_source(rxdrv_t *rx)
+{
+	struct attr *attr = rx->opaque;
+
+	return attr->bio;
+}
+
+static const struct rxdrv_ops rx_netio_ops = {
+	rx_netio_init,			/**< init */
+	rx_netio_destroy,		/**< destroy */
+	rx_netio_recv,			/**< recv */
+	NULL,					/**< recvfrom */
+	rx_netio_enable,		/**< enable */
+	rx_netio_disable,		/**< disable */
+	rx_netio_bio_source,	/**< bio_source */
+};
+
+const struct rxdrv_ops *
+rx_netio_get_ops(void)
+{
+	return &rx_netio_ops;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
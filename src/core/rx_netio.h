@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2026, gtk-gnutella developers
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup core
+ * @file
+ *
+ * Network driver -- threaded link level with optional decompression.
+ *
+ * @author gtk-gnutella developers
+ * @date 2026
+ */
+
+#ifndef _core_rx_netio_h_
+#define _core_rx_netio_h_
+
+#include "common.h"
+
+#include "rx.h"
+#include "if/core/bsched.h"
+
+const struct rxdrv_ops *rx_netio_get_ops(void);
+
+/**
+ * Callbacks used by the threaded link layer.
+ *
+ * They are all invoked from the main thread.
+ */
+struct rx_netio_cb {
+	void (*add_rx_given)(void *owner, ssize_t amount);
+	void (*add_rx_inflated)(void *owner, int amount);
+	void (*read_error)(void *owner,
+			const char *reason, ...) G_PRINTF_PTR(2, 3);
+	void (*inflate_error)(void *owner,
+			const char *reason, ...) G_PRINTF_PTR(2, 3);
+	void (*got_eof)(void *owner);
+};
+
+/**
+ * Arguments to be passed when the layer is instantiated.
+ */
+struct rx_netio_args {
+	const struct rx_netio_cb *cb;	/**< Callbacks */
+	struct wrap_io *wio;			/**< I/O wrapping routines */
+	bsched_bws_t bws;				/**< Bandwidth scheduler to use */
+	bool inflate;					/**< Whether input is deflated */
+	const void *dict;				/**< Preset dictionary, NULL if none */
+	size_t dict_len;				/**< Length of preset dictionary */
+};
+
+#endif	/* _core_rx_netio_h_ */
+
+/* vi: set ts=4 sw=4 cindent: */
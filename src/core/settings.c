@@ -112,6 +112,7 @@
 #include "lib/stringify.h"
 #include "lib/teq.h"
 #include "lib/thread.h"
+#include "lib/tigertree.h"
 #include "lib/tm.h"
 #include "lib/tmalloc.h"
 #include "lib/vmm.h"
@@ -2684,6 +2685,13 @@ bw_allow_stealing_set(bool unused_val)
 	bsched_config_stealing();
 }
 
+static void
+bw_htb_weight_set(uint32 unused_val)
+{
+	(void) unused_val;
+	bsched_config_htb();
+}
+
 static void
 lock_sleep_trace_set(bool val)
 {
@@ -2719,6 +2727,10 @@ static bool x ## _changed(property_t prop) {	\
 SETTINGS_CB(adns_debug,				uint32,	set_adns_debug)
 SETTINGS_CB(bg_debug,				uint32,	bg_set_debug)
 SETTINGS_CB(bw_allow_stealing,		bool,	bw_allow_stealing_set)
+SETTINGS_CB(bw_htb_weight_dht,		uint32,	bw_htb_weight_set)
+SETTINGS_CB(bw_htb_weight_gnet,		uint32,	bw_htb_weight_set)
+SETTINGS_CB(bw_htb_weight_http,		uint32,	bw_htb_weight_set)
+SETTINGS_CB(bw_htb_weight_udp,		uint32,	bw_htb_weight_set)
 SETTINGS_CB(configured_dht_mode,	uint32,	dht_configured_mode_changed)
 SETTINGS_CB(dbstore_debug,			uint32,	dbstore_set_debug)
 SETTINGS_CB(dl_minchunksize,		uint32,	file_info_set_minchunksize)
@@ -2735,6 +2747,7 @@ SETTINGS_CB(omalloc_debug,			uint32,	set_omalloc_debug)
 SETTINGS_CB(palloc_debug,			uint32,	set_palloc_debug)
 SETTINGS_CB(tm_debug,				uint32,	set_tm_debug)
 SETTINGS_CB(tmalloc_debug,			uint32,	set_tmalloc_debug)
+SETTINGS_CB(tth_threads,			uint32,	tt_set_threads)
 SETTINGS_CB(vmm_debug,				uint32,	set_vmm_debug)
 SETTINGS_CB(vxml_debug,				uint32,	set_vxml_debug)
 SETTINGS_CB(xmalloc_debug,			uint32,	set_xmalloc_debug)
@@ -3125,6 +3138,26 @@ static prop_map_t property_map[] = {
         bw_allow_stealing_changed,
         FALSE
     },
+	{
+		PROP_BW_HTB_WEIGHT_GNET,
+		bw_htb_weight_gnet_changed,
+		FALSE
+	},
+	{
+		PROP_BW_HTB_WEIGHT_UDP,
+		bw_htb_weight_udp_changed,
+		FALSE
+	},
+	{
+		PROP_BW_HTB_WEIGHT_DHT,
+		bw_htb_weight_dht_changed,
+		FALSE
+	},
+	{
+		PROP_BW_HTB_WEIGHT_HTTP,
+		bw_htb_weight_http_changed,
+		FALSE
+	},
 	{
 		PROP_ONLINE_MODE,
 		node_online_mode_changed,
@@ -3145,6 +3178,11 @@ static prop_map_t property_map[] = {
         tmalloc_debug_changed,
         TRUE
     },
+    {
+        PROP_TTH_THREADS,
+        tth_threads_changed,
+        TRUE
+    },
     {
         PROP_VXML_DEBUG,
         vxml_debug_changed,
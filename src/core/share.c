@@ -70,15 +70,20 @@
 #include "lib/atoms.h"
 #include "lib/barrier.h"
 #include "lib/bg.h"
+#include "lib/cond.h"
 #include "lib/cq.h"
 #include "lib/crash.h"
+#include "lib/dirwatch.h"
 #include "lib/endian.h"
+#include "lib/epoch.h"
+#include "lib/fd.h"
 #include "lib/file.h"
 #include "lib/getcpucount.h"
 #include "lib/halloc.h"
 #include "lib/hashing.h"
 #include "lib/hikset.h"
 #include "lib/hset.h"
+#include "lib/hstrfn.h"
 #include "lib/htable.h"
 #include "lib/listener.h"
 #include "lib/mime_type.h"
@@ -179,6 +184,19 @@ static cevent_t *share_qrp_rebuild_ev;
 
 static hset_t *partial_files;	/* Contains partial files, thread-safe */
 
+/*
+ * The file tables, indexed by file index and by sort index.
+ *
+ * They are published as a whole so that lock-free readers always see arrays
+ * consistent with their size.  Once published, the arrays are never resized
+ * nor freed in place: entries can only be cleared when files are removed.
+ */
+struct shared_ftable {
+	size_t count;						/* Amount of entries in tables */
+	shared_file_t **files;				/* Sorted by mtime */
+	shared_file_t **sorted;				/* Sorted by name */
+};
+
 /*
  * These variables are recreated by each library scanning.
  *
@@ -189,6 +207,10 @@ static hset_t *partial_files;	/* Contains partial files, thread-safe */
  *
  * To make sure we never access them without locking, they are groupped in
  * a structure and accessors are defined.
+ *
+ * The search tables and the file tables are also read without locking from
+ * within a read-side section of ``share_epoch'': writers still take the lock,
+ * but retire old versions through share_epoch instead of freeing them.
  */
 static struct shared_library {
 	uint64 files_scanned;	/* Amount of files shared in the library */
@@ -197,10 +219,11 @@ static struct shared_library {
 	search_table_t *search_table;
 	htable_t *file_basenames;
 	search_table_t *partial_table;
-	shared_file_t **file_table;			/* Sorted by mtime */
-	shared_file_t **sorted_file_table;	/* Sorted by name */
+	struct shared_ftable *ftable;		/* NULL when rebuilding */
+	htable_t *file_paths;				/* Full path -> shared file */
 } shared_libfile;
 static spinlock_t shared_libfile_slk = SPINLOCK_INIT;
+static epoch_t *share_epoch;
 
 #define SHARED_LIBFILE_LOCK		spinlock(&shared_libfile_slk)
 #define SHARED_LIBFILE_UNLOCK	spinunlock(&shared_libfile_slk)
@@ -222,6 +245,76 @@ GENERATE_ACCESSOR(uint64, bytes_scanned)
 
 #undef GENERATE_ACCESSOR
 
+/**
+ * Allocate a new file table snapshot.
+ *
+ * @param files		table sorted by mtime (taken over)
+ * @param sorted	table sorted by name (taken over)
+ * @param count		amount of entries in each table
+ */
+static struct shared_ftable *
+shared_ftable_make(shared_file_t **files, shared_file_t **sorted, size_t count)
+{
+	struct shared_ftable *ft;
+
+	if (NULL == files)
+		return NULL;
+
+	WALLOC(ft);
+	ft->count = count;
+	ft->files = files;
+	ft->sorted = sorted;
+
+	return ft;
+}
+
+/**
+ * Free file table snapshot, once lock-free readers can no longer see it.
+ */
+static void
+shared_ftable_free(void *p)
+{
+	struct shared_ftable *ft = p;
+
+	HFREE_NULL(ft->files);
+	HFREE_NULL(ft->sorted);
+	WFREE(ft);
+}
+
+/**
+ * Release search table, once lock-free readers can no longer see it.
+ */
+static void
+share_st_free(void *p)
+{
+	search_table_t *st = p;
+
+	st_free(&st);
+}
+
+/**
+ * Release list of shared files, once lock-free readers can no longer see
+ * the files it references.
+ */
+static void
+share_files_free(void *p)
+{
+	pslist_t *files = p;
+
+	shared_file_slist_free_null(&files);
+}
+
+/**
+ * Release shared file, once lock-free readers can no longer see it.
+ */
+static void
+share_file_free(void *p)
+{
+	shared_file_t *sf = p;
+
+	shared_file_unref(&sf);
+}
+
 /**
  * The recursive_scan_context is the context used by two distinct background
  * tasks, which cannot run at the same time:
@@ -442,6 +535,7 @@ reinit_sha1_table(void)
 		sha1_to_share = hikset_create(
 			offsetof(shared_file_t, sha1), HASH_KEY_FIXED, SHA1_RAW_SIZE);
 		hikset_thread_safe(sha1_to_share);
+		hikset_huge_pages(sha1_to_share);	/* Probed for each SHA1 query */
 	} else {
 		hikset_clear(sha1_to_share);
 	}
@@ -479,6 +573,8 @@ shared_file_alloc(void)
 static void
 shared_file_deindex(shared_file_t *sf)
 {
+	struct shared_ftable *ft;
+
 	shared_file_check(sf);
 	shared_file_name_check(sf);
 
@@ -490,29 +586,37 @@ shared_file_deindex(shared_file_t *sf)
 	sf->flags &= ~SHARE_F_BASENAME;
 
 	/*
-	 * The shared file might not be referenced by the current file_table
+	 * The shared file might not be referenced by the current file tables
 	 * either because it hasn't been build yet or because of a rescan.
 	 */
 
 	SHARED_LIBFILE_LOCK;
 
+	ft = shared_libfile.ftable;
+
 	if (
-		shared_libfile.file_table != NULL &&
+		ft != NULL &&
 		sf->file_index > 0 &&
-		sf->file_index <= shared_libfile.files_scanned &&
-		sf == shared_libfile.file_table[sf->file_index - 1]
+		sf->file_index <= ft->count &&
+		sf == ft->files[sf->file_index - 1]
 	) {
 		g_assert(SHARE_F_INDEXED & sf->flags);
-		shared_libfile.file_table[sf->file_index - 1] = NULL;
+		ft->files[sf->file_index - 1] = NULL;
 	}
 	if (
-		shared_libfile.sorted_file_table &&
+		ft != NULL &&
 		sf->sort_index > 0 &&
-		sf->sort_index <= shared_libfile.files_scanned &&
-		sf == shared_libfile.sorted_file_table[sf->sort_index - 1]
+		sf->sort_index <= ft->count &&
+		sf == ft->sorted[sf->sort_index - 1]
 	) {
 		g_assert(SHARE_F_INDEXED & sf->flags);
-		shared_libfile.sorted_file_table[sf->sort_index - 1] = NULL;
+		ft->sorted[sf->sort_index - 1] = NULL;
+	}
+	if (
+		shared_libfile.file_paths != NULL &&
+		sf == htable_lookup(shared_libfile.file_paths, sf->file_path)
+	) {
+		htable_remove(shared_libfile.file_paths, sf->file_path);
 	}
 
 	sf->file_index = 0;
@@ -788,14 +892,14 @@ shared_files_match(const char *query,
 	bool g2_query = booleanize(flags & SHARE_FM_G2);
 
 	/*
-	 * Take snapshots of the global search and partial tables, in case
-	 * they are reset by a background rescan.
+	 * A background rescan can install new search and partial tables at
+	 * any time, but the ones we see here are not freed before we leave
+	 * the read-side section.
 	 */
 
-	SHARED_LIBFILE_LOCK;
-	gt = st_refcnt_inc(shared_libfile.search_table);
-	pt = partials ? st_refcnt_inc(shared_libfile.partial_table) : NULL;
-	SHARED_LIBFILE_UNLOCK;
+	epoch_enter(share_epoch);
+	gt = shared_libfile.search_table;
+	pt = partials ? shared_libfile.partial_table : NULL;
 
 	/*
 	 * First search from the library.
@@ -822,8 +926,7 @@ shared_files_match(const char *query,
 			g2_query ? GNR_LOCAL_G2_PARTIAL_HITS : GNR_LOCAL_PARTIAL_HITS, n);
 	}
 
-	st_free(&gt);
-	st_free(&pt);
+	epoch_leave(share_epoch);
 }
 
 /**
@@ -898,21 +1001,24 @@ shared_special(const char *path)
 shared_file_t *
 shared_file(uint idx)
 {
+	const struct shared_ftable *ft;
 	shared_file_t * sf;
 
-	SHARED_LIBFILE_LOCK;
+	epoch_enter(share_epoch);
 
-	if (NULL == shared_libfile.file_table)		/* Rebuilding the library! */
+	ft = shared_libfile.ftable;
+
+	if (NULL == ft)		/* Rebuilding the library! */
 		sf = SHARE_REBUILDING;
-	else if (idx < 1 || idx > shared_libfile.files_scanned)
+	else if (idx < 1 || idx > ft->count)
 		sf = NULL;
 	else {
-		sf = shared_libfile.file_table[idx - 1];
+		sf = ft->files[idx - 1];
 		if (sf != NULL)
 			shared_file_ref(sf);
 	}
 
-	SHARED_LIBFILE_UNLOCK;
+	epoch_leave(share_epoch);
 
 	return sf;
 }
@@ -930,21 +1036,24 @@ shared_file(uint idx)
 shared_file_t *
 shared_file_sorted(uint idx)
 {
+	const struct shared_ftable *ft;
 	shared_file_t *sf;
 
-	SHARED_LIBFILE_LOCK;
+	epoch_enter(share_epoch);
+
+	ft = shared_libfile.ftable;
 
-	if (NULL == shared_libfile.sorted_file_table)	/* Rebuilding library! */
+	if (NULL == ft)		/* Rebuilding library! */
 		sf = SHARE_REBUILDING;
-	else if (idx < 1 || idx > shared_libfile.files_scanned)
+	else if (idx < 1 || idx > ft->count)
 		sf = NULL;
 	else {
-		sf = shared_libfile.sorted_file_table[idx - 1];
+		sf = ft->sorted[idx - 1];
 		if (sf != NULL)
 			shared_file_ref(sf);
 	}
 
-	SHARED_LIBFILE_UNLOCK;
+	epoch_leave(share_epoch);
 
 	return sf;
 }
@@ -992,13 +1101,13 @@ shared_file_by_name(const char *filename)
 
 	SHARED_LIBFILE_LOCK;
 
-	if G_UNLIKELY(NULL == shared_libfile.file_table) {
+	if G_UNLIKELY(NULL == shared_libfile.ftable) {
 		sf = SHARE_REBUILDING;
 	} else {
 		g_assert(shared_libfile.file_basenames != NULL);
 		idx = shared_file_get_index(filename);
 		if (idx > 0) {
-			sf = shared_libfile.file_table[idx - 1];
+			sf = shared_libfile.ftable->files[idx - 1];
 			shared_file_check(sf);
 			shared_file_ref(sf);
 		} else {
@@ -1489,7 +1598,7 @@ share_tthset_get(void)
 	SHARED_LIBFILE_LOCK;
 
 	n = shared_libfile.files_scanned;
-	sfp = shared_libfile.file_table;
+	sfp = NULL == shared_libfile.ftable ? NULL : shared_libfile.ftable->files;
 
 	while (n-- != 0) {
 		shared_file_t *sf = *sfp++;
@@ -1549,14 +1658,25 @@ struct recursive_scan {
 	shared_file_t **ftable;		/* cloned file_table, contains ref-counted sf */
 	search_table_t *search_tb;	/* the new search table */
 	search_table_t *partial_tb;	/* the new partial table */
+	htable_t *paths;			/* the new file_paths table */
+	slist_t *watched;			/* directories to watch (atoms), or NULL */
 	size_t partial_files_count;	/* amount of partials in hset when we started */
 	uint64 files_scanned;		/* amount of files shared in the library */
 	uint64 bytes_scanned;		/* size of the library */
 	int idx;					/* iterating index */
 	int ticks;					/* ticks used */
 	size_t ftable_capacity;		/* Amount of entries in ftable[] */
+	struct share_scanner *scanner;	/* parallel scanner, NULL if sequential */
+	uint64 dirs_scanned;		/* amount of directories scanned */
+	uint64 entries_seen;		/* amount of directory entries seen */
+	tm_nano_t scan_start;		/* when directory traversal started */
+	tm_nano_t scan_end;			/* when directory traversal ended */
 };
 
+static void share_scanner_free_null(struct share_scanner **sc_ptr);
+static bool share_watch_enabled(void);
+static void share_watch_install(slist_t **dirs_ptr);
+
 static inline void
 recursive_scan_check(const struct recursive_scan * const ctx)
 {
@@ -1583,6 +1703,8 @@ recursive_scan_new(const pslist_t *base_dirs, time_t now)
 	ctx->partial_files = slist_new();
 	ctx->words = htable_create(HASH_KEY_STRING, 0);
 	ctx->basenames = htable_create(HASH_KEY_STRING, 0);
+	if (base_dirs != NULL && share_watch_enabled())
+		ctx->watched = slist_new();
 	PSLIST_FOREACH(base_dirs, iter) {
 		const char *dir = atom_str_get(iter->data);
 		slist_append(ctx->base_dirs, deconstify_char(dir));
@@ -1648,6 +1770,7 @@ recursive_scan_context_free(void *data)
 
 	recursive_scan_check(ctx);
 
+	share_scanner_free_null(&ctx->scanner);
 	recursive_scan_closedir(ctx);
 
 	slist_iter_free(&ctx->iter);
@@ -1655,8 +1778,10 @@ recursive_scan_context_free(void *data)
 	slist_free_all(&ctx->sub_dirs, do_hfree);
 	slist_free_all(&ctx->shared_files, recursive_sf_unref);
 	slist_free_all(&ctx->partial_files, recursive_sf_unref);
+	slist_free_all(&ctx->watched, scan_base_dir_free);
 
 	htable_free_null(&ctx->basenames);
+	htable_free_null(&ctx->paths);
 	st_free(&ctx->search_tb);
 	st_free(&ctx->partial_tb);
 	atom_str_free_null(&ctx->base_dir);
@@ -1688,11 +1813,19 @@ recursive_scan_context_free(void *data)
 static void
 share_free(void)
 {
-	st_free(&shared_libfile.search_table);
+	/*
+	 * The search table, the file tables and the shared files they refer to
+	 * can still be used by lock-free readers.
+	 */
+
+	epoch_retire(share_epoch, shared_libfile.search_table, share_st_free);
+	epoch_retire(share_epoch, shared_libfile.shared_files, share_files_free);
+	epoch_retire(share_epoch, shared_libfile.ftable, shared_ftable_free);
+	shared_libfile.search_table = NULL;
+	shared_libfile.shared_files = NULL;
+	shared_libfile.ftable = NULL;
 	htable_free_null(&shared_libfile.file_basenames);
-	shared_file_slist_free_null(&shared_libfile.shared_files);
-	HFREE_NULL(shared_libfile.file_table);
-	HFREE_NULL(shared_libfile.sorted_file_table);
+	htable_free_null(&shared_libfile.file_paths);
 }
 
 /**
@@ -1779,254 +1912,728 @@ recursive_scan_opendir(struct recursive_scan *ctx, const char * const dir)
 		ctx->relative_path = NULL;
 	}
 	ctx->current_dir = atom_str_get(dir);
+	ctx->dirs_scanned++;
+
+	if (ctx->watched != NULL)
+		slist_append(ctx->watched, deconstify_char(atom_str_get(dir)));
 
 	if (GNET_PROPERTY(share_debug) > 5)
 		g_debug("SHARE scanning directory \"%s\"", ctx->current_dir);
 }
 
-static void
-recursive_scan_readdir(struct recursive_scan *ctx)
+/**
+ * Type of directory entries, as classified by recursive_scan_entry().
+ */
+enum recursive_scan_entry {
+	RSCAN_SKIP = 0,				/**< Entry must be ignored */
+	RSCAN_DIR,					/**< Directory to scan */
+	RSCAN_FILE					/**< Regular file to consider for sharing */
+};
+
+/**
+ * @return file descriptor of opened directory, or -1 if not available.
+ */
+static inline int
+recursive_scan_dirfd(DIR *dp)
 {
-	char *fullpath = NULL;
-	struct dirent *dir_entry;
+#ifdef HAS_DIRFD
+	return dirfd(dp);
+#else
+	(void) dp;
+	return -1;
+#endif	/* HAS_DIRFD */
+}
 
-	recursive_scan_check(ctx);
-	g_assert(ctx->directory);
+/**
+ * Get file status of directory entry, relative to the directory file
+ * descriptor when possible to spare the kernel a full path lookup.
+ *
+ * @param dfd		directory file descriptor, -1 if not available
+ * @param name		the entry name within the directory
+ * @param path		the full path of the entry
+ * @param sb		where file status is written
+ * @param follow	whether to follow symbolic links
+ *
+ * @return 0 if OK, -1 on error with errno set.
+ */
+static int
+recursive_scan_stat(int dfd, const char *name, const char *path,
+	filestat_t *sb, bool follow)
+{
+#ifdef HAS_FSTATAT
+	if (is_valid_fd(dfd))
+		return fstatat(dfd, name, sb, follow ? 0 : AT_SYMLINK_NOFOLLOW);
+#else
+	(void) dfd;
+	(void) name;
+#endif	/* HAS_FSTATAT */
 
-	dir_entry = readdir(ctx->directory);
-	if (dir_entry) {
-		const char *filename = dir_entry_filename(dir_entry);
-		filestat_t sb;
+	return follow ? stat(path, sb) : lstat(path, sb);
+}
+
+/**
+ * Classify directory entry, filling its file status when it is kept.
+ *
+ * This routine can be called concurrently by several threads.
+ *
+ * @param dfd		file descriptor of the directory, -1 if not available
+ * @param dir		the directory being scanned
+ * @param dir_entry	the directory entry
+ * @param sb		where file status is written
+ * @param fullpath	set to the full path of the entry (halloc'ed) when the
+ *					entry required a stat() call, to be freed by caller
+ *
+ * @return the type of the entry.
+ */
+static enum recursive_scan_entry
+recursive_scan_entry(int dfd, const char *dir, struct dirent *dir_entry,
+	filestat_t *sb, char **fullpath)
+{
+	const char *filename = dir_entry_filename(dir_entry);
 
-		if (GNET_PROPERTY(share_debug) > 19)
-			g_debug("SHARE considering entry \"%s\"", filename);
+	*fullpath = NULL;
 
-		if ('.' == filename[0]) {
-			/* Hidden file, or "." or ".." */
-			goto finish;
+	if (GNET_PROPERTY(share_debug) > 19)
+		g_debug("SHARE considering entry \"%s\"", filename);
+
+	if ('.' == filename[0]) {
+		/* Hidden file, or "." or ".." */
+		return RSCAN_SKIP;
+	}
+
+	sb->st_mode = dir_entry_mode(dir_entry);
+	switch (sb->st_mode) {
+	case 0:
+	case S_IFREG:
+	case S_IFDIR:
+	case S_IFLNK:
+		break;
+	default:
+		if (GNET_PROPERTY(share_debug)) {
+			g_warning("skipping file of unknown type \"%s\" in \"%s\"",
+				dir, filename);
 		}
+		return RSCAN_SKIP;
+	}
 
-		sb.st_mode = dir_entry_mode(dir_entry);
-		switch (sb.st_mode) {
-		case 0:
-		case S_IFREG:
-		case S_IFDIR:
-		case S_IFLNK:
-			break;
-		default:
-			if (GNET_PROPERTY(share_debug)) {
-				g_warning("skipping file of unknown type \"%s\" in \"%s\"",
-					ctx->current_dir, filename);
-			}
-			goto finish;
+	if (
+		S_ISLNK(sb->st_mode) &&
+		GNET_PROPERTY(scan_ignore_symlink_dirs) &&
+		GNET_PROPERTY(scan_ignore_symlink_regfiles)
+	) {
+		if (GNET_PROPERTY(share_debug) > 15) {
+			g_debug("SHARE to-be-ignored symlink, discarding \"%s\"",
+				filename);
+		}
+		return RSCAN_SKIP;
+	}
+
+	if (
+		S_ISREG(sb->st_mode) &&
+		!shared_file_valid_extension(filename)
+	) {
+		if (GNET_PROPERTY(share_debug) > 15) {
+			g_debug("SHARE unshared extension, discarding \"%s\"",
+				filename);
+		}
+		return RSCAN_SKIP;
+	}
+
+	*fullpath = make_pathname(dir, filename);
+	if (S_ISREG(sb->st_mode) || S_ISDIR(sb->st_mode)) {
+		if (recursive_scan_stat(dfd, filename, *fullpath, sb, TRUE)) {
+			g_warning("stat() failed %s: %m", *fullpath);
+			return RSCAN_SKIP;
+		}
+	} else if (!S_ISLNK(sb->st_mode)) {
+		if (recursive_scan_stat(dfd, filename, *fullpath, sb, FALSE)) {
+			g_warning("lstat() failed %s: %m", *fullpath);
+			return RSCAN_SKIP;
 		}
 
 		if (
-			S_ISLNK(sb.st_mode) &&
+			S_ISLNK(sb->st_mode) &&
 			GNET_PROPERTY(scan_ignore_symlink_dirs) &&
 			GNET_PROPERTY(scan_ignore_symlink_regfiles)
 		) {
+			/*
+			 * We check this again because dir_entry_mode() does not
+			 * work everywhere.
+			 */
 			if (GNET_PROPERTY(share_debug) > 15) {
 				g_debug("SHARE to-be-ignored symlink, discarding \"%s\"",
 					filename);
 			}
-			goto finish;
+			return RSCAN_SKIP;
 		}
+	}
+
+	/* Get info on the symlinked file */
+	if (S_ISLNK(sb->st_mode)) {
+		if (recursive_scan_stat(dfd, filename, *fullpath, sb, TRUE)) {
+			g_warning("broken symlink %s: %m", *fullpath);
+			return RSCAN_SKIP;
+		}
+
+		/*
+		 * For symlinks, we check whether we are supposed to process
+		 * symlinks for that type of entry, then either proceed or skip the
+		 * entry.
+		 */
 
 		if (
-			S_ISREG(sb.st_mode) &&
-			!shared_file_valid_extension(filename)
+			S_ISDIR(sb->st_mode) &&
+			GNET_PROPERTY(scan_ignore_symlink_dirs)
 		) {
-			if (GNET_PROPERTY(share_debug) > 15) {
-				g_debug("SHARE unshared extension, discarding \"%s\"",
-					filename);
-			}
-			goto finish;
+			if (GNET_PROPERTY(share_debug) > 15)
+				g_debug("SHARE discarding symlink dir \"%s\"", filename);
+			return RSCAN_SKIP;
+		}
+		if (
+			S_ISREG(sb->st_mode) &&
+			GNET_PROPERTY(scan_ignore_symlink_regfiles)
+		) {
+			if (GNET_PROPERTY(share_debug) > 15)
+				g_debug("SHARE discarding symlink file \"%s\"", filename);
+			return RSCAN_SKIP;
 		}
+	}
 
-		ctx->ticks += 10;	/* Heavier work */
+	if (S_ISDIR(sb->st_mode))
+		return RSCAN_DIR;
 
-		fullpath = make_pathname(ctx->current_dir, filename);
-		if (S_ISREG(sb.st_mode) || S_ISDIR(sb.st_mode)) {
-			if (stat(fullpath, &sb)) {
-				g_warning("stat() failed %s: %m", fullpath);
-				goto finish;
-			}
-		} else if (!S_ISLNK(sb.st_mode)) {
-			if (lstat(fullpath, &sb)) {
-				g_warning("lstat() failed %s: %m", fullpath);
-				goto finish;
-			}
+	if (S_ISREG(sb->st_mode)) {
+		if (GNET_PROPERTY(share_debug) > 10)
+			g_debug("SHARE adding file \"%s\"", filename);
+		return RSCAN_FILE;
+	}
 
-			if (
-				S_ISLNK(sb.st_mode) &&
-				GNET_PROPERTY(scan_ignore_symlink_dirs) &&
-				GNET_PROPERTY(scan_ignore_symlink_regfiles)
-			) {
-				/*
-				 * We check this again because dir_entry_mode() does not
-				 * work everywhere.
-				 */
-				if (GNET_PROPERTY(share_debug) > 15) {
-					g_debug("SHARE to-be-ignored symlink, discarding \"%s\"",
-						filename);
-				}
-				goto finish;
-			}
-		}
+	return RSCAN_SKIP;
+}
 
-		/* Get info on the symlinked file */
-		if (S_ISLNK(sb.st_mode)) {
-			if (stat(fullpath, &sb)) {
-				g_warning("broken symlink %s: %m", fullpath);
-				goto finish;
-			}
+static void
+recursive_scan_readdir(struct recursive_scan *ctx)
+{
+	char *fullpath = NULL;
+	struct dirent *dir_entry;
 
-			/*
-			 * For symlinks, we check whether we are supposed to process
-			 * symlinks for that type of entry, then either proceed or skip the
-			 * entry.
-			 */
+	recursive_scan_check(ctx);
+	g_assert(ctx->directory);
 
-			if (
-				S_ISDIR(sb.st_mode) &&
-				GNET_PROPERTY(scan_ignore_symlink_dirs)
-			) {
-				if (GNET_PROPERTY(share_debug) > 15)
-					g_debug("SHARE discarding symlink dir \"%s\"", filename);
-				goto finish;
-			}
-			if (
-				S_ISREG(sb.st_mode) &&
-				GNET_PROPERTY(scan_ignore_symlink_regfiles)
-			) {
-				if (GNET_PROPERTY(share_debug) > 15)
-					g_debug("SHARE discarding symlink file \"%s\"", filename);
-				goto finish;
-			}
-		}
+	dir_entry = readdir(ctx->directory);
+	if (dir_entry) {
+		filestat_t sb;
+		enum recursive_scan_entry type;
+
+		type = recursive_scan_entry(recursive_scan_dirfd(ctx->directory),
+			ctx->current_dir, dir_entry, &sb, &fullpath);
+
+		if (fullpath != NULL)
+			ctx->ticks += 10;	/* Heavier work */
+
+		ctx->entries_seen++;
 
-		if (S_ISDIR(sb.st_mode)) {
+		switch (type) {
+		case RSCAN_DIR:
 			/* If a directory, add to list for later processing */
 			slist_prepend(ctx->sub_dirs, fullpath);
 			fullpath = NULL;
-		} else if (S_ISREG(sb.st_mode)) {
-			shared_file_t *sf;
-
-			if (GNET_PROPERTY(share_debug) > 10)
-				g_debug("SHARE adding file \"%s\"", filename);
+			break;
+		case RSCAN_FILE:
+			{
+				shared_file_t *sf;
 
-			sf = share_scan_add_file(ctx->relative_path, fullpath, &sb);
-			if (sf) {
-				slist_append(ctx->shared_files, shared_file_ref(sf));
+				sf = share_scan_add_file(ctx->relative_path, fullpath, &sb);
+				if (sf) {
+					slist_append(ctx->shared_files, shared_file_ref(sf));
+				}
 			}
+			break;
+		case RSCAN_SKIP:
+			break;
 		}
 	} else {
 		recursive_scan_closedir(ctx);
 	}
 
-finish:
 	HFREE_NULL(fullpath);
 }
 
 /**
- * Callback invoked by the background task layer when a task is terminated.
+ * A directory queued for the parallel scanner.
  */
-static void
-recursive_scan_done(struct bgtask *bt, void *data, bgstatus_t status, void *arg)
-{
-	struct recursive_scan *ctx = data;
+struct share_scan_dir {
+	char *path;					/**< Directory to scan (halloc'ed) */
+	const char *base_dir;		/**< Shared directory it belongs to (atom) */
+};
 
-	recursive_scan_check(ctx);
-	(void) arg;
+/**
+ * A regular file found by the parallel scanner.
+ */
+struct share_scan_file {
+	char *path;					/**< Full path of file (halloc'ed) */
+	const char *dir;			/**< Directory holding the file (atom) */
+	const char *base_dir;		/**< Shared directory it belongs to (atom) */
+	filestat_t sb;				/**< File status */
+};
 
-	/*
-	 * Tracing for debugging purposes.
-	 */
+enum share_scanner_magic { SHARE_SCANNER_MAGIC = 0x2c4b1e93U };
 
-	if (GNET_PROPERTY(share_debug)) {
-		g_debug("terminating background task \"%s\" in %s, status=%s, "
-			"ran %'lu ms (%s)",
-			bg_task_name(bt), thread_name(), bgstatus_to_string(status),
-			bg_task_wtime(bt), short_time_ascii(bg_task_wtime(bt) / 1000));
-	}
+/**
+ * The parallel scanner.
+ *
+ * A set of worker threads traverse the shared directories concurrently,
+ * each scanning one directory at a time and queueing the sub-directories
+ * it finds for the other workers.  The regular files found are queued for
+ * the background task, which merges them into the library being built via
+ * share_scan_add_file(), so that the recursive_scan context remains only
+ * accessed by the library thread.
+ *
+ * Workers only deal with the filesystem: the conversion of relative paths,
+ * which relies on non-reentrant iconv() descriptors, is left to the task.
+ */
+struct share_scanner {
+	enum share_scanner_magic magic;
+	mutex_t lock;				/**< Protects fields below */
+	cond_t event;				/**< New directories, new files or end */
+	slist_t *dirs;				/**< Queued share_scan_dir */
+	slist_t *files;				/**< Queued share_scan_file */
+	uint busy;					/**< Workers scanning a directory */
+	bool stop;					/**< Whether workers must stop */
+	uint64 dirs_scanned;		/**< Directories scanned */
+	uint64 entries_seen;		/**< Directory entries seen */
+	slist_t *watched;			/**< Directories scanned (atoms), or NULL */
+	uint *tid;					/**< Worker thread IDs */
+	uint count;					/**< Amount of workers */
+	uint max;					/**< Amount of slots in tid[] */
+};
 
-	/*
-	 * If background tasks are run in the main thread, then we need to
-	 * explicitly reset the current task.  Otherwise, this is done in
-	 * the library thread, which explicitly invokes the scheduler.
-	 */
+#define SHARE_SCAN_THREADS		4	/**< Default amount of scanning threads */
+#define SHARE_SCAN_BATCH		256	/**< Files found before publishing them */
+#define SHARE_SCAN_WAIT			50	/**< ms, max wait for files to merge */
 
-	if (THREAD_MAIN_ID == share_thread_id) {
-		struct share_thread_vars *v = &share_thread_vars;
+static inline void
+share_scanner_check(const struct share_scanner * const sc)
+{
+	g_assert(sc != NULL);
+	g_assert(SHARE_SCANNER_MAGIC == sc->magic);
+}
 
-		/*
-		 * Taking the lock is not really necessary here because if we run
-		 * in the main thread, everything is serialized, so there cannot be
-		 * any concurrent access on these variables.  For uniformity though...
-		 *		--RAM, 2015-03-06
-		 */
+static void
+share_scan_dir_free(void *p)
+{
+	struct share_scan_dir *d = p;
 
-		spinlock(&v->lock);
+	HFREE_NULL(d->path);
+	atom_str_free_null(&d->base_dir);
+	WFREE(d);
+}
 
-		if (bt == v->task)
-			v->task = NULL;
+static void
+share_scan_file_free(void *p)
+{
+	struct share_scan_file *f = p;
 
-		spinunlock(&v->lock);
-	}
+	HFREE_NULL(f->path);
+	atom_str_free_null(&f->dir);
+	atom_str_free_null(&f->base_dir);
+	WFREE(f);
 }
 
 /**
- * Signal handler for task termination.
- *
- * This handler is invoked from the background task scheduler and is therefore
- * run in the thread that is handling the background task...  Not necessarily
- * the main thread.
+ * @return whether the scanner has nothing left to traverse.
  */
-static void
-recursive_scan_sighandler(struct bgtask *bt, void *data, bgsig_t sig)
+static inline bool
+share_scanner_idle(const struct share_scanner *sc)
 {
-	struct recursive_scan *ctx = data;
-
-	recursive_scan_check(ctx);
-	g_assert(BG_SIG_TERM == sig);
+	assert_mutex_is_owned(&sc->lock);
 
-	/*
-	 * Tracing for debugging purposes.
-	 */
-
-	if (GNET_PROPERTY(share_debug)) {
-		g_debug("cancelling background task \"%s\" in %s, currently in %s()",
-			bg_task_name(bt), thread_name(), bg_task_step_name(bt));
-	}
+	return sc->stop || (0 == sc->busy && 0 == slist_length(sc->dirs));
 }
 
-static void *
-recursive_rescan_starting(void *unused)
+/**
+ * Make the directories and files found by a worker visible.
+ *
+ * @param sc		the scanner
+ * @param dirs		sub-directories found, emptied on return
+ * @param files		regular files found, emptied on return
+ */
+static void
+share_scanner_publish(struct share_scanner *sc, slist_t *dirs, slist_t *files)
 {
-	(void) unused;
+	void *p;
 
-	gnet_prop_set_boolean_val(PROP_LIBRARY_REBUILDING, TRUE);
-	gnet_prop_set_timestamp_val(PROP_LIBRARY_RESCAN_STARTED, tm_time());
+	mutex_lock(&sc->lock);
 
-	return NULL;
+	while (NULL != (p = slist_shift(dirs)))
+		slist_prepend(sc->dirs, p);
+	while (NULL != (p = slist_shift(files)))
+		slist_append(sc->files, p);
+
+	cond_broadcast(&sc->event, &sc->lock);
+	mutex_unlock(&sc->lock);
 }
 
 /**
- * First step, intalling signal handler to trap task cancel.
+ * Scan one directory, queueing its sub-directories and files.
  */
-static bgret_t
-recursive_scan_step_setup(struct bgtask *bt, void *data, int uticks)
+static void
+share_scanner_dir(struct share_scanner *sc, const struct share_scan_dir *d)
 {
-	struct recursive_scan *ctx = data;
-
-	recursive_scan_check(ctx);
+	slist_t *dirs, *files;
+	const char *dir;
+	struct dirent *dir_entry;
+	uint64 entries = 0;
+	DIR *dp;
+	int dfd;
 
-	(void) uticks;
+	if (directory_is_unshareable(d->path))
+		return;
 
-	/*
-	 * The BG_SIG_TERM signal will be sent by the background task scheduler
-	 * when the task is cancelled.
+	/**
+	 * FIXME: On Windows FindFirstFile/FindNextFile/FindClose
+	 *		  must be used to get the Unicode filenames.
+	 */
+	if (NULL == (dp = opendir(d->path))) {
+		g_warning("can't open directory %s: %m", d->path);
+		return;
+	}
+
+	if (GNET_PROPERTY(share_debug) > 5)
+		g_debug("SHARE scanning directory \"%s\"", d->path);
+
+	dir = atom_str_get(d->path);
+	dirs = slist_new();
+	files = slist_new();
+	dfd = recursive_scan_dirfd(dp);
+
+	while (NULL != (dir_entry = readdir(dp))) {
+		char *fullpath;
+		filestat_t sb;
+
+		if G_UNLIKELY(atomic_bool_get(&sc->stop))
+			break;
+
+		entries++;
+
+		switch (recursive_scan_entry(dfd, d->path, dir_entry, &sb, &fullpath)) {
+		case RSCAN_DIR:
+			{
+				struct share_scan_dir *sd;
+
+				WALLOC(sd);
+				sd->path = fullpath;
+				sd->base_dir = atom_str_get(d->base_dir);
+				slist_prepend(dirs, sd);
+				fullpath = NULL;
+			}
+			break;
+		case RSCAN_FILE:
+			{
+				struct share_scan_file *sf;
+
+				WALLOC(sf);
+				sf->path = fullpath;
+				sf->dir = atom_str_get(dir);
+				sf->base_dir = atom_str_get(d->base_dir);
+				sf->sb = sb;
+				slist_append(files, sf);
+				fullpath = NULL;
+
+				if (slist_length(files) >= SHARE_SCAN_BATCH)
+					share_scanner_publish(sc, dirs, files);
+			}
+			break;
+		case RSCAN_SKIP:
+			break;
+		}
+
+		HFREE_NULL(fullpath);
+	}
+
+	closedir(dp);
+
+	share_scanner_publish(sc, dirs, files);
+	slist_free(&dirs);
+	slist_free(&files);
+
+	mutex_lock(&sc->lock);
+	sc->dirs_scanned++;
+	sc->entries_seen += entries;
+	if (sc->watched != NULL) {
+		slist_append(sc->watched, deconstify_char(dir));
+		dir = NULL;		/* Reference transferred */
+	}
+	mutex_unlock(&sc->lock);
+
+	atom_str_free_null(&dir);
+}
+
+/**
+ * Parallel scanner worker thread.
+ */
+static void *
+share_scanner_thread(void *arg)
+{
+	struct share_scanner *sc = arg;
+
+	share_scanner_check(sc);
+	thread_set_name("library scanner");
+
+	mutex_lock(&sc->lock);
+
+	for (;;) {
+		struct share_scan_dir *d;
+
+		while (0 == slist_length(sc->dirs) && !share_scanner_idle(sc))
+			cond_wait(&sc->event, &sc->lock);
+
+		if (share_scanner_idle(sc))
+			break;
+
+		d = slist_shift(sc->dirs);
+		sc->busy++;
+		mutex_unlock(&sc->lock);
+
+		share_scanner_dir(sc, d);
+		share_scan_dir_free(d);
+
+		mutex_lock(&sc->lock);
+		sc->busy--;
+		cond_broadcast(&sc->event, &sc->lock);
+	}
+
+	cond_broadcast(&sc->event, &sc->lock);
+	mutex_unlock(&sc->lock);
+
+	return NULL;
+}
+
+/**
+ * @return the amount of threads to use for scanning the library.
+ */
+static uint
+share_scanner_threads(void)
+{
+	uint n = GNET_PROPERTY(scan_threads);
+
+	return 0 == n ? SHARE_SCAN_THREADS : n;
+}
+
+/**
+ * Create a parallel scanner for the shared directories of the context,
+ * which are transferred to the scanner.
+ *
+ * @return the new scanner, NULL if no worker thread could be launched.
+ */
+static struct share_scanner *
+share_scanner_make(struct recursive_scan *ctx, uint n)
+{
+	struct share_scanner *sc;
+	const char *dir;
+	uint i;
+
+	recursive_scan_check(ctx);
+	g_assert(n > 1);
+
+	WALLOC0(sc);
+	sc->magic = SHARE_SCANNER_MAGIC;
+	mutex_init(&sc->lock);
+	cond_init(&sc->event, &sc->lock);
+	sc->dirs = slist_new();
+	sc->files = slist_new();
+	WALLOC_ARRAY(sc->tid, n);
+	sc->max = n;
+	if (ctx->watched != NULL)
+		sc->watched = slist_new();
+
+	while (NULL != (dir = slist_shift(ctx->base_dirs))) {
+		struct share_scan_dir *d;
+
+		WALLOC(d);
+		d->path = h_strdup(dir);
+		d->base_dir = dir;		/* Reference transferred */
+		slist_append(sc->dirs, d);
+	}
+
+	for (i = 0; i < n; i++) {
+		int r = thread_create(share_scanner_thread, sc,
+					THREAD_F_NO_POOL | THREAD_F_WARN, THREAD_STACK_MIN);
+
+		if (-1 == r)
+			break;
+
+		sc->tid[sc->count++] = r;
+	}
+
+	if (0 == sc->count) {
+		struct share_scan_dir *d;
+
+		/*
+		 * Could not create any thread: give back the directories to the
+		 * context, which will scan them sequentially.
+		 */
+
+		while (NULL != (d = slist_shift(sc->dirs))) {
+			slist_append(ctx->base_dirs, deconstify_char(d->base_dir));
+			d->base_dir = NULL;
+			share_scan_dir_free(d);
+		}
+	}
+
+	if (GNET_PROPERTY(share_debug)) {
+		g_debug("SHARE scanning library with %u thread%s",
+			PLURAL(MAX(1, sc->count)));
+	}
+
+	if (0 == sc->count) {
+		slist_free(&sc->dirs);
+		slist_free(&sc->files);
+		slist_free_all(&sc->watched, scan_base_dir_free);
+		WFREE_ARRAY(sc->tid, n);
+		cond_destroy(&sc->event);
+		mutex_destroy(&sc->lock);
+		sc->magic = 0;
+		WFREE(sc);
+		return NULL;
+	}
+
+	return sc;
+}
+
+/**
+ * Stop the parallel scanner, waiting for its threads, and free it.
+ */
+static void
+share_scanner_free_null(struct share_scanner **sc_ptr)
+{
+	struct share_scanner *sc = *sc_ptr;
+	uint i;
+
+	if (NULL == sc)
+		return;
+
+	share_scanner_check(sc);
+
+	mutex_lock(&sc->lock);
+	sc->stop = TRUE;
+	cond_broadcast(&sc->event, &sc->lock);
+	mutex_unlock(&sc->lock);
+
+	for (i = 0; i < sc->count; i++) {
+		if (-1 == thread_join(sc->tid[i], NULL))
+			g_warning("%s(): cannot join thread #%u: %m", G_STRFUNC, sc->tid[i]);
+	}
+
+	slist_free_all(&sc->dirs, share_scan_dir_free);
+	slist_free_all(&sc->files, share_scan_file_free);
+	slist_free_all(&sc->watched, scan_base_dir_free);
+	WFREE_ARRAY(sc->tid, sc->max);
+	cond_destroy(&sc->event);
+	mutex_destroy(&sc->lock);
+	sc->magic = 0;
+	WFREE(sc);
+	*sc_ptr = NULL;
+}
+
+/**
+ * Callback invoked by the background task layer when a task is terminated.
+ */
+static void
+recursive_scan_done(struct bgtask *bt, void *data, bgstatus_t status, void *arg)
+{
+	struct recursive_scan *ctx = data;
+
+	recursive_scan_check(ctx);
+	(void) arg;
+
+	/*
+	 * Tracing for debugging purposes.
+	 */
+
+	if (GNET_PROPERTY(share_debug)) {
+		g_debug("terminating background task \"%s\" in %s, status=%s, "
+			"ran %'lu ms (%s)",
+			bg_task_name(bt), thread_name(), bgstatus_to_string(status),
+			bg_task_wtime(bt), short_time_ascii(bg_task_wtime(bt) / 1000));
+	}
+
+	/*
+	 * If background tasks are run in the main thread, then we need to
+	 * explicitly reset the current task.  Otherwise, this is done in
+	 * the library thread, which explicitly invokes the scheduler.
+	 */
+
+	if (THREAD_MAIN_ID == share_thread_id) {
+		struct share_thread_vars *v = &share_thread_vars;
+
+		/*
+		 * Taking the lock is not really necessary here because if we run
+		 * in the main thread, everything is serialized, so there cannot be
+		 * any concurrent access on these variables.  For uniformity though...
+		 *		--RAM, 2015-03-06
+		 */
+
+		spinlock(&v->lock);
+
+		if (bt == v->task)
+			v->task = NULL;
+
+		spinunlock(&v->lock);
+	}
+}
+
+/**
+ * Signal handler for task termination.
+ *
+ * This handler is invoked from the background task scheduler and is therefore
+ * run in the thread that is handling the background task...  Not necessarily
+ * the main thread.
+ */
+static void
+recursive_scan_sighandler(struct bgtask *bt, void *data, bgsig_t sig)
+{
+	struct recursive_scan *ctx = data;
+
+	recursive_scan_check(ctx);
+	g_assert(BG_SIG_TERM == sig);
+
+	/*
+	 * Tracing for debugging purposes.
+	 */
+
+	if (GNET_PROPERTY(share_debug)) {
+		g_debug("cancelling background task \"%s\" in %s, currently in %s()",
+			bg_task_name(bt), thread_name(), bg_task_step_name(bt));
+	}
+}
+
+static void *
+recursive_rescan_starting(void *unused)
+{
+	(void) unused;
+
+	gnet_prop_set_boolean_val(PROP_LIBRARY_REBUILDING, TRUE);
+	gnet_prop_set_timestamp_val(PROP_LIBRARY_RESCAN_STARTED, tm_time());
+
+	return NULL;
+}
+
+/**
+ * First step, intalling signal handler to trap task cancel.
+ */
+static bgret_t
+recursive_scan_step_setup(struct bgtask *bt, void *data, int uticks)
+{
+	struct recursive_scan *ctx = data;
+
+	recursive_scan_check(ctx);
+
+	(void) uticks;
+
+	/*
+	 * The BG_SIG_TERM signal will be sent by the background task scheduler
+	 * when the task is cancelled.
 	 */
 
 	bg_task_signal(bt, BG_SIG_TERM, recursive_scan_sighandler);
@@ -2042,6 +2649,11 @@ recursive_scan_step_setup(struct bgtask *bt, void *data, int uticks)
 
 	teq_safe_rpc(THREAD_MAIN_ID, recursive_rescan_starting, NULL);
 
+	tm_precise_time(&ctx->scan_start);
+
+	if (share_scanner_threads() > 1)
+		ctx->scanner = share_scanner_make(ctx, share_scanner_threads());
+
 	bg_task_ticks_used(bt, 0);
 	return BGR_NEXT;
 }
@@ -2077,6 +2689,99 @@ recursive_scan_next_dir(struct recursive_scan *ctx)
 	}
 }
 
+/**
+ * Merge the files found by the parallel scanner into the library.
+ *
+ * @return TRUE if finished.
+ */
+static bool
+recursive_scan_merge(struct recursive_scan *ctx, int ticks)
+{
+	struct share_scanner *sc = ctx->scanner;
+	slist_t *files = slist_new();
+	struct share_scan_file *f;
+	bool done;
+
+	recursive_scan_check(ctx);
+	share_scanner_check(sc);
+
+	bg_task_cancel_test(ctx->task);
+
+	mutex_lock(&sc->lock);
+
+	/*
+	 * Wait a little for the workers to find files, unless we are running
+	 * in the main thread which must never block.
+	 */
+
+	if (
+		0 == slist_length(sc->files) && !share_scanner_idle(sc) &&
+		!thread_is_main()
+	) {
+		tm_t timeout;
+
+		tm_fill_ms(&timeout, SHARE_SCAN_WAIT);
+		cond_timed_wait(&sc->event, &sc->lock, &timeout);
+	}
+
+	/*
+	 * Each file costs about 10 ticks, as in recursive_scan_readdir().
+	 */
+
+	while (
+		slist_length(files) < UNSIGNED(MAX(1, ticks / 10)) &&
+		NULL != (f = slist_shift(sc->files))
+	)
+		slist_append(files, f);
+
+	done = 0 == slist_length(sc->files) && share_scanner_idle(sc);
+
+	if (done) {
+		void *dir;
+
+		ctx->dirs_scanned = sc->dirs_scanned;
+		ctx->entries_seen = sc->entries_seen;
+
+		while (sc->watched != NULL && NULL != (dir = slist_shift(sc->watched)))
+			slist_append(ctx->watched, dir);
+	}
+
+	mutex_unlock(&sc->lock);
+
+	while (NULL != (f = slist_shift(files))) {
+		shared_file_t *sf;
+
+		/*
+		 * Files of a directory are published together, so we only need
+		 * to compute the relative path when the directory changes.  We
+		 * can use the context fields of the sequential scan for that.
+		 */
+
+		if (f->dir != ctx->current_dir) {
+			atom_str_change(&ctx->current_dir, f->dir);
+			atom_str_free_null(&ctx->relative_path);
+			if (GNET_PROPERTY(search_results_expose_relative_paths))
+				ctx->relative_path = get_relative_path(f->base_dir, f->dir);
+		}
+
+		sf = share_scan_add_file(ctx->relative_path, f->path, &f->sb);
+		if (sf) {
+			slist_append(ctx->shared_files, shared_file_ref(sf));
+		}
+		share_scan_file_free(f);
+		ctx->ticks += 10;
+	}
+
+	slist_free(&files);
+
+	if (done) {
+		share_scanner_free_null(&ctx->scanner);
+		recursive_scan_closedir(ctx);
+	}
+
+	return done;
+}
+
 static bgret_t
 recursive_scan_step_compute(struct bgtask *bt, void *data, int ticks)
 {
@@ -2085,6 +2790,16 @@ recursive_scan_step_compute(struct bgtask *bt, void *data, int ticks)
 	recursive_scan_check(ctx);
 
 	ctx->ticks = 0;
+
+	if (ctx->scanner != NULL) {
+		if (recursive_scan_merge(ctx, ticks)) {
+			bg_task_ticks_used(bt, ctx->ticks);
+			return BGR_NEXT;
+		}
+		bg_task_ticks_used(bt, MIN(ctx->ticks, ticks));
+		return BGR_MORE;
+	}
+
 	do {
 		if (recursive_scan_next_dir(ctx)) {
 			bg_task_ticks_used(bt, ctx->ticks);
@@ -2106,10 +2821,13 @@ recursive_scan_step_compute_done(struct bgtask *bt, void *data, int ticks)
 
 	g_assert(NULL == ctx->shared);
 	g_assert(NULL == ctx->search_tb);
+	g_assert(NULL == ctx->scanner);
 
+	tm_precise_time(&ctx->scan_end);
 	ctx->files_scanned = slist_length(ctx->shared_files);
 	ctx->bytes_scanned = 0;
 	ctx->search_tb = st_create();
+	ctx->paths = htable_create(HASH_KEY_STRING, 0);
 
 	bg_task_ticks_used(bt, 0);
 	return BGR_NEXT;
@@ -2144,6 +2862,7 @@ recursive_scan_step_build_search_table(struct bgtask *bt, void *data, int ticks)
 			st_insert_item(ctx->search_tb, ST_SET_ALIAS, sf->name_normal, sf);
 
 		ctx->shared = pslist_prepend_const(ctx->shared, sf);
+		htable_insert_const(ctx->paths, sf->file_path, sf);
 		upload_stats_enforce_local_filename(sf);
 	}
 
@@ -2261,16 +2980,34 @@ recursive_update_scan_timing(void *data)
 {
 	struct recursive_scan *ctx = data;
 	time_delta_t elapsed;
+	tm_nano_t now;
+	double traversal, indexing;
+	uint32 rate;
 
 	recursive_scan_check(ctx);
 
 	elapsed = delta_time(tm_time_exact(), ctx->start_time);
 	elapsed = MAX(0, elapsed);
 
+	tm_precise_time(&now);
+	traversal = tm_precise_elapsed_f(&ctx->scan_end, &ctx->scan_start);
+	indexing = tm_precise_elapsed_f(&now, &ctx->scan_end);
+	rate = traversal > 0.0 ?
+		MIN(ctx->entries_seen / traversal, MAX_INT_VAL(uint32)) : 0;
+
 	gnet_prop_set_timestamp_val(PROP_LIBRARY_RESCAN_FINISHED, tm_time());
 	gnet_prop_set_guint32_val(PROP_LIBRARY_RESCAN_DURATION, elapsed);
+	gnet_prop_set_guint32_val(PROP_LIBRARY_RESCAN_RATE, rate);
 
-	return NULL;
+	if (GNET_PROPERTY(share_debug)) {
+		g_info("SHARE scanned %'zu entr%s in %'zu director%s (%u files/s): "
+			"traversal %.3f secs, indexing %.3f secs, %'zu file%s shared",
+			(size_t) ctx->entries_seen, plural_y(ctx->entries_seen),
+			(size_t) ctx->dirs_scanned, plural_y(ctx->dirs_scanned),
+			rate, traversal, indexing, PLURAL((size_t) ctx->files_scanned));
+	}
+
+	return NULL;
 }
 
 static bgret_t
@@ -2334,10 +3071,13 @@ next:
 }
 
 static void *
-recursive_install_shared(void *unused)
+recursive_install_shared(void *data)
 {
-	(void) unused;
+	struct recursive_scan *ctx = data;
+
+	recursive_scan_check(ctx);
 
+	share_watch_install(&ctx->watched);
 	gcu_gui_update_files_scanned();		/* Final view */
 	gnet_prop_set_boolean_val(PROP_LIBRARY_REBUILDING, FALSE);
 
@@ -2367,6 +3107,8 @@ recursive_scan_step_install_shared(struct bgtask *bt, void *data, int ticks)
 	struct recursive_scan *ctx = data;
 	size_t i;
 	pslist_t *files;
+	search_table_t *old_st;
+	struct shared_ftable *ft, *old_ft;
 
 	recursive_scan_check(ctx);
 	g_assert(ctx->search_tb != NULL);
@@ -2409,12 +3151,16 @@ recursive_scan_step_install_shared(struct bgtask *bt, void *data, int ticks)
 	SHARED_LIBFILE_LOCK;
 
 	/*
-	 * Don't let share_free() free the list of files whilst we hold the lock.
+	 * The old search table, file tables and list of files are only retired
+	 * once the new ones are published: lock-free readers must always find
+	 * valid tables.
 	 */
 
 	files = shared_libfile.shared_files;
-	shared_libfile.shared_files = NULL;
-	share_free();
+	old_st = shared_libfile.search_table;
+	old_ft = shared_libfile.ftable;
+	htable_free_null(&shared_libfile.file_basenames);
+	htable_free_null(&shared_libfile.file_paths);
 
 	/*
 	 * All the files in the list are no longer indexed, as we create new
@@ -2428,11 +3174,14 @@ recursive_scan_step_install_shared(struct bgtask *bt, void *data, int ticks)
 
 	pslist_foreach(files, shared_file_detach, NULL);
 
+	ft = shared_ftable_make(ctx->files, ctx->sorted, ctx->files_scanned);
+	atomic_mb();		/* New tables are complete before being visible */
+
 	shared_libfile.search_table			= ctx->search_tb;
 	shared_libfile.file_basenames		= ctx->basenames;
 	shared_libfile.shared_files			= ctx->shared;
-	shared_libfile.file_table			= ctx->files;
-	shared_libfile.sorted_file_table	= ctx->sorted;
+	shared_libfile.ftable				= ft;
+	shared_libfile.file_paths			= ctx->paths;
 	shared_libfile.files_scanned		= ctx->files_scanned;
 	shared_libfile.bytes_scanned		= ctx->bytes_scanned;
 
@@ -2445,12 +3194,15 @@ recursive_scan_step_install_shared(struct bgtask *bt, void *data, int ticks)
 	ctx->shared = NULL;
 	ctx->files = NULL;
 	ctx->sorted = NULL;
+	ctx->paths = NULL;
 
 	reinit_sha1_table();		/* Must happen whilst we hold the lock */
 
 	SHARED_LIBFILE_UNLOCK;
 
-	shared_file_slist_free_null(&files);
+	epoch_retire(share_epoch, old_st, share_st_free);
+	epoch_retire(share_epoch, old_ft, shared_ftable_free);
+	epoch_retire(share_epoch, files, share_files_free);
 
 	/*
 	 * If we're not running in the main thread, we need to funnel this
@@ -2459,7 +3211,7 @@ recursive_scan_step_install_shared(struct bgtask *bt, void *data, int ticks)
 	 *		--RAM, 2013-10-29
 	 */
 
-	teq_safe_rpc(THREAD_MAIN_ID, recursive_install_shared, NULL);
+	teq_safe_rpc(THREAD_MAIN_ID, recursive_install_shared, ctx);
 
 	/*
 	 * The next step is going to request the SHA1 of all the library files,
@@ -2494,7 +3246,7 @@ recursive_scan_load_ftable(struct recursive_scan *ctx)
 	XMALLOC0_ARRAY(ctx->ftable, ctx->ftable_capacity);
 
 	for (i = 0; i < ctx->ftable_capacity; i++) {
-		shared_file_t *sf = shared_libfile.file_table[i];
+		shared_file_t *sf = shared_libfile.ftable->files[i];
 
 		if (sf != NULL)
 			ctx->ftable[i] = shared_file_ref(sf);
@@ -2703,6 +3455,7 @@ static bgret_t
 recursive_scan_step_install_partials(struct bgtask *bt, void *data, int ticks)
 {
 	struct recursive_scan *ctx = data;
+	search_table_t *old;
 
 	recursive_scan_check(ctx);
 	g_assert(ctx->partial_tb != NULL);
@@ -2723,12 +3476,15 @@ recursive_scan_step_install_partials(struct bgtask *bt, void *data, int ticks)
 
 	SHARED_LIBFILE_LOCK;
 
-	st_free(&shared_libfile.partial_table);
+	old = shared_libfile.partial_table;
+	atomic_mb();		/* New table is complete before being visible */
 	shared_libfile.partial_table = ctx->partial_tb;
 	ctx->partial_tb = NULL;
 
 	SHARED_LIBFILE_UNLOCK;
 
+	epoch_retire(share_epoch, old, share_st_free);
+
 	bg_task_ticks_used(bt, 0);
 	return BGR_NEXT;
 }
@@ -2795,7 +3551,13 @@ recursive_scan_step_update_qrp_lib(struct bgtask *bt, void *data, int ticks)
 			SHARED_LIBFILE_UNLOCK;
 			break;
 		}
-		sf = shared_libfile.sorted_file_table[ctx->idx];
+		/*
+		 * Move to the next entry before processing this one: the table
+		 * can have holes left by removed files, and a file must be counted
+		 * only once since the QRP words are reference-counted.
+		 */
+
+		sf = shared_libfile.ftable->sorted[ctx->idx++];
 		if (sf != NULL)
 			sf = shared_file_ref(sf);
 
@@ -2812,8 +3574,6 @@ recursive_scan_step_update_qrp_lib(struct bgtask *bt, void *data, int ticks)
 
 		if (0 == (ctx->ticks & 0xf))
 			bg_task_cancel_test(ctx->task);
-
-		ctx->idx++;
 	}
 
 	bg_task_ticks_used(bt, ctx->ticks);
@@ -3001,252 +3761,1232 @@ share_update_qrp_create_task(bgsched_t *bs)
 	};
 	struct recursive_scan *ctx;
 
-	ctx = recursive_scan_new(NULL, tm_time());
+	ctx = recursive_scan_new(NULL, tm_time());
+
+	return ctx->task = bg_task_create(bs, "QRP update",
+				steps, N_ITEMS(steps),
+				ctx, recursive_scan_context_free,
+				recursive_scan_done, NULL);
+}
+
+/*
+ * The "share_thread_lib_xxx" routine is the implementation, within the
+ * "library" thread, of the corresponding API invoked from the "main" thread.
+ *
+ * These are handled as TEQ events, and are therefore delivered to the
+ * thread in the same order as they were issued.
+ */
+
+/**
+ * Start a library scan.
+ */
+static void
+share_thread_lib_rescan(void *unused_arg)
+{
+	struct share_thread_vars *v = &share_thread_vars;
+
+	(void) unused_arg;
+
+	spinlock(&v->lock);
+
+	if (v->task != NULL) {
+		bg_task_cancel(v->task);
+		v->task = NULL;
+	}
+
+	v->qrp_rebuild = FALSE;		/* since rescan takes care of it */
+	v->task = share_rescan_create_task(v->sched);
+
+	spinunlock(&v->lock);
+}
+
+/**
+ * Request a QRP rebuild.
+ */
+static void
+share_thread_lib_qrp_rebuild(void *unused_arg)
+{
+	struct share_thread_vars *v = &share_thread_vars;
+	bool pending;
+
+	(void) unused_arg;
+
+	spinlock(&v->lock);
+
+	if (v->task != NULL) {
+		v->qrp_rebuild = TRUE;		/* record for later */
+	} else {
+		v->task = share_update_qrp_create_task(v->sched);
+		v->qrp_rebuild = FALSE;
+	}
+
+	pending = v->qrp_rebuild;
+	spinunlock(&v->lock);
+
+	if (GNET_PROPERTY(share_debug) > 1) {
+		g_debug("SHARE background QRP recomputation %s",
+			pending ? "recorded" : "started");
+	}
+}
+
+/*
+ * The "share_lib_xxx" routine constitute the API from the "main" thread to the
+ * "library" thread.
+ */
+
+/**
+ * Start a library scan.
+ */
+static void
+share_lib_rescan(void)
+{
+	teq_post_unique(share_thread_id, share_thread_lib_rescan, NULL);
+}
+
+/**
+ * Request a QRP rebuild.
+ *
+ * This will update the QRP table, including both our shared library and our
+ * partials.
+ *
+ * @param force		if TRUE, do not optimize request if one is already pending
+ */
+static void
+share_lib_qrp_rebuild(bool force)
+{
+	bool done;
+
+	done = teq_post_ext(share_thread_id, !force,
+				share_thread_lib_qrp_rebuild, NULL);
+
+	g_assert(implies(force, done));
+
+	if (GNET_PROPERTY(share_debug) > 1) {
+		g_debug("SHARE %s request for background QRP recomputation (%s)",
+			force ? "forced" :
+			done ? "sent" : "avoided duplicate",
+			share_can_answer_partials() ?
+				"with partial files" : "library only");
+	}
+}
+
+/**
+ * Is there work pending for the library thread, or is thread terminated?
+ */
+static bool
+share_thread_has_work(void *unused_arg)
+{
+	struct share_thread_vars *v = &share_thread_vars;
+	(void) unused_arg;
+
+	return atomic_bool_get(&v->exiting) || v->task != NULL || v->qrp_rebuild;
+}
+
+/**
+ * Signal handler to terminate the library thread.
+ */
+static void
+share_thread_terminate(int sig)
+{
+	struct share_thread_vars *v = &share_thread_vars;
+
+	g_assert(TSIG_TERM == sig);
+
+	if (GNET_PROPERTY(share_debug))
+		g_debug("terminating library thread");
+
+	atomic_bool_set(&v->exiting, TRUE);
+	spinlock(&v->lock);
+	if (v->task != NULL) {
+		bg_task_cancel(v->task);
+		v->task = NULL;
+	}
+	spinunlock(&v->lock);
+}
+
+/**
+ * Library thread main loop.
+ */
+static void *
+share_thread_main(void *arg)
+{
+	struct share_thread_vars *v = &share_thread_vars;
+	barrier_t *b = arg;
+
+	thread_set_name("library");
+	teq_create();				/* Queue to receive TEQ events */
+	thread_signal(TSIG_TERM, share_thread_terminate);
+	v->sched = bg_sched_create("library", 1000000 /* 1 s */);
+
+	barrier_wait(b);			/* Thread has initialized */
+	barrier_free_null(&b);
+
+	if (GNET_PROPERTY(share_debug))
+		g_debug("library thread started");
+
+	/*
+	 * Process work until we're told to exit.
+	 */
+
+	while (!atomic_bool_get(&v->exiting)) {
+		struct bgtask *bt;
+		bool qrp_rebuild;
+
+		if (GNET_PROPERTY(share_debug))
+			g_debug("library thread sleeping");
+
+		teq_wait(share_thread_has_work, NULL);
+
+		if (atomic_bool_get(&v->exiting))
+			break;						/* Terminated by signal */
+
+		if (GNET_PROPERTY(share_debug))
+			g_debug("library thread awoken");
+
+		spinlock(&v->lock);
+		bt = v->task;					/* The task run */
+		spinunlock(&v->lock);
+
+		g_assert(bt != NULL);
+
+		while (0 != bg_sched_run(v->sched))
+			thread_check_suspended();
+
+		/*
+		 * QRP table rebuilds can have been recorded whilst we were processing
+		 * the previous task.  If one is present, create the task, which will
+		 * make share_thread_has_work() to return TRUE.
+		 */
+
+		spinlock(&v->lock);
+		if (v->task == bt)
+			v->task = NULL;				/* Finished running previous task */
+		qrp_rebuild = v->qrp_rebuild;
+		spinunlock(&v->lock);
+
+		if (qrp_rebuild)
+			share_thread_lib_qrp_rebuild(NULL);
+	}
+
+	bg_sched_destroy_null(&v->sched);
+
+	g_debug("library thread exiting");
+	return NULL;
+}
+
+/**
+ * Create a new library thread.
+ *
+ * This routine does not return until the library thread has been
+ * correctly initialized, so that the caller can immediately start to
+ * send TEQ events to the thread.
+ *
+ * @return thread ID, -1 on error.
+ */
+static int
+share_thread_create(void)
+{
+	barrier_t *b;
+	int r;
+
+	b = barrier_new(2);
+
+	/*
+	 * The library thread is created as a detached thread because we
+	 * do not expect any result from it.
+	 *
+	 * It is created as non-cancelable: to end it, we send it a TSIG_TERM.
+	 */
+
+	r = thread_create(share_thread_main, barrier_refcnt_inc(b),
+			THREAD_F_DETACH | THREAD_F_NO_CANCEL |
+				THREAD_F_NO_POOL | THREAD_F_PANIC,
+			THREAD_STACK_MIN);
+
+	barrier_wait(b);		/* Wait for thread to initialize */
+	barrier_free_null(&b);
+
+	return r;
+}
+
+/*
+ * Incremental library updates.
+ *
+ * Once a full rescan has installed the library, the directories it traversed
+ * are monitored for changes.  Changed paths are collected and, after a short
+ * delay to coalesce bursts of events, handed over to the library thread which
+ * examines the file system.  Its findings are then applied to the installed
+ * library from the main thread: files that disappeared are de-indexed, new
+ * files are given fresh indices at the end of the file table (keeping the
+ * indices of other files stable) and inserted into the search table, then the
+ * QRP table is incrementally updated with the words of the added and removed
+ * files.  Setting up the kernel watches is also left to the library thread.
+ *
+ * Only one batch of work is handed over at a time.  The watcher is created
+ * and freed by the main thread, but the library thread extends it whilst
+ * working on a batch: should monitoring stop meanwhile, the batch is cancelled
+ * and the watcher is only freed when the batch comes back.
+ *
+ * Full rescans remain necessary when the kernel loses events, when a large
+ * tree appears in the library, or when removals leave too many stale entries
+ * in the search table.
+ */
+
+#define SHARE_WATCH_DELAY		1000	/**< ms, delay before applying changes */
+#define SHARE_WATCH_BATCH		1024	/**< Max paths processed at once */
+#define SHARE_WATCH_WALK_MAX	10000	/**< Max entries seen in new trees */
+#define SHARE_WATCH_STALE_MIN	1000	/**< Min stale entries before rescan */
+
+/**
+ * A batch of work for the library thread.
+ */
+struct share_watch_job {
+	dirwatch_t *watcher;		/**< Watcher to extend */
+	slist_t *dirs;				/**< Directories to watch (atoms), or NULL */
+	pslist_t *base_dirs;		/**< Copy of the shared directories (atoms) */
+	htable_t *paths;			/**< Changed path (atom) -> is_dir, or NULL */
+	pslist_t *gone;				/**< Library files to de-index (ref'ed) */
+	pslist_t *added;			/**< New library files (ref'ed) */
+	size_t failed;				/**< Directories we could not watch */
+	bool ok;					/**< FALSE if a full rescan is required */
+	bool cancelled;				/**< Results are to be discarded */
+};
+
+static dirwatch_t *share_watcher;		/**< Watches shared directories */
+static htable_t *share_watch_pending;	/**< Changed path (atom) -> is_dir */
+static cevent_t *share_watch_ev;		/**< Delayed processing of changes */
+static size_t share_watch_stale;		/**< Files removed since last rescan */
+static pslist_t *share_watch_gone;		/**< Indexed files removed (ref'ed) */
+static struct share_watch_job *share_watch_job;	/**< Batch being worked on */
+
+static void share_watch_process(cqueue_t *cq, void *unused_obj);
+
+/**
+ * @return whether shared directories should be monitored for changes.
+ */
+static bool
+share_watch_enabled(void)
+{
+	return GNET_PROPERTY(share_incremental) && dirwatch_is_supported();
+}
+
+/**
+ * Free the key of the pending table -- hash table iterator callback.
+ */
+static bool
+share_watch_pending_free(const void *key, void *unused_value, void *unused_data)
+{
+	(void) unused_value;
+	(void) unused_data;
+
+	atom_str_free(key);
+	return TRUE;
+}
+
+/**
+ * Discard all the pending changes.
+ */
+static void
+share_watch_pending_clear(void)
+{
+	if (share_watch_pending != NULL) {
+		htable_foreach_remove(share_watch_pending,
+			share_watch_pending_free, NULL);
+	}
+}
+
+/**
+ * Schedule processing of the pending changes, unless already done.
+ */
+static void
+share_watch_schedule(int delay)
+{
+	if (NULL == share_watch_ev) {
+		share_watch_ev = cq_main_insert(delay, share_watch_process, NULL);
+	}
+}
+
+/**
+ * @return new batch of work for the library thread, extending the watcher.
+ */
+static struct share_watch_job *
+share_watch_job_new(void)
+{
+	struct share_watch_job *job;
+
+	g_assert(share_watcher != NULL);
+
+	WALLOC0(job);
+	job->watcher = share_watcher;
+	job->ok = TRUE;
+
+	return job;
+}
+
+/**
+ * Free batch of work.
+ */
+static void
+share_watch_job_free(struct share_watch_job *job)
+{
+	pslist_t *sl;
+
+	slist_free_all(&job->dirs, scan_base_dir_free);
+
+	PSLIST_FOREACH(job->base_dirs, sl) {
+		atom_str_free(sl->data);
+	}
+	pslist_free_null(&job->base_dirs);
+
+	if (job->paths != NULL) {
+		htable_foreach_remove(job->paths, share_watch_pending_free, NULL);
+		htable_free_null(&job->paths);
+	}
+
+	shared_file_slist_free_null(&job->gone);
+	shared_file_slist_free_null(&job->added);
+	WFREE(job);
+}
+
+/**
+ * Hand batch of work over to the library thread.
+ */
+static void
+share_watch_job_post(struct share_watch_job *job, notify_fn_t routine)
+{
+	g_assert(thread_is_main());
+	g_assert(NULL == share_watch_job);
+
+	share_watch_job = job;
+	teq_post(share_thread_id, routine, job);
+}
+
+/**
+ * Account for a batch of work coming back from the library thread.
+ *
+ * @return TRUE if the batch was cancelled and has been freed.
+ */
+static bool
+share_watch_job_done(struct share_watch_job *job)
+{
+	g_assert(thread_is_main());
+
+	if (job == share_watch_job)
+		share_watch_job = NULL;
+
+	if (!job->cancelled)
+		return FALSE;
+
+	/*
+	 * Monitoring was stopped whilst the library thread was extending the
+	 * watcher: it was left to us.
+	 */
+
+	if (job->watcher != share_watcher)
+		dirwatch_free_null(&job->watcher);
+
+	share_watch_job_free(job);
+
+	if (share_watch_pending != NULL && 0 != htable_count(share_watch_pending))
+		share_watch_schedule(SHARE_WATCH_DELAY / 10);
+
+	return TRUE;
+}
+
+/**
+ * Stop monitoring the library.
+ *
+ * The batch being worked on, if any, is cancelled and the watcher it extends
+ * will be freed when the library thread is done with it.
+ */
+static void
+share_watch_stop(void)
+{
+	struct share_watch_job *job = share_watch_job;
+
+	if (job != NULL) {
+		g_assert(job->watcher == share_watcher);
+
+		job->cancelled = TRUE;
+		share_watch_job = NULL;
+		share_watcher = NULL;		/* Freed by share_watch_job_done() */
+		return;
+	}
+
+	dirwatch_free_null(&share_watcher);
+}
+
+/**
+ * Give up on incremental changes and request a full library rescan.
+ */
+static void
+share_watch_rescan(const char *why)
+{
+	if (GNET_PROPERTY(share_debug))
+		g_debug("SHARE requesting full library rescan: %s", why);
+
+	if (share_watch_job != NULL)
+		share_watch_job->cancelled = TRUE;
+
+	share_watch_pending_clear();
+	shared_file_slist_free_null(&share_watch_gone);
+	share_lib_rescan();
+}
+
+/**
+ * @return the shared directory under which the path lies, NULL if the path
+ * is no longer part of the library.
+ */
+static const char *
+share_watch_base_dir(const struct share_watch_job *job, const char *path)
+{
+	pslist_t *sl;
+
+	PSLIST_FOREACH(job->base_dirs, sl) {
+		const char *dir = sl->data;
+		const char *s = is_strprefix(path, dir);
+
+		if (s != NULL && ('\0' == *s || G_DIR_SEPARATOR == *s))
+			return dir;
+	}
+
+	return NULL;
+}
+
+/**
+ * De-index a library file that is no longer present on disk.
+ */
+static void
+share_watch_remove(shared_file_t *sf)
+{
+	bool indexed = shared_file_indexed(sf);
+	bool listed = FALSE;
+
+	g_assert(thread_is_main());
+
+	if (GNET_PROPERTY(share_debug) > 1)
+		g_debug("SHARE removing \"%s\"", sf->file_path);
+
+	shared_file_remove(sf);
+
+	SHARED_LIBFILE_LOCK;
+	if (indexed) {
+		shared_libfile.bytes_scanned -=
+			MIN(shared_libfile.bytes_scanned, sf->file_size);
+	}
+	if (pslist_find(shared_libfile.shared_files, sf) != NULL) {
+		shared_libfile.shared_files =
+			pslist_remove(shared_libfile.shared_files, sf);
+		listed = TRUE;
+	}
+	SHARED_LIBFILE_UNLOCK;
+
+	if (listed)
+		epoch_retire(share_epoch, sf, share_file_free);
+
+	if (indexed) {
+		share_watch_gone =
+			pslist_prepend(share_watch_gone, shared_file_ref(sf));
+	}
+
+	share_watch_stale++;
+}
+
+/**
+ * @return the library file bearing that path (ref-counted), NULL if none.
+ */
+static shared_file_t *
+share_watch_lookup(const char *path)
+{
+	shared_file_t *sf = NULL;
+
+	SHARED_LIBFILE_LOCK;
+	if (shared_libfile.file_paths != NULL) {
+		sf = htable_lookup(shared_libfile.file_paths, path);
+		if (sf != NULL)
+			shared_file_ref(sf);
+	}
+	SHARED_LIBFILE_UNLOCK;
+
+	return sf;
+}
+
+/**
+ * Record that the library file bearing that path must be de-indexed.
+ */
+static void
+share_watch_forget(struct share_watch_job *job, const char *path)
+{
+	shared_file_t *sf = share_watch_lookup(path);
+
+	if (sf != NULL)
+		job->gone = pslist_prepend(job->gone, sf);
+}
+
+/**
+ * Record that all the library files lying under a directory must be
+ * de-indexed.
+ */
+static void
+share_watch_forget_tree(struct share_watch_job *job, const char *dir)
+{
+	size_t i;
+
+	SHARED_LIBFILE_LOCK;
+	for (i = 0; i < shared_libfile.files_scanned; i++) {
+		shared_file_t *sf = shared_libfile.ftable->files[i];
+		const char *s;
+
+		if (NULL == sf)
+			continue;
+
+		s = is_strprefix(sf->file_path, dir);
+		if (s != NULL && G_DIR_SEPARATOR == *s)
+			job->gone = pslist_prepend(job->gone, shared_file_ref(sf));
+	}
+	SHARED_LIBFILE_UNLOCK;
+}
+
+/**
+ * Consider a regular file for addition to the library, replacing the
+ * entry we had for that path if the file was modified.
+ *
+ * @param job		the batch being examined
+ * @param path		the full path of the file
+ * @param relpath	the relative path to expose, NULL if none
+ * @param sb		the file status
+ */
+static void
+share_watch_file(struct share_watch_job *job, const char *path,
+	const char *relpath, const filestat_t *sb)
+{
+	shared_file_t *sf;
+
+	sf = share_watch_lookup(path);
+
+	if (sf != NULL) {
+		bool same = sf->mtime == sb->st_mtime &&
+			sf->file_size == (filesize_t) sb->st_size;
+
+		if (same) {
+			shared_file_unref(&sf);
+			return;
+		}
+
+		job->gone = pslist_prepend(job->gone, sf);
+	}
+
+	sf = share_scan_add_file(relpath, path, sb);
+
+	if (sf != NULL) {
+		if (GNET_PROPERTY(share_debug) > 1)
+			g_debug("SHARE adding \"%s\"", path);
+		job->added = pslist_prepend(job->added, shared_file_ref(sf));
+	}
+}
+
+/**
+ * Traverse a directory that appeared in the library, watching it and
+ * collecting the files it holds.
+ *
+ * @return FALSE if the tree is too large to be handled incrementally.
+ */
+static bool
+share_watch_walk(struct share_watch_job *job,
+	const char *top, const char *base_dir)
+{
+	slist_t *dirs = slist_new();
+	size_t entries = 0;
+	char *dir;
+	bool ok = TRUE;
+
+	slist_append(dirs, h_strdup(top));
+
+	while (ok && NULL != (dir = slist_shift(dirs))) {
+		struct dirent *dir_entry;
+		const char *relpath = NULL;
+		DIR *dp;
+		int dfd;
+
+		if (directory_is_unshareable(dir) || NULL == (dp = opendir(dir))) {
+			HFREE_NULL(dir);
+			continue;
+		}
+
+		if (-1 == dirwatch_add(job->watcher, dir))
+			g_warning("cannot watch directory %s: %m", dir);
+
+		if (GNET_PROPERTY(search_results_expose_relative_paths))
+			relpath = get_relative_path(base_dir, dir);
+
+		dfd = recursive_scan_dirfd(dp);
+
+		while (NULL != (dir_entry = readdir(dp))) {
+			char *fullpath;
+			filestat_t sb;
+
+			if (++entries > SHARE_WATCH_WALK_MAX) {
+				ok = FALSE;
+				break;
+			}
+
+			switch (recursive_scan_entry(dfd, dir, dir_entry, &sb, &fullpath)) {
+			case RSCAN_DIR:
+				slist_append(dirs, fullpath);
+				fullpath = NULL;
+				break;
+			case RSCAN_FILE:
+				share_watch_file(job, fullpath, relpath, &sb);
+				break;
+			case RSCAN_SKIP:
+				break;
+			}
+
+			HFREE_NULL(fullpath);
+		}
+
+		closedir(dp);
+		atom_str_free_null(&relpath);
+		HFREE_NULL(dir);
+	}
+
+	slist_free_all(&dirs, do_hfree);
+
+	return ok;
+}
+
+/**
+ * Examine a changed path.
+ *
+ * @return FALSE if a full rescan is required.
+ */
+static bool
+share_watch_path(struct share_watch_job *job, const char *path, bool is_dir)
+{
+	const char *base_dir = share_watch_base_dir(job, path);
+	filestat_t sb;
+
+	if (NULL == base_dir)
+		return TRUE;		/* No longer shared */
+
+	if (-1 == stat(path, &sb)) {
+		if (is_dir)
+			share_watch_forget_tree(job, path);
+		share_watch_forget(job, path);
+		return TRUE;
+	}
+
+	if (S_ISDIR(sb.st_mode)) {
+		share_watch_forget(job, path);
+		if (dirwatch_contains(job->watcher, path))
+			return TRUE;	/* Known directory, its entries report changes */
+		return share_watch_walk(job, path, base_dir);
+	}
+
+	if (S_ISREG(sb.st_mode)) {
+		const char *relpath = NULL;
+
+		if (GNET_PROPERTY(scan_ignore_symlink_regfiles)) {
+			filestat_t lsb;
+
+			if (0 == lstat(path, &lsb) && S_ISLNK(lsb.st_mode))
+				return TRUE;
+		}
+
+		if (GNET_PROPERTY(search_results_expose_relative_paths)) {
+			char *dir = filepath_directory(path);
+
+			if (dir != NULL)
+				relpath = get_relative_path(base_dir, dir);
+			HFREE_NULL(dir);
+		}
+
+		share_watch_file(job, path, relpath, &sb);
+		atom_str_free_null(&relpath);
+	}
+
+	return TRUE;
+}
+
+/**
+ * Insert new files into the installed library.
+ *
+ * @param added		list of ref-counted shared files, freed on return
+ *
+ * @return list of ref-counted shared files that were indexed, whose hashes
+ * remain to be requested.
+ */
+static pslist_t *
+share_watch_index(pslist_t *added)
+{
+	shared_file_t **vec, **sorted, **files, **tbl, **old;
+	struct shared_ftable *ft, *old_ft;
+	search_table_t *st;
+	pslist_t *sl, *dups = NULL, *indexed = NULL;
+	size_t i, j, k, m, old_cnt, n = 0;
+
+	if (NULL == added)
+		return NULL;
+
+	/*
+	 * New files are appended to the file table in mtime order so that
+	 * the indices of the files already shared remain valid.
+	 */
+
+	HALLOC_ARRAY(vec, pslist_length(added));
+	PSLIST_FOREACH(added, sl) {
+		vec[n++] = sl->data;
+	}
+	pslist_free_null(&added);
+
+	vsort(vec, n, sizeof vec[0], shared_file_sort_by_mtime);
+
+	SHARED_LIBFILE_LOCK;
+
+	/*
+	 * A full rescan may have been installed since we looked at the files,
+	 * in which case it could already list some of them.
+	 */
+
+	if (NULL == shared_libfile.file_paths)
+		shared_libfile.file_paths = htable_create(HASH_KEY_STRING, 0);
+	if (NULL == shared_libfile.file_basenames)
+		shared_libfile.file_basenames = htable_create(HASH_KEY_STRING, 0);
+
+	for (i = j = 0; i < n; i++) {
+		shared_file_t *sf = vec[i];
+
+		if (htable_contains(shared_libfile.file_paths, sf->file_path))
+			dups = pslist_prepend(dups, sf);
+		else
+			vec[j++] = sf;
+	}
+
+	if (0 == j) {
+		SHARED_LIBFILE_UNLOCK;
+		goto done;
+	}
+
+	/*
+	 * Lock-less readers may still be looking at the published tables, so
+	 * we build new ones and retire the old ones once all readers are gone.
+	 */
+
+	old_ft = shared_libfile.ftable;
+	old_cnt = shared_libfile.files_scanned;
+	old = NULL == old_ft ? NULL : old_ft->sorted;
+
+	HALLOC_ARRAY(files, old_cnt + j);
+	if (old_cnt != 0)
+		memcpy(files, old_ft->files, old_cnt * sizeof files[0]);
+
+	for (i = 0; i < j; i++) {
+		shared_file_t *sf = vec[i];
+		uint val;
+
+		sf->file_index = ++shared_libfile.files_scanned;
+		sf->flags |= SHARE_F_INDEXED | SHARE_F_BASENAME;
+		files[sf->file_index - 1] = sf;
+
+		/* See recursive_scan_step_build_basenames() */
+
+		val = pointer_to_uint(
+			htable_lookup(shared_libfile.file_basenames, sf->name_nfc));
+		val = (val != 0) ? FILENAME_CLASH : sf->file_index;
+		htable_insert(shared_libfile.file_basenames,
+			sf->name_nfc, uint_to_pointer(val));
+
+		htable_insert_const(shared_libfile.file_paths, sf->file_path, sf);
+		shared_libfile.shared_files =
+			pslist_prepend(shared_libfile.shared_files, sf);
+		shared_libfile.bytes_scanned += sf->file_size;
+	}
+
+	/*
+	 * Merge the new files into the table sorted by name, squeezing out the
+	 * holes left by removed files.
+	 */
+
+	sorted = HCOPY_ARRAY(vec, j);
+	vsort(sorted, j, sizeof sorted[0], shared_file_sort_by_name);
+
+	HALLOC0_ARRAY(tbl, shared_libfile.files_scanned);
+
+	for (i = k = m = 0; i < old_cnt || k < j; /* empty */) {
+		shared_file_t *sf;
+
+		if (i < old_cnt && NULL == old[i]) {
+			i++;
+			continue;
+		}
+
+		if (
+			k >= j ||
+			(i < old_cnt && shared_file_sort_by_name(&old[i], &sorted[k]) <= 0)
+		)
+			sf = old[i++];
+		else
+			sf = sorted[k++];
+
+		sf->sort_index = ++m;
+		tbl[m - 1] = sf;
+	}
+
+	ft = shared_ftable_make(files, tbl, shared_libfile.files_scanned);
+	atomic_mb();
+	shared_libfile.ftable = ft;
+
+	st = st_refcnt_inc(shared_libfile.search_table);
+
+	SHARED_LIBFILE_UNLOCK;
+
+	epoch_retire(share_epoch, old_ft, shared_ftable_free);
+
+	HFREE_NULL(sorted);
+
+	for (i = 0; i < j; i++) {
+		shared_file_t *sf = vec[i];
 
-	return ctx->task = bg_task_create(bs, "QRP update",
-				steps, N_ITEMS(steps),
-				ctx, recursive_scan_context_free,
-				recursive_scan_done, NULL);
-}
+		st_insert_item(st, ST_SET_PLAIN, sf->name_canonic, sf);
+		if (sf->name_normal != NULL)
+			st_insert_item(st, ST_SET_ALIAS, sf->name_normal, sf);
 
-/*
- * The "share_thread_lib_xxx" routine is the implementation, within the
- * "library" thread, of the corresponding API invoked from the "main" thread.
- *
- * These are handled as TEQ events, and are therefore delivered to the
- * thread in the same order as they were issued.
- */
+		indexed = pslist_prepend(indexed, shared_file_ref(sf));
+	}
+
+	st_free(&st);
+
+done:
+	shared_file_slist_free_null(&dups);
+	HFREE_NULL(vec);
+
+	return indexed;
+}
 
 /**
- * Start a library scan.
+ * Library thread: enforce upload statistics and request the hashes of new
+ * library files.
+ *
+ * @param p		list of ref-counted shared files, freed on return
  */
 static void
-share_thread_lib_rescan(void *unused_arg)
+share_watch_hash(void *p)
 {
-	struct share_thread_vars *v = &share_thread_vars;
+	pslist_t *files = p, *sl;
 
-	(void) unused_arg;
-
-	spinlock(&v->lock);
+	PSLIST_FOREACH(files, sl) {
+		shared_file_t *sf = sl->data;
 
-	if (v->task != NULL) {
-		bg_task_cancel(v->task);
-		v->task = NULL;
+		upload_stats_enforce_local_filename(sf);
+		request_sha1(sf);
 	}
 
-	v->qrp_rebuild = FALSE;		/* since rescan takes care of it */
-	v->task = share_rescan_create_task(v->sched);
-
-	spinunlock(&v->lock);
+	shared_file_slist_free_null(&files);
 }
 
 /**
- * Request a QRP rebuild.
+ * Main thread: apply the changes found by the library thread.
  */
 static void
-share_thread_lib_qrp_rebuild(void *unused_arg)
+share_watch_apply(void *p)
 {
-	struct share_thread_vars *v = &share_thread_vars;
-	bool pending;
+	struct share_watch_job *job = p;
+	pslist_t *added, *sl;
+	size_t n;
 
-	(void) unused_arg;
+	if (share_watch_job_done(job))
+		return;
 
-	spinlock(&v->lock);
+	g_assert(NULL == share_watch_gone);
 
-	if (v->task != NULL) {
-		v->qrp_rebuild = TRUE;		/* record for later */
-	} else {
-		v->task = share_update_qrp_create_task(v->sched);
-		v->qrp_rebuild = FALSE;
+	/*
+	 * A file can be listed twice, e.g. when both itself and its directory
+	 * were reported as removed.
+	 */
+
+	PSLIST_FOREACH(job->gone, sl) {
+		shared_file_t *sf = sl->data;
+
+		if (shared_file_indexed(sf))
+			share_watch_remove(sf);
 	}
 
-	pending = v->qrp_rebuild;
-	spinunlock(&v->lock);
+	if (!job->ok) {
+		share_watch_job_free(job);
+		share_watch_rescan("too many new files");
+		return;
+	}
 
-	if (GNET_PROPERTY(share_debug) > 1) {
-		g_debug("SHARE background QRP recomputation %s",
-			pending ? "recorded" : "started");
+	n = htable_count(job->paths);
+	added = share_watch_index(job->added);
+	job->added = NULL;
+	share_watch_job_free(job);
+
+	if (GNET_PROPERTY(share_debug)) {
+		g_debug("SHARE applied %zu change%s, %zu pending, %zu stale entr%s",
+			PLURAL(n), htable_count(share_watch_pending),
+			share_watch_stale, plural_y(share_watch_stale));
 	}
-}
 
-/*
- * The "share_lib_xxx" routine constitute the API from the "main" thread to the
- * "library" thread.
- */
+	/*
+	 * Removed files are only hidden from the search table, which needs a
+	 * full rebuild when they become too numerous.
+	 */
 
-/**
- * Start a library scan.
- */
-static void
-share_lib_rescan(void)
-{
-	teq_post_unique(share_thread_id, share_thread_lib_rescan, NULL);
+	if (
+		share_watch_stale >= SHARE_WATCH_STALE_MIN &&
+		share_watch_stale >= files_scanned() / 4
+	) {
+		shared_file_slist_free_null(&added);
+		share_watch_rescan("too many stale entries");
+		return;
+	}
+
+	gcu_gui_update_files_scanned();
+
+	/*
+	 * Only update the QRP slots affected by the changes, unless the
+	 * incremental update is not possible.
+	 */
+
+	if (added != NULL || share_watch_gone != NULL) {
+		if (!qrp_update_files(added, share_watch_gone))
+			share_lib_qrp_rebuild(FALSE);
+	}
+
+	if (added != NULL)
+		teq_post(share_thread_id, share_watch_hash, added);
+
+	shared_file_slist_free_null(&share_watch_gone);
+
+	if (0 != htable_count(share_watch_pending))
+		share_watch_schedule(SHARE_WATCH_DELAY / 10);
 }
 
 /**
- * Request a QRP rebuild.
- *
- * This will update the QRP table, including both our shared library and our
- * partials.
- *
- * @param force		if TRUE, do not optimize request if one is already pending
+ * Library thread: examine the changed paths, then have the main thread
+ * apply the changes.
  */
 static void
-share_lib_qrp_rebuild(bool force)
+share_watch_examine(void *p)
 {
-	bool done;
-
-	done = teq_post_ext(share_thread_id, !force,
-				share_thread_lib_qrp_rebuild, NULL);
+	struct share_watch_job *job = p;
+	htable_iter_t *iter;
+	const void *key;
+	void *value;
 
-	g_assert(implies(force, done));
+	iter = htable_iter_new(job->paths);
 
-	if (GNET_PROPERTY(share_debug) > 1) {
-		g_debug("SHARE %s request for background QRP recomputation (%s)",
-			force ? "forced" :
-			done ? "sent" : "avoided duplicate",
-			share_can_answer_partials() ?
-				"with partial files" : "library only");
+	while (job->ok && htable_iter_next(iter, &key, &value)) {
+		job->ok = share_watch_path(job, key, pointer_to_bool(value));
 	}
-}
 
-/**
- * Is there work pending for the library thread, or is thread terminated?
- */
-static bool
-share_thread_has_work(void *unused_arg)
-{
-	struct share_thread_vars *v = &share_thread_vars;
-	(void) unused_arg;
+	htable_iter_release(&iter);
 
-	return atomic_bool_get(&v->exiting) || v->task != NULL || v->qrp_rebuild;
+	teq_safe_post(THREAD_MAIN_ID, share_watch_apply, job);
 }
 
 /**
- * Signal handler to terminate the library thread.
+ * Callout queue callback to hand the pending changes over to the library
+ * thread.
  */
 static void
-share_thread_terminate(int sig)
+share_watch_process(cqueue_t *cq, void *unused_obj)
 {
-	struct share_thread_vars *v = &share_thread_vars;
+	struct share_watch_job *job;
+	htable_iter_t *iter;
+	const void *key;
+	void *value;
+	pslist_t *sl;
+	size_t n = 0;
 
-	g_assert(TSIG_TERM == sig);
+	(void) unused_obj;
 
-	if (GNET_PROPERTY(share_debug))
-		g_debug("terminating library thread");
+	cq_zero(cq, &share_watch_ev);
 
-	atomic_bool_set(&v->exiting, TRUE);
-	spinlock(&v->lock);
-	if (v->task != NULL) {
-		bg_task_cancel(v->task);
-		v->task = NULL;
+	if (share_watch_job != NULL)
+		return;				/* Resumed when the library thread is done */
+
+	/*
+	 * Wait for any full rescan to complete: it may or may not have seen
+	 * the changes we recorded, but processing them again is harmless.
+	 */
+
+	if (atomic_bool_get(&share_rebuilding)) {
+		share_watch_schedule(SHARE_WATCH_DELAY);
+		return;
 	}
-	spinunlock(&v->lock);
+
+	if (NULL == share_watcher) {
+		share_watch_pending_clear();	/* Monitoring was disabled */
+		return;
+	}
+
+	job = share_watch_job_new();
+	job->paths = htable_create(HASH_KEY_STRING, 0);
+
+	PSLIST_FOREACH(shared_dirs, sl) {
+		job->base_dirs = pslist_prepend(job->base_dirs,
+			deconstify_char(atom_str_get(sl->data)));
+	}
+
+	iter = htable_iter_new(share_watch_pending);
+
+	while (n++ < SHARE_WATCH_BATCH && htable_iter_next(iter, &key, &value)) {
+		htable_insert(job->paths, key, value);		/* Key atom moved */
+		htable_iter_remove(iter);
+	}
+
+	htable_iter_release(&iter);
+
+	share_watch_job_post(job, share_watch_examine);
 }
 
 /**
- * Library thread main loop.
+ * Directory watcher callback, recording changes for later processing.
  */
-static void *
-share_thread_main(void *arg)
+static void
+share_watch_event(dirwatch_event_t ev, const char *path, bool is_dir,
+	void *unused_udata)
 {
-	struct share_thread_vars *v = &share_thread_vars;
-	barrier_t *b = arg;
+	const void *key;
+	void *value;
 
-	thread_set_name("library");
-	teq_create();				/* Queue to receive TEQ events */
-	thread_signal(TSIG_TERM, share_thread_terminate);
-	v->sched = bg_sched_create("library", 1000000 /* 1 s */);
+	(void) unused_udata;
 
-	barrier_wait(b);			/* Thread has initialized */
-	barrier_free_null(&b);
+	if (!GNET_PROPERTY(share_incremental))
+		return;
 
-	if (GNET_PROPERTY(share_debug))
-		g_debug("library thread started");
+	if (DIRWATCH_OVERFLOW == ev) {
+		share_watch_rescan("lost change events");
+		return;
+	}
 
-	/*
-	 * Process work until we're told to exit.
-	 */
+	if ('.' == filepath_basename(path)[0])
+		return;		/* Hidden entries are never shared */
 
-	while (!atomic_bool_get(&v->exiting)) {
-		struct bgtask *bt;
-		bool qrp_rebuild;
+	if (GNET_PROPERTY(share_debug) > 5) {
+		g_debug("SHARE %s %s \"%s\"",
+			DIRWATCH_REMOVED == ev ? "removed" : "changed",
+			is_dir ? "directory" : "file", path);
+	}
 
-		if (GNET_PROPERTY(share_debug))
-			g_debug("library thread sleeping");
+	if (htable_lookup_extended(share_watch_pending, path, &key, &value)) {
+		if (is_dir && !pointer_to_bool(value))
+			htable_insert(share_watch_pending, key, bool_to_pointer(TRUE));
+	} else {
+		htable_insert(share_watch_pending,
+			atom_str_get(path), bool_to_pointer(is_dir));
+	}
 
-		teq_wait(share_thread_has_work, NULL);
+	share_watch_schedule(SHARE_WATCH_DELAY);
+}
 
-		if (atomic_bool_get(&v->exiting))
-			break;						/* Terminated by signal */
+/**
+ * Main thread: report on the watches set up by the library thread.
+ */
+static void
+share_watch_installed(void *p)
+{
+	struct share_watch_job *job = p;
 
-		if (GNET_PROPERTY(share_debug))
-			g_debug("library thread awoken");
+	if (share_watch_job_done(job))
+		return;
 
-		spinlock(&v->lock);
-		bt = v->task;					/* The task run */
-		spinunlock(&v->lock);
+	if (!job->ok) {
+		g_warning("SHARE cannot watch all %u shared directories, "
+			"monitoring disabled: raise the system limit on watches",
+			slist_length(job->dirs));
+		dirwatch_free_null(&share_watcher);
+	} else if (GNET_PROPERTY(share_debug)) {
+		g_debug("SHARE watching %zu director%s (%zu failure%s)",
+			dirwatch_count(share_watcher),
+			plural_y(dirwatch_count(share_watcher)), PLURAL(job->failed));
+	}
 
-		g_assert(bt != NULL);
+	share_watch_job_free(job);
 
-		while (0 != bg_sched_run(v->sched))
-			thread_check_suspended();
+	if (0 != htable_count(share_watch_pending))
+		share_watch_schedule(SHARE_WATCH_DELAY / 10);
+}
 
-		/*
-		 * QRP table rebuilds can have been recorded whilst we were processing
-		 * the previous task.  If one is present, create the task, which will
-		 * make share_thread_has_work() to return TRUE.
-		 */
+/**
+ * Library thread: watch the directories traversed by a full rescan.
+ */
+static void
+share_watch_setup(void *p)
+{
+	struct share_watch_job *job = p;
+	slist_iter_t *iter;
 
-		spinlock(&v->lock);
-		if (v->task == bt)
-			v->task = NULL;				/* Finished running previous task */
-		qrp_rebuild = v->qrp_rebuild;
-		spinunlock(&v->lock);
+	iter = slist_iter_before_head(job->dirs);
 
-		if (qrp_rebuild)
-			share_thread_lib_qrp_rebuild(NULL);
+	while (slist_iter_has_next(iter)) {
+		const char *dir = slist_iter_next(iter);
+
+		if (-1 == dirwatch_add(job->watcher, dir)) {
+			if (ENOSPC == errno) {
+				job->ok = FALSE;
+				break;
+			}
+			job->failed++;
+		}
 	}
 
-	bg_sched_destroy_null(&v->sched);
+	slist_iter_free(&iter);
 
-	g_debug("library thread exiting");
-	return NULL;
+	teq_safe_post(THREAD_MAIN_ID, share_watch_installed, job);
 }
 
 /**
- * Create a new library thread.
+ * Start monitoring the directories traversed by a full rescan, which has
+ * just been installed.
  *
- * This routine does not return until the library thread has been
- * correctly initialized, so that the caller can immediately start to
- * send TEQ events to the thread.
+ * The watcher is created here, but the watches are set up by the library
+ * thread since there can be many directories.
  *
- * @return thread ID, -1 on error.
+ * @param dirs_ptr	list of directories (atoms), NULL if not monitoring,
+ *					taken over and nullified
  */
-static int
-share_thread_create(void)
+static void
+share_watch_install(slist_t **dirs_ptr)
 {
-	barrier_t *b;
-	int r;
+	struct share_watch_job *job;
 
-	b = barrier_new(2);
+	g_assert(thread_is_main());
 
-	/*
-	 * The library thread is created as a detached thread because we
-	 * do not expect any result from it.
-	 *
-	 * It is created as non-cancelable: to end it, we send it a TSIG_TERM.
-	 */
+	share_watch_stop();
+	share_watch_stale = 0;
 
-	r = thread_create(share_thread_main, barrier_refcnt_inc(b),
-			THREAD_F_DETACH | THREAD_F_NO_CANCEL |
-				THREAD_F_NO_POOL | THREAD_F_PANIC,
-			THREAD_STACK_MIN);
+	if (NULL == *dirs_ptr || !share_watch_enabled())
+		return;
 
-	barrier_wait(b);		/* Wait for thread to initialize */
-	barrier_free_null(&b);
+	share_watcher = dirwatch_make(share_watch_event, NULL);
 
-	return r;
+	if (NULL == share_watcher)
+		return;
+
+	if (NULL == share_watch_pending)
+		share_watch_pending = htable_create(HASH_KEY_STRING, 0);
+
+	job = share_watch_job_new();
+	job->dirs = *dirs_ptr;
+	*dirs_ptr = NULL;
+
+	share_watch_job_post(job, share_watch_setup);
+}
+
+/**
+ * Stop monitoring the library.
+ */
+static void
+share_watch_close(void)
+{
+	share_watch_stop();
+	cq_cancel(&share_watch_ev);
+	share_watch_pending_clear();
+	htable_free_null(&share_watch_pending);
+	shared_file_slist_free_null(&share_watch_gone);
 }
 
 /**
@@ -3299,10 +5039,12 @@ share_close(void)
 	 * referring to OOB data that oob_close() is going to free up.
 	 */
 
+	share_watch_close();
 	share_special_close();
 	free_extensions();
 	pslist_foreach(shared_libfile.shared_files, shared_file_detach, NULL);
 	share_free();
+	epoch_synchronize(share_epoch);		/* Release what share_free() retired */
 	shared_dirs_free();
 	huge_close();
 	qrp_close();
@@ -3314,6 +5056,7 @@ share_close(void)
 	hset_free_null(&partial_files);
 	hikset_free_null(&sha1_to_share);
 	cq_cancel(&share_qrp_rebuild_ev);
+	epoch_free_null(&share_epoch);
 }
 
 /*
@@ -4038,7 +5781,7 @@ share_fill_newest(shared_file_t **sfvec, size_t sfcount,
 
 	SHARED_LIBFILE_LOCK;
 
-	if (NULL == shared_libfile.file_table) {
+	if (NULL == shared_libfile.ftable) {
 		SHARED_LIBFILE_UNLOCK;
 		return 0;
 	}
@@ -4050,12 +5793,12 @@ share_fill_newest(shared_file_t **sfvec, size_t sfcount,
 		i >= 0 && j < sfcount;
 		i--
 	) {
-		shared_file_t *sf = shared_libfile.file_table[i];
+		shared_file_t *sf = shared_libfile.ftable->files[i];
 
 		if (sf != NULL) {
 			shared_file_check(sf);
 
-			/* file_table[] is sorted by increasing mtime */
+			/* files[] is sorted by increasing mtime */
 
 			if (delta_time(tm_time(), sf->mtime) > SHARE_RECENT_THRESH)
 				break;		/* Deeper files will be older */
@@ -4212,6 +5955,8 @@ share_init(void)
 	oob_proxy_init();
 	share_special_init();
 
+	share_epoch = epoch_make("share");
+
 	/*
 	 * We allocate an empty search_table, which will be de-allocated when we
 	 * call share_scan().  Why do we do this?  Because it ensures the table
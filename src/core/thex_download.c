@@ -693,6 +693,8 @@ thex_download_receive(struct thex_download *ctx,
 		struct rx_inflate_args args;
 
 		args.cb = &thex_rx_inflate_cb;
+		args.dict = NULL;
+		args.dict_len = 0;
 
 		ctx->rx = rx_make_above(ctx->rx, rx_inflate_get_ops(), &args);
 	}
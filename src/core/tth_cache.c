@@ -28,12 +28,32 @@
  *
  * Caching of tigertree data.
  *
- * The tigertree data for each shared file is stored in a file in the directory
- * GTK_GNUTELLA_DIR/tth_cache/ in raw binary form. For example, if the root
- * hash is 5EDB4PUVFGY2UKVISQ2DMACSPNRODTTODBS52RQ, the tigertree data is
- * stored in
+ * The tigertree leaves of all the shared files are stored in a single
+ * append-only file, GTK_GNUTELLA_DIR/tth_store, made of consecutive records.
+ * Each record starts with a 40-byte header (magic, amount of leaves, creation
+ * timestamp and root hash, all integers being big-endian) and is followed by
+ * the raw leaves.
+ *
+ * An index, keyed by root hash, tells where the record of each tree lies.
+ * It is kept in memory and saved to GTK_GNUTELLA_DIR/tth_store.idx on exit,
+ * along with the size of the store it describes: at startup, we load it and
+ * only scan the records that were appended after it was written.  A missing
+ * or unusable index is rebuilt by scanning the whole store.
+ *
+ * Removing a tree only drops it from the index, leaving a dead record in the
+ * store.  When dead records account for half the store, the cleanup thread
+ * compacts the store by copying the live records into a new file, without
+ * blocking concurrent lookups or insertions for the duration of the copy.
+ *
+ * Reads are done through a read-only memory mapping of the store, so that
+ * serving THEX requests does not need any system call.
+ *
+ * Older versions stored each tree in its own file, under the directory
+ * GTK_GNUTELLA_DIR/tth_cache/.  For instance, the leaves of the root hash
+ * 5EDB4PUVFGY2UKVISQ2DMACSPNRODTTODBS52RQ were stored in
  * $GTK_GNUTELLA_DIR/tth_cache/5E/DB4PUVFGY2UKVISQ2DMACSPNRODTTODBS52RQ.
- * This avoids storing too many files per directory.
+ * When that directory is found at startup, its entries are migrated into the
+ * store by a background thread, and are looked up there until migrated.
  *
  * Only the leaves at TTH_MAX_DEPTH or above are stored. The root hash and the
  * nodes at each level between above these leaves can be calculated from the
@@ -54,43 +74,104 @@
 #include "settings.h"
 #include "share.h"
 
+#include "lib/atomic.h"
 #include "lib/atoms.h"
 #include "lib/base32.h"
+#include "lib/compat_pio.h"
+#include "lib/endian.h"
 #include "lib/fd.h"
 #include "lib/file.h"
 #include "lib/ftw.h"
 #include "lib/halloc.h"
+#include "lib/hikset.h"
 #include "lib/hset.h"
 #include "lib/hstrfn.h"
+#include "lib/mutex.h"
 #include "lib/path.h"
 #include "lib/pslist.h"
-#include "lib/spinlock.h"
+#include "lib/random.h"
 #include "lib/str.h"
 #include "lib/stringify.h"
 #include "lib/thread.h"
 #include "lib/tigertree.h"
 #include "lib/timestamp.h"
+#include "lib/tm.h"
+#include "lib/vmm.h"
 #include "lib/walloc.h"
+#include "lib/xmalloc.h"
+#include "lib/xsort.h"
 
 #include "if/gnet_property_priv.h"
 #include "if/core/main.h"		/* For debugging() */
 
 #include "lib/override.h"       /* Must be the last header included */
 
+
 #if defined(S_IROTH)
 #define TTH_FILE_MODE (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH) /* 0644 */
 #else
 #define TTH_FILE_MODE (S_IRUSR | S_IWUSR | S_IRGRP) /* 0640 */
 #endif
 
+#define TTH_STORE_FILE		"tth_store"			/**< The leaves store */
+#define TTH_STORE_NEW		"tth_store.new"		/**< Store being compacted */
+#define TTH_INDEX_FILE		"tth_store.idx"		/**< The saved index */
+#define TTH_INDEX_NEW		"tth_store.idx.new"	/**< Index being saved */
+
+#define TTH_STORE_MAGIC		0x54544853U		/**< "TTHS": store header */
+#define TTH_RECORD_MAGIC	0x54544852U		/**< "TTHR": record header */
+#define TTH_INDEX_MAGIC		0x54544849U		/**< "TTHI": index header */
+#define TTH_STORE_VERSION	1
+
+#define TTH_STORE_HDR_SIZE	16		/**< magic, version, generation */
+#define TTH_RECORD_HDR_SIZE	40		/**< magic, leaves, stamp, root hash */
+#define TTH_INDEX_HDR_SIZE	40		/**< magic, version, generation, ... */
+#define TTH_INDEX_ENT_SIZE	40		/**< root hash, offset, leaves, stamp */
+#define TTH_INDEX_CHUNK		1024	/**< Index entries read at once */
+
+#define TTH_COMPACT_MIN		(4 * 1024 * 1024)	/**< Min dead bytes to compact */
+#define TTH_MAP_MIN			(1024 * 1024)		/**< Min length of store mapping */
+
+#define tth_record_size(n)	(TTH_RECORD_HDR_SIZE + (filesize_t) (n) * TTH_RAW_SIZE)
+
 /**
- * This lock is used to protect the creation / removal of directories
- * under the TTH cache.
+ * Index entry, locating the record of a tree in the store.
  */
-static spinlock_t tth_path_lk = SPINLOCK_INIT;
+struct tth_entry {
+	struct tth tth;			/**< Root hash (embedded key) */
+	filesize_t offset;		/**< Offset of the record in the store */
+	uint32 leaves;			/**< Amount of leaves in the record */
+	time_t stamp;			/**< Time at which tree was last inserted */
+};
 
-#define TTH_PATH_LOCK		spinlock(&tth_path_lk)
-#define TTH_PATH_UNLOCK		spinunlock(&tth_path_lk)
+/**
+ * The TTH leaves store.
+ */
+static struct tth_store {
+	hikset_t *index;		/**< Root hash -> struct tth_entry */
+	int fd;					/**< Opened store, -1 when closed */
+	uint64 generation;		/**< Store generation, changed by compaction */
+	filesize_t size;		/**< Store size, where next record goes */
+	filesize_t dead;		/**< Bytes held by unreferenced records */
+	const char *map;		/**< Read-only mapping of the store */
+	size_t map_len;			/**< Length of the mapping */
+	bool dirty;				/**< Whether index changed since last saved */
+	bool legacy;			/**< Whether old cache directory is migrated */
+} tth_store = { NULL, -1, 0, 0, 0, NULL, 0, FALSE, FALSE };
+
+/**
+ * This lock protects the whole store: index, file and mapping.
+ */
+static mutex_t tth_store_mtx = MUTEX_INIT;
+
+#define TTH_STORE_LOCK		mutex_lock(&tth_store_mtx)
+#define TTH_STORE_UNLOCK	mutex_unlock(&tth_store_mtx)
+
+/**
+ * Counts background threads working on the store (cleanup or migration),
+ * to make sure only one runs at a time.
+ */
+static int tth_cache_cleanups;
 
 static const char *
 tth_cache_directory(void)
@@ -116,104 +197,475 @@ tth_cache_pathname(const struct tth *tth)
 			&hash[0], G_DIR_SEPARATOR, &hash[2]);
 }
 
-static int
-tth_cache_file_create(const struct tth *tth)
+static char *
+tth_store_pathname(const char *name)
 {
-	char *pathname;
-	int accmode;
-	int fd;
+	return make_pathname(settings_config_dir(), name);
+}
 
-	g_return_val_if_fail(tth, -1);
+/**
+ * Fill record header.
+ */
+static void
+tth_record_header(char *buf, const struct tth *tth, uint32 leaves, time_t stamp)
+{
+	poke_be32(&buf[0], TTH_RECORD_MAGIC);
+	poke_be32(&buf[4], leaves);
+	poke_be64(&buf[8], stamp);
+	memcpy(&buf[16], tth->data, TTH_RAW_SIZE);
+}
 
-	accmode = O_WRONLY | O_TRUNC;
-	pathname = tth_cache_pathname(tth);
+/**
+ * Parse record header into the supplied index entry.
+ *
+ * @return TRUE if the header is valid.
+ */
+static bool
+tth_record_parse(const char *buf, struct tth_entry *e)
+{
+	if (TTH_RECORD_MAGIC != peek_be32(&buf[0]))
+		return FALSE;
+
+	e->leaves = peek_be32(&buf[4]);
+	e->stamp = peek_be64(&buf[8]);
+	memcpy(e->tth.data, &buf[16], TTH_RAW_SIZE);
+
+	return e->leaves > 1 && e->leaves <= TTH_MAX_LEAVES;
+}
+
+/**
+ * Write store header, with a new generation number.
+ *
+ * @return TRUE on success.
+ */
+static bool
+tth_store_header_write(int fd, uint64 *generation)
+{
+	char buf[TTH_STORE_HDR_SIZE];
+
+	*generation = random_u64();
+
+	poke_be32(&buf[0], TTH_STORE_MAGIC);
+	poke_be32(&buf[4], TTH_STORE_VERSION);
+	poke_be64(&buf[8], *generation);
+
+	return sizeof buf == compat_pwrite(fd, ARYLEN(buf), 0);
+}
+
+/**
+ * Record entry in the index, superseding any previous entry for the same
+ * tree, whose record becomes dead.
+ */
+static void
+tth_store_index_set(const struct tth_entry *e)
+{
+	struct tth_entry *old;
+
+	old = hikset_lookup(tth_store.index, &e->tth);
+
+	if (old != NULL) {
+		tth_store.dead += tth_record_size(old->leaves);
+		*old = *e;
+	} else {
+		struct tth_entry *ne = WCOPY(e);
+		hikset_insert(tth_store.index, ne);
+	}
+
+	tth_store.dirty = TRUE;
+}
+
+static bool
+tth_store_entry_free(void *data, void *unused_udata)
+{
+	struct tth_entry *e = data;
+
+	(void) unused_udata;
+
+	WFREE(e);
+	return TRUE;
+}
+
+/**
+ * Drop all the index entries.
+ */
+static void
+tth_store_index_clear(void)
+{
+	hikset_foreach_remove(tth_store.index, tth_store_entry_free, NULL);
+	tth_store.dead = 0;
+	tth_store.dirty = TRUE;
+}
+
+/**
+ * Drop the store mapping, if any.
+ */
+static void
+tth_store_unmap(void)
+{
+	if (tth_store.map != NULL) {
+		vmm_munmap(deconstify_pointer(tth_store.map), tth_store.map_len);
+		tth_store.map = NULL;
+		tth_store.map_len = 0;
+	}
+}
+
+/**
+ * Make sure the store mapping covers its first ``len'' bytes, remapping
+ * the store when it has grown past the current mapping.
+ *
+ * The mapping is made twice as large as the store, so that appending trees
+ * only triggers a logarithmic amount of remappings: mapping past the end of
+ * the file is fine as long as we do not access these pages before the file
+ * covers them, and since the mapping is shared, appended records show up in
+ * it as soon as they are written.
+ *
+ * @return TRUE if the data can be read from the mapping.
+ */
+static bool
+tth_store_map(filesize_t len)
+{
+#ifdef HAS_MMAP
+	static bool failed;
+	filesize_t want;
+	void *p;
+
+	g_assert(len <= tth_store.size);
+
+	if G_LIKELY(tth_store.map != NULL && len <= tth_store.map_len)
+		return TRUE;
+
+	if G_UNLIKELY(failed || tth_store.size > MAX_INT_VAL(size_t))
+		return FALSE;
+
+	tth_store_unmap();
+
+	want = MAX(2 * tth_store.size, TTH_MAP_MIN);
+	want = MIN(want, MAX_INT_VAL(size_t) - compat_pagesize());
+	want = round_pagesize(want);
+
+	p = vmm_mmap(NULL, want, PROT_READ, MAP_SHARED, tth_store.fd, 0);
 
 	/*
-	 * Critical section required since we could have a concurrent thread
-	 * deciding to remove empty directories whilst we are attempting
-	 * to create a new directory to store the new cached entry!
+	 * Reserving address space could fail on 32-bit systems where the store
+	 * is large, hence retry with only what is needed.
 	 */
 
-	TTH_PATH_LOCK;
+	if G_UNLIKELY(MAP_FAILED == p && want > tth_store.size) {
+		want = tth_store.size;
+		p = vmm_mmap(NULL, want, PROT_READ, MAP_SHARED, tth_store.fd, 0);
+	}
 
-	fd = file_create_missing(pathname, accmode, TTH_FILE_MODE);
-	if (fd < 0 && ENOENT == errno) {
-		char *dir = filepath_directory(pathname);
-		if (0 == create_directory(dir, DEFAULT_DIRECTORY_MODE)) {
-			fd = file_create(pathname, accmode, TTH_FILE_MODE);
-		}
-		HFREE_NULL(dir);
+	if G_UNLIKELY(MAP_FAILED == p) {
+		g_warning("%s(): cannot map TTH store, will use plain reads: %m",
+			G_STRFUNC);
+		failed = TRUE;
+		return FALSE;
 	}
 
-	TTH_PATH_UNLOCK;
+	tth_store.map = p;
+	tth_store.map_len = want;
 
-	HFREE_NULL(pathname);
-	return fd;
+	return TRUE;
+#else
+	(void) len;
+	return FALSE;
+#endif	/* HAS_MMAP */
 }
 
-static int
-tth_cache_file_open(const struct tth *tth)
+/**
+ * Scan store records starting at given offset, updating the index.
+ *
+ * A truncated or corrupted record ends the scan and the store is truncated
+ * there, since that can only be the result of a crash whilst appending.
+ */
+static void
+tth_store_scan(filesize_t offset)
+{
+	char buf[TTH_RECORD_HDR_SIZE];
+	filesize_t end = tth_store.size;
+	size_t n = 0;
+
+	while (offset < end) {
+		struct tth_entry e;
+
+		if (
+			sizeof buf != compat_pread(tth_store.fd, ARYLEN(buf), offset) ||
+			!tth_record_parse(buf, &e) ||
+			offset + tth_record_size(e.leaves) > end
+		)
+			break;
+
+		e.offset = offset;
+		tth_store_index_set(&e);
+		offset += tth_record_size(e.leaves);
+		n++;
+	}
+
+	if (offset != end) {
+		g_warning("%s(): truncating TTH store to %s bytes (had %s)",
+			G_STRFUNC, filesize_to_string(offset), filesize_to_string2(end));
+		if (-1 == ftruncate(tth_store.fd, offset))
+			g_warning("%s(): cannot truncate TTH store: %m", G_STRFUNC);
+		tth_store.size = offset;
+	}
+
+	if (debugging(0) && n != 0)
+		g_debug("%s(): scanned %zu TTH store record%s", G_STRFUNC, PLURAL(n));
+}
+
+/**
+ * Load the saved index, provided it matches the store.
+ *
+ * @return the size of the store covered by the index, 0 if no index.
+ */
+static filesize_t
+tth_store_index_load(void)
 {
-	char *pathname;
+	char hdr[TTH_INDEX_HDR_SIZE];
+	char *path, *buf = NULL;
+	filesize_t covered, dead;
+	uint64 count, i;
 	int fd;
 
-	g_return_val_if_fail(tth, -1);
+	path = tth_store_pathname(TTH_INDEX_FILE);
+	fd = file_open_missing(path, O_RDONLY);
+	covered = 0;
+
+	if (fd < 0)
+		goto done;
+
+	if (
+		sizeof hdr != read(fd, ARYLEN(hdr)) ||
+		TTH_INDEX_MAGIC != peek_be32(&hdr[0]) ||
+		TTH_STORE_VERSION != peek_be32(&hdr[4])
+	) {
+		g_warning("%s(): ignoring invalid TTH store index", G_STRFUNC);
+		goto done;
+	}
+
+	if (peek_be64(&hdr[8]) != tth_store.generation) {
+		g_warning("%s(): ignoring stale TTH store index", G_STRFUNC);
+		goto done;
+	}
+
+	covered = peek_be64(&hdr[16]);
+	dead = peek_be64(&hdr[24]);
+	count = peek_be64(&hdr[32]);
+
+	if (covered > tth_store.size || covered < TTH_STORE_HDR_SIZE) {
+		g_warning("%s(): TTH store index covers %s bytes, store has %s",
+			G_STRFUNC, filesize_to_string(covered),
+			filesize_to_string2(tth_store.size));
+		covered = 0;
+		goto done;
+	}
+
+	buf = halloc(TTH_INDEX_CHUNK * TTH_INDEX_ENT_SIZE);
 
-	pathname = tth_cache_pathname(tth);
-	fd = file_open_missing(pathname, O_RDONLY);
-	HFREE_NULL(pathname);
-	return fd;
+	for (i = 0; i < count; /* empty */) {
+		size_t n = MIN(count - i, TTH_INDEX_CHUNK), j;
+		size_t len = n * TTH_INDEX_ENT_SIZE;
+
+		if ((ssize_t) len != read(fd, buf, len))
+			goto invalid;
+
+		for (j = 0; j < n; j++) {
+			const char *p = &buf[j * TTH_INDEX_ENT_SIZE];
+			struct tth_entry e;
+
+			memcpy(e.tth.data, p, TTH_RAW_SIZE);
+			e.offset = peek_be64(&p[24]);
+			e.leaves = peek_be32(&p[32]);
+			e.stamp = peek_be32(&p[36]);
+
+			if (
+				e.leaves <= 1 || e.leaves > TTH_MAX_LEAVES ||
+				e.offset < TTH_STORE_HDR_SIZE ||
+				e.offset + tth_record_size(e.leaves) > covered
+			)
+				goto invalid;
+
+			tth_store_index_set(&e);
+		}
+
+		i += n;
+	}
+
+	tth_store.dead = dead;
+	tth_store.dirty = FALSE;
+
+	if (debugging(0)) {
+		g_debug("%s(): loaded %s TTH store entries", G_STRFUNC,
+			uint64_to_string(count));
+	}
+
+	goto done;
+
+invalid:
+	g_warning("%s(): corrupted TTH store index, rebuilding it", G_STRFUNC);
+	tth_store_index_clear();
+	covered = 0;
+
+	/* FALL THROUGH */
+
+done:
+	HFREE_NULL(buf);
+	fd_forget_and_close(&fd);
+	HFREE_NULL(path);
+	return covered;
 }
 
-static bool
-tth_cache_file_exists(const struct tth *tth)
+struct tth_index_save {
+	char *p;				/**< Where next entry is written */
+};
+
+static void
+tth_store_index_dump(void *data, void *udata)
 {
-	bool ret;
-	char *pathname;
+	const struct tth_entry *e = data;
+	struct tth_index_save *ctx = udata;
+	char *p = ctx->p;
 
-	g_return_val_if_fail(tth, FALSE);
+	memcpy(p, e->tth.data, TTH_RAW_SIZE);
+	poke_be64(&p[24], e->offset);
+	poke_be32(&p[32], e->leaves);
+	poke_be32(&p[36], e->stamp);
 
-	pathname = tth_cache_pathname(tth);
-	ret = file_exists(pathname);
-	HFREE_NULL(pathname);
-	return ret;
+	ctx->p += TTH_INDEX_ENT_SIZE;
 }
 
-void
-tth_cache_insert(const struct tth *tth, const struct tth *leaves, int n_leaves)
+/**
+ * Save the index if it changed, along with the size of the store it covers.
+ *
+ * Must be called with the store locked.
+ */
+static void
+tth_store_index_save(void)
 {
+	struct tth_index_save ctx;
+	char *path, *tmp, *buf;
+	size_t count, len;
 	int fd;
 
-	g_return_if_fail(tth);
-	g_return_if_fail(leaves);
-	g_return_if_fail(n_leaves >= 1);
+	assert_mutex_is_owned(&tth_store_mtx);
 
-	{
-		struct tth root;
+	if (!tth_store.dirty || tth_store.fd < 0)
+		return;
 
-		root = tt_root_hash(leaves, n_leaves);
-		g_return_if_fail(tth_eq(tth, &root));
-	}
+	count = hikset_count(tth_store.index);
+	len = TTH_INDEX_HDR_SIZE + count * TTH_INDEX_ENT_SIZE;
+	buf = halloc(len);
 
-	if (1 == n_leaves)
-		return;
+	poke_be32(&buf[0], TTH_INDEX_MAGIC);
+	poke_be32(&buf[4], TTH_STORE_VERSION);
+	poke_be64(&buf[8], tth_store.generation);
+	poke_be64(&buf[16], tth_store.size);
+	poke_be64(&buf[24], tth_store.dead);
+	poke_be64(&buf[32], count);
+
+	ctx.p = &buf[TTH_INDEX_HDR_SIZE];
+	hikset_foreach(tth_store.index, tth_store_index_dump, &ctx);
+	g_assert(ctx.p == &buf[len]);
+
+	path = tth_store_pathname(TTH_INDEX_FILE);
+	tmp = tth_store_pathname(TTH_INDEX_NEW);
+	fd = file_create(tmp, O_WRONLY | O_TRUNC, TTH_FILE_MODE);
 
-	fd = tth_cache_file_create(tth);
 	if (fd >= 0) {
-		size_t size;
-		ssize_t ret;
+		bool ok = (ssize_t) len == write(fd, buf, len) && 0 == fd_fsync(fd);
+
+		fd_forget_and_close(&fd);
+
+		if (!ok || -1 == rename(tmp, path)) {
+			g_warning("%s(): cannot save TTH store index: %m", G_STRFUNC);
+			unlink(tmp);
+		} else {
+			tth_store.dirty = FALSE;
+		}
+	}
+
+	HFREE_NULL(tmp);
+	HFREE_NULL(path);
+	HFREE_NULL(buf);
+}
+
+/**
+ * Append record for tree to the store.
+ *
+ * Must be called with the store locked.
+ *
+ * @return TRUE on success.
+ */
+static bool
+tth_store_append(const struct tth *tth,
+	const struct tth *leaves, size_t n_leaves, time_t stamp)
+{
+	struct tth_entry e;
+	size_t len;
+	ssize_t r;
+	char *buf;
+
+	assert_mutex_is_owned(&tth_store_mtx);
+	g_assert(n_leaves > 1 && n_leaves <= TTH_MAX_LEAVES);
 
-		STATIC_ASSERT(TTH_RAW_SIZE == sizeof(leaves[0]));
+	STATIC_ASSERT(TTH_RAW_SIZE == sizeof(leaves[0]));
 
-		size = TTH_RAW_SIZE * n_leaves;
-		ret = write(fd, leaves, size);
-		if ((ssize_t) -1 == ret) {
+	len = tth_record_size(n_leaves);
+	buf = halloc(len);
+	tth_record_header(buf, tth, n_leaves, stamp);
+	memcpy(&buf[TTH_RECORD_HDR_SIZE], leaves, n_leaves * TTH_RAW_SIZE);
+
+	r = compat_pwrite(tth_store.fd, buf, len, tth_store.size);
+	HFREE_NULL(buf);
+
+	if ((ssize_t) len != r) {
+		if ((ssize_t) -1 == r)
 			g_warning("%s(%s): write() failed: %m", G_STRFUNC, tth_base32(tth));
-		} else if ((size_t) ret != size) {
+		else
 			g_warning("%s(%s): incomplete write()", G_STRFUNC, tth_base32(tth));
-		}
-		fd_forget_and_close(&fd);
+
+		/* Do not leave a partial record, which would end the next scan */
+		if (-1 == ftruncate(tth_store.fd, tth_store.size))
+			g_warning("%s(): cannot truncate TTH store: %m", G_STRFUNC);
+
+		return FALSE;
 	}
+
+	e.tth = *tth;
+	e.offset = tth_store.size;
+	e.leaves = n_leaves;
+	e.stamp = stamp;
+	tth_store_index_set(&e);
+	tth_store.size += len;
+
+	return TRUE;
+}
+
+/**
+ * Read the leaves of an indexed tree.
+ *
+ * Must be called with the store locked.
+ *
+ * @return the amount of leaves read, 0 on error.
+ */
+static size_t
+tth_store_read(const struct tth_entry *e, struct tth *leaves, size_t n)
+{
+	filesize_t offset = e->offset + TTH_RECORD_HDR_SIZE;
+	size_t len;
+
+	assert_mutex_is_owned(&tth_store_mtx);
+
+	n = MIN(n, e->leaves);
+	len = n * TTH_RAW_SIZE;
+
+	if (tth_store_map(e->offset + tth_record_size(e->leaves))) {
+		memcpy(leaves, &tth_store.map[offset], len);
+		return n;
+	}
+
+	return (ssize_t) len == compat_pread(tth_store.fd, leaves, len, offset) ?
+		n : 0;
 }
 
 static size_t
@@ -240,85 +692,182 @@ tth_cache_leave_count(const struct tth *tth, const filestat_t *sb)
 }
 
 /**
- * @return The number of leaves or zero if unknown.
+ * Read leaves from a legacy cache file.
+ *
+ * @param path		the file to read
+ * @param tth		the tree root hash
+ * @param leaves	where leaves are written (NULL to only count leaves)
+ * @param n			amount of leaves that can be written
+ *
+ * @return the amount of leaves read, 0 if none.
  */
-size_t
-tth_cache_lookup(const struct tth *tth, filesize_t filesize)
+static size_t
+tth_legacy_read(const char *path, const struct tth *tth,
+	struct tth *leaves, size_t n)
 {
-	size_t expected, leave_count = 0;
-
-	g_return_val_if_fail(tth, 0);
+	size_t num_leaves = 0;
+	int fd;
 
-	expected = tt_good_node_count(filesize);
-	if (expected > 1) {
+	fd = file_open_missing(path, O_RDONLY);
+	if (fd >= 0) {
 		filestat_t sb;
-		char *pathname;
-
-		pathname = tth_cache_pathname(tth);
-		if (stat(pathname, &sb)) {
-			leave_count = 0;
-			if (ENOENT != errno) {
-				g_warning("%s(%s): stat(\"%s\") failed: %m",
-					G_STRFUNC, tth_base32(tth), pathname);
-			}
+
+		if (fstat(fd, &sb)) {
+			g_warning("%s(%s): fstat() failed: %m", G_STRFUNC, tth_base32(tth));
 		} else {
-			leave_count = tth_cache_leave_count(tth, &sb);
+			size_t n_leaves;
+
+			n_leaves = tth_cache_leave_count(tth, &sb);
+
+			if (NULL == leaves) {
+				num_leaves = n_leaves;
+			} else {
+				n_leaves = MIN(n, n_leaves);
+				if (n_leaves > 0) {
+					size_t size;
+					ssize_t ret;
+
+					STATIC_ASSERT(TTH_RAW_SIZE == sizeof(leaves[0]));
+
+					size = TTH_RAW_SIZE * n_leaves;
+					ret = read(fd, &leaves[0].data, size);
+					if ((size_t) ret == size) {
+						num_leaves = n_leaves;
+					}
+				}
+			}
 		}
+		fd_forget_and_close(&fd);
+	}
+	return num_leaves;
+}
+
+/**
+ * Get leaves of tree, from the store or from the legacy cache directory
+ * when it has not been fully migrated yet.
+ *
+ * @param tth		the tree root hash
+ * @param leaves	where leaves are written (NULL to only count leaves)
+ * @param n			amount of leaves that can be written
+ *
+ * @return the amount of leaves, 0 if tree is unknown.
+ */
+static size_t
+tth_cache_get_leaves(const struct tth *tth, struct tth *leaves, size_t n)
+{
+	const struct tth_entry *e;
+	size_t num_leaves = 0;
+	bool legacy;
+
+	g_return_val_if_fail(tth, 0);
+
+	TTH_STORE_LOCK;
+
+	e = NULL == tth_store.index ? NULL : hikset_lookup(tth_store.index, tth);
+
+	if (e != NULL)
+		num_leaves = NULL == leaves ? e->leaves : tth_store_read(e, leaves, n);
+
+	legacy = tth_store.legacy;
+
+	TTH_STORE_UNLOCK;
+
+	if (NULL == e && legacy) {
+		char *pathname = tth_cache_pathname(tth);
+		num_leaves = tth_legacy_read(pathname, tth, leaves, n);
 		HFREE_NULL(pathname);
-	} else {
-		leave_count = 1;
 	}
-	return expected != leave_count ? 0 : leave_count;
+
+	return num_leaves;
 }
 
 void
-tth_cache_remove(const struct tth *tth)
+tth_cache_insert(const struct tth *tth, const struct tth *leaves, int n_leaves)
 {
-	char *pathname;
-
 	g_return_if_fail(tth);
+	g_return_if_fail(leaves);
+	g_return_if_fail(n_leaves >= 1);
 
-	pathname = tth_cache_pathname(tth);
-	unlink(pathname);
-	HFREE_NULL(pathname);
+	{
+		struct tth root;
+
+		root = tt_root_hash(leaves, n_leaves);
+		g_return_if_fail(tth_eq(tth, &root));
+	}
+
+	if (1 == n_leaves)
+		return;
+
+	TTH_STORE_LOCK;
+
+	if (tth_store.fd >= 0) {
+		struct tth_entry *e = hikset_lookup(tth_store.index, tth);
+
+		/*
+		 * The leaves of a known tree with the same amount of leaves are
+		 * necessarily identical, since they yield the same root hash.
+		 * We only refresh the insertion time, which protects the entry
+		 * from the next cleanup.
+		 */
+
+		if (e != NULL && e->leaves == (uint32) n_leaves) {
+			e->stamp = tm_time();
+			tth_store.dirty = TRUE;
+		} else {
+			(void) tth_store_append(tth, leaves, n_leaves, tm_time());
+		}
+	}
+
+	TTH_STORE_UNLOCK;
 }
 
-static size_t
-tth_cache_get_leaves(const struct tth *tth,
-	struct tth leaves[TTH_MAX_LEAVES], size_t n)
+/**
+ * @return The number of leaves or zero if unknown.
+ */
+size_t
+tth_cache_lookup(const struct tth *tth, filesize_t filesize)
+{
+	size_t expected, leave_count;
+
+	g_return_val_if_fail(tth, 0);
+
+	expected = tt_good_node_count(filesize);
+	if (expected > 1) {
+		leave_count = tth_cache_get_leaves(tth, NULL, 0);
+	} else {
+		leave_count = 1;
+	}
+	return expected != leave_count ? 0 : leave_count;
+}
+
+void
+tth_cache_remove(const struct tth *tth)
 {
-	int fd, num_leaves = 0;
+	struct tth_entry *e;
+	bool legacy;
 
-	g_return_val_if_fail(tth, 0);
-	g_return_val_if_fail(leaves, 0);
+	g_return_if_fail(tth);
 
-	fd = tth_cache_file_open(tth);
-	if (fd >= 0) {
-		filestat_t sb;
+	TTH_STORE_LOCK;
 
-		if (fstat(fd, &sb)) {
-			g_warning("%s(%s): fstat() failed: %m", G_STRFUNC, tth_base32(tth));
-		} else {
-			size_t n_leaves;
+	e = NULL == tth_store.index ? NULL : hikset_lookup(tth_store.index, tth);
 
-			n_leaves = tth_cache_leave_count(tth, &sb);
-			n_leaves = MIN(n, n_leaves);
-			if (n_leaves > 0) {
-				size_t size;
-				ssize_t ret;
+	if (e != NULL) {
+		hikset_remove(tth_store.index, tth);
+		tth_store.dead += tth_record_size(e->leaves);
+		tth_store.dirty = TRUE;
+		WFREE(e);
+	}
 
-				STATIC_ASSERT(TTH_RAW_SIZE == sizeof(leaves[0]));
+	legacy = tth_store.legacy;
 
-				size = TTH_RAW_SIZE * n_leaves;
-				ret = read(fd, &leaves[0].data, size);
-				if ((size_t) ret == size) {
-					num_leaves = n_leaves;
-				}
-			}
-		}
-		fd_forget_and_close(&fd);
+	TTH_STORE_UNLOCK;
+
+	if (legacy) {
+		char *pathname = tth_cache_pathname(tth);
+		unlink(pathname);
+		HFREE_NULL(pathname);
 	}
-	return num_leaves;
 }
 
 size_t
@@ -364,7 +913,7 @@ tth_cache_get_tree(const struct tth *tth, filesize_t filesize,
 		}
 	}
 
-	if (tth_cache_file_exists(tth)) {
+	if (tth_cache_get_leaves(tth, NULL, 0) != 0) {
 		g_warning("%s(): removing corrupted tigertree for %s",
 			G_STRFUNC, tth_base32(tth));
 		tth_cache_remove(tth);
@@ -382,26 +931,249 @@ tth_cache_get_tree(const struct tth *tth, filesize_t filesize,
 size_t
 tth_cache_get_nleaves(const struct tth *tth)
 {
-	int fd;
-	filesize_t nleaves = 0;
-
 	g_return_val_if_fail(tth != NULL, 0);
 
-	fd = tth_cache_file_open(tth);
+	return tth_cache_get_leaves(tth, NULL, 0);
+}
 
-	if (fd >= 0) {
-		filestat_t sb;
+/**
+ * Location of a record being moved by compaction.
+ */
+struct tth_move {
+	struct tth tth;			/**< Root hash */
+	filesize_t from;		/**< Offset in the current store */
+	filesize_t to;			/**< Offset in the compacted store */
+	uint32 leaves;			/**< Amount of leaves */
+};
 
-		if (fstat(fd, &sb)) {
-			g_warning("%s(%s): fstat() failed: %m", G_STRFUNC, tth_base32(tth));
-		} else {
-			nleaves = tth_cache_leave_count(tth, &sb);
+static int
+tth_move_cmp(const void *a, const void *b)
+{
+	const struct tth_move *ma = a, *mb = b;
+
+	return CMP(ma->from, mb->from);
+}
+
+struct tth_compact_snapshot {
+	struct tth_move *moves;		/**< Records to move */
+	size_t count;				/**< Amount of records */
+};
+
+static void
+tth_store_snapshot(void *data, void *udata)
+{
+	const struct tth_entry *e = data;
+	struct tth_compact_snapshot *snap = udata;
+	struct tth_move *m = &snap->moves[snap->count++];
+
+	m->tth = e->tth;
+	m->from = e->offset;
+	m->leaves = e->leaves;
+}
+
+/**
+ * Copy record from one store to another.
+ *
+ * @return TRUE on success.
+ */
+static bool
+tth_store_copy(int from, filesize_t offset, int to, filesize_t at,
+	size_t len, char *buf)
+{
+	return
+		(ssize_t) len == compat_pread(from, buf, len, offset) &&
+		(ssize_t) len == compat_pwrite(to, buf, len, at);
+}
+
+/**
+ * Compact the store when enough of it is taken by dead records.
+ *
+ * The live records are first copied to a new store without holding the lock,
+ * which is only taken at the end to copy the records appended during the
+ * copy, relocate the index entries and switch to the new store.  Records
+ * are never modified once written, so the old store can be safely read
+ * concurrently with appends.
+ */
+static void
+tth_store_compact(void)
+{
+	struct tth_compact_snapshot snap;
+	filesize_t end, size, live;
+	char *path = NULL, *tmp = NULL, *buf = NULL;
+	uint64 generation;
+	int fd = -1, nfd = -1;
+	size_t i, moved = 0;
+
+	TTH_STORE_LOCK;
+
+	if (
+		tth_store.fd < 0 ||
+		tth_store.dead < TTH_COMPACT_MIN ||
+		tth_store.dead < tth_store.size / 2
+	) {
+		TTH_STORE_UNLOCK;
+		return;
+	}
+
+	fd = dup(tth_store.fd);		/* Safe against concurrent tth_cache_close() */
+	end = tth_store.size;
+	snap.count = 0;
+	XMALLOC_ARRAY(snap.moves, hikset_count(tth_store.index) + 1);
+	hikset_foreach(tth_store.index, tth_store_snapshot, &snap);
+
+	TTH_STORE_UNLOCK;
+
+	if (fd < 0) {
+		g_warning("%s(): cannot duplicate TTH store descriptor: %m", G_STRFUNC);
+		goto done;
+	}
+
+	if (debugging(0)) {
+		g_debug("%s(): compacting TTH store (%s bytes, %zu record%s)",
+			G_STRFUNC, filesize_to_string(end), PLURAL(snap.count));
+	}
+
+	path = tth_store_pathname(TTH_STORE_FILE);
+	tmp = tth_store_pathname(TTH_STORE_NEW);
+	nfd = file_create(tmp, O_RDWR | O_TRUNC, TTH_FILE_MODE);
+
+	if (nfd < 0 || !tth_store_header_write(nfd, &generation))
+		goto failed;
+
+	/*
+	 * Copy records in the order in which they appear in the store, to
+	 * read it sequentially.
+	 */
+
+	xqsort(snap.moves, snap.count, sizeof snap.moves[0], tth_move_cmp);
+
+	buf = halloc(tth_record_size(TTH_MAX_LEAVES));
+	size = TTH_STORE_HDR_SIZE;
+
+	for (i = 0; i < snap.count; i++) {
+		struct tth_move *m = &snap.moves[i];
+		size_t len = tth_record_size(m->leaves);
+
+		if (!tth_store_copy(fd, m->from, nfd, size, len, buf))
+			goto failed;
+
+		m->to = size;
+		size += len;
+	}
+
+	TTH_STORE_LOCK;
+
+	if (tth_store.fd < 0) {
+		TTH_STORE_UNLOCK;
+		goto failed;
+	}
+
+	/*
+	 * Relocate entries whose record we moved, unless they were removed or
+	 * superseded by a more recent record in the meantime.
+	 */
+
+	live = 0;
+
+	for (i = 0; i < snap.count; i++) {
+		const struct tth_move *m = &snap.moves[i];
+		struct tth_entry *e = hikset_lookup(tth_store.index, &m->tth);
+
+		if (e != NULL && e->offset == m->from) {
+			e->offset = m->to;
+			live += tth_record_size(m->leaves);
+			moved++;
 		}
+	}
 
-		fd_forget_and_close(&fd);
+	/*
+	 * Copy records appended whilst we were copying, if still referenced.
+	 */
+
+	while (end < tth_store.size) {
+		char hdr[TTH_RECORD_HDR_SIZE];
+		struct tth_entry r, *e;
+		size_t len;
+
+		if (
+			sizeof hdr != compat_pread(fd, ARYLEN(hdr), end) ||
+			!tth_record_parse(hdr, &r)
+		) {
+			TTH_STORE_UNLOCK;
+			goto failed;		/* Will leave index inconsistent, see below */
+		}
+
+		len = tth_record_size(r.leaves);
+		e = hikset_lookup(tth_store.index, &r.tth);
+
+		if (e != NULL && e->offset == end) {
+			if (!tth_store_copy(fd, end, nfd, size, len, buf)) {
+				TTH_STORE_UNLOCK;
+				goto failed;
+			}
+			e->offset = size;
+			size += len;
+			live += len;
+			moved++;
+		}
+
+		end += len;
+	}
+
+	if (0 != fd_fsync(nfd) || -1 == rename(tmp, path)) {
+		TTH_STORE_UNLOCK;
+		goto failed;
+	}
+
+	tth_store_unmap();
+	fd_forget_and_close(&tth_store.fd);
+	tth_store.fd = nfd;
+	tth_store.generation = generation;
+	tth_store.dead = size - TTH_STORE_HDR_SIZE - live;
+	tth_store.size = size;
+	tth_store.dirty = TRUE;
+	tth_store_index_save();
+	nfd = -1;
+
+	TTH_STORE_UNLOCK;
+
+	g_info("TTH store compacted from %s to %s bytes (%zu record%s)",
+		filesize_to_string(end), filesize_to_string2(size), PLURAL(moved));
+
+	goto done;
+
+failed:
+	/*
+	 * Relocations are only applied to the index once the new store is fully
+	 * written, and the old store remains untouched, so any failure before
+	 * the switch has no effect.  The only exception is a failure whilst
+	 * copying the records appended during compaction: these come after some
+	 * index entries were relocated, hence we rebuild the index.
+	 */
+
+	g_warning("%s(): cannot compact TTH store: %m", G_STRFUNC);
+
+	if (moved != 0) {
+		TTH_STORE_LOCK;
+		if (tth_store.fd >= 0) {
+			tth_store_index_clear();
+			tth_store_scan(TTH_STORE_HDR_SIZE);
+		}
+		TTH_STORE_UNLOCK;
 	}
 
-	return nleaves;
+	if (tmp != NULL)
+		unlink(tmp);
+
+	/* FALL THROUGH */
+
+done:
+	fd_close(&nfd);
+	fd_close(&fd);
+	XFREE_NULL(snap.moves);
+	HFREE_NULL(buf);
+	HFREE_NULL(tmp);
+	HFREE_NULL(path);
 }
 
 /**
@@ -414,24 +1186,10 @@ tth_cache_dir_rmdir(const char *path)
 	if (debugging(0))
 		g_message("%s(): removing TTH cache directory %s", G_STRFUNC, path);
 
-	/*
-	 * To avoid any conflicts with another thread attempting to create a
-	 * file under that directory, take a lock.
-	 *
-	 * Note that there is a race condition between the traversal that detects
-	 * the directory is empty and the time we actually attempt to remove it.
-	 * Hence, we silence any error having to deal with the directory being
-	 * non-empty and therefore non-removable.
-	 */
-
-	TTH_PATH_LOCK;
-
 	if (-1 == rmdir(path) && ENOTEMPTY != errno) {
 		g_warning("%s(): cannot remove TTH cache directory %s: %m",
 			G_STRFUNC, path);
 	}
-
-	TTH_PATH_UNLOCK;
 }
 
 
@@ -451,7 +1209,7 @@ tth_cache_cleanup_rmdir(
 			tth_cache_dir_rmdir(info->fpath);	/* Try, we can't read it */
 		} else if (FTW_F_DONE & info->flags) {
 			void *cnt = (*dirsp)->data;
-			if (NULL == cnt && 0 != info->level)
+			if (NULL == cnt)
 				tth_cache_dir_rmdir(info->fpath);
 			*dirsp = pslist_delete_link(*dirsp, *dirsp);	/* Strip head */
 		} else {
@@ -493,13 +1251,21 @@ tth_cache_file_remove(const char *path, const char *reason)
 }
 
 /**
- * ftw_foreach() callback to remove obsolete / spurious files.
+ * Context for tth_cache_migrate_entry().
+ */
+struct tth_cache_migrate {
+	struct tth *leaves;		/**< Buffer for TTH_MAX_LEAVES leaves */
+	size_t migrated;		/**< Amount of entries migrated */
+};
+
+/**
+ * ftw_foreach() callback to migrate legacy cache files into the store.
  */
 static ftw_status_t
-tth_cache_cleanup_unlink(
+tth_cache_migrate_entry(
 	const ftw_info_t *info, const filestat_t *sb, void *data)
 {
-	const hset_t *shared = data;
+	struct tth_cache_migrate *ctx = data;
 
 	if (FTW_F_DIR & info->flags)
 		return FTW_STATUS_OK;
@@ -511,9 +1277,10 @@ tth_cache_cleanup_unlink(
 
 	if (FTW_F_FILE & info->flags) {
 		char **path;
-		struct tth tth;
+		struct tth tth, root;
 		char b32[TTH_BASE32_SIZE + 2];
-		size_t len;
+		size_t len, n;
+		bool stored;
 
 		if (FTW_F_NOSTAT & info->flags) {
 			g_warning("%s(): ignoring unaccessible cached TTH %s",
@@ -544,30 +1311,42 @@ tth_cache_cleanup_unlink(
 			goto done;
 		}
 
+		n = tth_legacy_read(info->fpath, &tth, ctx->leaves, TTH_MAX_LEAVES);
+
+		if (n <= 1) {
+			tth_cache_file_remove(info->fpath, "invalid");
+			goto done;
+		}
+
+		root = tt_root_hash(ctx->leaves, n);
+
+		if (!tth_eq(&tth, &root)) {
+			tth_cache_file_remove(info->fpath, "corrupted");
+			goto done;
+		}
+
 		/*
-		 * At this point, we have a valid TTH cache filename.
-		 *
-		 * We want to only process files created before the session started.
-		 *
-		 * The rationale is that users could start unsharing directories,
-		 * moving files around, add new files, etc..  Each time a new library
-		 * rescan occurs, we're going to create new TTH cache files, or some
-		 * cached files could become unused for a while and then files will
-		 * reappear in the library.
-		 *
-		 * By only ever cleaning up files created before the current session,
-		 * we have a higher likelyhood of processing an obsolete cache entry.
+		 * Keep the file modification time as the insertion time, so that
+		 * the next cleanup can still spot the entries that were created
+		 * in previous sessions and are no longer shared.
 		 */
 
-		if (delta_time(sb->st_mtime, GNET_PROPERTY(session_start_stamp)) >= 0)
-			goto done;		/* Created after session started, skip */
-
-		if (!hset_contains(shared, &tth)) {
-			if (debugging(0))
-				g_debug("%s(): unshared TTH (%s)", G_STRFUNC, info->rpath);
-			(void) tth_cache_file_unlink(info->fpath, "unshared");
+		TTH_STORE_LOCK;
+		stored = tth_store.fd >= 0 &&
+			(
+				NULL != hikset_lookup(tth_store.index, &tth) ||
+				tth_store_append(&tth, ctx->leaves, n, sb->st_mtime)
+			);
+		TTH_STORE_UNLOCK;
+
+		if (!stored) {
+			g_strfreev(path);
+			return FTW_STATUS_ABORT;	/* Store closed or cannot write */
 		}
 
+		if (tth_cache_file_unlink(info->fpath, "migrated"))
+			ctx->migrated++;
+
 		/* FALL THROUGH */
 
 	done:
@@ -579,44 +1358,34 @@ tth_cache_cleanup_unlink(
 	return FTW_STATUS_ERROR;
 }
 
-static int tth_cache_cleanups;
-
 /**
- * Main entry point for the thread that cleans up the TTH cache.
+ * Main entry point for the thread migrating the legacy TTH cache directory.
  */
 static void *
-tth_cache_cleanup_thread(void *unused_arg)
+tth_cache_migrate_thread(void *unused_arg)
 {
-	hset_t *shared;
 	const char *rootdir = tth_cache_directory();
+	struct tth_cache_migrate ctx;
 	pslist_t *dirstack;
 	uint32 flags;
 	ftw_status_t res;
 
 	(void) unused_arg;
 
-	if (!is_directory(rootdir))
-		goto done;			/* No TTH cache */
-
-	/*
-	 * First pass: spot all file entries that are older than our start
-	 * time (i.e. were created in another session) and which cannot be
-	 * associated with a shared file.
-	 */
+	ctx.leaves = halloc(TTH_MAX_LEAVES * sizeof ctx.leaves[0]);
+	ctx.migrated = 0;
 
-	shared = share_tthset_get();
 	flags = FTW_O_PHYS | FTW_O_MOUNT | FTW_O_ALL;
-	res = ftw_foreach(rootdir, flags, 0, tth_cache_cleanup_unlink, shared);
-	share_tthset_free(shared);
+	res = ftw_foreach(rootdir, flags, 0, tth_cache_migrate_entry, &ctx);
+	HFREE_NULL(ctx.leaves);
 
 	if (res != FTW_STATUS_OK) {
-		g_warning("%s(): initial traversal failed with %d, aborting",
-			G_STRFUNC, res);
-		goto done;
+		g_warning("%s(): migration of %s stopped with %d",
+			G_STRFUNC, rootdir, res);
 	}
 
 	/*
-	 * Second pass: spot empty directories and remove them.
+	 * Remove the now empty directories, including the root one.
 	 */
 
 	flags |= FTW_O_ENTRY | FTW_O_DEPTH;
@@ -624,21 +1393,119 @@ tth_cache_cleanup_thread(void *unused_arg)
 	(void) ftw_foreach(rootdir, flags, 0, tth_cache_cleanup_rmdir, &dirstack);
 	pslist_free(dirstack);
 
-	/* FALL THROUGH */
+	TTH_STORE_LOCK;
+	tth_store.legacy = is_directory(rootdir);
+	tth_store_index_save();
+	TTH_STORE_UNLOCK;
+
+	g_info("migrated %lu legacy TTH cache entr%s into the TTH store",
+		PLURAL_Y((ulong) ctx.migrated));
 
-done:
 	atomic_int_dec(&tth_cache_cleanups);
 	return NULL;
 }
 
 /**
- * Cleanup the TTH cache by removing needless entries.
+ * Context for tth_cache_purge().
  */
-void
-tth_cache_cleanup(void)
+struct tth_cache_purge {
+	const hset_t *shared;	/**< Set of shared TTHs */
+	time_t start;			/**< Session start */
+	size_t purged;			/**< Amount of entries purged */
+};
+
+/**
+ * hikset_foreach_remove() callback to purge unshared entries.
+ */
+static bool
+tth_cache_purge(void *data, void *udata)
+{
+	struct tth_entry *e = data;
+	struct tth_cache_purge *ctx = udata;
+
+	/*
+	 * We want to only process entries inserted before the session started.
+	 *
+	 * The rationale is that users could start unsharing directories,
+	 * moving files around, add new files, etc..  Each time a new library
+	 * rescan occurs, we're going to insert new TTH cache entries, or some
+	 * cached entries could become unused for a while and then files will
+	 * reappear in the library.
+	 *
+	 * By only ever cleaning up entries inserted before the current session,
+	 * we have a higher likelyhood of processing an obsolete cache entry.
+	 */
+
+	if (delta_time(e->stamp, ctx->start) >= 0)
+		return FALSE;		/* Inserted after session started, skip */
+
+	if (hset_contains(ctx->shared, &e->tth))
+		return FALSE;
+
+	if (debugging(0))
+		g_debug("%s(): unshared TTH (%s)", G_STRFUNC, tth_base32(&e->tth));
+
+	tth_store.dead += tth_record_size(e->leaves);
+	ctx->purged++;
+	WFREE(e);
+	return TRUE;
+}
+
+/**
+ * Main entry point for the thread that cleans up the TTH cache.
+ */
+static void *
+tth_cache_cleanup_thread(void *unused_arg)
+{
+	struct tth_cache_purge ctx;
+	hset_t *shared;
+
+	(void) unused_arg;
+
+	/*
+	 * First pass: spot all entries that are older than our start time
+	 * (i.e. were inserted in another session) and which cannot be
+	 * associated with a shared file.
+	 */
+
+	shared = share_tthset_get();
+	ctx.shared = shared;
+	ctx.start = GNET_PROPERTY(session_start_stamp);
+	ctx.purged = 0;
+
+	TTH_STORE_LOCK;
+	if (tth_store.fd >= 0) {
+		hikset_foreach_remove(tth_store.index, tth_cache_purge, &ctx);
+		if (ctx.purged != 0)
+			tth_store.dirty = TRUE;
+	}
+	TTH_STORE_UNLOCK;
+
+	share_tthset_free(shared);
+
+	if (debugging(0) && ctx.purged != 0) {
+		g_debug("%s(): purged %lu unshared TTH entr%s",
+			G_STRFUNC, PLURAL_Y((ulong) ctx.purged));
+	}
+
+	/*
+	 * Second pass: reclaim the space used by dead records.
+	 */
+
+	tth_store_compact();
+
+	atomic_int_dec(&tth_cache_cleanups);
+	return NULL;
+}
+
+/**
+ * Launch background thread working on the store, unless one is running.
+ */
+static void
+tth_cache_background(process_fn_t routine)
 {
 	if (0 == atomic_int_inc(&tth_cache_cleanups)) {
-		int id = thread_create(tth_cache_cleanup_thread,
+		int id = thread_create(routine,
 					NULL, THREAD_F_DETACH | THREAD_F_WARN, THREAD_STACK_MIN);
 		if (-1 == id)
 			atomic_int_dec(&tth_cache_cleanups);
@@ -648,16 +1515,113 @@ tth_cache_cleanup(void)
 	}
 }
 
+/**
+ * Cleanup the TTH cache by removing needless entries.
+ */
+void
+tth_cache_cleanup(void)
+{
+	tth_cache_background(tth_cache_cleanup_thread);
+}
+
+/**
+ * Open the store, creating it if needed.
+ *
+ * @return TRUE if the store is opened.
+ */
+static bool
+tth_store_open(void)
+{
+	char hdr[TTH_STORE_HDR_SIZE];
+	filestat_t sb;
+	char *path;
+	int fd;
+
+	path = tth_store_pathname(TTH_STORE_FILE);
+	fd = file_open_missing(path, O_RDWR);
+
+	if (fd < 0 && ENOENT == errno)
+		fd = file_create(path, O_RDWR, TTH_FILE_MODE);
+
+	HFREE_NULL(path);
+
+	if (fd < 0)
+		return FALSE;
+
+	if (-1 == fstat(fd, &sb)) {
+		g_warning("%s(): fstat() failed: %m", G_STRFUNC);
+		fd_forget_and_close(&fd);
+		return FALSE;
+	}
+
+	if (
+		sb.st_size < TTH_STORE_HDR_SIZE ||
+		sizeof hdr != compat_pread(fd, ARYLEN(hdr), 0) ||
+		TTH_STORE_MAGIC != peek_be32(&hdr[0]) ||
+		TTH_STORE_VERSION != peek_be32(&hdr[4])
+	) {
+		if (sb.st_size != 0)
+			g_warning("%s(): discarding invalid TTH store", G_STRFUNC);
+
+		if (
+			-1 == ftruncate(fd, 0) ||
+			!tth_store_header_write(fd, &tth_store.generation)
+		) {
+			g_warning("%s(): cannot initialize TTH store: %m", G_STRFUNC);
+			fd_forget_and_close(&fd);
+			return FALSE;
+		}
+		sb.st_size = TTH_STORE_HDR_SIZE;
+	} else {
+		tth_store.generation = peek_be64(&hdr[8]);
+	}
+
+	tth_store.fd = fd;
+	tth_store.size = sb.st_size;
+
+	return TRUE;
+}
+
 void
 tth_cache_init(void)
 {
-	/* NOTHING */
+	filesize_t covered;
+
+	tth_store.index = hikset_create(
+		offsetof(struct tth_entry, tth), HASH_KEY_FIXED, sizeof(struct tth));
+
+	TTH_STORE_LOCK;
+
+	if (tth_store_open()) {
+		covered = tth_store_index_load();
+		tth_store_scan(MAX(covered, TTH_STORE_HDR_SIZE));
+	}
+
+	tth_store.legacy = is_directory(tth_cache_directory());
+
+	TTH_STORE_UNLOCK;
+
+	if (tth_store.legacy && tth_store.fd >= 0)
+		tth_cache_background(tth_cache_migrate_thread);
 }
 
 void
 tth_cache_close(void)
 {
-	/* NOTHING */
+	TTH_STORE_LOCK;
+
+	if (tth_store.fd >= 0) {
+		tth_store_index_save();
+		tth_store_unmap();
+		fd_forget_and_close(&tth_store.fd);
+	}
+
+	if (tth_store.index != NULL) {
+		hikset_foreach_remove(tth_store.index, tth_store_entry_free, NULL);
+		hikset_free_null(&tth_store.index);
+	}
+
+	TTH_STORE_UNLOCK;
 }
 
 /* vi: set ts=4 sw=4 cindent: */
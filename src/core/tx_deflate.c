@@ -47,6 +47,7 @@
 #include "lib/cq.h"
 #include "lib/endian.h"
 #include "lib/mempcpy.h"
+#include "lib/stringify.h"
 #include "lib/tm.h"
 #include "lib/walloc.h"
 #include "lib/zlib_util.h"
@@ -69,6 +70,18 @@
 #define BUFFER_NAGLE	500		/**< 500 ms */
 #define BUFFER_DELAY	2		/**< 2 secs -- max Nagle delay */
 
+/*
+ * Adaptive compression level parameters.
+ */
+
+#define DEFLATE_DEFAULT_LEVEL	6		/**< What Z_DEFAULT_COMPRESSION means */
+#define DEFLATE_ADAPT_PERIOD	5		/**< 5 secs between level evaluations */
+#define DEFLATE_ADAPT_INPUT		4096	/**< Min input bytes to evaluate */
+#define DEFLATE_ADAPT_RETRY		12		/**< Periods before retrying a level */
+#define DEFLATE_MAX_NS_PER_BYTE	200		/**< Don't compress harder above that */
+#define DEFLATE_MIN_GAIN		0.01	/**< Min ratio gain from a higher level */
+#define DEFLATE_PARAMS_ROOM		64		/**< Output room for deflateParams() */
+
 struct buffer {
 	char *arena;				/**< Buffer arena */
 	char *end;					/**< First byte outside buffer */
@@ -105,7 +118,19 @@ struct attr {
 		uint32		size;		/**< Payload size counter for gzip */
 		uLong		crc;		/**< CRC-32 accumlator for gzip */
 	} gzip;
+	struct {
+		uint64		cpu_ns;		/**< Time spent in deflate() during period */
+		size_t		input;		/**< Input bytes flushed during period */
+		size_t		output;		/**< Output bytes flushed during period */
+		uint		flowc;		/**< Times we entered flow-control in period */
+		uint		retry;		/**< Periods since next level was deemed useless */
+		uint		known;		/**< Bitmap of levels for which ratio[] is known */
+		time_t		start;		/**< Start of the current evaluation period */
+		int			level;		/**< Current compression level */
+		double		ratio[Z_BEST_COMPRESSION + 1];	/**< EMA of ratio per level */
+	} adapt;
 	unsigned nagle:1;			/**< Whether to use Nagle or not */
+	unsigned adaptive:1;		/**< Whether to adapt the compression level */
 };
 
 /*
@@ -119,11 +144,43 @@ struct attr {
 
 static void deflate_nagle_timeout(cqueue_t *cq, void *arg);
 static size_t tx_deflate_pending(txdrv_t *tx);
+static void deflate_adapt(txdrv_t *tx);
 
 #define tx_deflate_debugging(lvl) \
 	G_UNLIKELY(GNET_PROPERTY(tx_deflate_debug) > (lvl) && \
 		tx_debug_host(&tx->host))
 
+/**
+ * Run deflate() on the stream, accounting for the time spent compressing.
+ *
+ * Since compression is purely CPU-bound and runs synchronously, the elapsed
+ * time is a good measure of the CPU time it consumed.
+ *
+ * @return the deflate() status.
+ */
+static int
+deflate_timed(txdrv_t *tx, int flush)
+{
+	struct attr *attr = tx->opaque;
+	tm_nano_t start, end;
+	long ns;
+	int ret;
+
+	tm_precise_time(&start);
+	ret = deflate(attr->outz, flush);
+	tm_precise_time(&end);
+
+	ns = tm_precise_elapsed_ns(&end, &start);
+
+	if G_LIKELY(ns > 0) {
+		attr->adapt.cpu_ns += ns;
+		if (attr->cb->add_tx_cputime != NULL)
+			attr->cb->add_tx_cputime(tx->owner, ns);
+	}
+
+	return ret;
+}
+
 /**
  * Write ready-to-be-sent buffer to the lower layer.
  */
@@ -319,6 +376,7 @@ deflate_set_flowc(txdrv_t *tx, bool on)
 
 	if (on) {
 		attr->flags |= DF_FLOWC;		/* Enter flow control */
+		attr->adapt.flowc++;
 	} else {
 		attr->flags &= ~DF_FLOWC;		/* Leave flow control state */
 	}
@@ -373,8 +431,16 @@ deflate_flushed(txdrv_t *tx)
 	}
 
 done:
+	attr->adapt.input += attr->unflushed;
+	attr->adapt.output += attr->flushed;
 	attr->unflushed = attr->flushed = 0;
 	attr->flags &= ~DF_FLUSH;
+
+	if (
+		attr->adaptive &&
+		delta_time(tm_time(), attr->adapt.start) >= DEFLATE_ADAPT_PERIOD
+	)
+		deflate_adapt(tx);
 }
 
 /**
@@ -418,7 +484,7 @@ retry:
 
 	g_assert(outz->avail_out > 0);
 
-	ret = deflate(outz, (tx->flags & TX_CLOSING) ? Z_FINISH : Z_SYNC_FLUSH);
+	ret = deflate_timed(tx, (tx->flags & TX_CLOSING) ? Z_FINISH : Z_SYNC_FLUSH);
 
 	switch (ret) {
 	case Z_BUF_ERROR:				/* Nothing to flush */
@@ -475,6 +541,162 @@ done:
 	return TRUE;		/* Fully flushed */
 }
 
+/**
+ * Change the compression level of the stream.
+ *
+ * This must be called right after a flush, when there is no pending input,
+ * so that deflateParams() does not have to compress anything with the
+ * old parameters.  Older zlib versions can still emit an empty block, so we
+ * make sure there is room in the filling buffer for it.
+ *
+ * @return TRUE if the level was changed.
+ */
+static bool
+deflate_set_level(txdrv_t *tx, int level)
+{
+	struct attr *attr = tx->opaque;
+	z_streamp outz = attr->outz;
+	struct buffer *b;
+	size_t written;
+	int old_avail;
+	int ret;
+
+	g_assert(level >= Z_BEST_SPEED && level <= Z_BEST_COMPRESSION);
+	g_assert(0 == attr->unflushed);
+
+	b = &attr->buf[attr->fill_idx];	/* Buffer we fill */
+
+	if (b->end - b->wptr < DEFLATE_PARAMS_ROOM)
+		return FALSE;				/* Will retry at next evaluation */
+
+	outz->next_out = cast_to_pointer(b->wptr);
+	outz->avail_out = old_avail = b->end - b->wptr;
+	outz->avail_in = 0;
+
+	ret = deflateParams(outz, level, Z_DEFAULT_STRATEGY);
+
+	written = old_avail - outz->avail_out;
+	b->wptr += written;
+	attr->flushed += written;
+
+	if (written != 0 && NULL != attr->cb->add_tx_deflated)
+		attr->cb->add_tx_deflated(tx->owner, written);
+
+	if (Z_OK != ret) {
+		if (tx_deflate_debugging(0)) {
+			g_debug("TX %s: (%s) cannot switch from level %d to %d: %s",
+				G_STRFUNC, gnet_host_to_string(&tx->host),
+				attr->adapt.level, level, zlib_strerror(ret));
+		}
+		return FALSE;
+	}
+
+	if (tx_deflate_debugging(1)) {
+		g_debug("TX %s: (%s) compression level %d -> %d",
+			G_STRFUNC, gnet_host_to_string(&tx->host),
+			attr->adapt.level, level);
+	}
+
+	attr->adapt.level = level;
+
+	if (NULL != attr->cb->level_changed)
+		attr->cb->level_changed(tx->owner, level);
+
+	return TRUE;
+}
+
+/**
+ * Evaluate the compression level to use, based on what happened during
+ * the last period.
+ *
+ * We only compress harder when the link is bandwidth-bound, i.e. when we
+ * had to flow-control the upper layer or when our owner reports that its
+ * message queue is congested.  A higher level is not attempted when the
+ * CPU cost per byte is already high or when it did not bring any noticeable
+ * gain in the compression ratio the last time we tried it.
+ *
+ * When the link is not bandwidth-bound, we lower the level to save CPU.
+ */
+static void
+deflate_adapt(txdrv_t *tx)
+{
+	struct attr *attr = tx->opaque;
+	int level = attr->adapt.level;
+	int target = level;
+	double ratio;
+	uint64 ns_per_byte;
+	bool bound;
+
+	if (tx->flags & (TX_ERROR | TX_CLOSING) || attr->flags & DF_SHUTDOWN)
+		return;
+
+	/*
+	 * Wait until we have enough data to get meaningful figures.
+	 */
+
+	if (attr->adapt.input < DEFLATE_ADAPT_INPUT)
+		return;
+
+	ratio = 1.0 - ((double) attr->adapt.output / attr->adapt.input);
+	ns_per_byte = attr->adapt.cpu_ns / attr->adapt.input;
+
+	/*
+	 * Slow EMA for the compression ratio of each level, computed for the
+	 * last n=7 periods, so the smoothing factor sm=2/(n+1) is 1/4.
+	 */
+
+	if (attr->adapt.known & (1U << level)) {
+		attr->adapt.ratio[level] +=
+			(ratio / 4.0) - (attr->adapt.ratio[level] / 4.0);
+	} else {
+		attr->adapt.ratio[level] = ratio;
+		attr->adapt.known |= 1U << level;
+	}
+
+	bound = attr->adapt.flowc != 0 ||
+		(NULL != attr->cb->congested && attr->cb->congested(tx->owner));
+
+	if (bound) {
+		if (
+			level < Z_BEST_COMPRESSION &&
+			ns_per_byte < DEFLATE_MAX_NS_PER_BYTE
+		) {
+			int next = level + 1;
+
+			if (
+				!(attr->adapt.known & (1U << next)) ||
+				attr->adapt.ratio[next] - attr->adapt.ratio[level] >=
+					DEFLATE_MIN_GAIN
+			) {
+				target = next;
+			} else if (++attr->adapt.retry >= DEFLATE_ADAPT_RETRY) {
+				/* Traffic may have changed, forget what we know */
+				attr->adapt.known &= ~(1U << next);
+				attr->adapt.retry = 0;
+			}
+		}
+	} else if (level > Z_BEST_SPEED) {
+		target = level - 1;
+	}
+
+	if (tx_deflate_debugging(2)) {
+		g_debug("TX %s: (%s) level %d: %zu bytes into %zu (%.2f%%), "
+			"%s ns/byte, %u flow-control%s%s, target level %d",
+			G_STRFUNC, gnet_host_to_string(&tx->host), level,
+			attr->adapt.input, attr->adapt.output, 100 * ratio,
+			uint64_to_string(ns_per_byte), attr->adapt.flowc,
+			plural(attr->adapt.flowc), bound ? " (bound)" : "", target);
+	}
+
+	if (target != level && deflate_set_level(tx, target))
+		attr->adapt.retry = 0;
+
+	attr->adapt.cpu_ns = 0;
+	attr->adapt.input = attr->adapt.output = 0;
+	attr->adapt.flowc = 0;
+	attr->adapt.start = tm_time();
+}
+
 /**
  * Flush compression and send whatever we got so far.
  */
@@ -602,7 +824,7 @@ deflate_add(txdrv_t *tx, const void *data, int len)
 		 * that we have more room available for the output.
 		 */
 
-		ret = deflate(outz, flush_started ? Z_SYNC_FLUSH : 0);
+		ret = deflate_timed(tx, flush_started ? Z_SYNC_FLUSH : 0);
 
 		if (Z_OK != ret) {
 			attr->flags |= DF_SHUTDOWN;
@@ -828,6 +1050,7 @@ tx_deflate_init(txdrv_t *tx, void *args)
 	z_streamp outz;
 	int ret;
 	int i;
+	int initial_level;
 
 	g_assert(tx);
 	g_assert(NULL != targs->cb);
@@ -870,6 +1093,13 @@ tx_deflate_init(txdrv_t *tx, void *args)
 	 *		--RAM, 2011-11-29
 	 */
 
+	/*
+	 * When running in adaptive mode, the level chosen here is only the
+	 * starting point: it will be raised or lowered by deflate_adapt()
+	 * depending on whether the link is bandwidth-bound.  The window size
+	 * and memory level cannot be changed once the stream is initialized.
+	 */
+
 	{
 		int window_bits = MAX_WBITS;		/* Must be 8 .. MAX_WBITS */
 		int mem_level = MAX_MEM_LEVEL;		/* Must be 1 .. MAX_MEM_LEVEL */
@@ -890,6 +1120,9 @@ tx_deflate_init(txdrv_t *tx, void *args)
 		ret = deflateInit2(outz, level, Z_DEFLATED,
 				targs->gzip ? (-window_bits) : window_bits, mem_level,
 				Z_DEFAULT_STRATEGY);
+
+		initial_level = Z_DEFAULT_COMPRESSION == level ?
+			DEFLATE_DEFAULT_LEVEL : level;
 	}
 
 	if (Z_OK != ret) {
@@ -899,13 +1132,35 @@ tx_deflate_init(txdrv_t *tx, void *args)
 		return NULL;
 	}
 
+	/*
+	 * Prime the compressor with the preset dictionary, when one was
+	 * negotiated with the remote end.
+	 */
+
+	if (targs->dict != NULL) {
+		g_assert(targs->dict_len != 0);
+
+		ret = deflateSetDictionary(outz, targs->dict, targs->dict_len);
+
+		if (Z_OK != ret) {
+			g_warning("unable to set compressor dictionary for peer %s: %s",
+				gnet_host_to_string(&tx->host), zlib_strerror(ret));
+			deflateEnd(outz);
+			WFREE(outz);
+			return NULL;
+		}
+	}
+
 	WALLOC0(attr);
 	attr->cq = targs->cq;
 	attr->cb = targs->cb;
 	attr->buffer_size = targs->buffer_size;
 	attr->buffer_flush = targs->buffer_flush;
 	attr->nagle = booleanize(targs->nagle);
+	attr->adaptive = booleanize(targs->adaptive);
 	attr->gzip.enabled = targs->gzip;
+	attr->adapt.level = initial_level;
+	attr->adapt.start = tm_time();
 
 	attr->outz = outz;
 	attr->tm_ev = NULL;
@@ -942,6 +1197,9 @@ tx_deflate_init(txdrv_t *tx, void *args)
 
 	tx->opaque = attr;
 
+	if (NULL != attr->cb->level_changed)
+		attr->cb->level_changed(tx->owner, initial_level);
+
 	/*
 	 * Register our service routine to the lower layer.
 	 */
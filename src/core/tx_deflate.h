@@ -48,6 +48,9 @@ struct tx_deflate_cb {
 	void (*add_tx_deflated)(void *owner, int amount);
 	void (*shutdown)(void *owner, const char *reason, ...);
 	void (*flow_control)(void *owner, size_t amount);
+	void (*add_tx_cputime)(void *owner, uint64 ns);
+	void (*level_changed)(void *owner, int level);
+	bool (*congested)(void *owner);
 };
 
 /**
@@ -61,6 +64,9 @@ struct tx_deflate_args {
 	bool nagle;					/**< Whether to use Nagle or not */
 	bool gzip;					/**< Whether to use gzip encapsulation */
 	bool reduced;				/**< Whether to use reduced compression */
+	bool adaptive;				/**< Whether to adapt compression level */
+	const void *dict;			/**< Preset dictionary, NULL if none */
+	size_t dict_len;			/**< Length of preset dictionary */
 };
 
 #endif	/* _core_tx_deflate_h_ */
@@ -4189,6 +4189,9 @@ static const struct tx_deflate_cb upload_tx_deflate_cb = {
 	NULL,				/* add_tx_deflated */
 	upload_tx_error,	/* shutdown */
 	NULL,				/* flow_control */
+	NULL,				/* add_tx_cputime */
+	NULL,				/* level_changed */
+	NULL,				/* congested */
 };
 
 static void
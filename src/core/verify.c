@@ -30,22 +30,28 @@
  * Computation is done in a separate thread, but this is invisible to the
  * calling thread as callbacks happen in the calling thread context.
  *
- * Each verification thread is given a thread event queue (TEQ), and the
- * calling thread needs to also create its own TEQ so that we can properly
- * dispatch callbacks.
+ * Verifications are handled by a pool of threads shared by all the
+ * verification contexts.  Each file being hashed is a job with its own hash
+ * state, so that the same context can have several files hashed at the
+ * same time by different threads.  Each pool thread is given a thread event
+ * queue (TEQ) on which it is woken up when work is enqueued.
  *
- * As work is concurrently inserted into the verification lists, a notification
- * event is sent to the computing thread to wake it up.
+ * The size of the pool is configured by the "verify_threads" property: when
+ * left to 0, a single thread is used on systems with at most 2 CPUs, and
+ * one thread per CPU, minus one for the main thread, otherwise.
  *
- * On systems with 2 CPUs only, all the verifications are handled by one single
- * thread, so we continue to use the legacy code, relying on the background
- * task scheduler to properly arbitrate processing between the various hash
- * verifications.
+ * Queued files are first resolved by the pool threads, which determine the
+ * device on which each file resides and move it to the queue of that device.
+ * The amount of files concurrently read from the same device is limited by
+ * the "verify_device_readers" property, so that spinning disks do not get to
+ * seek back and forth between files.  The default of 0 places no limit.
+ * High-priority requests are never held back by that limit.
  *
- * As soon as there are 3 CPUs or more, all the verifications are handled in
- * separate threads, but there are distinct background task schedulers created,
- * so each thread can use almost all its processing ticks to actually compute
- * the hash value.
+ * A thread keeps reading from the device it last read from, as long as that
+ * device has queued files.  Otherwise it resolves more files, and when none
+ * are left it steals work from the device with the longest queue that still
+ * has a free reader slot.  Per-device statistics are collected and can be
+ * retrieved via verify_device_stats().
  *
  * @author Raphael Manfredi
  * @date 2002-2003, 2013
@@ -61,19 +67,21 @@
 #include "lib/atomic.h"
 #include "lib/atoms.h"
 #include "lib/barrier.h"
-#include "lib/bg.h"
 #include "lib/compat_misc.h"
 #include "lib/constants.h"
 #include "lib/cq.h"
+#include "lib/elist.h"
 #include "lib/entropy.h"
 #include "lib/file.h"
 #include "lib/file_object.h"
 #include "lib/getcpucount.h"
 #include "lib/halloc.h"
 #include "lib/hashing.h"
-#include "lib/hashlist.h"
+#include "lib/hevset.h"
+#include "lib/mutex.h"
+#include "lib/pslist.h"
 #include "lib/str.h"
-#include "lib/stringify.h"		/* For short_time_ascii() */
+#include "lib/stringify.h"		/* For PLURAL() */
 #include "lib/teq.h"
 #include "lib/thread.h"
 #include "lib/tm.h"
@@ -81,42 +89,31 @@
 
 #include "lib/override.h"	/* Must be the last header included */
 
-#define HASH_BUF_SIZE		(128 * 1024)	/**< Size of the reading buffer */
+/*
+ * The reading buffer is large enough for the Tigertree code to hash the
+ * leaves of each slice we feed it in parallel.
+ */
+#define HASH_BUF_SIZE		(1024 * 1024)	/**< Size of the reading buffer */
 
-#define HASH_THREAD_MAX			2			/**< At most 2 hashing threads */
+#define VERIFY_THREAD_MAX		64			/**< At most 64 hashing threads */
+#define VERIFY_DEVICE_MAX		64			/**< Devices with their own queue */
 #define VERIFY_DEFERRED			10			/**< ms: deferred free timeout */
 #define VERIFY_PROGRESS_NOTIFY	1			/**< s: progress notification */
 
-#define VERIFY_INVALID_LOCAL_ID -1U
-
 enum verify_magic { VERIFY_MAGIC = 0x2dc84379U };
 
 /**
- * Verification task context.
+ * Verification context, one per kind of hash.
+ *
+ * The context only knows about the files it queued, to detect duplicates:
+ * the files themselves sit in the global queues.
  */
 struct verify {
 	enum verify_magic magic;	/**< Magic number. */
-	hash_list_t *files_to_hash;	/**< Work queue */
 	const struct verify_hash hash;	/**< Hash-specific processing callbacks */
-	struct bgtask *task;		/**< Background task handling the processing */
-	bgsched_t *sched;			/**< Task scheduler for this thread */
-	unsigned verify_stid;		/**< Verification thread ID */
-
-	file_object_t *file;		/**< The file object to access the file. */
-	filesize_t offset;			/**< Current offset into the file. */
-	filesize_t start;			/**< Start offset of range to verify. */
-	filesize_t end;				/**< End offset of range to verify . */
-	time_t started;				/**< Start time, to determine comp. rate */
-	time_t last_progress;		/**< Last time we informed about progress */
-	char *buffer;				/**< Read buffer */
-	size_t buffer_size;			/**< Size of buffer in bytes. */
-
-	enum verify_status status;	/**< Used for callback multiplexing. */
-	uint8 shutdowned;			/**< Flag indicating context was shutdown */
-
-	/* Fields copied from currently processed verify_file entry */
-	verify_callback	callback;	/**< User-specified callback function. */
-	void *user_data;			/**< User-specified callback parameter. */
+	hevset_t *queued;			/**< Queued files, to spot duplicates */
+	uint running;				/**< Files being resolved or hashed */
+	bool shutdowned;			/**< Flag indicating context was shutdown */
 };
 
 static inline void
@@ -126,24 +123,6 @@ verify_check(const struct verify * const ctx)
 	g_assert(VERIFY_MAGIC == ctx->magic);
 }
 
-static inline void
-verify_hash_init(const struct verify * const ctx)
-{
-	ctx->hash.init(ctx->end - ctx->start);
-}
-
-static inline int
-verify_hash_update(const struct verify * const ctx, const void *data, size_t n)
-{
-	return ctx->hash.update(data, n);
-}
-
-static inline int
-verify_hash_final(const struct verify * const ctx)
-{
-	return ctx->hash.final();
-}
-
 static inline const char *
 verify_hash_name(const struct verify * const ctx)
 {
@@ -154,11 +133,16 @@ enum verify_file_magic { VERIFY_FILE_MAGIC = 0x063ac7adU };
 
 struct verify_file {
 	enum verify_file_magic magic;	/**< Magic number */
+	struct verify *ctx;				/**< Context which queued the file */
 	const char *pathname;			/**< Absolute path of the file */
 	filesize_t offset;				/**< Offset to start at */
 	filesize_t amount;				/**< Amount of bytes to hash */
 	verify_callback	callback;		/**< User-specified callback function */
 	void *user_data;				/**< Callback argument */
+	struct verify_device *device;	/**< Device queue, NULL if unresolved */
+	link_t lk;						/**< Links file in its queue */
+	bool resolving;					/**< Off queue, device being determined */
+	bool high_priority;				/**< Whether request is urgent */
 };
 
 static inline void
@@ -169,7 +153,8 @@ verify_file_check(const struct verify_file * const item)
 }
 
 static struct verify_file *
-verify_file_new(const char *pathname, filesize_t offset, filesize_t amount,
+verify_file_new(struct verify *ctx,
+	const char *pathname, filesize_t offset, filesize_t amount,
 	verify_callback callback, void *user_data)
 {
 	struct verify_file *item;
@@ -179,6 +164,7 @@ verify_file_new(const char *pathname, filesize_t offset, filesize_t amount,
 
 	WALLOC0(item);
 	item->magic = VERIFY_FILE_MAGIC;
+	item->ctx = ctx;
 	item->pathname = atom_str_get(pathname);
 	item->offset = offset;
 	item->amount = amount;
@@ -197,7 +183,246 @@ verify_file_free(struct verify_file **ptr)
 		atom_str_free_null(&item->pathname);
 		item->magic = 0;
 		WFREE(item);
+		*ptr = NULL;
+	}
+}
+
+enum verify_job_magic { VERIFY_JOB_MAGIC = 0x51d7a2e6U };
+
+/**
+ * A file being hashed by a thread of the pool.
+ */
+struct verify_job {
+	enum verify_job_magic magic;	/**< Magic number */
+	struct verify *ctx;			/**< Context which queued the file */
+	struct verify_file *item;	/**< The queued file */
+	void *state;				/**< Hash state, from the init() callback */
+	file_object_t *file;		/**< The file object to access the file. */
+	struct verify_device *device;	/**< Device held whilst reading */
+	filesize_t offset;			/**< Current offset into the file. */
+	filesize_t start;			/**< Start offset of range to verify. */
+	filesize_t end;				/**< End offset of range to verify . */
+	time_t started;				/**< Start time, to determine comp. rate */
+	time_t last_progress;		/**< Last time we informed about progress */
+	enum verify_status status;	/**< Used for callback multiplexing. */
+};
+
+static inline void
+verify_job_check(const struct verify_job * const job)
+{
+	g_assert(job);
+	g_assert(VERIFY_JOB_MAGIC == job->magic);
+}
+
+/**
+ * Initialize job to process the queued file.
+ */
+static void
+verify_job_init(struct verify_job *job, struct verify_file *item)
+{
+	verify_file_check(item);
+
+	ZERO(job);
+	job->magic = VERIFY_JOB_MAGIC;
+	job->ctx = item->ctx;
+	job->item = item;
+	job->start = job->offset = item->offset;
+	job->end = item->offset + item->amount;
+}
+
+/**
+ * A device holding files to hash, with its queue.
+ *
+ * There are few devices holding files to hash, hence a small table with
+ * linear lookups is enough.  When the table is full, files on new devices
+ * share an extra queue, which is not subject to the reader limit and whose
+ * statistics are not reported.
+ */
+struct verify_device {
+	struct verify_device_stats stats;	/**< Statistics and readers */
+	elist_t files;						/**< Files queued on the device */
+};
+
+static struct verify_device verify_devices[VERIFY_DEVICE_MAX];
+static size_t verify_devices_count;
+static struct verify_device verify_device_other;
+static elist_t verify_unresolved;		/**< Files whose device is unknown */
+
+/*
+ * The lock protects the queues, the devices, the pool and the contexts.
+ * It is never held whilst reading files or invoking user callbacks.
+ */
+static mutex_t verify_mtx = MUTEX_INIT;
+
+#define VERIFY_LOCK		mutex_lock(&verify_mtx)
+#define VERIFY_UNLOCK	mutex_unlock(&verify_mtx)
+
+/**
+ * @return the i-th device, the extra one when ``i'' is the device count.
+ */
+static inline struct verify_device *
+verify_device_at(size_t i)
+{
+	return i < verify_devices_count ? &verify_devices[i] : &verify_device_other;
+}
+
+/**
+ * Get device entry, creating it if missing.
+ *
+ * @return the device entry, the extra one if we cannot track more devices.
+ */
+static struct verify_device *
+verify_device_get(uint64 dev)
+{
+	struct verify_device *vd;
+	size_t i;
+
+	assert_mutex_is_owned(&verify_mtx);
+
+	for (i = 0; i < verify_devices_count; i++) {
+		vd = &verify_devices[i];
+		if (vd->stats.dev == dev)
+			return vd;
+	}
+
+	if G_UNLIKELY(verify_devices_count >= N_ITEMS(verify_devices))
+		return &verify_device_other;
+
+	vd = &verify_devices[verify_devices_count++];
+	vd->stats.dev = dev;
+	elist_init(&vd->files, offsetof(struct verify_file, lk));
+
+	return vd;
+}
+
+/**
+ * @return whether the device is read by as many threads as allowed.
+ */
+static bool
+verify_device_busy(const struct verify_device *vd)
+{
+	uint limit = GNET_PROPERTY(verify_device_readers);
+
+	return vd != &verify_device_other &&
+		0 != limit && vd->stats.readers >= limit;
+}
+
+/**
+ * @return whether the first file queued on the device can be read now.
+ */
+static bool
+verify_device_ready(const struct verify_device *vd)
+{
+	const struct verify_file *item = elist_head(&vd->files);
+
+	return item != NULL && (item->high_priority || !verify_device_busy(vd));
+}
+
+/**
+ * @return a device whose first queued file is urgent, NULL if none.
+ */
+static struct verify_device *
+verify_device_urgent(void)
+{
+	size_t i;
+
+	for (i = 0; i <= verify_devices_count; i++) {
+		struct verify_device *vd = verify_device_at(i);
+		const struct verify_file *item = elist_head(&vd->files);
+
+		if (item != NULL && item->high_priority)
+			return vd;
+	}
+
+	return NULL;
+}
+
+/**
+ * @return the device with the longest queue among the ones that can be
+ * read now, NULL if none.
+ */
+static struct verify_device *
+verify_device_steal(void)
+{
+	struct verify_device *best = NULL;
+	size_t i;
+
+	for (i = 0; i <= verify_devices_count; i++) {
+		struct verify_device *vd = verify_device_at(i);
+
+		if (!verify_device_ready(vd))
+			continue;
+
+		if (NULL == best || elist_count(&vd->files) > elist_count(&best->files))
+			best = vd;
+	}
+
+	return best;
+}
+
+/**
+ * Account for data read and hashed on the device.
+ *
+ * @param vd		the device entry
+ * @param amount	amount of bytes processed
+ * @param elapsed	time spent, in seconds
+ */
+static void
+verify_device_account(struct verify_device *vd, size_t amount, double elapsed)
+{
+	VERIFY_LOCK;
+	vd->stats.bytes += amount;
+	vd->stats.busy_us += (uint64) (elapsed * 1e6);
+	VERIFY_UNLOCK;
+}
+
+/**
+ * Count a file whose processing ended on the device.
+ *
+ * @param vd		the device entry (NULL if file was not read)
+ * @param ok		whether the file was successfully hashed
+ */
+static void
+verify_device_count(struct verify_device *vd, bool ok)
+{
+	if (NULL == vd)
+		return;
+
+	VERIFY_LOCK;
+	if (ok)
+		vd->stats.files++;
+	else
+		vd->stats.errors++;
+	VERIFY_UNLOCK;
+}
+
+/**
+ * Fill supplied vector with per-device verification statistics.
+ *
+ * @param vec		the vector to fill
+ * @param n			amount of entries in the vector
+ *
+ * @return the amount of entries filled.
+ */
+size_t
+verify_device_stats(struct verify_device_stats *vec, size_t n)
+{
+	size_t i;
+
+	g_assert(vec != NULL || 0 == n);
+
+	VERIFY_LOCK;
+
+	for (i = 0; i < n && i < verify_devices_count; i++) {
+		const struct verify_device *vd = &verify_devices[i];
+
+		vec[i] = vd->stats;		/* Struct copy */
+		vec[i].queued = elist_count(&vd->files);
 	}
+
+	VERIFY_UNLOCK;
+
+	return i;
 }
 
 /*
@@ -230,12 +455,13 @@ verify_file_free(struct verify_file **ptr)
 static void *
 verify_cb(void *arg)
 {
-	struct verify *ctx = arg;
+	struct verify_job *job = arg;
+	const struct verify_file *item = job->item;
 
-	verify_check(ctx);
+	verify_job_check(job);
 	g_assert(thread_is_main());		/* Funnelled to main thread */
 
-	return bool_to_pointer(ctx->callback(ctx, ctx->status, ctx->user_data));
+	return bool_to_pointer(item->callback(job, job->status, item->user_data));
 }
 
 /**
@@ -243,12 +469,12 @@ verify_cb(void *arg)
  * aborted and verify_failure() will be called afterwards.
  */
 static bool
-verify_start(struct verify *ctx)
+verify_start(struct verify_job *job)
 {
-	verify_check(ctx);
+	verify_job_check(job);
 
-	ctx->status = VERIFY_START;
-	return pointer_to_bool(teq_safe_rpc(THREAD_MAIN_ID, verify_cb, ctx));
+	job->status = VERIFY_START;
+	return pointer_to_bool(teq_safe_rpc(THREAD_MAIN_ID, verify_cb, job));
 }
 
 /**
@@ -256,52 +482,54 @@ verify_start(struct verify *ctx)
  * aborted and verify_failure() will be called afterwards.
  */
 static bool
-verify_progress(struct verify *ctx)
+verify_progress(struct verify_job *job)
 {
-	verify_check(ctx);
+	verify_job_check(job);
 
-	ctx->status = VERIFY_PROGRESS;
-	return pointer_to_bool(teq_safe_rpc(THREAD_MAIN_ID, verify_cb, ctx));
+	job->status = VERIFY_PROGRESS;
+	return pointer_to_bool(teq_safe_rpc(THREAD_MAIN_ID, verify_cb, job));
 }
 
 static void
-verify_failure(struct verify *ctx)
+verify_failure(struct verify_job *job)
 {
-	verify_check(ctx);
+	verify_job_check(job);
 
-	ctx->status = VERIFY_ERROR;
-	(void) teq_safe_rpc(THREAD_MAIN_ID, verify_cb, ctx);
-	ctx->status = VERIFY_INVALID;
+	verify_device_count(job->device, FALSE);
+	job->status = VERIFY_ERROR;
+	(void) teq_safe_rpc(THREAD_MAIN_ID, verify_cb, job);
+	job->status = VERIFY_INVALID;
 }
 
 static void
-verify_shutdown(struct verify *ctx)
+verify_shutdown(struct verify_job *job)
 {
-	verify_check(ctx);
+	verify_job_check(job);
 
-	ctx->status = VERIFY_SHUTDOWN;
-	(void) teq_safe_rpc(THREAD_MAIN_ID, verify_cb, ctx);
-	ctx->status = VERIFY_INVALID;
+	job->status = VERIFY_SHUTDOWN;
+	(void) teq_safe_rpc(THREAD_MAIN_ID, verify_cb, job);
+	job->status = VERIFY_INVALID;
 }
 
 static void
-verify_done(struct verify *ctx)
+verify_done(struct verify_job *job)
 {
-	verify_check(ctx);
+	verify_job_check(job);
 
-	ctx->status = VERIFY_DONE;
-	(void) teq_safe_rpc(THREAD_MAIN_ID, verify_cb, ctx);
-	ctx->status = VERIFY_INVALID;
+	verify_device_count(job->device, TRUE);
+	job->status = VERIFY_DONE;
+	(void) teq_safe_rpc(THREAD_MAIN_ID, verify_cb, job);
+	job->status = VERIFY_INVALID;
 }
 
 /**
  * @return current verification status.
  */
 enum verify_status
-verify_status(const struct verify *ctx)
+verify_status(const struct verify_job *job)
 {
-	verify_check(ctx);
-	return ctx->status;
+	verify_job_check(job);
+	return job->status;
 }
 
 /**
@@ -309,12 +537,12 @@ verify_status(const struct verify *ctx)
  * that have been hashed of the current file so far.
  */
 filesize_t
-verify_hashed(const struct verify *ctx)
+verify_hashed(const struct verify_job *job)
 {
-	verify_check(ctx);
-	g_assert(VERIFY_INVALID != ctx->status);
+	verify_job_check(job);
+	g_assert(VERIFY_INVALID != job->status);
 
-	return ctx->offset - ctx->start;
+	return job->offset - job->start;
 }
 
 /**
@@ -322,19 +550,32 @@ verify_hashed(const struct verify *ctx)
  * since hashing of the current file started.
  */
 uint
-verify_elapsed(const struct verify *ctx)
+verify_elapsed(const struct verify_job *job)
 {
 	time_delta_t d;
 
-	verify_check(ctx);
-	g_assert(VERIFY_INVALID != ctx->status);
+	verify_job_check(job);
+	g_assert(VERIFY_INVALID != job->status);
 
-	d = delta_time(tm_time(), ctx->started);
+	d = delta_time(tm_time(), job->started);
 	d = MAX(0, d);
 	d = MIN(d, INT_MAX);
 	return d;
 }
 
+/**
+ * The hash-specific layer calls this to access the hash state of the file,
+ * as returned by its init() callback.
+ */
+void *
+verify_job_state(const struct verify_job *job)
+{
+	verify_job_check(job);
+	g_assert(job->state != NULL);
+
+	return job->state;
+}
+
 static uint
 verify_item_hash(const void *key)
 {
@@ -366,685 +607,767 @@ verify_item_equal(const void *p, const void *q)
 }
 
 /**
- * Variables controlling asynchronous "cancellation" of verification threads.
- *
- * The verify_exit[] array is index by a small number (the "local thread ID")
- * and tells the thread whether it has received a TSIG_TERM signal.
- *
- * The verify_threads[] array contains the ID of threads, and a linear lookup
- * is used to find the proper "local thread ID", the index at which we find
- * a matching thread ID.
- */
-static bool verify_exit[HASH_THREAD_MAX];
-static unsigned verify_threads[HASH_THREAD_MAX];
-static int verify_thread_count;
-
-/**
- * Structure passed to verify_thread_has_work().
+ * Queue file at the tail of the list, or at its head when urgent.
  */
-struct verify_work {
-	bgsched_t *bs;		/**< Background task scheduler */
-	int id;				/**< Local thread ID */
-};
+static void
+verify_file_queue(elist_t *list, struct verify_file *item)
+{
+	if (item->high_priority)
+		elist_prepend(list, item);
+	else
+		elist_append(list, item);
+}
 
 /**
- * Is there work pending in the scheduler, or is thread terminated?
+ * Flag queued file as urgent, moving it to the head of its queue.
  */
-static bool
-verify_thread_has_work(void *arg)
+static void
+verify_file_urge(struct verify_file *item)
 {
-	struct verify_work *w = arg;
+	assert_mutex_is_owned(&verify_mtx);
+
+	item->high_priority = TRUE;
 
 	/*
-	 * When the thread should exit, as indicated by verify_exit[] being set,
-	 * we return TRUE to make sure we exit from the teq_wait() call.
+	 * A file being resolved is not linked anywhere: it will be inserted
+	 * at the head of the queue of its device.
 	 */
 
-	return verify_exit[w->id] || 0 != bg_sched_runcount(w->bs);
-}
-
-/**
- * Compute local thread ID of verification thread.
- */
-static unsigned
-verify_thread_local_id(unsigned stid, bool panic)
-{
-	unsigned i;
+	if (!item->resolving) {
+		elist_t *list = NULL == item->device ?
+			&verify_unresolved : &item->device->files;
 
-	for (i = 0; i < N_ITEMS(verify_threads); i++) {
-		if (verify_threads[i] == stid)
-			return i;
+		elist_remove(list, item);
+		elist_prepend(list, item);
 	}
-
-	if (panic)
-		s_error("%s(): cannot find %s", G_STRFUNC, thread_id_name(stid));
-
-	return VERIFY_INVALID_LOCAL_ID;		/* Invalid ID, meaning not found */
 }
 
 /**
- * Signal handler to terminate the thread.
+ * Notify the owner of a queued file that it will not be hashed since its
+ * context is being shutdown, and free it.
  */
 static void
-verify_thread_terminate(int sig)
+verify_discard(struct verify_file *item)
 {
-	unsigned i;
-
-	g_assert(TSIG_TERM == sig);
+	struct verify_job job;
 
-	i = verify_thread_local_id(thread_small_id(), TRUE);
-	verify_exit[i] = TRUE;
+	verify_job_init(&job, item);
+	verify_shutdown(&job);
+	verify_file_free(&item);
 }
 
 /**
- * Arguments passed to the verification thread.
+ * A verification thread from the pool.
  */
-struct verify_thread_arg {
-	const char *name;			/* Thread name */
-	barrier_t *b;				/* Setup barrier */
-	bgsched_t *sched;			/* Background task scheduler to run */
+struct verify_worker {
+	struct verify_device *home;	/**< Device we last read from */
+	char *buffer;				/**< Read buffer */
+	unsigned stid;				/**< Thread small ID */
+	bool idle;					/**< Waiting for work, under lock */
+	bool kicked;				/**< Woken up to look for work */
+	bool exit;					/**< Whether thread received TSIG_TERM */
 };
 
 /**
- * Verfication thread main loop.
+ * The verification thread pool.
+ *
+ * Threads are created on demand, when work is pending, no thread is idle
+ * and the pool can be grown.  They are terminated when the last verification
+ * context is freed.
  */
-static void *
-verify_thread_main(void *p)
-{
-	struct verify_thread_arg *args = p;
-	struct verify_work winfo;
-	int i;
-
-	thread_set_name(args->name);
-	teq_create();				/* Queue to receive incoming work */
-	barrier_wait(args->b);		/* Thread has initialized */
-	barrier_free_null(&args->b);
-	winfo.bs = args->sched;
-	WFREE_TYPE_NULL(args);
-
-	if (GNET_PROPERTY(verify_debug))
-		g_debug("verification %s started", thread_name());
-
-	/*
-	 * Prepare for termination when receiveing a TSIG_TERM.
-	 */
-
-	winfo.id = i = atomic_int_inc(&verify_thread_count);
-
-	g_assert(i < HASH_THREAD_MAX);		/* Not creating too many threads */
-
-	verify_threads[i] = thread_small_id();
-	thread_signal(TSIG_TERM, verify_thread_terminate);
+static struct verify_worker verify_workers[VERIFY_THREAD_MAX];
+static int verify_workers_count;
+static int verify_contexts;
 
-	g_assert(verify_threads[i] != 0);	/* Not the main thread */
+/**
+ * @return the amount of threads we want in the pool.
+ */
+static int
+verify_pool_size(void)
+{
+	int n = GNET_PROPERTY(verify_threads);
 
 	/*
-	 * Process incoming work, until thread is terminated.
+	 * When not configured, use a single thread for all the verifications
+	 * on systems with only 2 CPUs.  Otherwise, use one thread per CPU as
+	 * long as we leave one CPU free for the main thread.
 	 */
 
-	while (!verify_exit[i]) {
-		if (GNET_PROPERTY(verify_debug))
-			g_debug("verification %s sleeping", thread_name());
-
-		teq_wait(verify_thread_has_work, &winfo);
+	if (0 == n) {
+		long cpus = getcpucount();
 
-		if (GNET_PROPERTY(verify_debug))
-			g_debug("verification %s awoken", thread_name());
-
-		while (0 != bg_sched_run(winfo.bs))
-			thread_check_suspended();
+		n = cpus <= 2 ? 1 : cpus - 1;
 	}
 
-	g_debug("verification %s exiting", thread_name());
-
-	bg_sched_destroy_null(&winfo.bs);
-	verify_threads[i] = 0;			/* Signals: can destroy verify context */
-
-	return NULL;
+	return CLAMP(n, 1, VERIFY_THREAD_MAX);
 }
 
 /**
- * Create a new verification thread with given name.
- *
- * This routine does not return until the verification thread has been
- * correctly initialized, so that the caller can immediately start to
- * enqueue work to the thread.
- *
- * @param v			the verification context for which we create a thread
- * @param name		the background task scheduler to use in that thread
- * @param name		the created thread name
- *
- * @return thread ID, -1 on error.
+ * @return whether there is a file that a thread could process now.
  */
-static int
-verify_thread_create(struct verify *v, bgsched_t *bs, const char *name)
+static bool
+verify_has_work(void)
 {
-	barrier_t *b;
-	struct verify_thread_arg *args;
-	int r;
-
-	b = barrier_new(2);
-
-	WALLOC(args);
-	args->name = name;
-	args->b = barrier_refcnt_inc(b);
-	args->sched = bs;
-
-	/*
-	 * The verification thread is created as a detached thread because we
-	 * do not expect any result from it.
-	 *
-	 * It is created as non-cancelable: to end it, we send it a TSIG_TERM.
-	 */
+	size_t i;
 
-	r = thread_create(verify_thread_main, args,
-			THREAD_F_DETACH | THREAD_F_NO_CANCEL |
-				THREAD_F_NO_POOL | THREAD_F_PANIC,
-			THREAD_STACK_MIN);
+	assert_mutex_is_owned(&verify_mtx);
 
-	v->verify_stid = r;
-	v->sched = bs;
+	if (0 != elist_count(&verify_unresolved))
+		return TRUE;
 
-	barrier_wait(b);		/* Wait for thread to initialize */
-	barrier_free_null(&b);
+	for (i = 0; i <= verify_devices_count; i++) {
+		if (verify_device_ready(verify_device_at(i)))
+			return TRUE;
+	}
 
-	return r;
+	return FALSE;
 }
 
 /**
- * Create a new verification thread if necessary.
+ * Event callback to wake up an idle verification thread.
  */
 static void
-verify_thread_create_if_needed(struct verify *v)
+verify_wakeup(void *arg)
 {
-	static unsigned verify_id;
-	static bgsched_t *verify_bs;
-	long cpus = getcpucount();
-
-	g_assert(thread_is_main());		/* Always called from main thread */
+	struct verify_worker *vw = arg;
 
-	/*
-	 * When there are more than 2 CPUs, we are on a multi-core system and we
-	 * create one thread per verification.  If they have only 2 CPUs, then we
-	 * just create a single thread to handle all the verifications.
-	 */
+	g_assert(thread_small_id() == vw->stid);
 
-	if (cpus <= 2) {
-		if G_UNLIKELY(NULL == verify_bs) {
-			static const char name[] = "verify";
+	vw->kicked = TRUE;
+}
 
-			verify_bs = bg_sched_create(name, 500000);		/* 500 ms */
-			verify_id = verify_thread_create(v, verify_bs, name);
-		} else {
-			v->sched = verify_bs;
-			v->verify_stid = verify_id;
-		}
-	} else {
-		const char *tname = str_smsg("verify %s", verify_hash_name(v));
-		const char *name = constant_str(tname);
+/**
+ * Is there work for the thread, or is thread terminated?
+ */
+static bool
+verify_thread_has_work(void *arg)
+{
+	struct verify_worker *vw = arg;
 
-		bgsched_t *bs = bg_sched_create(name, 1000000);		/* 1 sec */
-		(void) verify_thread_create(v, bs, name);
-	}
+	/*
+	 * When the thread should exit, as indicated by its exit flag being set,
+	 * we return TRUE to make sure we exit from the teq_wait() call.
+	 */
+
+	return vw->exit || vw->kicked;
 }
 
 /**
- * Create a new verification context.
- *
- * @param hash		Hash-specific callbacks for this hash verification
- *
- * @return verification context to which work can be requested via
- * verify_enqueue()
+ * Signal handler to terminate the thread.
  */
-struct verify *
-verify_new(const struct verify_hash *hash)
+static void
+verify_thread_terminate(int sig)
 {
-	struct verify *ctx;
-
-	g_assert(hash);
+	unsigned stid = thread_small_id();
+	uint i;
 
-	WALLOC0(ctx);
-	ctx->magic = VERIFY_MAGIC;
-	ctx->buffer_size = HASH_BUF_SIZE;
-	ctx->buffer = halloc(ctx->buffer_size);
-	STATIC_ASSERT(sizeof ctx->hash == sizeof(struct verify_hash));
-	*(struct verify_hash *) &ctx->hash = *hash;		/* Assignment to "const" */
-	ctx->files_to_hash = hash_list_new(verify_item_hash, verify_item_equal);
-	hash_list_thread_safe(ctx->files_to_hash);
+	g_assert(TSIG_TERM == sig);
 
-	verify_thread_create_if_needed(ctx);
+	for (i = 0; i < N_ITEMS(verify_workers); i++) {
+		if (verify_workers[i].stid == stid) {
+			verify_workers[i].exit = TRUE;
+			return;
+		}
+	}
 
-	return ctx;
+	s_error("%s(): cannot find %s", G_STRFUNC, thread_id_name(stid));
 }
 
+static void verify_thread_create(int id);
+
 /**
- * Callout queue callback to check whether we can free the verify context.
+ * Make sure pending work gets picked up: wake up an idle thread, or create
+ * a new one when all the threads are busy and the pool can still grow.
  */
 static void
-verify_deferred_free(cqueue_t *cq, void *data)
+verify_kick(void)
 {
-	struct verify *ctx = data;
-	unsigned i;
-
-	verify_check(ctx);
-
-	/*
-	 * We do not free the verification context until the thread that uses it
-	 * has not marked it was about to exit by clearing its corresponding
-	 * entry in verify_threads[].
-	 */
+	int i;
 
-	i = verify_thread_local_id(ctx->verify_stid, FALSE);
+	assert_mutex_is_owned(&verify_mtx);
 
-	if (i != VERIFY_INVALID_LOCAL_ID) {
-		/*
-		 * Thread has not terminated yet, could have pending RPCs...
-		 */
+	if (!verify_has_work())
+		return;
 
-		if (GNET_PROPERTY(verify_debug) > 1) {
-			g_debug("verification %s for %s not terminated yet",
-				thread_id_name(ctx->verify_stid), verify_hash_name(ctx));
-		}
+	for (i = 0; i < verify_workers_count; i++) {
+		struct verify_worker *vw = &verify_workers[i];
 
-		cq_insert(cq, VERIFY_DEFERRED, verify_deferred_free, ctx);
-	} else {
-		if (GNET_PROPERTY(verify_debug) > 1) {
-			g_debug("freeing %s verification context", verify_hash_name(ctx));
+		if (vw->idle) {
+			vw->idle = FALSE;
+			teq_post(vw->stid, verify_wakeup, vw);
+			return;
 		}
+	}
 
-		hash_list_free(&ctx->files_to_hash);
-		ctx->magic = 0;
-		WFREE(ctx);
+	if (verify_workers_count < verify_pool_size()) {
+		verify_thread_create(verify_workers_count);
+		verify_workers_count++;
 	}
 }
 
 /**
- * Free verification context and nullify its pointer.
- *
- * The actual physical disposal of the verification context is deferred until
- * the thread responsible for handling the work has terminated.
+ * Take the first file queued on the device, holding the device for reading.
  */
-void
-verify_free(struct verify **ptr)
+static struct verify_file *
+verify_take(struct verify_worker *vw, struct verify_device *vd)
 {
-	struct verify *ctx = *ptr;
-
-	if (ctx != NULL) {
-		verify_check(ctx);
-		g_assert(!ctx->shutdowned);
+	struct verify_file *item;
 
-		if (ctx->task != NULL) {
-			bg_task_cancel(ctx->task);
-			ctx->task = NULL;
-		}
+	assert_mutex_is_owned(&verify_mtx);
 
-		ctx->shutdowned = TRUE;
-		thread_kill(ctx->verify_stid, TSIG_TERM);
-		*ptr = NULL;
+	item = elist_shift(&vd->files);
+	verify_file_check(item);
+	g_assert(item->device == vd);
 
-		/*
-		 * Defer freeing of the context until the thread is dead
-		 *
-		 * We leave the ctx->files_to_hash list around as well because
-		 * it could still be accessed by other threads.
-		 */
+	hevset_remove(item->ctx->queued, item);
+	item->ctx->running++;
+	vd->stats.readers++;
+	vw->home = vd;
 
-		cq_main_insert(VERIFY_DEFERRED, verify_deferred_free, ctx);
-	}
+	return item;
 }
 
-static void
-verify_context_free(void *data)
+/**
+ * Determine the device on which the first unresolved file resides, and move
+ * the file to the queue of that device.
+ *
+ * This is done by the pool threads so that enqueuing work never blocks on a
+ * stat() call.  The lock is released whilst we stat() the file, which stays
+ * in the set of queued files of its context so that duplicates are still
+ * detected meanwhile.
+ *
+ * @return the device where the file was queued, NULL if the file was
+ * dropped because its context was shutdown meanwhile.
+ */
+static struct verify_device *
+verify_resolve(struct verify_file *item)
 {
-	struct verify *ctx = data;
+	struct verify *ctx = item->ctx;
+	struct verify_device *vd;
+	filestat_t buf;
+	uint64 dev = 0;
 
-	verify_check(ctx);
-	/* If we're called, the task is being terminated */
+	assert_mutex_is_owned(&verify_mtx);
+	g_assert(NULL == item->device);
 
-	/*
-	 * There's nothing to free here.  We're managing the overall context
-	 * ourselves, and this overall context is given as the task's context.
-	 * We just need to record the fact that the task has been terminated
-	 * here so verify_free() does not try to cancel it.
-	 */
-
-	ctx->task = NULL;
+	elist_remove(&verify_unresolved, item);
+	item->resolving = TRUE;
+	ctx->running++;
 
-	if (GNET_PROPERTY(verify_debug) > 1) {
-		g_debug("destroying task for %s verification", verify_hash_name(ctx));
-	}
-}
+	VERIFY_UNLOCK;
 
-static void
-verify_next_file(struct verify *ctx)
-{
-	struct verify_file *item;
-	bool skipped = FALSE;
+	if (0 == stat(item->pathname, &buf))
+		dev = buf.st_dev;
 
-	verify_check(ctx);
-	g_assert(NULL == ctx->file);
+	VERIFY_LOCK;
 
-	item = hash_list_shift(ctx->files_to_hash);
-	if (item != NULL) {
-		verify_file_check(item);
+	item->resolving = FALSE;
 
-		ctx->user_data = item->user_data;
-		ctx->callback = item->callback;
-		ctx->start = item->offset;
-		ctx->end = item->offset + item->amount;
-		ctx->offset = ctx->start;
-
-		if (verify_start(ctx)) {
-			ctx->file = file_object_open(item->pathname, O_RDONLY);
-			if (NULL == ctx->file) {
-				g_warning("failed to open \"%s\" for %s hashing: %m",
-					item->pathname, verify_hash_name(ctx));
-			}
-		} else {
-			if (GNET_PROPERTY(verify_debug)) {
-				g_debug("discarding request of %s digest for %s",
-					verify_hash_name(ctx), item->pathname);
-			}
-			skipped = TRUE;
-		}
+	if (ctx->shutdowned) {
+		hevset_remove(ctx->queued, item);
+		VERIFY_UNLOCK;
+		verify_discard(item);
+		VERIFY_LOCK;
+		ctx->running--;
+		return NULL;
+	}
 
-		verify_file_free(&item);
+	ctx->running--;
+	vd = item->device = verify_device_get(dev);
+	verify_file_queue(&vd->files, item);
 
-		if (NULL == ctx->file)
-			goto done;
-	}
+	return vd;
+}
 
-	if (ctx->file) {
-		if (GNET_PROPERTY(verify_debug)) {
-			g_debug("verifying %s digest for %s",
-				verify_hash_name(ctx), file_object_pathname(ctx->file));
+/**
+ * Pick the next file to hash.
+ *
+ * Urgent files come first, wherever they are queued.  Then we keep reading
+ * from the device we last read from, if it has more queued files.  Otherwise
+ * we resolve more files, and we steal work from the other devices when all
+ * the files are resolved.  The device of the returned file is held.
+ *
+ * @return the next file to process, NULL if none can be processed now.
+ */
+static struct verify_file *
+verify_pick(struct verify_worker *vw)
+{
+	assert_mutex_is_owned(&verify_mtx);
+
+	for (;;) {
+		struct verify_file *item = elist_head(&verify_unresolved);
+		struct verify_device *vd = verify_device_urgent();
+
+		if (vd != NULL)
+			return verify_take(vw, vd);
+
+		if (
+			(NULL == item || !item->high_priority) &&
+			vw->home != NULL && verify_device_ready(vw->home)
+		)
+			return verify_take(vw, vw->home);
+
+		if (item != NULL) {
+			vd = verify_resolve(item);
+			if (vd != NULL && verify_device_ready(vd))
+				return verify_take(vw, vd);
+			continue;
 		}
-		verify_hash_init(ctx);
-		file_object_fadvise_sequential(ctx->file);
-		ctx->last_progress = ctx->started = tm_time_exact();
-	}
-	return;
-
-done:
-	if (skipped)
-		verify_shutdown(ctx);
-	else
-		verify_failure(ctx);
 
-	file_object_close(&ctx->file);
+		vd = verify_device_steal();
+		return NULL == vd ? NULL : verify_take(vw, vd);
+	}
 }
 
 static void
-verify_final(struct verify *ctx)
+verify_final(struct verify_job *job)
 {
-	verify_check(ctx);
-
-	if (ctx->offset != ctx->end) {
-		g_warning("file shrunk? \"%s\"", file_object_pathname(ctx->file));
-		verify_failure(ctx);
-	} else if (verify_hash_final(ctx)) {
-		g_warning("verify_hash_final() failed for \"%s\"",
-			file_object_pathname(ctx->file));
-		verify_failure(ctx);
+	verify_job_check(job);
+
+	if (job->offset != job->end) {
+		g_warning("file shrunk? \"%s\"", file_object_pathname(job->file));
+		verify_failure(job);
+	} else if (job->ctx->hash.final(job->state)) {
+		g_warning("%s finalization failed for \"%s\"",
+			verify_hash_name(job->ctx), file_object_pathname(job->file));
+		verify_failure(job);
 	} else {
-		verify_done(ctx);
+		verify_done(job);
 	}
-	file_object_close(&ctx->file);
 }
 
-static void
-verify_update(struct verify *ctx)
+/**
+ * Read and hash the next slice of the file.
+ *
+ * @return TRUE when the job is over.
+ */
+static bool
+verify_job_step(struct verify_worker *vw, struct verify_job *job)
 {
+	struct verify *ctx = job->ctx;
+	tm_nano_t start, end;
+	time_t now;
 	ssize_t r;
 
-	verify_check(ctx);
+	verify_job_check(job);
+
+	if G_UNLIKELY(ctx->shutdowned) {
+		verify_shutdown(job);
+		return TRUE;
+	}
+
+	tm_precise_time(&start);
 
-	if (ctx->offset < ctx->end) {
+	if (job->offset < job->end) {
 		filesize_t amount;
 		size_t n;
 
-		amount = ctx->end - ctx->offset;
-		n = MIN(amount, ctx->buffer_size);
-		r = file_object_pread(ctx->file, ctx->buffer, n, ctx->offset);
+		amount = job->end - job->offset;
+		n = MIN(amount, HASH_BUF_SIZE);
+		r = file_object_pread(job->file, vw->buffer, n, job->offset);
 	} else {
 		r = 0;
 	}
 
 	if ((ssize_t) -1 == r) {
-		if (!is_temporary_error(errno)) {
-			g_warning("error while reading \"%s\": %m",
-				file_object_pathname(ctx->file));
-			goto error;
-		}
+		if (is_temporary_error(errno))
+			return FALSE;
+		g_warning("error while reading \"%s\": %m",
+			file_object_pathname(job->file));
+		goto error;
 	} else if (0 == r) {
-		verify_final(ctx);
-	} else {
-		time_t now;
+		verify_final(job);
+		return TRUE;
+	}
 
-		ctx->offset += (size_t) r;
+	job->offset += (size_t) r;
 
-		if (verify_hash_update(ctx, ctx->buffer, r)) {
-			g_warning("%s computation error for \"%s\"",
-				verify_hash_name(ctx), file_object_pathname(ctx->file));
-			goto error;
-		}
+	if (ctx->hash.update(job->state, vw->buffer, r)) {
+		g_warning("%s computation error for \"%s\"",
+			verify_hash_name(ctx), file_object_pathname(job->file));
+		goto error;
+	}
 
-		/*
-		 * Don't inform about progress too frequently: if we're running in
-		 * a dedicated thread, the notification will issue a cross-thread RPC
-		 * which is slowing down the computation since we need to wait for
-		 * the reply before resuming.
-		 */
+	tm_precise_time(&end);
+	verify_device_account(job->device, r, tm_precise_elapsed_f(&end, &start));
 
-		now = tm_time();
+	/*
+	 * Don't inform about progress too frequently: the notification issues
+	 * a cross-thread RPC which is slowing down the computation since we
+	 * need to wait for the reply before resuming.
+	 */
 
-		if (delta_time(now, ctx->last_progress) >= VERIFY_PROGRESS_NOTIFY) {
-			ctx->last_progress = now;
-			if (!verify_progress(ctx)) {
-				g_warning("%s computation progress stopped for \"%s\"",
-					verify_hash_name(ctx), file_object_pathname(ctx->file));
-				goto error;
-			}
+	now = tm_time();
+
+	if (delta_time(now, job->last_progress) >= VERIFY_PROGRESS_NOTIFY) {
+		job->last_progress = now;
+		if (!verify_progress(job)) {
+			g_warning("%s computation progress stopped for \"%s\"",
+				verify_hash_name(ctx), file_object_pathname(job->file));
+			goto error;
 		}
 	}
-	return;
+
+	return FALSE;
 
 error:
-	verify_failure(ctx);
-	file_object_close(&ctx->file);
+	verify_failure(job);
+	return TRUE;
 }
 
 /**
- * Drop all the queued items for the verification thread.
- *
- * This is dispatched to the main thread.
+ * Hash the file picked by the thread, then release its device.
  */
 static void
-verify_queue_flush(void *data)
+verify_job_run(struct verify_worker *vw, struct verify_file *item)
 {
-	struct verify *ctx = data;
-	struct verify_file *item;
+	struct verify *ctx = item->ctx;
+	struct verify_job job;
 
 	verify_check(ctx);
-	g_assert(thread_is_main());
 
-	while (NULL != (item = hash_list_shift(ctx->files_to_hash))) {
-		/* Setup minimal context to call verify_shutdown() */
-		ctx->user_data = item->user_data;
-		ctx->callback = item->callback;
+	verify_job_init(&job, item);
+	job.device = item->device;
 
-		verify_shutdown(ctx);
-		verify_file_free(&item);
+	if (!verify_start(&job)) {
+		if (GNET_PROPERTY(verify_debug)) {
+			g_debug("discarding request of %s digest for %s",
+				verify_hash_name(ctx), item->pathname);
+		}
+		verify_shutdown(&job);
+	} else if (NULL == (job.file = file_object_open(item->pathname, O_RDONLY))) {
+		g_warning("failed to open \"%s\" for %s hashing: %m",
+			item->pathname, verify_hash_name(ctx));
+		verify_failure(&job);
+	} else {
+		if (GNET_PROPERTY(verify_debug)) {
+			g_debug("verifying %s digest for %s in %s",
+				verify_hash_name(ctx), item->pathname, thread_name());
+		}
+		job.state = ctx->hash.init(job.end - job.start);
+		file_object_fadvise_sequential(job.file);
+		job.last_progress = job.started = tm_time_exact();
+
+		while (!verify_job_step(vw, &job))
+			thread_check_suspended();
+
+		ctx->hash.free(job.state);
+		file_object_close(&job.file);
 	}
+
+	VERIFY_LOCK;
+	g_assert(job.device->stats.readers != 0);
+	job.device->stats.readers--;
+	ctx->running--;
+	verify_kick();				/* Others may now read from the device */
+	VERIFY_UNLOCK;
+
+	verify_file_free(&item);
 }
 
 /**
- * Signal handler for task termination.
- *
- * This handler is invoked from the background task scheduler and is therefore
- * run in the thread that is handling verification.
+ * Arguments passed to the verification thread.
  */
-static void
-verify_bg_sighandler(struct bgtask *bt, void *data, bgsig_t sig)
+struct verify_thread_arg {
+	const char *name;			/* Thread name */
+	barrier_t *b;				/* Setup barrier */
+	int id;						/* Index of thread in the pool */
+};
+
+/**
+ * Verfication thread main loop.
+ */
+static void *
+verify_thread_main(void *p)
 {
-	struct verify *ctx = data;
+	struct verify_thread_arg *args = p;
+	struct verify_worker *vw;
 
-	verify_check(ctx);
-	g_assert(BG_SIG_TERM == sig);
+	thread_set_name(args->name);
+	teq_create();				/* Queue to receive wakeup events */
 
-	if (GNET_PROPERTY(verify_debug)) {
-		g_debug("cancelling background task \"%s\" in %s",
-			bg_task_name(bt), thread_name());
-	}
+	vw = &verify_workers[args->id];
+	vw->stid = thread_small_id();
+	vw->buffer = halloc(HASH_BUF_SIZE);
+
+	g_assert(vw->stid != 0);	/* Not the main thread */
 
 	/*
-	 * Abort current file hashing.
+	 * Prepare for termination when receiveing a TSIG_TERM.
 	 */
 
-	if (ctx->file != NULL) {
-		verify_shutdown(ctx);
-		file_object_close(&ctx->file);
-	}
-	HFREE_NULL(ctx->buffer);
+	thread_signal(TSIG_TERM, verify_thread_terminate);
+
+	barrier_wait(args->b);		/* Thread has initialized */
+	barrier_free_null(&args->b);
+	WFREE_TYPE_NULL(args);
+
+	if (GNET_PROPERTY(verify_debug))
+		g_debug("verification %s started", thread_name());
 
 	/*
-	 * Flush the queue.
+	 * Process files, until thread is terminated.
 	 *
-	 * To speed things up, we'll redirect this work to the main thread: since
-	 * we're shutdowning, there's no real processing done in the main thread,
-	 * and it will be more efficient if we're currently in the library thread
-	 * since we will avoid all these TEQ RPCs between the two threads.
+	 * When we pick a file, we kick another thread in case there is more
+	 * work pending, so that a burst of enqueued files spreads to all the
+	 * threads of the pool.
 	 */
 
-	teq_post(THREAD_MAIN_ID, verify_queue_flush, ctx);
+	while (!vw->exit) {
+		struct verify_file *item;
+
+		VERIFY_LOCK;
+		item = verify_pick(vw);
+		vw->idle = NULL == item;
+		if (item != NULL)
+			verify_kick();
+		VERIFY_UNLOCK;
+
+		if (item != NULL) {
+			verify_job_run(vw, item);
+			thread_check_suspended();
+			continue;
+		}
+
+		if (GNET_PROPERTY(verify_debug))
+			g_debug("verification %s sleeping", thread_name());
+
+		teq_wait(verify_thread_has_work, vw);
+		vw->kicked = FALSE;
+
+		if (GNET_PROPERTY(verify_debug))
+			g_debug("verification %s awoken", thread_name());
+	}
+
+	g_debug("verification %s exiting", thread_name());
+
+	HFREE_NULL(vw->buffer);
+
+	return NULL;
 }
 
 /**
- * First verification step, intalling signal handler to trap termination.
+ * Create a new verification thread in the pool.
+ *
+ * This routine does not return until the verification thread has been
+ * correctly initialized, so that the caller can immediately wake it up.
+ *
+ * @param id		the index of the thread in the pool
  */
-static bgret_t
-verify_step_setup(struct bgtask *bt, void *unused_data, int unused_ticks)
+static void
+verify_thread_create(int id)
 {
-	(void) unused_data;
-	(void) unused_ticks;
+	struct verify_worker *vw = &verify_workers[id];
+	struct verify_thread_arg *args;
+	const char *name;
+	barrier_t *b;
+
+	assert_mutex_is_owned(&verify_mtx);
+
+	name = constant_str(str_smsg("verify #%d", id));
+	b = barrier_new(2);
 
-	bg_task_signal(bt, BG_SIG_TERM, verify_bg_sighandler);
-	bg_task_ticks_used(bt, 0);
-	return BGR_NEXT;
+	WALLOC(args);
+	args->name = name;
+	args->b = barrier_refcnt_inc(b);
+	args->id = id;
+
+	ZERO(vw);
+
+	/*
+	 * The verification thread is created as a detached thread because we
+	 * do not expect any result from it.
+	 *
+	 * It is created as non-cancelable: to end it, we send it a TSIG_TERM.
+	 */
+
+	(void) thread_create(verify_thread_main, args,
+			THREAD_F_DETACH | THREAD_F_NO_CANCEL |
+				THREAD_F_NO_POOL | THREAD_F_PANIC,
+			THREAD_STACK_MIN);
+
+	barrier_wait(b);		/* Wait for thread to initialize */
+	barrier_free_null(&b);
 }
 
 /**
- * Incremental verification step, invoked through the background task scheduler.
+ * Terminate all the threads from the pool.
  */
-static bgret_t
-verify_step_compute(struct bgtask *bt, void *data, int ticks)
+static void
+verify_pool_shutdown(void)
 {
-	struct verify *ctx = data;
-	int i = ticks;
-	int used = 0;		/* Amount used for CPU-intensive tasks */
-	int light = 0;		/* Amount used for system-intensive tasks */
+	int i;
 
-	verify_check(ctx);
-	(void) bt;
+	VERIFY_LOCK;
 
-	while (i-- > 0) {
-		bg_task_cancel_test(bt);
-		if (NULL == ctx->file) {
-			verify_next_file(ctx);
-		}
-		if (ctx->file) {
-			verify_update(ctx);
-			used++;
-		} else {
-			light++;	/* Did not open file, still processed something */
-		}
-		if (NULL == ctx->file && 0 == hash_list_length(ctx->files_to_hash))
-			break;
+	for (i = 0; i < verify_workers_count; i++) {
+		thread_kill(verify_workers[i].stid, TSIG_TERM);
 	}
 
-	/*
-	 * If we don't use all our ticks, we need to tell the scheduler
-	 * otherwise the average tick cost will be wrong and when we start
-	 * using all our ticks, the whole process could "freeze" during several
-	 * seconds, if not minutes!
-	 */
+	verify_workers_count = 0;
 
-	used += light / 10;			/* Arbitrary decimation factor */
+	VERIFY_UNLOCK;
+}
 
-	if (used < ticks)
-		bg_task_ticks_used(bt, used);
+/**
+ * Create a new verification context.
+ *
+ * @param hash		Hash-specific callbacks for this hash verification
+ *
+ * @return verification context to which work can be requested via
+ * verify_enqueue()
+ */
+struct verify *
+verify_new(const struct verify_hash *hash)
+{
+	struct verify *ctx;
 
-	if (ctx->file || hash_list_length(ctx->files_to_hash) > 0) {
-		return BGR_MORE;
-	} else {
-		return BGR_DONE;
+	g_assert(hash);
+	g_assert(thread_is_main());		/* Always called from main thread */
+
+	WALLOC0(ctx);
+	ctx->magic = VERIFY_MAGIC;
+	STATIC_ASSERT(sizeof ctx->hash == sizeof(struct verify_hash));
+	*(struct verify_hash *) &ctx->hash = *hash;		/* Assignment to "const" */
+	ctx->queued = hevset_create_any(0,
+		verify_item_hash, NULL, verify_item_equal);
+
+	VERIFY_LOCK;
+
+	if (!elist_is_initialized(&verify_unresolved)) {
+		elist_init(&verify_unresolved, offsetof(struct verify_file, lk));
+		elist_init(&verify_device_other.files,
+			offsetof(struct verify_file, lk));
 	}
+
+	VERIFY_UNLOCK;
+
+	atomic_int_inc(&verify_contexts);
+
+	return ctx;
 }
 
 /**
- * Termination callback for verification task.
- *
- * This handler is invoked from the background task scheduler and is therefore
- * run in the thread that is handling verification.
+ * Callout queue callback to check whether we can free the verify context.
  */
 static void
-verify_bg_done(struct bgtask *bt, void *data, bgstatus_t status, void *uarg)
+verify_deferred_free(cqueue_t *cq, void *data)
 {
 	struct verify *ctx = data;
+	bool busy;
 
 	verify_check(ctx);
 
-	(void) uarg;
-
 	/*
-	 * Sole purpose here is to trace task termination and print execution
-	 * statistics, for debugging.
+	 * We do not free the verification context until all the files it
+	 * queued are either discarded or processed by the pool threads.
 	 */
 
-	if (GNET_PROPERTY(verify_debug)) {
-		g_debug("terminating background task \"%s\" in %s, status=%s, "
-			"ran %'lu ms (%s)",
-			bg_task_name(bt), thread_name(), bgstatus_to_string(status),
-			bg_task_wtime(bt), short_time_ascii(bg_task_wtime(bt) / 1000));
+	VERIFY_LOCK;
+	busy = 0 != ctx->running || 0 != hevset_count(ctx->queued);
+	VERIFY_UNLOCK;
+
+	if (busy) {
+		if (GNET_PROPERTY(verify_debug) > 1) {
+			g_debug("%s verification still has %u running file%s",
+				verify_hash_name(ctx), PLURAL(ctx->running));
+		}
+
+		cq_insert(cq, VERIFY_DEFERRED, verify_deferred_free, ctx);
+	} else {
+		if (GNET_PROPERTY(verify_debug) > 1) {
+			g_debug("freeing %s verification context", verify_hash_name(ctx));
+		}
+
+		hevset_free_null(&ctx->queued);
+		ctx->magic = 0;
+		WFREE(ctx);
+
+		if (1 == atomic_int_dec(&verify_contexts))
+			verify_pool_shutdown();
 	}
 }
 
 /**
- * Create background task to perform the verification if not already there.
+ * Context of verify_flush_item().
  */
-static void
-verify_create_task(struct verify *ctx)
+struct verify_flush {
+	const struct verify *ctx;	/* Context being shutdown */
+	pslist_t *items;			/* Collected files */
+};
+
+/**
+ * elist_foreach_remove() callback collecting the queued files of a context.
+ */
+static bool
+verify_flush_item(void *data, void *udata)
 {
-	verify_check(ctx);
+	struct verify_file *item = data;
+	struct verify_flush *vf = udata;
 
-	if (NULL == ctx->task) {
-		static const bgstep_cb_t step[] = {
-			verify_step_setup,
-			verify_step_compute
-		};
+	verify_file_check(item);
 
-		if (GNET_PROPERTY(verify_debug) > 1) {
-			g_debug("creating new task for %s verification",
-				verify_hash_name(ctx));
-		}
+	if (item->ctx != vf->ctx)
+		return FALSE;
 
-		ctx->task = bg_task_create(ctx->sched, verify_hash_name(ctx),
-							step, N_ITEMS(step),
-			  				ctx, verify_context_free,
-							verify_bg_done, NULL);
-	}
+	hevset_remove(item->ctx->queued, item);
+	vf->items = pslist_prepend(vf->items, item);
+	return TRUE;
 }
 
 /**
- * Notified that work was enqueued and should be processed by the
- * verification thread attached to the context.
+ * Free verification context and nullify its pointer.
  *
- * This is called in the thread that is running the verification task.
+ * The files it queued are discarded, and the actual physical disposal of the
+ * verification context is deferred until the files being hashed are done.
  */
-static void
-verify_enqueued(void *arg)
+void
+verify_free(struct verify **ptr)
 {
-	verify_create_task(arg);
+	struct verify *ctx = *ptr;
+
+	if (ctx != NULL) {
+		struct verify_flush vf;
+		pslist_t *sl;
+		size_t i;
+
+		verify_check(ctx);
+		g_assert(!ctx->shutdowned);
+		g_assert(thread_is_main());
+
+		vf.ctx = ctx;
+		vf.items = NULL;
+		*ptr = NULL;
+
+		VERIFY_LOCK;
+
+		ctx->shutdowned = TRUE;
+
+		elist_foreach_remove(&verify_unresolved, verify_flush_item, &vf);
+		for (i = 0; i <= verify_devices_count; i++) {
+			elist_foreach_remove(&verify_device_at(i)->files,
+				verify_flush_item, &vf);
+		}
+
+		VERIFY_UNLOCK;
+
+		vf.items = pslist_reverse(vf.items);
+
+		PSLIST_FOREACH(vf.items, sl) {
+			verify_discard(sl->data);
+		}
+
+		pslist_free_null(&vf.items);
+
+		/*
+		 * Files being resolved or hashed by the pool threads notice that the
+		 * context is shutdown and discard their work: defer freeing until
+		 * they are done.  The pool threads are terminated when the last
+		 * context is freed.
+		 */
+
+		cq_main_insert(VERIFY_DEFERRED, verify_deferred_free, ctx);
+	}
 }
 
 /**
@@ -1074,8 +1397,8 @@ verify_enqueue(struct verify *ctx, int high_priority,
 	const char *pathname, filesize_t offset, filesize_t amount,
 	verify_callback callback, void *user_data)
 {
-	struct verify_file *item;
-	int inserted;
+	struct verify_file *item, *queued;
+	bool inserted;
 
 	verify_check(ctx);
 	g_return_val_if_fail(pathname, FALSE);
@@ -1087,24 +1410,32 @@ verify_enqueue(struct verify *ctx, int high_priority,
 		pathname, strsize(pathname),
 		VARLEN(amount), NULL);
 
-	item = verify_file_new(pathname, offset, amount, callback, user_data);
+	item = verify_file_new(ctx, pathname, offset, amount, callback, user_data);
+	item->high_priority = 0 != high_priority;
 
-	hash_list_lock(ctx->files_to_hash);
+	VERIFY_LOCK;
 
-	if (hash_list_contains(ctx->files_to_hash, item)) {
+	queued = hevset_lookup(ctx->queued, item);
+
+	if (queued != NULL) {
 		if (high_priority)
-			hash_list_moveto_head(ctx->files_to_hash, item);
+			verify_file_urge(queued);
 		inserted = FALSE;
 	} else {
-		if (high_priority) {
-			hash_list_prepend(ctx->files_to_hash, item);
-		} else {
-			hash_list_append(ctx->files_to_hash, item);
-		}
+		hevset_insert(ctx->queued, item);
+		verify_file_queue(&verify_unresolved, item);
 		inserted = TRUE;
 	}
 
-	hash_list_unlock(ctx->files_to_hash);
+	/*
+	 * Make sure an idle thread gets to process the new work, creating a
+	 * new thread when they are all busy and the pool can grow.
+	 */
+
+	if (inserted || high_priority)
+		verify_kick();
+
+	VERIFY_UNLOCK;
 
 	if (GNET_PROPERTY(verify_debug)) {
 		g_debug("%s %s digest verification for %s",
@@ -1112,18 +1443,7 @@ verify_enqueue(struct verify *ctx, int high_priority,
 			verify_hash_name(ctx), pathname);
 	}
 
-	/*
-	 * When work was inserted into the queue (represented by the hash list
-	 * here), we signal the thread handling the verification so that it can
-	 * be awoken if it was sleeping: the TSIG_TEQ signal will let the thread
-	 * out of the teq_wait() call in its main processing loop, and the
-	 * verify_enqueued() event callback will make sure we have a background
-	 * task to actually process the work.
-	 */
-
-	if (inserted)
-		teq_post(ctx->verify_stid, verify_enqueued, ctx);
-	else
+	if (!inserted)
 		verify_file_free(&item);
 
 	return inserted;
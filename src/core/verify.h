@@ -50,15 +50,36 @@ enum verify_status {
 };
 
 struct verify;
+struct verify_job;
 
-typedef bool (*verify_callback)(const struct verify *,
+typedef bool (*verify_callback)(const struct verify_job *,
 										enum verify_status, void *user_data);
 
+/**
+ * Hash-specific callbacks.
+ *
+ * Each file being hashed gets its own hash state, returned by init() and
+ * released by free(), so that several files can be hashed concurrently.
+ */
 struct verify_hash {
 	const char *	(*name)(void);
-	void 			(*init)(filesize_t amount);
-	int  			(*update)(const void *data, size_t size);
-	int 			(*final)(void);
+	void *			(*init)(filesize_t amount);
+	int  			(*update)(void *state, const void *data, size_t size);
+	int 			(*final)(void *state);
+	void			(*free)(void *state);
+};
+
+/**
+ * Per-device verification statistics.
+ */
+struct verify_device_stats {
+	uint64 dev;			/**< Device number */
+	uint readers;		/**< Files being currently read */
+	uint queued;		/**< Files waiting to be read */
+	uint64 files;		/**< Files successfully hashed */
+	uint64 errors;		/**< Files that could not be hashed */
+	uint64 bytes;		/**< Bytes read and hashed */
+	uint64 busy_us;		/**< Time spent reading and hashing, in usecs */
 };
 
 struct verify *verify_new(const struct verify_hash *);
@@ -68,9 +89,12 @@ bool verify_enqueue(struct verify *, int high_priority,
 	const char *pathname, filesize_t offset, filesize_t filesize,
 	verify_callback callback, void *user_data);
 
-enum verify_status verify_status(const struct verify *);
-filesize_t verify_hashed(const struct verify *);
-uint verify_elapsed(const struct verify *);
+enum verify_status verify_status(const struct verify_job *);
+filesize_t verify_hashed(const struct verify_job *);
+uint verify_elapsed(const struct verify_job *);
+void *verify_job_state(const struct verify_job *);
+
+size_t verify_device_stats(struct verify_device_stats *vec, size_t n);
 
 #endif	/* _core_verify_h_ */
 
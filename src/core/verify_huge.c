@@ -0,0 +1,227 @@
+/*
+ * Copyright (c) 2026, gtk-gnutella developers
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup core
+ * @file
+ *
+ * Fused SHA-1 and TTH verification of shared library files.
+ *
+ * When a file enters the library without any cached hash, we need both its
+ * SHA-1 and its TTH.  Running the two through separate verification contexts
+ * means the whole file is read from disk twice, which is painful when the
+ * library holds large files.
+ *
+ * This verification context reads each block once and feeds it to both the
+ * SHA-1 and the Tigertree hashing contexts, so that both digests (and the
+ * TTH leaves) are available when the VERIFY_DONE callback fires.
+ *
+ * @author gtk-gnutella developers
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "verify_huge.h"
+
+#include "lib/halloc.h"
+#include "lib/once.h"
+#include "lib/sha1.h"
+#include "lib/tigertree.h"
+#include "lib/walloc.h"
+
+#include "lib/override.h"		/* Must be the last header included */
+
+static struct {
+	struct verify	*verify;
+} verify_huge;
+
+/**
+ * Hash state of a file.
+ */
+struct verify_huge_state {
+	SHA1_context	sha1_ctx;
+	TTH_CONTEXT		*tth_ctx;
+	struct sha1		sha1;
+	struct tth		tth;
+};
+
+static const char *
+verify_huge_name(void)
+{
+	return "SHA-1+TTH";
+}
+
+static void *
+verify_huge_reset(filesize_t size)
+{
+	struct verify_huge_state *vs;
+	int ret;
+
+	WALLOC(vs);
+	ret = SHA1_reset(&vs->sha1_ctx);
+	g_assert(SHA_SUCCESS == ret);
+
+	vs->tth_ctx = halloc(tt_size());
+	tt_init(vs->tth_ctx, size);
+	return vs;
+}
+
+static int
+verify_huge_update(void *state, const void *data, size_t size)
+{
+	struct verify_huge_state *vs = state;
+
+	if (SHA_SUCCESS != SHA1_input(&vs->sha1_ctx, data, size))
+		return -1;
+
+	tt_update(vs->tth_ctx, data, size);
+	return 0;
+}
+
+static int
+verify_huge_final(void *state)
+{
+	struct verify_huge_state *vs = state;
+
+	if (SHA_SUCCESS != SHA1_result(&vs->sha1_ctx, &vs->sha1))
+		return -1;
+
+	tt_digest(vs->tth_ctx, &vs->tth);
+	return 0;
+}
+
+static void
+verify_huge_free(void *state)
+{
+	struct verify_huge_state *vs = state;
+
+	HFREE_NULL(vs->tth_ctx);
+	WFREE(vs);
+}
+
+static const struct verify_hash verify_hash_huge = {
+	verify_huge_name,
+	verify_huge_reset,
+	verify_huge_update,
+	verify_huge_final,
+	verify_huge_free,
+};
+
+/**
+ * Enqueue file for computation of both its SHA-1 and its TTH.
+ *
+ * @return TRUE if the file was enqueued.
+ */
+bool
+verify_huge_enqueue(bool high_priority,
+	const char *pathname, filesize_t filesize,
+	verify_callback callback, void *user_data)
+{
+	verify_huge_init();
+
+	/*
+	 * The context is gone after verify_huge_shutdown(), but we can still be
+	 * called from pending callbacks during shutdown.
+	 */
+
+	if G_UNLIKELY(NULL == verify_huge.verify)
+		return FALSE;
+
+	return verify_enqueue(verify_huge.verify, high_priority,
+		pathname, 0, filesize, callback, user_data);
+}
+
+const struct sha1 *
+verify_huge_sha1(const struct verify_job *job)
+{
+	const struct verify_huge_state *vs;
+
+	g_return_val_if_fail(verify_status(job) == VERIFY_DONE, NULL);
+
+	vs = verify_job_state(job);
+	return &vs->sha1;
+}
+
+const struct tth *
+verify_huge_tth(const struct verify_job *job)
+{
+	const struct verify_huge_state *vs;
+
+	g_return_val_if_fail(verify_status(job) == VERIFY_DONE, NULL);
+
+	vs = verify_job_state(job);
+	return &vs->tth;
+}
+
+const struct tth *
+verify_huge_leaves(const struct verify_job *job)
+{
+	const struct verify_huge_state *vs;
+
+	g_return_val_if_fail(verify_status(job) == VERIFY_DONE, NULL);
+
+	vs = verify_job_state(job);
+	return tt_leaves(vs->tth_ctx);
+}
+
+size_t
+verify_huge_leave_count(const struct verify_job *job)
+{
+	const struct verify_huge_state *vs;
+
+	g_return_val_if_fail(verify_status(job) == VERIFY_DONE, 0);
+
+	vs = verify_job_state(job);
+	return tt_leave_count(vs->tth_ctx);
+}
+
+static void G_COLD
+verify_huge_init_once(void)
+{
+	verify_huge.verify = verify_new(&verify_hash_huge);
+}
+
+void G_COLD
+verify_huge_init(void)
+{
+	static once_flag_t initialized;
+
+	/*
+	 * Must use once_flag_runwait() since verify_new() can create a thread,
+	 * see verify_sha1_init() for details.
+	 */
+
+	once_flag_runwait(&initialized, verify_huge_init_once);
+}
+
+/**
+ * Stops the background task for fused hashing.
+ */
+void G_COLD
+verify_huge_shutdown(void)
+{
+	verify_free(&verify_huge.verify);
+}
+
+/* vi: set ts=4 sw=4 cindent: */
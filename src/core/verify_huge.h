@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2026, gtk-gnutella developers
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup core
+ * @file
+ *
+ * Fused SHA-1 and TTH verification of shared library files.
+ *
+ * @author gtk-gnutella developers
+ * @date 2026
+ */
+
+#ifndef _core_verify_huge_h_
+#define _core_verify_huge_h_
+
+#include "common.h"
+
+#include "verify.h"
+
+struct sha1;
+struct tth;
+
+bool verify_huge_enqueue(bool high_priority,
+	const char *pathname, filesize_t filesize,
+	verify_callback callback, void *user_data);
+
+const struct sha1 *verify_huge_sha1(const struct verify_job *);
+const struct tth *verify_huge_tth(const struct verify_job *);
+const struct tth *verify_huge_leaves(const struct verify_job *);
+size_t verify_huge_leave_count(const struct verify_job *);
+
+void verify_huge_init(void);
+void verify_huge_shutdown(void);
+
+#endif /* _core_verify_huge_h_ */
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -38,6 +38,7 @@
 #include "lib/misc.h"
 #include "lib/once.h"
 #include "lib/sha1.h"
+#include "lib/walloc.h"
 
 #include "core/verify_sha1.h"
 
@@ -45,9 +46,15 @@
 
 static struct {
 	struct verify	*verify;
+} verify_sha1;
+
+/**
+ * Hash state of a file.
+ */
+struct verify_sha1_state {
 	SHA1_context	context;
 	struct sha1		digest;
-} verify_sha1;
+};
 
 static const char *
 verify_sha1_name(void)
@@ -55,39 +62,53 @@ verify_sha1_name(void)
 	return "SHA-1";
 }
 
-static void
+static void *
 verify_sha1_reset(filesize_t amount)
 {
+	struct verify_sha1_state *vs;
 	int ret;
 
 	(void) amount;
-	ret = SHA1_reset(&verify_sha1.context);
+	WALLOC(vs);
+	ret = SHA1_reset(&vs->context);
 	g_assert(SHA_SUCCESS == ret);
+	return vs;
 }
 
 static int
-verify_sha1_update(const void *data, size_t size)
+verify_sha1_update(void *state, const void *data, size_t size)
 {
+	struct verify_sha1_state *vs = state;
 	int ret;
 
-	ret = SHA1_input(&verify_sha1.context, data, size);
+	ret = SHA1_input(&vs->context, data, size);
 	return SHA_SUCCESS == ret ? 0 : -1;
 }
 
 static int
-verify_sha1_final(void)
+verify_sha1_final(void *state)
 {
+	struct verify_sha1_state *vs = state;
 	int ret;
 
-	ret = SHA1_result(&verify_sha1.context, &verify_sha1.digest);
+	ret = SHA1_result(&vs->context, &vs->digest);
 	return SHA_SUCCESS == ret ? 0 : -1;
 }
 
+static void
+verify_sha1_free(void *state)
+{
+	struct verify_sha1_state *vs = state;
+
+	WFREE(vs);
+}
+
 static const struct verify_hash verify_hash_sha1 = {
 	verify_sha1_name,
 	verify_sha1_reset,
 	verify_sha1_update,
 	verify_sha1_final,
+	verify_sha1_free,
 };
 
 int
@@ -100,10 +121,14 @@ verify_sha1_enqueue(int high_priority,
 }
 
 const struct sha1 *
-verify_sha1_digest(const struct verify *ctx)
+verify_sha1_digest(const struct verify_job *job)
 {
-	g_return_val_if_fail(verify_status(ctx) == VERIFY_DONE, NULL);
-	return &verify_sha1.digest;
+	const struct verify_sha1_state *vs;
+
+	g_return_val_if_fail(verify_status(job) == VERIFY_DONE, NULL);
+
+	vs = verify_job_state(job);
+	return &vs->digest;
 }
 
 static void G_COLD
@@ -42,7 +42,7 @@ int verify_sha1_enqueue(int high_priority,
 	const char *pathname, filesize_t filesize,
 	verify_callback callback, void *user_data);
 
-const struct sha1 *verify_sha1_digest(const struct verify *);
+const struct sha1 *verify_sha1_digest(const struct verify_job *);
 
 void verify_sha1_init(void);
 void verify_sha1_close(void);
@@ -48,14 +48,21 @@
 #include "lib/tiger.h"
 #include "lib/tigertree.h"
 #include "lib/tm.h"
+#include "lib/walloc.h"
 
 #include "lib/override.h"		/* Must be the last inclusion */
 
 static struct {
 	struct verify	*verify;
+} verify_tth;
+
+/**
+ * Hash state of a file.
+ */
+struct verify_tth_state {
 	TTH_CONTEXT		*context;
 	struct tth		digest;
-} verify_tth;
+};
 
 static const char *
 verify_tth_name(void)
@@ -63,65 +70,88 @@ verify_tth_name(void)
 	return "TTH";
 }
 
-static void
+static void *
 verify_tth_reset(filesize_t size)
 {
-	if G_LIKELY(verify_tth.context != NULL)
-		tt_init(verify_tth.context, size);
+	struct verify_tth_state *vs;
+
+	WALLOC(vs);
+	vs->context = halloc(tt_size());
+	tt_init(vs->context, size);
+	return vs;
 }
 
 static int
-verify_tth_update(const void *data, size_t size)
+verify_tth_update(void *state, const void *data, size_t size)
 {
-	if G_UNLIKELY(NULL == verify_tth.context)
-		return -1;
+	struct verify_tth_state *vs = state;
 
-	tt_update(verify_tth.context, data, size);
+	tt_update(vs->context, data, size);
 	return 0;
 }
 
 static int
-verify_tth_final(void)
+verify_tth_final(void *state)
 {
-	if G_UNLIKELY(NULL == verify_tth.context)
-		return -1;
+	struct verify_tth_state *vs = state;
 
-	tt_digest(verify_tth.context, &verify_tth.digest);
+	tt_digest(vs->context, &vs->digest);
 	return 0;
 }
 
+static void
+verify_tth_free(void *state)
+{
+	struct verify_tth_state *vs = state;
+
+	HFREE_NULL(vs->context);
+	WFREE(vs);
+}
+
 static const struct verify_hash verify_hash_tth = {
 	verify_tth_name,
 	verify_tth_reset,
 	verify_tth_update,
 	verify_tth_final,
+	verify_tth_free,
 };
 
 const struct tth *
-verify_tth_digest(const struct verify *ctx)
+verify_tth_digest(const struct verify_job *job)
 {
-	g_return_val_if_fail(verify_status(ctx) == VERIFY_DONE, NULL);
-	return &verify_tth.digest;
+	const struct verify_tth_state *vs;
+
+	g_return_val_if_fail(verify_status(job) == VERIFY_DONE, NULL);
+
+	vs = verify_job_state(job);
+	return &vs->digest;
 }
 
 const struct tth *
-verify_tth_leaves(const struct verify *ctx)
+verify_tth_leaves(const struct verify_job *job)
 {
-	g_return_val_if_fail(verify_status(ctx) == VERIFY_DONE, NULL);
-	return tt_leaves(verify_tth.context);
+	const struct verify_tth_state *vs;
+
+	g_return_val_if_fail(verify_status(job) == VERIFY_DONE, NULL);
+
+	vs = verify_job_state(job);
+	return tt_leaves(vs->context);
 }
 
 size_t
-verify_tth_leave_count(const struct verify *ctx)
+verify_tth_leave_count(const struct verify_job *job)
 {
-	g_return_val_if_fail(verify_status(ctx) == VERIFY_DONE, 0);
-	return tt_leave_count(verify_tth.context);
+	const struct verify_tth_state *vs;
+
+	g_return_val_if_fail(verify_status(job) == VERIFY_DONE, 0);
+
+	vs = verify_job_state(job);
+	return tt_leave_count(vs->context);
 }
 
 static void G_COLD
 verify_tth_init_once(void)
 {
-	verify_tth.context = halloc(tt_size());
 	verify_tth.verify = verify_new(&verify_hash_tth);
 }
 
@@ -152,18 +182,9 @@ verify_tth_shutdown(void)
 	verify_free(&verify_tth.verify);
 }
 
-/**
- * Release memory resources used by tigertree verification.
- */
-void G_COLD
-verify_tth_close(void)
-{
-	HFREE_NULL(verify_tth.context);
-}
-
 static bool
-request_tigertree_callback(const struct verify *ctx, enum verify_status status,
-	void *user_data)
+request_tigertree_callback(const struct verify_job *job,
+	enum verify_status status, void *user_data)
 {
 	shared_file_t *sf = user_data;
 
@@ -202,8 +223,8 @@ request_tigertree_callback(const struct verify *ctx, enum verify_status status,
 		return shared_file_is_servable(sf);
 	case VERIFY_DONE:
 		{
-			const struct tth *tth = verify_tth_digest(ctx);
-			size_t n_leaves = verify_tth_leave_count(ctx);
+			const struct tth *tth = verify_tth_digest(job);
+			size_t n_leaves = verify_tth_leave_count(job);
 
 			if (GNET_PROPERTY(verify_debug)) {
 				g_debug("%s(): computed TTH %s (%zu lea%s) for %s",
@@ -226,7 +247,7 @@ request_tigertree_callback(const struct verify *ctx, enum verify_status status,
 			 *		--RAM, 2017-10-20
 			 */
 
-			tth_cache_insert(tth, verify_tth_leaves(ctx), n_leaves);
+			tth_cache_insert(tth, verify_tth_leaves(job), n_leaves);
 			huge_update_hashes(sf, shared_file_sha1(sf), tth);
 		}
 		goto done;
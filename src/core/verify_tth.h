@@ -47,13 +47,12 @@ bool verify_tth_prepend(const char *pathname,
 		filesize_t offset, filesize_t amount,
 		verify_callback callback, void *user_data);
 
-const struct tth *verify_tth_digest(const struct verify *);
-const struct tth *verify_tth_leaves(const struct verify *);
-size_t verify_tth_leave_count(const struct verify *);
+const struct tth *verify_tth_digest(const struct verify_job *);
+const struct tth *verify_tth_leaves(const struct verify_job *);
+size_t verify_tth_leave_count(const struct verify_job *);
 
 void verify_tth_init(void);
 void verify_tth_shutdown(void);
-void verify_tth_close(void);
 
 void request_tigertree(struct shared_file *sf, bool high_priority);
 
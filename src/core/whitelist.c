@@ -40,6 +40,7 @@
 #include "common.h"
 
 #include "whitelist.h"
+#include "ipclass.h"
 #include "settings.h"
 #include "ipp_cache.h"
 #include "nodes.h"
@@ -232,6 +233,7 @@ whitelist_add(struct whitelist *item)
 		log_whitelist_item(item, "adding");
 
 	sl_whitelist = pslist_prepend(sl_whitelist, item);
+	ipclass_changed();
 }
 
 /**
@@ -258,6 +260,7 @@ whitelist_dns_cb(const host_addr_t *addrs, size_t n, void *udata)
 			if (ctx->revalidate) {
 				item->addr = ipv4_unspecified;
 				item->bits = 0;
+				ipclass_changed();
 			} else {
 				whitelist_free(item);
 			}
@@ -272,6 +275,8 @@ whitelist_dns_cb(const host_addr_t *addrs, size_t n, void *udata)
 			}
 			if (!ctx->revalidate) {
 				whitelist_add(item);
+			} else {
+				ipclass_changed();
 			}
 		}
 	}
@@ -566,6 +571,18 @@ whitelist_connect(void)
  */
 bool
 whitelist_check(const host_addr_t ha)
+{
+	return 0 != (ipclass_lookup(ha) & IPCLASS_WHITELIST);
+}
+
+/**
+ * Iterate over the whitelisted address ranges, for ipclass.
+ *
+ * @param cb		callback invoked on each network and its amount of bits
+ * @param data		additional callback argument
+ */
+void
+whitelist_foreach_range(whitelist_range_cb_t cb, void *data)
 {
 	const pslist_t *sl;
 
@@ -575,11 +592,8 @@ whitelist_check(const host_addr_t ha)
 		if (!is_host_addr(item->addr))
 			continue;
 
-		if (host_addr_matches(ha, item->addr, item->bits))
-			return TRUE;
+		(*cb)(item->addr, item->bits, data);
 	}
-
-	return FALSE;
 }
 
 /**
@@ -675,6 +689,7 @@ whitelist_close(void)
 	}
 
     pslist_free_null(&sl_whitelist);
+	ipclass_changed();
 }
 
 /* vi: set ts=4 sw=4 cindent: */
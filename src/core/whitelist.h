@@ -40,7 +40,11 @@
 #include "common.h"
 #include "lib/host_addr.h"
 
+typedef void (*whitelist_range_cb_t)(
+	const host_addr_t addr, uint bits, void *data);
+
 bool whitelist_check(const host_addr_t addr);
+void whitelist_foreach_range(whitelist_range_cb_t cb, void *data);
 void whitelist_init(void);
 void whitelist_close(void);
 uint whitelist_connect(void);
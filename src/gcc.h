@@ -224,6 +224,18 @@
 #define NO_INLINE
 #endif	/* GCC >= 3.1 */
 
+/**
+ * Compile a function for a specific instruction set extension, e.g.
+ * G_TARGET("avx2"), so that it can be selected at runtime after checking
+ * what the CPU supports.  Code using it must be protected by HAS_G_TARGET.
+ */
+#if defined(HASATTRIBUTE) && (HAS_GCC(4, 9) || defined(__clang__))
+#define G_TARGET(x)		__attribute__((target(x)))
+#define HAS_G_TARGET
+#else
+#define G_TARGET(x)
+#endif	/* GCC >= 4.9 */
+
 #if defined(HASATTRIBUTE) && HAS_GCC(2, 7)
 #define G_ALIGNED(n)	 __attribute__((aligned(n)))
 #else
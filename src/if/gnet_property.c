@@ -1164,6 +1164,38 @@ guint64  gnet_property_variable_bc_loopback_in		= 0;
 static const guint64  gnet_property_variable_bc_loopback_in_default = 0;
 guint64  gnet_property_variable_bc_private_in		= 0;
 static const guint64  gnet_property_variable_bc_private_in_default = 0;
+gboolean gnet_property_variable_tx_deflate_adaptive		= FALSE;
+static const gboolean gnet_property_variable_tx_deflate_adaptive_default = FALSE;
+gboolean gnet_property_variable_gnet_deflate_dictionary		= TRUE;
+static const gboolean gnet_property_variable_gnet_deflate_dictionary_default = TRUE;
+guint32  gnet_property_variable_net_io_workers		= 0;
+static const guint32  gnet_property_variable_net_io_workers_default = 0;
+gboolean gnet_property_variable_bw_htb_scheduler		= FALSE;
+static const gboolean gnet_property_variable_bw_htb_scheduler_default = FALSE;
+guint32  gnet_property_variable_bw_htb_weight_gnet		= 4;
+static const guint32  gnet_property_variable_bw_htb_weight_gnet_default = 4;
+guint32  gnet_property_variable_bw_htb_weight_udp		= 2;
+static const guint32  gnet_property_variable_bw_htb_weight_udp_default = 2;
+guint32  gnet_property_variable_bw_htb_weight_dht		= 1;
+static const guint32  gnet_property_variable_bw_htb_weight_dht_default = 1;
+guint32  gnet_property_variable_bw_htb_weight_http		= 3;
+static const guint32  gnet_property_variable_bw_htb_weight_http_default = 3;
+guint32  gnet_property_variable_tth_threads		= 0;
+static const guint32  gnet_property_variable_tth_threads_default = 0;
+guint32  gnet_property_variable_verify_threads		= 0;
+static const guint32  gnet_property_variable_verify_threads_default = 0;
+guint32  gnet_property_variable_verify_device_readers		= 0;
+static const guint32  gnet_property_variable_verify_device_readers_default = 0;
+guint32  gnet_property_variable_scan_threads		= 0;
+static const guint32  gnet_property_variable_scan_threads_default = 0;
+guint32  gnet_property_variable_library_rescan_rate		= 0;
+static const guint32  gnet_property_variable_library_rescan_rate_default = 0;
+gboolean gnet_property_variable_share_incremental		= TRUE;
+static const gboolean gnet_property_variable_share_incremental_default = TRUE;
+guint32  gnet_property_variable_ipclass_debug		= 0;
+static const guint32  gnet_property_variable_ipclass_debug_default = 0;
+guint32  gnet_property_variable_memtag_dump_period		= 0;
+static const guint32  gnet_property_variable_memtag_dump_period_default = 0;
 
 static prop_set_t *gnet_property;
 
@@ -11778,6 +11810,346 @@ gnet_prop_init(void) {
 	gnet_property->props[503].data.guint64.max	= (guint64) -1;
 	gnet_property->props[503].data.guint64.min	= 0x0000000000000000;
 
+
+	/*
+	 * PROP_TX_DEFLATE_ADAPTIVE:
+	 *
+	 * General data:
+	 */
+	gnet_property->props[504].name = "tx_deflate_adaptive";
+	gnet_property->props[504].desc = _("Whether the compression level of deflated Gnutella links should be adapted at runtime: compress harder when the link is bandwidth-bound, spend less CPU otherwise.");
+	gnet_property->props[504].ev_changed = event_new("tx_deflate_adaptive_changed");
+	gnet_property->props[504].save = TRUE;
+	gnet_property->props[504].internal = FALSE;
+	gnet_property->props[504].vector_size = 1;
+	mutex_init(&gnet_property->props[504].lock);
+
+	/* Type specific data: */
+	gnet_property->props[504].type				= PROP_TYPE_BOOLEAN;
+	gnet_property->props[504].data.boolean.def	= (void *) &gnet_property_variable_tx_deflate_adaptive_default;
+	gnet_property->props[504].data.boolean.value = (void *) &gnet_property_variable_tx_deflate_adaptive;
+
+
+	/*
+	 * PROP_GNET_DEFLATE_DICTIONARY:
+	 *
+	 * General data:
+	 */
+	gnet_property->props[505].name = "gnet_deflate_dictionary";
+	gnet_property->props[505].desc = _("Whether to prime compressed Gnutella links with a preset dictionary, when the remote node advertises the same one.");
+	gnet_property->props[505].ev_changed = event_new("gnet_deflate_dictionary_changed");
+	gnet_property->props[505].save = TRUE;
+	gnet_property->props[505].internal = FALSE;
+	gnet_property->props[505].vector_size = 1;
+	mutex_init(&gnet_property->props[505].lock);
+
+	/* Type specific data: */
+	gnet_property->props[505].type				= PROP_TYPE_BOOLEAN;
+	gnet_property->props[505].data.boolean.def	= (void *) &gnet_property_variable_gnet_deflate_dictionary_default;
+	gnet_property->props[505].data.boolean.value = (void *) &gnet_property_variable_gnet_deflate_dictionary;
+
+
+	/*
+	 * PROP_NET_IO_WORKERS:
+	 *
+	 * General data:
+	 */
+	gnet_property->props[506].name = "net_io_workers";
+	gnet_property->props[506].desc = _("Amount of I/O worker threads reading Gnutella connections, 0 meaning all network input is handled by the main thread.");
+	gnet_property->props[506].ev_changed = event_new("net_io_workers_changed");
+	gnet_property->props[506].save = TRUE;
+	gnet_property->props[506].internal = FALSE;
+	gnet_property->props[506].vector_size = 1;
+	mutex_init(&gnet_property->props[506].lock);
+
+	/* Type specific data: */
+	gnet_property->props[506].type				= PROP_TYPE_GUINT32;
+	gnet_property->props[506].data.guint32.def	= (void *) &gnet_property_variable_net_io_workers_default;
+	gnet_property->props[506].data.guint32.value = (void *) &gnet_property_variable_net_io_workers;
+	gnet_property->props[506].data.guint32.choices = NULL;
+	gnet_property->props[506].data.guint32.max	= 32;
+	gnet_property->props[506].data.guint32.min	= 0;
+
+
+	/*
+	 * PROP_BW_HTB_SCHEDULER:
+	 *
+	 * General data:
+	 */
+	gnet_property->props[507].name = "bw_htb_scheduler";
+	gnet_property->props[507].desc = _("Whether to schedule bandwidth with hierarchical token buckets and deficit round-robin among I/O sources, instead of dividing a fixed per-second budget between sources. Token buckets refill continuously, which avoids bursts at the start of each second and lets slow sources get their share without waiting.");
+	gnet_property->props[507].ev_changed = event_new("bw_htb_scheduler_changed");
+	gnet_property->props[507].save = TRUE;
+	gnet_property->props[507].internal = FALSE;
+	gnet_property->props[507].vector_size = 1;
+	mutex_init(&gnet_property->props[507].lock);
+
+	/* Type specific data: */
+	gnet_property->props[507].type				= PROP_TYPE_BOOLEAN;
+	gnet_property->props[507].data.boolean.def	= (void *) &gnet_property_variable_bw_htb_scheduler_default;
+	gnet_property->props[507].data.boolean.value = (void *) &gnet_property_variable_bw_htb_scheduler;
+
+
+	/*
+	 * PROP_BW_HTB_WEIGHT_GNET:
+	 *
+	 * General data:
+	 */
+	gnet_property->props[508].name = "bw_htb_weight_gnet";
+	gnet_property->props[508].desc = _("Weight of the Gnutella TCP traffic when sharing unused bandwidth with the token bucket scheduler.");
+	gnet_property->props[508].ev_changed = event_new("bw_htb_weight_gnet_changed");
+	gnet_property->props[508].save = TRUE;
+	gnet_property->props[508].internal = FALSE;
+	gnet_property->props[508].vector_size = 1;
+	mutex_init(&gnet_property->props[508].lock);
+
+	/* Type specific data: */
+	gnet_property->props[508].type				= PROP_TYPE_GUINT32;
+	gnet_property->props[508].data.guint32.def	= (void *) &gnet_property_variable_bw_htb_weight_gnet_default;
+	gnet_property->props[508].data.guint32.value = (void *) &gnet_property_variable_bw_htb_weight_gnet;
+	gnet_property->props[508].data.guint32.choices = NULL;
+	gnet_property->props[508].data.guint32.max	= 100;
+	gnet_property->props[508].data.guint32.min	= 1;
+
+
+	/*
+	 * PROP_BW_HTB_WEIGHT_UDP:
+	 *
+	 * General data:
+	 */
+	gnet_property->props[509].name = "bw_htb_weight_udp";
+	gnet_property->props[509].desc = _("Weight of the Gnutella UDP traffic when sharing unused bandwidth with the token bucket scheduler.");
+	gnet_property->props[509].ev_changed = event_new("bw_htb_weight_udp_changed");
+	gnet_property->props[509].save = TRUE;
+	gnet_property->props[509].internal = FALSE;
+	gnet_property->props[509].vector_size = 1;
+	mutex_init(&gnet_property->props[509].lock);
+
+	/* Type specific data: */
+	gnet_property->props[509].type				= PROP_TYPE_GUINT32;
+	gnet_property->props[509].data.guint32.def	= (void *) &gnet_property_variable_bw_htb_weight_udp_default;
+	gnet_property->props[509].data.guint32.value = (void *) &gnet_property_variable_bw_htb_weight_udp;
+	gnet_property->props[509].data.guint32.choices = NULL;
+	gnet_property->props[509].data.guint32.max	= 100;
+	gnet_property->props[509].data.guint32.min	= 1;
+
+
+	/*
+	 * PROP_BW_HTB_WEIGHT_DHT:
+	 *
+	 * General data:
+	 */
+	gnet_property->props[510].name = "bw_htb_weight_dht";
+	gnet_property->props[510].desc = _("Weight of the DHT traffic when sharing unused bandwidth with the token bucket scheduler.");
+	gnet_property->props[510].ev_changed = event_new("bw_htb_weight_dht_changed");
+	gnet_property->props[510].save = TRUE;
+	gnet_property->props[510].internal = FALSE;
+	gnet_property->props[510].vector_size = 1;
+	mutex_init(&gnet_property->props[510].lock);
+
+	/* Type specific data: */
+	gnet_property->props[510].type				= PROP_TYPE_GUINT32;
+	gnet_property->props[510].data.guint32.def	= (void *) &gnet_property_variable_bw_htb_weight_dht_default;
+	gnet_property->props[510].data.guint32.value = (void *) &gnet_property_variable_bw_htb_weight_dht;
+	gnet_property->props[510].data.guint32.choices = NULL;
+	gnet_property->props[510].data.guint32.max	= 100;
+	gnet_property->props[510].data.guint32.min	= 1;
+
+
+	/*
+	 * PROP_BW_HTB_WEIGHT_HTTP:
+	 *
+	 * General data:
+	 */
+	gnet_property->props[511].name = "bw_htb_weight_http";
+	gnet_property->props[511].desc = _("Weight of the HTTP traffic (uploads and downloads) when sharing unused bandwidth with the token bucket scheduler.");
+	gnet_property->props[511].ev_changed = event_new("bw_htb_weight_http_changed");
+	gnet_property->props[511].save = TRUE;
+	gnet_property->props[511].internal = FALSE;
+	gnet_property->props[511].vector_size = 1;
+	mutex_init(&gnet_property->props[511].lock);
+
+	/* Type specific data: */
+	gnet_property->props[511].type				= PROP_TYPE_GUINT32;
+	gnet_property->props[511].data.guint32.def	= (void *) &gnet_property_variable_bw_htb_weight_http_default;
+	gnet_property->props[511].data.guint32.value = (void *) &gnet_property_variable_bw_htb_weight_http;
+	gnet_property->props[511].data.guint32.choices = NULL;
+	gnet_property->props[511].data.guint32.max	= 100;
+	gnet_property->props[511].data.guint32.min	= 1;
+
+
+	/*
+	 * PROP_TTH_THREADS:
+	 *
+	 * General data:
+	 */
+	gnet_property->props[512].name = "tth_threads";
+	gnet_property->props[512].desc = _("Amount of threads used to compute the Tigertree leaf hashes of large files. Use 0 to have one thread per CPU, 1 to disable parallel hashing.");
+	gnet_property->props[512].ev_changed = event_new("tth_threads_changed");
+	gnet_property->props[512].save = TRUE;
+	gnet_property->props[512].internal = FALSE;
+	gnet_property->props[512].vector_size = 1;
+	mutex_init(&gnet_property->props[512].lock);
+
+	/* Type specific data: */
+	gnet_property->props[512].type				= PROP_TYPE_GUINT32;
+	gnet_property->props[512].data.guint32.def	= (void *) &gnet_property_variable_tth_threads_default;
+	gnet_property->props[512].data.guint32.value = (void *) &gnet_property_variable_tth_threads;
+	gnet_property->props[512].data.guint32.choices = NULL;
+	gnet_property->props[512].data.guint32.max	= 16;
+	gnet_property->props[512].data.guint32.min	= 0;
+
+
+	/*
+	 * PROP_VERIFY_THREADS:
+	 *
+	 * General data:
+	 */
+	gnet_property->props[513].name = "verify_threads";
+	gnet_property->props[513].desc = _("Amount of threads hashing files in the background, shared by all the verification queues.  Use 0 to size the pool according to the amount of CPUs.");
+	gnet_property->props[513].ev_changed = event_new("verify_threads_changed");
+	gnet_property->props[513].save = TRUE;
+	gnet_property->props[513].internal = FALSE;
+	gnet_property->props[513].vector_size = 1;
+	mutex_init(&gnet_property->props[513].lock);
+
+	/* Type specific data: */
+	gnet_property->props[513].type				= PROP_TYPE_GUINT32;
+	gnet_property->props[513].data.guint32.def	= (void *) &gnet_property_variable_verify_threads_default;
+	gnet_property->props[513].data.guint32.value = (void *) &gnet_property_variable_verify_threads;
+	gnet_property->props[513].data.guint32.choices = NULL;
+	gnet_property->props[513].data.guint32.max	= 64;
+	gnet_property->props[513].data.guint32.min	= 0;
+
+
+	/*
+	 * PROP_VERIFY_DEVICE_READERS:
+	 *
+	 * General data:
+	 */
+	gnet_property->props[514].name = "verify_device_readers";
+	gnet_property->props[514].desc = _("Maximum amount of files being concurrently read from the same device for hash verification, 0 meaning unlimited.  Set it to 1 for spinning disks to avoid seeking.");
+	gnet_property->props[514].ev_changed = event_new("verify_device_readers_changed");
+	gnet_property->props[514].save = TRUE;
+	gnet_property->props[514].internal = FALSE;
+	gnet_property->props[514].vector_size = 1;
+	mutex_init(&gnet_property->props[514].lock);
+
+	/* Type specific data: */
+	gnet_property->props[514].type				= PROP_TYPE_GUINT32;
+	gnet_property->props[514].data.guint32.def	= (void *) &gnet_property_variable_verify_device_readers_default;
+	gnet_property->props[514].data.guint32.value = (void *) &gnet_property_variable_verify_device_readers;
+	gnet_property->props[514].data.guint32.choices = NULL;
+	gnet_property->props[514].data.guint32.max	= 8;
+	gnet_property->props[514].data.guint32.min	= 0;
+
+
+	/*
+	 * PROP_SCAN_THREADS:
+	 *
+	 * General data:
+	 */
+	gnet_property->props[515].name = "scan_threads";
+	gnet_property->props[515].desc = _("Amount of threads traversing the shared directories in parallel during a library rescan.  Use 1 to scan directories one at a time, or 0 to let the application decide.");
+	gnet_property->props[515].ev_changed = event_new("scan_threads_changed");
+	gnet_property->props[515].save = TRUE;
+	gnet_property->props[515].internal = FALSE;
+	gnet_property->props[515].vector_size = 1;
+	mutex_init(&gnet_property->props[515].lock);
+
+	/* Type specific data: */
+	gnet_property->props[515].type				= PROP_TYPE_GUINT32;
+	gnet_property->props[515].data.guint32.def	= (void *) &gnet_property_variable_scan_threads_default;
+	gnet_property->props[515].data.guint32.value = (void *) &gnet_property_variable_scan_threads;
+	gnet_property->props[515].data.guint32.choices = NULL;
+	gnet_property->props[515].data.guint32.max	= 16;
+	gnet_property->props[515].data.guint32.min	= 0;
+
+
+	/*
+	 * PROP_LIBRARY_RESCAN_RATE:
+	 *
+	 * General data:
+	 */
+	gnet_property->props[516].name = "library_rescan_rate";
+	gnet_property->props[516].desc = _("The number of files per second processed during the last scan of the library.");
+	gnet_property->props[516].ev_changed = event_new("library_rescan_rate_changed");
+	gnet_property->props[516].save = FALSE;
+	gnet_property->props[516].internal = TRUE;
+	gnet_property->props[516].vector_size = 1;
+	mutex_init(&gnet_property->props[516].lock);
+
+	/* Type specific data: */
+	gnet_property->props[516].type				= PROP_TYPE_GUINT32;
+	gnet_property->props[516].data.guint32.def	= (void *) &gnet_property_variable_library_rescan_rate_default;
+	gnet_property->props[516].data.guint32.value = (void *) &gnet_property_variable_library_rescan_rate;
+	gnet_property->props[516].data.guint32.choices = NULL;
+	gnet_property->props[516].data.guint32.max	= 0xFFFFFFFF;
+	gnet_property->props[516].data.guint32.min	= 0x00000000;
+
+
+	/*
+	 * PROP_SHARE_INCREMENTAL:
+	 *
+	 * General data:
+	 */
+	gnet_property->props[517].name = "share_incremental";
+	gnet_property->props[517].desc = _("Whether to monitor shared directories for changes and update the library incrementally, instead of relying only on full rescans.");
+	gnet_property->props[517].ev_changed = event_new("share_incremental_changed");
+	gnet_property->props[517].save = TRUE;
+	gnet_property->props[517].internal = FALSE;
+	gnet_property->props[517].vector_size = 1;
+	mutex_init(&gnet_property->props[517].lock);
+
+	/* Type specific data: */
+	gnet_property->props[517].type				= PROP_TYPE_BOOLEAN;
+	gnet_property->props[517].data.boolean.def	= (void *) &gnet_property_variable_share_incremental_default;
+	gnet_property->props[517].data.boolean.value = (void *) &gnet_property_variable_share_incremental;
+
+
+	/*
+	 * PROP_IPCLASS_DEBUG:
+	 *
+	 * General data:
+	 */
+	gnet_property->props[518].name = "ipclass_debug";
+	gnet_property->props[518].desc = _("Debug level for the compiled IP address classification.");
+	gnet_property->props[518].ev_changed = event_new("ipclass_debug_changed");
+	gnet_property->props[518].save = TRUE;
+	gnet_property->props[518].internal = FALSE;
+	gnet_property->props[518].vector_size = 1;
+	mutex_init(&gnet_property->props[518].lock);
+
+	/* Type specific data: */
+	gnet_property->props[518].type				= PROP_TYPE_GUINT32;
+	gnet_property->props[518].data.guint32.def	= (void *) &gnet_property_variable_ipclass_debug_default;
+	gnet_property->props[518].data.guint32.value = (void *) &gnet_property_variable_ipclass_debug;
+	gnet_property->props[518].data.guint32.choices = NULL;
+	gnet_property->props[518].data.guint32.max	= 20;
+	gnet_property->props[518].data.guint32.min	= 0;
+
+
+	/*
+	 * PROP_MEMTAG_DUMP_PERIOD:
+	 *
+	 * General data:
+	 */
+	gnet_property->props[519].name = "memtag_dump_period";
+	gnet_property->props[519].desc = _("Period, in seconds, at which memory usage per accounting domain is logged for graphing.  Set to 0 to disable.");
+	gnet_property->props[519].ev_changed = event_new("memtag_dump_period_changed");
+	gnet_property->props[519].save = TRUE;
+	gnet_property->props[519].internal = FALSE;
+	gnet_property->props[519].vector_size = 1;
+	mutex_init(&gnet_property->props[519].lock);
+
+	/* Type specific data: */
+	gnet_property->props[519].type				= PROP_TYPE_GUINT32;
+	gnet_property->props[519].data.guint32.def	= (void *) &gnet_property_variable_memtag_dump_period_default;
+	gnet_property->props[519].data.guint32.value = (void *) &gnet_property_variable_memtag_dump_period;
+	gnet_property->props[519].data.guint32.choices = NULL;
+	gnet_property->props[519].data.guint32.max	= 86400;
+	gnet_property->props[519].data.guint32.min	= 0;
+
 	gnet_property->by_name = htable_create(HASH_KEY_STRING, 0);
 	for (n = 0; n < GNET_PROPERTY_NUM; n ++) {
 		htable_insert(gnet_property->by_name,
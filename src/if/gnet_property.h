@@ -540,6 +540,22 @@ typedef enum {
 	PROP_BC_DHT_IN,
 	PROP_BC_LOOPBACK_IN,
 	PROP_BC_PRIVATE_IN,
+	PROP_TX_DEFLATE_ADAPTIVE,
+	PROP_GNET_DEFLATE_DICTIONARY,
+	PROP_NET_IO_WORKERS,
+	PROP_BW_HTB_SCHEDULER,
+	PROP_BW_HTB_WEIGHT_GNET,
+	PROP_BW_HTB_WEIGHT_UDP,
+	PROP_BW_HTB_WEIGHT_DHT,
+	PROP_BW_HTB_WEIGHT_HTTP,
+	PROP_TTH_THREADS,
+	PROP_VERIFY_THREADS,
+	PROP_VERIFY_DEVICE_READERS,
+	PROP_SCAN_THREADS,
+	PROP_LIBRARY_RESCAN_RATE,
+	PROP_SHARE_INCREMENTAL,
+	PROP_IPCLASS_DEBUG,
+	PROP_MEMTAG_DUMP_PERIOD,
 	GNET_PROPERTY_END
 } gnet_property_t;
 
@@ -554,6 +554,22 @@ extern const guint64	gnet_property_variable_bc_gnet_udp_in;
 extern const guint64	gnet_property_variable_bc_dht_in;
 extern const guint64	gnet_property_variable_bc_loopback_in;
 extern const guint64	gnet_property_variable_bc_private_in;
+extern const gboolean gnet_property_variable_tx_deflate_adaptive;
+extern const gboolean gnet_property_variable_gnet_deflate_dictionary;
+extern const guint32	gnet_property_variable_net_io_workers;
+extern const gboolean gnet_property_variable_bw_htb_scheduler;
+extern const guint32	gnet_property_variable_bw_htb_weight_gnet;
+extern const guint32	gnet_property_variable_bw_htb_weight_udp;
+extern const guint32	gnet_property_variable_bw_htb_weight_dht;
+extern const guint32	gnet_property_variable_bw_htb_weight_http;
+extern const guint32	gnet_property_variable_tth_threads;
+extern const guint32	gnet_property_variable_verify_threads;
+extern const guint32	gnet_property_variable_verify_device_readers;
+extern const guint32	gnet_property_variable_scan_threads;
+extern const guint32	gnet_property_variable_library_rescan_rate;
+extern const gboolean gnet_property_variable_share_incremental;
+extern const guint32	gnet_property_variable_ipclass_debug;
+extern const guint32	gnet_property_variable_memtag_dump_period;
 
 
 prop_set_t *gnet_prop_init(void);
@@ -39,6 +39,7 @@
 #include "common.h"
 
 #include "atoms.h"
+#include "atomic.h"
 #include "buf.h"
 #include "constants.h"
 #include "endian.h"
@@ -48,9 +49,11 @@
 #include "misc.h"
 #include "omalloc.h"
 #include "once.h"
+#include "pow2.h"
 #include "spinlock.h"
 #include "str.h"
 #include "stringify.h"
+#include "thread.h"
 #include "walloc.h"
 #include "xmalloc.h"
 
@@ -96,14 +99,19 @@ union mem_chunk {
  * What we return to the outside is the value of atom_arena(), not a
  * pointer to the atom structure.
  *
- * The reference count is not held in the atom header but is stored in the
- * hash table tracking atoms of a given type, to limit the memory overhead,
- * and mprotect() overhead when compiling with PROTECT_ATOMS.
+ * The atom header links the atom in the hash bucket chain of its shard and
+ * holds the reference count, which is updated atomically so that existing
+ * atoms can be reused or released without taking the shard lock, as long
+ * as the reference count does not drop to zero.
  */
 typedef struct atom {
 #ifdef ATOMS_HAVE_MAGIC
 	atom_prot_magic_t magic;	/**< Magic should be at the beginning */
 #endif /* ATOM_HAVE_MAGIC */
+	struct atom *next;			/**< Next atom in the bucket chain */
+	uint32 hash;				/**< Hashed atom value */
+	uint32 size;				/**< Size of atom, including header */
+	uint refcnt;				/**< Reference count */
 #ifdef TRACK_ATOMS
 	htable_t *get;				/**< Allocation spots */
 	htable_t *free;				/**< Free spots */
@@ -117,85 +125,12 @@ typedef struct atom {
 		((sizeof(atom_t) % MEM_ALIGNBYTES) ? 1 : 0)))
 
 /*
- * On 32-bit machines, the size and reference counts of atoms are stored as
- * values in the atom hash table.
- *
- * On 64-bit machines, the size and reference counts are encoded in the
- * pointer field.
- *
- * The atom size is therefore limited to 4 GiB, which is a reasonable upper
- * limit given that each time the atom is requested, we need to hash it.
+ * The atom size is limited to 4 GiB, which is a reasonable upper limit
+ * given that each time the atom is requested, we need to hash it.
  */
 
 #define ATOM_SIZE_MAX	0xffffffffU
 
-/*
- * Atom information on 32-bit machines, stored in the hash table.
- */
-struct atom_info {
-	size_t len;			/**< Atom length */
-	int refcnt;			/**< Reference count */
-};
-
-/*
- * On 64-bit machines:
- *
- * - the size is stored in the upper 32 bits of the atom's hash table
- *   64-bit value
- * - the reference count is held in the lower 32 bits of that value.
- *
- * This allows us to simply increment or decrement the whole value to account
- * for reference changes made to the atom.
- */
-
-#if PTRSIZE > 4
-#define ATOM_LENGTH(x)	((x) >> 32)
-#define ATOM_REFCNT(x)	((x) & ATOM_SIZE_MAX)
-#define ATOM_INFO(l)	((l) << 32)
-#else	/* PTRSIZE <= 4 */
-/*
- * Make sure this unreachable code on 32-bit machines does not trigger
- * compilation warnings, and is indeed unreacheable.
- */
-#define ATOM_LENGTH(x)	(s_error_expr("unused code called"), ATOM_SIZE_MAX)
-#define ATOM_REFCNT(x)	(s_error_expr("unused code called"), 0)
-#define ATOM_INFO(x)	(s_error_expr("unused code called"), 0)
-#endif	/* PTRSIZE > 4 */
-
-/**
- * Return the atom's length from the information stored in the hash table.
- */
-static inline size_t
-atom_info_length(void *p)
-{
-	if (4 == sizeof p) {
-		/* 32-bit machine, value is a pointer to a struct atom_info */
-		struct atom_info *ai = p;
-		return ai->len;
-	} else {
-		/* 64-bit machine, value is encoded */
-		return ATOM_LENGTH(pointer_to_ulong(p));
-	}
-}
-
-/**
- * Return the atom's reference count from the information stored in
- * the hash table.
- */
-static inline int
-atom_info_refcnt(void *p)
-{
-	if (4 == sizeof p) {
-		/* 32-bit machine, value is a pointer to a struct atom_info */
-		struct atom_info *ai = p;
-		return ai->refcnt;
-	} else {
-		/* 64-bit machine, value is encoded */
-		return ATOM_REFCNT(pointer_to_ulong(p));
-	}
-}
-
-
 static inline atom_t *
 atom_from_arena(const void *key)
 {
@@ -240,8 +175,8 @@ ATOM_TRACK_REFCNT(const void *key, int delta, size_t refcnt)
 	atom_t *a = atom_from_arena(key);
 
 	/*
-	 * The table where the atoms lies is locked, no need to use atomic ops
-	 * to update the tracking count.
+	 * All the tracked operations are serialized by the tracking lock, no
+	 * need to use atomic ops to update the tracking count.
 	 */
 
 	a->trackcnt += delta;
@@ -528,24 +463,84 @@ atom_dealloc(atom_t *a, size_t size)
 
 #endif /* PROTECT_ATOMS */
 
+/*
+ * With PROTECT_ATOMS, the atom header cannot be updated without first
+ * making the page writable.  Since a page is shared among atoms of all
+ * types, these updates are serialized by a global lock, and the lock-free
+ * fast paths are disabled.
+ */
+#ifdef PROTECT_ATOMS
+static spinlock_t atom_prot_slk = SPINLOCK_INIT;
+
+#define ATOM_PROT_LOCK		spinlock_hidden(&atom_prot_slk)
+#define ATOM_PROT_UNLOCK	spinunlock_hidden(&atom_prot_slk)
+
+#define atom_hdr_unprotect(a) G_STMT_START {	\
+	ATOM_PROT_LOCK;								\
+	atom_unprotect((a), (a)->size);				\
+} G_STMT_END
+
+#define atom_hdr_protect(a) G_STMT_START {		\
+	atom_protect((a), (a)->size);				\
+	ATOM_PROT_UNLOCK;							\
+} G_STMT_END
+#else	/* !PROTECT_ATOMS */
+#define ATOM_PROT_LOCK
+#define ATOM_PROT_UNLOCK
+#define atom_hdr_unprotect(a)
+#define atom_hdr_protect(a)
+#define ATOMS_LOCKFREE
+#endif	/* PROTECT_ATOMS */
+
 typedef size_t (*len_func_t)(const void *v);
 typedef const char *(*str_func_t)(const void *v);
 
+/*
+ * Atoms of each type are spread over ATOM_SHARDS shards, selected by the
+ * upper bits of the atom hash, each shard being an independently locked
+ * hash table with chained buckets.
+ *
+ * Updates to a shard are made under its lock, but lookups can traverse the
+ * bucket chains without any lock: atoms are linked in a chain only once
+ * fully initialized, and the memory of removed atoms and of replaced bucket
+ * arrays is reclaimed only after all the concurrent readers are gone (see
+ * the epoch-based reclamation below).
+ *
+ * A lock-free lookup can miss an existing atom when it races with a resize
+ * of the shard, hence a miss is always confirmed under the lock.
+ */
+#define ATOM_SHARD_BITS		4
+#define ATOM_SHARDS			(1U << ATOM_SHARD_BITS)
+#define ATOM_BUCKETS_MIN	16		/**< Initial amount of buckets per shard */
+#define ATOM_CACHELINE		64		/**< Amount of bytes in a CPU cacheline */
+
+struct atom_buckets {
+	size_t mask;				/**< Amount of buckets - 1 */
+	atom_t *head[1];			/**< Chain heads (extended) */
+};
+
+struct atom_shard {
+	spinlock_t lock;			/**< Lock protecting shard updates */
+	struct atom_buckets *buckets;	/**< Bucket array (NULL if none yet) */
+	size_t count;				/**< Amount of atoms in shard */
+} G_ALIGNED(ATOM_CACHELINE);
+
+#define ATOM_SHARD_LOCK(s)		spinlock(&(s)->lock)
+#define ATOM_SHARD_UNLOCK(s)	spinunlock(&(s)->lock)
+
 /**
  * Description of atom types.
  */
 typedef struct atom_desc {
-	spinlock_t lock;			/**< Lock protecting the hash table */
 	const char *type;			/**< Type of atoms */
-	htable_t *table;			/**< Table of atoms: "atom value" -> size */
+	struct atom_shard *shard;	/**< Atom tables, ATOM_SHARDS of them */
 	hash_fn_t hash_func;		/**< Hashing function for atoms */
 	eq_fn_t eq_func;			/**< Atom equality function */
 	len_func_t len_func;		/**< Atom length function */
 	str_func_t str_func;		/**< Atom to human-readable string */
 } atom_desc_t;
 
-#define ATOM_TABLE_LOCK(t)		spinlock(&(t)->lock)
-#define ATOM_TABLE_UNLOCK(t)	spinunlock(&(t)->lock)
+static struct atom_shard atom_shards[NUM_ATOM_TYPES][ATOM_SHARDS];
 
 static size_t str_xlen(const void *v);
 static const char *str_str(const void *v);
@@ -579,22 +574,21 @@ static const char *packed_host_addr_str(const void *v);
 #define pha_eq		packed_host_addr_equal
 #define pha_len		packed_host_addr_len
 #define pha_str		packed_host_addr_str
-#define S			SPINLOCK_INIT
 #define N			NULL
 
 /**
  * The set of all atom types we know about.
  */
 static atom_desc_t atoms[] = {
-	{ S, "String", N, str_hash,    str_eq,     str_xlen,   str_str  }, /* 0 */
-	{ S, "GUID",   N, guid_hash,   guid_eq,    guid_len,   guid_str }, /* 1 */
-	{ S, "SHA1",   N, sha1_hash,   sha1_eq,	   sha1_len,   sha1_str }, /* 2 */
-	{ S, "TTH",    N, tth_hash,    tth_eq,	   tth_len,    tth_str },  /* 3 */
-	{ S, "uint64", N, uint64_hash, uint64_eq,  uint64_len, uint64_str},/* 4 */
-	{ S, "filesize", N, fs_hash,   fs_eq,      fs_len,     fs_str },   /* 5 */
-	{ S, "uint32", N, uint32_hash, uint32_eq,  uint32_len, uint32_str},/* 6 */
-	{ S, "host",   N, gnh_hash,    gnh_eq,     gnh_len,    gnh_str },  /* 7 */
-	{ S, "addr",   N, pha_hash,    pha_eq,     pha_len,    pha_str },  /* 8 */
+	{ "String",   N, str_hash,    str_eq,     str_xlen,   str_str  },	/* 0 */
+	{ "GUID",     N, guid_hash,   guid_eq,    guid_len,   guid_str },	/* 1 */
+	{ "SHA1",     N, sha1_hash,   sha1_eq,	  sha1_len,   sha1_str },	/* 2 */
+	{ "TTH",      N, tth_hash,    tth_eq,	  tth_len,    tth_str },	/* 3 */
+	{ "uint64",   N, uint64_hash, uint64_eq,  uint64_len, uint64_str},	/* 4 */
+	{ "filesize", N, fs_hash,     fs_eq,      fs_len,     fs_str },		/* 5 */
+	{ "uint32",   N, uint32_hash, uint32_eq,  uint32_len, uint32_str},	/* 6 */
+	{ "host",     N, gnh_hash,    gnh_eq,     gnh_len,    gnh_str },	/* 7 */
+	{ "addr",     N, pha_hash,    pha_eq,     pha_len,    pha_str },	/* 8 */
 };
 
 #undef str_hash
@@ -611,7 +605,6 @@ static atom_desc_t atoms[] = {
 #undef pha_eq
 #undef pha_len
 #undef pha_str
-#undef S
 #undef N
 
 /**
@@ -953,6 +946,418 @@ uint32_str(const void *v)
 	return p;
 }
 
+/*
+ * Epoch-based reclamation of the memory that lock-free readers can access.
+ *
+ * Each thread entering a lock-free section publishes the global epoch it saw
+ * in its reader slot, and clears the slot when leaving.  Memory retired at
+ * epoch E can no longer be reached by readers once the global epoch reached
+ * E + 2, and the global epoch can only move forward when all the active
+ * readers have seen its current value.
+ */
+
+struct atom_reader {
+	uint epoch;					/**< Epoch seen at entry, 0 when not reading */
+	uint depth;					/**< Nesting depth of lock-free sections */
+} G_ALIGNED(ATOM_CACHELINE);
+
+struct atom_retired {
+	struct atom_retired *next;	/**< Next retired item */
+	void *p;					/**< Retired memory */
+	size_t size;				/**< Atom size, 0 for a bucket array */
+	uint epoch;					/**< Epoch at which memory was retired */
+};
+
+static struct atom_reader atom_readers[THREAD_MAX];
+static uint atom_epoch = 1;
+static struct atom_retired *atom_retired_list;
+static size_t atom_retired_count;
+static spinlock_t atom_retire_slk = SPINLOCK_INIT;
+
+#define ATOM_RETIRE_BATCH	64		/**< Reclaim once that many items retired */
+
+#define ATOM_RETIRE_LOCK	spinlock_hidden(&atom_retire_slk)
+#define ATOM_RETIRE_UNLOCK	spinunlock_hidden(&atom_retire_slk)
+
+/**
+ * Enter lock-free section.
+ *
+ * @return the reader slot to give back to atom_read_leave(), NULL if the
+ * thread cannot be identified, in which case the caller must use locks.
+ */
+static inline struct atom_reader *
+atom_read_enter(void)
+{
+	uint stid = thread_small_id();
+	struct atom_reader *r;
+
+	if G_UNLIKELY(stid >= THREAD_MAX)
+		return NULL;
+
+	r = &atom_readers[stid];
+
+	if G_LIKELY(0 == r->depth++) {
+		uint e;
+
+		/*
+		 * Make sure the epoch we publish is still the current one once
+		 * it is visible to other threads.
+		 */
+
+		do {
+			e = atom_epoch;
+			r->epoch = e;
+			atomic_mb();
+		} while G_UNLIKELY(e != atom_epoch);
+	}
+
+	return r;
+}
+
+/**
+ * Leave lock-free section.
+ */
+static inline void
+atom_read_leave(struct atom_reader *r)
+{
+	g_assert(r->depth != 0);
+
+	if G_LIKELY(0 == --r->depth) {
+		atomic_mb();
+		r->epoch = 0;
+	}
+}
+
+/**
+ * Record memory that lock-free readers may still be accessing.
+ *
+ * @param p		the memory to release
+ * @param size	atom size, or 0 if ``p'' is a bucket array
+ *
+ * @return TRUE if enough items were retired to attempt reclaiming them.
+ */
+static bool
+atom_retire(void *p, size_t size)
+{
+	struct atom_retired *ar;
+	size_t count;
+
+	WALLOC(ar);
+	ar->p = p;
+	ar->size = size;
+
+	ATOM_RETIRE_LOCK;
+	ar->epoch = atom_epoch;
+	ar->next = atom_retired_list;
+	atom_retired_list = ar;
+	count = ++atom_retired_count;
+	ATOM_RETIRE_UNLOCK;
+
+	return count >= ATOM_RETIRE_BATCH;
+}
+
+/**
+ * Release retired memory.
+ */
+static void
+atom_release(struct atom_retired *ar)
+{
+	if (0 == ar->size) {
+		xfree(ar->p);
+	} else {
+		atom_t *a = ar->p;
+
+		ATOM_PROT_LOCK;
+		atom_unprotect(a, ar->size);
+		atom_dealloc(a, ar->size);
+		ATOM_PROT_UNLOCK;
+	}
+	WFREE(ar);
+}
+
+/**
+ * Attempt to advance the global epoch and release the retired memory that
+ * no reader can access any more.
+ */
+static void
+atom_reclaim(void)
+{
+	struct atom_retired *ar, *next, *keep = NULL, *dead = NULL;
+	uint e, i;
+
+	if (!spinlock_hidden_try(&atom_retire_slk))
+		return;			/* Another thread is reclaiming or retiring */
+
+	if (atom_retired_count < ATOM_RETIRE_BATCH) {
+		ATOM_RETIRE_UNLOCK;
+		return;		/* Already done by another thread */
+	}
+
+	e = atom_epoch;
+	atomic_mb();
+
+	for (i = 0; i < N_ITEMS(atom_readers); i++) {
+		uint re = atom_readers[i].epoch;
+
+		if (re != 0 && re != e)
+			break;		/* Reader still active in a previous epoch */
+	}
+
+	if (N_ITEMS(atom_readers) == i) {
+		if G_UNLIKELY(0 == ++e)
+			e = 1;		/* Epoch 0 means "not reading" */
+		atom_epoch = e;
+		atomic_mb();
+	}
+
+	for (ar = atom_retired_list; ar != NULL; ar = next) {
+		next = ar->next;
+		if ((int) (e - ar->epoch) >= 2) {
+			ar->next = dead;
+			dead = ar;
+			atom_retired_count--;
+		} else {
+			ar->next = keep;
+			keep = ar;
+		}
+	}
+
+	atom_retired_list = keep;
+	ATOM_RETIRE_UNLOCK;
+
+	for (ar = dead; ar != NULL; ar = next) {
+		next = ar->next;
+		atom_release(ar);
+	}
+}
+
+/**
+ * @return the hash value of ``key'' for atoms of the given type.
+ */
+static inline uint32
+atom_hash(const atom_desc_t *ad, const void *key)
+{
+	return hashing_mix32((*ad->hash_func)(key));
+}
+
+/**
+ * @return the shard holding atoms with the given hash value.
+ */
+static inline struct atom_shard *
+atom_shard(atom_desc_t *ad, uint32 hash)
+{
+	return &ad->shard[hash >> (32 - ATOM_SHARD_BITS)];
+}
+
+/**
+ * Look for an atom in the shard.
+ *
+ * This can be called without holding the shard lock, from within a
+ * lock-free section, in which case the atom returned may be in the process
+ * of being removed (reference count dropped to 0).
+ *
+ * @return the atom matching ``key'', NULL if not found.
+ */
+static atom_t *
+atom_lookup(const atom_desc_t *ad, const struct atom_shard *sh,
+	const void *key, uint32 hash)
+{
+	const struct atom_buckets *b = sh->buckets;
+	atom_t *a;
+
+	if G_UNLIKELY(NULL == b)
+		return NULL;
+
+	for (a = b->head[hash & b->mask]; a != NULL; a = a->next) {
+		if (hash == a->hash && (*ad->eq_func)(atom_arena(a), key))
+			return a;
+	}
+
+	return NULL;
+}
+
+/**
+ * Atomically increase the reference count of an atom, unless it is 0.
+ *
+ * @return the new reference count, 0 if the atom is being removed.
+ */
+static inline uint
+atom_refcnt_inc(atom_t *a)
+{
+	uint r;
+	bool ok;
+
+	do {
+		r = a->refcnt;
+		if G_UNLIKELY(0 == r)
+			return 0;
+		atom_hdr_unprotect(a);
+		ok = atomic_uint_xchg_if_eq(&a->refcnt, r, r + 1);
+		atom_hdr_protect(a);
+	} while G_UNLIKELY(!ok);
+
+	return r + 1;
+}
+
+/**
+ * Atomically decrease the reference count of an atom, unless this would
+ * drop the last reference, which can only be done with the shard locked.
+ *
+ * @return the new reference count, 0 if this is the last reference.
+ */
+static inline uint
+atom_refcnt_dec(atom_t *a)
+{
+	uint r;
+	bool ok;
+
+	do {
+		r = a->refcnt;
+		g_assert_log(r != 0, "attempting to free dead atom at %p", a);
+		if (1 == r)
+			return 0;
+		atom_hdr_unprotect(a);
+		ok = atomic_uint_xchg_if_eq(&a->refcnt, r, r - 1);
+		atom_hdr_protect(a);
+	} while G_UNLIKELY(!ok);
+
+	return r - 1;
+}
+
+/**
+ * Drop the last reference to an atom, with the shard locked.
+ *
+ * A concurrent lock-free atom_get() may have grabbed a new reference to
+ * the atom after we determined that we had the last one.
+ *
+ * @return the new reference count, 0 if the atom must be removed.
+ */
+static uint
+atom_refcnt_dec_last(atom_t *a)
+{
+	for (;;) {
+		uint r = atom_refcnt_dec(a);
+		bool ok;
+
+		if (r != 0)
+			return r;
+
+		atom_hdr_unprotect(a);
+		ok = atomic_uint_xchg_if_eq(&a->refcnt, 1, 0);
+		atom_hdr_protect(a);
+
+		if (ok)
+			return 0;
+	}
+}
+
+/**
+ * Update the link to the next atom in a bucket chain.
+ */
+static inline void
+atom_set_next(atom_t *a, atom_t *next)
+{
+	atom_hdr_unprotect(a);
+	a->next = next;
+	atom_hdr_protect(a);
+}
+
+/**
+ * Resize the bucket array of the shard, which must be locked.
+ *
+ * Atoms are moved to their new chain one at a time.  A concurrent lock-free
+ * reader following an atom being moved can therefore miss the atom it is
+ * looking for, but always reaches the end of a chain.
+ */
+static void
+atom_shard_resize(struct atom_shard *sh, size_t buckets)
+{
+	struct atom_buckets *b, *old = sh->buckets;
+	size_t i;
+
+	g_assert(IS_POWER_OF_2(buckets));
+	g_assert(spinlock_is_held(&sh->lock));
+
+	b = xmalloc0(offsetof(struct atom_buckets, head) +
+			buckets * sizeof b->head[0]);
+	b->mask = buckets - 1;
+
+	if (old != NULL) {
+		for (i = 0; i <= old->mask; i++) {
+			atom_t *a, *next;
+
+			for (a = old->head[i]; a != NULL; a = next) {
+				size_t j = a->hash & b->mask;
+
+				next = a->next;
+				atom_set_next(a, b->head[j]);
+				b->head[j] = a;
+			}
+		}
+	}
+
+	atomic_mb();
+	sh->buckets = b;
+
+	if (old != NULL)
+		(void) atom_retire(old, 0);
+}
+
+/**
+ * Make sure there is room for a new atom in the shard, which must be locked.
+ *
+ * @return the bucket array where the new atom can be inserted.
+ */
+static struct atom_buckets *
+atom_shard_reserve(struct atom_shard *sh)
+{
+	if G_UNLIKELY(NULL == sh->buckets)
+		atom_shard_resize(sh, ATOM_BUCKETS_MIN);
+	else if G_UNLIKELY(sh->count > sh->buckets->mask)
+		atom_shard_resize(sh, 2 * (sh->buckets->mask + 1));
+
+	return sh->buckets;
+}
+
+/**
+ * Remove atom from the shard, which must be locked.
+ *
+ * The atom memory is not released since lock-free readers may still be
+ * accessing it.
+ */
+static void
+atom_remove(const atom_desc_t *ad, struct atom_shard *sh, atom_t *a)
+{
+	struct atom_buckets *b = sh->buckets;
+	atom_t *p, *prev = NULL;
+	size_t i;
+
+	g_assert(b != NULL);
+
+	i = a->hash & b->mask;
+
+	for (p = b->head[i]; p != a; p = p->next) {
+		g_assert_log(p != NULL,
+			"attempting to free unknown %s atom at %p", ad->type, atom_arena(a));
+		prev = p;
+	}
+
+	/*
+	 * The removed atom keeps its link to the next atom, so that any reader
+	 * currently looking at it can continue its traversal.
+	 */
+
+	if (NULL == prev)
+		b->head[i] = a->next;
+	else
+		atom_set_next(prev, a->next);
+
+	sh->count--;
+
+	if G_UNLIKELY(sh->count < b->mask / 8 && b->mask >= 2 * ATOM_BUCKETS_MIN)
+		atom_shard_resize(sh, (b->mask + 1) / 2);
+}
+
 /**
  * Initialize atom structures.
  */
@@ -970,7 +1375,6 @@ atoms_init_once(void)
 	ZERO(&settings);
 
 	STATIC_ASSERT(NUM_ATOM_TYPES == N_ITEMS(atoms));
-	STATIC_ASSERT(4 == sizeof(void *) || sizeof(void *) == sizeof(ulong));
 
 #ifdef PROTECT_ATOMS
 	for (i = 0; i < N_ITEMS(mem_cache); i++) {
@@ -980,8 +1384,12 @@ atoms_init_once(void)
 
 	for (i = 0; i < N_ITEMS(atoms); i++) {
 		atom_desc_t *ad = &atoms[i];
+		uint j;
+
+		ad->shard = atom_shards[i];
 
-		ad->table = htable_create_any(ad->hash_func, NULL, ad->eq_func);
+		for (j = 0; j < ATOM_SHARDS; j++)
+			spinlock_init(&ad->shard[j].lock);
 	}
 
 	/*
@@ -1020,6 +1428,26 @@ atoms_init(void)
 	once_flag_run(&atoms_inited, atoms_init_once);
 }
 
+/**
+ * Look for the atom matching ``key'', with its shard locked.
+ *
+ * @return the atom, NULL if not found.
+ */
+static atom_t *
+atom_find(enum atom_type type, const void *key)
+{
+	atom_desc_t *ad = &atoms[type];
+	uint32 hash = atom_hash(ad, key);
+	struct atom_shard *sh = atom_shard(ad, hash);
+	atom_t *a;
+
+	ATOM_SHARD_LOCK(sh);
+	a = atom_lookup(ad, sh, key, hash);
+	ATOM_SHARD_UNLOCK(sh);
+
+	return a;
+}
+
 /**
  * Check whether atom exists.
  *
@@ -1029,11 +1457,12 @@ bool
 atom_exists(enum atom_type type, const void *key)
 {
 	g_assert(key != NULL);
+	g_assert(UNSIGNED(type) < N_ITEMS(atoms));
 
 	if G_UNLIKELY(!ONCE_DONE(atoms_inited))
 		return FALSE;
 
-	return htable_contains(atoms[type].table, key);
+	return NULL != atom_find(type, key);
 }
 
 /**
@@ -1044,42 +1473,17 @@ atom_exists(enum atom_type type, const void *key)
 bool
 atom_is_atom(enum atom_type type, const void *key)
 {
-	const void *atom;
+	atom_t *a;
 
 	g_assert(key != NULL);
+	g_assert(UNSIGNED(type) < N_ITEMS(atoms));
 
 	if G_UNLIKELY(!ONCE_DONE(atoms_inited))
 		return FALSE;
 
-	return htable_lookup_extended(atoms[type].table, key, &atom, NULL)
-		&& key == atom;
-}
+	a = atom_find(type, key);
 
-/**
- * Increment / decrement the atom reference count.
- *
- * Must be called with the table description locked.
- *
- * @return new reference count.
- */
-static inline size_t
-atom_refcnt_add(const atom_desc_t *ad, const void *key, void *value, int delta)
-{
-	if (4 == sizeof(void *)) {
-		/* 32-bit machine, we can directly update the atom_info structure */
-		struct atom_info *ai = value;
-		ai->refcnt += delta;
-		return ai->refcnt;
-	} else {
-		/* 64-bit machine, we must update the hash table value */
-		ulong v = pointer_to_ulong(value);
-		if (delta > 0)
-			v += delta;
-		else
-			v -= -delta;	/* Necessary since int may be smaller than long */
-		htable_insert(ad->table, key, ulong_to_pointer(v));
-		return ATOM_REFCNT(v);
-	}
+	return a != NULL && key == atom_arena(a);
 }
 
 /**
@@ -1092,9 +1496,11 @@ const void *
 atom_get(enum atom_type type, const void *key)
 {
 	atom_desc_t *ad;
-	const void *orig_key;
-	void *value;
-	size_t size;
+	struct atom_shard *sh;
+	struct atom_buckets *b;
+	uint32 hash;
+	size_t size, len, i;
+	uint refcnt;
 	atom_t *a;
 
 	STATIC_ASSERT(0 == ARENA_OFFSET % MEM_ALIGNBYTES);
@@ -1108,64 +1514,84 @@ atom_get(enum atom_type type, const void *key)
 		atoms_init();
 
 	ad = &atoms[type];		/* Where atoms of this type are held */
-	ATOM_TABLE_LOCK(ad);
+	hash = atom_hash(ad, key);
+	sh = atom_shard(ad, hash);
 
-	if (htable_lookup_extended(ad->table, key, &orig_key, &value)) {
-		size_t refcnt;
-
-		size = atom_info_length(value);
-		/* Prevent gcc warning if ARENA_OFFSET == 0 */
-		g_assert(size == ARENA_OFFSET || size > ARENA_OFFSET);
+#ifdef ATOMS_LOCKFREE
+	{
+		struct atom_reader *r = atom_read_enter();
 
 		/*
-		 * Atom exists, increment ref count and return it.
+		 * Fast path: atom exists, increment ref count and return it,
+		 * without locking the shard.
 		 */
 
-		g_assert(atom_info_refcnt(value) > 0);
+		if G_LIKELY(r != NULL) {
+			a = atom_lookup(ad, sh, key, hash);
+			refcnt = NULL == a ? 0 : atom_refcnt_inc(a);
+			atom_read_leave(r);
 
-		refcnt = atom_refcnt_add(ad, orig_key, value, +1);
-		ATOM_TRACK_REFCNT(orig_key, +1, refcnt);
-		ATOM_TABLE_UNLOCK(ad);
+			if G_LIKELY(refcnt != 0) {
+				ATOM_TRACK_REFCNT(atom_arena(a), +1, refcnt);
+				return atom_arena(a);
+			}
+		}
+	}
+#endif	/* ATOMS_LOCKFREE */
 
-		return orig_key;
-	} else {
-		size_t len;
+	ATOM_SHARD_LOCK(sh);
 
+	a = atom_lookup(ad, sh, key, hash);
+
+	if (a != NULL) {
 		/*
-		 * Create new atom.
+		 * Atom exists, increment ref count and return it.
+		 *
+		 * Atoms linked in the shard always have a positive reference
+		 * count when the shard is locked since the last reference is
+		 * dropped under the lock.
 		 */
 
-		len = (*ad->len_func)(key);
-		g_assert(len < ATOM_SIZE_MAX - ARENA_OFFSET);
-		size = round_size_fast(MEM_ALIGNBYTES, ARENA_OFFSET + len);
+		refcnt = atom_refcnt_inc(a);
+		g_assert(refcnt > 1);
+		ATOM_TRACK_REFCNT(atom_arena(a), +1, refcnt);
+		ATOM_SHARD_UNLOCK(sh);
 
-		a = atom_alloc(size);
-		memcpy(atom_arena(a), key, len);
-		atom_protect(a, size);
+		return atom_arena(a);
+	}
 
-		/*
-		 * Insert atom in table.
-		 *
-		 * On 32-bit machines, we have to allocate the atom_info structure.
-		 * On 64-bit machines, encode size and refcnt in a long.
-		 */
+	/*
+	 * Create new atom.
+	 */
 
-		if (4 == sizeof(void *)) {
-			struct atom_info *ai;
+	len = (*ad->len_func)(key);
+	g_assert(len < ATOM_SIZE_MAX - ARENA_OFFSET - MEM_ALIGNBYTES);
+	size = round_size_fast(MEM_ALIGNBYTES, ARENA_OFFSET + len);
 
-			WALLOC(ai);
-			ai->len = size;
-			ai->refcnt = 1;
-			htable_insert(ad->table, atom_arena(a), ai);
-		} else {
-			ulong v = ATOM_INFO(size) + 1;	/* +1 means refcnt is 1 */
-			htable_insert(ad->table, atom_arena(a), ulong_to_pointer(v));
-		}
+	b = atom_shard_reserve(sh);
+	i = hash & b->mask;
 
-		ATOM_TABLE_UNLOCK(ad);
+	ATOM_PROT_LOCK;
+	a = atom_alloc(size);
+	a->next = b->head[i];
+	a->hash = hash;
+	a->size = size;
+	a->refcnt = 1;
+	memcpy(atom_arena(a), key, len);
+	atom_protect(a, size);
+	ATOM_PROT_UNLOCK;
 
-		return atom_arena(a);
-	}
+	/*
+	 * Insert atom in table, making it visible to lock-free readers.
+	 */
+
+	atomic_mb();
+	b->head[i] = a;
+	sh->count++;
+
+	ATOM_SHARD_UNLOCK(sh);
+
+	return atom_arena(a);
 }
 
 /**
@@ -1176,55 +1602,52 @@ void
 atom_free(enum atom_type type, const void *key)
 {
 	atom_desc_t *ad;
-	size_t size;
+	struct atom_shard *sh;
+	uint refcnt;
 	atom_t *a;
-	bool found;
-	int refcnt;
-	void *value;
-	const void *orig_key;
 
     g_assert(key != NULL);
 	g_assert(UNSIGNED(type) < N_ITEMS(atoms));
 	ATOM_TRACK_IS_LOCKED();
 
 	ad = &atoms[type];		/* Where atoms of this type are held */
-	ATOM_TABLE_LOCK(ad);
+	a = atom_from_arena(key);
+	atom_check(a);
+
+	/* Prevent gcc warning if ARENA_OFFSET == 0 */
+	g_assert(a->size == ARENA_OFFSET || a->size > ARENA_OFFSET);
 
-	found = htable_lookup_extended(ad->table, key, &orig_key, &value);
+#ifdef ATOMS_LOCKFREE
+	/*
+	 * Fast path: this is not the last reference, no need to lock the shard.
+	 */
 
-	g_assert_log(found,
-		"attempting to free unknown %s atom at %p", ad->type, key);
-	g_assert_log(key == orig_key,
-		"attempt to free %s atom copy at %p, atom was at %p",
-			ad->type, key, orig_key);
+	refcnt = atom_refcnt_dec(a);
 
-	size = atom_info_length(value);
+	if G_LIKELY(refcnt != 0) {
+		ATOM_TRACK_REFCNT(key, -1, refcnt);
+		return;
+	}
+#endif	/* ATOMS_LOCKFREE */
 
-	/* Prevent gcc warning if ARENA_OFFSET == 0 */
-	g_assert(size == ARENA_OFFSET || size > ARENA_OFFSET);
+	sh = atom_shard(ad, a->hash);
+	ATOM_SHARD_LOCK(sh);
 
-	a = atom_from_arena(key);
-	refcnt = atom_info_refcnt(value);
+	refcnt = atom_refcnt_dec_last(a);
 
 	/*
 	 * Dispose of atom when its reference count reaches 0.
 	 */
 
-	if (1 == refcnt) {
-		htable_remove(ad->table, key);
-		if (4 == sizeof(void *)) {
-			/* 32-bit machine */
-			struct atom_info *ai = value;
-			WFREE(ai);
-		}
-		atom_unprotect(a, size);
-		atom_dealloc(a, size);
+	if (0 == refcnt) {
+		atom_remove(ad, sh, a);
+		ATOM_SHARD_UNLOCK(sh);
+		if (atom_retire(a, a->size))
+			atom_reclaim();
 	} else {
-		size_t rcnt = atom_refcnt_add(ad, key, value, -1);
-		ATOM_TRACK_REFCNT(key, -1, rcnt);
+		ATOM_TRACK_REFCNT(key, -1, refcnt);
+		ATOM_SHARD_UNLOCK(sh);
 	}
-
-	ATOM_TABLE_UNLOCK(ad);
 }
 
 #ifdef TRACK_ATOMS
@@ -1436,13 +1859,12 @@ dump_tracking_table(const void *atom, htable_t *h, char *what)
  * Warning about existing atom that should have been freed.
  */
 static void
-atom_warn_free(const void *key, void *value, void *udata)
+atom_warn_free(const atom_desc_t *ad, atom_t *a)
 {
-	atom_t *a = atom_from_arena(key);
-	atom_desc_t *ad = udata;
+	const void *key = atom_arena(a);
 
-	g_warning("found remaining %s atom %p, refcnt=%d: \"%s\"",
-		ad->type, key, atom_info_refcnt(value), (*ad->str_func)(key));
+	g_warning("found remaining %s atom %p, refcnt=%u: \"%s\"",
+		ad->type, key, a->refcnt, (*ad->str_func)(key));
 
 #ifdef TRACK_ATOMS
 	spinlock(&a->lock);
@@ -1451,14 +1873,7 @@ atom_warn_free(const void *key, void *value, void *udata)
 	destroy_tracking_table(&a->get);
 	destroy_tracking_table(&a->free);
 	spinlock_destroy(&a->lock);
-#else
-	(void) a;
 #endif
-
-	/*
-	 * Don't free the entry, so that we know where the leak originates from.
-	 *		--RAM, 02/02/2003
-	 */
 }
 
 /**
@@ -1467,15 +1882,59 @@ atom_warn_free(const void *key, void *value, void *udata)
 void
 atoms_close(void)
 {
-	uint i;
+	struct atom_retired *ar, *next;
+	uint i, j;
+
+	if G_UNLIKELY(!ONCE_DONE(atoms_inited))
+		return;
 
 	for (i = 0; i < N_ITEMS(atoms); i++) {
 		atom_desc_t *ad = &atoms[i];
 
-		ATOM_TABLE_LOCK(ad);
-		htable_foreach(ad->table, atom_warn_free, ad);
-		htable_free_null(&ad->table);
-		ATOM_TABLE_UNLOCK(ad);
+		for (j = 0; j < ATOM_SHARDS; j++) {
+			struct atom_shard *sh = &ad->shard[j];
+			struct atom_buckets *b;
+			size_t k;
+
+			ATOM_SHARD_LOCK(sh);
+			b = sh->buckets;
+			sh->buckets = NULL;
+			sh->count = 0;
+			ATOM_SHARD_UNLOCK(sh);
+
+			if (NULL == b)
+				continue;
+
+			/*
+			 * Don't free the remaining atoms, so that we know where the
+			 * leak originates from.
+			 *		--RAM, 02/02/2003
+			 */
+
+			for (k = 0; k <= b->mask; k++) {
+				atom_t *a;
+
+				for (a = b->head[k]; a != NULL; a = a->next)
+					atom_warn_free(ad, a);
+			}
+
+			(void) atom_retire(b, 0);
+		}
+	}
+
+	/*
+	 * There cannot be any concurrent reader at this stage.
+	 */
+
+	ATOM_RETIRE_LOCK;
+	ar = atom_retired_list;
+	atom_retired_list = NULL;
+	atom_retired_count = 0;
+	ATOM_RETIRE_UNLOCK;
+
+	for (/* empty */; ar != NULL; ar = next) {
+		next = ar->next;
+		atom_release(ar);
 	}
 }
 
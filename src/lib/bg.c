@@ -89,6 +89,10 @@
  * processing of enqueued work items, as well as a free routine for these
  * work items.
  *
+ * A step can also hand parallel-safe sub-steps to the thread pool through
+ * bg_task_parallel(), to run CPU-intensive work on several cores whilst the
+ * task sleeps.  The sub-steps are cancelled along with their task.
+ *
  * The difficult part of background tasks is that processing needs to be
  * sequential, and each step needs to be able to interrupt its processing at
  * any time and resume it at the next invocation.  Moreover, the context is
@@ -120,6 +124,7 @@
 #include "str.h"
 #include "stringify.h"		/* For short_time_ascii() and plural() */
 #include "tm.h"
+#include "tpool.h"
 #include "walloc.h"
 
 #include "override.h"		/* Must be the last header included */
@@ -230,6 +235,7 @@ struct bgtask {
 	int elapsed;			/**< Elapsed during last run, in usec */
 	double tick_cost;		/**< Time in ms. spent by each tick */
 	bgsig_cb_t sigh[BG_SIG_COUNT];	/**< Signal handlers */
+	tpool_group_t *par;		/**< Parallel sub-steps in progress */
 	spinlock_t lock;		/**< Thread-safe lock */
 	slink_t bgt_link;		/**< Links task in appropriate list */
 };
@@ -1469,6 +1475,14 @@ bg_task_terminate(bgtask_t *bt)
 		 */
 	}
 
+	/*
+	 * Cancel any parallel sub-step still pending before the user context
+	 * can be freed.  This must be done before locking the scheduler since
+	 * the completion of the sub-steps wakes up the task.
+	 */
+
+	tpool_group_free_null(&bt->par);
+
 	bs = bt->sched;
 	bg_sched_check(bs);
 
@@ -1859,6 +1873,99 @@ bg_task_ticks_used(bgtask_t *bt, int used)
 	}
 }
 
+/**
+ * Called from the thread pool when all the parallel sub-steps of a task
+ * have completed.
+ */
+static void
+bg_task_parallel_done(tpool_group_t *unused_tg, void *arg)
+{
+	bgtask_t *bt = arg;
+
+	(void) unused_tg;
+
+	bg_task_wakeup(bt);
+}
+
+/**
+ * Run ``n'' parallel-safe sub-steps on the thread pool, as ``cb(ctx, i)''
+ * for each ``i'' from 0 to n - 1, where ``ctx'' is the task context.
+ *
+ * This must be called from a processing step, which must return the value
+ * we return.  The task sleeps whilst the sub-steps are running on several
+ * CPUs, and the step is invoked again when they have all completed: calling
+ * this routine again then moves to the next step.
+ *
+ * The sub-steps run concurrently with each other and with the scheduler
+ * thread, hence they must only access the parts of the context that no
+ * other code will modify until they complete.
+ *
+ * When the task is cancelled or killed, the sub-steps that have not started
+ * are dropped and we wait for the running ones before the "done" callback
+ * and the context freeing callback are invoked.
+ *
+ * @param bt		the running task
+ * @param cb		the sub-step to run
+ * @param n			amount of sub-steps to run
+ *
+ * @return the status that the processing step must return.
+ */
+bgret_t
+bg_task_parallel(bgtask_t *bt, bgpar_cb_t cb, size_t n)
+{
+	tpool_t *tp;
+
+	bg_task_is_running(bt, G_STRFUNC);
+	g_assert(cb != NULL);
+
+	/*
+	 * When invoked again, we were woken up by bg_task_parallel_done().
+	 */
+
+	if (bt->par != NULL) {
+		g_assert(tpool_group_done(bt->par));
+
+		tpool_group_free_null(&bt->par);
+		return BGR_NEXT;
+	}
+
+	/*
+	 * Once the pool is gone, we are shutting down: run sub-steps inline.
+	 */
+
+	tp = tpool_default();
+
+	if G_UNLIKELY(NULL == tp) {
+		size_t i;
+
+		for (i = 0; i < n; i++)
+			(*cb)(bt->ucontext, i);
+
+		return BGR_NEXT;
+	}
+
+	if (bg_debug > 2) {
+		s_debug("BGTASK \"%s\" %p running %zu sub-step%s of step #%d in pool",
+			bt->name, bt, PLURAL(n), bt->step);
+	}
+
+	/*
+	 * Request sleeping before submitting, so that the task is always flagged
+	 * for sleeping when bg_task_parallel_done() wakes it up.
+	 */
+
+	bt->par = tpool_group_make(tp, TPOOL_PRIO_NORMAL, bg_task_parallel_done, bt);
+	bg_task_sleep(bt);
+	bg_task_ticks_used(bt, 0);		/* Ticks are meaningless here */
+
+	if G_UNLIKELY(0 == n)
+		bg_task_wakeup(bt);
+	else
+		tpool_submit(bt->par, cb, bt->ucontext, n);
+
+	return BGR_MORE;
+}
+
 /**
  * This routine can be called by a running task to request that it be put
  * to sleep as soon as its current step is finished.
@@ -2838,6 +2945,7 @@ bg_close(void)
 {
 	bg_sched_destroy_null(&bg_sched);
 	bg_closed = TRUE;
+	tpool_close();
 }
 
 /* bg_task_goto */
@@ -138,6 +138,7 @@ bgsched_info_check(const bgsched_info_t * const bsi)
  * `bgstart_cb_t' is the initial callback when daemon starts working.
  * `bgend_cb_t' is the final callback when daemon ends working.
  * `bgnotify_cb_t' is the start/stop callback when daemon starts/stops working.
+ * `bgpar_cb_t' is a parallel-safe sub-step, run from the thread pool.
  */
 
 typedef bgret_t (*bgstep_cb_t)(bgtask_t *h, void *ctx, int ticks);
@@ -148,6 +149,7 @@ typedef void (*bgdone_cb_t)(bgtask_t *h, void *ctx,
 typedef void (*bgstart_cb_t)(bgtask_t *h, void *ctx, void *item);
 typedef void (*bgend_cb_t)(bgtask_t *h, void *ctx, void *item);
 typedef void (*bgnotify_cb_t)(bgtask_t *h, bool on);
+typedef void (*bgpar_cb_t)(void *ctx, size_t idx);
 
 /*
  * Public interface.
@@ -202,6 +204,7 @@ void bg_task_sleep(bgtask_t *bt);
 void bg_task_wakeup(bgtask_t *bt);
 void bg_task_exit(bgtask_t *h, int code) G_NORETURN;
 void bg_task_ticks_used(bgtask_t *h, int used);
+bgret_t bg_task_parallel(bgtask_t *h, bgpar_cb_t cb, size_t n);
 bgsig_cb_t bg_task_signal(bgtask_t *h, bgsig_t sig, bgsig_cb_t handler);
 
 bgtask_t *bg_task_ref(bgtask_t *bt);
@@ -0,0 +1,423 @@
+/*
+ * cq-test -- callout queue timing wheel tests.
+ *
+ * Copyright (c) 2026 gtk-gnutella developers
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the authors nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "common.h"
+
+#include "lib/cq.h"
+#include "lib/misc.h"
+#include "lib/progname.h"
+#include "lib/pslist.h"
+#include "lib/rand31.h"
+#include "lib/xmalloc.h"
+
+#define TEST_ITEMS	1000		/* Default amount of events per test */
+
+/*
+ * Each wheel level spans 2^8 more ticks than the previous one, and a tick
+ * lasts 2^5 units of virtual time, as in cq.c.
+ */
+#define TEST_TICK(t)		((t) >> 5)
+#define TEST_LEVEL_SPAN(l)	((cq_time_t) 1 << (5 + 8 * ((l) + 1)))
+
+static bool silent_mode, verbose_mode;
+static unsigned initial_seed;
+static const char *current_test;
+
+static cqueue_t *test_cq;
+static cq_time_t test_now;		/* Virtual time of the queue */
+static cq_time_t test_prev;		/* Virtual time before last advance */
+static cq_time_t test_tick;		/* Tick of last triggered event */
+static size_t test_fired;		/* Amount of triggered events */
+
+struct item {
+	cevent_t *ev;				/* Pending event, NULL if fired/cancelled */
+	cq_time_t due;				/* Virtual time at which event is due */
+	cq_time_t set;				/* Virtual time at which due was set */
+	bool cancelled;
+	bool fired;
+};
+
+static void G_NORETURN
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-hSV] [-c items] [-n loops] [-R seed]\n"
+		"  -c : sets amount of events per test\n"
+		"  -h : prints this help message\n"
+		"  -n : sets amount of times tests are run\n"
+		"  -R : seed for repeatable random key sequence\n"
+		"  -S : silent mode -- do not print anything for successful tests\n"
+		"  -V : verbose mode -- print status after each successful test\n"
+		, getprogname());
+	exit(EXIT_FAILURE);
+}
+
+static void G_NORETURN
+test_abort(void)
+{
+	if (current_test != NULL)
+		printf("%s - FAILED at t=%s\n", current_test,
+			cq_time_to_string(test_now));
+	printf("use '-R %u' to reproduce problem.\n", initial_seed);
+	abort();
+}
+
+#define test_assert(x) G_STMT_START {			\
+	if G_UNLIKELY(!(x)) {						\
+		printf("assertion \"%s\" failed at %s:%d\n",	\
+			#x, __FILE__, __LINE__);					\
+		test_abort();							\
+	}											\
+} G_STMT_END
+
+/**
+ * Event callback: must be invoked during the first advance of the clock
+ * reaching the due time of the event, and events must be triggered in
+ * tick order.
+ *
+ * An event due right away is only triggered at the next advance.
+ */
+static void
+test_fire(cqueue_t *cq, void *arg)
+{
+	struct item *it = arg;
+
+	test_assert(cq == test_cq);
+	test_assert(!it->cancelled);
+	test_assert(!it->fired);
+	test_assert(it->due <= test_now);		/* Not early */
+	test_assert(it->due > test_prev || it->set >= test_prev);	/* Not late */
+	test_assert(TEST_TICK(it->due) >= test_tick);
+
+	test_tick = TEST_TICK(it->due);
+	cq_zero(cq, &it->ev);
+	it->fired = TRUE;
+	test_fired++;
+}
+
+static void
+test_start(const char *what)
+{
+	current_test = what;
+	test_cq = cq_make(what, 0, 1000);
+	test_now = test_prev = test_tick = 0;
+	test_fired = 0;
+
+	/* Bind queue to this thread, so that we do not get extended events */
+	cq_advance(test_cq, 0);
+}
+
+static void
+test_done(void)
+{
+	test_assert(0 == cq_count(test_cq));
+	cq_free_null(&test_cq);
+
+	if (verbose_mode)
+		printf("%s - OK\n", current_test);
+	current_test = NULL;
+}
+
+/**
+ * Fetch statistics about our callout queue.
+ */
+static void
+test_info(cq_info_t *info)
+{
+	pslist_t *sl, *l;
+	bool found = FALSE;
+
+	sl = cq_info_list();
+
+	PSLIST_FOREACH(sl, l) {
+		const cq_info_t *cqi = l->data;
+
+		cq_info_check(cqi);
+		if (0 == strcmp(cqi->name, current_test)) {
+			*info = *cqi;		/* Struct copy */
+			info->name = info->parent = NULL;	/* Atoms freed below */
+			found = TRUE;
+		}
+	}
+
+	cq_info_list_free_null(&sl);
+	test_assert(found);
+}
+
+/**
+ * @return a random delay, within the span of a random wheel level.
+ */
+static int
+test_delay(void)
+{
+	uint level = rand31_value(CQ_INFO_LEVELS - 1);
+	cq_time_t span = TEST_LEVEL_SPAN(level);
+
+	span = MIN(span, (cq_time_t) MAX_INT_VAL(int));
+	return rand31_value(span - 1);
+}
+
+static void
+test_insert(struct item *it, int delay)
+{
+	it->set = test_now;
+	it->due = test_now + delay;
+	it->ev = cq_insert(test_cq, delay, test_fire, it);
+}
+
+static void
+test_cancel(struct item *it)
+{
+	test_assert(it->ev != NULL);
+	cq_cancel(&it->ev);
+	it->cancelled = TRUE;
+}
+
+static void
+test_resched(struct item *it, int delay)
+{
+	test_assert(it->ev != NULL);
+	test_assert(cq_resched(it->ev, delay));
+	it->set = test_now;
+	it->due = test_now + delay;
+}
+
+static void
+test_advance(int elapsed)
+{
+	test_prev = test_now;
+	test_now += elapsed;
+	cq_advance(test_cq, elapsed);
+}
+
+/**
+ * Advance the clock by random steps, of widely varying magnitude, until
+ * all the pending events have been triggered.
+ */
+static void
+test_run(struct item *items, size_t cnt)
+{
+	size_t i, expected = 0;
+	cq_time_t last = 0;
+
+	for (i = 0; i < cnt; i++) {
+		if (!items[i].cancelled && !items[i].fired) {
+			expected++;
+			last = MAX(last, items[i].due);
+		}
+	}
+
+	expected += test_fired;
+
+	while (test_now < last) {
+		uint bits = rand31_value(24);
+		int step = 1 + rand31_value((1U << bits) - 1);
+
+		test_advance(step);
+	}
+
+	test_assert(test_fired == expected);
+
+	for (i = 0; i < cnt; i++) {
+		test_assert(items[i].cancelled != items[i].fired);
+		test_assert(NULL == items[i].ev);
+	}
+}
+
+/**
+ * Events spread over all the levels of the wheel, some of them cancelled,
+ * must all trigger at their due time and in order.
+ */
+static void
+test_levels(size_t cnt)
+{
+	struct item *items;
+	cq_info_t info;
+	size_t i;
+
+	test_start("levels");
+	XMALLOC0_ARRAY(items, cnt);
+
+	for (i = 0; i < cnt; i++)
+		test_insert(&items[i], test_delay());
+
+	test_info(&info);
+	test_assert(cnt == info.event_count);
+
+	if (cnt >= 64) {
+		for (i = 0; i < CQ_INFO_LEVELS; i++)
+			test_assert(info.level_count[i] != 0);
+	}
+
+	for (i = 0; i < cnt; i++) {
+		if (0 == rand31_value(7))
+			test_cancel(&items[i]);
+	}
+
+	test_run(items, cnt);
+
+	test_info(&info);
+	test_assert(info.cascade_count != 0 || cnt < 64);
+
+	XFREE_NULL(items);
+	test_done();
+}
+
+/**
+ * Events held in upper levels are cascaded down as time passes: cancel or
+ * reschedule them once cascaded, earlier or later, and check that they only
+ * trigger at their new due time.
+ */
+static void
+test_cascade(size_t cnt)
+{
+	struct item *items;
+	cq_info_t info;
+	cq_time_t first = MAX_INT_VAL(cq_time_t);
+	size_t i;
+
+	test_start("cascade");
+	XMALLOC0_ARRAY(items, cnt);
+
+	/*
+	 * All events are initially held in the same slot of level 2, and are
+	 * due late enough for that slot to be cascaded before any of them
+	 * triggers.
+	 */
+
+	for (i = 0; i < cnt; i++) {
+		int delay = TEST_LEVEL_SPAN(1) + TEST_LEVEL_SPAN(0) +
+			rand31_value(TEST_LEVEL_SPAN(1) - TEST_LEVEL_SPAN(0) - 1);
+
+		test_insert(&items[i], delay);
+		first = MIN(first, items[i].due);
+	}
+
+	test_info(&info);
+	test_assert(cnt == info.level_count[2]);
+
+	/*
+	 * Move right before the first due time: events have now been cascaded
+	 * to lower levels, and none triggered yet.
+	 */
+
+	while (test_now + 1 < first) {
+		int step = 1 + rand31_value(MIN(first - test_now - 1, 100000) - 1);
+
+		test_advance(step);
+	}
+
+	test_info(&info);
+	test_assert(0 == test_fired);
+	test_assert(info.cascaded_count != 0);
+	test_assert(cnt == info.level_count[0] + info.level_count[1]);
+
+	for (i = 0; i < cnt; i++) {
+		struct item *it = &items[i];
+
+		switch (rand31_value(3)) {
+		case 0:
+			test_cancel(it);
+			break;
+		case 1:		/* Earlier, possibly now */
+			test_resched(it, rand31_value(it->due - test_now));
+			break;
+		case 2:		/* Later, possibly back to the upper levels */
+			test_resched(it, test_delay());
+			break;
+		default:	/* Unchanged */
+			break;
+		}
+	}
+
+	test_run(items, cnt);
+
+	XFREE_NULL(items);
+	test_done();
+}
+
+int
+main(int argc, char **argv)
+{
+	extern int optind;
+	extern char *optarg;
+	size_t count = TEST_ITEMS;
+	size_t loops = 1;
+	unsigned rseed = 0;
+	size_t i;
+	int c;
+	const char options[] = "c:hn:R:SV";
+
+	progstart(argc, argv);
+
+	while ((c = getopt(argc, argv, options)) != EOF) {
+		switch (c) {
+		case 'c':			/* amount of events per test */
+			count = atol(optarg);
+			break;
+		case 'n':			/* amount of runs */
+			loops = atol(optarg);
+			break;
+		case 'R':			/* randomize in a repeatable way */
+			rseed = atoi(optarg);
+			break;
+		case 'S':			/* silent mode */
+			silent_mode = TRUE;
+			break;
+		case 'V':			/* verbose mode */
+			verbose_mode = TRUE;
+			break;
+		case 'h':			/* show help */
+		default:
+			usage();
+			break;
+		}
+	}
+
+	if ((argc -= optind) != 0 || 0 == count)
+		usage();
+
+	rand31_set_seed(rseed);
+	initial_seed = rand31_current_seed();
+
+	for (i = 0; i < loops; i++) {
+		test_levels(count);
+		test_cascade(count);
+	}
+
+	if (!silent_mode)
+		printf("All callout queue tests OK.\n");
+
+	return 0;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
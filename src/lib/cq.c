@@ -82,8 +82,9 @@ enum cevent_magic {
 struct cevent {
 	enum cevent_magic ce_magic;	/**< Magic number (must be at the top) */
 	cq_time_t ce_time;			/**< Absolute trigger time (virtual cq time) */
-	struct cevent *ce_bnext;	/**< Next item in hash bucket */
-	struct cevent *ce_bprev;	/**< Prev item in hash bucket */
+	struct cevent *ce_bnext;	/**< Next item in wheel slot */
+	struct cevent *ce_bprev;	/**< Prev item in wheel slot */
+	struct chash *ce_slot;		/**< Wheel slot where event is linked */
 	cqueue_t *ce_cq;			/**< Callout queue where event is registered */
 	cq_service_t ce_fn;			/**< Callback routine */
 	void *ce_arg;				/**< Argument to pass to said callback */
@@ -144,18 +145,26 @@ cevent_has_triggered(const cevent_t *ce)
  *
  * Callout queue descriptor.
  *
- * A callout queue is really a sorted linked list of events that are to
- * happen in the near future, most recent coming first.
+ * A callout queue is a set of events that are to happen in the future,
+ * which we need to trigger in order as time goes by.
  *
- * Naturally, the insertion/deletion of items has to be relatively efficient.
- * We don't want to go through all the items in the list to find the proper
- * position for insertion.
+ * Naturally, the insertion/deletion of items has to be efficient since
+ * we can have hundreds of thousands of pending events, most of them being
+ * timeouts that will be cancelled before they fire.
  *
- * To do that, we maintain a parallel hash list of all the events, each event
- * being inserted in the bucket i, where i is computed by abs_time % size,
- * abs_time being the absolute time where the event is to be triggered
- * and size being the size of the hash list. All the items under the bucket
- * list are further sorted by increasing trigger time.
+ * To do that, events are kept in a hierarchical timing wheel.  Time is first
+ * divided into ticks (see EV_TICK) and the wheel has CQ_WHEEL_LEVELS levels
+ * of CQ_WHEEL_SLOTS slots each.  Level 0 has one slot per tick, and each slot
+ * of level n covers as many ticks as the whole level n-1.  An event is put
+ * in the lowest level whose span covers its trigger tick, measured from the
+ * current wheel position, and within a slot events are not sorted: insertion
+ * and removal are therefore O(1).
+ *
+ * As the wheel position moves forward, the slots of level 0 are expired one
+ * after the other.  Each time level 0 wraps around, the next slot of level 1
+ * is "cascaded", i.e. its events are redistributed in level 0, and so on for
+ * the upper levels.  Cascading is lazy: far away events are only looked at
+ * when time comes close enough to them, and most are cancelled before.
  *
  * To be completely generic, the callout queue "absolute time" is a mere
  * unsigned long value. It can represent an amount of ms, or an amount of
@@ -165,10 +174,16 @@ cevent_has_triggered(const cevent_t *ce)
  */
 
 struct chash {
-	cevent_t *ch_head;			/**< Bucket list head */
-	cevent_t *ch_tail;			/**< Bucket list tail */
+	cevent_t *ch_head;			/**< Slot list head */
+	size_t ch_count;			/**< Amount of events in slot */
 };
 
+#define CQ_WHEEL_BITS	8		/**< Each level has 2^8 slots */
+#define CQ_WHEEL_SLOTS	(1U << CQ_WHEEL_BITS)
+#define CQ_WHEEL_MASK	(CQ_WHEEL_SLOTS - 1)
+#define CQ_WHEEL_LEVELS	CQ_INFO_LEVELS	/**< Spans 2^32 ticks */
+#define CQ_WHEEL_SIZE	(CQ_WHEEL_LEVELS * CQ_WHEEL_SLOTS)
+
 enum cqueue_magic  {
 	CQUEUE_MAGIC    = 0x140332ddU,
 	CSUBQUEUE_MAGIC = 0x64d037feU
@@ -179,8 +194,12 @@ struct cqueue {
 	tm_t cq_last_heartbeat;		/**< Real time of last heartbeat */
 	cq_time_t cq_time;			/**< "current time" */
 	const char *cq_name;		/**< Queue name, for logging */
-	struct chash *cq_hash;		/**< Array of buckets for hash list */
-	struct chash *cq_current;	/**< Current bucket scanned in cq_clock() */
+	struct chash *cq_wheel;		/**< Wheel slots, one level after the other */
+	struct chash *cq_current;	/**< Current slot scanned in cq_clock() */
+	cq_time_t cq_tick;			/**< Wheel position, prior ticks expired */
+	size_t cq_level_items[CQ_WHEEL_LEVELS];	/**< Events held per level */
+	size_t cq_cascades;			/**< Amount of slots cascaded */
+	size_t cq_cascaded;			/**< Amount of events moved by cascades */
 	elist_t cq_periodic;		/**< Periodic events registered */
 	hset_t *cq_idle;			/**< Idle events registered */
 	const cevent_t *cq_call;	/**< Event being called out, for cq_zero() */
@@ -189,7 +208,6 @@ struct cqueue {
 	unsigned cq_stid;			/**< Thread where callout queue runs */
 	int cq_ticks;				/**< Number of cq_clock() calls processed */
 	int cq_items;				/**< Amount of recorded events */
-	int cq_last_bucket;			/**< Last bucket slot we were at */
 	int cq_period;				/**< Regular callout period, in ms */
 	uint8 cq_call_extended;		/**< Is cq_call an extended event? */
 	time_t cq_last_idle;		/**< Last time we ran the idle callbacks */
@@ -206,17 +224,18 @@ cqueue_check(const struct cqueue * const cq)
 	g_assert(CQUEUE_MAGIC == cq->cq_magic || CSUBQUEUE_MAGIC == cq->cq_magic);
 }
 
-#define HASH_SIZE	2048		/**< Hash list size, must be a power of 2 */
-#define HASH_MASK	(HASH_SIZE - 1)
-
 /*
- * The hashing function divides the time by 2^5 or 32, to avoid cq_clock()
- * scanning too many hash buckets each time.  This means our time resolution
+ * The wheel tick is the time divided by 2^5 or 32, to avoid cq_clock()
+ * scanning too many wheel slots each time.  This means our time resolution
  * is at least 32 units.  If we increment cq_clock() with milliseconds, we
  * won't trigger any queue run unless at least 32 milliseconds have elapsed.
  */
-#define EV_HASH(x) (((x) >> 5) & HASH_MASK)
-#define EV_OVER(x) (((x) >> 5) & ~HASH_MASK)
+#define EV_TICK(x)	((x) >> 5)
+
+/*
+ * Slot index at given wheel level for a tick.
+ */
+#define EV_INDEX(t,l)	(((t) >> ((l) * CQ_WHEEL_BITS)) & CQ_WHEEL_MASK)
 
 /**
  * Locking of the callout queue for short period of time, in sections that
@@ -306,14 +325,14 @@ static cqueue_t *
 cq_initialize(cqueue_t *cq, const char *name, cq_time_t now, int period)
 {
 	/*
-	 * The cq_hash hash list is used to speed up insert/delete operations.
+	 * The cq_wheel timing wheel is used to speed up insert/delete operations.
 	 */
 
 	cq->cq_magic = CQUEUE_MAGIC;
 	cq->cq_name = atom_str_get(name);
-	XMALLOC0_ARRAY(cq->cq_hash, HASH_SIZE);
+	XMALLOC0_ARRAY(cq->cq_wheel, CQ_WHEEL_SIZE);
 	cq->cq_time = now;
-	cq->cq_last_bucket = EV_HASH(now);
+	cq->cq_tick = EV_TICK(now);
 	cq->cq_period = period;
 	cq->cq_stid = THREAD_INVALID_ID;
 	mutex_init(&cq->cq_lock);
@@ -528,100 +547,84 @@ ev_free(cevent_t *ev)
 	cevent_check(ev);
 	/* Event must no longer be part of a callout queue list */
 	g_assert(NULL == ev->ce_bnext && NULL == ev->ce_bprev);
+	g_assert(NULL == ev->ce_slot);
 
 	ev_forced_free(ev);
 }
 
 /**
- * Link event into the callout queue.
+ * @return wheel level of a slot.
  */
-static void
-ev_link(cevent_t *ev)
+static inline uint
+cq_slot_level(const cqueue_t *cq, const struct chash *ch)
 {
-	struct chash *ch;		/* Hashing bucket */
-	cq_time_t trigger;		/* Trigger time */
-	cevent_t *hev;			/* To loop through the hash bucket */
-	cqueue_t *cq;
-
-	cevent_check(ev);
-
-	cq = ev->ce_cq;
+	return (ch - cq->cq_wheel) >> CQ_WHEEL_BITS;
+}
 
-	cqueue_check(cq);
-	g_assert(ev->ce_time >= cq->cq_time);
-	g_assert(NULL == ev->ce_bnext && NULL == ev->ce_bprev);
-	assert_mutex_is_owned(&cq->cq_lock);
+/**
+ * Put event in the wheel slot corresponding to its trigger time, relative
+ * to the current wheel position.
+ */
+static void
+ev_place(cqueue_t *cq, cevent_t *ev)
+{
+	cq_time_t tick, delta;
+	struct chash *ch;
+	uint level;
 
-	trigger = ev->ce_time;
-	cq->cq_items++;
-	ch = &cq->cq_hash[EV_HASH(trigger)];
+	tick = EV_TICK(ev->ce_time);
+	g_assert(tick >= cq->cq_tick);
 
-	g_assert(ch != NULL);
+	delta = tick - cq->cq_tick;
 
-	/*
-	 * If bucket is empty, the event is the new head.
-	 */
-
-	if (NULL == ch->ch_head) {
-		g_assert(NULL == ch->ch_tail);
-		ch->ch_tail = ch->ch_head = ev;
-		/* This is a precondition: ev->ce_bnext = ev->ce_bprev = NULL; */
-		return;
+	for (level = 0; level < CQ_WHEEL_LEVELS - 1; level++) {
+		if (delta < (cq_time_t) 1 << ((level + 1) * CQ_WHEEL_BITS))
+			break;
 	}
 
 	/*
-	 * If item is larger than the tail, insert at the end right away.
+	 * Events past the span of the wheel are parked in the furthest slot
+	 * of the last level, and will be put back there when cascaded until
+	 * they come in range.
 	 */
 
-	hev = ch->ch_tail;
+	if G_UNLIKELY(delta >> (CQ_WHEEL_LEVELS * CQ_WHEEL_BITS) != 0)
+		tick = cq->cq_tick + MAX_INT_VAL(uint32);
 
-	cevent_check(hev);
-	g_assert(NULL == hev->ce_bnext);
+	ch = &cq->cq_wheel[(level << CQ_WHEEL_BITS) + EV_INDEX(tick, level)];
 
-	if (trigger >= hev->ce_time) {
-		hev->ce_bnext = ev;
-		/* This is a precondition: ev->ce_bnext = NULL; */
-		ev->ce_bprev = hev;
-		ch->ch_tail = ev;
-		return;
+	ev->ce_slot = ch;
+	ev->ce_bnext = ch->ch_head;
+	if (ch->ch_head != NULL) {
+		cevent_check(ch->ch_head);
+		g_assert(NULL == ch->ch_head->ce_bprev);
+		ch->ch_head->ce_bprev = ev;
 	}
+	ch->ch_head = ev;
+	ch->ch_count++;
+	cq->cq_level_items[level]++;
+}
 
-	/*
-	 * If item is smaller than the head...
-	 */
-
-	hev = ch->ch_head;
-
-	cevent_check(hev);
-	g_assert(NULL == hev->ce_bprev);
+/**
+ * Link event into the callout queue.
+ */
+static void
+ev_link(cevent_t *ev)
+{
+	cqueue_t *cq;
 
-	if (trigger < hev->ce_time) {
-		hev->ce_bprev = ev;
-		ev->ce_bnext = hev;
-		/* This is a precondition: ev->ce_bprev = NULL; */
-		ch->ch_head = ev;
-		return;
-	}
+	cevent_check(ev);
 
-	/*
-	 * Insert before the first item whose trigger will come after ours.
-	 */
+	cq = ev->ce_cq;
 
-	for (hev = hev->ce_bnext; hev != NULL; hev = hev->ce_bnext) {
-		cevent_check(hev);
-		g_assert(hev->ce_bprev != NULL);
-
-		if (trigger < hev->ce_time) {
-			/* Inserting `ev' before `hev', which is not the head of list */
-			hev->ce_bprev->ce_bnext = ev;
-			ev->ce_bprev = hev->ce_bprev;
-			ev->ce_bnext = hev;
-			hev->ce_bprev = ev;
-			return;
-		}
-	}
+	cqueue_check(cq);
+	g_assert(ev->ce_time >= cq->cq_time);
+	g_assert(NULL == ev->ce_bnext && NULL == ev->ce_bprev);
+	g_assert(NULL == ev->ce_slot);
+	assert_mutex_is_owned(&cq->cq_lock);
 
-	g_assert_not_reached();	/* Must have found an event to insert before */
+	cq->cq_items++;
+	ev_place(cq, ev);
 }
 
 /**
@@ -630,7 +633,7 @@ ev_link(cevent_t *ev)
 static void
 ev_unlink(cevent_t *ev)
 {
-	struct chash *ch;			/* Hashing bucket */
+	struct chash *ch;			/* Wheel slot */
 	cqueue_t *cq;
 
 	cevent_check(ev);
@@ -640,54 +643,128 @@ ev_unlink(cevent_t *ev)
 	cqueue_check(cq);
 	assert_mutex_is_owned(&cq->cq_lock);
 
-	ch = &cq->cq_hash[EV_HASH(ev->ce_time)];
+	ch = ev->ce_slot;
 	cq->cq_items--;
 
-	/* Bucket cannot be empty or `ev' is not part of the callout list! */
-	g_assert_log(ch->ch_head != NULL && ch->ch_tail != NULL,
-		"%s(): bucket #%u for ev%s=%p %s(%p) in cq \"%s\" has head=%p, tail=%p",
-		G_STRFUNC, (uint) EV_HASH(ev->ce_time),
-		cevent_is_extended(ev) ? "x" : "", ev,
+	/* Slot cannot be empty or `ev' is not part of the callout list! */
+	g_assert_log(ch != NULL && ch->ch_head != NULL,
+		"%s(): slot %p for ev%s=%p %s(%p) in cq \"%s\" has head=%p",
+		G_STRFUNC, ch, cevent_is_extended(ev) ? "x" : "", ev,
 		stacktrace_function_name(ev->ce_fn), ev->ce_arg, cq->cq_name,
-		ch->ch_head, ch->ch_tail);
-
-	/* Since bucket is not empty, verify pointers are valid */
-	cevent_check(ch->ch_head);
-	cevent_check(ch->ch_tail);
+		NULL == ch ? NULL : ch->ch_head);
 
-	/* Head has no previous, tail has no next, by definition */
-	g_assert(NULL == ch->ch_head->ce_bprev);
-	g_assert(NULL == ch->ch_tail->ce_bnext);
-
-	/*
-	 * Unlinking the item is straigthforward, unlike insertion!
-	 */
+	g_assert(size_is_positive(ch->ch_count));
 
 	if (ch->ch_head == ev) {
 		g_assert(NULL == ev->ce_bprev);
 		ch->ch_head = ev->ce_bnext;
-	}
-	if (ch->ch_tail == ev) {
-		g_assert(NULL == ev->ce_bnext);
-		ch->ch_tail = ev->ce_bprev;
-	}
-
-	if (ev->ce_bprev != NULL) {
+	} else {
 		cevent_check(ev->ce_bprev);
 		ev->ce_bprev->ce_bnext = ev->ce_bnext;
 	}
+
 	if (ev->ce_bnext != NULL) {
 		cevent_check(ev->ce_bnext);
 		ev->ce_bnext->ce_bprev = ev->ce_bprev;
 	}
 
+	ch->ch_count--;
+	cq->cq_level_items[cq_slot_level(cq, ch)]--;
+
 	/* Flag event as removed, for ev_link() assertions */
 	ev->ce_bnext = NULL;
 	ev->ce_bprev = NULL;
+	ev->ce_slot = NULL;
+}
+
+/**
+ * Cascade slot of the wheel, redistributing its events into lower levels.
+ *
+ * @param cq		the callout queue
+ * @param level		the wheel level (not 0)
+ * @param idx		the slot index within the level
+ */
+static void
+cq_wheel_cascade(cqueue_t *cq, uint level, uint idx)
+{
+	struct chash *ch;
+	cevent_t *ev, *next;
+
+	g_assert(level != 0 && level < CQ_WHEEL_LEVELS);
+	assert_mutex_is_owned(&cq->cq_lock);
+
+	ch = &cq->cq_wheel[(level << CQ_WHEEL_BITS) + idx];
+
+	if (NULL == ch->ch_head)
+		return;
+
+	cq->cq_cascades++;
+	cq->cq_cascaded += ch->ch_count;
+	cq->cq_level_items[level] -= ch->ch_count;
 
-	/* Postcondition: head and tail are still correct */
-	g_assert(NULL == ch->ch_head || NULL == ch->ch_head->ce_bprev);
-	g_assert(NULL == ch->ch_tail || NULL == ch->ch_tail->ce_bnext);
+	ev = ch->ch_head;
+	ch->ch_head = NULL;
+	ch->ch_count = 0;
+
+	for (/* empty */; ev != NULL; ev = next) {
+		cevent_check(ev);
+		g_assert(ch == ev->ce_slot);
+
+		next = ev->ce_bnext;
+		ev->ce_bnext = ev->ce_bprev = NULL;
+		ev_place(cq, ev);
+	}
+}
+
+/**
+ * Move the wheel position forward, towards the target tick.
+ *
+ * When the lower levels of the wheel are empty, we jump right to the next
+ * tick where an upper slot needs to be cascaded, or to the target.
+ *
+ * @param cq		the callout queue
+ * @param target	the tick we want to reach
+ */
+static void
+cq_wheel_advance(cqueue_t *cq, cq_time_t target)
+{
+	cq_time_t t = cq->cq_tick;
+	uint level;
+
+	g_assert(t < target);
+	assert_mutex_is_owned(&cq->cq_lock);
+
+	for (level = 0; level < CQ_WHEEL_LEVELS; level++) {
+		if (cq->cq_level_items[level] != 0)
+			break;
+	}
+
+	if G_UNLIKELY(CQ_WHEEL_LEVELS == level) {
+		cq->cq_tick = target;		/* Wheel is empty */
+		return;
+	} else if G_LIKELY(0 == level) {
+		t++;
+	} else {
+		cq_time_t span = (cq_time_t) 1 << (level * CQ_WHEEL_BITS);
+		t = MIN((t | (span - 1)) + 1, target);
+	}
+
+	cq->cq_tick = t;
+
+	/*
+	 * When level 0 wraps around, cascade the next slot of level 1, and
+	 * so on as long as we wrap around at each level.
+	 */
+
+	if (0 == EV_INDEX(t, 0)) {
+		for (level = 1; level < CQ_WHEEL_LEVELS; level++) {
+			uint idx = EV_INDEX(t, level);
+
+			cq_wheel_cascade(cq, level, idx);
+			if (idx != 0)
+				break;
+		}
+	}
 }
 
 /**
@@ -1263,6 +1340,45 @@ cq_replace(cevent_t *ev, cq_service_t fn, void *arg)
 	return TRUE;
 }
 
+/**
+ * Expire the due events held in a level-0 wheel slot.
+ *
+ * @param cq		the callout queue
+ * @param ch		the wheel slot
+ * @param now		the current time
+ *
+ * @return amount of events triggered.
+ */
+static size_t
+cq_wheel_expire(cqueue_t *cq, struct chash *ch, cq_time_t now)
+{
+	cevent_t *ev = ch->ch_head;
+	size_t processed = 0;
+
+	/*
+	 * All the events in the slot are for the same tick, but unless the tick
+	 * is fully elapsed, some could still be in the future.
+	 *
+	 * Because the callbacks are invoked with the queue unlocked, the slot
+	 * can be modified whilst we expire events, hence we restart from the
+	 * head of the slot after each triggered event.
+	 */
+
+	while (ev != NULL) {
+		cevent_check(ev);
+
+		if (ev->ce_time <= now) {
+			cq_expire_internal(cq, ev);
+			processed++;
+			ev = ch->ch_head;
+		} else {
+			ev = ev->ce_bnext;
+		}
+	}
+
+	return processed;
+}
+
 /**
  * The heartbeat of our callout queue.
  *
@@ -1279,13 +1395,10 @@ cq_replace(cevent_t *ev, cq_service_t fn, void *arg)
 static size_t
 cq_clock(cqueue_t *cq, int elapsed)
 {
-	int bucket;
-	int last_bucket, old_last_bucket;
-	struct chash *ch, *old_current;
-	cevent_t *ev;
+	struct chash *old_current;
 	const cevent_t *old_call;
 	bool old_call_extended, force_idle = FALSE;
-	cq_time_t now;
+	cq_time_t now, tick;
 	size_t processed = 0;
 
 	cqueue_check(cq);
@@ -1296,10 +1409,10 @@ cq_clock(cqueue_t *cq, int elapsed)
 	 * Recursive calls are possible: in the middle of an event, we could
 	 * trigger something that will call cq_dispatch() manually for instance.
 	 *
-	 * Therefore, we save the cq_current and cq_last_bucket fields upon
-	 * entry and restore them at the end as appropriate. If cq_current is
-	 * NULL initially, it means we were not in the middle of any recursion
-	 * so we won't have to restore cq_last_bucket.
+	 * Therefore, we save the cq_current field upon entry and restore it at
+	 * the end.  If cq_current is NULL initially, it means we were not in
+	 * the middle of any recursion.  The wheel position is shared: a recursive
+	 * call can only move it forward, which we notice when it comes back.
 	 *
 	 * Note that we enforce recursive calls to cq_clock() to be on the
 	 * same thread due to the use of a mutex. However, each initial run of
@@ -1309,75 +1422,34 @@ cq_clock(cqueue_t *cq, int elapsed)
 	old_current = cq->cq_current;
 	old_call = cq->cq_call;
 	old_call_extended = cq->cq_call_extended;
-	old_last_bucket = cq->cq_last_bucket;
 
 	cq->cq_ticks++;
 	cq->cq_time += elapsed;
 	now = cq->cq_time;
-
-	bucket = cq->cq_last_bucket;		/* Bucket we traversed last time */
-	ch = &cq->cq_hash[bucket];
-	last_bucket = EV_HASH(now);			/* Last bucket to traverse now */
-
-	/*
-	 * If `elapsed' has overflowed the hash size, then we'll need to look at
-	 * all the buckets in the table (wrap around).
-	 */
-
-	if (EV_OVER(elapsed))
-		last_bucket = bucket;
-
-	/*
-	 * Since the hashed time is a not a strictly monotonic function of time,
-	 * we have to rescan the last bucket, in case the earliest event have
-	 * expired now, before moving forward.
-	 */
-
-	cq->cq_current = ch;
-
-	while ((ev = ch->ch_head) && ev->ce_time <= now) {
-		cq_expire_internal(cq, ev);
-		processed++;
-	}
+	tick = EV_TICK(now);
 
 	/*
-	 * If we don't have to move forward (elapsed is too small), we're done.
+	 * Expire the slot at the current wheel position, which can still hold
+	 * events from the previous run if its tick was not fully elapsed, then
+	 * move forward until we reach the current tick.
 	 */
 
-	if (cq->cq_last_bucket == last_bucket && !EV_OVER(elapsed))
-		goto done;
-
-	cq->cq_last_bucket = last_bucket;
-
-	do {
-		ch++;
-		if (++bucket >= HASH_SIZE) {
-			bucket = 0;
-			ch = cq->cq_hash;
-		}
-
-		/*
-		 * Since each bucket is sorted, we can stop our walkthrough as
-		 * soon as we reach an event scheduled after `now'.
-		 */
+	for (;;) {
+		struct chash *ch = &cq->cq_wheel[EV_INDEX(cq->cq_tick, 0)];
 
 		cq->cq_current = ch;
+		processed += cq_wheel_expire(cq, ch, now);
 
-		while ((ev = ch->ch_head) && ev->ce_time <= now) {
-			cq_expire_internal(cq, ev);
-			processed++;
-		}
+		if (cq->cq_tick >= tick)
+			break;
 
-	} while (bucket != last_bucket);
+		cq_wheel_advance(cq, tick);
+	}
 
-done:
 	cq->cq_current = old_current;
 	cq->cq_call = old_call;
 	cq->cq_call_extended = old_call_extended;
 
-	if G_UNLIKELY(old_current != NULL)
-		cq->cq_last_bucket = old_last_bucket;	/* Was in recursive call */
-
 	if (cq_debugging(5)) {
 		s_debug("CQ: %squeue \"%s\" %striggered %zu event%s (%d item%s)",
 			cq->cq_magic == CSUBQUEUE_MAGIC ? "sub" : "",
@@ -1438,8 +1510,7 @@ int
 cq_delay(const cqueue_t *cq)
 {
 	int delay = MAX_INT_VAL(int);
-	int last_bucket;
-	int i;
+	uint level, scanned = 0;
 	cq_time_t now;
 	bool adjusted = FALSE;
 
@@ -1447,36 +1518,47 @@ cq_delay(const cqueue_t *cq)
 
 	mutex_lock_const(&cq->cq_lock);
 
-	last_bucket = cq->cq_last_bucket;	/* Last bucket scanned */
 	now = cq->cq_time;
 
-	for (i = 0; i < HASH_SIZE; i++) {
-		int b = (last_bucket + i) & HASH_MASK;
-		struct chash *ch = &cq->cq_hash[b];
-		cevent_t *ev = ch->ch_head;
-		int edelay;
-
-		/*
-		 * If the delay we have so far is not too large (does not overflow
-		 * the size of the hashing array) and we have moved away from the
-		 * last scanned bucket by an amount that is large-enough, we know
-		 * we cannot find a smaller delay ahead in the buckets.
-		 */
+	/*
+	 * At each level, the first non-empty slot past the wheel position holds
+	 * the earliest events of that level.  However, an upper level can hold
+	 * events scheduled earlier than some in the lower levels, so we need to
+	 * look at all the levels.
+	 *
+	 * The current slot of the upper levels has already been cascaded, hence
+	 * it can only hold events for the next wheel revolution: it comes last.
+	 */
 
-		if (!EV_OVER(delay) && i > EV_HASH(delay))
-			break;
+	for (level = 0; level < CQ_WHEEL_LEVELS && delay != 0; level++) {
+		const struct chash *slots = &cq->cq_wheel[level << CQ_WHEEL_BITS];
+		uint i, idx = EV_INDEX(cq->cq_tick, level);
 
-		if (NULL == ev)
+		if (0 == cq->cq_level_items[level])
 			continue;
 
-		edelay = ev->ce_time - now;
+		if (level != 0)
+			idx++;
+
+		for (i = 0; i < CQ_WHEEL_SLOTS; i++) {
+			const struct chash *ch = &slots[(idx + i) & CQ_WHEEL_MASK];
+			const cevent_t *ev;
 
-		if G_UNLIKELY(edelay <= 0) {
-			delay = 0;
+			scanned++;
+
+			if (NULL == ch->ch_head)
+				continue;
+
+			for (ev = ch->ch_head; ev != NULL; ev = ev->ce_bnext) {
+				if G_UNLIKELY(ev->ce_time <= now) {
+					delay = 0;
+					break;
+				}
+				if (ev->ce_time - now < (cq_time_t) delay)
+					delay = ev->ce_time - now;
+			}
 			break;
 		}
-
-		delay = MIN(delay, edelay);
 	}
 
 	/*
@@ -1504,9 +1586,9 @@ cq_delay(const cqueue_t *cq)
 	mutex_unlock_const(&cq->cq_lock);
 
 	if (cq_debugging(4)) {
-		s_debug("%s(%s): %smin delay is %d, scanned %d bucket%s",
+		s_debug("%s(%s): %smin delay is %d, scanned %u slot%s",
 			G_STRFUNC, cq->cq_name, adjusted ? "adjusted " : "",
-			delay, PLURAL(i));
+			delay, PLURAL(scanned));
 	}
 
 	return delay;
@@ -1619,6 +1701,39 @@ cq_heartbeat(cqueue_t *cq)
 	return triggered;
 }
 
+/**
+ * Advance the virtual time of a callout queue by the specified amount,
+ * triggering all the events that expire.
+ *
+ * This is meant for queues whose time is not tied to the wall clock, such
+ * as in simulations or tests: regular queues are driven by cq_heartbeat().
+ * Like heartbeats, it must always be called from the same thread.
+ *
+ * @param cq		the callout queue
+ * @param elapsed	the elapsed time, in the queue's "virtual time"
+ *
+ * @return the amount of triggered events.
+ */
+size_t
+cq_advance(cqueue_t *cq, int elapsed)
+{
+	uint stid = thread_small_id();
+
+	cqueue_check(cq);
+	g_assert(elapsed >= 0);
+
+	CQ_LOCK(cq);
+
+	if G_UNLIKELY(THREAD_INVALID_ID == cq->cq_stid)
+		cq->cq_stid = stid;
+
+	g_assert_log(stid == cq->cq_stid,
+		"%s(): callout queue \"%s\" used to advance from %s, called from %s",
+		G_STRFUNC, cq->cq_name, thread_id_name(cq->cq_stid), thread_name());
+
+	return cq_clock(cq, elapsed);	/* Releases the mutex */
+}
+
 /**
  * Convenience routine: insert event in the main callout queue.
  *
@@ -2298,7 +2413,7 @@ cq_global_init(void)
 void
 cq_init(cq_invoke_t idle, const uint32 *debug)
 {
-	STATIC_ASSERT(IS_POWER_OF_2(HASH_SIZE));
+	STATIC_ASSERT(CQ_WHEEL_LEVELS * CQ_WHEEL_BITS <= 32);
 
 	/*
 	 * Loudly warn if the callout queue already exists when this routine
@@ -2395,7 +2510,7 @@ cq_free(cqueue_t *cq)
 {
 	cevent_t *ev;
 	cevent_t *ev_next;
-	int i;
+	uint i;
 	struct chash *ch;
 
 	cqueue_check(cq);
@@ -2409,7 +2524,7 @@ cq_free(cqueue_t *cq)
 
 	mutex_lock(&cq->cq_lock);
 
-	for (ch = cq->cq_hash, i = 0; i < HASH_SIZE; i++, ch++) {
+	for (ch = cq->cq_wheel, i = 0; i < CQ_WHEEL_SIZE; i++, ch++) {
 		for (ev = ch->ch_head; ev; ev = ev_next) {
 			ev_next = ev->ce_bnext;
 			ev_forced_free(ev);
@@ -2426,7 +2541,7 @@ cq_free(cqueue_t *cq)
 		hset_free_null(&cq->cq_idle);
 	}
 
-	XFREE_NULL(cq->cq_hash);
+	XFREE_NULL(cq->cq_wheel);
 	atom_str_free_null(&cq->cq_name);
 
 	/*
@@ -2493,6 +2608,30 @@ cq_close(void)
 	}
 }
 
+/**
+ * Fill wheel occupancy statistics for the callout queue.
+ */
+static void
+cq_wheel_occupancy(const cqueue_t *cq, cq_info_t *cqi)
+{
+	uint i;
+
+	assert_mutex_is_owned(&cq->cq_lock);
+
+	for (i = 0; i < CQ_WHEEL_SIZE; i++) {
+		const struct chash *ch = &cq->cq_wheel[i];
+
+		if (0 == ch->ch_count)
+			continue;
+
+		cqi->level_slots[cq_slot_level(cq, ch)]++;
+		cqi->slot_max = MAX(cqi->slot_max, ch->ch_count);
+	}
+
+	for (i = 0; i < CQ_WHEEL_LEVELS; i++)
+		cqi->level_count[i] = cq->cq_level_items[i];
+}
+
 /**
  * Retrieve callout queue information.
  *
@@ -2535,6 +2674,9 @@ cq_info_list(void)
 		cqi->heartbeat_count = cq->cq_ticks;
 		cqi->triggered_count = cq->cq_triggered;
 		cqi->last_idle = cq->cq_last_idle;
+		cqi->cascade_count = cq->cq_cascades;
+		cqi->cascaded_count = cq->cq_cascaded;
+		cq_wheel_occupancy(cq, cqi);
 		CQ_UNLOCK(cq);
 
 		sl = pslist_prepend(sl, cqi);
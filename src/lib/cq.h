@@ -62,6 +62,8 @@ typedef uint64 cq_time_t;		/**< Virtual time for callout queue */
 
 enum cq_info_magic { CQ_INFO_MAGIC = 0x12c867d4 };
 
+#define CQ_INFO_LEVELS	4		/**< Amount of levels in the timing wheel */
+
 /**
  * Callout queue information that can be retrieved.
  */
@@ -77,6 +79,11 @@ typedef struct {
 	size_t triggered_count;		/**< Amount of triggered events */
 	int period;					/**< Period, in ms */
 	time_t last_idle;			/**< Last idle scheduling */
+	size_t level_count[CQ_INFO_LEVELS];	/**< Events held per wheel level */
+	size_t level_slots[CQ_INFO_LEVELS];	/**< Non-empty slots per wheel level */
+	size_t slot_max;			/**< Largest amount of events in a slot */
+	size_t cascade_count;		/**< Amount of wheel slots cascaded */
+	size_t cascaded_count;		/**< Amount of events moved by cascades */
 } cq_info_t;
 
 static inline void
@@ -106,6 +113,7 @@ cevent_t *cq_insert(cqueue_t *cq, int delay, cq_service_t fn, void *arg);
 cevent_t *cq_main_insert(int delay, cq_service_t fn, void *arg);
 cq_time_t cq_remaining(const cevent_t *ev);
 size_t cq_heartbeat(cqueue_t *cq);
+size_t cq_advance(cqueue_t *cq, int elapsed);
 bool cq_expire(cevent_t *ev);
 void cq_zero(cqueue_t *cq, cevent_t **ev_ptr);
 void cq_acknowledge(cqueue_t *cq, cevent_t *ev);
@@ -0,0 +1,519 @@
+/*
+ * digest-test -- SHA-1 and TTH hashing tests and benchmarks.
+ *
+ * Copyright (c) 2026, gtk-gnutella developers
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the authors nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "common.h"
+
+#include "atoms.h"
+#include "compat_misc.h"
+#include "getcpucount.h"
+#include "halloc.h"
+#include "misc.h"
+#include "progname.h"
+#include "random.h"
+#include "sha1.h"
+#include "str.h"
+#include "stringify.h"
+#include "tigertree.h"
+#include "tm.h"
+#include "xmalloc.h"
+
+#define DIGEST_BUF_SIZE		(1024 * 1024)	/* Same as HASH_BUF_SIZE in verify.c */
+#define DIGEST_FILES_MAX	1024			/* Max amount of synthetic files */
+#define DIGEST_BENCH_SIZE	(64 * 1024 * 1024)	/* In-memory benchmarks */
+
+static bool verbose;
+
+static void G_NORETURN
+usage(void)
+{
+	fprintf(stderr,
+			"Usage: %s [-Bhkv] [-d dir] [-n files] [-s MiB] [-t threads]\n"
+			"  -B : skip in-memory SHA-1 and Tigertree benchmarks\n"
+			"  -d : directory where synthetic files are created (default: .)\n"
+			"  -h : prints this help message\n"
+			"  -k : keep synthetic files\n"
+			"  -n : amount of synthetic files (default: 8)\n"
+			"  -t : max amount of Tigertree threads (default: CPU count)\n"
+			"  -s : size of each synthetic file, in MiB (default: 16)\n"
+			"  -v : verbose, show computed hashes\n"
+			, getprogname());
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * Hashes computed over a file.
+ */
+struct digest_result {
+	struct sha1 sha1;
+	struct tth tth;
+};
+
+/**
+ * Benchmark statistics for one hashing strategy.
+ */
+struct digest_stats {
+	uint64 bytes;			/* Bytes read from disk */
+	uint64 data;			/* Bytes of file data fully hashed */
+	double elapsed;			/* Wall-clock time, in seconds */
+};
+
+enum digest_mode {
+	DIGEST_SHA1 = (1 << 0),
+	DIGEST_TTH  = (1 << 1),
+	DIGEST_BOTH = DIGEST_SHA1 | DIGEST_TTH
+};
+
+static char *digest_buf;
+static TTH_CONTEXT *digest_tt;
+
+/**
+ * Create synthetic file of given size, filled with random data.
+ */
+static void
+digest_create(const char *path, filesize_t size)
+{
+	int fd;
+	filesize_t done = 0;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (-1 == fd)
+		s_fatal_exit(EXIT_FAILURE, "can't create \"%s\": %m", path);
+
+	while (done < size) {
+		size_t n = MIN(size - done, DIGEST_BUF_SIZE);
+		ssize_t w;
+
+		random_bytes(digest_buf, n);
+		w = write(fd, digest_buf, n);
+		if (w < 0 || UNSIGNED(w) != n)
+			s_fatal_exit(EXIT_FAILURE, "can't write \"%s\": %m", path);
+		done += n;
+	}
+
+	if (-1 == fsync(fd))
+		s_warning("cannot fsync \"%s\": %m", path);
+
+	close(fd);
+}
+
+/**
+ * Read file once, feeding the selected hashes, the way the verify layer
+ * does it.
+ */
+static void
+digest_file(const char *path, enum digest_mode mode,
+	struct digest_result *r, struct digest_stats *st)
+{
+	SHA1_context sha1;
+	filestat_t buf;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (-1 == fd || -1 == fstat(fd, &buf))
+		s_fatal_exit(EXIT_FAILURE, "can't open \"%s\": %m", path);
+
+	/*
+	 * Evict the file from the page cache, when the OS lets us, so that
+	 * each pass really hits the disk as it would for a new library file.
+	 */
+
+	compat_fadvise_dontneed(fd, 0, 0);
+
+	if (mode & DIGEST_SHA1)
+		SHA1_reset(&sha1);
+	if (mode & DIGEST_TTH)
+		tt_init(digest_tt, buf.st_size);
+
+	for (;;) {
+		ssize_t n = read(fd, digest_buf, DIGEST_BUF_SIZE);
+
+		if (n < 0)
+			s_fatal_exit(EXIT_FAILURE, "can't read \"%s\": %m", path);
+		if (0 == n)
+			break;
+
+		st->bytes += n;
+		if (mode & DIGEST_SHA1)
+			st->data += n;
+		if (mode & DIGEST_SHA1)
+			SHA1_input(&sha1, digest_buf, n);
+		if (mode & DIGEST_TTH)
+			tt_update(digest_tt, digest_buf, n);
+	}
+
+	if (mode & DIGEST_SHA1)
+		SHA1_result(&sha1, &r->sha1);
+	if (mode & DIGEST_TTH)
+		tt_digest(digest_tt, &r->tth);
+
+	close(fd);
+}
+
+/**
+ * Hash in-memory data with the given kernel, feeding it DIGEST_BUF_SIZE
+ * bytes at a time as the verify layer would.
+ *
+ * @return throughput in GiB/s, 0 if kernel is not available.
+ */
+static double
+digest_sha1_kernel(enum sha1_kernel k, const char *mem, struct sha1 *out)
+{
+	SHA1_context ctx;
+	tm_nano_t start, end;
+	size_t off;
+	double elapsed;
+
+	if (!sha1_kernel_force(k))
+		return 0.0;
+
+	SHA1_reset(&ctx);
+	tm_precise_time(&start);
+
+	for (off = 0; off < DIGEST_BENCH_SIZE; off += DIGEST_BUF_SIZE)
+		SHA1_input(&ctx, &mem[off], DIGEST_BUF_SIZE);
+
+	SHA1_result(&ctx, out);
+	tm_precise_time(&end);
+	elapsed = tm_precise_elapsed_f(&end, &start);
+	sha1_kernel_force(SHA1_KERNEL_AUTO);
+
+	return 0.0 == elapsed ? 0.0 :
+		(double) DIGEST_BENCH_SIZE / (1024.0 * 1024.0 * 1024.0) / elapsed;
+}
+
+/**
+ * Benchmark all the SHA-1 kernels the CPU supports and check that they all
+ * compute the same digests.
+ *
+ * @return TRUE if OK.
+ */
+static bool
+digest_sha1_bench(void)
+{
+	struct sha1 ref, got;
+	char *mem;
+	enum sha1_kernel k;
+	bool ok = TRUE;
+
+	STATIC_ASSERT(0 == DIGEST_BENCH_SIZE % DIGEST_BUF_SIZE);
+
+	mem = xmalloc(DIGEST_BENCH_SIZE);
+	random_bytes(mem, DIGEST_BENCH_SIZE);
+
+	printf("SHA-1 kernels, %u MiB:\n", DIGEST_BENCH_SIZE / (1024 * 1024));
+
+	for (k = SHA1_KERNEL_AUTO; k < SHA1_KERNEL_COUNT; k++) {
+		struct sha1 *out = SHA1_KERNEL_AUTO == k ? &ref : &got;
+		double gibs;
+
+		if (!sha1_kernel_available(k)) {
+			printf("%-10s n/a\n", sha1_kernel_name(k));
+			continue;
+		}
+
+		gibs = digest_sha1_kernel(k, mem, out);
+		printf("%-10s %6.3f GiB/s\n", sha1_kernel_name(k), gibs);
+
+		if (out != &ref && 0 != memcmp(&ref, &got, sizeof ref)) {
+			printf("%s kernel computed wrong digest\n", sha1_kernel_name(k));
+			ok = FALSE;
+		}
+	}
+
+	XFREE_NULL(mem);
+	return ok;
+}
+
+/**
+ * Compute TTH of in-memory data, fed in chunks of ``chunk'' bytes.
+ *
+ * @return throughput in MiB/s.
+ */
+static double
+digest_tth_mem(const char *mem, size_t len, size_t chunk, struct tth *out)
+{
+	tm_nano_t start, end;
+	size_t off;
+	double elapsed;
+
+	tm_precise_time(&start);
+
+	tt_init(digest_tt, len);
+	for (off = 0; off < len; off += chunk)
+		tt_update(digest_tt, &mem[off], MIN(chunk, len - off));
+	tt_digest(digest_tt, out);
+
+	tm_precise_time(&end);
+	elapsed = tm_precise_elapsed_f(&end, &start);
+
+	return 0.0 == elapsed ? 0.0 : len / (1024.0 * 1024.0) / elapsed;
+}
+
+/**
+ * Benchmark Tigertree hashing for an increasing amount of threads, checking
+ * that all computed TTH are identical.
+ *
+ * @return TRUE if OK.
+ */
+static bool
+digest_tth_bench(uint max_threads)
+{
+	size_t len = DIGEST_BENCH_SIZE;
+	struct tth ref, got;
+	char *mem;
+	uint t;
+	bool ok = TRUE;
+
+	mem = xmalloc(len);
+	random_bytes(mem, len);
+
+	printf("Tigertree of %zu MiB:\n", len / (1024 * 1024));
+
+	/*
+	 * Feeding less than a leaf at a time prevents batching and mimics the
+	 * original leaf-by-leaf code.
+	 */
+
+	tt_set_threads(1);
+	printf("%-10s %8.1f MiB/s\n", "unbatched",
+		digest_tth_mem(mem, len, TTH_BLOCKSIZE - 1, &ref));
+
+	/*
+	 * Feed DIGEST_BUF_SIZE bytes at a time, as the verify layer does: this
+	 * is what the parallel leaf hashing gets to work with in practice.
+	 */
+
+	for (t = 1; t <= max_threads; t *= 2) {
+		tt_set_threads(t);
+		printf("%2u thread%s %8.1f MiB/s\n", PLURAL(t),
+			digest_tth_mem(mem, len, DIGEST_BUF_SIZE, &got));
+
+		if (!tth_eq(&ref, &got)) {
+			printf("TTH mismatch with %u thread%s\n", PLURAL(t));
+			ok = FALSE;
+		}
+	}
+
+	tt_set_threads(1);
+	XFREE_NULL(mem);
+	return ok;
+}
+
+/**
+ * Hash all the files, either through two separate passes (SHA-1 then TTH,
+ * as done with two distinct verify contexts) or through a single fused pass.
+ */
+static void
+digest_run(char **paths, uint n, bool fused,
+	struct digest_result *res, struct digest_stats *st)
+{
+	tm_nano_t start, end;
+	uint i;
+
+	ZERO(st);
+	tm_precise_time(&start);
+
+	for (i = 0; i < n; i++) {
+		if (fused) {
+			digest_file(paths[i], DIGEST_BOTH, &res[i], st);
+		} else {
+			digest_file(paths[i], DIGEST_SHA1, &res[i], st);
+			digest_file(paths[i], DIGEST_TTH, &res[i], st);
+		}
+	}
+
+	tm_precise_time(&end);
+	st->elapsed = tm_precise_elapsed_f(&end, &start);
+}
+
+static void
+digest_print(const char *what, const struct digest_stats *st)
+{
+	double mib = st->bytes / (1024.0 * 1024.0);
+	double data = st->data / (1024.0 * 1024.0);
+
+	printf("%-10s %10.1f MiB read %8.3f secs %8.1f MiB/s hashed\n",
+		what, mib, st->elapsed,
+		st->elapsed > 0.0 ? data / st->elapsed : 0.0);
+}
+
+int
+main(int argc, char **argv)
+{
+	extern int optind;
+	extern char *optarg;
+	const char *dir = ".";
+	uint files = 8, size = 16, i;
+	bool keep = FALSE, kernels = TRUE;
+	uint threads = getcpucount();
+	char *base, **paths;
+	struct digest_result *sep, *fus, *one;
+	struct digest_stats sst, fst, ost;
+	int c, retval = 0;
+	const char options[] = "Bd:hkn:s:t:v";
+
+	progstart(argc, argv);
+
+	while ((c = getopt(argc, argv, options)) != EOF) {
+		switch (c) {
+		case 'B':
+			kernels = FALSE;
+			break;
+		case 'd':
+			dir = optarg;
+			break;
+		case 'k':
+			keep = TRUE;
+			break;
+		case 'n':
+			files = atoi(optarg);
+			break;
+		case 's':
+			size = atoi(optarg);
+			break;
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 'v':
+			verbose = TRUE;
+			break;
+		case 'h':			/* show help */
+		default:
+			usage();
+			break;
+		}
+	}
+
+	if (argc != optind)
+		usage();
+
+	if (0 == files || files > DIGEST_FILES_MAX || 0 == threads)
+		usage();
+
+	sha1_check();		/* Aborts on failure */
+
+	digest_buf = xmalloc(DIGEST_BUF_SIZE);
+	digest_tt = xmalloc(tt_size());
+
+	tt_check();			/* Aborts on failure */
+
+	if (kernels && !digest_sha1_bench())
+		retval = 1;
+
+	if (kernels && !digest_tth_bench(threads))
+		retval = 1;
+
+	tt_set_threads(threads);
+
+	base = str_cmsg("%s/digest-test.%lu", dir, (ulong) getpid());
+	if (-1 == mkdir(base, S_IRWXU))
+		s_fatal_exit(EXIT_FAILURE, "can't create \"%s\": %m", base);
+
+	XMALLOC_ARRAY(paths, files);
+	XMALLOC0_ARRAY(sep, files);
+	XMALLOC0_ARRAY(fus, files);
+	XMALLOC0_ARRAY(one, files);
+
+	printf("Creating %u synthetic file%s of %u MiB in %s\n",
+		PLURAL(files), size, base);
+
+	for (i = 0; i < files; i++) {
+		paths[i] = str_cmsg("%s/file-%u", base, i);
+		digest_create(paths[i], (filesize_t) size * 1024 * 1024);
+	}
+
+	digest_run(paths, files, FALSE, sep, &sst);
+	digest_run(paths, files, TRUE, fus, &fst);
+
+	/*
+	 * Same fused pass with sequential leaf hashing, to measure what the
+	 * parallel Tigertree leaves bring on the verification path.
+	 */
+
+	tt_set_threads(1);
+	digest_run(paths, files, TRUE, one, &ost);
+	tt_set_threads(threads);
+
+	digest_print("separate", &sst);
+	digest_print("fused", &fst);
+	digest_print("fused, 1T", &ost);
+
+	for (i = 0; i < files; i++) {
+		if (verbose) {
+			printf("%s: sha1=%s tth=%s\n", paths[i],
+				sha1_base32(&fus[i].sha1), tth_base32(&fus[i].tth));
+		}
+		if (
+			!sha1_eq(&sep[i].sha1, &fus[i].sha1) ||
+			!tth_eq(&sep[i].tth, &fus[i].tth) ||
+			!tth_eq(&one[i].tth, &fus[i].tth)
+		) {
+			printf("hash mismatch for %s\n", paths[i]);
+			retval = 1;
+		}
+	}
+
+	if (fst.bytes * 2 != sst.bytes) {
+		printf("fused pass did not halve I/O: %s vs %s bytes\n",
+			uint64_to_string(fst.bytes), uint64_to_string2(sst.bytes));
+		retval = 1;
+	}
+
+	if (fst.elapsed > 0.0) {
+		printf("Speedup: %.2fx\n", sst.elapsed / fst.elapsed);
+		printf("Parallel leaves (%u thread%s) speedup: %.2fx\n",
+			PLURAL(tt_get_threads()), ost.elapsed / fst.elapsed);
+	}
+
+	for (i = 0; i < files; i++) {
+		if (!keep && -1 == unlink(paths[i]))
+			s_warning("can't unlink \"%s\": %m", paths[i]);
+		HFREE_NULL(paths[i]);
+	}
+	if (!keep && -1 == rmdir(base))
+		s_warning("can't remove \"%s\": %m", base);
+
+	HFREE_NULL(base);
+	XFREE_NULL(paths);
+	XFREE_NULL(sep);
+	XFREE_NULL(fus);
+	XFREE_NULL(one);
+	XFREE_NULL(digest_buf);
+	XFREE_NULL(digest_tt);
+
+	if (0 == retval)
+		printf("All OK!\n");
+
+	return retval;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
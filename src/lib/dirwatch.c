@@ -0,0 +1,495 @@
+/*
+ * Copyright (c) 2026, gtk-gnutella developers
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Directory change notifications.
+ *
+ * This is a thin layer over the kernel inotify interface: directories are
+ * registered individually (inotify is not recursive) and changes to their
+ * entries are reported to a single callback, from the main thread, as the
+ * kernel queue is read via the I/O event loop.
+ *
+ * When the kernel does not support inotify, dirwatch_is_supported() returns
+ * FALSE and dirwatch_make() returns NULL, so that callers can fall back to
+ * periodic full scans.
+ *
+ * @author gtk-gnutella developers
+ * @date 2026
+ */
+
+#include "common.h"
+
+#ifdef HAS_INOTIFY
+#include <sys/inotify.h>
+#endif
+
+#include "dirwatch.h"
+
+#include "atoms.h"
+#include "fd.h"
+#include "halloc.h"
+#include "htable.h"
+#include "inputevt.h"
+#include "mutex.h"
+#include "path.h"
+#include "walloc.h"
+
+#include "override.h"		/* Must be the last header included */
+
+#ifdef HAS_INOTIFY
+
+#define DIRWATCH_BUFLEN		16384	/**< Size of the event reading buffer */
+
+/**
+ * Events we want to hear about for each watched directory.
+ */
+#define DIRWATCH_MASK	\
+	(IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_ATTRIB | \
+	 IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | \
+	 IN_ONLYDIR)
+
+enum dirwatch_magic { DIRWATCH_MAGIC = 0x3e1c07a5 };
+
+/**
+ * A directory watcher.
+ */
+struct dirwatch {
+	enum dirwatch_magic magic;	/**< Magic number */
+	int fd;						/**< The inotify file descriptor */
+	unsigned event_id;			/**< I/O event registration ID */
+	htable_t *by_wd;			/**< watch descriptor -> directory (atom) */
+	htable_t *by_dir;			/**< directory (atom) -> watch descriptor */
+	dirwatch_cb_t cb;			/**< Callback to invoke on changes */
+	void *udata;				/**< Opaque argument for callback */
+	char *buf;					/**< Event reading buffer */
+	mutex_t lock;				/**< Thread-safe lock for the tables */
+};
+
+static inline void
+dirwatch_check(const struct dirwatch * const dw)
+{
+	g_assert(dw != NULL);
+	g_assert(DIRWATCH_MAGIC == dw->magic);
+}
+
+#define DIRWATCH_LOCK(d)	mutex_lock(&(d)->lock)
+#define DIRWATCH_UNLOCK(d)	mutex_unlock(&(d)->lock)
+
+/**
+ * Forget about a watch descriptor that the kernel has already removed.
+ */
+static void
+dirwatch_forget_wd(dirwatch_t *dw, int wd)
+{
+	const char *dir;
+
+	DIRWATCH_LOCK(dw);
+	dir = htable_lookup(dw->by_wd, int_to_pointer(wd));
+	if (dir != NULL) {
+		if (pointer_to_int(htable_lookup(dw->by_dir, dir)) == wd)
+			htable_remove(dw->by_dir, dir);
+		htable_remove(dw->by_wd, int_to_pointer(wd));
+		atom_str_free(dir);
+	}
+	DIRWATCH_UNLOCK(dw);
+}
+
+/**
+ * Dispatch one inotify event to the user callback.
+ */
+static void
+dirwatch_dispatch(dirwatch_t *dw, const struct inotify_event *ie)
+{
+	const char *dir;
+
+	if (ie->mask & IN_Q_OVERFLOW) {
+		(*dw->cb)(DIRWATCH_OVERFLOW, NULL, FALSE, dw->udata);
+		return;
+	}
+
+	if (ie->mask & IN_IGNORED) {
+		dirwatch_forget_wd(dw, ie->wd);
+		return;
+	}
+
+	DIRWATCH_LOCK(dw);
+	dir = htable_lookup(dw->by_wd, int_to_pointer(ie->wd));
+	if (dir != NULL)
+		dir = atom_str_get(dir);
+	DIRWATCH_UNLOCK(dw);
+
+	if (NULL == dir)
+		return;		/* Removed whilst event was queued */
+
+	if (ie->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+		/*
+		 * The directory itself went away.  A move leaves the watch in place
+		 * but its recorded path is now stale, hence we drop it.  The parent
+		 * directory, if watched, will also report the entry.
+		 */
+
+		if (ie->mask & IN_MOVE_SELF)
+			dirwatch_remove(dw, dir);
+		(*dw->cb)(DIRWATCH_REMOVED, dir, TRUE, dw->udata);
+	} else if (ie->len != 0 && ie->name[0] != '\0') {
+		char *path = make_pathname(dir, ie->name);
+		bool is_dir = booleanize(ie->mask & IN_ISDIR);
+
+		if (ie->mask & (IN_DELETE | IN_MOVED_FROM)) {
+			if (is_dir)
+				dirwatch_remove(dw, path);
+			(*dw->cb)(DIRWATCH_REMOVED, path, is_dir, dw->udata);
+		} else {
+			(*dw->cb)(DIRWATCH_CHANGED, path, is_dir, dw->udata);
+		}
+		HFREE_NULL(path);
+	}
+
+	atom_str_free(dir);
+}
+
+/**
+ * I/O callback invoked when the inotify descriptor is readable.
+ */
+static void
+dirwatch_read(void *data, int unused_source, inputevt_cond_t unused_cond)
+{
+	dirwatch_t *dw = data;
+
+	(void) unused_source;
+	(void) unused_cond;
+
+	dirwatch_check(dw);
+
+	for (;;) {
+		ssize_t r;
+		const char *p, *end;
+
+		r = read(dw->fd, dw->buf, DIRWATCH_BUFLEN);
+
+		if (-1 == r) {
+			if (!is_temporary_error(errno))
+				s_warning("%s(): read error on inotify descriptor: %m", G_STRFUNC);
+			break;
+		}
+		if (0 == r)
+			break;
+
+		p = dw->buf;
+		end = p + r;
+
+		while (ptr_diff(end, p) >= sizeof(struct inotify_event)) {
+			const struct inotify_event *ie = (const void *) p;
+			size_t len = sizeof *ie + ie->len;
+
+			if (ptr_diff(end, p) < len)
+				break;		/* Truncated event, cannot happen */
+
+			dirwatch_dispatch(dw, ie);
+			p += len;
+		}
+	}
+}
+
+/**
+ * Are directory watches supported on this system?
+ */
+bool
+dirwatch_is_supported(void)
+{
+	return TRUE;
+}
+
+/**
+ * Create a new directory watcher.
+ *
+ * This must be called from the main thread, since events are dispatched
+ * through the main I/O event loop.
+ *
+ * @param cb		callback to invoke on changes
+ * @param udata		opaque argument for callback
+ *
+ * @return new watcher, NULL if the kernel refused to create one.
+ */
+dirwatch_t *
+dirwatch_make(dirwatch_cb_t cb, void *udata)
+{
+	dirwatch_t *dw;
+	int fd;
+
+	g_assert(cb != NULL);
+
+	fd = inotify_init();
+	if (-1 == fd) {
+		s_warning("%s(): cannot create inotify descriptor: %m", G_STRFUNC);
+		return NULL;
+	}
+
+	fd = fd_get_non_stdio(fd);
+	fd_set_close_on_exec(fd);
+	fd_set_nonblocking(fd);
+
+	WALLOC0(dw);
+	dw->magic = DIRWATCH_MAGIC;
+	dw->fd = fd;
+	dw->cb = cb;
+	dw->udata = udata;
+	dw->by_wd = htable_create(HASH_KEY_SELF, 0);
+	dw->by_dir = htable_create(HASH_KEY_STRING, 0);
+	dw->buf = halloc(DIRWATCH_BUFLEN);
+	mutex_init(&dw->lock);
+	dw->event_id = inputevt_add(fd, INPUT_EVENT_RX, dirwatch_read, dw);
+
+	return dw;
+}
+
+static void
+dirwatch_free_dir(const void *key, void *unused_value, void *unused_data)
+{
+	(void) unused_value;
+	(void) unused_data;
+
+	atom_str_free(key);
+}
+
+/**
+ * Destroy directory watcher and nullify its pointer.
+ */
+void
+dirwatch_free_null(dirwatch_t **dw_ptr)
+{
+	dirwatch_t *dw = *dw_ptr;
+
+	if (dw != NULL) {
+		dirwatch_check(dw);
+
+		inputevt_remove(&dw->event_id);
+		fd_forget_and_close(&dw->fd);	/* Drops all kernel watches */
+
+		/* Atoms are referenced once through by_dir and once through by_wd */
+
+		htable_foreach(dw->by_dir, dirwatch_free_dir, NULL);
+		htable_foreach(dw->by_wd, dirwatch_free_dir, NULL);
+		htable_free_null(&dw->by_dir);
+		htable_free_null(&dw->by_wd);
+		HFREE_NULL(dw->buf);
+		mutex_destroy(&dw->lock);
+		dw->magic = 0;
+		WFREE(dw);
+		*dw_ptr = NULL;
+	}
+}
+
+/**
+ * Start watching a directory.
+ *
+ * Watching a directory that is already watched is harmless.
+ *
+ * @return 0 if OK, -1 on error with errno set (ENOSPC when the kernel limit
+ * on the amount of watches has been reached).
+ */
+int
+dirwatch_add(dirwatch_t *dw, const char *dir)
+{
+	int wd;
+	const char *old;
+	const void *key;
+	void *value;
+
+	dirwatch_check(dw);
+	g_assert(dir != NULL);
+
+	wd = inotify_add_watch(dw->fd, dir, DIRWATCH_MASK);
+	if (-1 == wd)
+		return -1;
+
+	DIRWATCH_LOCK(dw);
+
+	/*
+	 * The same directory can be reached through different paths, in which
+	 * case the kernel hands out the same watch descriptor: the last path
+	 * registered is the one we report.
+	 */
+
+	old = htable_lookup(dw->by_wd, int_to_pointer(wd));
+	if (old != NULL) {
+		if (0 == strcmp(old, dir)) {
+			DIRWATCH_UNLOCK(dw);
+			return 0;
+		}
+		if (pointer_to_int(htable_lookup(dw->by_dir, old)) == wd) {
+			htable_remove(dw->by_dir, old);
+			atom_str_free(old);
+		}
+		htable_remove(dw->by_wd, int_to_pointer(wd));
+		atom_str_free(old);
+	}
+
+	if (htable_lookup_extended(dw->by_dir, dir, &key, &value)) {
+		htable_remove(dw->by_dir, key);
+		atom_str_free(key);
+	}
+
+	htable_insert_const(dw->by_wd, int_to_pointer(wd), atom_str_get(dir));
+	htable_insert(dw->by_dir, atom_str_get(dir), int_to_pointer(wd));
+
+	DIRWATCH_UNLOCK(dw);
+
+	return 0;
+}
+
+/**
+ * Stop watching a directory, if it was watched.
+ */
+void
+dirwatch_remove(dirwatch_t *dw, const char *dir)
+{
+	const void *key;
+	void *value;
+	int wd = -1;
+
+	dirwatch_check(dw);
+	g_assert(dir != NULL);
+
+	DIRWATCH_LOCK(dw);
+	if (htable_lookup_extended(dw->by_dir, dir, &key, &value)) {
+		const char *d;
+
+		wd = pointer_to_int(value);
+		htable_remove(dw->by_dir, key);
+		atom_str_free(key);
+
+		d = htable_lookup(dw->by_wd, value);
+		if (d != NULL) {
+			htable_remove(dw->by_wd, value);
+			atom_str_free(d);
+		}
+	}
+	DIRWATCH_UNLOCK(dw);
+
+	/*
+	 * The kernel will still queue an IN_IGNORED event for the descriptor,
+	 * which will be ignored since the watch descriptor is now unknown.
+	 */
+
+	if (wd != -1)
+		inotify_rm_watch(dw->fd, wd);
+}
+
+/**
+ * Is directory being watched?
+ */
+bool
+dirwatch_contains(const dirwatch_t *dw, const char *dir)
+{
+	bool found;
+
+	dirwatch_check(dw);
+
+	mutex_lock_const(&dw->lock);
+	found = htable_contains(dw->by_dir, dir);
+	mutex_unlock_const(&dw->lock);
+
+	return found;
+}
+
+/**
+ * @return amount of watched directories.
+ */
+size_t
+dirwatch_count(const dirwatch_t *dw)
+{
+	size_t n;
+
+	dirwatch_check(dw);
+
+	mutex_lock_const(&dw->lock);
+	n = htable_count(dw->by_dir);
+	mutex_unlock_const(&dw->lock);
+
+	return n;
+}
+
+#else	/* !HAS_INOTIFY */
+
+bool
+dirwatch_is_supported(void)
+{
+	return FALSE;
+}
+
+dirwatch_t *
+dirwatch_make(dirwatch_cb_t cb, void *udata)
+{
+	(void) cb;
+	(void) udata;
+
+	return NULL;
+}
+
+void
+dirwatch_free_null(dirwatch_t **dw_ptr)
+{
+	g_assert(NULL == *dw_ptr);
+}
+
+int
+dirwatch_add(dirwatch_t *dw, const char *dir)
+{
+	(void) dw;
+	(void) dir;
+
+	errno = ENOTSUP;
+	return -1;
+}
+
+void
+dirwatch_remove(dirwatch_t *dw, const char *dir)
+{
+	(void) dw;
+	(void) dir;
+}
+
+bool
+dirwatch_contains(const dirwatch_t *dw, const char *dir)
+{
+	(void) dw;
+	(void) dir;
+
+	return FALSE;
+}
+
+size_t
+dirwatch_count(const dirwatch_t *dw)
+{
+	(void) dw;
+
+	return 0;
+}
+
+#endif	/* HAS_INOTIFY */
+
+/* vi: set ts=4 sw=4 cindent: */
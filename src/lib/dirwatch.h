@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2026, gtk-gnutella developers
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Directory change notifications.
+ *
+ * @author gtk-gnutella developers
+ * @date 2026
+ */
+
+#ifndef _dirwatch_h_
+#define _dirwatch_h_
+
+#include "common.h"
+
+/**
+ * Events reported for a watched directory.
+ */
+typedef enum dirwatch_event {
+	DIRWATCH_CHANGED = 0,	/**< Entry created, written to or moved in */
+	DIRWATCH_REMOVED,		/**< Entry deleted or moved out */
+	DIRWATCH_OVERFLOW		/**< Kernel queue overflowed, events were lost */
+} dirwatch_event_t;
+
+/**
+ * The callback invoked, from the main thread, for each reported change.
+ *
+ * The path is that of the changed entry, NULL for DIRWATCH_OVERFLOW.
+ * The is_dir flag tells whether the entry is a directory.
+ */
+typedef void (*dirwatch_cb_t)(
+	dirwatch_event_t ev, const char *path, bool is_dir, void *udata);
+
+typedef struct dirwatch dirwatch_t;
+
+/*
+ * Public interface.
+ */
+
+bool dirwatch_is_supported(void);
+dirwatch_t *dirwatch_make(dirwatch_cb_t cb, void *udata);
+void dirwatch_free_null(dirwatch_t **dw_ptr);
+int dirwatch_add(dirwatch_t *dw, const char *dir);
+void dirwatch_remove(dirwatch_t *dw, const char *dir);
+bool dirwatch_contains(const dirwatch_t *dw, const char *dir);
+size_t dirwatch_count(const dirwatch_t *dw);
+
+#endif /* _dirwatch_h_ */
+
+/* vi: set ts=4 sw=4 cindent: */
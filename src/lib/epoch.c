@@ -0,0 +1,404 @@
+/*
+ * Copyright (c) 2026, gtk-gnutella developers
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Epoch-based memory reclamation.
+ *
+ * Each domain has a global epoch counter and one reader slot per thread.
+ * A thread entering a read-side section publishes the global epoch it saw
+ * in its slot, and clears the slot when leaving.
+ *
+ * Memory retired at epoch E can still be reached by readers that entered
+ * at epoch E (or E - 1, if they saw the old counter just before it moved).
+ * The global epoch can only move forward when all the active readers have
+ * seen its current value, hence once it reaches E + 2 no reader can see
+ * anything that was retired at E.
+ *
+ * Reclamation happens when enough items were retired, and periodically from
+ * the main callout queue so that a lone retired item does not linger.
+ *
+ * @author gtk-gnutella developers
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "epoch.h"
+
+#include "atomic.h"
+#include "cq.h"
+#include "spinlock.h"
+#include "thread.h"
+#include "vmm.h"
+#include "walloc.h"
+
+#include "override.h"		/* Must be the last header included */
+
+#define EPOCH_CACHELINE		64		/**< Amount of bytes in a CPU cacheline */
+#define EPOCH_RETIRE_BATCH	64		/**< Reclaim once that many items retired */
+#define EPOCH_CALLOUT		1000	/**< Periodic reclaim every second */
+
+enum epoch_magic { EPOCH_MAGIC = 0x0c7a5e91 };
+
+struct epoch_reader {
+	uint epoch;					/**< Epoch seen at entry, 0 when not reading */
+	uint depth;					/**< Nesting depth of read-side sections */
+} G_ALIGNED(EPOCH_CACHELINE);
+
+struct epoch_retired {
+	struct epoch_retired *next;	/**< Next retired item */
+	void *p;					/**< Retired memory */
+	free_fn_t fn;				/**< Freeing routine for ``p'' */
+	uint epoch;					/**< Epoch at which memory was retired */
+};
+
+/*
+ * The reader slots come right after the read-mostly fields so that they do
+ * not share a cacheline with the fields updated by writers.
+ */
+struct epoch {
+	enum epoch_magic magic;
+	uint current;				/**< Global epoch, never 0 */
+	const char *name;			/**< Domain name, for logging */
+	cperiodic_t *reclaim_ev;	/**< Periodic reclamation */
+	struct epoch_reader readers[THREAD_MAX];
+	spinlock_t lock;			/**< Protects retired list */
+	struct epoch_retired *retired;	/**< Retired items, newest first */
+	size_t count;				/**< Amount of retired items */
+};
+
+static inline void
+epoch_check(const struct epoch * const ep)
+{
+	g_assert(ep != NULL);
+	g_assert(EPOCH_MAGIC == ep->magic);
+}
+
+#define EPOCH_LOCK(e)		spinlock(&(e)->lock)
+#define EPOCH_UNLOCK(e)		spinunlock(&(e)->lock)
+
+/**
+ * @return the reader slot of the current thread.
+ */
+static inline struct epoch_reader *
+epoch_reader(epoch_t *ep)
+{
+	uint stid = thread_small_id();
+
+	g_assert(stid < N_ITEMS(ep->readers));
+
+	return &ep->readers[stid];
+}
+
+/**
+ * Periodic reclamation callback.
+ */
+static bool
+epoch_reclaim_periodic(void *obj)
+{
+	epoch_t *ep = obj;
+
+	epoch_check(ep);
+
+	if (0 != ep->count)
+		(void) epoch_reclaim(ep);
+
+	return TRUE;		/* Keep calling */
+}
+
+/**
+ * Create a new reclamation domain.
+ *
+ * @param name		the domain name, for logging (static string)
+ *
+ * @return a new domain, to be freed with epoch_free_null().
+ */
+epoch_t *
+epoch_make(const char *name)
+{
+	epoch_t *ep;
+
+	/*
+	 * Allocating a whole page guarantees the alignment of the reader slots.
+	 */
+
+	ep = vmm_alloc0(sizeof *ep);
+	ep->magic = EPOCH_MAGIC;
+	ep->current = 1;
+	ep->name = name;
+	spinlock_init(&ep->lock);
+	ep->reclaim_ev = cq_periodic_main_add(EPOCH_CALLOUT,
+		epoch_reclaim_periodic, ep);
+
+	return ep;
+}
+
+/**
+ * Free the reclamation domain and nullify its pointer.
+ *
+ * All the retired memory is freed first, waiting for readers to leave their
+ * read-side section if necessary.
+ */
+void
+epoch_free_null(epoch_t **ep_ptr)
+{
+	epoch_t *ep = *ep_ptr;
+
+	if (ep != NULL) {
+		epoch_check(ep);
+
+		cq_periodic_remove(&ep->reclaim_ev);
+		epoch_synchronize(ep);
+		spinlock_destroy(&ep->lock);
+		ep->magic = 0;
+		vmm_free(ep, sizeof *ep);
+		*ep_ptr = NULL;
+	}
+}
+
+/**
+ * Enter read-side section.
+ *
+ * Until the matching epoch_leave(), the calling thread can dereference any
+ * pointer it reads from data protected by this domain: memory retired in
+ * the meantime will not be freed.
+ */
+void
+epoch_enter(epoch_t *ep)
+{
+	struct epoch_reader *r;
+
+	epoch_check(ep);
+
+	r = epoch_reader(ep);
+
+	if G_LIKELY(0 == r->depth++) {
+		uint e;
+
+		/*
+		 * Make sure the epoch we publish is still the current one once
+		 * it is visible to other threads.
+		 */
+
+		do {
+			e = ep->current;
+			r->epoch = e;
+			atomic_mb();
+		} while G_UNLIKELY(e != ep->current);
+	}
+}
+
+/**
+ * Leave read-side section.
+ *
+ * Pointers read within the section must no longer be used, unless the
+ * objects they refer to were otherwise referenced.
+ */
+void
+epoch_leave(epoch_t *ep)
+{
+	struct epoch_reader *r;
+
+	epoch_check(ep);
+
+	r = epoch_reader(ep);
+
+	g_assert_log(r->depth != 0,
+		"%s(): not in a read-side section of \"%s\"", G_STRFUNC, ep->name);
+
+	if G_LIKELY(0 == --r->depth) {
+		atomic_mb();
+		r->epoch = 0;
+	}
+}
+
+/**
+ * Try to move the global epoch forward.
+ *
+ * @return the current epoch.
+ */
+static uint
+epoch_advance(epoch_t *ep)
+{
+	uint e = ep->current, i;
+
+	atomic_mb();
+
+	for (i = 0; i < N_ITEMS(ep->readers); i++) {
+		uint re = ep->readers[i].epoch;
+
+		if (re != 0 && re != e)
+			return e;	/* Reader still active in a previous epoch */
+	}
+
+	if G_UNLIKELY(0 == ++e)
+		e = 1;			/* Epoch 0 means "not reading" */
+
+	ep->current = e;
+	atomic_mb();
+
+	return e;
+}
+
+/**
+ * Attempt to release retired memory.
+ *
+ * @param ep		the reclamation domain
+ * @param wait		whether to wait for a concurrent reclamation
+ *
+ * @return the amount of retired items that could not be freed yet.
+ */
+static size_t
+epoch_reclaim_internal(epoch_t *ep, bool wait)
+{
+	struct epoch_retired *er, *next, *keep = NULL, *dead = NULL;
+	size_t left;
+	uint e;
+
+	if (wait)
+		EPOCH_LOCK(ep);
+	else if (!spinlock_try(&ep->lock))
+		return ep->count;		/* Another thread is reclaiming or retiring */
+
+	/*
+	 * Two epoch changes are needed before memory retired in the current
+	 * epoch can be freed, so try to advance twice: if there are no readers
+	 * we can free everything at once.
+	 */
+
+	(void) epoch_advance(ep);
+	e = epoch_advance(ep);
+
+	for (er = ep->retired; er != NULL; er = next) {
+		next = er->next;
+		if ((int) (e - er->epoch) >= 2) {
+			er->next = dead;
+			dead = er;
+			ep->count--;
+		} else {
+			er->next = keep;
+			keep = er;
+		}
+	}
+
+	ep->retired = keep;
+	left = ep->count;
+	EPOCH_UNLOCK(ep);
+
+	/*
+	 * Free outside the lock: freeing routines can retire more memory.
+	 */
+
+	for (er = dead; er != NULL; er = next) {
+		next = er->next;
+		(*er->fn)(er->p);
+		WFREE(er);
+	}
+
+	return left;
+}
+
+/**
+ * Hand memory that readers may still be accessing.
+ *
+ * The memory must no longer be reachable from the shared data structures:
+ * only readers already in their read-side section may still see it.
+ *
+ * @param ep		the reclamation domain
+ * @param p			the memory to release
+ * @param fn		the routine to free ``p'' once no reader can access it
+ */
+void
+epoch_retire(epoch_t *ep, void *p, free_fn_t fn)
+{
+	struct epoch_retired *er;
+	size_t count;
+
+	epoch_check(ep);
+	g_assert(fn != NULL);
+
+	if (NULL == p)
+		return;
+
+	WALLOC(er);
+	er->p = p;
+	er->fn = fn;
+
+	EPOCH_LOCK(ep);
+	er->epoch = ep->current;
+	er->next = ep->retired;
+	ep->retired = er;
+	count = ++ep->count;
+	EPOCH_UNLOCK(ep);
+
+	if (count >= EPOCH_RETIRE_BATCH)
+		(void) epoch_reclaim_internal(ep, FALSE);
+}
+
+/**
+ * Attempt to free the retired memory that no reader can access any more.
+ *
+ * @return the amount of retired items that could not be freed yet.
+ */
+size_t
+epoch_reclaim(epoch_t *ep)
+{
+	epoch_check(ep);
+
+	return epoch_reclaim_internal(ep, FALSE);
+}
+
+/**
+ * Wait until all the memory retired so far is freed.
+ *
+ * This must not be called from within a read-side section of the domain,
+ * which would deadlock.
+ */
+void
+epoch_synchronize(epoch_t *ep)
+{
+	epoch_check(ep);
+
+	g_assert_log(0 == epoch_reader(ep)->depth,
+		"%s(): called within a read-side section of \"%s\"",
+		G_STRFUNC, ep->name);
+
+	while (0 != epoch_reclaim_internal(ep, TRUE))
+		thread_yield();
+}
+
+/**
+ * @return the amount of retired items not freed yet.
+ */
+size_t
+epoch_pending(const epoch_t *ep)
+{
+	epoch_check(ep);
+
+	return ep->count;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2026, gtk-gnutella developers
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Epoch-based memory reclamation.
+ *
+ * This lets threads read shared data structures without taking any lock nor
+ * updating any reference count, which would bounce the same cacheline between
+ * all the CPUs.  Readers only flag that they are reading, in a slot that is
+ * private to their thread.
+ *
+ * Writers still serialize among themselves by their own means.  They publish
+ * a new version of the data by swapping a pointer, and hand the old version
+ * to epoch_retire(): it will only be freed once all the readers that could
+ * still see it have left their read-side section.
+ *
+ * Read-side sections can be nested but must not block for long, as they
+ * delay the reclamation of all the memory retired in the same domain.
+ *
+ * Here is our API:
+ *
+ *		epoch_make()			-- create a new reclamation domain
+ *		epoch_free_null()		-- reclaim everything and free the domain
+ *		epoch_enter()			-- enter read-side section
+ *		epoch_leave()			-- leave read-side section
+ *		epoch_retire()			-- defer freeing until no reader can see data
+ *		epoch_reclaim()			-- attempt to free retired data
+ *		epoch_synchronize()		-- wait until all retired data is freed
+ *		epoch_pending()			-- amount of retired items not yet freed
+ *
+ * @author gtk-gnutella developers
+ * @date 2026
+ */
+
+#ifndef _epoch_h_
+#define _epoch_h_
+
+typedef struct epoch epoch_t;
+
+/*
+ * Public interface.
+ */
+
+epoch_t *epoch_make(const char *name);
+void epoch_free_null(epoch_t **ep_ptr);
+
+void epoch_enter(epoch_t *ep);
+void epoch_leave(epoch_t *ep);
+
+void epoch_retire(epoch_t *ep, void *p, free_fn_t fn);
+size_t epoch_reclaim(epoch_t *ep);
+void epoch_synchronize(epoch_t *ep);
+size_t epoch_pending(const epoch_t *ep);
+
+#endif /* _epoch_h_ */
+
+/* vi: set ts=4 sw=4 cindent: */
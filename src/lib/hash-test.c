@@ -0,0 +1,429 @@
+/*
+ * hash-test -- hash set tests and benchmarking.
+ *
+ * Copyright (c) 2026 gtk-gnutella developers
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the authors nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "common.h"
+
+#include "lib/hikset.h"
+#include "lib/htable.h"
+#include "lib/misc.h"
+#include "lib/progname.h"
+#include "lib/rand31.h"
+#include "lib/stringify.h"
+#include "lib/tm.h"
+#include "lib/xmalloc.h"
+
+#define TEST_BITS_MIN	8		/* Smallest default set: 256 items */
+#define TEST_BITS_MAX	20		/* Largest default set: 1M items */
+#define TEST_BITS_STEP	3
+
+static bool silent_mode, verbose_mode, chrono, huge;
+static unsigned initial_seed;
+static const char *current_test;
+static const char *current_engine;
+
+struct item {
+	const void *key;
+	bool present;
+};
+
+static void G_NORETURN
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-hHtSV] [-c items] [-n loops] [-R seed]\n"
+		"  -c : sets item count to test\n"
+		"  -h : prints this help message\n"
+		"  -H : back large sets with huge pages\n"
+		"  -n : sets amount of operations in mixed tests, per item\n"
+		"  -t : time each test\n"
+		"  -R : seed for repeatable random key sequence\n"
+		"  -S : silent mode -- do not print anything for successful tests\n"
+		"  -V : verbose mode -- print status after each successful test\n"
+		, getprogname());
+	exit(EXIT_FAILURE);
+}
+
+static void G_NORETURN
+test_abort(void)
+{
+	if (current_test != NULL)
+		printf("%7s - %s - FAILED\n", current_engine, current_test);
+	printf("use '-R %u' to reproduce problem.\n", initial_seed);
+	abort();
+}
+
+#define test_assert(x) G_STMT_START {			\
+	if G_UNLIKELY(!(x)) {						\
+		printf("assertion \"%s\" failed at %s:%d\n",	\
+			#x, __FILE__, __LINE__);					\
+		test_abort();							\
+	}											\
+} G_STMT_END
+
+/**
+ * Create the items, with distinct random keys.
+ *
+ * The item count is doubled: half of the items are never inserted and
+ * serve for unsuccessful lookups.
+ */
+static struct item *
+generate_items(size_t cnt)
+{
+	struct item *items;
+	size_t i;
+	uint32 salt = rand31_u32() | 1;
+
+	XMALLOC0_ARRAY(items, 2 * cnt);
+
+	/*
+	 * Multiplying by an odd number is a bijection modulo 2^32, hence the
+	 * keys are distinct.
+	 */
+
+	for (i = 0; i < 2 * cnt; i++)
+		items[i].key = uint_to_pointer((i + 1) * salt);
+
+	return items;
+}
+
+static hikset_t *
+set_create(bool groups)
+{
+	hikset_t *hs;
+
+	hs = hikset_create(offsetof(struct item, key), HASH_KEY_SELF, 0);
+
+	if (groups)
+		hikset_group_probing(hs);
+	if (huge)
+		hikset_huge_pages(hs);
+
+	return hs;
+}
+
+static void
+test_insert(hikset_t *hs, struct item *items, size_t cnt)
+{
+	size_t i;
+
+	for (i = 0; i < cnt; i++) {
+		hikset_insert(hs, &items[i]);
+		items[i].present = TRUE;
+	}
+
+	test_assert(hikset_count(hs) == cnt);
+}
+
+static void
+test_lookup_hit(hikset_t *hs, struct item *items, size_t cnt)
+{
+	size_t i;
+
+	for (i = 0; i < cnt; i++)
+		test_assert(hikset_lookup(hs, items[i].key) == &items[i]);
+}
+
+static void
+test_lookup_miss(hikset_t *hs, struct item *items, size_t cnt)
+{
+	size_t i;
+
+	for (i = cnt; i < 2 * cnt; i++)
+		test_assert(!hikset_contains(hs, items[i].key));
+}
+
+/**
+ * Random mix of lookups, insertions and deletions over the whole item set.
+ *
+ * This is the pattern of tables with a large churn, where tombstones pile up
+ * in the double hashing engine.
+ */
+static void
+test_mixed(hikset_t *hs, struct item *items, size_t cnt, size_t loops,
+	uint lookup_pct)
+{
+	size_t i, n = hikset_count(hs);
+
+	for (i = 0; i < loops * cnt; i++) {
+		struct item *it = &items[rand31_value(2 * cnt - 1)];
+
+		if ((uint) rand31_value(99) < lookup_pct) {
+			void *v = hikset_lookup(hs, it->key);
+			test_assert(it->present ? v == it : NULL == v);
+		} else if (it->present) {
+			hikset_remove(hs, it->key);
+			it->present = FALSE;
+			n--;
+		} else {
+			hikset_insert(hs, it);
+			it->present = TRUE;
+			n++;
+		}
+	}
+
+	test_assert(hikset_count(hs) == n);
+}
+
+/**
+ * Check that the set holds exactly the items flagged as present.
+ */
+static void
+test_verify(hikset_t *hs, struct item *items, size_t cnt)
+{
+	size_t i;
+
+	for (i = 0; i < 2 * cnt; i++)
+		test_assert(items[i].present == hikset_contains(hs, items[i].key));
+}
+
+static void
+test_delete(hikset_t *hs, struct item *items, size_t cnt)
+{
+	size_t i;
+
+	for (i = 0; i < 2 * cnt; i++) {
+		if (items[i].present) {
+			hikset_remove(hs, items[i].key);
+			items[i].present = FALSE;
+		}
+	}
+
+	test_assert(0 == hikset_count(hs));
+}
+
+static void
+timeit(const char *what, size_t ops, const tm_nano_t *start)
+{
+	tm_nano_t end;
+
+	tm_precise_time(&end);
+
+	if (chrono) {
+		double elapsed = tm_precise_elapsed_f(&end, start);
+		printf("%7s - %-14s - %zu op%s, %.3gs, %.1f ns/op\n",
+			current_engine, what, ops, plural(ops), elapsed,
+			0 == ops ? 0.0 : elapsed * 1e9 / ops);
+	} else if (verbose_mode) {
+		printf("%7s - %s - OK\n", current_engine, what);
+	}
+	fflush(stdout);
+}
+
+#define TIMEIT(what, ops, call) G_STMT_START {	\
+	tm_nano_t start;							\
+	size_t nops = ops;							\
+	current_test = what;						\
+	tm_precise_time(&start);					\
+	call;										\
+	timeit(what, nops, &start);					\
+} G_STMT_END
+
+static void
+run(struct item *items, size_t cnt, size_t loops, bool groups)
+{
+	hikset_t *hs;
+	size_t i;
+
+	current_engine = groups ? "groups" : "double";
+
+	for (i = 0; i < 2 * cnt; i++)
+		items[i].present = FALSE;
+
+	hs = set_create(groups);
+
+	TIMEIT("insert", cnt, test_insert(hs, items, cnt));
+	TIMEIT("lookup hit", cnt, test_lookup_hit(hs, items, cnt));
+	TIMEIT("lookup miss", cnt, test_lookup_miss(hs, items, cnt));
+	TIMEIT("mix 90% lookup", loops * cnt,
+		test_mixed(hs, items, cnt, loops, 90));
+	test_verify(hs, items, cnt);
+	TIMEIT("mix 50% lookup", loops * cnt,
+		test_mixed(hs, items, cnt, loops, 50));
+	test_verify(hs, items, cnt);
+	TIMEIT("churn", loops * cnt, test_mixed(hs, items, cnt, loops, 0));
+	test_verify(hs, items, cnt);
+	TIMEIT("delete", hikset_count(hs), test_delete(hs, items, cnt));
+
+	current_test = NULL;
+	hikset_free_null(&hs);
+}
+
+/**
+ * Check a hash table, whose values are held in the arena along with the keys,
+ * through a sequence of insertions, value updates and removals.
+ */
+static void
+run_table(struct item *items, size_t cnt, size_t loops, bool groups)
+{
+	htable_t *ht;
+	size_t i, n = 0;
+
+	current_engine = groups ? "groups" : "double";
+	current_test = "table";
+
+	for (i = 0; i < 2 * cnt; i++)
+		items[i].present = FALSE;
+
+	ht = htable_create(HASH_KEY_SELF, 0);
+	if (groups)
+		htable_group_probing(ht);
+
+	for (i = 0; i < loops * cnt; i++) {
+		size_t j = rand31_value(2 * cnt - 1);
+		struct item *it = &items[j];
+
+		switch (rand31_value(3)) {
+		case 0:
+			test_assert(htable_lookup(ht, it->key) ==
+				(it->present ? &items[(j + 1) % (2 * cnt)] : NULL));
+			break;
+		case 1:
+			if (it->present) {
+				htable_remove(ht, it->key);
+				it->present = FALSE;
+				n--;
+			}
+			break;
+		default:
+			htable_insert(ht, it->key, &items[(j + 1) % (2 * cnt)]);
+			if (!it->present)
+				n++;
+			it->present = TRUE;
+			break;
+		}
+	}
+
+	test_assert(htable_count(ht) == n);
+
+	for (i = 0; i < 2 * cnt; i++) {
+		void *v = htable_lookup(ht, items[i].key);
+		test_assert(v == (items[i].present ? &items[(i + 1) % (2 * cnt)] : NULL));
+	}
+
+	if (verbose_mode)
+		printf("%7s - %s - OK\n", current_engine, current_test);
+
+	current_test = NULL;
+	htable_free_null(&ht);
+}
+
+static void
+test(size_t cnt, size_t loops)
+{
+	struct item *items;
+	unsigned seed = rand31_current_seed();
+
+	items = generate_items(cnt);
+
+	/*
+	 * Both engines see the same random sequence of operations.
+	 */
+
+	rand31_set_seed(seed);
+	run(items, cnt, loops, FALSE);
+	rand31_set_seed(seed);
+	run(items, cnt, loops, TRUE);
+
+	rand31_set_seed(seed);
+	run_table(items, cnt, loops, FALSE);
+	rand31_set_seed(seed);
+	run_table(items, cnt, loops, TRUE);
+
+	xfree(items);
+}
+
+int
+main(int argc, char **argv)
+{
+	extern int optind;
+	extern char *optarg;
+	size_t count = 0;
+	size_t loops = 4;
+	unsigned rseed = 0;
+	size_t i;
+	int c;
+	const char options[] = "c:hHn:tR:SV";
+
+	progstart(argc, argv);
+
+	while ((c = getopt(argc, argv, options)) != EOF) {
+		switch (c) {
+		case 'c':			/* amount of items to use */
+			count = atol(optarg);
+			break;
+		case 'n':			/* amount of mixed operations per item */
+			loops = atol(optarg);
+			break;
+		case 'H':			/* huge pages */
+			huge = TRUE;
+			break;
+		case 't':			/* timing report */
+			chrono = TRUE;
+			break;
+		case 'R':			/* randomize in a repeatable way */
+			rseed = atoi(optarg);
+			break;
+		case 'S':			/* silent mode */
+			silent_mode = TRUE;
+			break;
+		case 'V':			/* verbose mode */
+			verbose_mode = TRUE;
+			break;
+		case 'h':			/* show help */
+		default:
+			usage();
+			break;
+		}
+	}
+
+	if ((argc -= optind) != 0)
+		usage();
+
+	rand31_set_seed(rseed);
+	initial_seed = rand31_current_seed();
+
+	for (i = TEST_BITS_MIN; i <= TEST_BITS_MAX; i += TEST_BITS_STEP) {
+		size_t cnt = count != 0 ? count : 1U << i;
+
+		if (!silent_mode)
+			printf("Testing with %zu items...\n", cnt);
+
+		test(cnt, loops);
+
+		if (count != 0)
+			break;
+	}
+
+	return 0;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
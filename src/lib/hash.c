@@ -97,6 +97,19 @@
  * different given that there is no value associated with a key within a set,
  * and the vocabulary is different (we speak of set "items", not "keys").
  *
+ * Tables can also opt for group probing, right after creation, in which case
+ * an extra array of control bytes is kept, one per slot.  A control byte
+ * holds 7 bits of the hashed value for a used slot, or flags the slot as
+ * being empty or deleted.  The table is then split into groups of 16 slots
+ * whose control bytes are all looked at in one single operation (SSE2 when
+ * available): we only compare keys whose control byte matches, and a group
+ * holding an empty slot ends the lookup.  Groups are visited through
+ * quadratic probing (triangular numbers), which visits all the groups since
+ * their amount is a power of 2.  The major benefit is that deleting an item
+ * from a group that still has empty slots does not need a tombstone, since
+ * no lookup could have gone past that group.  This is well suited to tables
+ * experiencing a large churn.
+ *
  * @author Raphael Manfredi
  * @date 2012
  */
@@ -109,12 +122,17 @@
 
 #include "endian.h"
 #include "hashing.h"
+#include "pow2.h"
 #include "rand31.h"
 #include "random.h"
 #include "unsigned.h"
 #include "vmm.h"
 #include "walloc.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "override.h"			/* Must be the last header included */
 
 #define HASH_HOPS_MIN	4		/* Theoretical hops when full at 75% */
@@ -132,6 +150,23 @@
 #define HASH_CACHELINE	64		/* Amount of bytes in a CPU cacheline */
 #define HASH_LINE_ITEMS	(HASH_CACHELINE / INTSIZE)	/* hashes are `uint' */
 
+/*
+ * Control bytes, for tables probed by groups.
+ *
+ * A used slot has a control byte holding the 7 upper bits of its hashed value,
+ * the other values having their leading bit set.  Tables smaller than a group
+ * still get a full group of control bytes, the trailing ones being sentinels
+ * that are never matched.
+ */
+#define HASH_GROUP_BITS		4
+#define HASH_GROUP			(1U << HASH_GROUP_BITS)	/* Slots in a group */
+
+#define HASH_CTRL_EMPTY		0x80	/* Free slot */
+#define HASH_CTRL_DELETED	0xfe	/* Tombstone */
+#define HASH_CTRL_SENTINEL	0xff	/* Past the end of a small table */
+
+#define HASH_CTRL_H2(hv)	((uint8) ((hv) >> 25))
+
 /**
  * Type of table resizing we want to perform.
  */
@@ -220,7 +255,7 @@ hash_hops_max(const struct hkeys *hk)
  * Compute the total size of the arena required for given amount of items.
  */
 static size_t
-hash_arena_size(size_t items, bool has_values)
+hash_arena_size(size_t items, bool has_values, bool groups)
 {
 	size_t size;
 
@@ -238,6 +273,8 @@ hash_arena_size(size_t items, bool has_values)
 	 *
 	 * This allows the hashes array to be correctly aligned since the size
 	 * of a pointer is always larger or equal to the size of an unsigned value.
+	 *
+	 * When probing by groups, the control bytes come last.
 	 */
 
 	STATIC_ASSERT(sizeof(void *) >= sizeof(unsigned));
@@ -247,6 +284,8 @@ hash_arena_size(size_t items, bool has_values)
 	if (has_values)
 		size *= 2;
 	size += items * sizeof(unsigned);
+	if (groups)
+		size += MAX(items, HASH_GROUP);
 
 	return size;
 }
@@ -268,10 +307,28 @@ hash_update_arena_pointers(struct hash *h, void *arena)
 		arena = ptr_add_offset(arena, hk->size * sizeof(void *));
 	}
 	hk->hashes = arena;
+	hk->ctrl = hk->groups ?
+		ptr_add_offset(arena, hk->size * sizeof(unsigned)) : NULL;
 
 	hk->relocate = 0;
 }
 
+/**
+ * Mark all the slots of the key set as free.
+ */
+static void
+hash_keyset_reset(struct hkeys *hk)
+{
+	memset(hk->hashes, 0, hk->size * sizeof(unsigned));
+
+	if (hk->groups) {
+		memset(hk->ctrl, HASH_CTRL_EMPTY, hk->size);
+		if G_UNLIKELY(hk->size < HASH_GROUP)
+			memset(&hk->ctrl[hk->size], HASH_CTRL_SENTINEL,
+				HASH_GROUP - hk->size);
+	}
+}
+
 /**
  * Allocate arena for the hash.
  *
@@ -302,15 +359,17 @@ hash_arena_allocate(struct hash *h, size_t bits)
 	 * For structures in "raw" mode, avoid walloc() and use the VMM layer.
 	 */
 
-	size = hash_arena_size(hk->size, hk->has_values);
+	size = hash_arena_size(hk->size, hk->has_values, hk->groups);
 
-	if (size >= compat_pagesize() || hk->raw_memory)
+	if (hk->huge_pages && vmm_huge_size(size))
+		arena = vmm_alloc_huge(size);
+	else if (size >= compat_pagesize() || hk->raw_memory)
 		arena = vmm_alloc(size);
 	else
 		arena = walloc(size);
 
 	hash_update_arena_pointers(h, arena);
-	memset(hk->hashes, 0, hk->size * sizeof(unsigned));
+	hash_keyset_reset(hk);
 }
 
 /**
@@ -344,11 +403,14 @@ hash_arena_relocate(struct hash *h)
 	if G_LIKELY(0 != ++hk->relocate)
 		return;
 
-	size = hash_arena_size(hk->size, hk->has_values);
+	size = hash_arena_size(hk->size, hk->has_values, hk->groups);
 
 	if (size < compat_pagesize() && !hk->raw_memory)
 		return;		/* Not allocated via VMM */
 
+	if (hk->huge_pages && vmm_huge_size(size))
+		return;		/* Huge page regions cannot move */
+
 	arena = vmm_move(hk->keys, size);
 	if G_LIKELY(arena == hk->keys)
 		return;		/* Not moved */
@@ -360,7 +422,7 @@ hash_arena_relocate(struct hash *h)
  * Release arena of given length.
  */
 static void
-hash_arena_size_free(void *arena, size_t len, bool raw)
+hash_arena_size_free(void *arena, size_t len, const struct hkeys *hk)
 {
 	/*
 	 * If the arena size is more than a page size, we used VMM to allocate the
@@ -369,7 +431,9 @@ hash_arena_size_free(void *arena, size_t len, bool raw)
 	 * When the hash is in "raw" mode, we avoid walloc().
 	 */
 
-	if (len >= compat_pagesize() || raw)
+	if (hk->huge_pages && vmm_huge_size(len))
+		vmm_free_huge(arena, len);
+	else if (len >= compat_pagesize() || hk->raw_memory)
 		vmm_free(arena, len);
 	else
 		wfree(arena, len);
@@ -384,8 +448,8 @@ hash_arena_kset_free(struct hash *h)
 	struct hkeys *hk = &h->kset;
 	size_t size;
 
-	size = hash_arena_size(hk->size, hk->has_values);
-	hash_arena_size_free(hk->keys, size, hk->raw_memory);
+	size = hash_arena_size(hk->size, hk->has_values, hk->groups);
+	hash_arena_size_free(hk->keys, size, hk);
 }
 
 /**
@@ -556,6 +620,129 @@ hash_keyset_equals(const struct hkeys *hk, const void *k1, const void *k2)
 	g_assert_not_reached();
 }
 
+/**
+ * Compute bitmask of the slots within a group whose control byte is ``c''.
+ *
+ * @param g		the first control byte of the group
+ * @param c		the control byte we are looking for
+ *
+ * @return bitmask where bit #i is set when slot #i of the group matches.
+ */
+static inline ALWAYS_INLINE uint
+hash_group_match(const uint8 *g, uint8 c)
+{
+#ifdef __SSE2__
+	__m128i ctrl = _mm_loadu_si128((const __m128i *) g);
+
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(c), ctrl));
+#else
+	uint i, m = 0;
+
+	for (i = 0; i < HASH_GROUP; i++)
+		m |= (uint) (g[i] == c) << i;
+
+	return m;
+#endif
+}
+
+/**
+ * Compute bitmask of the slots within a group that are either empty or
+ * deleted, i.e. where a new key could be inserted.
+ */
+static inline ALWAYS_INLINE uint
+hash_group_available(const uint8 *g)
+{
+#ifdef __SSE2__
+	__m128i ctrl = _mm_loadu_si128((const __m128i *) g);
+
+	/* Signed comparison: EMPTY and DELETED are the only bytes below -1 */
+
+	return _mm_movemask_epi8(
+		_mm_cmpgt_epi8(_mm_set1_epi8(HASH_CTRL_SENTINEL), ctrl));
+#else
+	uint i, m = 0;
+
+	for (i = 0; i < HASH_GROUP; i++)
+		m |= (uint) (g[i] >= HASH_CTRL_EMPTY && g[i] < HASH_CTRL_SENTINEL) << i;
+
+	return m;
+#endif
+}
+
+/**
+ * Lookup key in a key set probed by groups.
+ *
+ * This has the same interface as hash_keyset_lookup(), which it serves.
+ */
+static bool G_HOT
+hash_keyset_lookup_groups(struct hkeys *hk, const void *key, unsigned hv,
+	size_t *kidx, size_t *tombidx)
+{
+	size_t gmask, g, n, base = 0;
+	size_t first_tomb = (size_t) -1, first_free = (size_t) -1;
+	uint8 h2 = HASH_CTRL_H2(hv);
+
+	gmask = hk->bits > HASH_GROUP_BITS ?
+		(1UL << (hk->bits - HASH_GROUP_BITS)) - 1 : 0;
+	g = hv & gmask;
+
+	/*
+	 * We visit group g + n*(n+1)/2 at step n, and since the amount of groups
+	 * is a power of 2, we will go through all the groups before looping.
+	 */
+
+	for (n = 0; n <= gmask; n++) {
+		const uint8 *gc;
+		uint m, avail;
+
+		base = g << HASH_GROUP_BITS;
+		gc = &hk->ctrl[base];
+
+		for (m = hash_group_match(gc, h2); m != 0; m &= m - 1) {
+			size_t idx = base + ctz(m);
+
+			if (
+				hk->hashes[idx] == hv &&
+				hash_keyset_equals(hk, hk->keys[idx], key)
+			) {
+				*kidx = idx;
+				if (tombidx != NULL)
+					*tombidx = first_tomb;
+				return TRUE;
+			}
+		}
+
+		avail = hash_group_available(gc);
+
+		if G_LIKELY(avail != 0) {
+			uint tombs = hash_group_match(gc, HASH_CTRL_DELETED);
+
+			if ((size_t) -1 == first_tomb && tombs != 0)
+				first_tomb = base + ctz(tombs);
+			if ((size_t) -1 == first_free)
+				first_free = base + ctz(avail);
+			if (avail != tombs)
+				break;			/* Group has an empty slot, key is absent */
+		}
+
+		g = (g + n + 1) & gmask;
+	}
+
+	/*
+	 * Flag for a resizing when we had to look at too many groups or when
+	 * there was no room left in the table.
+	 */
+
+	if G_UNLIKELY(n >= HASH_HOPS_MIN || (size_t) -1 == first_free)
+		hk->resize = TRUE;
+
+	if (tombidx != NULL)
+		*tombidx = first_tomb;
+	*kidx = (size_t) -1 == first_free ? base : first_free;
+
+	return FALSE;
+}
+
 /**
  * Lookup key in the key set.
  *
@@ -582,6 +769,9 @@ hash_keyset_lookup(struct hkeys *hk, const void *key, unsigned hv,
 	size_t first_tomb, mask, hops;
 	bool found;
 
+	if (hk->groups)
+		return hash_keyset_lookup_groups(hk, key, hv, kidx, tombidx);
+
 	idx = hashing_keep(hv, hk->bits);
 	ih = hk->hashes[idx];
 
@@ -702,10 +892,51 @@ hash_keyset_lookup(struct hkeys *hk, const void *key, unsigned hv,
 	return found;
 }
 
+/**
+ * Record hashed value of the key stored at the specified index.
+ */
+static inline void
+hash_keyset_set(struct hkeys *hk, size_t idx, unsigned hv)
+{
+	hk->hashes[idx] = hv;
+	if (hk->groups)
+		hk->ctrl[idx] = HASH_CTRL_H2(hv);
+}
+
+/**
+ * Release the key stored at the specified index.
+ *
+ * When probing by groups, the slot is simply freed when its group still has
+ * an empty slot: groups only lose their last empty slot through insertions,
+ * so no lookup could have gone past this group since the table was built.
+ *
+ * @return TRUE if we had to erect a tombstone, FALSE if slot is now free.
+ */
+static bool
+hash_keyset_vacate(struct hkeys *hk, size_t idx)
+{
+	if (hk->groups) {
+		size_t base = idx & ~((size_t) HASH_GROUP - 1);
+
+		if (0 != hash_group_match(&hk->ctrl[base], HASH_CTRL_EMPTY)) {
+			hk->hashes[idx] = HASH_FREE;
+			hk->ctrl[idx] = HASH_CTRL_EMPTY;
+			return FALSE;
+		}
+		hk->ctrl[idx] = HASH_CTRL_DELETED;
+	}
+
+	hk->hashes[idx] = HASH_TOMB;
+	return TRUE;
+}
+
 /**
  * Erect a new tombstone at the specified key index.
  *
- * @return TRUE if we erected a new tombstone, FALSE if there was already one.
+ * When probing by groups, the slot may be freed instead when no tombstone
+ * is required.
+ *
+ * @return TRUE if we removed the key, FALSE if the slot was already unused.
  */
 bool
 hash_erect_tombstone(struct hash *h, size_t idx)
@@ -719,11 +950,11 @@ hash_erect_tombstone(struct hash *h, size_t idx)
 
 	hk = &h->kset;
 
-	if G_UNLIKELY(HASH_TOMB == hk->hashes[idx])
+	if G_UNLIKELY(!HASH_IS_REAL(hk->hashes[idx]))
 		return FALSE;
 
-	hk->hashes[idx] = HASH_TOMB;
-	hk->tombs++;
+	if (hash_keyset_vacate(hk, idx))
+		hk->tombs++;
 	return TRUE;
 }
 
@@ -738,8 +969,7 @@ hash_resize_min(struct hash *h)
 	assert_hash_locked(h);
 
 	if G_UNLIKELY(HASH_MIN_BITS == h->kset.bits) {
-		memset(h->kset.hashes, 0,
-			(1U << HASH_MIN_BITS) * sizeof h->kset.hashes[0]);
+		hash_keyset_reset(&h->kset);
 		h->kset.tombs = 0;
 		h->kset.relocate = 0;
 		h->kset.resize = FALSE;
@@ -775,7 +1005,8 @@ hash_resize(struct hash *h, enum hash_resize_mode mode)
 	if (h->kset.has_values)
 		old_values = (*h->ops->get_values)(h);
 	old_size = h->kset.size;
-	old_arena_size = hash_arena_size(old_size, h->kset.has_values);
+	old_arena_size =
+		hash_arena_size(old_size, h->kset.has_values, h->kset.groups);
 
 	switch (mode) {
 	case HASH_RESIZE_SAME:
@@ -828,7 +1059,7 @@ size_computed:
 
 			keys++;
 			h->kset.keys[idx] = *hk;
-			h->kset.hashes[idx] = *hp;
+			hash_keyset_set(&h->kset, idx, *hp);
 			if (old_values != NULL)
 				new_values[idx] = old_values[i];
 		}
@@ -838,7 +1069,7 @@ size_computed:
 		"keys=%zu, h->kset.items=%zu, resize mode=%d",
 		keys, h->kset.items, mode);
 
-	hash_arena_size_free(old_keys, old_arena_size, h->kset.raw_memory);
+	hash_arena_size_free(old_keys, old_arena_size, &h->kset);
 	h->kset.relocate = 0;
 }
 
@@ -1022,7 +1253,7 @@ hash_insert_key(struct hash *h, const void *key)
 			h->kset.tombs--;
 		}
 		h->kset.items++;
-		h->kset.hashes[idx] = hv;
+		hash_keyset_set(&h->kset, idx, hv);
 	}
 
 	h->kset.keys[idx] = key;	/* Could be a new pointer, so always update */
@@ -1098,11 +1329,12 @@ no_resize:
 			g_assert(size_is_positive(h->kset.tombs));
 
 			h->kset.keys[tombidx] = h->kset.keys[idx];
-			h->kset.hashes[tombidx] = hv;
+			hash_keyset_set(&h->kset, tombidx, hv);
 			if (values != NULL)
 				values[tombidx] = values[idx];
 
-			h->kset.hashes[idx] = HASH_TOMB;
+			if (!hash_keyset_vacate(&h->kset, idx))
+				h->kset.tombs--;		/* Old slot freed, tomb was reused */
 			return tombidx;
 		}
 
@@ -1317,6 +1549,52 @@ hash_free(struct hash *h)
 	(*h->ops->hash_free)(h);
 }
 
+/**
+ * Switch the hash to probing by groups of control bytes.
+ *
+ * This needs to be done right after creating the hash table, before any
+ * key is inserted.  It is best suited to tables with frequent deletions.
+ */
+void
+hash_group_probing(struct hash *h)
+{
+	hash_check(h);
+	g_assert(0 == h->kset.items);
+	g_assert(0 == h->refcnt);
+
+	hash_synchronize(h);
+
+	if (!h->kset.groups) {
+		hash_arena_kset_free(h);
+		h->kset.groups = TRUE;
+		hash_arena_allocate(h, HASH_MIN_BITS);
+	}
+
+	hash_return_void(h);
+}
+
+/**
+ * Back the arena of the hash by huge pages when it becomes large enough.
+ *
+ * This is meant for large tables that are randomly probed on hot paths,
+ * where TLB misses dominate.  It must be requested whilst the arena is
+ * still small, typically right after creating the hash table.
+ */
+void
+hash_huge_pages(struct hash *h)
+{
+	hash_check(h);
+
+	hash_synchronize(h);
+
+	g_assert(!vmm_huge_size(
+		hash_arena_size(h->kset.size, h->kset.has_values, h->kset.groups)));
+
+	h->kset.huge_pages = TRUE;
+
+	hash_return_void(h);
+}
+
 /**
  * Mark the hash as thread-safe.
  *
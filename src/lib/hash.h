@@ -77,6 +77,7 @@ struct hkeys {
 	size_t tombs;				/* Amount of deleted items (tombstones) */
 	const void **keys;			/* Array of keys */
 	unsigned *hashes;			/* Array of hashed keys */
+	uint8 *ctrl;				/* Control bytes, when probing by groups */
 	union {
 		struct {
 			hash_fn_t hash;			/* Primary key hashing function */
@@ -97,6 +98,8 @@ struct hkeys {
 	unsigned has_values:1;		/* Whether keys have associated values */
 	unsigned raw_memory:1;		/* Don't use walloc(), use VMM and xpmalloc() */
 	unsigned relocate:10;		/* Attempts for arena relocation */
+	unsigned groups:1;			/* Probe control bytes by groups */
+	unsigned huge_pages:1;		/* Large arenas backed by huge pages */
 };
 
 #define HASH(x)		((struct hash *) (x))
@@ -152,6 +155,8 @@ struct hash {
  */
 
 void hash_thread_safe(struct hash *h);
+void hash_group_probing(struct hash *h);
+void hash_huge_pages(struct hash *h);
 
 #define hash_synchronize(h) G_STMT_START {			\
 	if G_UNLIKELY((h)->lock != NULL) 				\
@@ -297,6 +297,34 @@ hevset_thread_safe(hevset_t *ht)
 	hash_thread_safe(HASH(ht));
 }
 
+/**
+ * Make hash set probe its slots by groups of control bytes.
+ *
+ * This needs to be done right after creating the hash set, before inserting
+ * anything, and is meant for sets with a large churn.
+ */
+void
+hevset_group_probing(hevset_t *ht)
+{
+	hevset_check(ht);
+
+	hash_group_probing(HASH(ht));
+}
+
+/**
+ * Back the hash set by huge pages when it grows large enough.
+ *
+ * This needs to be done right after creating the hash set, and is meant
+ * for large sets probed on hot paths.
+ */
+void
+hevset_huge_pages(hevset_t *ht)
+{
+	hevset_check(ht);
+
+	hash_huge_pages(HASH(ht));
+}
+
 /**
  * Lock the hash set to allow a sequence of operations to be atomically
  * conducted.
@@ -414,6 +414,34 @@ hikset_thread_safe(hikset_t *hx)
 	hash_thread_safe(HASH(hx));
 }
 
+/**
+ * Make hash set probe its slots by groups of control bytes.
+ *
+ * This needs to be done right after creating the hash set, before inserting
+ * anything, and is meant for sets with a large churn.
+ */
+void
+hikset_group_probing(hikset_t *hx)
+{
+	hikset_check(hx);
+
+	hash_group_probing(HASH(hx));
+}
+
+/**
+ * Back the hash set by huge pages when it grows large enough.
+ *
+ * This needs to be done right after creating the hash set, and is meant
+ * for large sets probed on hot paths.
+ */
+void
+hikset_huge_pages(hikset_t *hx)
+{
+	hikset_check(hx);
+
+	hash_huge_pages(HASH(hx));
+}
+
 /**
  * Lock the hash set to allow a sequence of operations to be atomically
  * conducted.
@@ -123,6 +123,7 @@ typedef struct {
 #include "stacktrace.h"
 #include "stringify.h"
 #include "thread.h"			/* For thread_in_syscall_set() */
+#include "timestamp.h"
 #include "tm.h"
 #include "walloc.h"
 #include "xmalloc.h"
@@ -131,8 +132,12 @@ typedef struct {
 
 static unsigned inputevt_debug;
 static bool inputevt_trace;
+static unsigned inputevt_trace_gen;
 static unsigned inputevt_stid = THREAD_INVALID_ID;
 
+#define INPUTEVT_STATS_PERIOD	10		/**< Seconds between stats logging */
+#define INPUTEVT_BATCH_MIN		64		/**< Minimum events per wakeup */
+
 /**
  * Set debugging level.
  */
@@ -144,10 +149,17 @@ inputevt_set_debug(unsigned level)
 
 /**
  * Set tracing.
+ *
+ * Besides tracing all the handler invocations, this periodically logs the
+ * amount of system calls made per dispatching round and the amount of
+ * events reported per wakeup, for each polling context.
  */
 void
 inputevt_set_trace(bool on)
 {
+	if (on && !inputevt_trace)
+		inputevt_trace_gen++;		/* Restart statistics collection */
+
 	inputevt_trace = on;
 }
 
@@ -196,6 +208,8 @@ typedef struct relay_list {
 	size_t readers;
 	size_t writers;
 	unsigned poll_idx;
+	inputevt_cond_t armed;		/**< Conditions monitored by the kernel */
+	inputevt_cond_t pending;	/**< Edges reported but not dispatched */
 } relay_list_t;
 
 struct event {
@@ -209,10 +223,23 @@ struct new_relay {
 	unsigned id;
 };
 
+/**
+ * Context statistics, logged when tracing.
+ */
+struct inputevt_stats {
+	uint64 dispatches;			/**< Dispatching rounds */
+	uint64 wakeups;				/**< Dispatching rounds with events */
+	uint64 events;				/**< Events reported by the kernel */
+	uint64 syscalls;			/**< System calls made */
+	uint64 cached;				/**< Interest changes needing no syscall */
+	time_t start;				/**< Start of collection period */
+	unsigned gen;				/**< Tracing generation */
+};
+
 static const inputevt_handler_t zero_handler;
 static int (*default_poll_func)(GPollFD *, unsigned, int);
 
-struct poll_ctx {
+struct inputevt_ctx {
 	mutex_t lock;				/**< Thread-safe lock */
 	inputevt_relay_t **relay;	/**< The relay contexts */
 	bit_array_t *used_event_id;	/**< A bit array, which ID slots are used */
@@ -227,9 +254,12 @@ struct poll_ctx {
 	unsigned num_poll_idx;		/**< Length of used_poll_idx array */
 	unsigned max_poll_idx;
 	unsigned num_ready;			/**< Used for /dev/poll only */
+	unsigned max_events;		/**< Adaptive max amount of events per wakeup */
+	struct inputevt_stats stats;	/**< Statistics */
 	unsigned initialized:1;		/**< TRUE if the context has been initialized */
 	unsigned dispatching:1;		/**< TRUE if dispatching events */
 	unsigned collecting:1;		/**< TRUE when collecing / waiting for events */
+	unsigned edge_triggered:1;	/**< TRUE when events are edge-triggered */
 
 #ifdef HAS_KQUEUE
 	struct kevent *kev_arr;
@@ -246,10 +276,10 @@ struct poll_ctx {
 	 * and constitute the common interface.
 	 */
 	const char *polling_method;
-	int (*collect_events)(struct poll_ctx *, int); /* non-pollable master fd */
-	int (*event_check_all)(struct poll_ctx *);
-	struct event (*event_get)(const struct poll_ctx *, unsigned);
-	int (*event_set_mask)(struct poll_ctx *, int,
+	int (*collect_events)(struct inputevt_ctx *, int); /* non-pollable master fd */
+	int (*event_check_all)(struct inputevt_ctx *);
+	struct event (*event_get)(const struct inputevt_ctx *, unsigned);
+	int (*event_set_mask)(struct inputevt_ctx *, int,
 			inputevt_cond_t, inputevt_cond_t);
 };
 
@@ -262,9 +292,12 @@ struct poll_ctx {
 #define CTX_UNLOCK(c)		mutex_unlock(&c->lock)
 #define CTX_IS_LOCKED(c)	mutex_is_owned(&c->lock)
 
+#define CTX_SYSCALL(c)		((c)->stats.syscalls++)
+
 static unsigned data_available;
 
-static void inputevt_process_added(struct poll_ctx *ctx);
+static void inputevt_process_added(struct inputevt_ctx *ctx);
+static bool inputevt_cancel_added(struct inputevt_ctx *ctx, unsigned id);
 
 /**
  * @return A positive value indicates how much data is available for reading.
@@ -276,10 +309,10 @@ inputevt_data_available(void)
 	return data_available;
 }
 
-static inline struct poll_ctx *
+static inline struct inputevt_ctx *
 get_global_poll_ctx(void)
 {
-	static struct poll_ctx ctx;
+	static struct inputevt_ctx ctx;
 	return &ctx;
 }
 
@@ -287,7 +320,7 @@ get_global_poll_ctx(void)
  * Start "collecting" events through a possibly blocking system call.
  */
 static void
-inputevt_collect_start(struct poll_ctx *ctx, int timeout_ms)
+inputevt_collect_start(struct inputevt_ctx *ctx, int timeout_ms)
 {
 	g_assert(CTX_IS_LOCKED(ctx));
 
@@ -302,7 +335,7 @@ inputevt_collect_start(struct poll_ctx *ctx, int timeout_ms)
  * End "collecting" events.
  */
 static void
-inputevt_collect_end(struct poll_ctx *ctx, int timeout_ms)
+inputevt_collect_end(struct inputevt_ctx *ctx, int timeout_ms)
 {
 	g_assert(!CTX_IS_LOCKED(ctx));
 
@@ -317,7 +350,7 @@ inputevt_collect_end(struct poll_ctx *ctx, int timeout_ms)
 }
 
 static inline unsigned
-inputevt_poll_idx_new(struct poll_ctx *ctx, int fd)
+inputevt_poll_idx_new(struct inputevt_ctx *ctx, int fd)
 {
 	unsigned idx;
 
@@ -359,7 +392,7 @@ inputevt_poll_idx_new(struct poll_ctx *ctx, int fd)
 }
 
 static inline void
-inputevt_poll_idx_free(struct poll_ctx *ctx, unsigned *idx_ptr)
+inputevt_poll_idx_free(struct inputevt_ctx *ctx, unsigned *idx_ptr)
 {
 	const unsigned idx = *idx_ptr;
 
@@ -408,7 +441,7 @@ inputevt_poll_idx_free(struct poll_ctx *ctx, unsigned *idx_ptr)
 
 #ifdef HAS_KQUEUE
 static struct event
-event_get_with_kqueue(const struct poll_ctx *ctx, unsigned idx)
+event_get_with_kqueue(const struct inputevt_ctx *ctx, unsigned idx)
 {
 	const struct kevent *ev = &ctx->kev_arr[idx];
 	struct event event;
@@ -433,7 +466,7 @@ event_get_with_kqueue(const struct poll_ctx *ctx, unsigned idx)
 }
 
 static int
-event_set_mask_with_kqueue(struct poll_ctx *ctx, int fd,
+event_set_mask_with_kqueue(struct inputevt_ctx *ctx, int fd,
 	inputevt_cond_t old, inputevt_cond_t cur)
 {
 	static const struct timespec zero_ts;
@@ -464,6 +497,7 @@ event_set_mask_with_kqueue(struct poll_ctx *ctx, int fd,
 		i++;
 	}
 
+	CTX_SYSCALL(ctx);
 	if (-1 == (ret = kevent(ctx->master_fd, kev, i, NULL, 0, &zero_ts)))
 		s_error("%s(): kevent() failed: %m", G_STRFUNC);
 
@@ -471,7 +505,7 @@ event_set_mask_with_kqueue(struct poll_ctx *ctx, int fd,
 }
 
 static int
-event_check_all_with_kqueue(struct poll_ctx *ctx)
+event_check_all_with_kqueue(struct inputevt_ctx *ctx)
 {
 	static const struct timespec zero_ts;
 
@@ -479,6 +513,7 @@ event_check_all_with_kqueue(struct poll_ctx *ctx)
 	g_assert(ctx->initialized);
 	g_assert(CTX_IS_LOCKED(ctx));
 
+	CTX_SYSCALL(ctx);
 	return kevent(ctx->master_fd, NULL, 0, ctx->kev_arr, ctx->num_ev, &zero_ts);
 }
 
@@ -486,7 +521,7 @@ event_check_all_with_kqueue(struct poll_ctx *ctx)
 
 #ifdef HAS_EPOLL
 static struct event
-event_get_with_epoll(const struct poll_ctx *ctx, unsigned idx)
+event_get_with_epoll(const struct inputevt_ctx *ctx, unsigned idx)
 {
 	const struct epoll_event *ev = &ctx->ep_arr[idx];
 	struct event event;
@@ -503,11 +538,12 @@ event_get_with_epoll(const struct poll_ctx *ctx, unsigned idx)
 }
 
 static int
-event_set_mask_with_epoll(struct poll_ctx *ctx, int fd,
+event_set_mask_with_epoll(struct inputevt_ctx *ctx, int fd,
 	inputevt_cond_t old, inputevt_cond_t cur)
 {
 	static const struct epoll_event zero_ev;
 	struct epoll_event ev;
+	relay_list_t *rl;
 	int op;
 
 	g_assert(CTX_IS_LOCKED(ctx));
@@ -517,6 +553,31 @@ event_set_mask_with_epoll(struct poll_ctx *ctx, int fd,
 	if (cur == old)
 		return 0;
 
+	rl = htable_lookup(ctx->ht, int_to_pointer(fd));
+	g_assert(NULL != rl);
+
+	/*
+	 * In edge-triggered mode, we do not disarm conditions which are no
+	 * longer wanted as long as the descriptor remains monitored: the few
+	 * spurious edges are filtered when dispatching, which is cheaper than
+	 * the epoll_ctl() churn of handlers toggling their interest.
+	 *
+	 * Re-arming a condition is only required when an edge for it was
+	 * reported whilst nobody was interested, since it would otherwise
+	 * never be reported again.
+	 */
+
+	if (ctx->edge_triggered && 0 != cur) {
+		if (0 == (cur & ~rl->armed) && 0 == (cur & rl->pending)) {
+			ctx->stats.cached++;
+			return 0;
+		}
+		cur |= rl->armed;
+	} else if (cur == rl->armed) {
+		ctx->stats.cached++;
+		return 0;
+	}
+
 	ev = zero_ev;
 	ev.data.ptr = int_to_pointer(fd);
 
@@ -524,31 +585,61 @@ event_set_mask_with_epoll(struct poll_ctx *ctx, int fd,
 		ev.events |= EPOLLIN | EPOLLPRI;
 	if (INPUT_EVENT_W & cur)
 		ev.events |= EPOLLOUT;
+	if (ctx->edge_triggered)
+		ev.events |= EPOLLET;
 
-	if (0 == old)
+	if (0 == rl->armed)
 		op = EPOLL_CTL_ADD;
 	else if (0 == cur)
 		op = EPOLL_CTL_DEL;
 	else
 		op = EPOLL_CTL_MOD;
 
+	rl->armed = cur;
+	rl->pending = 0;
+	CTX_SYSCALL(ctx);
+
 	return epoll_ctl(ctx->master_fd, op, fd, &ev);
 }
 
 static int
-event_check_all_with_epoll(struct poll_ctx *ctx)
+event_check_all_with_epoll(struct inputevt_ctx *ctx)
 {
+	unsigned max;
+	int ret;
+
 	g_assert(ctx);
 	g_assert(ctx->initialized);
 	g_assert(CTX_IS_LOCKED(ctx));
 
-	return epoll_wait(ctx->master_fd, ctx->ep_arr, ctx->num_ev, 0);
+	/*
+	 * The amount of events we collect per wakeup adapts to the load: the
+	 * limit grows when the previous batch was full and shrinks when it
+	 * was mostly empty.  Events beyond the limit are not lost, the kernel
+	 * reporting them at the next wakeup.
+	 */
+
+	max = MIN(ctx->max_events, ctx->num_ev);
+	max = MAX(1, max);
+
+	CTX_SYSCALL(ctx);
+	ret = epoll_wait(ctx->master_fd, ctx->ep_arr, max, 0);
+
+	if (UNSIGNED(ret) == max) {
+		if (ctx->max_events < ctx->num_ev)
+			ctx->max_events *= 2;
+	} else if (ret >= 0 && UNSIGNED(ret) < max / 4) {
+		if (ctx->max_events > INPUTEVT_BATCH_MIN)
+			ctx->max_events /= 2;
+	}
+
+	return ret;
 }
 #endif	/* HAS_EPOLL */
 
 #ifdef HAS_DEV_POLL
 static int
-event_set_mask_with_dev_poll(struct poll_ctx *ctx, int fd,
+event_set_mask_with_dev_poll(struct inputevt_ctx *ctx, int fd,
 	inputevt_cond_t old, inputevt_cond_t cur)
 {
 	g_assert(CTX_IS_LOCKED(ctx));
@@ -580,6 +671,7 @@ event_set_mask_with_dev_poll(struct poll_ctx *ctx, int fd,
 			ssize_t ret;
 			size_t size;
 			size = i * sizeof pfd[0];
+			CTX_SYSCALL(ctx);
 			ret = write(ctx->master_fd, &pfd, size);
 			g_assert((size_t) ret == size || (ssize_t)-1 == ret);
 		}
@@ -588,7 +680,7 @@ event_set_mask_with_dev_poll(struct poll_ctx *ctx, int fd,
 }
 
 static int
-collect_events_with_devpoll(struct poll_ctx *ctx, int timeout_ms)
+collect_events_with_devpoll(struct inputevt_ctx *ctx, int timeout_ms)
 {
 	struct dvpoll dvp;
 	int ret;
@@ -600,6 +692,7 @@ collect_events_with_devpoll(struct poll_ctx *ctx, int timeout_ms)
 	dvp.dp_nfds = ctx->num_ev;
 	dvp.dp_fds = ctx->pfd_arr;
 
+	CTX_SYSCALL(ctx);
 	inputevt_collect_start(ctx, timeout_ms);
 	ret = ioctl(ctx->master_fd, DP_POLL, &dvp);
 	inputevt_collect_end(ctx, timeout_ms);
@@ -613,7 +706,7 @@ collect_events_with_devpoll(struct poll_ctx *ctx, int timeout_ms)
 #endif	/* HAS_DEV_POLL */
 
 static int
-event_set_mask_with_poll(struct poll_ctx *ctx, int fd,
+event_set_mask_with_poll(struct inputevt_ctx *ctx, int fd,
 	inputevt_cond_t old, inputevt_cond_t cur)
 {
 	struct pollfd *pfd;
@@ -649,7 +742,7 @@ event_set_mask_with_poll(struct poll_ctx *ctx, int fd,
 #ifdef MINGW32
 
 static unsigned
-get_poll_idx(const struct poll_ctx *ctx, int fd)
+get_poll_idx(const struct inputevt_ctx *ctx, int fd)
 {
 	relay_list_t *rl;
 
@@ -663,7 +756,7 @@ get_poll_idx(const struct poll_ctx *ctx, int fd)
 }
 
 static int
-collect_events_with_select(struct poll_ctx *ctx, int timeout_ms)
+collect_events_with_select(struct inputevt_ctx *ctx, int timeout_ms)
 {
 	struct timeval tv;
 	fd_set r, w, x;
@@ -713,6 +806,7 @@ collect_events_with_select(struct poll_ctx *ctx, int timeout_ms)
 		tv.tv_usec = (timeout_ms % 1000) * 1000UL;
 	}
 
+	CTX_SYSCALL(ctx);
 	inputevt_collect_start(ctx, timeout_ms);
 	ret = select(FD_SETSIZE, (void *) &r, (void *) &w, (void *) &x,
 			timeout_ms < 0 ? NULL : &tv);
@@ -745,7 +839,7 @@ collect_events_with_select(struct poll_ctx *ctx, int timeout_ms)
 #endif /* MINGW32 */
 
 static int
-collect_events_with_poll(struct poll_ctx *ctx, int timeout_ms)
+collect_events_with_poll(struct inputevt_ctx *ctx, int timeout_ms)
 {
 	int ret;
 
@@ -758,6 +852,7 @@ collect_events_with_poll(struct poll_ctx *ctx, int timeout_ms)
 	 * it again to the thread layer.
 	 */
 
+	CTX_SYSCALL(ctx);
 	inputevt_collect_start(ctx, 0);
 	ret = compat_poll(ctx->pfd_arr, ctx->max_poll_idx, timeout_ms);
 	inputevt_collect_end(ctx, 0);
@@ -769,7 +864,7 @@ collect_events_with_poll(struct poll_ctx *ctx, int timeout_ms)
 }
 
 static int
-event_check_all_with_poll(struct poll_ctx *ctx)
+event_check_all_with_poll(struct inputevt_ctx *ctx)
 {
 	int ret;
 
@@ -781,7 +876,7 @@ event_check_all_with_poll(struct poll_ctx *ctx)
 }
 
 static struct event
-event_get_with_poll(const struct poll_ctx *ctx, unsigned idx)
+event_get_with_poll(const struct inputevt_ctx *ctx, unsigned idx)
 {
 	const struct pollfd *pfd = &ctx->pfd_arr[idx];
 	struct event event;
@@ -797,7 +892,7 @@ event_get_with_poll(const struct poll_ctx *ctx, unsigned idx)
 }
 
 static void
-check_for_events(struct poll_ctx *ctx, int *timeout_ms_ptr)
+check_for_events(struct inputevt_ctx *ctx, int *timeout_ms_ptr)
 {
 	int ret, timeout_ms;
 
@@ -859,7 +954,7 @@ check_for_events(struct poll_ctx *ctx, int *timeout_ms_ptr)
 }
 
 void
-inputevt_poll_idx_compact(struct poll_ctx *ctx)
+inputevt_poll_idx_compact(struct inputevt_ctx *ctx)
 {
 	CTX_LOCK(ctx);
 
@@ -900,7 +995,7 @@ inputevt_poll_idx_compact(struct poll_ctx *ctx)
 }
 
 static void
-relay_list_remove(struct poll_ctx *ctx, unsigned id)
+relay_list_remove(struct inputevt_ctx *ctx, unsigned id)
 {
 	relay_list_t *rl;
 	inputevt_relay_t *relay;
@@ -932,7 +1027,7 @@ relay_list_remove(struct poll_ctx *ctx, unsigned id)
  * Purge removed sources.
  */
 static void
-inputevt_purge_removed(struct poll_ctx *ctx)
+inputevt_purge_removed(struct inputevt_ctx *ctx)
 {
 	pslist_t *sl;
 
@@ -960,16 +1055,23 @@ inputevt_purge_removed(struct poll_ctx *ctx)
 
 /**
  * Handle event on given file descriptor.
+ *
+ * This is called without the context lock, which is only taken to access
+ * the state shared with the relay management routines.
  */
 static void
-inputevt_handle(const struct poll_ctx *ctx, int fd, inputevt_cond_t condition)
+inputevt_handle(struct inputevt_ctx *ctx, int fd, inputevt_cond_t condition)
 {
 	relay_list_t *rl;
 	pslist_t *sl;
+	inputevt_cond_t wanted = 0;
 
 	g_assert(is_valid_fd(fd));
+	g_assert(!CTX_IS_LOCKED(ctx));
 
+	CTX_LOCK(ctx);
 	rl = htable_lookup(ctx->ht, int_to_pointer(fd));
+	CTX_UNLOCK(ctx);
 
 	g_assert(NULL != rl);
 	g_assert((0 == rl->readers && 0 == rl->writers) || NULL != rl->sl);
@@ -992,6 +1094,8 @@ inputevt_handle(const struct poll_ctx *ctx, int fd, inputevt_cond_t condition)
 		if G_UNLIKELY(zero_handler == relay->handler)
 			continue;
 
+		wanted |= relay->condition;
+
 		if (condition & relay->condition) {
 			data_available = 0;		/* FIXME: not thread-safe */
 
@@ -1010,13 +1114,62 @@ inputevt_handle(const struct poll_ctx *ctx, int fd, inputevt_cond_t condition)
 			}
 		}
 	}
+
+	/*
+	 * Remember edges nobody was interested in: they will not be reported
+	 * again, so the condition must be re-armed when interest comes back.
+	 */
+
+	if (ctx->edge_triggered) {
+		CTX_LOCK(ctx);
+		rl->pending |= condition & INPUT_EVENT_RW & ~wanted;
+		CTX_UNLOCK(ctx);
+	}
+}
+
+/**
+ * Log context statistics periodically, when tracing.
+ */
+static void
+inputevt_stats_log(struct inputevt_ctx *ctx, bool force)
+{
+	struct inputevt_stats *st = &ctx->stats;
+	time_t now = tm_time();
+
+	g_assert(CTX_IS_LOCKED(ctx));
+
+	if (st->gen != inputevt_trace_gen) {
+		ZERO(st);
+		st->gen = inputevt_trace_gen;
+		st->start = now;
+		return;
+	}
+
+	if (!force && delta_time(now, st->start) < INPUTEVT_STATS_PERIOD)
+		return;
+
+	if (0 != st->dispatches) {
+		s_info("%s(): %s%s in %s: "
+			"%.2f syscalls/dispatch, %.2f events/wakeup, "
+			"%s dispatch%s, %s cached interest change%s",
+			G_STRFUNC, ctx->polling_method,
+			ctx->edge_triggered ? " (edge-triggered)" : "", thread_name(),
+			st->syscalls / (double) st->dispatches,
+			0 == st->wakeups ? 0.0 : st->events / (double) st->wakeups,
+			uint64_to_string(st->dispatches), plural_es(st->dispatches),
+			uint64_to_string2(st->cached), plural(st->cached));
+	}
+
+	ZERO(st);
+	st->gen = inputevt_trace_gen;
+	st->start = now;
 }
 
 /**
  * Our main I/O event dispatching loop.
  */
 static void G_HOT
-inputevt_timer(struct poll_ctx *ctx)
+inputevt_timer(struct inputevt_ctx *ctx)
 {
 	int num_events;
 
@@ -1042,11 +1195,15 @@ inputevt_timer(struct poll_ctx *ctx)
 	}
 
 	ctx->dispatching = TRUE;
+	ctx->stats.dispatches++;
 
 	if (num_events > 0) {
 		unsigned idx;
 		pslist_t *evlist = NULL, *es;
 
+		ctx->stats.wakeups++;
+		ctx->stats.events += num_events;
+
 		g_assert(UNSIGNED(num_events) <= ctx->num_ev);
 
 		for (idx = 0; num_events > 0 && idx < ctx->num_ev; idx++) {
@@ -1120,6 +1277,12 @@ inputevt_timer(struct poll_ctx *ctx)
 		inputevt_purge_removed(ctx);
 	}
 
+	if (ctx->added_relays != NULL)
+		inputevt_process_added(ctx);
+
+	if G_UNLIKELY(inputevt_trace)
+		inputevt_stats_log(ctx, FALSE);
+
 	CTX_UNLOCK(ctx);
 }
 
@@ -1130,7 +1293,7 @@ static bool
 dispatch_poll(GIOChannel *unused_source,
 	GIOCondition unused_cond, void *udata)
 {
-	struct poll_ctx *ctx = udata;
+	struct inputevt_ctx *ctx = udata;
 
 	(void) unused_cond;
 	(void) unused_source;
@@ -1142,7 +1305,7 @@ dispatch_poll(GIOChannel *unused_source,
 static int
 poll_func(GPollFD *gfds, unsigned n, int timeout_ms)
 {
-	struct poll_ctx *ctx;
+	struct inputevt_ctx *ctx;
 	int r;
 	bool dispatching;
 
@@ -1199,9 +1362,8 @@ poll_func(GPollFD *gfds, unsigned n, int timeout_ms)
  * must be kept in mind, that file descriptor numbers are recycled.
  */
 void
-inputevt_remove(unsigned *id_ptr)
+inputevt_ctx_remove(inputevt_ctx_t *ctx, unsigned *id_ptr)
 {
-	struct poll_ctx *ctx;
 	inputevt_relay_t *relay;
 	relay_list_t *rl;
 	inputevt_cond_t old, cur;
@@ -1212,15 +1374,19 @@ inputevt_remove(unsigned *id_ptr)
 	if G_UNLIKELY(0 == id)
 		return;
 
-	ctx = get_global_poll_ctx();
+	g_assert(ctx != NULL);
 	g_assert(ctx->initialized);
 	g_assert(ctx->ht);
 	g_assert(0 != id);
-	g_assert(id < ctx->num_ev);
-	g_assert(0 != bit_array_get(ctx->used_event_id, id));
 
 	CTX_LOCK(ctx);
 
+	if G_UNLIKELY(ctx->added_relays != NULL && inputevt_cancel_added(ctx, id))
+		goto done;
+
+	g_assert(id < ctx->num_ev);
+	g_assert(0 != bit_array_get(ctx->used_event_id, id));
+
 	relay = ctx->relay[id];
 	g_assert(NULL != relay);
 	g_assert(zero_handler != relay->handler);
@@ -1274,13 +1440,24 @@ inputevt_remove(unsigned *id_ptr)
 		ctx->relay[id] = NULL;
 		bit_array_clear(ctx->used_event_id, id);
 	}
+
+done:
 	*id_ptr = 0;
 
 	CTX_UNLOCK(ctx);
 }
 
+/**
+ * Remove source from the global polling context and nullify its ID.
+ */
+void
+inputevt_remove(unsigned *id_ptr)
+{
+	inputevt_ctx_remove(get_global_poll_ctx(), id_ptr);
+}
+
 static inline unsigned
-inputevt_get_free_id(const struct poll_ctx *ctx)
+inputevt_get_free_id(const struct inputevt_ctx *ctx)
 {
 	g_assert(CTX_IS_LOCKED(ctx));
 
@@ -1291,7 +1468,7 @@ inputevt_get_free_id(const struct poll_ctx *ctx)
 }
 
 static void
-inputevt_add_source(struct poll_ctx *ctx, inputevt_relay_t *relay, uint id)
+inputevt_add_source(struct inputevt_ctx *ctx, inputevt_relay_t *relay, uint id)
 {
 	inputevt_cond_t old;
 
@@ -1374,6 +1551,8 @@ inputevt_add_source(struct poll_ctx *ctx, inputevt_relay_t *relay, uint id)
 			WALLOC(rl);
 			rl->readers = 0;
 			rl->writers = 0;
+			rl->armed = 0;
+			rl->pending = 0;
 			rl->sl = NULL;
 			rl->poll_idx = inputevt_poll_idx_new(ctx, relay->fd);
 			old = 0;
@@ -1402,7 +1581,7 @@ inputevt_add_source(struct poll_ctx *ctx, inputevt_relay_t *relay, uint id)
  * Process added sources.
  */
 static void
-inputevt_process_added(struct poll_ctx *ctx)
+inputevt_process_added(struct inputevt_ctx *ctx)
 {
 	pslist_t *sl;
 
@@ -1419,10 +1598,42 @@ inputevt_process_added(struct poll_ctx *ctx)
 	pslist_free_null(&ctx->added_relays);
 }
 
+/**
+ * Cancel addition of a source that was deferred, if found.
+ *
+ * @return TRUE if the source was still pending and has been discarded.
+ */
+static bool
+inputevt_cancel_added(struct inputevt_ctx *ctx, unsigned id)
+{
+	pslist_t *sl;
+
+	g_assert(CTX_IS_LOCKED(ctx));
+
+	PSLIST_FOREACH(ctx->added_relays, sl) {
+		struct new_relay *nr = sl->data;
+
+		if (nr->id != id)
+			continue;
+
+		ctx->added_relays = pslist_remove(ctx->added_relays, nr);
+
+		/* IDs taken from the free slots were marked as used already */
+		if (id < ctx->num_ev)
+			bit_array_clear(ctx->used_event_id, id);
+
+		WFREE(nr->relay);
+		WFREE(nr);
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
 void
 inputevt_set_readable(int fd)
 {
-	struct poll_ctx *ctx = get_global_poll_ctx();
+	struct inputevt_ctx *ctx = get_global_poll_ctx();
 	void *key = int_to_pointer(fd);
 
 	if (inputevt_debug > 3) {
@@ -1443,7 +1654,7 @@ inputevt_set_readable(int fd)
 }
 
 static int
-init_with_kqueue(struct poll_ctx *ctx)
+init_with_kqueue(struct inputevt_ctx *ctx)
 #ifdef HAS_KQUEUE
 {
 	const int fd = kqueue();
@@ -1455,7 +1666,6 @@ init_with_kqueue(struct poll_ctx *ctx)
 
 	g_assert(CTX_IS_LOCKED(ctx));
 
-	g_main_context_set_poll_func(NULL, default_poll_func);
 	ctx->master_fd = fd;
 	ctx->polling_method = "kqueue()";
 	ctx->collect_events = NULL; /* master fd can be polled */
@@ -1473,7 +1683,7 @@ init_with_kqueue(struct poll_ctx *ctx)
 #endif
 
 static int
-init_with_devpoll(struct poll_ctx *ctx)
+init_with_devpoll(struct inputevt_ctx *ctx)
 #ifdef HAS_DEV_POLL
 {
 	const int fd = fd_get_non_stdio(open("/dev/poll", O_RDWR));
@@ -1485,7 +1695,6 @@ init_with_devpoll(struct poll_ctx *ctx)
 
 	g_assert(CTX_IS_LOCKED(ctx));
 
-	g_main_context_set_poll_func(NULL, default_poll_func);
 	ctx->master_fd = fd;
 	ctx->polling_method = "/dev/poll";
 	ctx->collect_events = collect_events_with_devpoll;
@@ -1503,7 +1712,7 @@ init_with_devpoll(struct poll_ctx *ctx)
 #endif	/* HAS_DEV_POLL */
 
 static int
-init_with_epoll(struct poll_ctx *ctx)
+init_with_epoll(struct inputevt_ctx *ctx)
 #ifdef HAS_EPOLL
 {
 	const int fd = epoll_create(1024 /* Just an arbitrary value as hint */);
@@ -1515,7 +1724,6 @@ init_with_epoll(struct poll_ctx *ctx)
 
 	g_assert(CTX_IS_LOCKED(ctx));
 
-	g_main_context_set_poll_func(NULL, default_poll_func);
 	ctx->master_fd = fd;
 	ctx->polling_method = "epoll()";
 	ctx->collect_events = NULL; /* master fd can be polled */
@@ -1533,13 +1741,10 @@ init_with_epoll(struct poll_ctx *ctx)
 #endif	/* HAS_EPOLL */
 
 static int
-init_with_poll(struct poll_ctx *ctx)
+init_with_poll(struct inputevt_ctx *ctx)
 {
-	default_poll_func = g_main_context_get_poll_func(NULL);
-
 	g_assert(CTX_IS_LOCKED(ctx));
 
-	g_main_context_set_poll_func(NULL, poll_func);
 	ctx->master_fd = -1;
 	ctx->polling_method = "poll()";
 	ctx->collect_events = collect_events_with_poll;
@@ -1567,19 +1772,18 @@ inputevt_thread_id(void)
 }
 
 /**
- * Performs module initialization.
- * @param use_poll If TRUE, kqueue(), epoll(), /dev/poll etc. won't be used.
+ * Initialize a polling context, selecting the best I/O event backend.
+ *
+ * @param ctx		the context to initialize
+ * @param use_poll	if TRUE, kqueue(), epoll(), /dev/poll etc. won't be used.
  */
-void
-inputevt_init(int use_poll)
+static void
+inputevt_ctx_setup(struct inputevt_ctx *ctx, bool use_poll)
 {
-	struct poll_ctx *ctx;
-
-	ctx = get_global_poll_ctx();
-	inputevt_stid = thread_small_id();
-
 	g_assert(!ctx->initialized);
+
 	ctx->initialized = TRUE;
+	ctx->max_events = INPUTEVT_BATCH_MIN;
 	ctx->ht = htable_create(HASH_KEY_SELF, 0);
 	ctx->readable = hash_list_new(NULL, NULL);
 	mutex_init(&ctx->lock);
@@ -1603,13 +1807,65 @@ inputevt_init(int use_poll)
 		}
 	}
 
+	if (is_valid_fd(ctx->master_fd))
+		fd_set_close_on_exec(ctx->master_fd);	/* Just in case */
+
+	CTX_UNLOCK(ctx);
+}
+
+/**
+ * Release all the resources held by a polling context.
+ */
+static void
+inputevt_ctx_teardown(struct inputevt_ctx *ctx)
+{
+	CTX_LOCK(ctx);
+
+	inputevt_purge_removed(ctx);
+	htable_free_null(&ctx->ht);
+	hash_list_free(&ctx->readable);
+	HFREE_NULL(ctx->used_poll_idx);
+	HFREE_NULL(ctx->used_event_id);
+	XFREE_NULL(ctx->relay);
+	XFREE_NULL(ctx->pfd_arr);
+#ifdef HAS_KQUEUE
+	XFREE_NULL(ctx->kev_arr);
+#endif
+#ifdef HAS_EPOLL
+	XFREE_NULL(ctx->ep_arr);
+#endif
+	fd_close(&ctx->master_fd);
+	ctx->initialized = FALSE;
+
 	CTX_UNLOCK(ctx);
+	mutex_destroy(&ctx->lock);
+}
+
+/**
+ * Performs module initialization.
+ * @param use_poll If TRUE, kqueue(), epoll(), /dev/poll etc. won't be used.
+ */
+void
+inputevt_init(int use_poll)
+{
+	struct inputevt_ctx *ctx;
+
+	ctx = get_global_poll_ctx();
+	inputevt_stid = thread_small_id();
+
+	inputevt_ctx_setup(ctx, use_poll);
+
+	/*
+	 * The global context is driven by the GLib main loop: when the backend
+	 * has a master file descriptor, we just need to watch it.  Otherwise,
+	 * we have to hook into the GLib poll() routine.
+	 */
+
+	default_poll_func = g_main_context_get_poll_func(NULL);
 
 	if (is_valid_fd(ctx->master_fd)) {
 		GIOChannel *ch;
 
-		fd_set_close_on_exec(ctx->master_fd);	/* Just in case */
-
 		ch = g_io_channel_unix_new(ctx->master_fd);
 
 #if GLIB_CHECK_VERSION(2, 0, 0)
@@ -1617,6 +1873,8 @@ inputevt_init(int use_poll)
 #endif /* GLib >= 2.0 */
 
 		(void) g_io_add_watch(ch, READ_CONDITION, dispatch_poll, ctx);
+	} else {
+		g_main_context_set_poll_func(NULL, poll_func);
 	}
 
 #ifdef INPUTEVT_DEBUGGING
@@ -1626,28 +1884,177 @@ inputevt_init(int use_poll)
 }
 
 /**
- * Adds an event source to the main GLIB monitor queue.
+ * Create a new private polling context.
  *
- * A replacement for gdk_input_add().
- * Behaves exactly the same, except destroy notification has
- * been removed (since gtkg does not use it).
+ * Unlike the global context, which is driven by the GLib main loop, private
+ * contexts are meant to be driven explicitly by a dedicated thread, through
+ * inputevt_ctx_run().  Sources must be added to and removed from them with
+ * inputevt_ctx_add() and inputevt_ctx_remove(), since source IDs are only
+ * meaningful within their context.
+ *
+ * @param use_poll If TRUE, kqueue(), epoll(), /dev/poll etc. won't be used.
+ *
+ * @return a new polling context, to be freed with inputevt_ctx_free_null().
+ */
+inputevt_ctx_t *
+inputevt_ctx_new(bool use_poll)
+{
+	struct inputevt_ctx *ctx;
+
+	XMALLOC0(ctx);
+	inputevt_ctx_setup(ctx, use_poll);
+
+	return ctx;
+}
+
+/**
+ * Free private polling context and nullify its pointer.
+ */
+void
+inputevt_ctx_free_null(inputevt_ctx_t **ctx_ptr)
+{
+	struct inputevt_ctx *ctx = *ctx_ptr;
+
+	if (ctx != NULL) {
+		g_assert(ctx != get_global_poll_ctx());
+
+		if G_UNLIKELY(inputevt_trace) {
+			CTX_LOCK(ctx);
+			inputevt_stats_log(ctx, TRUE);
+			CTX_UNLOCK(ctx);
+		}
+
+		inputevt_ctx_teardown(ctx);
+		XFREE_NULL(ctx);
+		*ctx_ptr = NULL;
+	}
+}
+
+/**
+ * Switch private context to edge-triggered events, if supported.
+ *
+ * Handlers of an edge-triggered context are only invoked when the state
+ * of their file descriptor changes, hence they must consume all the
+ * available data (or fill the output buffer) until they get EAGAIN, or
+ * they will not be notified again.  In exchange, the kernel does not need
+ * to report the same ready descriptors at each wakeup and handlers can
+ * toggle their interest without triggering system calls.
+ *
+ * This must be called before any source is added to the context.
+ *
+ * @return TRUE if events are now edge-triggered, FALSE if the polling
+ * method of the context does not support it.
+ */
+bool
+inputevt_ctx_set_edge_triggered(inputevt_ctx_t *ctx)
+{
+	g_assert(ctx != NULL);
+	g_assert(ctx != get_global_poll_ctx());
+	g_assert(ctx->initialized);
+
+	CTX_LOCK(ctx);
+
+	g_assert_log(0 == htable_count(ctx->ht),
+		"%s(): context already has sources", G_STRFUNC);
+
+#ifdef HAS_EPOLL
+	if (event_set_mask_with_epoll == ctx->event_set_mask)
+		ctx->edge_triggered = TRUE;
+#endif	/* HAS_EPOLL */
+
+	CTX_UNLOCK(ctx);
+
+	return ctx->edge_triggered;
+}
+
+/**
+ * @return the name of the polling method used by the context.
+ */
+const char *
+inputevt_ctx_method(const inputevt_ctx_t *ctx)
+{
+	g_assert(ctx != NULL);
+	g_assert(ctx->initialized);
+
+	return ctx->polling_method;
+}
+
+/**
+ * Wait for I/O events on a private context and dispatch them.
+ *
+ * This is the event loop of threads owning a private context, to be called
+ * repeatedly.  The handlers are invoked from the calling thread.
+ *
+ * @param ctx			the polling context
+ * @param timeout_ms	maximum amount of time to wait for events
+ *
+ * @return the amount of ready sources that were dispatched.
+ */
+int
+inputevt_ctx_run(inputevt_ctx_t *ctx, int timeout_ms)
+{
+	int ready;
+
+	g_assert(ctx != NULL);
+	g_assert(ctx != get_global_poll_ctx());
+	g_assert(ctx->initialized);
+	g_assert(timeout_ms >= 0);
+
+	CTX_LOCK(ctx);
+
+	if (NULL == ctx->collect_events) {
+		struct pollfd pfd;
+
+		/*
+		 * The master file descriptor becomes readable when events are
+		 * pending, which inputevt_timer() will then collect.
+		 */
+
+		pfd.fd = ctx->master_fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+
+		CTX_SYSCALL(ctx);
+		inputevt_collect_start(ctx, 0);
+		ready = compat_poll(&pfd, 1, timeout_ms);
+		inputevt_collect_end(ctx, 0);
+	} else if (0 == ctx->max_poll_idx) {
+		CTX_UNLOCK(ctx);
+		thread_sleep_ms(timeout_ms);	/* Nothing to monitor yet */
+		return 0;
+	} else {
+		if (0 == ctx->num_ready)
+			check_for_events(ctx, &timeout_ms);
+		ready = ctx->num_ready;
+	}
+
+	CTX_UNLOCK(ctx);
+
+	if (ready > 0)
+		inputevt_timer(ctx);
+
+	return MAX(0, ready);
+}
+
+/**
+ * Adds an event source to the supplied polling context.
+ *
+ * @return the ID of the source within the context.
  */
 unsigned
-inputevt_add(int fd, inputevt_cond_t cond,
+inputevt_ctx_add(inputevt_ctx_t *ctx, int fd, inputevt_cond_t cond,
 	inputevt_handler_t handler, void *data)
 {
 	inputevt_relay_t *relay;
-	struct poll_ctx *ctx;
 	uint id;
 
+	g_assert(ctx != NULL);
 	g_assert(is_valid_fd(fd));
 	g_assert(zero_handler != handler);
 
 	safety_assert(is_open_fd(fd));
 	safety_assert(is_a_socket(fd) || is_a_fifo(fd));
 
-	ctx = get_global_poll_ctx();
-
 	g_assert(ctx->initialized);
 	g_assert(ctx->ht != NULL);
 
@@ -1688,6 +2095,10 @@ cond_is_okay:
 	 * However, we need to synchronously return an ID to the caller, so we
 	 * need to decide now and reserve the ID without necessarily adding the
 	 * source.
+	 *
+	 * Private contexts are dispatched by their own thread without holding
+	 * the lock whilst sources are added by other threads, hence additions
+	 * must also be deferred whilst they are dispatching events.
 	 */
 
 	CTX_LOCK(ctx);
@@ -1710,7 +2121,10 @@ cond_is_okay:
 		}
 	}
 
-	if (ctx->collecting) {
+	if (
+		ctx->collecting ||
+		(ctx->dispatching && ctx != get_global_poll_ctx())
+	) {
 		struct new_relay *nr;
 
 		WALLOC(nr);
@@ -1726,6 +2140,20 @@ cond_is_okay:
 	return id;
 }
 
+/**
+ * Adds an event source to the main GLIB monitor queue.
+ *
+ * A replacement for gdk_input_add().
+ * Behaves exactly the same, except destroy notification has
+ * been removed (since gtkg does not use it).
+ */
+unsigned
+inputevt_add(int fd, inputevt_cond_t cond,
+	inputevt_handler_t handler, void *data)
+{
+	return inputevt_ctx_add(get_global_poll_ctx(), fd, cond, handler, data);
+}
+
 /**
  * Force I/O processing for all the ready sources.
  *
@@ -1735,7 +2163,7 @@ cond_is_okay:
 void
 inputevt_dispatch(void)
 {
-	struct poll_ctx *ctx = get_global_poll_ctx();
+	struct inputevt_ctx *ctx = get_global_poll_ctx();
 
 	inputevt_timer(ctx);
 }
@@ -1746,25 +2174,8 @@ inputevt_dispatch(void)
 void
 inputevt_close(void)
 {
-	struct poll_ctx *ctx;
-
-	ctx = get_global_poll_ctx();
 	inputevt_stid = THREAD_INVALID_ID;
-
-	CTX_LOCK(ctx);
-
-	inputevt_purge_removed(ctx);
-	htable_free_null(&ctx->ht);
-	hash_list_free(&ctx->readable);
-	HFREE_NULL(ctx->used_poll_idx);
-	HFREE_NULL(ctx->used_event_id);
-	XFREE_NULL(ctx->relay);
-	XFREE_NULL(ctx->pfd_arr);
-	fd_close(&ctx->master_fd);
-	ctx->initialized = FALSE;
-
-	CTX_UNLOCK(ctx);
-	mutex_destroy(&ctx->lock);
+	inputevt_ctx_teardown(get_global_poll_ctx());
 }
 
 /* vi: set ts=4 sw=4 cindent: */
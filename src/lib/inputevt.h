@@ -65,6 +65,8 @@ typedef void (*inputevt_handler_t) (
 	inputevt_cond_t condition
 );
 
+typedef struct inputevt_ctx inputevt_ctx_t;
+
 /*
  * Module initialization and cleanup functions.
  */
@@ -88,6 +90,19 @@ size_t inputevt_data_available(void);
 void inputevt_remove(unsigned *id_ptr);
 void inputevt_set_readable(int fd);
 
+/*
+ * Private polling contexts, driven by their own thread.
+ */
+
+inputevt_ctx_t *inputevt_ctx_new(bool use_poll);
+void inputevt_ctx_free_null(inputevt_ctx_t **ctx_ptr);
+bool inputevt_ctx_set_edge_triggered(inputevt_ctx_t *ctx);
+const char *inputevt_ctx_method(const inputevt_ctx_t *ctx);
+unsigned inputevt_ctx_add(inputevt_ctx_t *ctx, int source,
+	inputevt_cond_t condition, inputevt_handler_t handler, void *data);
+void inputevt_ctx_remove(inputevt_ctx_t *ctx, unsigned *id_ptr);
+int inputevt_ctx_run(inputevt_ctx_t *ctx, int timeout_ms);
+
 #endif  /* _inputevt_h_ */
 
 /* vi: set ts=4 sw=4 cindent: */
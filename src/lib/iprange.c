@@ -438,4 +438,54 @@ iprange_get_host_count4(const struct iprange_db *idb)
 	return hosts;
 }
 
+/**
+ * Iterate over the IPv4 networks of the database, in increasing order.
+ *
+ * The database must be synchronized, so that networks do not overlap.
+ *
+ * @param idb	the IP range database
+ * @param cb	callback invoked on each network
+ * @param data	additional callback argument
+ */
+void
+iprange_foreach4(const struct iprange_db *idb, iprange_cb4_t cb, void *data)
+{
+	size_t i, n;
+
+	iprange_db_check(idb);
+	g_assert(!idb->tab4_unsorted);
+
+	n = sorted_array_count(idb->tab4);
+
+	for (i = 0; i < n; i++) {
+		const struct iprange_net4 *item = sorted_array_item(idb->tab4, i);
+		(*cb)(item->ip, item->bits, item->value, data);
+	}
+}
+
+/**
+ * Iterate over the IPv6 networks of the database, in increasing order.
+ *
+ * The database must be synchronized, so that networks do not overlap.
+ *
+ * @param idb	the IP range database
+ * @param cb	callback invoked on each network
+ * @param data	additional callback argument
+ */
+void
+iprange_foreach6(const struct iprange_db *idb, iprange_cb6_t cb, void *data)
+{
+	size_t i, n;
+
+	iprange_db_check(idb);
+	g_assert(!idb->tab6_unsorted);
+
+	n = sorted_array_count(idb->tab6);
+
+	for (i = 0; i < n; i++) {
+		const struct iprange_net6 *item = sorted_array_item(idb->tab6, i);
+		(*cb)(item->ip, item->bits, item->value, data);
+	}
+}
+
 /* vi: set ts=4 sw=4 cindent: */
@@ -45,6 +45,10 @@
 
 struct iprange_db;
 
+typedef void (*iprange_cb4_t)(uint32 net, uint bits, uint16 value, void *data);
+typedef void (*iprange_cb6_t)(
+	const uint8 *net, uint bits, uint16 value, void *data);
+
 const char *iprange_strerror(iprange_err_t errnum);
 
 struct iprange_db *iprange_new(void);
@@ -66,6 +70,11 @@ unsigned iprange_get_item_count6(const struct iprange_db *idb);
 
 unsigned iprange_get_host_count4(const struct iprange_db *idb);
 
+void iprange_foreach4(const struct iprange_db *idb,
+	iprange_cb4_t cb, void *data);
+void iprange_foreach6(const struct iprange_db *idb,
+	iprange_cb6_t cb, void *data);
+
 #endif	/* _iprange_h_ */
 
 /* vi: set ts=4 sw=4 cindent: */
@@ -0,0 +1,311 @@
+/*
+ * list-test -- sorted insertion tests for one-way and two-way lists.
+ *
+ * Copyright (c) 2026 gtk-gnutella developers
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the authors nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "common.h"
+
+#include "lib/plist.h"
+#include "lib/progname.h"
+#include "lib/pslist.h"
+#include "lib/rand31.h"
+#include "lib/xmalloc.h"
+
+#define TEST_ITEMS	64		/* Default amount of items per list */
+#define TEST_LOOPS	256		/* Default amount of random lists */
+
+static bool silent_mode, verbose_mode;
+static unsigned initial_seed;
+static const char *current_test;
+
+static void G_NORETURN
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-hSV] [-c items] [-n loops] [-R seed]\n"
+		"  -c : sets item count per list\n"
+		"  -h : prints this help message\n"
+		"  -n : sets amount of random lists to build\n"
+		"  -R : seed for repeatable random key sequence\n"
+		"  -S : silent mode -- do not print anything for successful tests\n"
+		"  -V : verbose mode -- print status after each successful test\n"
+		, getprogname());
+	exit(EXIT_FAILURE);
+}
+
+static void G_NORETURN
+test_abort(void)
+{
+	if (current_test != NULL)
+		printf("%s - FAILED\n", current_test);
+	printf("use '-R %u' to reproduce problem.\n", initial_seed);
+	abort();
+}
+
+#define test_assert(x) G_STMT_START {			\
+	if G_UNLIKELY(!(x)) {						\
+		printf("assertion \"%s\" failed at %s:%d\n",	\
+			#x, __FILE__, __LINE__);					\
+		test_abort();							\
+	}											\
+} G_STMT_END
+
+static int
+item_cmp(const void *a, const void *b)
+{
+	ulong x = pointer_to_ulong(a), y = pointer_to_ulong(b);
+
+	return CMP(x, y);
+}
+
+static int
+item_cmp_data(const void *a, const void *b, void *data)
+{
+	size_t *calls = data;
+
+	(*calls)++;
+	return item_cmp(a, b);
+}
+
+static void
+test_start(const char *what)
+{
+	current_test = what;
+}
+
+static void
+test_done(void)
+{
+	if (verbose_mode)
+		printf("%s - OK\n", current_test);
+	current_test = NULL;
+}
+
+/**
+ * Check that the one-way list holds exactly the items of the (sorted)
+ * reference array, in that order.
+ */
+static void
+pslist_check(const pslist_t *pl, const ulong *ref, size_t cnt)
+{
+	const pslist_t *l;
+	size_t i = 0;
+
+	for (l = pl; l != NULL; l = pslist_next(l)) {
+		test_assert(i < cnt);
+		test_assert(pointer_to_ulong(pslist_data(l)) == ref[i]);
+		i++;
+	}
+
+	test_assert(i == cnt);
+}
+
+/**
+ * Check that the two-way list holds exactly the items of the (sorted)
+ * reference array, in that order, and that the back links are consistent.
+ */
+static void
+plist_check(const plist_t *pl, const ulong *ref, size_t cnt)
+{
+	const plist_t *l, *prev = NULL;
+	size_t i = 0;
+
+	for (l = pl; l != NULL; l = plist_next(l)) {
+		test_assert(i < cnt);
+		test_assert(pointer_to_ulong(plist_data(l)) == ref[i]);
+		test_assert(plist_prev(l) == prev);
+		prev = l;
+		i++;
+	}
+
+	test_assert(i == cnt);
+}
+
+static void
+insert_ref(ulong *ref, size_t cnt, ulong v)
+{
+	size_t i = cnt;
+
+	while (i > 0 && ref[i - 1] > v) {
+		ref[i] = ref[i - 1];
+		i--;
+	}
+	ref[i] = v;
+}
+
+/**
+ * Fixed insertion sequences exercising the head, the middle and the tail
+ * of the list, including insertion after the current last item.
+ */
+static void
+test_fixed(void)
+{
+	static const struct {
+		const char *what;
+		ulong items[6];
+	} tests[] = {
+		{ "ascending",		{ 1, 2, 3, 4, 5, 6 } },
+		{ "descending",		{ 6, 5, 4, 3, 2, 1 } },
+		{ "append-last",	{ 3, 1, 2, 4, 5, 6 } },
+		{ "middle",			{ 1, 6, 3, 4, 2, 5 } },
+		{ "duplicates",		{ 2, 2, 1, 3, 3, 1 } },
+	};
+	size_t i, j;
+
+	for (i = 0; i < N_ITEMS(tests); i++) {
+		pslist_t *sl = NULL;
+		plist_t *dl = NULL;
+		ulong ref[N_ITEMS(tests[0].items)];
+		size_t calls = 0;
+
+		test_start(tests[i].what);
+
+		for (j = 0; j < N_ITEMS(tests[i].items); j++) {
+			void *p = ulong_to_pointer(tests[i].items[j]);
+
+			insert_ref(ref, j, tests[i].items[j]);
+			sl = pslist_insert_sorted(sl, p, item_cmp);
+			dl = plist_insert_sorted(dl, p, item_cmp);
+			pslist_check(sl, ref, j + 1);
+			plist_check(dl, ref, j + 1);
+		}
+
+		pslist_free_null(&sl);
+		plist_free_null(&dl);
+
+		for (j = 0; j < N_ITEMS(tests[i].items); j++) {
+			void *p = ulong_to_pointer(tests[i].items[j]);
+
+			sl = pslist_insert_sorted_with_dta(sl, p, item_cmp_data, &calls);
+			dl = plist_insert_sorted_with_dta(dl, p, item_cmp_data, &calls);
+		}
+
+		pslist_check(sl, ref, N_ITEMS(ref));
+		plist_check(dl, ref, N_ITEMS(ref));
+		test_assert(calls != 0);
+
+		pslist_free_null(&sl);
+		plist_free_null(&dl);
+
+		test_done();
+	}
+}
+
+/**
+ * Random insertion sequences, checked against a sorted reference array.
+ */
+static void
+test_random(size_t cnt, size_t loops)
+{
+	ulong *ref;
+	size_t n;
+
+	XMALLOC_ARRAY(ref, cnt);
+
+	for (n = 0; n < loops; n++) {
+		pslist_t *sl = NULL;
+		plist_t *dl = NULL;
+		size_t i;
+
+		test_start("random");
+
+		for (i = 0; i < cnt; i++) {
+			ulong v = rand31_value(cnt);
+
+			insert_ref(ref, i, v);
+			sl = pslist_insert_sorted(sl, ulong_to_pointer(v), item_cmp);
+			dl = plist_insert_sorted(dl, ulong_to_pointer(v), item_cmp);
+		}
+
+		pslist_check(sl, ref, cnt);
+		plist_check(dl, ref, cnt);
+
+		pslist_free_null(&sl);
+		plist_free_null(&dl);
+
+		test_done();
+	}
+
+	xfree(ref);
+}
+
+int
+main(int argc, char **argv)
+{
+	extern int optind;
+	extern char *optarg;
+	size_t count = TEST_ITEMS;
+	size_t loops = TEST_LOOPS;
+	unsigned rseed = 0;
+	int c;
+	const char options[] = "c:hn:R:SV";
+
+	progstart(argc, argv);
+
+	while ((c = getopt(argc, argv, options)) != EOF) {
+		switch (c) {
+		case 'c':			/* amount of items per list */
+			count = atol(optarg);
+			break;
+		case 'n':			/* amount of random lists */
+			loops = atol(optarg);
+			break;
+		case 'R':			/* randomize in a repeatable way */
+			rseed = atoi(optarg);
+			break;
+		case 'S':			/* silent mode */
+			silent_mode = TRUE;
+			break;
+		case 'V':			/* verbose mode */
+			verbose_mode = TRUE;
+			break;
+		case 'h':			/* show help */
+		default:
+			usage();
+			break;
+		}
+	}
+
+	if ((argc -= optind) != 0 || 0 == count)
+		usage();
+
+	rand31_set_seed(rseed);
+	initial_seed = rand31_current_seed();
+
+	test_fixed();
+	test_random(count, loops);
+
+	if (!silent_mode)
+		printf("All sorted list insertions OK.\n");
+
+	return 0;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -0,0 +1,417 @@
+/*
+ * Copyright (c) 2026, gtk-gnutella developers
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Per-domain memory accounting.
+ *
+ * Callers register a memory domain once, getting a small tag which they
+ * then supply to the tagged allocation routines declared in memtag.h, at
+ * allocation and at freeing time.  Each domain keeps, for each of the
+ * accounted allocators, the amount of bytes allocated and freed and the
+ * amount of allocation and freeing calls.  Counters are atomically updated,
+ * hence accounting costs two atomic additions per call and no lock.
+ *
+ * Blocks do not record their domain: this keeps the allocators untouched
+ * and the accounting exact, as long as the same tag is used to allocate
+ * and free a block.
+ *
+ * Periodic sampling through memtag_sample() computes the growth rate of
+ * each domain since the previous sample, which is how leaks and runaway
+ * caches are spotted.
+ *
+ * @author gtk-gnutella developers
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "memtag.h"
+
+#include "atomic.h"
+#include "dump_options.h"
+#include "log.h"
+#include "spinlock.h"
+#include "str.h"
+#include "stringify.h"
+#include "tm.h"
+#include "xsort.h"
+
+#include "override.h"			/* Must be the last header included */
+
+/**
+ * Counters of a domain for a given allocator.
+ */
+struct memtag_counters {
+	AU64(allocated);			/**< Bytes allocated */
+	AU64(freed);				/**< Bytes freed */
+	AU64(allocs);				/**< Allocation calls */
+	AU64(frees);				/**< Freeing calls */
+};
+
+/**
+ * A memory domain.
+ */
+struct memtag_domain {
+	struct memtag_counters c[MEMTAG_ALLOCATOR_COUNT];
+	const char *name;			/**< Domain name (static string) */
+	uint64 last_bytes;			/**< Bytes in use at last sample */
+	double rate;				/**< Growth in bytes/s between last samples */
+};
+
+static const char *memtag_allocator_name[] = {
+	"walloc",					/* MEMTAG_WALLOC */
+	"xmalloc",					/* MEMTAG_XMALLOC */
+	"vmm",						/* MEMTAG_VMM */
+};
+
+static struct memtag_domain memtag_domain[MEMTAG_MAX];
+static uint memtag_count = 1;	/* Slot 0 is MEMTAG_NONE */
+static spinlock_t memtag_slk = SPINLOCK_INIT;
+
+static tm_nano_t memtag_last_sample;
+static bool memtag_sampled;
+
+#define MEMTAG_LOCK		spinlock(&memtag_slk)
+#define MEMTAG_UNLOCK	spinunlock(&memtag_slk)
+
+static inline struct memtag_domain *
+memtag_get(memtag_t t)
+{
+	g_assert_log(t != MEMTAG_NONE && t < atomic_uint_get(&memtag_count),
+		"%s(): invalid tag %u", G_STRFUNC, t);
+
+	return &memtag_domain[t];
+}
+
+/**
+ * Register a memory domain.
+ *
+ * Registering the same name twice returns the same tag, so that modules
+ * can register their domain at initialization time without caring whether
+ * they were already initialized before.
+ *
+ * @param name		the domain name, which must be a static string
+ *
+ * @return the tag to use in the tagged allocation routines, MEMTAG_NONE if
+ * there are too many domains already.
+ */
+memtag_t
+memtag_register(const char *name)
+{
+	uint i;
+	memtag_t t = MEMTAG_NONE;
+
+	g_assert(name != NULL);
+
+	MEMTAG_LOCK;
+
+	for (i = 1; i < memtag_count; i++) {
+		if (0 == strcmp(name, memtag_domain[i].name)) {
+			t = i;
+			goto done;
+		}
+	}
+
+	if (memtag_count < MEMTAG_MAX) {
+		t = memtag_count;
+		memtag_domain[t].name = name;
+		atomic_uint_inc(&memtag_count);
+	}
+
+done:
+	MEMTAG_UNLOCK;
+
+	if G_UNLIKELY(MEMTAG_NONE == t)
+		s_carp_once("%s(): too many domains, not accounting \"%s\"",
+			G_STRFUNC, name);
+
+	return t;
+}
+
+/**
+ * @return the name of the domain for given tag.
+ */
+const char *
+memtag_name(memtag_t t)
+{
+	if (MEMTAG_NONE == t)
+		return "none";
+
+	return memtag_get(t)->name;
+}
+
+/**
+ * Account for an allocation of `size' bytes by allocator `a' in domain `t'.
+ */
+void
+memtag_account_alloc(memtag_t t, enum memtag_allocator a, size_t size)
+{
+	struct memtag_counters *c;
+
+	g_assert(UNSIGNED(a) < MEMTAG_ALLOCATOR_COUNT);
+
+	c = &memtag_get(t)->c[a];
+	AU64_ADD(&c->allocated, size);
+	AU64_INC(&c->allocs);
+}
+
+/**
+ * Account for the freeing of `size' bytes by allocator `a' in domain `t'.
+ */
+void
+memtag_account_free(memtag_t t, enum memtag_allocator a, size_t size)
+{
+	struct memtag_counters *c;
+
+	g_assert(UNSIGNED(a) < MEMTAG_ALLOCATOR_COUNT);
+
+	c = &memtag_get(t)->c[a];
+	AU64_ADD(&c->freed, size);
+	AU64_INC(&c->frees);
+}
+
+/**
+ * Snapshot of a domain, for reporting.
+ */
+struct memtag_snapshot {
+	const char *name;
+	uint64 bytes;				/**< Bytes in use */
+	uint64 blocks;				/**< Blocks in use */
+	uint64 allocs;				/**< Total allocation calls */
+	uint64 frees;				/**< Total freeing calls */
+	double rate;				/**< Growth rate, in bytes/s */
+};
+
+/**
+ * Take a snapshot of the counters of a domain.
+ *
+ * @param d		the domain
+ * @param a		the allocator, MEMTAG_ALLOCATOR_COUNT meaning all of them
+ * @param s		where the snapshot is written
+ */
+static void
+memtag_snapshot(const struct memtag_domain *d, uint a,
+	struct memtag_snapshot *s)
+{
+	uint i;
+
+	ZERO(s);
+	s->name = d->name;
+	s->rate = d->rate;
+
+	for (i = 0; i < MEMTAG_ALLOCATOR_COUNT; i++) {
+		const struct memtag_counters *c = &d->c[i];
+		uint64 allocs, frees;
+
+		if (a != MEMTAG_ALLOCATOR_COUNT && a != i)
+			continue;
+
+		/*
+		 * Read freeing counters first, so that a concurrent allocation
+		 * followed by its freeing cannot make usage appear negative.
+		 */
+
+		frees = AU64_VALUE(&c->frees);
+		s->bytes -= AU64_VALUE(&c->freed);
+		allocs = AU64_VALUE(&c->allocs);
+		s->bytes += AU64_VALUE(&c->allocated);
+
+		s->blocks += allocs - frees;
+		s->allocs += allocs;
+		s->frees += frees;
+	}
+}
+
+/**
+ * Compute the growth rate of each domain since the last sample.
+ *
+ * This is meant to be called periodically.
+ */
+void
+memtag_sample(void)
+{
+	tm_nano_t now;
+	double elapsed = 0.0;
+	uint i, n;
+
+	tm_precise_time(&now);
+	n = atomic_uint_get(&memtag_count);
+
+	MEMTAG_LOCK;
+
+	if (memtag_sampled)
+		elapsed = tm_precise_elapsed_f(&now, &memtag_last_sample);
+
+	memtag_last_sample = now;
+	memtag_sampled = TRUE;
+
+	for (i = 1; i < n; i++) {
+		struct memtag_domain *d = &memtag_domain[i];
+		struct memtag_snapshot s;
+
+		memtag_snapshot(d, MEMTAG_ALLOCATOR_COUNT, &s);
+
+		if (elapsed > 0.0) {
+			d->rate = ((double) s.bytes - (double) d->last_bytes) / elapsed;
+		}
+		d->last_bytes = s.bytes;
+	}
+
+	MEMTAG_UNLOCK;
+}
+
+/**
+ * Sort snapshots by decreasing growth rate, then by decreasing usage.
+ */
+static int
+memtag_snapshot_cmp(const void *a, const void *b)
+{
+	const struct memtag_snapshot *sa = a, *sb = b;
+	int c;
+
+	c = CMP(sb->rate, sa->rate);
+	return 0 != c ? c : CMP(sb->bytes, sa->bytes);
+}
+
+/**
+ * Take a sorted snapshot of all the registered domains.
+ *
+ * @param a		the allocator, MEMTAG_ALLOCATOR_COUNT meaning all of them
+ * @param s		array of MEMTAG_MAX entries where snapshots are written
+ *
+ * @return the amount of filled entries.
+ */
+static uint
+memtag_snapshot_all(uint a, struct memtag_snapshot *s)
+{
+	uint i, n;
+
+	n = atomic_uint_get(&memtag_count);
+
+	MEMTAG_LOCK;
+	for (i = 1; i < n; i++) {
+		memtag_snapshot(&memtag_domain[i], a, &s[i - 1]);
+	}
+	MEMTAG_UNLOCK;
+
+	xqsort(s, n - 1, sizeof s[0], memtag_snapshot_cmp);
+
+	return n - 1;
+}
+
+/**
+ * Dump per-domain memory usage, sorted by decreasing growth rate, to
+ * specified logging agent.
+ */
+void
+memtag_dump_stats_log(logagent_t *la, unsigned options)
+{
+	struct memtag_snapshot s[MEMTAG_MAX];
+	bool groupped = booleanize(options & DUMP_OPT_PRETTY);
+	uint i, n;
+
+	n = memtag_snapshot_all(MEMTAG_ALLOCATOR_COUNT, s);
+
+	for (i = 0; i < n; i++) {
+		char bytes[UINT64_DEC_GRP_BUFLEN], blocks[UINT64_DEC_GRP_BUFLEN];
+
+		if (groupped) {
+			uint64_to_gstring_buf(s[i].bytes, ARYLEN(bytes));
+			uint64_to_gstring_buf(s[i].blocks, ARYLEN(blocks));
+		} else {
+			uint64_to_string_buf(s[i].bytes, ARYLEN(bytes));
+			uint64_to_string_buf(s[i].blocks, ARYLEN(blocks));
+		}
+
+		log_info(la, "MEMTAG %-16s = %s byte%s in %s block%s, %+.1f B/s",
+			s[i].name, bytes, plural(s[i].bytes),
+			blocks, plural(s[i].blocks), s[i].rate);
+	}
+}
+
+/**
+ * Dump per-domain usage of each allocator to specified logging agent.
+ */
+void
+memtag_dump_usage_log(logagent_t *la, unsigned options)
+{
+	bool groupped = booleanize(options & DUMP_OPT_PRETTY);
+	uint a;
+
+	for (a = 0; a < MEMTAG_ALLOCATOR_COUNT; a++) {
+		struct memtag_snapshot s[MEMTAG_MAX];
+		uint i, n;
+
+		n = memtag_snapshot_all(a, s);
+
+		for (i = 0; i < n; i++) {
+			if (0 == s[i].allocs)
+				continue;
+
+			log_info(la, "MEMTAG %-16s %-7s bytes = %s",
+				s[i].name, memtag_allocator_name[a],
+				uint64_to_string_grp(s[i].bytes, groupped));
+			log_info(la, "MEMTAG %-16s %-7s blocks = %s",
+				s[i].name, memtag_allocator_name[a],
+				uint64_to_string_grp(s[i].blocks, groupped));
+			log_info(la, "MEMTAG %-16s %-7s allocs = %s",
+				s[i].name, memtag_allocator_name[a],
+				uint64_to_string_grp(s[i].allocs, groupped));
+			log_info(la, "MEMTAG %-16s %-7s frees = %s",
+				s[i].name, memtag_allocator_name[a],
+				uint64_to_string_grp(s[i].frees, groupped));
+		}
+	}
+}
+
+/**
+ * Log one line per domain with the current time, the domain name, the bytes
+ * and blocks in use and the growth rate, as tab-separated fields.
+ *
+ * This is meant to be logged periodically and extracted for graphing.
+ */
+void
+memtag_dump_samples_log(logagent_t *la)
+{
+	struct memtag_snapshot s[MEMTAG_MAX];
+	char now[UINT64_DEC_BUFLEN];
+	uint i, n;
+
+	n = memtag_snapshot_all(MEMTAG_ALLOCATOR_COUNT, s);
+	uint64_to_string_buf(tm_time(), ARYLEN(now));
+
+	for (i = 0; i < n; i++) {
+		char bytes[UINT64_DEC_BUFLEN], blocks[UINT64_DEC_BUFLEN];
+
+		uint64_to_string_buf(s[i].bytes, ARYLEN(bytes));
+		uint64_to_string_buf(s[i].blocks, ARYLEN(blocks));
+
+		log_info(la, "MEMTAG\t%s\t%s\t%s\t%s\t%.1f",
+			now, s[i].name, bytes, blocks, s[i].rate);
+	}
+}
+
+/* vi: set ts=4 sw=4 cindent: */
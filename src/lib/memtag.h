@@ -0,0 +1,213 @@
+/*
+ * Copyright (c) 2026, gtk-gnutella developers
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Per-domain memory accounting.
+ *
+ * @author gtk-gnutella developers
+ * @date 2026
+ */
+
+#ifndef _memtag_h_
+#define _memtag_h_
+
+#include "vmm.h"
+#include "walloc.h"
+#include "xmalloc.h"
+
+/**
+ * A memory domain tag, as returned by memtag_register().
+ *
+ * The MEMTAG_NONE tag disables accounting, so that a domain whose
+ * registration failed can still allocate memory through the tagged calls.
+ */
+typedef uint8 memtag_t;
+
+#define MEMTAG_NONE		0
+#define MEMTAG_MAX		64		/**< Max amount of domains, including none */
+
+/**
+ * Allocators whose usage is accounted per domain.
+ */
+enum memtag_allocator {
+	MEMTAG_WALLOC = 0,
+	MEMTAG_XMALLOC,
+	MEMTAG_VMM,
+
+	MEMTAG_ALLOCATOR_COUNT
+};
+
+struct logagent;
+
+/*
+ * Public interface.
+ */
+
+memtag_t memtag_register(const char *name);
+const char *memtag_name(memtag_t t);
+
+void memtag_account_alloc(memtag_t t, enum memtag_allocator a, size_t size);
+void memtag_account_free(memtag_t t, enum memtag_allocator a, size_t size);
+
+void memtag_sample(void);
+void memtag_dump_stats_log(struct logagent *la, unsigned options);
+void memtag_dump_usage_log(struct logagent *la, unsigned options);
+void memtag_dump_samples_log(struct logagent *la);
+
+/*
+ * Tagged allocation routines.
+ *
+ * The tag must be supplied again when freeing, since blocks do not record
+ * the domain they were allocated for.
+ */
+
+static inline void * G_MALLOC G_NON_NULL
+walloc_tagged(memtag_t t, size_t size)
+{
+	if (t != MEMTAG_NONE)
+		memtag_account_alloc(t, MEMTAG_WALLOC, size);
+	return walloc(size);
+}
+
+static inline void * G_MALLOC G_NON_NULL
+walloc0_tagged(memtag_t t, size_t size)
+{
+	if (t != MEMTAG_NONE)
+		memtag_account_alloc(t, MEMTAG_WALLOC, size);
+	return walloc0(size);
+}
+
+static inline void
+wfree_tagged(memtag_t t, void *p, size_t size)
+{
+	if (t != MEMTAG_NONE)
+		memtag_account_free(t, MEMTAG_WALLOC, size);
+	wfree(p, size);
+}
+
+static inline void * WARN_UNUSED_RESULT G_NON_NULL
+wrealloc_tagged(memtag_t t, void *p, size_t old_size, size_t new_size)
+{
+	if (t != MEMTAG_NONE) {
+		memtag_account_free(t, MEMTAG_WALLOC, old_size);
+		memtag_account_alloc(t, MEMTAG_WALLOC, new_size);
+	}
+	return wrealloc(p, old_size, new_size);
+}
+
+static inline void * G_MALLOC G_NON_NULL
+xmalloc_tagged(memtag_t t, size_t size)
+{
+	void *p = xmalloc(size);
+
+	if (t != MEMTAG_NONE)
+		memtag_account_alloc(t, MEMTAG_XMALLOC, xallocated(p));
+	return p;
+}
+
+static inline void * G_MALLOC G_NON_NULL
+xmalloc0_tagged(memtag_t t, size_t size)
+{
+	void *p = xmalloc0(size);
+
+	if (t != MEMTAG_NONE)
+		memtag_account_alloc(t, MEMTAG_XMALLOC, xallocated(p));
+	return p;
+}
+
+static inline void
+xfree_tagged(memtag_t t, void *p)
+{
+	if (NULL == p)
+		return;
+	if (t != MEMTAG_NONE)
+		memtag_account_free(t, MEMTAG_XMALLOC, xallocated(p));
+	xfree(p);
+}
+
+static inline void * WARN_UNUSED_RESULT G_NON_NULL
+xrealloc_tagged(memtag_t t, void *p, size_t size)
+{
+	if (t != MEMTAG_NONE && p != NULL)
+		memtag_account_free(t, MEMTAG_XMALLOC, xallocated(p));
+	p = xrealloc(p, size);
+	if (t != MEMTAG_NONE)
+		memtag_account_alloc(t, MEMTAG_XMALLOC, xallocated(p));
+	return p;
+}
+
+static inline void * G_MALLOC G_NON_NULL
+vmm_alloc_tagged(memtag_t t, size_t size)
+{
+	if (t != MEMTAG_NONE)
+		memtag_account_alloc(t, MEMTAG_VMM, size);
+	return vmm_alloc(size);
+}
+
+static inline void
+vmm_free_tagged(memtag_t t, void *p, size_t size)
+{
+	if (NULL == p)
+		return;
+	if (t != MEMTAG_NONE)
+		memtag_account_free(t, MEMTAG_VMM, size);
+	vmm_free(p, size);
+}
+
+#define WALLOC_TAG(t,p)			\
+G_STMT_START {					\
+	p = walloc_tagged(t, sizeof *p);	\
+} G_STMT_END
+
+#define WALLOC0_TAG(t,p)		\
+G_STMT_START {					\
+	p = walloc0_tagged(t, sizeof *p);	\
+} G_STMT_END
+
+#define WFREE_TAG(t,p)			\
+G_STMT_START {					\
+	wfree_tagged(t, p, sizeof *p);	\
+} G_STMT_END
+
+#define WFREE_TAG_TYPE_NULL(t,p)	\
+G_STMT_START {					\
+	if (p != NULL) {			\
+		wfree_tagged(t, p, sizeof *p);	\
+		p = NULL;				\
+	}							\
+} G_STMT_END
+
+#define XFREE_TAG_NULL(t,p)		\
+G_STMT_START {					\
+	if (p != NULL) {			\
+		xfree_tagged(t, p);		\
+		p = NULL;				\
+	}							\
+} G_STMT_END
+
+#endif /* _memtag_h_ */
+
+/* vi: set ts=4 sw=4 cindent: */
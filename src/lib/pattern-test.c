@@ -462,6 +462,8 @@ test_strstr(bool low_letters)
 		char *haystack = xmalloc(hlen + 1);
 		char *needle;
 		char *rs, *rp, *rn;
+		const char *rv;
+		cpattern_t *pat;
 
 		/*
 		 * Allow only empty needles once, and after that, use large needles.
@@ -507,6 +509,20 @@ test_strstr(bool low_letters)
 		if (rs != NULL)
 			g_assert(0 == strncmp(rs, needle, nlen));
 
+		pat = pattern_compile_fast(needle, nlen, FALSE);
+
+		rv = pattern_simd_force(pat, haystack, 0, 0, qs_any);
+		g_assert_log(rs == rv,
+			"%s(%zu): rs=%p, rv=%p, hlen=%'zu, nlen=%'zu (length unknown)",
+			G_STRFUNC, asize, rs, rv, hlen, nlen);
+
+		rv = pattern_simd_force(pat, haystack, hlen, 0, qs_any);
+		g_assert_log(rs == rv,
+			"%s(%zu): rs=%p, rv=%p, hlen=%'zu, nlen=%'zu (length known)",
+			G_STRFUNC, asize, rs, rv, hlen, nlen);
+
+		pattern_free(pat);
+
 		try++;
 		if (rs != NULL) {
 			matches++;
@@ -1116,16 +1132,19 @@ main(int argc, char **argv)
 	/*
 	 * Test correctness of qs_* flags and case-sensitiveness
 	 *
-	 * We have to check both Quick Search and 2-Way for correctness.
+	 * We have to check Quick Search, 2-Way and the SIMD kernels for
+	 * correctness.
 	 */
 
 #define FN(x)		x ## _force, #x
 
 	test_pattern_case(FN(pattern_qsearch));
 	test_pattern_case(FN(pattern_match));
+	test_pattern_case(FN(pattern_simd));
 
 	test_qs_flags(FN(pattern_qsearch));
 	test_qs_flags(FN(pattern_match));
+	test_qs_flags(FN(pattern_simd));
 
 	/*
 	 * OK, seems the above are correct, benchmark our routines.
@@ -52,6 +52,12 @@
 
 #include "override.h"		/* Must be the last header included */
 
+#if defined(HAS_G_TARGET) && (defined(__x86_64__) || defined(__i386__))
+#define PATTERN_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
 #define ALPHA_SIZE	256			/**< Alphabet size */
 
 #define CPU_CACHELINE	(8 * sizeof(long))	/* Guesstimate of CPU cacheline */
@@ -2056,6 +2062,474 @@ pattern_strrchr(const char *haystack, int c)
 	return pattern_memrchr(haystack, c, len);
 }
 
+/***
+ *** SIMD kernels.
+ ***
+ *** These are additional candidates for the benchmarks run by pattern_init():
+ *** they are only installed when they end-up being faster than both the libc
+ *** and our word-at-a-time implementations on the running CPU.
+ ***
+ *** The same code is compiled for 16-byte (SSE2) and 32-byte (AVX2) vectors
+ *** through the PATTERN_xxx_<isa> operation macros below.
+ ***/
+
+#ifdef PATTERN_X86
+
+#define PATTERN_VEC_sse2			__m128i
+#define PATTERN_LOAD_sse2(p)		_mm_load_si128((const __m128i *) (p))
+#define PATTERN_LOADU_sse2(p)		_mm_loadu_si128((const __m128i *) (p))
+#define PATTERN_SET1_sse2(c)		_mm_set1_epi8(c)
+#define PATTERN_EQ_sse2(a, b)		_mm_cmpeq_epi8((a), (b))
+#define PATTERN_OR_sse2(a, b)		_mm_or_si128((a), (b))
+#define PATTERN_AND_sse2(a, b)		_mm_and_si128((a), (b))
+#define PATTERN_MASK_sse2(v)		((uint32) _mm_movemask_epi8(v))
+
+#define PATTERN_VEC_avx2			__m256i
+#define PATTERN_LOAD_avx2(p)		_mm256_load_si256((const __m256i *) (p))
+#define PATTERN_LOADU_avx2(p)		_mm256_loadu_si256((const __m256i *) (p))
+#define PATTERN_SET1_avx2(c)		_mm256_set1_epi8(c)
+#define PATTERN_EQ_avx2(a, b)		_mm256_cmpeq_epi8((a), (b))
+#define PATTERN_OR_avx2(a, b)		_mm256_or_si256((a), (b))
+#define PATTERN_AND_avx2(a, b)		_mm256_and_si256((a), (b))
+#define PATTERN_MASK_avx2(v)		((uint32) _mm256_movemask_epi8(v))
+
+/**
+ * Check the inner part of a SIMD candidate, whose first and last characters
+ * are already known to match the pattern.
+ */
+static inline bool
+pattern_simd_verify(const cpattern_t *p, const uchar *t)
+{
+	const uchar *n = (const uchar *) p->pattern;
+	size_t i;
+
+	if (p->len <= 2)
+		return TRUE;
+
+	if (!p->icase)
+		return 0 == memcmp(&t[1], &n[1], p->len - 2);
+
+	for (i = 1; i < p->len - 1; i++) {
+		if (t[i] != n[i] && ascii_tolower(t[i]) != ascii_tolower(n[i]))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Walk through the candidate positions flagged in `m', relative to `base'.
+ */
+#define PATTERN_SIMD_CANDIDATES(base, m)								\
+	while ((m) != 0) {													\
+		const uchar *tc = (base) + ctz(m);								\
+		if (															\
+			pattern_simd_verify(p, tc) &&								\
+			pattern_has_matched(p, tc, text, end, word)					\
+		)																\
+			return (const char *) tc;									\
+		(m) &= (m) - 1;													\
+	}
+
+/*
+ * The memchr(), strchr() and strlen() kernels start with an aligned load of
+ * the vector holding the first byte, masking-out what precedes the string:
+ * like pattern_memchr(), they can read past the end of the string but never
+ * across a page boundary.
+ *
+ * The main loops test 4 vectors at a time, starting at an address aligned
+ * on the size of these 4 vectors so that they still lie on the same page.
+ *
+ * The substring search is the "generic SIMD" algorithm: we compare, for W
+ * consecutive positions at once, the first and last characters of the needle
+ * against the text and only verify the positions where both match.  With
+ * case-insensitive patterns, each of these two characters is compared with
+ * its lowercase and uppercase variants.
+ *
+ * Because that filtering can degenerate to O(m*n) on pathological texts,
+ * needles longer than PATTERN_SIMD_MAXLEN are handed to the 2-way algorithm.
+ */
+#define PATTERN_SIMD_MAXLEN		32
+
+#define PATTERN_SIMD_KERNELS(isa)										\
+																		\
+static void * G_TARGET(#isa) G_HOT										\
+pattern_memchr_ ## isa(const void *haystack, int c, size_t n)			\
+{																		\
+	const size_t w = sizeof(PATTERN_VEC_ ## isa);						\
+	const PATTERN_VEC_ ## isa vc = PATTERN_SET1_ ## isa(c);				\
+	const char *s = haystack;											\
+	size_t off = pointer_to_ulong(s) & (w - 1);							\
+	const char *p = s - off;											\
+	uint32 m;															\
+	int i;																\
+																		\
+	if G_UNLIKELY(0 == n)												\
+		return NULL;													\
+																		\
+	n = size_saturate_add(n, off);	/* Bytes to scan from `p' */		\
+	m = PATTERN_MASK_ ## isa(PATTERN_EQ_ ## isa(						\
+			PATTERN_LOAD_ ## isa(p), vc));								\
+	m &= MAX_INT_VAL(uint32) << off;									\
+																		\
+	while (0 == m) {													\
+		if (n <= w)														\
+			return NULL;												\
+		p += w;															\
+		n -= w;															\
+		if (0 == (pointer_to_ulong(p) & (4 * w - 1))) {				\
+			while (n > 4 * w) {											\
+				PATTERN_VEC_ ## isa a = PATTERN_LOAD_ ## isa(p);		\
+				PATTERN_VEC_ ## isa b = PATTERN_LOAD_ ## isa(p + w);	\
+				PATTERN_VEC_ ## isa x = PATTERN_LOAD_ ## isa(p + 2 * w);\
+				PATTERN_VEC_ ## isa y = PATTERN_LOAD_ ## isa(p + 3 * w);\
+				a = PATTERN_OR_ ## isa(									\
+					PATTERN_EQ_ ## isa(a, vc), PATTERN_EQ_ ## isa(b, vc));\
+				x = PATTERN_OR_ ## isa(									\
+					PATTERN_EQ_ ## isa(x, vc), PATTERN_EQ_ ## isa(y, vc));\
+				if (0 != PATTERN_MASK_ ## isa(PATTERN_OR_ ## isa(a, x)))	\
+					break;												\
+				p += 4 * w;												\
+				n -= 4 * w;												\
+			}															\
+		}																\
+		m = PATTERN_MASK_ ## isa(PATTERN_EQ_ ## isa(					\
+				PATTERN_LOAD_ ## isa(p), vc));							\
+	}																	\
+																		\
+	i = ctz(m);															\
+	return UNSIGNED(i) < n ? deconstify_char(p) + i : NULL;				\
+}																		\
+																		\
+static char * G_TARGET(#isa) G_HOT										\
+pattern_strchr_ ## isa(const char *s, int c)							\
+{																		\
+	const size_t w = sizeof(PATTERN_VEC_ ## isa);						\
+	const PATTERN_VEC_ ## isa vc = PATTERN_SET1_ ## isa(c);				\
+	const PATTERN_VEC_ ## isa zero = PATTERN_SET1_ ## isa(0);			\
+	size_t off = pointer_to_ulong(s) & (w - 1);							\
+	const char *p = s - off;											\
+	PATTERN_VEC_ ## isa v;												\
+	uint32 m;															\
+																		\
+	v = PATTERN_LOAD_ ## isa(p);										\
+	m = PATTERN_MASK_ ## isa(PATTERN_OR_ ## isa(						\
+			PATTERN_EQ_ ## isa(v, vc), PATTERN_EQ_ ## isa(v, zero)));	\
+	m &= MAX_INT_VAL(uint32) << off;									\
+																		\
+	while (0 == m) {													\
+		p += w;															\
+		if (0 == (pointer_to_ulong(p) & (4 * w - 1))) {				\
+			for (;;) {													\
+				PATTERN_VEC_ ## isa a = PATTERN_LOAD_ ## isa(p);		\
+				PATTERN_VEC_ ## isa b = PATTERN_LOAD_ ## isa(p + w);	\
+				PATTERN_VEC_ ## isa x = PATTERN_LOAD_ ## isa(p + 2 * w);\
+				PATTERN_VEC_ ## isa y = PATTERN_LOAD_ ## isa(p + 3 * w);\
+				a = PATTERN_OR_ ## isa(									\
+					PATTERN_OR_ ## isa(									\
+						PATTERN_EQ_ ## isa(a, vc), PATTERN_EQ_ ## isa(a, zero)),\
+					PATTERN_OR_ ## isa(									\
+						PATTERN_EQ_ ## isa(b, vc), PATTERN_EQ_ ## isa(b, zero)));\
+				x = PATTERN_OR_ ## isa(									\
+					PATTERN_OR_ ## isa(									\
+						PATTERN_EQ_ ## isa(x, vc), PATTERN_EQ_ ## isa(x, zero)),\
+					PATTERN_OR_ ## isa(									\
+						PATTERN_EQ_ ## isa(y, vc), PATTERN_EQ_ ## isa(y, zero)));\
+				if (0 != PATTERN_MASK_ ## isa(PATTERN_OR_ ## isa(a, x)))	\
+					break;												\
+				p += 4 * w;												\
+			}															\
+		}																\
+		v = PATTERN_LOAD_ ## isa(p);									\
+		m = PATTERN_MASK_ ## isa(PATTERN_OR_ ## isa(					\
+				PATTERN_EQ_ ## isa(v, vc), PATTERN_EQ_ ## isa(v, zero)));\
+	}																	\
+																		\
+	p += ctz(m);														\
+	return *p == (char) c ? deconstify_char(p) : NULL;					\
+}																		\
+																		\
+static size_t G_TARGET(#isa) G_HOT										\
+pattern_strlen_ ## isa(const char *s)									\
+{																		\
+	const size_t w = sizeof(PATTERN_VEC_ ## isa);						\
+	const PATTERN_VEC_ ## isa zero = PATTERN_SET1_ ## isa(0);			\
+	size_t off = pointer_to_ulong(s) & (w - 1);							\
+	const char *p = s - off;											\
+	uint32 m;															\
+																		\
+	m = PATTERN_MASK_ ## isa(PATTERN_EQ_ ## isa(						\
+			PATTERN_LOAD_ ## isa(p), zero));							\
+	m &= MAX_INT_VAL(uint32) << off;									\
+																		\
+	while (0 == m) {													\
+		p += w;															\
+		if (0 == (pointer_to_ulong(p) & (4 * w - 1))) {				\
+			for (;;) {													\
+				PATTERN_VEC_ ## isa a = PATTERN_LOAD_ ## isa(p);		\
+				PATTERN_VEC_ ## isa b = PATTERN_LOAD_ ## isa(p + w);	\
+				PATTERN_VEC_ ## isa x = PATTERN_LOAD_ ## isa(p + 2 * w);\
+				PATTERN_VEC_ ## isa y = PATTERN_LOAD_ ## isa(p + 3 * w);\
+				a = PATTERN_OR_ ## isa(									\
+					PATTERN_EQ_ ## isa(a, zero), PATTERN_EQ_ ## isa(b, zero));\
+				x = PATTERN_OR_ ## isa(									\
+					PATTERN_EQ_ ## isa(x, zero), PATTERN_EQ_ ## isa(y, zero));\
+				if (0 != PATTERN_MASK_ ## isa(PATTERN_OR_ ## isa(a, x)))	\
+					break;												\
+				p += 4 * w;												\
+			}															\
+		}																\
+		m = PATTERN_MASK_ ## isa(PATTERN_EQ_ ## isa(					\
+				PATTERN_LOAD_ ## isa(p), zero));						\
+	}																	\
+																		\
+	return ptr_diff(p, s) + ctz(m);										\
+}																		\
+																		\
+static const char * G_TARGET(#isa) G_HOT								\
+pattern_simd_known_ ## isa(												\
+	const cpattern_t *p, const uchar *text, size_t tlen, size_t toffset,	\
+	qsearch_mode_t word)												\
+{																		\
+	const size_t w = sizeof(PATTERN_VEC_ ## isa);						\
+	const uchar *n = (const uchar *) p->pattern;						\
+	const uchar *end = text + tlen;										\
+	const uchar *tp = text + toffset;									\
+	const uchar *last;				/* Last possible match start */		\
+	size_t nlen = p->len;												\
+	uchar f1, f2, l1, l2;												\
+	PATTERN_VEC_ ## isa vf1, vf2, vl1, vl2;								\
+																		\
+	pattern_check(p);													\
+																		\
+	if G_UNLIKELY(0 == nlen || nlen > PATTERN_SIMD_MAXLEN)				\
+		return pattern_match_known(p, text, tlen, toffset, word);		\
+																		\
+	if G_UNLIKELY(tlen - toffset < nlen)								\
+		return NULL;													\
+																		\
+	last = end - nlen;													\
+	f1 = f2 = n[0];														\
+	l1 = l2 = n[nlen - 1];												\
+																		\
+	if (p->icase) {														\
+		f1 = ascii_tolower(f1);											\
+		f2 = ascii_toupper(f2);											\
+		l1 = ascii_tolower(l1);											\
+		l2 = ascii_toupper(l2);											\
+	}																	\
+																		\
+	vf1 = PATTERN_SET1_ ## isa(f1);										\
+	vf2 = PATTERN_SET1_ ## isa(f2);										\
+	vl1 = PATTERN_SET1_ ## isa(l1);										\
+	vl2 = PATTERN_SET1_ ## isa(l2);										\
+																		\
+	while (ptr_diff(end, tp) >= w + nlen - 1) {							\
+		PATTERN_VEC_ ## isa f = PATTERN_LOADU_ ## isa(tp);				\
+		PATTERN_VEC_ ## isa l = PATTERN_LOADU_ ## isa(tp + nlen - 1);	\
+		uint32 m;														\
+																		\
+		f = PATTERN_OR_ ## isa(											\
+			PATTERN_EQ_ ## isa(f, vf1), PATTERN_EQ_ ## isa(f, vf2));	\
+		l = PATTERN_OR_ ## isa(											\
+			PATTERN_EQ_ ## isa(l, vl1), PATTERN_EQ_ ## isa(l, vl2));	\
+		m = PATTERN_MASK_ ## isa(PATTERN_AND_ ## isa(f, l));			\
+		PATTERN_SIMD_CANDIDATES(tp, m);									\
+		tp += w;														\
+	}																	\
+																		\
+	if (tp > last)														\
+		return NULL;													\
+																		\
+	/*																	\
+	 * Process the remaining positions with a last vector ending at the	\
+	 * end of the text, masking those we already checked, if the text is	\
+	 * large enough.  Otherwise fallback to scalar comparisons.			\
+	 */																	\
+																		\
+	if (tlen >= w + nlen - 1) {											\
+		const uchar *q = end - (w + nlen - 1);							\
+		PATTERN_VEC_ ## isa f = PATTERN_LOADU_ ## isa(q);				\
+		PATTERN_VEC_ ## isa l = PATTERN_LOADU_ ## isa(q + nlen - 1);	\
+		uint32 m;														\
+																		\
+		f = PATTERN_OR_ ## isa(											\
+			PATTERN_EQ_ ## isa(f, vf1), PATTERN_EQ_ ## isa(f, vf2));	\
+		l = PATTERN_OR_ ## isa(											\
+			PATTERN_EQ_ ## isa(l, vl1), PATTERN_EQ_ ## isa(l, vl2));	\
+		m = PATTERN_MASK_ ## isa(PATTERN_AND_ ## isa(f, l));			\
+		m &= MAX_INT_VAL(uint32) << ptr_diff(tp, q);					\
+		PATTERN_SIMD_CANDIDATES(q, m);									\
+		return NULL;													\
+	}																	\
+																		\
+	for (; tp <= last; tp++) {											\
+		uchar a = tp[0], b = tp[nlen - 1];								\
+		if (															\
+			(a == f1 || a == f2) && (b == l1 || b == l2) &&				\
+			pattern_simd_verify(p, tp) &&								\
+			pattern_has_matched(p, tp, text, end, word)					\
+		)																\
+			return (const char *) tp;									\
+	}																	\
+																		\
+	return NULL;														\
+}																		\
+																		\
+static const char * G_TARGET(#isa)										\
+pattern_simd_unknown_ ## isa(											\
+	const cpattern_t *p, const uchar *text, size_t min_tlen,			\
+	qsearch_mode_t word)												\
+{																		\
+	size_t tlen;														\
+																		\
+	if G_UNLIKELY(p->len > PATTERN_SIMD_MAXLEN)							\
+		return pattern_match_unknown(p, text, min_tlen, word);			\
+																		\
+	tlen = min_tlen + pattern_strlen_ ## isa((const char *) text + min_tlen);\
+	return pattern_simd_known_ ## isa(p, text, tlen, 0, word);			\
+}
+
+PATTERN_SIMD_KERNELS(sse2)
+PATTERN_SIMD_KERNELS(avx2)
+
+#define PATTERN_CPU_SSE2	(1U << 0)
+#define PATTERN_CPU_AVX2	(1U << 1)
+
+/**
+ * A set of SIMD kernels, as benchmarking candidates.
+ */
+static const struct pattern_simd {
+	uint cpu;						/**< CPU feature they require */
+	const char *memchr_name;
+	pattern_memchr_t *memchr;
+	const char *strchr_name;
+	pattern_strchr_t *strchr;
+	const char *strlen_name;
+	pattern_strlen_t *strlen;
+	const char *unknown_name;
+	pattern_dflt_unknown_t *unknown;
+	const char *known_name;
+	pattern_dflt_known_t *known;
+} pattern_simd[] = {
+#define PATTERN_SIMD(isa, cpu)	{										\
+	cpu,																\
+	"pattern_memchr_" #isa,			pattern_memchr_ ## isa,				\
+	"pattern_strchr_" #isa,			pattern_strchr_ ## isa,				\
+	"pattern_strlen_" #isa,			pattern_strlen_ ## isa,				\
+	"pattern_simd_unknown_" #isa,	pattern_simd_unknown_ ## isa,		\
+	"pattern_simd_known_" #isa,		pattern_simd_known_ ## isa,			\
+}
+	PATTERN_SIMD(sse2, PATTERN_CPU_SSE2),
+	PATTERN_SIMD(avx2, PATTERN_CPU_AVX2),
+#undef PATTERN_SIMD
+};
+
+/**
+ * Probe the CPU for the instruction set extensions we can use.
+ */
+static uint
+pattern_cpu_features(void)
+{
+	uint eax, ebx, ecx, edx, max;
+	uint features = 0;
+	bool ymm = FALSE;
+
+	max = __get_cpuid_max(0, NULL);
+	if (max < 1)
+		return 0;
+
+	__cpuid(1, eax, ebx, ecx, edx);
+
+	if (edx & bit_SSE2)
+		features |= PATTERN_CPU_SSE2;
+
+	/*
+	 * AVX2 also requires that the OS saves the YMM registers on context
+	 * switches, which is advertised through XCR0.
+	 */
+
+	if (ecx & bit_OSXSAVE) {
+		uint lo, hi;
+
+		__asm__ __volatile__ ("xgetbv" : "=a" (lo), "=d" (hi) : "c" (0));
+		ymm = 6 == (lo & 6);
+	}
+
+	if (max >= 7) {
+		__cpuid_count(7, 0, eax, ebx, ecx, edx);
+
+		if (ymm && (ebx & bit_AVX2))
+			features |= PATTERN_CPU_AVX2;
+	}
+
+	return features;
+}
+
+static uint pattern_cpu;
+static bool pattern_cpu_probed;
+
+/**
+ * @return TRUE if the SIMD kernels can be used on the running CPU.
+ */
+static bool
+pattern_simd_available(const struct pattern_simd *ps)
+{
+	if G_UNLIKELY(!pattern_cpu_probed) {
+		pattern_cpu = pattern_cpu_features();
+		pattern_cpu_probed = TRUE;
+	}
+
+	return 0 != (pattern_cpu & ps->cpu);
+}
+
+#endif	/* PATTERN_X86 */
+
+/**
+ * SIMD matching algorithm, using the widest kernel the CPU supports.  It
+ * looks for the already compiled pattern within the text, according to the
+ * word-matching directives.
+ *
+ * When no SIMD kernel is available, this falls back to the 2-way algorithm.
+ *
+ * This version is immune to benchmarking!
+ *
+ * @return pointer to beginning of matching substring, NULL if not found.
+ */
+const char *
+pattern_simd_force(
+	const cpattern_t *cpat,	/**< Compiled pattern */
+	const char *text,		/**< Text we're scanning */
+	size_t tlen,			/**< Text length, 0 = unknown */
+	size_t toffset,			/**< Offset within text for search start */
+	qsearch_mode_t word)	/**< Beginning/whole word matching? */
+{
+#ifdef PATTERN_X86
+	size_t k = N_ITEMS(pattern_simd);
+
+	while (k-- != 0) {
+		const struct pattern_simd *ps = &pattern_simd[k];
+
+		if (!pattern_simd_available(ps))
+			continue;
+
+		if (0 == tlen) {
+			g_assert_log(0 == toffset,
+				"%s(): toffset=%'zu, must be 0 when text length is unknown",
+				G_STRFUNC, toffset);
+			return (*ps->unknown)(cpat, (uchar *) text, 0, word);
+		} else {
+			g_assert_log(toffset <= tlen,
+				"%s(): toffset=%'zu, tlen=%'zu",
+				G_STRFUNC, toffset, tlen);
+			return (*ps->known)(cpat, (uchar *) text, tlen, toffset, word);
+		}
+	}
+#endif	/* PATTERN_X86 */
+
+	return pattern_match_force(cpat, text, tlen, toffset, word);
+}
+
 /**
  * Specialized version for tiny needles of 2 characters.
  */
@@ -2995,8 +3469,121 @@ pattern_benchmark_n_times(
 	ctx->name[idx] = # function;				\
 	ctx->u.fn[idx] = function;
 
+#define PATTERN_BENCH_DFLT_NEEDLES	5	/* odd number */
+
+/**
+ * Benchmark the two default routines for typical needle lengths.
+ *
+ * @return index of the routine that was faster for most of them (0 or 1).
+ */
+static size_t
+pattern_benchmark_needles(
+	enum pattern_benchmark_type which,
+	int verbose,
+	struct pattern_benchmark_context *ctx)
+{
+	size_t n;
+	char needle[PATTERN_NEEDLE_LEN + 1];
+	size_t sum = 0;
+	size_t winner = 0;
+
+	ctx->needle = needle;
+	ctx->use_text = TRUE;	/* More representative of real text */
+	ctx->direction = PATTERN_FORWARD;
+
+	for (n = 3; n < 3 + PATTERN_BENCH_DFLT_NEEDLES; n++) {
+		ctx->nlen = n;		/* Typical needle length */
+		sum += pattern_benchmark_n_times(3, which, verbose, ctx);
+	}
+
+	if (sum > PATTERN_BENCH_DFLT_NEEDLES / 2)
+		winner = 1;
+
+	if (verbose & PATTERN_INIT_SELECTED) {
+		g_assert(winner <= 1);
+		s_info("will use %s() over %s()",
+			ctx->name[winner], ctx->name[1 - winner]);
+	}
+
+	return winner;
+}
+
+/**
+ * Challenge the routine which won the last benchmark with each of the SIMD
+ * kernels the CPU supports, in turn.
+ *
+ * @param which		the type of benchmark
+ * @param i			index of the routine which won the last benchmark
+ * @param verbose	verbosity flags
+ * @param ctx		the benchmarking context
+ *
+ * @return index of the routine that won the last round (0 or 1).
+ */
+static size_t
+pattern_benchmark_simd(
+	enum pattern_benchmark_type which,
+	size_t i,
+	int verbose,
+	struct pattern_benchmark_context *ctx)
+{
+#ifdef PATTERN_X86
+	size_t k;
+
+	for (k = 0; k < N_ITEMS(pattern_simd); k++) {
+		const struct pattern_simd *ps = &pattern_simd[k];
+
+		if (!pattern_simd_available(ps))
+			continue;
+
+		ctx->name[0] = ctx->name[i];
+
+		switch (which) {
+		case PATTERN_BENCH_MEMCHR:
+			ctx->u.mc[0] = ctx->u.mc[i];
+			ctx->name[1] = ps->memchr_name;
+			ctx->u.mc[1] = ps->memchr;
+			i = pattern_benchmark_n_times(3, which, verbose, ctx);
+			break;
+		case PATTERN_BENCH_STRCHR:
+			ctx->u.sc[0] = ctx->u.sc[i];
+			ctx->name[1] = ps->strchr_name;
+			ctx->u.sc[1] = ps->strchr;
+			i = pattern_benchmark_n_times(3, which, verbose, ctx);
+			break;
+		case PATTERN_BENCH_STRLEN:
+			ctx->u.sl[0] = ctx->u.sl[i];
+			ctx->name[1] = ps->strlen_name;
+			ctx->u.sl[1] = ps->strlen;
+			i = pattern_benchmark_n_times(3, which, verbose, ctx);
+			break;
+		case PATTERN_BENCH_DFLT_UNKNOWN:
+			ctx->u.pu[0] = ctx->u.pu[i];
+			ctx->name[1] = ps->unknown_name;
+			ctx->u.pu[1] = ps->unknown;
+			i = pattern_benchmark_needles(which, verbose, ctx);
+			break;
+		case PATTERN_BENCH_DFLT_KNOWN:
+			ctx->u.pk[0] = ctx->u.pk[i];
+			ctx->name[1] = ps->known_name;
+			ctx->u.pk[1] = ps->known;
+			i = pattern_benchmark_needles(which, verbose, ctx);
+			break;
+		default:
+			g_assert_not_reached();
+		}
+	}
+#else
+	(void) which;
+	(void) verbose;
+	(void) ctx;
+#endif	/* PATTERN_X86 */
+
+	return i;
+}
+
 /**
- * Benchmark the memchr() routine against pattern_memchr().
+ * Benchmark the memchr() routine against pattern_memchr(), then the winner
+ * against the SIMD kernels.
  */
 static void
 pattern_benchmark_memchr(int verbose, struct pattern_benchmark_context *ctx)
@@ -3010,6 +3597,7 @@ pattern_benchmark_memchr(int verbose, struct pattern_benchmark_context *ctx)
 	ctx->direction = PATTERN_FORWARD;
 
 	i = pattern_benchmark_n_times(3, PATTERN_BENCH_MEMCHR, verbose, ctx);
+	i = pattern_benchmark_simd(PATTERN_BENCH_MEMCHR, i, verbose, ctx);
 	fast_memchr = ctx->u.mc[i];
 }
 
@@ -3039,7 +3627,8 @@ pattern_benchmark_memrchr(int verbose, struct pattern_benchmark_context *ctx)
 }
 
 /**
- * Benchmark the strchr() routine against pattern_strchr().
+ * Benchmark the strchr() routine against pattern_strchr(), then the winner
+ * against the SIMD kernels.
  */
 static void
 pattern_benchmark_strchr(int verbose, struct pattern_benchmark_context *ctx)
@@ -3055,6 +3644,7 @@ pattern_benchmark_strchr(int verbose, struct pattern_benchmark_context *ctx)
 	ctx->c = pattern_non_alphabet;
 
 	i = pattern_benchmark_n_times(3, PATTERN_BENCH_STRCHR, verbose, ctx);
+	i = pattern_benchmark_simd(PATTERN_BENCH_STRCHR, i, verbose, ctx);
 	fast_strchr = ctx->u.sc[i];
 }
 
@@ -3079,7 +3669,8 @@ pattern_benchmark_strrchr(int verbose, struct pattern_benchmark_context *ctx)
 }
 
 /**
- * Benchmark the strlen() routine against pattern_strlen().
+ * Benchmark the strlen() routine against pattern_strlen(), then the winner
+ * against the SIMD kernels.
  */
 static void
 pattern_benchmark_strlen(int verbose, struct pattern_benchmark_context *ctx)
@@ -3092,6 +3683,7 @@ pattern_benchmark_strlen(int verbose, struct pattern_benchmark_context *ctx)
 	ctx->direction = PATTERN_FORWARD;
 
 	i = pattern_benchmark_n_times(3, PATTERN_BENCH_STRLEN, verbose, ctx);
+	i = pattern_benchmark_simd(PATTERN_BENCH_STRLEN, i, verbose, ctx);
 	fast_strlen = ctx->u.sl[i];
 }
 
@@ -3138,7 +3730,8 @@ pattern_benchmark_dflt_known(
 
 /**
  * Benchmark Quick Search versus 2-Way for matching with known / unknown
- * text lengths, for typical string searches.
+ * text lengths, for typical string searches, then the winner against the
+ * SIMD kernels.
  *
  * Indeed, depending on the compiler, Quick Search is sometimes faster,
  * sometimes slower than 2-Way.
@@ -3146,45 +3739,36 @@ pattern_benchmark_dflt_known(
 static void
 pattern_benchmark_dflt(int verbose, struct pattern_benchmark_context *ctx)
 {
-	size_t n;
-	char needle[PATTERN_NEEDLE_LEN + 1];
-	size_t sum = 0;
-	size_t winner = 0;
-
-#define PATTERN_BENCH_DFLT_NEEDLES	5	/* odd number */
-
-	ctx->needle = needle;
-	ctx->use_text = TRUE;	/* More representative of real text */
+	size_t i;
 
 	PATTERN_BENCHMARK(0, pu, pattern_qsearch_unknown);
 	PATTERN_BENCHMARK(1, pu, pattern_match_unknown);
 
-	ctx->direction = PATTERN_FORWARD;
+	i = pattern_benchmark_needles(PATTERN_BENCH_DFLT_UNKNOWN, verbose, ctx);
+	i = pattern_benchmark_simd(PATTERN_BENCH_DFLT_UNKNOWN, i, verbose, ctx);
 
-	for (n = 3; n < 3 + PATTERN_BENCH_DFLT_NEEDLES; n++) {
-		ctx->nlen = n;		/* Typical needle length */
-		sum += pattern_benchmark_n_times(3,
-			PATTERN_BENCH_DFLT_UNKNOWN, verbose, ctx);
-	}
-
-	if (sum > PATTERN_BENCH_DFLT_NEEDLES / 2)
-		winner = 1;
+	pattern_dflt_unknown = ctx->u.pu[i];
+	pattern_dflt_name_u = ctx->name[i];
 
-	if (verbose & PATTERN_INIT_SELECTED) {
-		g_assert(winner <= 1);
-		s_info("will use %s() over %s()",
-			ctx->name[winner], ctx->name[1 - winner]);
-	}
+	/*
+	 * The SIMD kernels hand long needles to the 2-Way algorithm, so only
+	 * Quick Search can do without the factorization of the needle.
+	 */
 
-	pattern_dflt_unknown = ctx->u.pu[winner];
-	pattern_dflt_name_u = ctx->name[winner];
-	pattern_dflt_u_2way = (pattern_dflt_unknown == pattern_match_unknown);
+	pattern_dflt_u_2way = (pattern_dflt_unknown != pattern_qsearch_unknown);
 
 	/*
-	 * With known text lengths, always use the 2-Way String Matching
-	 * algorithm since it is guaranteed to be O(n) and is consistently
-	 * faster anyway.
+	 * With known text lengths, always prefer the 2-Way String Matching
+	 * algorithm over Quick Search since it is guaranteed to be O(n) and
+	 * is consistently faster anyway.  Only the SIMD kernels can beat it.
 	 */
+
+	PATTERN_BENCHMARK(0, pk, pattern_match_known);
+
+	i = pattern_benchmark_simd(PATTERN_BENCH_DFLT_KNOWN, 0, verbose, ctx);
+
+	pattern_dflt_known = ctx->u.pk[i];
+	pattern_dflt_name_k = ctx->name[i];
 }
 
 #define PATTERN_BENCH_CUTOFF_CLOSE		8	/* When are we closing-in? */
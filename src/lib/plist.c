@@ -1045,7 +1045,7 @@ plist_insert_sorted_internal(plist_t *pl, void *data,
 	WALLOC0(nl);
 	nl->data = data;
 
-	if (tl->next != NULL && c > 0) {
+	if (NULL == tl->next && c > 0) {
 		tl->next = nl;
 		nl->prev = tl;
 		return pl;
@@ -48,6 +48,7 @@
 #include "once.h"
 #include "path.h"
 #include "product.h"
+#include "sha1.h"
 #include "strvec.h"
 #include "tm.h"
 #include "vmm.h"
@@ -93,6 +94,7 @@ progstart(int argc, char * const *argv)
 #endif	/* MINGW32 */
 
 	thread_main_starting();		/* We are now certain we're the main thread */
+	sha1_init();				/* Before any other thread can start hashing */
 
 	progname_argc = argc;
 	progname_argv = deconstify_pointer(argv);
@@ -999,7 +999,7 @@ pslist_insert_sorted_internal(pslist_t *pl, void *data,
 	WALLOC(nl);
 	nl->data = data;
 
-	if (tl->next != NULL && c > 0) {
+	if (NULL == tl->next && c > 0) {
 		tl->next = nl;
 		nl->next = NULL;
 		return pl;
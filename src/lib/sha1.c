@@ -68,13 +68,36 @@
 #include "endian.h"
 #include "sha1.h"
 #include "misc.h"			/* For RCSID */
+#include "random.h"
 #include "override.h"		/* Must be the last header included */
 
+#if defined(HAS_G_TARGET) && (defined(__x86_64__) || defined(__i386__))
+#define SHA1_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
 #define SHA1_BLEN	64		/**< Message block length */
 
+/**
+ * A single-stream kernel processes ``n'' consecutive 64-byte blocks,
+ * updating the intermediate hash ``ihash''.
+ */
+typedef void (*sha1_blocks_fn_t)(uint32 *ihash, const void *data, size_t n);
+
 /* Local Function Prototyptes */
 static void SHA1_pad_message(SHA1_context *);
-static void SHA1_process_message_block(SHA1_context *, const void *mblock);
+static void sha1_blocks_select(uint32 *ihash, const void *data, size_t n);
+
+/*
+ * Runtime-selected kernel.
+ *
+ * Initially, sha1_blocks points to a trampoline which installs the best
+ * kernel for the running CPU on first use.  This does not use the "once"
+ * layer because SHA-1 is needed very early by the memory allocators.
+ * Concurrent first calls simply install the same value.
+ */
+static sha1_blocks_fn_t sha1_blocks = sha1_blocks_select;
 
 /**
  *  SHA1_reset
@@ -252,16 +275,20 @@ SHA1_input(SHA1_context *context, const void *data, size_t length)
 		goto slowpath;
 
 fastpath:
-	for (/**/; length >= SHA1_BLEN; mp += SHA1_BLEN, length -= SHA1_BLEN) {
-		context->length += 8 * SHA1_BLEN;		/* Counts bits, not bytes */
+	if (length >= SHA1_BLEN) {
+		size_t n = length / SHA1_BLEN;
+		uint64 bits = (uint64) n * 8 * SHA1_BLEN;	/* Counts bits */
 
-		if G_UNLIKELY(context->length < 8 * SHA1_BLEN) {
+		if G_UNLIKELY(context->length + bits < context->length) {
 			/* Message is too long */
 			context->corrupted = SHA_INPUT_TOO_LONG;
 			return SHA_INPUT_TOO_LONG;
 		}
 
-		SHA1_process_message_block(context, mp);
+		context->length += bits;
+		(*sha1_blocks)(context->ihash, mp, n);
+		mp += n * SHA1_BLEN;
+		length -= n * SHA1_BLEN;
 	}
 
 	/* FALL THROUGH */
@@ -282,7 +309,8 @@ slowpath:
 		}
 
 		if G_UNLIKELY(SHA1_BLEN == context->midx) {
-			SHA1_process_message_block(context, context->mblock);
+			(*sha1_blocks)(context->ihash, context->mblock, 1);
+			context->midx = 0;
 			if (length >= SHA1_BLEN && 0 == pointer_to_long(mp) % 4)
 				goto fastpath;		/* Can use faster processing now */
 		}
@@ -299,8 +327,11 @@ slowpath:
  *      stored in the mblock parameter.
  *
  *  Parameters:
+ *      ihash: [in/out]
+ *          The intermediate message digest to update
  *      mblock: [in]
- *          Start of the next 64 message bytes to process
+ *          Start of the next 64 message bytes to process, which must be
+ *          aligned on a 32-bit boundary
  *
  *  Returns:
  *      Nothing.
@@ -311,7 +342,7 @@ slowpath:
  *      names used in the publication.
  */
 static void G_HOT
-SHA1_process_message_block(SHA1_context *context, const void *mblock)
+SHA1_process_message_block(uint32 *ihash, const void *mblock)
 {
 	const uint32 K[] = {       /* Constants defined in SHA-1 */
 		0x5A827999,
@@ -365,11 +396,11 @@ SHA1_process_message_block(SHA1_context *context, const void *mblock)
 		CRUNCH; wp++;		/* t+9 */
 	}
 
-	a = context->ihash[0];
-	b = context->ihash[1];
-	c = context->ihash[2];
-	d = context->ihash[3];
-	e = context->ihash[4];
+	a = ihash[0];
+	b = ihash[1];
+	c = ihash[2];
+	d = ihash[3];
+	e = ihash[4];
 
 	wp = &W[0];
 
@@ -489,13 +520,25 @@ SHA1_process_message_block(SHA1_context *context, const void *mblock)
 	ROTATE(3, c, d, e, a, b, M3);
 	ROTATE(3, b, c, d, e, a, M3);
 
-	context->ihash[0] += a;
-	context->ihash[1] += b;
-	context->ihash[2] += c;
-	context->ihash[3] += d;
-	context->ihash[4] += e;
+	ihash[0] += a;
+	ihash[1] += b;
+	ihash[2] += c;
+	ihash[3] += d;
+	ihash[4] += e;
+}
 
-	context->midx = 0;
+/**
+ * Portable single-stream kernel.
+ */
+static void
+sha1_blocks_generic(uint32 *ihash, const void *data, size_t n)
+{
+	const uint8 *p = data;
+
+	while (n-- != 0) {
+		SHA1_process_message_block(ihash, p);
+		p += SHA1_BLEN;
+	}
 }
 
 /**
@@ -534,7 +577,8 @@ SHA1_pad_message(SHA1_context *context)
 			context->mblock[context->midx++] = 0;
 		}
 
-		SHA1_process_message_block(context, context->mblock);
+		(*sha1_blocks)(context->ihash, context->mblock, 1);
+		context->midx = 0;
 
 		while (context->midx < SHA1_BUP) {
 			context->mblock[context->midx++] = 0;
@@ -551,7 +595,446 @@ SHA1_pad_message(SHA1_context *context)
 	 */
 
 	poke_be64(&context->mblock[SHA1_BUP], context->length);
-	SHA1_process_message_block(context, context->mblock);
+	(*sha1_blocks)(context->ihash, context->mblock, 1);
+	context->midx = 0;
+}
+
+/***
+ *** Accelerated kernels.
+ ***/
+
+#ifdef SHA1_X86
+
+/**
+ * Single-stream kernel using the x86 SHA extensions.
+ *
+ * Each group of 4 rounds is computed by one SHA1RNDS4 instruction, whilst
+ * SHA1MSG1, SHA1MSG2 and a XOR expand the message schedule 4 words at a
+ * time, interleaved with the rounds.
+ */
+static void G_TARGET("sha,ssse3,sse4.1")
+sha1_blocks_shani(uint32 *ihash, const void *data, size_t n)
+{
+	const uint8 *p = data;
+	__m128i abcd, abcd_save, e0, e0_save, e1;
+	__m128i m0, m1, m2, m3;
+	const __m128i mask =
+		_mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+
+	abcd = _mm_loadu_si128((const __m128i *) ihash);
+	e0 = _mm_set_epi32(ihash[4], 0, 0, 0);
+	abcd = _mm_shuffle_epi32(abcd, 0x1b);
+
+/*
+ * Rounds 4i .. 4i+3, for 4 <= i <= 16, where ``mc'' holds message words
+ * for the current group, ``en'' the E value for it and ``eo'' will hold
+ * the E value for the next group.  The other message registers get the
+ * next steps of the schedule expansion.
+ */
+#define SHANI_ROUNDS(f, en, eo, mc, m2_, mx, m1_)		\
+	en = _mm_sha1nexte_epu32(en, mc);					\
+	eo = abcd;											\
+	m2_ = _mm_sha1msg2_epu32(m2_, mc);					\
+	abcd = _mm_sha1rnds4_epu32(abcd, en, f);			\
+	m1_ = _mm_sha1msg1_epu32(m1_, mc);					\
+	mx = _mm_xor_si128(mx, mc);
+
+#define SHANI_LOAD(m, off) \
+	m = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (p + (off))), mask)
+
+	while (n-- != 0) {
+		abcd_save = abcd;
+		e0_save = e0;
+
+		/* Rounds 0-3 */
+		SHANI_LOAD(m0, 0);
+		e0 = _mm_add_epi32(e0, m0);
+		e1 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+		/* Rounds 4-7 */
+		SHANI_LOAD(m1, 16);
+		e1 = _mm_sha1nexte_epu32(e1, m1);
+		e0 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+		m0 = _mm_sha1msg1_epu32(m0, m1);
+
+		/* Rounds 8-11 */
+		SHANI_LOAD(m2, 32);
+		e0 = _mm_sha1nexte_epu32(e0, m2);
+		e1 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+		m1 = _mm_sha1msg1_epu32(m1, m2);
+		m0 = _mm_xor_si128(m0, m2);
+
+		/* Rounds 12-15 */
+		SHANI_LOAD(m3, 48);
+		SHANI_ROUNDS(0, e1, e0, m3, m0, m1, m2);
+
+		/* Rounds 16-67 */
+		SHANI_ROUNDS(0, e0, e1, m0, m1, m2, m3);
+		SHANI_ROUNDS(1, e1, e0, m1, m2, m3, m0);
+		SHANI_ROUNDS(1, e0, e1, m2, m3, m0, m1);
+		SHANI_ROUNDS(1, e1, e0, m3, m0, m1, m2);
+		SHANI_ROUNDS(1, e0, e1, m0, m1, m2, m3);
+		SHANI_ROUNDS(1, e1, e0, m1, m2, m3, m0);
+		SHANI_ROUNDS(2, e0, e1, m2, m3, m0, m1);
+		SHANI_ROUNDS(2, e1, e0, m3, m0, m1, m2);
+		SHANI_ROUNDS(2, e0, e1, m0, m1, m2, m3);
+		SHANI_ROUNDS(2, e1, e0, m1, m2, m3, m0);
+		SHANI_ROUNDS(2, e0, e1, m2, m3, m0, m1);
+		SHANI_ROUNDS(3, e1, e0, m3, m0, m1, m2);
+		SHANI_ROUNDS(3, e0, e1, m0, m1, m2, m3);
+
+		/* Rounds 68-71 */
+		e1 = _mm_sha1nexte_epu32(e1, m1);
+		e0 = abcd;
+		m2 = _mm_sha1msg2_epu32(m2, m1);
+		abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+		m3 = _mm_xor_si128(m3, m1);
+
+		/* Rounds 72-75 */
+		e0 = _mm_sha1nexte_epu32(e0, m2);
+		e1 = abcd;
+		m3 = _mm_sha1msg2_epu32(m3, m2);
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+
+		/* Rounds 76-79 */
+		e1 = _mm_sha1nexte_epu32(e1, m3);
+		e0 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+
+		e0 = _mm_sha1nexte_epu32(e0, e0_save);
+		abcd = _mm_add_epi32(abcd, abcd_save);
+
+		p += SHA1_BLEN;
+	}
+
+#undef SHANI_ROUNDS
+#undef SHANI_LOAD
+
+	abcd = _mm_shuffle_epi32(abcd, 0x1b);
+	_mm_storeu_si128((__m128i *) ihash, abcd);
+	ihash[4] = _mm_extract_epi32(e0, 3);
+}
+
+#define SHA1_CPU_SHANI	(1U << 0)
+
+/**
+ * Probe the CPU for the instruction set extensions we can use.
+ */
+static uint
+sha1_cpu_features(void)
+{
+	uint eax, ebx, ecx, edx, max;
+	uint features = 0;
+	bool ssse3, sse41;
+
+	max = __get_cpuid_max(0, NULL);
+	if (max < 7)
+		return 0;
+
+	__cpuid(1, eax, ebx, ecx, edx);
+
+	ssse3 = 0 != (ecx & bit_SSSE3);
+	sse41 = 0 != (ecx & bit_SSE4_1);
+
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+
+	if (ssse3 && sse41 && (ebx & (1U << 29)))	/* SHA extensions */
+		features |= SHA1_CPU_SHANI;
+
+	return features;
+}
+
+#else	/* !SHA1_X86 */
+
+static uint
+sha1_cpu_features(void)
+{
+	return 0;
+}
+
+#endif	/* SHA1_X86 */
+
+static uint sha1_features;
+static bool sha1_features_probed;
+
+/**
+ * @return TRUE if the specified kernel can be used on the running CPU.
+ */
+bool
+sha1_kernel_available(enum sha1_kernel k)
+{
+	if G_UNLIKELY(!sha1_features_probed) {
+		sha1_features = sha1_cpu_features();
+		sha1_features_probed = TRUE;
+	}
+
+	switch (k) {
+	case SHA1_KERNEL_AUTO:
+	case SHA1_KERNEL_GENERIC:
+		return TRUE;
+	case SHA1_KERNEL_SHANI:
+		return 0 != (sha1_features & SHA1_CPU_SHANI);
+	case SHA1_KERNEL_COUNT:
+		break;
+	}
+
+	return FALSE;
+}
+
+/**
+ * @return the name of the kernel.
+ */
+const char *
+sha1_kernel_name(enum sha1_kernel k)
+{
+	switch (k) {
+	case SHA1_KERNEL_AUTO:		return "auto";
+	case SHA1_KERNEL_GENERIC:	return "generic";
+	case SHA1_KERNEL_SHANI:		return "sha-ni";
+	case SHA1_KERNEL_COUNT:		break;
+	}
+
+	return "unknown";
+}
+
+/**
+ * @return the block processing routine of the kernel, the best one for
+ * SHA1_KERNEL_AUTO.
+ */
+static sha1_blocks_fn_t
+sha1_kernel_blocks(enum sha1_kernel k)
+{
+	if (SHA1_KERNEL_AUTO == k) {
+		k = sha1_kernel_available(SHA1_KERNEL_SHANI) ?
+			SHA1_KERNEL_SHANI : SHA1_KERNEL_GENERIC;
+	}
+
+#ifdef SHA1_X86
+	if (SHA1_KERNEL_SHANI == k)
+		return sha1_blocks_shani;
+#endif
+
+	return sha1_blocks_generic;
+}
+
+/**
+ * Install the kernel to use, the best one for SHA1_KERNEL_AUTO.
+ */
+static void
+sha1_kernel_install(enum sha1_kernel k)
+{
+	sha1_blocks = sha1_kernel_blocks(k);
+}
+
+/**
+ * Trampoline installing the best kernel on first use.
+ */
+static void
+sha1_blocks_select(uint32 *ihash, const void *data, size_t n)
+{
+	sha1_kernel_install(SHA1_KERNEL_AUTO);
+	(*sha1_blocks)(ihash, data, n);
+}
+
+/**
+ * Install the best SHA-1 kernel for the running CPU.
+ *
+ * This is called by progstart() whilst the process is still mono-threaded,
+ * so that the kernel is chosen once and never switched under the feet of
+ * a thread that is hashing.  Any hashing done before, during the early
+ * memory allocator setup, goes through the same selection.
+ */
+void
+sha1_init(void)
+{
+	if (sha1_blocks_select == sha1_blocks)
+		sha1_kernel_install(SHA1_KERNEL_AUTO);
+}
+
+/**
+ * Force usage of a specific kernel, for testing and benchmarking.
+ *
+ * This is not thread-safe and must only be done when nobody else is hashing.
+ *
+ * @return TRUE if the kernel was installed, FALSE if it is not available.
+ */
+bool
+sha1_kernel_force(enum sha1_kernel k)
+{
+	if (!sha1_kernel_available(k))
+		return FALSE;
+
+	sha1_kernel_install(k);
+	return TRUE;
+}
+
+/**
+ * Compute the SHA-1 of ``len'' bytes at ``data'' with the supplied block
+ * processing routine, leaving the installed kernel alone.
+ *
+ * Like SHA1_input(), the routine is only handed 32-bit aligned blocks.
+ */
+static void G_COLD
+sha1_kernel_digest(sha1_blocks_fn_t blocks,
+	const void *data, size_t len, struct sha1 *digest)
+{
+	uint32 ihash[SHA1_RAW_SIZE / 4] = {
+		0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0
+	};
+	uint32 mblock[2 * SHA1_BLEN / 4];
+	uint8 *q = (uint8 *) mblock;
+	const uint8 *p = data;
+	size_t n = len / SHA1_BLEN, tail = len % SHA1_BLEN, pad;
+	uint i;
+
+	if (0 == pointer_to_ulong(p) % 4) {
+		(*blocks)(ihash, p, n);
+	} else {
+		for (i = 0; i < n; i++) {
+			memcpy(mblock, p + i * SHA1_BLEN, SHA1_BLEN);
+			(*blocks)(ihash, mblock, 1);
+		}
+	}
+
+	ZERO(&mblock);
+	memcpy(q, p + n * SHA1_BLEN, tail);
+	q[tail] = 0x80;
+	pad = tail < SHA1_BLEN - 8 ? SHA1_BLEN : 2 * SHA1_BLEN;
+	poke_be64(&q[pad - 8], (uint64) len * 8);
+	(*blocks)(ihash, mblock, pad / SHA1_BLEN);
+
+	for (i = 0; i < sizeof digest->data; i++) {
+		digest->data[i] = ihash[i >> 2] >> 8 * (3 - (i & 0x03));
+	}
+}
+
+/**
+ * Check SHA-1 digest of data against expected hexadecimal value.
+ */
+static void G_COLD
+sha1_check_digest(const char *what, const struct sha1 *digest,
+	const char *expected, size_t len)
+{
+	char hex[2 * SHA1_RAW_SIZE + 1];
+
+	bin_to_hex_buf(digest, sizeof *digest, ARYLEN(hex));
+
+	if (0 != strcasecmp(expected, hex)) {
+		s_error("%s(): %s: expected %s, got %s on %zu-byte input",
+			G_STRFUNC, what, expected, hex, len);
+	}
+}
+
+/**
+ * Check the kernel against the generic implementation on ``len'' bytes of
+ * random data, starting at ``buf''.
+ */
+static void G_COLD
+sha1_check_kernel(enum sha1_kernel k, const uint8 *buf, size_t len)
+{
+	struct sha1 d1, d2;
+
+	sha1_kernel_digest(sha1_blocks_generic, buf, len, &d1);
+	sha1_kernel_digest(sha1_kernel_blocks(k), buf, len, &d2);
+
+	if (0 != memcmp(&d1, &d2, sizeof d1)) {
+		s_error("%s(): %s kernel differs from generic code on %zu bytes",
+			G_STRFUNC, sha1_kernel_name(k), len);
+	}
+}
+
+/**
+ * Check the SHA1_input() path, with the installed kernel, against the
+ * generic implementation on ``len'' bytes of random data at ``buf''.
+ */
+static void G_COLD
+sha1_check_input(const uint8 *buf, size_t len)
+{
+	SHA1_context ctx;
+	struct sha1 d1, d2;
+
+	sha1_kernel_digest(sha1_blocks_generic, buf, len, &d1);
+
+	/*
+	 * Feed one byte first to also check input starting on a partial block.
+	 */
+
+	SHA1_reset(&ctx);
+	SHA1_input(&ctx, buf, 1);
+	SHA1_input(&ctx, buf + 1, len - 1);
+	SHA1_result(&ctx, &d2);
+
+	if (0 != memcmp(&d1, &d2, sizeof d1))
+		s_error("%s(): SHA1_input() is wrong on %zu bytes", G_STRFUNC, len);
+}
+
+/**
+ * Self-test of the SHA-1 implementation, checking all the kernels that
+ * the running CPU supports.
+ *
+ * Kernels are called through their own routine, so this can run whilst
+ * other threads are hashing with the installed kernel.
+ */
+void G_COLD
+sha1_check(void)
+{
+	static const struct {
+		const char *digest;
+		const char *s;
+	} tests[] = {
+		{ "DA39A3EE5E6B4B0D3255BFEF95601890AFD80709", "" },
+		{ "A9993E364706816ABA3E25717850C26C9CD0D89D", "abc" },
+		{ "84983E441C3BD26EBAAE4AA1F95129E5E54670F1",
+			"abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq" },
+	};
+	static uint8 buf[4096 + 1];
+	SHA1_context ctx;
+	struct sha1 digest;
+	uint i;
+	enum sha1_kernel k;
+
+	random_bytes(buf, sizeof buf);
+
+	for (k = SHA1_KERNEL_GENERIC; k < SHA1_KERNEL_COUNT; k++) {
+		sha1_blocks_fn_t blocks;
+
+		if (!sha1_kernel_available(k))
+			continue;
+
+		blocks = sha1_kernel_blocks(k);
+
+		for (i = 0; i < N_ITEMS(tests); i++) {
+			size_t len = strlen(tests[i].s);
+
+			sha1_kernel_digest(blocks, tests[i].s, len, &digest);
+			sha1_check_digest(sha1_kernel_name(k),
+				&digest, tests[i].digest, len);
+		}
+
+		sha1_check_kernel(k, buf, sizeof buf - 1);
+		sha1_check_kernel(k, buf + 1, sizeof buf - 1);	/* Unaligned */
+		sha1_check_kernel(k, buf, 3 * SHA1_BLEN + 5);
+		sha1_check_kernel(k, buf, SHA1_BLEN - 8);		/* Two padding blocks */
+	}
+
+	/*
+	 * Now the public interface, with whatever kernel is installed.
+	 */
+
+	for (i = 0; i < N_ITEMS(tests); i++) {
+		size_t len = strlen(tests[i].s);
+
+		SHA1_reset(&ctx);
+		SHA1_input(&ctx, tests[i].s, len);
+		SHA1_result(&ctx, &digest);
+		sha1_check_digest("SHA1_input()", &digest, tests[i].digest, len);
+	}
+
+	sha1_check_input(buf, sizeof buf - 1);
+	sha1_check_input(buf + 1, sizeof buf - 1);
 }
 
 /* vi: set ts=4 sw=4 cindent: */
@@ -85,6 +85,24 @@ int SHA1_input(SHA1_context *, const void *, size_t);
 int SHA1_result(SHA1_context *, struct sha1 *digest);
 int SHA1_intermediate(const SHA1_context *, struct sha1 *digest);
 
+/**
+ * Block processing kernels, selected at runtime depending on the CPU.
+ */
+enum sha1_kernel {
+	SHA1_KERNEL_AUTO = 0,		/**< Best kernel for the running CPU */
+	SHA1_KERNEL_GENERIC,		/**< Portable C code */
+	SHA1_KERNEL_SHANI,			/**< x86 SHA extensions */
+
+	SHA1_KERNEL_COUNT
+};
+
+bool sha1_kernel_available(enum sha1_kernel k);
+bool sha1_kernel_force(enum sha1_kernel k);
+const char *sha1_kernel_name(enum sha1_kernel k);
+
+void sha1_init(void);
+void sha1_check(void);
+
 /**
  * Feed the SHA1 context with the content of a variable.
  */
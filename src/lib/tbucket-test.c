@@ -0,0 +1,638 @@
+/*
+ * tbucket-test -- token bucket tests and bandwidth scheduling simulation.
+ *
+ * Copyright (c) 2026, gtk-gnutella developers
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the authors nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "common.h"
+
+#include "progname.h"
+#include "stringify.h"
+#include "tbucket.h"
+
+#define SIM_SOURCES		256			/* Maximum amount of simulated sources */
+#define SIM_WRITE		16384		/* Max amount written per I/O event */
+#define SIM_TICK_NS		1000000		/* Simulation tick: 1 ms */
+#define SIM_WINDOW		10			/* Burstiness window, in ticks */
+#define SIM_SLOW_BPS	1024		/* Production rate of slow sources */
+#define SIM_BURST		(48 * 1024)	/* Amount emitted by bursty sources */
+#define SIM_BURST_MS	2000		/* Period of bursty sources */
+
+#define OLD_PERIOD		1000		/* Period of fixed-slot scheduler, in ms */
+#define OLD_SLOT_MIN	256			/* Same as BW_SLOT_MIN in core/bsched.c */
+
+static bool verbose;
+
+static void G_NORETURN
+usage(void)
+{
+	fprintf(stderr,
+			"Usage: %s [-hv] [-b bursty] [-g greedy] [-r KiB/s] [-s slow]"
+			" [-t secs]\n"
+			"  -b : amount of bursty sources (default: 2)\n"
+			"  -g : amount of greedy sources (default: 4)\n"
+			"  -h : prints this help message\n"
+			"  -r : scheduled bandwidth, in KiB/s (default: 64)\n"
+			"  -s : amount of slow sources (default: 4)\n"
+			"  -t : simulated time, in seconds (default: 60)\n"
+			"  -v : verbose, show per-source statistics\n"
+			, getprogname());
+	exit(EXIT_FAILURE);
+}
+
+enum sim_kind {
+	SIM_GREEDY,		/* Always has data to send */
+	SIM_SLOW,		/* Produces data slowly, continuously */
+	SIM_BURSTY		/* Produces large bursts periodically */
+};
+
+struct sim_source {
+	enum sim_kind kind;
+	uint64 backlog;			/* Data waiting to be sent */
+	uint64 sent;			/* Total sent */
+	uint64 fair;			/* Fair share (max-min) over the simulation */
+	double produced;		/* Fraction of produced data, for slow sources */
+	uint stalled;			/* Current stalling time, in ticks */
+	uint max_stalled;		/* Longest stalling time, in ticks */
+	tbucket_flow_t flow;	/* DRR state */
+	bool used;				/* Model of BIO_F_USED */
+	bool active;			/* Model of BIO_F_ACTIVE */
+};
+
+struct sim_result {
+	double utilization;
+	double jain;
+	uint slow_stall;
+	uint max_stall;
+	double burstiness;
+};
+
+/*
+ * Model of the fixed-period slot allocator from core/bsched.c, without the
+ * favours, pre-allocation, penalties and stealing, which play no role when
+ * there is a single scheduler.
+ */
+struct old_sched {
+	struct sim_source *src;
+	int count;
+	int64 bw_max;
+	int64 bw_actual;
+	int64 bw_slot;
+	int last_used;
+	int current_used;
+	bool looped;
+	bool frozen;
+	bool cleared;
+	bool nobw;
+};
+
+static void
+old_begin_period(struct old_sched *os)
+{
+	int i, dividor = os->count;
+
+	os->last_used = os->current_used;
+	if (os->last_used > 0 && os->last_used < os->count)
+		dividor = os->last_used + 1;
+
+	os->bw_slot = os->bw_max / dividor;
+	os->frozen = os->bw_slot < OLD_SLOT_MIN;
+	os->nobw = os->cleared = os->looped = FALSE;
+	os->current_used = 0;
+	os->bw_actual = 0;
+
+	for (i = 0; i < os->count; i++)
+		os->src[i].used = os->src[i].active = FALSE;
+}
+
+static uint64
+old_available(struct old_sched *os, struct sim_source *s, uint64 len)
+{
+	bool used = s->used, active = s->active;
+	int64 available, result;
+
+	if (os->nobw)
+		return 0;
+
+	if (!used) {
+		os->current_used++;
+		s->used = TRUE;
+	}
+	s->active = TRUE;
+
+	if (!os->looped && used)
+		os->looped = TRUE;
+
+	available = os->bw_max - os->bw_actual;
+
+	if (!os->frozen && available > OLD_SLOT_MIN && active) {
+		int64 slot = available / os->count;
+
+		if (slot > OLD_SLOT_MIN) {
+			if (!os->cleared) {
+				int i;
+				for (i = 0; i < os->count; i++)
+					os->src[i].active = FALSE;
+				os->cleared = TRUE;
+			}
+			os->bw_slot = slot;
+		} else {
+			os->frozen = TRUE;
+			os->bw_slot = OLD_SLOT_MIN;
+		}
+	}
+
+	if (available <= 0) {
+		os->nobw = TRUE;
+		return 0;
+	}
+
+	result = MIN(os->bw_slot, available);
+	available -= result;
+
+	if ((int64) len > result && available > 0 && os->looped && !used) {
+		int64 adj = len - result;
+		int64 nominal = 2 * os->bw_max / os->count;
+
+		adj = MIN(adj, nominal);
+		adj = MIN(adj, available);
+		result += adj;
+	}
+
+	return MIN((uint64) result, len);
+}
+
+static void
+old_update(struct old_sched *os, uint64 used)
+{
+	os->bw_actual += used;
+	if (os->bw_actual >= os->bw_max)
+		os->nobw = TRUE;
+}
+
+/*
+ * Compute max-min fair shares given the average demand of each source.
+ */
+static void
+sim_fair_shares(struct sim_source *src, int n, uint64 rate, uint secs)
+{
+	double left = (double) rate * secs;
+	int remaining = n, i;
+	bool changed = TRUE;
+	bool done[SIM_SOURCES];
+
+	ZERO(&done);
+
+	while (changed && remaining > 0) {
+		double share = left / remaining;
+
+		changed = FALSE;
+		for (i = 0; i < n; i++) {
+			double demand;
+
+			if (done[i] || SIM_GREEDY == src[i].kind)
+				continue;
+
+			demand = SIM_SLOW == src[i].kind ?
+				(double) SIM_SLOW_BPS * secs :
+				(double) SIM_BURST * (secs * 1000 / SIM_BURST_MS);
+
+			if (demand <= share) {
+				src[i].fair = demand;
+				left -= demand;
+				remaining--;
+				done[i] = TRUE;
+				changed = TRUE;
+			}
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		if (!done[i])
+			src[i].fair = left / remaining;
+	}
+}
+
+static void
+sim_produce(struct sim_source *s, uint tick)
+{
+	switch (s->kind) {
+	case SIM_GREEDY:
+		s->backlog = SIM_WRITE;
+		break;
+	case SIM_SLOW:
+		s->produced += SIM_SLOW_BPS / 1000.0;
+		if (s->produced >= 1.0) {
+			uint64 whole = (uint64) s->produced;
+			s->backlog += whole;
+			s->produced -= whole;
+		}
+		break;
+	case SIM_BURSTY:
+		if (0 == tick % SIM_BURST_MS)
+			s->backlog += SIM_BURST;
+		break;
+	}
+}
+
+static void
+sim_stall(struct sim_source *s, uint64 sent, bool wanted)
+{
+	if (0 == sent && wanted) {
+		s->stalled++;
+		s->max_stalled = MAX(s->max_stalled, s->stalled);
+	} else {
+		s->stalled = 0;
+	}
+}
+
+static const char *
+sim_kind_name(enum sim_kind k)
+{
+	switch (k) {
+	case SIM_GREEDY: return "greedy";
+	case SIM_SLOW:   return "slow";
+	case SIM_BURSTY: return "bursty";
+	}
+	return "?";
+}
+
+/**
+ * Run simulation.
+ *
+ * @param src		the sources, reset by the simulation
+ * @param n			amount of sources
+ * @param rate		the configured bandwidth, in bytes/s
+ * @param secs		simulated time
+ * @param htb		whether to use token buckets instead of the period model
+ * @param r			where results are written
+ */
+static void
+sim_run(struct sim_source *src, int n, uint64 rate, uint secs, bool htb,
+	struct sim_result *r)
+{
+	struct old_sched os;
+	tbucket_t *root, *class;
+	uint tick, ticks = secs * 1000;
+	uint64 window = 0, peak = 0, total = 0;
+	double num = 0.0, den = 0.0;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		struct sim_source *s = &src[i];
+		s->backlog = s->sent = 0;
+		s->produced = 0.0;
+		s->stalled = s->max_stalled = 0;
+		ZERO(&s->flow);
+	}
+
+	ZERO(&os);
+	os.src = src;
+	os.count = n;
+	os.bw_max = rate * OLD_PERIOD / 1000;
+
+	root = tbucket_make(NULL, 0, 1);
+	class = tbucket_make(root, rate, 1);
+
+	for (tick = 0; tick < ticks; tick++) {
+		uint64 now = (uint64) tick * SIM_TICK_NS + 1;
+		int start = tick % n;		/* Event loop dispatching order */
+
+		if (!htb && 0 == tick % OLD_PERIOD)
+			old_begin_period(&os);
+
+		for (i = 0; i < n; i++)
+			sim_produce(&src[i], tick);
+
+		for (i = 0; i < n; i++) {
+			struct sim_source *s = &src[(start + i) % n];
+			uint64 len = MIN(s->backlog, SIM_WRITE), granted;
+
+			if (0 == len) {
+				sim_stall(s, 0, FALSE);
+				continue;
+			}
+
+			if (htb) {
+				granted = tbucket_flow_grant(class, &s->flow, len, now);
+				if (granted != 0) {
+					tbucket_flow_charge(class, &s->flow, granted);
+					tbucket_consume(class, granted, now);
+				}
+			} else {
+				granted = old_available(&os, s, len);
+				if (granted != 0)
+					old_update(&os, granted);
+			}
+
+			s->backlog -= granted;
+			s->sent += granted;
+			window += granted;
+			total += granted;
+			sim_stall(s, granted, TRUE);
+		}
+
+		if (0 == (tick + 1) % SIM_WINDOW) {
+			peak = MAX(peak, window);
+			window = 0;
+		}
+	}
+
+	tbucket_free_null(&class);
+	tbucket_free_null(&root);
+
+	/*
+	 * Jain's fairness index, computed on throughput normalized by the
+	 * max-min fair share of each source: 1.0 means perfect fairness.
+	 */
+
+	sim_fair_shares(src, n, rate, secs);
+
+	r->slow_stall = r->max_stall = 0;
+
+	for (i = 0; i < n; i++) {
+		struct sim_source *s = &src[i];
+		double x = s->fair != 0 ? (double) s->sent / s->fair : 1.0;
+
+		num += x;
+		den += x * x;
+
+		r->max_stall = MAX(r->max_stall, s->max_stalled);
+		if (SIM_SLOW == s->kind)
+			r->slow_stall = MAX(r->slow_stall, s->max_stalled);
+
+		if (verbose) {
+			printf("  %s #%d %-6s sent=%s fair=%s stall=%u ms\n",
+				htb ? "htb" : "old", i, sim_kind_name(s->kind),
+				uint64_to_string(s->sent), uint64_to_string2(s->fair),
+				s->max_stalled);
+		}
+	}
+
+	r->jain = num * num / (n * den);
+	r->utilization = (double) total / ((double) rate * secs);
+	r->burstiness = (double) peak / ((double) rate * SIM_WINDOW / 1000.0);
+}
+
+static void
+sim_print(const char *name, const struct sim_result *r)
+{
+	printf("%-10s %6.1f%% %7.3f %8u ms %8u ms %7.1fx\n",
+		name, r->utilization * 100.0, r->jain,
+		r->slow_stall, r->max_stall, r->burstiness);
+}
+
+static bool
+close_to(double value, double expected, double tolerance)
+{
+	return value >= expected * (1.0 - tolerance) &&
+		value <= expected * (1.0 + tolerance);
+}
+
+/*
+ * Check the hierarchical behaviour: lending of unused tokens to the parent,
+ * and weighted borrowing by classes in need.
+ */
+static bool
+test_hierarchy(void)
+{
+	tbucket_t *root, *a, *b, *c;
+	uint64 got_a = 0, got_b = 0, got_c = 0;
+	uint tick;
+	bool ok = TRUE;
+
+	root = tbucket_make(NULL, 0, 1);
+	a = tbucket_make(root, 10000, 3);
+	b = tbucket_make(root, 10000, 1);
+	c = tbucket_make(root, 20000, 1);
+
+	/*
+	 * Classes a and b are greedy, c is idle during the first 10 seconds
+	 * and greedy afterwards.  During the first phase, a and b must share
+	 * what c does not use in proportion of their weight: a gets 10000 plus
+	 * 3/4 of 20000, b gets 10000 plus 1/4 of 20000.
+	 */
+
+	for (tick = 0; tick < 20000; tick++) {
+		uint64 now = (uint64) tick * SIM_TICK_NS + 1;
+		uint64 n;
+
+		if (10000 == tick) {
+			if (!close_to(got_a, 250000, 0.05)) {
+				printf("%s(): class a got %s bytes, expected 250000\n",
+					G_STRFUNC, uint64_to_string(got_a));
+				ok = FALSE;
+			}
+			if (!close_to(got_b, 150000, 0.05)) {
+				printf("%s(): class b got %s bytes, expected 150000\n",
+					G_STRFUNC, uint64_to_string(got_b));
+				ok = FALSE;
+			}
+			got_a = got_b = 0;
+		}
+
+		n = tbucket_available(a, now);
+		tbucket_consume(a, n, now);
+		got_a += n;
+
+		n = tbucket_available(b, now);
+		tbucket_consume(b, n, now);
+		got_b += n;
+
+		if (tick >= 10000) {
+			n = tbucket_available(c, now);
+			tbucket_consume(c, n, now);
+			got_c += n;
+		}
+	}
+
+	/*
+	 * During the second phase, everyone is greedy: each gets its own rate,
+	 * the burst accumulated by c being the only excess.
+	 */
+
+	if (!close_to(got_a, 100000, 0.05) || !close_to(got_b, 100000, 0.05)) {
+		printf("%s(): classes a and b got %s and %s bytes, expected 100000\n",
+			G_STRFUNC, uint64_to_string(got_a), uint64_to_string2(got_b));
+		ok = FALSE;
+	}
+	if (!close_to(got_c, 200000, 0.05)) {
+		printf("%s(): class c got %s bytes, expected 200000\n",
+			G_STRFUNC, uint64_to_string(got_c));
+		ok = FALSE;
+	}
+
+	/*
+	 * With lending disabled on the idle c, a and b only get their own rate.
+	 * Then when c lends again but a cannot borrow, b gets all the spare
+	 * bandwidth of c.
+	 */
+
+	tbucket_set_flags(c, TBUCKET_F_NO_LEND);
+
+	for (tick = 20000; tick < 40000; tick++) {
+		uint64 now = (uint64) tick * SIM_TICK_NS + 1;
+		uint64 n;
+
+		if (20000 == tick || 30000 == tick) {
+			got_a = got_b = 0;
+		} else if (tick == 29999) {
+			if (
+				!close_to(got_a, 100000, 0.05) ||
+				!close_to(got_b, 100000, 0.05)
+			) {
+				printf("%s(): no lending: classes a and b got %s and %s bytes,"
+					" expected 100000\n", G_STRFUNC,
+					uint64_to_string(got_a), uint64_to_string2(got_b));
+				ok = FALSE;
+			}
+			tbucket_set_flags(c, 0);
+			tbucket_set_flags(a, TBUCKET_F_NO_BORROW);
+		}
+
+		n = tbucket_available(a, now);
+		tbucket_consume(a, n, now);
+		got_a += n;
+
+		n = tbucket_available(b, now);
+		tbucket_consume(b, n, now);
+		got_b += n;
+	}
+
+	if (!close_to(got_a, 100000, 0.05) || !close_to(got_b, 300000, 0.05)) {
+		printf("%s(): no borrowing: classes a and b got %s and %s bytes, "
+			"expected 100000 and 300000\n",
+			G_STRFUNC, uint64_to_string(got_a), uint64_to_string2(got_b));
+		ok = FALSE;
+	}
+
+	tbucket_free_null(&a);
+	tbucket_free_null(&b);
+	tbucket_free_null(&c);
+	tbucket_free_null(&root);
+
+	return ok;
+}
+
+int
+main(int argc, char **argv)
+{
+	extern int optind;
+	extern char *optarg;
+	struct sim_source src[SIM_SOURCES];
+	struct sim_result old, htb;
+	uint greedy = 4, slow = 4, bursty = 2, secs = 60, rate = 64;
+	int c, i, n;
+	int retval = 0;
+	const char options[] = "b:g:hr:s:t:v";
+
+	progstart(argc, argv);
+
+	while ((c = getopt(argc, argv, options)) != EOF) {
+		switch (c) {
+		case 'b':
+			bursty = atoi(optarg);
+			break;
+		case 'g':
+			greedy = atoi(optarg);
+			break;
+		case 'r':
+			rate = atoi(optarg);
+			break;
+		case 's':
+			slow = atoi(optarg);
+			break;
+		case 't':
+			secs = atoi(optarg);
+			break;
+		case 'v':
+			verbose = TRUE;
+			break;
+		case 'h':			/* show help */
+		default:
+			usage();
+			break;
+		}
+	}
+
+	if (argc != optind)
+		usage();
+
+	n = greedy + slow + bursty;
+
+	if (0 == n || n > SIM_SOURCES || 0 == rate || 0 == secs)
+		usage();
+
+	if (!test_hierarchy())
+		retval = 1;
+
+	ZERO(&src);
+
+	for (i = 0; i < n; i++) {
+		src[i].kind = UNSIGNED(i) < greedy ? SIM_GREEDY :
+			UNSIGNED(i) < greedy + slow ? SIM_SLOW : SIM_BURSTY;
+	}
+
+	printf("Simulating %u greedy, %u slow, %u bursty source%s "
+		"at %u KiB/s for %u second%s\n",
+		greedy, slow, bursty, plural(n), rate, PLURAL(secs));
+
+	sim_run(src, n, rate * 1024, secs, FALSE, &old);
+	sim_run(src, n, rate * 1024, secs, TRUE, &htb);
+
+	printf("%-10s %7s %7s %11s %11s %8s\n",
+		"scheduler", "usage", "jain", "slow-stall", "max-stall", "burst");
+	sim_print("period", &old);
+	sim_print("htb+drr", &htb);
+
+	/*
+	 * The token buckets must fully use the bandwidth, without starving the
+	 * slow sources, and cannot be less fair than the period model.
+	 */
+
+	if (htb.utilization < 0.95) {
+		printf("HTB utilization too low: %.1f%%\n", htb.utilization * 100.0);
+		retval = 1;
+	}
+	if (htb.jain < 0.95 || htb.jain + 0.01 < old.jain) {
+		printf("HTB fairness too low: %.3f\n", htb.jain);
+		retval = 1;
+	}
+	if (slow != 0 && htb.slow_stall > 2 * TBUCKET_ROUND_MS * UNSIGNED(n)) {
+		printf("HTB starves slow sources: %u ms\n", htb.slow_stall);
+		retval = 1;
+	}
+
+	if (0 == retval)
+		printf("All OK!\n");
+
+	return retval;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
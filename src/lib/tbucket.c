@@ -0,0 +1,686 @@
+/*
+ * Copyright (c) 2026, gtk-gnutella developers
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Hierarchical token buckets with deficit round-robin among flows.
+ *
+ * A token bucket is credited continuously with tokens (bytes) at its
+ * configured rate, up to a ceiling defined by its burst size.  Buckets can
+ * be arranged in a tree: a child whose bucket overflows gives its spare
+ * tokens to its parent (unless TBUCKET_F_NO_LEND is set), and a child that
+ * runs out of tokens can borrow from its parent (unless TBUCKET_F_NO_BORROW
+ * is set).  The tokens of the parent are distributed as they accrue between
+ * the children having recently expressed demand, in proportion of their
+ * weights, so that the order in which children draw tokens does not matter.
+ *
+ * Refilling is lazy and driven by the caller-supplied time, in nanoseconds,
+ * so there is no refilling granularity other than the clock's: a bucket can
+ * be queried every few microseconds and will grant exactly what has accrued
+ * since the last call.
+ *
+ * On top of a bucket, flows (I/O sources typically) can be scheduled using
+ * deficit round-robin: each flow gets a quantum of bytes per round and cannot
+ * be granted more than that until the next round starts, which happens as
+ * soon as all the flows active in the round exhausted their quantum or had
+ * their request fully satisfied, or when the round lasted twice as long as
+ * it should have.  This prevents greedy flows from starving the slow ones
+ * regardless of the order in which they are serviced.
+ *
+ * None of these routines are thread-safe: callers must serialize accesses
+ * to a given bucket hierarchy.
+ *
+ * @author gtk-gnutella developers
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "tbucket.h"
+
+#include "pslist.h"
+#include "walloc.h"
+
+#include "override.h"			/* Must be the last header included */
+
+#define TBUCKET_NS			1000000000.0	/**< Nanoseconds per second */
+#define TBUCKET_MS			1000000			/**< Nanoseconds per ms */
+#define TBUCKET_CAP_MIN		2048			/**< Minimum bucket capacity */
+#define TBUCKET_QUANTUM_MIN	1460			/**< Minimum DRR quantum (MSS) */
+#define TBUCKET_DEMAND_MS	100				/**< Demand is recent if younger */
+#define TBUCKET_WAIT_MAX_MS	1000			/**< Maximum waiting time */
+
+#define TBUCKET_ROUND_NS	((uint64) TBUCKET_ROUND_MS * TBUCKET_MS)
+#define TBUCKET_DEMAND_NS	((uint64) TBUCKET_DEMAND_MS * TBUCKET_MS)
+#define TBUCKET_WAIT_MAX_NS	((uint64) TBUCKET_WAIT_MAX_MS * TBUCKET_MS)
+
+enum tbucket_magic { TBUCKET_MAGIC = 0x2c91b5e7 };
+
+/**
+ * A token bucket.
+ */
+struct tbucket {
+	enum tbucket_magic magic;
+	struct tbucket *parent;		/**< Parent bucket, NULL for root */
+	pslist_t *children;			/**< Children buckets */
+	uint64 rate;				/**< Refilling rate, in bytes/s */
+	uint64 child_rate;			/**< Sum of the children rates */
+	int64 cap;					/**< Maximum amount of tokens */
+	int64 tokens;				/**< Tokens available, negative if in debt */
+	int64 borrowed;				/**< Tokens given by parent */
+	double frac;				/**< Fraction of token not yet credited */
+	uint64 last;				/**< Last refilling time */
+	uint64 demand;				/**< Last time we needed to borrow */
+	uint32 flags;				/**< Operating flags */
+	uint weight;				/**< Weight when borrowing from parent */
+	uint burst_ms;				/**< Burst size, in ms of traffic */
+	/* Deficit round-robin */
+	uint round;					/**< Current round */
+	uint flows;					/**< Flows active during this round */
+	uint exhausted;				/**< Flows that exhausted their quantum */
+	uint64 quantum;				/**< Per-flow quantum for this round */
+	uint64 round_start;			/**< When current round started */
+	uint64 round_ns;			/**< Maximum duration of current round */
+};
+
+static inline void
+tbucket_check(const struct tbucket * const tb)
+{
+	g_assert(tb != NULL);
+	g_assert(TBUCKET_MAGIC == tb->magic);
+}
+
+/**
+ * Recompute the capacity of the bucket.
+ *
+ * The ceiling is the amount of traffic that the bucket and all its children
+ * can emit during the burst period, so that a parent can hold the tokens
+ * lent by all its children.
+ */
+static void
+tbucket_recap(tbucket_t *tb)
+{
+	double cap;
+
+	cap = (double) (tb->rate + tb->child_rate) * tb->burst_ms / 1000.0;
+	tb->cap = MAX(cap, TBUCKET_CAP_MIN);
+
+	if (tb->tokens > tb->cap)
+		tb->tokens = tb->cap;
+	if (tb->borrowed > tb->cap)
+		tb->borrowed = tb->cap;
+}
+
+/**
+ * Create a new token bucket.
+ *
+ * @param parent	the parent bucket, NULL to create a root bucket
+ * @param rate		the guaranteed rate, in bytes per second
+ * @param weight	the weight of the bucket when borrowing from its parent
+ *
+ * @return a new bucket, initially empty.
+ */
+tbucket_t *
+tbucket_make(tbucket_t *parent, uint64 rate, uint weight)
+{
+	tbucket_t *tb;
+
+	WALLOC0(tb);
+	tb->magic = TBUCKET_MAGIC;
+	tb->rate = rate;
+	tb->weight = MAX(weight, 1);
+	tb->burst_ms = TBUCKET_BURST_MS;
+	tb->round = 1;
+	tb->quantum = TBUCKET_QUANTUM_MIN;
+	tb->round_ns = TBUCKET_ROUND_NS;
+	tbucket_recap(tb);
+
+	if (parent != NULL) {
+		tbucket_check(parent);
+
+		tb->parent = parent;
+		parent->children = pslist_prepend(parent->children, tb);
+		parent->child_rate += rate;
+		tbucket_recap(parent);
+	}
+
+	return tb;
+}
+
+/**
+ * Free token bucket, which must no longer have any children, and nullify
+ * its pointer.
+ */
+void
+tbucket_free_null(tbucket_t **tb_ptr)
+{
+	tbucket_t *tb = *tb_ptr;
+
+	if (tb != NULL) {
+		tbucket_check(tb);
+		g_assert_log(NULL == tb->children,
+			"%s(): bucket still has %zu children",
+			G_STRFUNC, pslist_length(tb->children));
+
+		if (tb->parent != NULL) {
+			tbucket_t *parent = tb->parent;
+
+			parent->children = pslist_remove(parent->children, tb);
+			parent->child_rate -= tb->rate;
+			tbucket_recap(parent);
+		}
+
+		tb->magic = 0;
+		WFREE(tb);
+		*tb_ptr = NULL;
+	}
+}
+
+/**
+ * Change the guaranteed rate of the bucket.
+ */
+void
+tbucket_set_rate(tbucket_t *tb, uint64 rate)
+{
+	tbucket_check(tb);
+
+	if (tb->parent != NULL) {
+		tbucket_t *parent = tb->parent;
+
+		parent->child_rate -= tb->rate;
+		parent->child_rate += rate;
+		tbucket_recap(parent);
+	}
+
+	tb->rate = rate;
+	tbucket_recap(tb);
+}
+
+/**
+ * Change the weight of the bucket when sharing its parent's spare tokens
+ * with its siblings.
+ */
+void
+tbucket_set_weight(tbucket_t *tb, uint weight)
+{
+	tbucket_check(tb);
+
+	tb->weight = MAX(weight, 1);
+}
+
+/**
+ * Change the burst size of the bucket, expressed in milliseconds of traffic
+ * at the configured rate.
+ */
+void
+tbucket_set_burst(tbucket_t *tb, uint ms)
+{
+	tbucket_check(tb);
+
+	tb->burst_ms = MAX(ms, 1);
+	tbucket_recap(tb);
+}
+
+/**
+ * Set the operating flags of the bucket.
+ */
+void
+tbucket_set_flags(tbucket_t *tb, uint32 flags)
+{
+	tbucket_check(tb);
+
+	tb->flags = flags;
+}
+
+/**
+ * @return the guaranteed rate of the bucket, in bytes per second.
+ */
+uint64
+tbucket_rate(const tbucket_t *tb)
+{
+	tbucket_check(tb);
+
+	return tb->rate;
+}
+
+/**
+ * @return the amount of tokens held by the bucket (negative if in debt),
+ * as of the last refilling.
+ */
+int64
+tbucket_tokens(const tbucket_t *tb)
+{
+	tbucket_check(tb);
+
+	return tb->tokens;
+}
+
+/**
+ * Is bucket currently in need of tokens from its parent?
+ */
+static inline bool
+tbucket_in_demand(const tbucket_t *tb, uint64 now)
+{
+	return !(tb->flags & TBUCKET_F_NO_BORROW) &&
+		tb->demand != 0 && now >= tb->demand &&
+		now - tb->demand < TBUCKET_DEMAND_NS;
+}
+
+/**
+ * Record that the bucket needs more tokens than it has.
+ */
+static inline void
+tbucket_demand(tbucket_t *tb, uint64 now)
+{
+	if (tb->parent != NULL)
+		tb->demand = MAX(now, 1);
+}
+
+/**
+ * Distribute the tokens of the bucket among the children that need them,
+ * in proportion of their weights.
+ */
+static void
+tbucket_lend(tbucket_t *tb, uint64 now)
+{
+	pslist_t *sl;
+	uint64 total = 0;
+	int64 pool = tb->tokens;
+
+	if (pool <= 0)
+		return;
+
+	PSLIST_FOREACH(tb->children, sl) {
+		const tbucket_t *child = sl->data;
+
+		if (tbucket_in_demand(child, now) && child->borrowed < child->cap)
+			total += child->weight;
+	}
+
+	if (0 == total)
+		return;
+
+	PSLIST_FOREACH(tb->children, sl) {
+		tbucket_t *child = sl->data;
+		int64 share;
+
+		if (!tbucket_in_demand(child, now) || child->borrowed >= child->cap)
+			continue;
+
+		share = pool * child->weight / total;
+		share = MIN(share, child->cap - child->borrowed);
+		child->borrowed += share;
+		tb->tokens -= share;
+	}
+}
+
+/**
+ * Refill bucket and its children recursively.
+ *
+ * @return amount of tokens that spilled over the bucket's capacity and
+ * which can be lent to the parent.
+ */
+static int64
+tbucket_refill_tree(tbucket_t *tb, uint64 now)
+{
+	pslist_t *sl;
+	int64 spill = 0;
+
+	if G_UNLIKELY(0 == tb->last || now < tb->last)
+		tb->last = now;			/* First refilling, or clock went backwards */
+
+	if (now > tb->last) {
+		double add = tb->rate * ((now - tb->last) / TBUCKET_NS) + tb->frac;
+
+		/*
+		 * Avoid overflowing when the bucket was not refilled for a long
+		 * time: it will be capped anyway.
+		 */
+
+		if (add >= (double) (tb->cap - MIN(tb->tokens, 0))) {
+			tb->tokens = tb->cap;
+			tb->frac = 0.0;
+		} else {
+			int64 whole = (int64) add;
+
+			tb->tokens += whole;
+			tb->frac = add - whole;
+		}
+		tb->last = now;
+	}
+
+	PSLIST_FOREACH(tb->children, sl) {
+		tb->tokens += tbucket_refill_tree(sl->data, now);
+	}
+
+	if (tb->children != NULL)
+		tbucket_lend(tb, now);
+
+	if (tb->tokens > tb->cap) {
+		spill = tb->tokens - tb->cap;
+		tb->tokens = tb->cap;
+	}
+
+	return (tb->flags & TBUCKET_F_NO_LEND) ? 0 : spill;
+}
+
+/**
+ * Refill the whole hierarchy to which the bucket belongs.
+ *
+ * Siblings need to be refilled as well to account for the tokens they
+ * spill over to their parent.
+ */
+static void
+tbucket_refill(tbucket_t *tb, uint64 now)
+{
+	while (tb->parent != NULL)
+		tb = tb->parent;
+
+	tbucket_refill_tree(tb, now);
+}
+
+/**
+ * Compute amount of tokens that can be used at the given time, including
+ * the ones that were borrowed from the parent.
+ */
+uint64
+tbucket_available(tbucket_t *tb, uint64 now)
+{
+	tbucket_check(tb);
+
+	tbucket_refill(tb, now);
+
+	return MAX(tb->tokens, 0) + tb->borrowed;
+}
+
+/**
+ * Record that given amount of tokens was used.
+ *
+ * Tokens are taken from the bucket first, then from what was borrowed from
+ * the parent.  If there are not enough tokens, the bucket gets into debt.
+ */
+void
+tbucket_consume(tbucket_t *tb, uint64 amount, uint64 now)
+{
+	int64 own, missing;
+
+	tbucket_check(tb);
+
+	tbucket_refill(tb, now);
+
+	own = MIN((int64) amount, MAX(tb->tokens, 0));
+	tb->tokens -= own;
+	missing = amount - own;
+
+	/*
+	 * Record demand when we are out of our own tokens, so that the parent
+	 * will lend us our share of its spare tokens at the next refills.
+	 */
+
+	if (tb->tokens <= 0)
+		tbucket_demand(tb, now);
+
+	if (0 == missing)
+		return;
+
+	own = MIN(missing, tb->borrowed);
+	tb->borrowed -= own;
+	tb->tokens -= missing - own;	/* Debt, repaid by next refills */
+}
+
+/**
+ * Compute how long we have to wait before the bucket holds the specified
+ * amount of tokens, assuming nothing can be borrowed from the parent.
+ *
+ * @return waiting time in nanoseconds.
+ */
+uint64
+tbucket_wait(const tbucket_t *tb, uint64 amount)
+{
+	double missing, ns;
+
+	tbucket_check(tb);
+
+	if (tb->tokens + tb->borrowed >= (int64) amount)
+		return 0;
+
+	if (0 == tb->rate)
+		return TBUCKET_WAIT_MAX_NS;
+
+	missing = (double) amount - tb->tokens - tb->borrowed - tb->frac;
+	ns = missing * TBUCKET_NS / tb->rate;
+
+	return MIN(ns, TBUCKET_WAIT_MAX_NS);
+}
+
+/**
+ * Start new deficit round-robin round.
+ */
+static void
+tbucket_new_round(tbucket_t *tb, uint64 now)
+{
+	double quantum, duration;
+
+	/*
+	 * The quantum is computed so that all the flows seen during the
+	 * previous round can use up the bucket's rate over TBUCKET_ROUND_MS,
+	 * but we never go below a full TCP segment: with many flows, rounds
+	 * last longer.
+	 *
+	 * Rounds usually end earlier than their maximal duration: as soon as
+	 * all the flows are exhausted or satisfied, which keeps the scheduler
+	 * work-conserving.  The maximal duration only matters for flows that
+	 * stop requesting bandwidth in the middle of a round.
+	 */
+
+	quantum = (double) tb->rate * TBUCKET_ROUND_MS / 1000.0;
+	quantum /= MAX(tb->flows, 1);
+	quantum = MAX(quantum, TBUCKET_QUANTUM_MIN);
+
+	duration = 0 == tb->rate ? 0.0 :
+		2.0 * quantum * MAX(tb->flows, 1) * TBUCKET_NS / tb->rate;
+	duration = MAX(duration, TBUCKET_ROUND_NS);
+
+	tb->quantum = quantum;
+	tb->round_ns = MIN(duration, TBUCKET_WAIT_MAX_NS);
+	tb->round++;
+	tb->flows = 0;
+	tb->exhausted = 0;
+	tb->round_start = now;
+}
+
+/**
+ * Credit flow with its quantum if this is a new round for it.
+ */
+static void
+tbucket_flow_credit(tbucket_t *tb, tbucket_flow_t *f)
+{
+	if (f->round != tb->round) {
+		uint64 quantum = MAX(tb->quantum >> f->shift, 1);
+
+		/*
+		 * A flow which could not use its quantum because tokens were
+		 * lacking keeps it, but no more, to not accumulate credit.
+		 * A negative deficit means the flow used more than it was granted,
+		 * and is deduced.
+		 */
+
+		f->deficit = MIN(f->deficit, (int64) quantum) + (int64) quantum;
+		f->round = tb->round;
+		f->exhausted = FALSE;
+		tb->flows++;
+	}
+}
+
+/**
+ * Flag flow as not needing more bandwidth during this round.
+ */
+static inline void
+tbucket_flow_done(tbucket_t *tb, tbucket_flow_t *f)
+{
+	if (!f->exhausted && f->round == tb->round) {
+		f->exhausted = TRUE;
+		tb->exhausted++;
+	}
+}
+
+/**
+ * Compute how much a flow can use now.
+ *
+ * @param tb		the bucket from which the flow draws its tokens
+ * @param f			the flow
+ * @param len		the amount the flow would like to use
+ * @param now		current time
+ *
+ * @return amount granted, 0 meaning the flow has to wait.
+ */
+uint64
+tbucket_flow_grant(tbucket_t *tb, tbucket_flow_t *f, uint64 len, uint64 now)
+{
+	uint64 available, granted;
+
+	tbucket_check(tb);
+	g_assert(f != NULL);
+
+	if (now < tb->round_start || now - tb->round_start >= tb->round_ns)
+		tbucket_new_round(tb, now);
+
+	tbucket_flow_credit(tb, f);
+	f->granted = 0;
+
+	if (f->deficit <= 0) {
+		tbucket_flow_done(tb, f);
+
+		/*
+		 * When all the flows active during the round are done, there
+		 * is no need to wait for the round to time out.
+		 */
+
+		if (tb->exhausted < tb->flows)
+			return 0;
+
+		tbucket_new_round(tb, now);
+		tbucket_flow_credit(tb, f);
+
+		if (f->deficit <= 0)
+			return 0;
+	}
+
+	available = tbucket_available(tb, now);
+
+	if (available < len)
+		tbucket_demand(tb, now);
+
+	granted = MIN(available, (uint64) f->deficit);
+	granted = MIN(granted, len);
+
+	/*
+	 * A flow getting all it asked for has nothing more to send for now,
+	 * and must not prevent the next round from starting.
+	 */
+
+	if (granted == len)
+		tbucket_flow_done(tb, f);
+
+	return f->granted = granted;
+}
+
+/**
+ * Record that the flow used the specified amount.
+ *
+ * This only updates the flow's deficit: tokens are consumed from the bucket
+ * with tbucket_consume(), since the bucket can be charged for traffic that
+ * is not attributable to a flow.
+ */
+void
+tbucket_flow_charge(tbucket_t *tb, tbucket_flow_t *f, uint64 used)
+{
+	tbucket_check(tb);
+	g_assert(f != NULL);
+
+	f->deficit -= MIN(used, (uint64) MAX_INT_VAL(int64) / 2);
+
+	/*
+	 * A flow that could not use all it was granted is flow-controlled and
+	 * will not need more bandwidth until the next round.
+	 */
+
+	if (f->deficit <= 0 || used < f->granted)
+		tbucket_flow_done(tb, f);
+
+	f->granted = 0;
+}
+
+/**
+ * Flow is no longer drawing from the bucket.
+ */
+void
+tbucket_flow_remove(tbucket_t *tb, tbucket_flow_t *f)
+{
+	tbucket_check(tb);
+	g_assert(f != NULL);
+
+	tbucket_flow_done(tb, f);
+	ZERO(f);
+}
+
+/**
+ * @return current round number, which changes each time a new round starts.
+ */
+uint
+tbucket_round(const tbucket_t *tb)
+{
+	tbucket_check(tb);
+
+	return tb->round;
+}
+
+/**
+ * Compute when flows that were denied bandwidth may be granted some.
+ *
+ * @return delay in nanoseconds.
+ */
+uint64
+tbucket_next_event(tbucket_t *tb, uint64 now)
+{
+	uint64 round_end;
+
+	tbucket_check(tb);
+
+	/*
+	 * If there are tokens, flows were denied because they exhausted their
+	 * quantum: they have to wait for the next round.  Otherwise, wait for
+	 * enough tokens to grant a minimal quantum.
+	 */
+
+	if (tbucket_available(tb, now) >= TBUCKET_QUANTUM_MIN) {
+		round_end = tb->round_start + tb->round_ns;
+		return now >= round_end ? 0 : round_end - now;
+	}
+
+	return tbucket_wait(tb, TBUCKET_QUANTUM_MIN);
+}
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2026, gtk-gnutella developers
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Hierarchical token buckets with deficit round-robin among flows.
+ *
+ * @author gtk-gnutella developers
+ * @date 2026
+ */
+
+#ifndef _tbucket_h_
+#define _tbucket_h_
+
+#include "common.h"
+
+typedef struct tbucket tbucket_t;
+
+/**
+ * Deficit round-robin state for a flow drawing from a token bucket.
+ *
+ * This is meant to be embedded in the structure describing the flow, and
+ * must be zeroed initially.
+ */
+typedef struct tbucket_flow {
+	int64 deficit;			/**< Bytes the flow may still use this round */
+	uint64 granted;			/**< Amount granted at last request */
+	uint round;				/**< Last round when flow got its quantum */
+	uint8 shift;			/**< Quantum reduction, as a power of 2 */
+	uint8 exhausted;		/**< Whether flow is done for this round */
+} tbucket_flow_t;
+
+/*
+ * Bucket flags.
+ */
+
+#define TBUCKET_F_NO_LEND	(1U << 0)	/**< Unused tokens not given to parent */
+#define TBUCKET_F_NO_BORROW	(1U << 1)	/**< Never borrow from parent */
+
+#define TBUCKET_BURST_MS	50		/**< Default burst size, in ms of traffic */
+#define TBUCKET_ROUND_MS	10		/**< Nominal duration of a DRR round */
+
+/*
+ * Public interface.
+ *
+ * All times are expressed in nanoseconds from an arbitrary monotonic origin,
+ * rates in bytes per second.
+ */
+
+tbucket_t *tbucket_make(tbucket_t *parent, uint64 rate, uint weight);
+void tbucket_free_null(tbucket_t **tb_ptr);
+
+void tbucket_set_rate(tbucket_t *tb, uint64 rate);
+void tbucket_set_weight(tbucket_t *tb, uint weight);
+void tbucket_set_burst(tbucket_t *tb, uint ms);
+void tbucket_set_flags(tbucket_t *tb, uint32 flags);
+uint64 tbucket_rate(const tbucket_t *tb);
+int64 tbucket_tokens(const tbucket_t *tb);
+
+uint64 tbucket_available(tbucket_t *tb, uint64 now);
+void tbucket_consume(tbucket_t *tb, uint64 amount, uint64 now);
+uint64 tbucket_wait(const tbucket_t *tb, uint64 amount);
+
+uint64 tbucket_flow_grant(tbucket_t *tb, tbucket_flow_t *f,
+	uint64 len, uint64 now);
+void tbucket_flow_charge(tbucket_t *tb, tbucket_flow_t *f, uint64 used);
+void tbucket_flow_remove(tbucket_t *tb, tbucket_flow_t *f);
+uint tbucket_round(const tbucket_t *tb);
+uint64 tbucket_next_event(tbucket_t *tb, uint64 now);
+
+#endif /* _tbucket_h_ */
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -35,6 +35,7 @@
 #include "aq.h"
 #include "atio.h"
 #include "atomic.h"
+#include "atoms.h"
 #include "barrier.h"
 #include "compat_poll.h"
 #include "compat_sleep_ms.h"
@@ -42,11 +43,14 @@
 #include "cq.h"
 #include "crash.h"
 #include "dam.h"
+#include "endian.h"
 #include "evq.h"
+#include "fd.h"
 #include "getcpucount.h"
 #include "halloc.h"
 #include "hset.h"
 #include "hstrfn.h"
+#include "inputevt.h"
 #include "log.h"
 #include "misc.h"
 #include "mutex.h"
@@ -94,7 +98,7 @@ static void G_NORETURN
 usage(void)
 {
 	fprintf(stderr,
-		"Usage: %s [-hejsvwxABCDEFHIKMNOPQRSUVWX]\n"
+		"Usage: %s [-hejsvwxABCDEFHIKLMNOPQRSUVWXY]\n"
 		"       [-a type] [-b size] [-c CPU]\n"
 		"       [-f count] [-n count] [-r percent] [-t ms] [-T msecs]\n"
 		"       [-z fn1,fn2...]\n"
@@ -122,6 +126,7 @@ usage(void)
 		"  -H : test thread interrupts\n"
 		"  -I : test inter-thread waiter signaling\n"
 		"  -K : test thread cancellation\n"
+		"  -L : loopback I/O load through 1..CPU per-thread event loops\n"
 		"  -M : monitors tennis match via waiters\n"
 		"  -N : add broadcast noise during tennis session\n"
 		"  -O : test thread stack overflow\n"
@@ -134,6 +139,7 @@ usage(void)
 		"  -V : test thread event queue (TEQ)\n"
 		"  -W : test local event queue (EVQ)\n"
 		"  -X : exercise concurrent memory allocation\n"
+		"  -Y : benchmark concurrent atom_get() / atom_free()\n"
 		"Values given as decimal, hexadecimal (0x), octal (0) or binary (0b)\n"
 		"Allocators: r=random mix, h=halloc, v=vmm_alloc, w=walloc, x=xmalloc\n"
 		, getprogname());
@@ -2123,6 +2129,156 @@ test_memory(unsigned repeat, bool posix, int percentage)
 	emit("%s() done!", G_STRFUNC);
 }
 
+#define ATOM_BENCH_KEYS		4096	/* Distinct atoms used by the benchmark */
+#define ATOM_BENCH_HELD		16		/* Atoms held at a time by each thread */
+#define ATOM_BENCH_OPS		500000	/* atom_get() calls per thread */
+
+struct atom_bench {
+	char **keys;			/* Atom values */
+	size_t ops;				/* Amount of atom_get() per thread */
+};
+
+static void *
+atom_bench_thread(void *arg)
+{
+	const struct atom_bench *ab = arg;
+	const char *held[ATOM_BENCH_HELD];
+	uint32 x = random_u32() | 1;		/* Thread-local xorshift state */
+	size_t i;
+
+	ZERO(&held);
+
+	for (i = 0; i < ab->ops; i++) {
+		const char *key, **h = &held[i % ATOM_BENCH_HELD];
+
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+
+		key = ab->keys[x % ATOM_BENCH_KEYS];
+
+		if (*h != NULL)
+			atom_str_free(*h);
+
+		*h = atom_str_get(key);
+
+		if G_UNLIKELY(0 != strcmp(*h, key))
+			s_error("%s(): got atom \"%s\" for \"%s\"", G_STRFUNC, *h, key);
+	}
+
+	for (i = 0; i < N_ITEMS(held); i++) {
+		if (held[i] != NULL)
+			atom_str_free(held[i]);
+	}
+
+	return NULL;
+}
+
+/**
+ * Run the atom benchmark with ``n'' concurrent threads.
+ *
+ * @return elapsed time, in microseconds.
+ */
+static long
+test_atoms_one(struct atom_bench *ab, int n)
+{
+	tm_t start, end;
+	int *t, i;
+
+	WALLOC_ARRAY(t, n);
+
+	tm_now_exact(&start);
+
+	for (i = 0; i < n; i++) {
+		t[i] = thread_create(atom_bench_thread, ab,
+				THREAD_F_PANIC, THREAD_STACK_MIN);
+	}
+
+	for (i = 0; i < n; i++) {
+		if (-1 == thread_join(t[i], NULL))
+			s_error("%s(): could not join with %s: %m",
+				G_STRFUNC, thread_id_name(t[i]));
+	}
+
+	tm_now_exact(&end);
+
+	WFREE_ARRAY(t, n);
+
+	return tm_elapsed_us(&end, &start);
+}
+
+/**
+ * Measure how concurrent atom_get() / atom_free() scale with the amount
+ * of threads.
+ *
+ * In the "hot" run, the main thread holds a reference on all the atoms,
+ * so threads only reuse existing atoms.  In the "churn" run, atoms are
+ * created and destroyed as threads pick and release them.
+ */
+static void
+test_atoms(unsigned repeat)
+{
+	long cpus = 0 == cpu_count ? getcpucount() : cpu_count;
+	struct atom_bench ab;
+	const char *base[ATOM_BENCH_KEYS];
+	unsigned r;
+	size_t i;
+
+	TESTING(G_STRFUNC);
+
+	emit("%s() detected %ld CPU%s%s", G_STRFUNC, PLURAL(cpus),
+		0 == cpu_count ? "" : " (forced by -c)");
+
+	XMALLOC_ARRAY(ab.keys, ATOM_BENCH_KEYS);
+	ab.ops = ATOM_BENCH_OPS;
+
+	for (i = 0; i < ATOM_BENCH_KEYS; i++) {
+		char buf[32];
+
+		str_bprintf(ARYLEN(buf), "atom-bench-%zu", i);
+		ab.keys[i] = xstrdup(buf);
+	}
+
+	for (r = 0; r < repeat; r++) {
+		int pass;
+
+		for (pass = 0; pass < 2; pass++) {
+			bool hot = 0 == pass;
+			long n;
+
+			if (hot) {
+				for (i = 0; i < ATOM_BENCH_KEYS; i++)
+					base[i] = atom_str_get(ab.keys[i]);
+			}
+
+			for (n = 1; n <= cpus; n = n < cpus && 2 * n > cpus ? cpus : 2 * n) {
+				long us = test_atoms_one(&ab, n);
+				double ops = (double) n * ab.ops;
+
+				emit("%s() #%u %s: %ld thread%s, %.3f Mops/s, %.1f ns/op",
+					G_STRFUNC, r, hot ? "hot" : "churn", PLURAL(n),
+					ops / MAX(us, 1), us * 1e3 / ops);
+			}
+
+			for (i = 0; i < ATOM_BENCH_KEYS; i++) {
+				if (hot) {
+					g_assert(atom_is_atom(ATOM_STRING, base[i]));
+					atom_str_free(base[i]);
+				}
+				g_assert_log(!atom_exists(ATOM_STRING, ab.keys[i]),
+					"%s(): atom \"%s\" still exists after %s run",
+					G_STRFUNC, ab.keys[i], hot ? "hot" : "churn");
+			}
+		}
+	}
+
+	for (i = 0; i < ATOM_BENCH_KEYS; i++)
+		xfree(ab.keys[i]);
+	XFREE_NULL(ab.keys);
+
+	emit("%s() done!", G_STRFUNC);
+}
+
 static int teq_recv_cnt;
 static int teq_sent_cnt;
 static int teq_callout_cnt;
@@ -2338,6 +2494,237 @@ test_evq(unsigned repeat)
 	}
 }
 
+#define NETIO_STREAMS		32		/* Amount of loopback streams */
+#define NETIO_MESSAGES		(NETIO_BURST * 2048)	/* Messages per stream */
+#define NETIO_HEADER		23		/* Size of a Gnutella header */
+#define NETIO_PAYLOAD		64		/* Payload of each message */
+#define NETIO_BURST			64		/* Messages per write() */
+
+struct netio_stream {
+	int fd[2];					/* Socket pair: [0] read, [1] write */
+	unsigned id;				/* Event source ID in the reader context */
+	unsigned received;			/* Messages received */
+	size_t fill;				/* Bytes held in partial message */
+	size_t need;				/* Length of current message */
+	char msg[NETIO_HEADER + NETIO_PAYLOAD];	/* Partial message */
+	struct netio_loop *loop;	/* Event loop reading the stream */
+};
+
+struct netio_loop {
+	inputevt_ctx_t *ctx;		/* Private event context */
+	unsigned active;			/* Streams still active */
+	barrier_t *b;				/* Start barrier */
+	struct netio_stream **streams;
+	unsigned count;				/* Amount of streams */
+};
+
+static void
+netio_test_readable(void *data, int fd, inputevt_cond_t unused_cond)
+{
+	struct netio_stream *ns = data;
+	char buf[16384];
+	ssize_t r;
+
+	(void) unused_cond;
+
+	while ((r = read(fd, buf, sizeof buf)) > 0) {
+		const char *p = buf;
+
+		/*
+		 * Split the stream into messages, as a Gnutella receiver would do,
+		 * using the payload length held at the end of the header.
+		 */
+
+		while (r > 0) {
+			size_t n = MIN((size_t) r, ns->need - ns->fill);
+
+			memcpy(&ns->msg[ns->fill], p, n);
+			ns->fill += n;
+			p += n;
+			r -= n;
+
+			if (ns->fill < ns->need)
+				break;
+
+			if (NETIO_HEADER == ns->need) {
+				uint32 len = peek_le32(&ns->msg[NETIO_HEADER - 4]);
+
+				g_assert(NETIO_PAYLOAD == len);
+				ns->need += len;
+				continue;
+			}
+
+			ns->received++;
+			ns->fill = 0;
+			ns->need = NETIO_HEADER;
+		}
+	}
+
+	if (0 == r || NETIO_MESSAGES == ns->received) {
+		g_assert(NETIO_MESSAGES == ns->received);
+		inputevt_ctx_remove(ns->loop->ctx, &ns->id);
+		ns->loop->active--;
+	} else if (!is_temporary_error(errno)) {
+		s_error("%s(): read error: %m", G_STRFUNC);
+	}
+}
+
+static void *
+netio_test_reader(void *arg)
+{
+	struct netio_loop *nl = arg;
+	unsigned i;
+
+	for (i = 0; i < nl->count; i++) {
+		struct netio_stream *ns = nl->streams[i];
+
+		ns->loop = nl;
+		ns->id = inputevt_ctx_add(nl->ctx, ns->fd[0], INPUT_EVENT_RX,
+			netio_test_readable, ns);
+	}
+	nl->active = nl->count;
+
+	barrier_wait(nl->b);
+	barrier_refcnt_dec(nl->b);
+
+	while (nl->active != 0)
+		inputevt_ctx_run(nl->ctx, 100);
+
+	return NULL;
+}
+
+static void *
+netio_test_writer(void *arg)
+{
+	struct netio_loop *nl = arg;
+	char *burst;
+	size_t len = NETIO_BURST * (NETIO_HEADER + NETIO_PAYLOAD);
+	unsigned i, j;
+
+	burst = xmalloc0(len);
+
+	for (i = 0; i < NETIO_BURST; i++) {
+		char *m = &burst[i * (NETIO_HEADER + NETIO_PAYLOAD)];
+		poke_le32(&m[NETIO_HEADER - 4], NETIO_PAYLOAD);
+	}
+
+	barrier_wait(nl->b);
+	barrier_refcnt_dec(nl->b);
+
+	for (j = 0; j < NETIO_MESSAGES / NETIO_BURST; j++) {
+		for (i = 0; i < nl->count; i++) {
+			int fd = nl->streams[i]->fd[1];
+			size_t w = 0;
+
+			while (w < len) {
+				ssize_t r = write(fd, &burst[w], len - w);
+				if (-1 == r)
+					s_error("%s(): write error: %m", G_STRFUNC);
+				w += r;
+			}
+		}
+	}
+
+	for (i = 0; i < nl->count; i++)
+		close(nl->streams[i]->fd[1]);
+
+	xfree(burst);
+	return NULL;
+}
+
+static void
+test_netio_one(unsigned loops, bool edge)
+{
+	struct netio_stream streams[NETIO_STREAMS];
+	struct netio_loop nl[NETIO_STREAMS];
+	int rid[NETIO_STREAMS], wid[NETIO_STREAMS];
+	barrier_t *b;
+	tm_t start, end;
+	double secs;
+	unsigned i;
+
+	g_assert(loops != 0 && loops <= NETIO_STREAMS);
+
+	b = barrier_new(2 * loops + 1);
+	ZERO(&nl);
+
+	for (i = 0; i < loops; i++) {
+		nl[i].ctx = inputevt_ctx_new(FALSE);
+		if (edge && !inputevt_ctx_set_edge_triggered(nl[i].ctx))
+			s_error("%s(): edge-triggered events not supported", G_STRFUNC);
+		nl[i].b = b;
+		XMALLOC0_ARRAY(nl[i].streams, NETIO_STREAMS);
+	}
+
+	for (i = 0; i < NETIO_STREAMS; i++) {
+		struct netio_stream *ns = &streams[i];
+		struct netio_loop *l = &nl[i % loops];
+
+		ZERO(ns);
+		if (-1 == socketpair(AF_LOCAL, SOCK_STREAM, 0, ns->fd))
+			s_error("%s(): socketpair() failed: %m", G_STRFUNC);
+		fd_set_nonblocking(ns->fd[0]);
+		ns->need = NETIO_HEADER;
+		l->streams[l->count++] = ns;
+	}
+
+	for (i = 0; i < loops; i++) {
+		barrier_refcnt_inc(b);		/* For the reader */
+		barrier_refcnt_inc(b);		/* For the writer */
+		rid[i] = thread_create(netio_test_reader, &nl[i], THREAD_F_PANIC, 0);
+		wid[i] = thread_create(netio_test_writer, &nl[i], THREAD_F_PANIC, 0);
+	}
+
+	barrier_wait(b);
+	tm_now_exact(&start);
+
+	for (i = 0; i < loops; i++) {
+		thread_join(rid[i], NULL);
+		thread_join(wid[i], NULL);
+	}
+
+	tm_now_exact(&end);
+	secs = tm_elapsed_f(&end, &start);
+
+	emit("%s(): %u %s event loop%s: %.0f msg/s (%.3f secs)", G_STRFUNC,
+		loops, edge ? "edge-triggered" : "level-triggered", plural(loops),
+		NETIO_STREAMS * NETIO_MESSAGES / secs, secs);
+
+	for (i = 0; i < NETIO_STREAMS; i++) {
+		g_assert(0 == streams[i].id);
+		close(streams[i].fd[0]);
+	}
+
+	for (i = 0; i < loops; i++) {
+		inputevt_ctx_free_null(&nl[i].ctx);
+		XFREE_NULL(nl[i].streams);
+	}
+
+	barrier_free_null(&b);
+}
+
+static void
+test_netio(unsigned repeat)
+{
+	long cpus = 0 == cpu_count ? getcpucount() : cpu_count;
+
+	TESTING(G_STRFUNC);
+
+	emit("%s() detected %ld CPU%s%s", G_STRFUNC, PLURAL(cpus),
+		0 == cpu_count ? "" : " (forced by -c)");
+
+	cpus = MIN(cpus, NETIO_STREAMS);
+
+	while (repeat--) {
+		unsigned loops;
+
+		for (loops = 1; loops <= cpus; loops *= 2) {
+			test_netio_one(loops, FALSE);
+			test_netio_one(loops, TRUE);
+		}
+	}
+}
+
 #define INTERRUPTS	5	/* Amount of interrupts we're sending */
 
 static int interrupt_count;
@@ -2514,9 +2901,9 @@ main(int argc, char **argv)
 	bool inter = FALSE, forking = FALSE, aqueue = FALSE, rwlock = FALSE;
 	bool signals = FALSE, barrier = FALSE, overflow = FALSE, memory = FALSE;
 	bool stats = FALSE, teq = FALSE, cancel = FALSE, dam = FALSE, evq = FALSE;
-	bool interrupts = FALSE, qlock = FALSE;
+	bool interrupts = FALSE, qlock = FALSE, netio = FALSE, atoms = FALSE;
 	unsigned repeat = 1, play_time = 0;
-	const char options[] = "a:b:c:ef:hjn:r:st:vwxz:ABCDEFHIKMNOPQRST:UVWX";
+	const char options[] = "a:b:c:ef:hjn:r:st:vwxz:ABCDEFHIKLMNOPQRST:UVWXY";
 
 	progstart(argc, argv);
 	thread_set_main(TRUE);		/* We're the main thread, we can block */
@@ -2551,6 +2938,9 @@ main(int argc, char **argv)
 		case 'K':			/* test thread cancellation */
 			cancel = TRUE;
 			break;
+		case 'L':			/* test loopback I/O through event loops */
+			netio = TRUE;
+			break;
 		case 'M':			/* monitor tennis match */
 			monitor = TRUE;
 			break;
@@ -2588,6 +2978,9 @@ main(int argc, char **argv)
 		case 'X':			/* exercise memory allocation */
 			memory = TRUE;
 			break;
+		case 'Y':			/* benchmark atoms */
+			atoms = TRUE;
+			break;
 		case 'a':			/* choose allocator for -X tests */
 			allocator = *optarg;
 			break;
@@ -2738,6 +3131,12 @@ main(int argc, char **argv)
 	if (evq)
 		test_evq(repeat);
 
+	if (netio)
+		test_netio(repeat);
+
+	if (atoms)
+		test_atoms(repeat);
+
 	/*
 	 * Print final statistics.
 	 */
@@ -160,42 +160,116 @@ tiger_compress(const uint64 *data, uint64 state[3])
   tiger_compress_macro(data, state);
 }
 
-void
-tiger(const void *data, uint64 length, char hash[24])
+/* Two independent compressions, interleaved round by round so that the */
+/* CPU can overlap the S-box lookups of both lanes.                      */
+#define round2(a,b,c,x,A,B,C,X,mul) \
+      c ^= x; \
+      C ^= X; \
+      a -= t1[((c)>>(0*8))&0xFF] ^ t2[((c)>>(2*8))&0xFF] ^ \
+	   t3[((c)>>(4*8))&0xFF] ^ t4[((c)>>(6*8))&0xFF] ; \
+      A -= t1[((C)>>(0*8))&0xFF] ^ t2[((C)>>(2*8))&0xFF] ^ \
+	   t3[((C)>>(4*8))&0xFF] ^ t4[((C)>>(6*8))&0xFF] ; \
+      b += t4[((c)>>(1*8))&0xFF] ^ t3[((c)>>(3*8))&0xFF] ^ \
+	   t2[((c)>>(5*8))&0xFF] ^ t1[((c)>>(7*8))&0xFF] ; \
+      B += t4[((C)>>(1*8))&0xFF] ^ t3[((C)>>(3*8))&0xFF] ^ \
+	   t2[((C)>>(5*8))&0xFF] ^ t1[((C)>>(7*8))&0xFF] ; \
+      b *= mul; \
+      B *= mul;
+
+#define pass2(a,b,c,A,B,C,mul) \
+      round2(a,b,c,x[0],A,B,C,y[0],mul) \
+      round2(b,c,a,x[1],B,C,A,y[1],mul) \
+      round2(c,a,b,x[2],C,A,B,y[2],mul) \
+      round2(a,b,c,x[3],A,B,C,y[3],mul) \
+      round2(b,c,a,x[4],B,C,A,y[4],mul) \
+      round2(c,a,b,x[5],C,A,B,y[5],mul) \
+      round2(a,b,c,x[6],A,B,C,y[6],mul) \
+      round2(b,c,a,x[7],B,C,A,y[7],mul)
+
+static inline ALWAYS_INLINE void
+tiger_key_schedule(uint64 *x)
 {
-  uint64 i, j, res[3];
-  const uint8 *data_u8 = data;
-  union {
-    uint64 u64[8];
-    uint8 u8[64];
-  } temp;
+  key_schedule
+}
+
+static void G_HOT
+tiger_compress2(const uint64 *str, const uint64 *str2,
+  uint64 state[3], uint64 state2[3])
+{
+  uint64 a, b, c, tmpa, A, B, C, tmpA;
+  uint64 x[8], y[8];
+  int pass_no, i;
+
+  a = state[0];
+  b = state[1];
+  c = state[2];
+  A = state2[0];
+  B = state2[1];
+  C = state2[2];
+
+  for (i = 0; i < 8; i++) {
+    x[i] = str[i];
+    y[i] = str2[i];
+  }
+
+  pass2(a,b,c,A,B,C,5)
+  tiger_key_schedule(x);
+  tiger_key_schedule(y);
+  pass2(c,a,b,C,A,B,7)
+  tiger_key_schedule(x);
+  tiger_key_schedule(y);
+  pass2(b,c,a,B,C,A,9)
+  for (pass_no = 3; pass_no < PASSES; pass_no++) {
+    tiger_key_schedule(x);
+    tiger_key_schedule(y);
+    pass2(a,b,c,A,B,C,9)
+    tmpa = a; a = c; c = b; b = tmpa;
+    tmpA = A; A = C; C = B; B = tmpA;
+  }
+
+  state[0] ^= a;
+  state[1] = b - state[1];
+  state[2] += c;
+  state2[0] ^= A;
+  state2[1] = B - state2[1];
+  state2[2] += C;
+}
 
-  res[0] = U64_FROM_2xU32(0x01234567UL, 0x89ABCDEFUL);
-  res[1] = U64_FROM_2xU32(0xFEDCBA98UL, 0x76543210UL);
+#undef round2
+#undef pass2
+
+#define tiger_init(res) \
+  res[0] = U64_FROM_2xU32(0x01234567UL, 0x89ABCDEFUL); \
+  res[1] = U64_FROM_2xU32(0xFEDCBA98UL, 0x76543210UL); \
   res[2] = U64_FROM_2xU32(0xF096A5B4UL, 0xC3B2E187UL);
 
+/* Load a 64-byte block as 8 little-endian words.                        */
+static inline void
+tiger_load(uint64 *dst, const uint8 *p)
+{
 #if IS_BIG_ENDIAN
-  for (i = length; i >= 64; i -= 64) {
-    for (j = 0; j < 64; j++) {
-      temp.u8[j ^ 7] = data_u8[j];
-    }
-    tiger_compress(temp.u64, res);
-    data_u8 += 64;
-  }
-#else	/* !IS_BIG_ENDIAN */
-  if ((ulong) data & 7) {
-    for (i = length; i >= 64; i -= 64) {
-      memcpy(temp.u64, data_u8, 64);
-      tiger_compress(temp.u64, res);
-      data_u8 += 64;
-    }
-  } else {
-    for (i = length; i >= 64; i -= 64) {
-      tiger_compress((void *) data_u8, res);
-      data_u8 += 64;
-    }
+  uint8 *d = (uint8 *) dst;
+  uint j;
+
+  for (j = 0; j < 64; j++) {
+    d[j ^ 7] = p[j];
   }
+#else
+  memcpy(dst, p, 64);
 #endif	/* IS_BIG_ENDIAN */
+}
+
+/* Process the trailing ``i'' bytes (less than 64) and the padding, then */
+/* write the final hash.                                                 */
+static void
+tiger_finish(const uint8 *data_u8, uint64 i, uint64 length,
+  uint64 res[3], char hash[24])
+{
+  uint64 j;
+  union {
+    uint64 u64[8];
+    uint8 u8[64];
+  } temp;
 
 #if IS_BIG_ENDIAN
   for (j = 0; j < i; j++) {
@@ -237,6 +311,82 @@ tiger(const void *data, uint64 length, char hash[24])
   }
 }
 
+void
+tiger(const void *data, uint64 length, char hash[24])
+{
+  uint64 i, res[3];
+  const uint8 *data_u8 = data;
+  union {
+    uint64 u64[8];
+    uint8 u8[64];
+  } temp;
+
+  tiger_init(res);
+
+#if IS_BIG_ENDIAN
+  for (i = length; i >= 64; i -= 64) {
+    tiger_load(temp.u64, data_u8);
+    tiger_compress(temp.u64, res);
+    data_u8 += 64;
+  }
+#else	/* !IS_BIG_ENDIAN */
+  if ((ulong) data & 7) {
+    for (i = length; i >= 64; i -= 64) {
+      memcpy(temp.u64, data_u8, 64);
+      tiger_compress(temp.u64, res);
+      data_u8 += 64;
+    }
+  } else {
+    for (i = length; i >= 64; i -= 64) {
+      tiger_compress((void *) data_u8, res);
+      data_u8 += 64;
+    }
+  }
+#endif	/* IS_BIG_ENDIAN */
+
+  tiger_finish(data_u8, i, length, res, hash);
+}
+
+/**
+ * Compute the Tiger hash of ``n'' independent messages of the same length,
+ * message data[i] yielding hash[i].
+ *
+ * Messages are processed by pairs, with both compressions interleaved,
+ * which is faster than hashing them one after the other.
+ */
+void
+tiger_multi(const void * const data[], size_t n, uint64 length,
+  char (*hash)[24])
+{
+  size_t k;
+
+  for (k = 0; k + 1 < n; k += 2) {
+    uint64 i, res[3], res2[3];
+    const uint8 *p = data[k], *p2 = data[k + 1];
+    union {
+      uint64 u64[8];
+      uint8 u8[64];
+    } temp, temp2;
+
+    tiger_init(res);
+    tiger_init(res2);
+
+    for (i = length; i >= 64; i -= 64) {
+      tiger_load(temp.u64, p);
+      tiger_load(temp2.u64, p2);
+      tiger_compress2(temp.u64, temp2.u64, res, res2);
+      p += 64;
+      p2 += 64;
+    }
+
+    tiger_finish(p, i, length, res, hash[k]);
+    tiger_finish(p2, i, length, res2, hash[k + 1]);
+  }
+
+  if (k < n)
+    tiger(data[k], length, hash[k]);
+}
+
 /* vi: set ai et sts=2 sw=2 cindent: */
 /**
  * Runs some test cases to check whether the implementation of the tiger
@@ -38,6 +38,8 @@
 
 void tiger_check(void);
 void tiger(const void *data, uint64 length, char hash[24]);
+void tiger_multi(const void * const data[], size_t n, uint64 length,
+	char (*hash)[24]);
 
 #endif /* _tiger_h_ */
 /* vi: set ts=4 sw=4 cindent: */
@@ -80,10 +80,13 @@
 
 #include "tigertree.h"
 
+#include "atomic.h"
 #include "base32.h"
 #include "endian.h"
+#include "getcpucount.h"
 #include "halloc.h"
 #include "misc.h"
+#include "tpool.h"
 #include "unsigned.h"
 
 #include "override.h"		/* Must be the last header included */
@@ -97,6 +100,20 @@
  * longer than 2^64 in size), havoc may ensue. */
 #define TTH_STACKSIZE	(TIGERSIZE * 56)
 
+/* amount of leaves hashed at once when data is fed in large chunks */
+#define TTH_BATCH		128
+
+/* minimum amount of leaves per job when hashing in parallel (256 KiB) */
+#define TTH_PAR_MIN		256
+
+/* maximum amount of leaves hashed at once in parallel (8 MiB) */
+#define TTH_PAR_BATCH	8192
+
+/* maximum amount of threads used to hash leaves */
+#define TTH_THREAD_MAX	16
+
+static int tt_threads = 1;		/* threads used to hash leaves */
+
 enum {
 	TTH_F_INITIALIZED	= 1 << 0,
 	TTH_F_FINISHED		= 1 << 1
@@ -301,19 +318,19 @@ tt_collapse(TTH_CONTEXT *ctx)
 	}
 }
 
+/**
+ * Push the hash of the next leaf block onto the stack, collapsing the
+ * tree as far as possible.
+ */
 static void
-tt_block(TTH_CONTEXT *ctx)
+tt_push(TTH_CONTEXT *ctx, const struct tth *hash)
 {
-	g_assert(ctx);
-
-	tiger(ctx->block.bytes, ctx->block_fill, ctx->stack[ctx->si].data);
+	ctx->stack[ctx->si] = *hash;
 	if (ctx->bpl == 1) {
 		ctx->leaves[ctx->li] = ctx->stack[ctx->si];
 		ctx->li++;
 	}
 
-	ctx->block_fill = 1;
-
 	ctx->si++;
 	ctx->n++;
 
@@ -324,6 +341,144 @@ tt_block(TTH_CONTEXT *ctx)
 	tt_collapse(ctx);
 }
 
+static void
+tt_block(TTH_CONTEXT *ctx)
+{
+	struct tth hash;
+
+	g_assert(ctx);
+
+	tiger(ctx->block.bytes, ctx->block_fill, hash.data);
+	ctx->block_fill = 1;
+	tt_push(ctx, &hash);
+}
+
+/**
+ * Compute the hashes of ``n'' consecutive full leaf blocks.
+ */
+static void
+tt_leaf_hash(const char *data, size_t n, struct tth *hash)
+{
+	union {
+		uint64 u64;	/* Better alignment */
+		char bytes[TTH_BLOCKSIZE + 1];
+	} buf[2];
+	const void *msg[2] = { buf[0].bytes, buf[1].bytes };
+	size_t i;
+
+	buf[0].bytes[0] = buf[1].bytes[0] = 0x00;
+
+	for (i = 0; i < n; i += 2) {
+		size_t k = MIN(2, n - i);
+
+		memcpy(&buf[0].bytes[1], &data[i * TTH_BLOCKSIZE], TTH_BLOCKSIZE);
+		if (k > 1) {
+			memcpy(&buf[1].bytes[1], &data[(i + 1) * TTH_BLOCKSIZE],
+				TTH_BLOCKSIZE);
+		}
+		tiger_multi(msg, k, sizeof buf[0].bytes, (char (*)[24]) &hash[i]);
+	}
+}
+
+/**
+ * Leaf hashing work, split into slices of consecutive leaves.
+ */
+struct tt_leaf_work {
+	const char *data;		/* the leaf blocks */
+	struct tth *hash;		/* where leaf hashes are written */
+	size_t n;				/* amount of leaves */
+	size_t slices;			/* amount of slices */
+};
+
+/**
+ * Hash the leaves of the given slice.
+ */
+static void
+tt_leaf_slice(const struct tt_leaf_work *w, size_t idx)
+{
+	size_t per = w->n / w->slices, off = idx * per;
+	size_t n = idx + 1 == w->slices ? w->n - off : per;
+
+	tt_leaf_hash(&w->data[off * TTH_BLOCKSIZE], n, &w->hash[off]);
+}
+
+/**
+ * Pool job: the calling thread handles slice #0 itself, hence the offset.
+ */
+static void
+tt_leaf_job(void *data, size_t idx)
+{
+	tt_leaf_slice(data, idx + 1);
+}
+
+/**
+ * Compute the hashes of ``n'' consecutive full leaf blocks, splitting the
+ * work in slices handed to the default thread pool when worth it.
+ *
+ * @param data		the leaf blocks
+ * @param n			amount of leaves
+ * @param hash		where leaf hashes are written
+ * @param threads	maximum amount of threads to use, including ours
+ */
+static void
+tt_leaf_hash_parallel(const char *data, size_t n, struct tth *hash,
+	uint threads)
+{
+	struct tt_leaf_work w;
+	tpool_group_t *tg;
+	tpool_t *tp;
+
+	w.slices = MIN(threads, n / TTH_PAR_MIN);
+	tp = w.slices > 1 ? tpool_default() : NULL;
+
+	/*
+	 * We cannot wait for pool jobs from a pool worker, and there is no pool
+	 * any more at shutdown time: hash everything ourselves then.
+	 */
+
+	if (NULL == tp || tpool_is_worker(tp)) {
+		tt_leaf_hash(data, n, hash);
+		return;
+	}
+
+	w.slices = MIN(w.slices, tpool_workers(tp) + 1);
+	w.data = data;
+	w.hash = hash;
+	w.n = n;
+
+	tg = tpool_group_make(tp, TPOOL_PRIO_NORMAL, NULL, NULL);
+	tpool_submit(tg, tt_leaf_job, &w, w.slices - 1);
+	tt_leaf_slice(&w, 0);
+	tpool_group_wait(tg);
+	tpool_group_free_null(&tg);
+}
+
+/**
+ * Set the amount of threads used to hash leaf blocks when large amounts
+ * of data are fed to tt_update().
+ *
+ * @param n		amount of threads, 0 meaning one per CPU.
+ */
+void
+tt_set_threads(uint n)
+{
+	if (0 == n)
+		n = getcpucount();
+
+	n = MAX(n, 1);
+	n = MIN(n, TTH_THREAD_MAX);
+	atomic_int_set(&tt_threads, n);
+}
+
+/**
+ * @return the amount of threads used to hash leaf blocks.
+ */
+uint
+tt_get_threads(void)
+{
+	return atomic_int_get(&tt_threads);
+}
+
 static void
 tt_finish(TTH_CONTEXT *ctx)
 {
@@ -418,8 +573,12 @@ tt_init(TTH_CONTEXT *ctx, filesize_t filesize)
 	ctx->flags = TTH_F_INITIALIZED;
 }
 
-void
-tt_update(TTH_CONTEXT *ctx, const void *data, size_t size)
+/**
+ * Feed data to the context, hashing leaves with at most ``threads'' threads.
+ */
+static void
+tt_update_threads(TTH_CONTEXT *ctx, const void *data, size_t size,
+	uint threads)
 {
 	const char *block = data;
 
@@ -429,8 +588,41 @@ tt_update(TTH_CONTEXT *ctx, const void *data, size_t size)
 	g_assert(size == 0 || NULL != data);
 
 	while (size > 0) {
-		size_t n = sizeof ctx->block.bytes - ctx->block_fill;
+		size_t n;
+
+		/*
+		 * When no partial block is pending, full blocks are hashed directly
+		 * from the supplied data, by batches: the leaves are independent
+		 * so they can be hashed in parallel, and only their hashes need to
+		 * be pushed in order.  Parallel batches are much larger, to make
+		 * handing them to the thread pool worth it.
+		 */
+
+		if (1 == ctx->block_fill && size >= TTH_BLOCKSIZE) {
+			struct tth buf[TTH_BATCH], *hash = buf;
+			size_t i, leaves = size / TTH_BLOCKSIZE;
+
+			if (threads > 1 && leaves >= 2 * TTH_PAR_MIN) {
+				n = MIN(leaves, TTH_PAR_BATCH);
+				HALLOC_ARRAY(hash, n);
+				tt_leaf_hash_parallel(block, n, hash, threads);
+			} else {
+				n = MIN(leaves, N_ITEMS(buf));
+				tt_leaf_hash(block, n, hash);
+			}
+
+			for (i = 0; i < n; i++)
+				tt_push(ctx, &hash[i]);
+
+			if (hash != buf)
+				HFREE_NULL(hash);
+
+			block += n * TTH_BLOCKSIZE;
+			size -= n * TTH_BLOCKSIZE;
+			continue;
+		}
 
+		n = sizeof ctx->block.bytes - ctx->block_fill;
 		n = MIN(n, size);
 		memmove(&ctx->block.bytes[ctx->block_fill], block, n);
 		ctx->block_fill += n;
@@ -443,6 +635,12 @@ tt_update(TTH_CONTEXT *ctx, const void *data, size_t size)
 	}
 }
 
+void
+tt_update(TTH_CONTEXT *ctx, const void *data, size_t size)
+{
+	tt_update_threads(ctx, data, size, atomic_int_get(&tt_threads));
+}
+
 void
 tt_digest(TTH_CONTEXT *ctx, struct tth *hash)
 {
@@ -504,6 +702,41 @@ tt_check_digest(const char * const expected, const void *data, size_t size)
 	}
 }
 
+/**
+ * Check that feeding data in large chunks, hashing leaves in batches and
+ * in parallel, yields the same TTH as feeding it byte by byte.
+ */
+static void G_COLD
+tt_check_batch(void)
+{
+	size_t len = 3 * TTH_PAR_MIN * TTH_BLOCKSIZE + 123, i;
+	char *data = halloc(len);
+	struct tth h1, h2, h3;
+	TTH_CONTEXT ctx;
+
+	for (i = 0; i < len; i++)
+		data[i] = (i * 131 + (i >> 7)) & 0xff;
+
+	tt_init(&ctx, len);
+	for (i = 0; i < len; i++)
+		tt_update(&ctx, &data[i], 1);
+	tt_digest(&ctx, &h1);
+
+	tt_init(&ctx, len);
+	tt_update_threads(&ctx, data, len, 4);
+	tt_digest(&ctx, &h2);
+
+	tt_init(&ctx, len);
+	for (i = 0; i < len; i += 1000)
+		tt_update_threads(&ctx, &data[i], MIN(1000, len - i), 1);
+	tt_digest(&ctx, &h3);
+
+	HFREE_NULL(data);
+
+	if (0 != memcmp(&h1, &h2, sizeof h1) || 0 != memcmp(&h1, &h3, sizeof h1))
+		g_error("Tigertree batch hashing is defective.");
+}
+
 void G_COLD
 tt_check(void)
 {
@@ -526,6 +759,8 @@ tt_check(void)
 		memset(buf, 'A', sizeof buf);
 		tt_check_digest("PZMRYHGY6LTBEH63ZWAHDORHSYTLO4LEFUIKHWY", ARYLEN(buf));
 	}
+
+	tt_check_batch();
 }
 
 /* vi: set ts=4 sw=4 cindent: */
@@ -0,0 +1,590 @@
+/*
+ * Copyright (c) 2026, gtk-gnutella developers
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Work-stealing thread pool.
+ *
+ * Every worker owns one queue per priority level, protected by a spinlock
+ * that is only contended when another worker steals from it.  The owner
+ * takes its most recent job, whose data is likely to still be in its CPU
+ * cache, whereas thieves take the oldest one.
+ *
+ * The pool semaphore holds one token per queued job: a worker grabs a token
+ * before looking for a job, hence it is certain to find one in some queue,
+ * and idle workers sleep in the kernel instead of spinning.
+ *
+ * Each group counts its jobs that were submitted but not completed yet.
+ * Cancelled jobs are not removed from the queues: the worker that picks
+ * them simply does not run them, which keeps the accounting trivial.
+ *
+ * @author gtk-gnutella developers
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "tpool.h"
+
+#include "atomic.h"
+#include "cond.h"
+#include "elist.h"
+#include "getcpucount.h"
+#include "log.h"
+#include "mutex.h"
+#include "once.h"
+#include "semaphore.h"
+#include "spinlock.h"
+#include "str.h"
+#include "thread.h"
+#include "vmm.h"
+#include "walloc.h"
+
+#include "override.h"		/* Must be the last header included */
+
+#define TPOOL_CACHELINE		64		/**< Amount of bytes in a CPU cacheline */
+#define TPOOL_WORKERS_MAX	16		/**< Maximum amount of workers */
+#define TPOOL_STACK			(THREAD_STACK_MIN * 2)
+
+enum tpool_magic { TPOOL_MAGIC = 0x3b1e07d5 };
+enum tpool_group_magic { TPOOL_GROUP_MAGIC = 0x5e42c9a1 };
+
+struct tpool_job {
+	tpool_group_t *group;		/**< Group to which job belongs */
+	tpool_fn_t fn;				/**< Routine to run */
+	void *data;					/**< Routine argument */
+	size_t idx;					/**< Job index within submission */
+	link_t lnk;					/**< Links jobs in worker queue */
+};
+
+struct tpool_worker {
+	tpool_t *pool;				/**< Pool to which worker belongs */
+	uint index;					/**< Index in pool */
+	uint stid;					/**< Thread small ID */
+	elist_t queue[TPOOL_PRIO_COUNT];	/**< Queued jobs, per priority */
+	spinlock_t lock;			/**< Protects queues */
+} G_ALIGNED(TPOOL_CACHELINE);
+
+struct tpool {
+	enum tpool_magic magic;
+	uint workers;				/**< Amount of worker threads */
+	uint next;					/**< Next worker for foreign submissions */
+	bool stopping;				/**< Set when workers must exit */
+	const char *name;			/**< Pool name, for logging */
+	semaphore_t *jobs;			/**< One token per queued job */
+	struct tpool_worker worker[TPOOL_WORKERS_MAX];
+};
+
+static inline void
+tpool_check(const struct tpool * const tp)
+{
+	g_assert(tp != NULL);
+	g_assert(TPOOL_MAGIC == tp->magic);
+}
+
+struct tpool_group {
+	enum tpool_group_magic magic;
+	tpool_prio_t prio;			/**< Priority of all the jobs */
+	bool cancelled;				/**< Whether group was cancelled */
+	size_t pending;				/**< Jobs submitted but not completed */
+	tpool_t *pool;				/**< Pool running the jobs */
+	tpool_done_fn_t done;		/**< Completion callback (optional) */
+	void *arg;					/**< Completion callback argument */
+	mutex_t lock;				/**< Protects counter and callback */
+	cond_t completed;			/**< Signalled when ``pending'' drops to 0 */
+};
+
+static inline void
+tpool_group_check(const struct tpool_group * const tg)
+{
+	g_assert(tg != NULL);
+	g_assert(TPOOL_GROUP_MAGIC == tg->magic);
+}
+
+#define TPOOL_WORKER_LOCK(w)	spinlock(&(w)->lock)
+#define TPOOL_WORKER_UNLOCK(w)	spinunlock(&(w)->lock)
+
+#define TPOOL_GROUP_LOCK(g)		mutex_lock(&(g)->lock)
+#define TPOOL_GROUP_UNLOCK(g)	mutex_unlock(&(g)->lock)
+
+static tpool_t *tpool_dflt;
+static once_flag_t tpool_dflt_inited;
+
+/**
+ * @return the worker structure of the current thread if it belongs to
+ * the pool, NULL otherwise.
+ */
+static struct tpool_worker *
+tpool_worker_self(tpool_t *tp)
+{
+	uint i, stid = thread_small_id();
+
+	for (i = 0; i < tp->workers; i++) {
+		if (tp->worker[i].stid == stid)
+			return &tp->worker[i];
+	}
+
+	return NULL;
+}
+
+/**
+ * Remove a job from the queue of a worker, at the given priority.
+ *
+ * @param w			the worker whose queue we look at
+ * @param prio		the priority of the queue
+ * @param owner		whether we are the worker owning the queue
+ *
+ * @return the job, NULL if the queue was empty.
+ */
+static struct tpool_job *
+tpool_worker_take(struct tpool_worker *w, tpool_prio_t prio, bool owner)
+{
+	struct tpool_job *tj;
+	elist_t *q = &w->queue[prio];
+
+	/*
+	 * Peek at the count without locking first: if we miss a job that was
+	 * just queued, the token we hold will make us look again.
+	 */
+
+	if (0 == elist_count(q))
+		return NULL;
+
+	TPOOL_WORKER_LOCK(w);
+	tj = owner ? elist_pop(q) : elist_shift(q);
+	TPOOL_WORKER_UNLOCK(w);
+
+	return tj;
+}
+
+/**
+ * Find the next job to run for a worker, from its own queues first and
+ * then from the other workers, by decreasing priority.
+ *
+ * The caller holds a job token, hence there is at least one job queued.
+ */
+static struct tpool_job *
+tpool_worker_next(struct tpool_worker *w)
+{
+	tpool_t *tp = w->pool;
+
+	for (;;) {
+		uint p, i;
+
+		for (p = 0; p < TPOOL_PRIO_COUNT; p++) {
+			struct tpool_job *tj = tpool_worker_take(w, p, TRUE);
+
+			if (tj != NULL)
+				return tj;
+
+			for (i = 1; i < tp->workers; i++) {
+				struct tpool_worker *victim =
+					&tp->worker[(w->index + i) % tp->workers];
+
+				tj = tpool_worker_take(victim, p, FALSE);
+				if (tj != NULL)
+					return tj;
+			}
+		}
+
+		/*
+		 * Another worker took the job we were looking at whilst the job
+		 * matching its token was queued in a place we had already visited.
+		 */
+
+		thread_yield();
+	}
+}
+
+/**
+ * Job completed (or skipped because its group was cancelled).
+ */
+static void
+tpool_group_job_done(tpool_group_t *tg)
+{
+	TPOOL_GROUP_LOCK(tg);
+
+	g_assert(tg->pending != 0);
+
+	/*
+	 * The completion callback is invoked with the group locked, so that the
+	 * group cannot be cancelled nor freed whilst it runs.
+	 */
+
+	if (0 == --tg->pending) {
+		if (!tg->cancelled && tg->done != NULL)
+			(*tg->done)(tg, tg->arg);
+		cond_broadcast(&tg->completed, &tg->lock);
+	}
+
+	TPOOL_GROUP_UNLOCK(tg);
+}
+
+/**
+ * Run job and free it.
+ */
+static void
+tpool_job_run(struct tpool_job *tj)
+{
+	tpool_group_t *tg = tj->group;
+
+	tpool_group_check(tg);
+
+	if (!atomic_bool_get(&tg->cancelled))
+		(*tj->fn)(tj->data, tj->idx);
+
+	WFREE(tj);
+	tpool_group_job_done(tg);
+}
+
+/**
+ * Worker thread main loop.
+ */
+static void *
+tpool_worker_main(void *arg)
+{
+	struct tpool_worker *w = arg;
+	tpool_t *tp = w->pool;
+
+	tpool_check(tp);
+
+	thread_set_name_atom(str_smsg("%s pool #%u", tp->name, w->index));
+
+	for (;;) {
+		if (!semaphore_acquire(tp->jobs, 1, NULL)) {
+			if (EINTR == errno)
+				continue;
+			s_error("%s(): cannot get job token: %m", G_STRFUNC);
+		}
+
+		if (atomic_bool_get(&tp->stopping))
+			break;
+
+		tpool_job_run(tpool_worker_next(w));
+	}
+
+	return NULL;
+}
+
+/**
+ * Create a new pool.
+ *
+ * @param name		the pool name, for logging (static string)
+ * @param workers	amount of worker threads, 0 meaning one per CPU
+ *
+ * @return a new pool, to be freed with tpool_free_null().
+ */
+tpool_t *
+tpool_make(const char *name, uint workers)
+{
+	tpool_t *tp;
+	uint i;
+
+	if (0 == workers)
+		workers = getcpucount();
+
+	workers = MAX(workers, 1);
+	workers = MIN(workers, TPOOL_WORKERS_MAX);
+
+	tp = vmm_alloc0(sizeof *tp);
+	tp->magic = TPOOL_MAGIC;
+	tp->name = name;
+	tp->workers = workers;
+	tp->jobs = semaphore_create(0);
+
+	for (i = 0; i < workers; i++) {
+		struct tpool_worker *w = &tp->worker[i];
+		uint p;
+
+		w->pool = tp;
+		w->index = i;
+		w->stid = THREAD_INVALID_ID;
+		spinlock_init(&w->lock);
+		for (p = 0; p < TPOOL_PRIO_COUNT; p++)
+			elist_init(&w->queue[p], offsetof(struct tpool_job, lnk));
+	}
+
+	/*
+	 * Workers can start before all the thread IDs are recorded, but they
+	 * will not look at them before jobs are submitted, i.e. before we return.
+	 */
+
+	for (i = 0; i < workers; i++) {
+		struct tpool_worker *w = &tp->worker[i];
+
+		w->stid = thread_create(tpool_worker_main, w,
+			THREAD_F_NO_CANCEL | THREAD_F_PANIC, TPOOL_STACK);
+	}
+
+	return tp;
+}
+
+/**
+ * Stop all the workers and free the pool.
+ *
+ * All the groups created on the pool must have been freed already.
+ */
+void
+tpool_free_null(tpool_t **tp_ptr)
+{
+	tpool_t *tp = *tp_ptr;
+	uint i;
+
+	if (NULL == tp)
+		return;
+
+	tpool_check(tp);
+
+	atomic_bool_set(&tp->stopping, TRUE);
+	semaphore_release(tp->jobs, tp->workers);
+
+	for (i = 0; i < tp->workers; i++) {
+		struct tpool_worker *w = &tp->worker[i];
+		uint p;
+
+		if (-1 == thread_join(w->stid, NULL)) {
+			s_error("%s(): cannot join with %s: %m",
+				G_STRFUNC, thread_id_name(w->stid));
+		}
+
+		for (p = 0; p < TPOOL_PRIO_COUNT; p++)
+			g_assert(0 == elist_count(&w->queue[p]));
+
+		spinlock_destroy(&w->lock);
+	}
+
+	semaphore_destroy(&tp->jobs);
+	tp->magic = 0;
+	vmm_free(tp, sizeof *tp);
+	*tp_ptr = NULL;
+}
+
+static void
+tpool_default_init(void)
+{
+	tpool_dflt = tpool_make("default", 0);
+}
+
+/**
+ * @return the default pool, created on first use with one worker per CPU,
+ * NULL after tpool_close().
+ */
+tpool_t *
+tpool_default(void)
+{
+	ONCE_FLAG_RUN(tpool_dflt_inited, tpool_default_init);
+
+	return tpool_dflt;
+}
+
+/**
+ * Free the default pool, at shutdown time.
+ */
+void
+tpool_close(void)
+{
+	tpool_free_null(&tpool_dflt);
+}
+
+/**
+ * @return amount of worker threads in the pool.
+ */
+uint
+tpool_workers(const tpool_t *tp)
+{
+	tpool_check(tp);
+
+	return tp->workers;
+}
+
+/**
+ * @return whether the calling thread is one of the workers of the pool,
+ * which must not wait for the completion of jobs of that pool.
+ */
+bool
+tpool_is_worker(const tpool_t *tp)
+{
+	tpool_check(tp);
+
+	return NULL != tpool_worker_self(deconstify_pointer(tp));
+}
+
+/**
+ * Create a new job group.
+ *
+ * @param tp		the pool that will run the jobs
+ * @param prio		the priority of all the jobs of the group
+ * @param done		if non-NULL, called when all the submitted jobs completed
+ * @param arg		additional argument for the ``done'' callback
+ *
+ * @return a new group, to be freed with tpool_group_free_null().
+ */
+tpool_group_t *
+tpool_group_make(tpool_t *tp, tpool_prio_t prio,
+	tpool_done_fn_t done, void *arg)
+{
+	tpool_group_t *tg;
+
+	tpool_check(tp);
+	g_assert(UNSIGNED(prio) < TPOOL_PRIO_COUNT);
+
+	WALLOC0(tg);
+	tg->magic = TPOOL_GROUP_MAGIC;
+	tg->pool = tp;
+	tg->prio = prio;
+	tg->done = done;
+	tg->arg = arg;
+	mutex_init(&tg->lock);
+	tg->completed = COND_INIT;
+
+	return tg;
+}
+
+/**
+ * Cancel the pending jobs of the group, wait for the running ones and
+ * free the group.
+ */
+void
+tpool_group_free_null(tpool_group_t **tg_ptr)
+{
+	tpool_group_t *tg = *tg_ptr;
+
+	if (NULL == tg)
+		return;
+
+	tpool_group_cancel(tg);
+
+	cond_destroy(&tg->completed);
+	mutex_destroy(&tg->lock);
+	tg->magic = 0;
+	WFREE(tg);
+	*tg_ptr = NULL;
+}
+
+/**
+ * Submit ``n'' new jobs to the group: ``fn(data, i)'' will be run for each
+ * ``i'' from 0 to n - 1, in no particular order and possibly concurrently.
+ *
+ * When called from one of the pool workers, the jobs are queued locally,
+ * otherwise they are spread among all the workers.
+ */
+void
+tpool_submit(tpool_group_t *tg, tpool_fn_t fn, void *data, size_t n)
+{
+	tpool_t *tp;
+	struct tpool_worker *self;
+	size_t i;
+
+	tpool_group_check(tg);
+	g_assert(fn != NULL);
+
+	if G_UNLIKELY(0 == n)
+		return;
+
+	tp = tg->pool;
+	tpool_check(tp);
+	g_assert(!tp->stopping);
+
+	TPOOL_GROUP_LOCK(tg);
+	tg->pending += n;
+	TPOOL_GROUP_UNLOCK(tg);
+
+	self = tpool_worker_self(tp);
+
+	for (i = 0; i < n; i++) {
+		struct tpool_job *tj;
+		struct tpool_worker *w;
+
+		WALLOC0(tj);
+		tj->group = tg;
+		tj->fn = fn;
+		tj->data = data;
+		tj->idx = i;
+
+		w = self != NULL ? self :
+			&tp->worker[atomic_uint_inc(&tp->next) % tp->workers];
+
+		TPOOL_WORKER_LOCK(w);
+		elist_append(&w->queue[tg->prio], tj);
+		TPOOL_WORKER_UNLOCK(w);
+	}
+
+	semaphore_release(tp->jobs, n);
+}
+
+/**
+ * @return whether all the jobs submitted to the group have completed.
+ */
+bool
+tpool_group_done(const tpool_group_t *tg)
+{
+	tpool_group_check(tg);
+
+	atomic_mb();
+	return 0 == tg->pending;
+}
+
+/**
+ * Wait until all the jobs submitted to the group have completed.
+ *
+ * This cannot be called from a worker of the pool, which would then wait
+ * for jobs that it is the only one able to run.
+ */
+void
+tpool_group_wait(tpool_group_t *tg)
+{
+	tpool_group_check(tg);
+	g_assert_log(NULL == tpool_worker_self(tg->pool),
+		"%s(): cannot wait from %s", G_STRFUNC, thread_name());
+
+	TPOOL_GROUP_LOCK(tg);
+
+	while (0 != tg->pending)
+		cond_wait(&tg->completed, &tg->lock);
+
+	TPOOL_GROUP_UNLOCK(tg);
+}
+
+/**
+ * Cancel the group: its jobs that did not start yet will never run, and
+ * we wait for the ones currently running.
+ *
+ * The completion callback is no longer invoked once a group is cancelled,
+ * hence the callback and its argument can be safely disposed of when
+ * we return.
+ */
+void
+tpool_group_cancel(tpool_group_t *tg)
+{
+	tpool_group_check(tg);
+
+	TPOOL_GROUP_LOCK(tg);
+	tg->cancelled = TRUE;
+	TPOOL_GROUP_UNLOCK(tg);
+
+	tpool_group_wait(tg);
+}
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2026, gtk-gnutella developers
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Work-stealing thread pool.
+ *
+ * A pool is a fixed set of worker threads running jobs, which are plain
+ * routines given an opaque argument and an index.  Jobs are submitted in
+ * groups: a group is the unit that can be waited for or cancelled, and it
+ * records the priority of all its jobs.
+ *
+ * Each worker has its own queues, one per priority level.  Jobs submitted
+ * by a worker go to its own queues, other submissions are spread among the
+ * workers.  An idle worker steals the oldest jobs from the others, so that
+ * the load balances itself across the CPUs.  Jobs of a higher priority are
+ * always picked before jobs of a lower priority, wherever they are queued.
+ *
+ * Cancelling a group drops its jobs that did not start yet, and waits for
+ * the ones that are running.
+ *
+ * Here is our API:
+ *
+ *		tpool_make()			-- create a new pool
+ *		tpool_free_null()		-- stop workers and free the pool
+ *		tpool_default()			-- the default pool, one worker per CPU
+ *		tpool_close()			-- free the default pool
+ *		tpool_workers()			-- amount of workers in the pool
+ *		tpool_group_make()		-- create a new job group
+ *		tpool_group_free_null()	-- cancel group and free it
+ *		tpool_submit()			-- submit new jobs to the group
+ *		tpool_group_done()		-- whether all jobs of the group completed
+ *		tpool_group_wait()		-- wait until all jobs of the group completed
+ *		tpool_group_cancel()	-- cancel all the pending jobs of the group
+ *
+ * @author gtk-gnutella developers
+ * @date 2026
+ */
+
+#ifndef _tpool_h_
+#define _tpool_h_
+
+/**
+ * Job priorities, from the most urgent to the least urgent.
+ */
+typedef enum {
+	TPOOL_PRIO_HIGH = 0,
+	TPOOL_PRIO_NORMAL,
+	TPOOL_PRIO_LOW,
+
+	TPOOL_PRIO_COUNT
+} tpool_prio_t;
+
+typedef struct tpool tpool_t;
+typedef struct tpool_group tpool_group_t;
+
+/**
+ * A job, run as ``fn(data, idx)'' from one of the worker threads.
+ */
+typedef void (*tpool_fn_t)(void *data, size_t idx);
+
+/**
+ * Called from the worker thread that completed the last job of a group,
+ * unless the group was cancelled.
+ */
+typedef void (*tpool_done_fn_t)(tpool_group_t *tg, void *arg);
+
+/*
+ * Public interface.
+ */
+
+tpool_t *tpool_make(const char *name, uint workers);
+void tpool_free_null(tpool_t **tp_ptr);
+tpool_t *tpool_default(void);
+void tpool_close(void);
+uint tpool_workers(const tpool_t *tp);
+bool tpool_is_worker(const tpool_t *tp);
+
+tpool_group_t *tpool_group_make(tpool_t *tp, tpool_prio_t prio,
+	tpool_done_fn_t done, void *arg);
+void tpool_group_free_null(tpool_group_t **tg_ptr);
+
+void tpool_submit(tpool_group_t *tg, tpool_fn_t fn, void *data, size_t n);
+bool tpool_group_done(const tpool_group_t *tg);
+void tpool_group_wait(tpool_group_t *tg);
+void tpool_group_cancel(tpool_group_t *tg);
+
+#endif /* _tpool_h_ */
+
+/* vi: set ts=4 sw=4 cindent: */
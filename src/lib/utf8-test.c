@@ -0,0 +1,382 @@
+/*
+ * utf8-test -- UTF-8 validation and normalization tests and benchmarking.
+ *
+ * Copyright (c) 2026 gtk-gnutella developers
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the authors nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "common.h"
+
+#include "lib/halloc.h"
+#include "lib/malloc.h"
+#include "lib/misc.h"
+#include "lib/progname.h"
+#include "lib/rand31.h"
+#include "lib/stringify.h"
+#include "lib/tm.h"
+#include "lib/utf8.h"
+#include "lib/xmalloc.h"
+
+#define TEST_RANDOM		1000	/* Default amount of random strings */
+#define TEST_MAXLEN		200		/* Maximum length of random strings */
+
+static bool silent_mode, verbose_mode, chrono;
+static unsigned initial_seed;
+static const char *current_test;
+
+/*
+ * A sample of queries and file names, as seen by the search and sharing
+ * code: mostly ASCII, with some accented Latin and a few other scripts.
+ */
+static const char *corpus[] = {
+	"",
+	"a",
+	"linux",
+	"ubuntu 24.04 desktop amd64.iso",
+	"The_Quick_Brown_Fox-Jumps.Over.The.Lazy.Dog.mp3",
+	"Pink Floyd - The Dark Side of the Moon (1973) [FLAC]",
+	"01 - Shine On You Crazy Diamond (Parts I-V).ogg",
+	"  leading and trailing  spaces  ",
+	"punctuation!!! ??? ... --- +++ ***",
+	"CamelCaseFileName_With_Numbers_0123456789.txt",
+	"line one\nline two\n",
+	"tab\tseparated\tvalues.tsv",
+	"caf\xc3\xa9 cr\xc3\xa8me br\xc3\xbbl\xc3\xa9\x65",
+	"Beyonc\xc3\xa9 - D\xc3\xa9j\xc3\xa0 Vu.mp3",
+	"na\xc3\xafve r\xc3\xa9sum\xc3\xa9.pdf",
+	"Sigur R\xc3\xb3s - \xc3\x81g\xc3\xa6tis byrjun",
+	"e\xcc\x81t\xc3\xa9 (decomposed first e)",
+	"Stra\xc3\x9f\x65 und Gr\xc3\xbc\xc3\x9f\x65",
+	"\xef\xac\x81le \xe2\x84\x96 5 \xc2\xbd",
+	"\xd0\x9c\xd0\xbe\xd1\x81\xd0\xba\xd0\xb2\xd0\xb0 2010.avi",
+	"\xe6\x9d\xb1\xe4\xba\xac \xe3\x82\xbf\xe3\x83\xaf\xe3\x83\xbc.jpg",
+	"\xed\x95\x9c\xea\xb5\xad\xec\x96\xb4 lesson 01.mp4",
+	"\xce\x95\xce\xbb\xce\xbb\xce\xac\xce\xb4\xce\xb1 - \xce\x91\xce\xb8\xce\xae\xce\xbd\xce\xb1",
+	"a very long file name made of plain ASCII words only, as is most often "
+		"the case for shared files, which should go through the fast paths "
+		"in one sweep without ever decoding a single character.avi",
+	"a long ASCII prefix followed by a single accented letter at the very "
+		"end of the string: \xc3\xa9",
+};
+
+/*
+ * Strings which are not valid UTF-8.
+ */
+static const char *invalid[] = {
+	"truncated \xc3",
+	"overlong \xc0\xaf slash",
+	"surrogate \xed\xa0\x80 half",
+	"stray continuation \x80 byte",
+	"plain ASCII then \xff",
+};
+
+static void G_NORETURN
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-htSV] [-c strings] [-n loops] [-R seed]\n"
+		"  -c : sets amount of random strings to test\n"
+		"  -h : prints this help message\n"
+		"  -n : sets amount of benchmarking loops over the corpus\n"
+		"  -t : time each test, with and without the ASCII fast paths\n"
+		"  -R : seed for repeatable random string sequence\n"
+		"  -S : silent mode -- do not print anything for successful tests\n"
+		"  -V : verbose mode -- print status after each successful test\n"
+		, getprogname());
+	exit(EXIT_FAILURE);
+}
+
+static void G_NORETURN
+test_abort(void)
+{
+	if (current_test != NULL)
+		printf("%s - FAILED\n", current_test);
+	printf("use '-R %u' to reproduce problem.\n", initial_seed);
+	abort();
+}
+
+#define test_assert(x) G_STMT_START {			\
+	if G_UNLIKELY(!(x)) {						\
+		printf("assertion \"%s\" failed at %s:%d\n",	\
+			#x, __FILE__, __LINE__);					\
+		test_abort();							\
+	}											\
+} G_STMT_END
+
+static const uni_norm_t norms[] = {
+	UNI_NORM_NFC, UNI_NORM_NFD, UNI_NORM_NFKC, UNI_NORM_NFKD,
+};
+
+/**
+ * Check that the fast paths give the same results as the general code
+ * on the given string.
+ */
+static void
+test_string(const char *s)
+{
+	size_t len = vstrlen(s);
+	bool valid, ascii;
+	char *a, *b;
+	uint i;
+
+	utf8_ascii_fast_path(TRUE);
+	valid = utf8_is_valid_string(s);
+	ascii = is_ascii_string(s);
+	test_assert(utf8_is_valid_data(s, len) == valid);
+
+	utf8_ascii_fast_path(FALSE);
+	test_assert(utf8_is_valid_string(s) == valid);
+	test_assert(utf8_is_valid_data(s, len) == valid);
+	test_assert(is_ascii_string(s) == ascii);
+
+	if (!valid)
+		return;
+
+	for (i = 0; i < N_ITEMS(norms); i++) {
+		utf8_ascii_fast_path(TRUE);
+		a = utf8_normalize(s, norms[i]);
+		utf8_ascii_fast_path(FALSE);
+		b = utf8_normalize(s, norms[i]);
+		test_assert(0 == strcmp(a, b));
+		G_FREE_NULL(a);
+		G_FREE_NULL(b);
+	}
+
+	utf8_ascii_fast_path(TRUE);
+	a = utf8_canonize(s);
+	test_assert(a != s);
+	utf8_ascii_fast_path(FALSE);
+	b = utf8_canonize(s);
+	test_assert(0 == strcmp(a, b));
+	HFREE_NULL(a);
+	HFREE_NULL(b);
+}
+
+/**
+ * Generate a random string: mostly ASCII, with the occasional character
+ * picked from the corpus to get non-ASCII sequences.
+ */
+static char *
+random_string(size_t *offset)
+{
+	size_t len = rand31_value(TEST_MAXLEN), off = rand31_value(15), i;
+	char *buf, *p;
+
+	/* Each character takes at most 4 bytes */
+	buf = xmalloc(off + 4 * len + 1);
+	p = buf + off;
+
+	for (i = 0; i < len; i++) {
+		uint r = rand31_value(99);
+
+		if (r < 3) {
+			const char *c = corpus[12 + rand31_value(N_ITEMS(corpus) - 15)];
+			const char *q = c + rand31_value(vstrlen(c) - 1);
+
+			/* Copy one whole UTF-8 character, skipping partial ones */
+			while (0x80 == (*q & 0xc0))
+				q++;
+			if ('\0' == *q)
+				q = c;
+			do {
+				*p++ = *q++;
+			} while (0x80 == (*q & 0xc0));
+		} else if (r < 10) {
+			*p++ = 1 + rand31_value(0x7e);
+		} else {
+			static const char chars[] = "abcdefghijklmnopqrstuvwxyz"
+				"ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789 ._-";
+			*p++ = chars[rand31_value(CONST_STRLEN(chars) - 1)];
+		}
+	}
+	*p = '\0';
+
+	*offset = off;
+	return buf + off;
+}
+
+static void
+test_corpus(void)
+{
+	uint i;
+
+	current_test = "corpus";
+
+	for (i = 0; i < N_ITEMS(corpus); i++)
+		test_string(corpus[i]);
+	for (i = 0; i < N_ITEMS(invalid); i++) {
+		utf8_ascii_fast_path(TRUE);
+		test_assert(!utf8_is_valid_string(invalid[i]));
+		test_string(invalid[i]);
+	}
+
+	if (verbose_mode)
+		printf("%s - OK\n", current_test);
+}
+
+static void
+test_random(size_t cnt)
+{
+	size_t i;
+
+	current_test = "random";
+
+	for (i = 0; i < cnt; i++) {
+		size_t off;
+		char *s = random_string(&off);
+
+		test_string(s);
+		xfree(s - off);
+	}
+
+	if (verbose_mode)
+		printf("%s - OK (%zu strings)\n", current_test, cnt);
+}
+
+static void
+timeit(const char *what, bool fast, size_t ops, const tm_nano_t *start)
+{
+	tm_nano_t end;
+	double elapsed;
+
+	tm_precise_time(&end);
+	elapsed = tm_precise_elapsed_f(&end, start);
+
+	printf("%-5s - %-16s - %zu op%s, %.3gs, %.1f ns/op\n",
+		fast ? "fast" : "slow", what, ops, plural(ops), elapsed,
+		0 == ops ? 0.0 : elapsed * 1e9 / ops);
+	fflush(stdout);
+}
+
+#define TIMEIT(what, loops, call) G_STMT_START {		\
+	uint f;												\
+	for (f = 0; f < 2; f++) {							\
+		tm_nano_t start;								\
+		size_t l, n;									\
+		utf8_ascii_fast_path(0 == f);					\
+		tm_precise_time(&start);						\
+		for (l = 0; l < loops; l++) {					\
+			for (n = 0; n < N_ITEMS(corpus); n++) {		\
+				const char *s = corpus[n];				\
+				call;									\
+			}											\
+		}												\
+		timeit(what, 0 == f, loops * N_ITEMS(corpus), &start);	\
+	}													\
+} G_STMT_END
+
+static void
+benchmark(size_t loops)
+{
+	static size_t lengths[N_ITEMS(corpus)];
+	static volatile size_t sink;
+	uint i;
+
+	for (i = 0; i < N_ITEMS(corpus); i++)
+		lengths[i] = vstrlen(corpus[i]);
+
+	TIMEIT("valid_string", loops, sink += utf8_is_valid_string(s));
+	TIMEIT("valid_data", loops, sink += utf8_is_valid_data(s, lengths[n]));
+	TIMEIT("is_ascii", loops, sink += is_ascii_string(s));
+	TIMEIT("normalize NFC", loops, {
+		char *r = utf8_normalize(s, UNI_NORM_NFC);
+		G_FREE_NULL(r);
+	});
+	TIMEIT("normalize NFKD", loops, {
+		char *r = utf8_normalize(s, UNI_NORM_NFKD);
+		G_FREE_NULL(r);
+	});
+	TIMEIT("canonize", loops, {
+		char *r = utf8_canonize(s);
+		HFREE_NULL(r);
+	});
+
+	utf8_ascii_fast_path(TRUE);
+}
+
+int
+main(int argc, char **argv)
+{
+	extern int optind;
+	extern char *optarg;
+	size_t count = TEST_RANDOM;
+	size_t loops = 10000;
+	unsigned rseed = 0;
+	int c;
+	const char options[] = "c:hn:tR:SV";
+
+	progstart(argc, argv);
+
+	while ((c = getopt(argc, argv, options)) != EOF) {
+		switch (c) {
+		case 'c':			/* amount of random strings */
+			count = atol(optarg);
+			break;
+		case 'n':			/* amount of benchmarking loops */
+			loops = atol(optarg);
+			break;
+		case 't':			/* timing report */
+			chrono = TRUE;
+			break;
+		case 'R':			/* randomize in a repeatable way */
+			rseed = atoi(optarg);
+			break;
+		case 'S':			/* silent mode */
+			silent_mode = TRUE;
+			break;
+		case 'V':			/* verbose mode */
+			verbose_mode = TRUE;
+			break;
+		case 'h':			/* show help */
+		default:
+			usage();
+			break;
+		}
+	}
+
+	if ((argc -= optind) != 0)
+		usage();
+
+	rand31_set_seed(rseed);
+	initial_seed = rand31_current_seed();
+
+	locale_init();
+
+	test_corpus();
+	test_random(count);
+
+	if (chrono)
+		benchmark(loops);
+
+	if (!silent_mode)
+		printf("All tests passed.\n");
+
+	return 0;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -74,7 +74,9 @@
 #include "htable.h"
 #include "mempcpy.h"
 #include "misc.h"
+#include "op.h"
 #include "path.h"
+#include "pow2.h"
 #include "pslist.h"
 #include "random.h"
 #include "str.h"
@@ -82,6 +84,10 @@
 #include "unsigned.h"
 #include "walloc.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "override.h"		/* Must be the last header included */
 
 /**
@@ -105,6 +111,7 @@ ui_uses_utf8_encoding(void)
 }
 
 static void unicode_compose_init(void);
+static void utf8_canon_ascii_init(void);
 
 static bool unicode_compose_init_passed;
 static bool locale_init_passed;
@@ -124,6 +131,9 @@ static bool use_icu = FALSE;
 /** Used by is_latin_locale(). It is initialized by locale_init(). */
 static bool latin_locale = FALSE;
 
+/** Whether to take the ASCII fast paths, see utf8_ascii_fast_path(). */
+static bool utf8_fast = TRUE;
+
 #if 0  /*  xxxUSE_ICU */
 static UConverter *conv_icu_locale = NULL;
 static UConverter *conv_icu_utf8 = NULL;
@@ -382,6 +392,119 @@ static const uint8 utf8len_mark[] = {
 #define UNICODE_IS_ILLEGAL(x) \
 	((x) > 0x10FFFFU || (UNI_ILLEGAL & (x)) == UNI_ILLEGAL)
 
+/*
+ * Most of the strings we validate and normalize (queries, file names) are
+ * pure ASCII or mostly so.  The following routines skip over ASCII runs
+ * a memory word, or an SSE2 vector, at a time so that only the non-ASCII
+ * parts need to be decoded.
+ */
+
+#define UTF8_ONEMASK		((op_t) -1 / 0xff)	/* 0x01010101 on 32-bit */
+#define UTF8_HIGHMASK		(UTF8_ONEMASK * 0x80)	/* 0x80808080 on 32-bit */
+#define UTF8_HAS_NUL(x)		(((x) - UTF8_ONEMASK) & ~(x) & UTF8_HIGHMASK)
+
+/**
+ * Compute the length of the leading ASCII run of a buffer.
+ *
+ * @param s		the start of the buffer
+ * @param len	the length of the buffer
+ *
+ * @return the amount of leading bytes that are ASCII (NUL included).
+ */
+static inline size_t
+utf8_ascii_span(const char *s, size_t len)
+{
+	const char *p = s, *end = s + len;
+
+#ifdef __SSE2__
+	while (ptr_diff(end, p) >= sizeof(__m128i)) {
+		uint m = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) p));
+		if (m != 0)
+			return ptr_diff(p, s) + ctz(m);
+		p += sizeof(__m128i);
+	}
+#else
+	while (ptr_diff(end, p) >= OPSIZ) {
+		op_t w;
+		memcpy(&w, p, OPSIZ);
+		if (w & UTF8_HIGHMASK)
+			break;
+		p += OPSIZ;
+	}
+#endif	/* __SSE2__ */
+
+	while (p != end && UTF8_IS_ASCII(*p))
+		p++;
+
+	return ptr_diff(p, s);
+}
+
+/**
+ * Skip the leading ASCII run of a NUL-terminated string.
+ *
+ * This reads aligned memory past the end of the string, but never across
+ * a page boundary since loads are aligned on their size.
+ *
+ * @param s		a NUL-terminated string
+ *
+ * @return a pointer to the first byte of `s' which is either NUL or non-ASCII.
+ */
+static inline const char *
+utf8_ascii_skip(const char *s)
+{
+	const char *p = s;
+
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128();
+	size_t off = pointer_to_ulong(p) & (sizeof(__m128i) - 1);
+	__m128i v;
+	uint m;
+
+	p -= off;
+	v = _mm_load_si128((const __m128i *) p);
+	m = _mm_movemask_epi8(v) | _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+	m &= ~0U << off;
+
+	while (0 == m) {
+		p += sizeof(__m128i);
+		v = _mm_load_si128((const __m128i *) p);
+		m = _mm_movemask_epi8(v) | _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+	}
+
+	return p + ctz(m);
+#else
+	while (!op_aligned(p)) {
+		if ('\0' == *p || !UTF8_IS_ASCII(*p))
+			return p;
+		p++;
+	}
+
+	for (;;) {
+		op_t w = *(const op_t *) p;
+		if ((w & UTF8_HIGHMASK) || UTF8_HAS_NUL(w))
+			break;
+		p += OPSIZ;
+	}
+
+	while ('\0' != *p && UTF8_IS_ASCII(*p))
+		p++;
+
+	return p;
+#endif	/* __SSE2__ */
+}
+
+/**
+ * Enable or disable the ASCII fast paths in validation and normalization.
+ *
+ * The results are identical either way: this is only meant to allow
+ * benchmarking and regression testing of the fast paths.
+ */
+void
+utf8_ascii_fast_path(bool on)
+{
+	utf8_fast = booleanize(on);
+}
+
 /**
  * Determines the UTF-8 byte length for the given Unicode codepoint.
  *
@@ -985,6 +1108,11 @@ utf8_is_valid_string(const char *src)
 	uint clen;
 
 	for (s = src; '\0' != *s; s += clen) {
+		if (utf8_fast && UTF8_IS_ASCII(*s)) {
+			s = utf8_ascii_skip(s);
+			if ('\0' == *s)
+				break;
+		}
 		if (0 == (clen = utf8_char_len(s)))
 			return FALSE;
 	}
@@ -1004,6 +1132,14 @@ utf8_is_valid_data(const char *src, size_t len)
 	while (len > 0) {
 		size_t clen;
 
+		if (utf8_fast && UTF8_IS_ASCII(*src)) {
+			clen = utf8_ascii_span(src, len);
+			len -= clen;
+			src += clen;
+			if (0 == len)
+				break;
+		}
+
 		clen = utf8_skip(*src);
 		if (clen > len || 0 == utf8_char_len(src))
 			break;
@@ -2010,6 +2146,7 @@ locale_init(void)
 
 	conversion_init();
 	unicode_compose_init();
+	utf8_canon_ascii_init();
 
 #if 0 && !defined(OFFICIAL_BUILD)
 	utf8_regression_checks();
@@ -2659,6 +2796,9 @@ charset_to_utf8(const char *cs, const char *src, size_t src_len)
 bool
 is_ascii_string(const char *s)
 {
+	if (utf8_fast)
+		s = utf8_ascii_skip(s);
+
 	while (IS_NON_NUL_ASCII(s))
 		++s;
 
@@ -4305,6 +4445,22 @@ utf8_decompose(const char *src, char *out, size_t size, bool nfkd)
 			char buf[256], utf8_buf[4], *q;
 			size_t utf8_len;
 
+			/*
+			 * ASCII characters have no decomposition: copy whole runs.
+			 */
+
+			if (utf8_fast && UTF8_IS_ASCII(*src)) {
+				size_t n = ptr_diff(utf8_ascii_skip(src), src);
+				size_t room = size - new_len;
+
+				n = MIN(n, room);
+				dst = mempcpy(dst, src, n);
+				src += n;
+				new_len += n;
+				if (n == room || '\0' == *src)
+					break;
+			}
+
 			uc = utf8_decode_char_fast(src, &retlen);
 			if (uc == 0x0000)
 				break;
@@ -4338,6 +4494,15 @@ utf8_decompose(const char *src, char *out, size_t size, bool nfkd)
 	}
 
 	while (*src != '\0') {
+		if (utf8_fast && UTF8_IS_ASCII(*src)) {
+			const char *s = utf8_ascii_skip(src);
+
+			new_len += ptr_diff(s, src);
+			src = s;
+			if ('\0' == *src)
+				break;
+		}
+
 		uc = utf8_decode_char_fast(src, &retlen);
 		if (uc == 0x0000)
 			break;
@@ -5561,6 +5726,109 @@ utf32_normalize(const uint32 *src, uni_norm_t norm)
 	return NULL;
 }
 
+/**
+ * Compute the length of the leading part of an UTF-8 string which is
+ * left unchanged by the given normalization.
+ *
+ * All the code points below the limit used here are starters which do
+ * not decompose in the requested form, hence are stable under NFD or NFKD.
+ * For NFC and NFKC, the last of them may still compose with the following
+ * character, so it is left out of the stable prefix.
+ *
+ * @param src the string to normalize, must be valid UTF-8.
+ * @param norm one of UNI_NORM_NFC, UNI_NORM_NFD, UNI_NORM_NFKC, UNI_NORM_NFKD.
+ *
+ * @return the length in bytes of the stable prefix, which is the length
+ * of the whole string when it is already normalized.
+ */
+static size_t
+utf8_normalize_stable(const char *src, uni_norm_t norm)
+{
+	const char *s = src, *last = src;
+	uint32 limit = 0;
+	bool compose = FALSE;
+
+	switch (norm) {
+	case UNI_NORM_NFC:
+		compose = TRUE;
+		limit = 0x0300;		/* Combining diacritical marks */
+		break;
+	case UNI_NORM_NFKC:
+		compose = TRUE;
+		/* FALLTHRU */
+	case UNI_NORM_NFKD:
+		limit = 0x00A0;		/* No-break space, first compatibility mapping */
+		break;
+	case UNI_NORM_NFD:
+		limit = 0x00C0;		/* First Latin-1 letter with a decomposition */
+		break;
+	case NUM_UNI_NORM:
+		g_assert_not_reached();
+	}
+
+	for (;;) {
+		uint32 uc;
+		uint retlen;
+
+		if (UTF8_IS_ASCII(*s)) {
+			const char *e = utf8_ascii_skip(s);
+
+			if ('\0' == *e)
+				return ptr_diff(e, src);
+			if (e != s) {
+				last = e - 1;
+				s = e;
+			}
+		}
+
+		uc = utf8_decode_char_fast(s, &retlen);
+		if (uc >= limit || 0 == uc)
+			break;
+		last = s;
+		s += retlen;
+	}
+
+	return ptr_diff(compose ? last : s, src);
+}
+
+/**
+ * Normalizes an UTF-8 string through its UTF-32 conversion.
+ *
+ * @param src the string to normalize, must be valid UTF-8.
+ * @param norm one of UNI_NORM_NFC, UNI_NORM_NFD, UNI_NORM_NFKC, UNI_NORM_NFKD.
+ *
+ * @return a newly allocated string
+ */
+static char *
+utf8_normalize_full(const char *src, uni_norm_t norm)
+{
+	uint32 *dst32;
+	size_t n;
+	uint32 buf[1024];
+	uint32 *s;
+
+	n = utf8_to_utf32(src, buf, N_ITEMS(buf));
+	if (n < N_ITEMS(buf)) {
+		s = buf;
+	} else {
+		size_t size = n + 1;
+
+		s = g_malloc(size * sizeof *s);
+		n = utf8_to_utf32(src, s, size);
+		g_assert(size - 1 == n);
+	}
+
+	dst32 = utf32_normalize(s, norm);
+
+	g_assert(dst32 != s);
+	if (s != buf) {
+		G_FREE_NULL(s);
+	}
+
+	(void) utf32_to_utf8_inplace(dst32);
+	return cast_to_char_ptr(dst32);
+}
+
 /**
  * Normalizes an UTF-8 string to the request normal form and returns
  * it as a newly allocated string.
@@ -5573,43 +5841,39 @@ utf32_normalize(const uint32 *src, uni_norm_t norm)
 char *
 utf8_normalize(const char *src, uni_norm_t norm)
 {
-	uint32 *dst32;
-
 	g_assert(src);
 	g_assert(utf8_is_valid_string(src));
 	g_assert(UNSIGNED(norm) < NUM_UNI_NORM);
 
-	if (is_ascii_string(src)) {
-		/*
-		 * Optimize this later and return the original src pointer.
-		 */
-		return g_strdup(src);
-	} else {
-		size_t n;
-		uint32 buf[1024];
-		uint32 *s;
-
-		n = utf8_to_utf32(src, buf, N_ITEMS(buf));
-		if (n < N_ITEMS(buf)) {
-			s = buf;
-		} else {
-			size_t size = n + 1;
+	if (utf8_fast) {
+		size_t n = utf8_normalize_stable(src, norm);
 
-			s = g_malloc(size * sizeof *s);
-			n = utf8_to_utf32(src, s, size);
-			g_assert(size - 1 == n);
-		}
+		if ('\0' == src[n])
+			return g_strdup(src);
 
-		dst32 = utf32_normalize(s, norm);
+		/*
+		 * Only normalize what follows the stable prefix, which is then
+		 * copied verbatim in front of the result.
+		 */
 
-		g_assert(dst32 != s);
-		if (s != buf) {
-			G_FREE_NULL(s);
+		if (n != 0) {
+			char *tail, *dst, *p;
+			size_t len;
+
+			tail = utf8_normalize_full(src + n, norm);
+			len = vstrlen(tail);
+			dst = g_malloc(n + len + 1);
+			p = mempcpy(dst, src, n);
+			p = mempcpy(p, tail, len);
+			*p = '\0';
+			G_FREE_NULL(tail);
+			return dst;
 		}
+	} else if (is_ascii_string(src)) {
+		return g_strdup(src);
 	}
 
-	(void) utf32_to_utf8_inplace(dst32);
-	return cast_to_char_ptr(dst32);
+	return utf8_normalize_full(src, norm);
 }
 
 /**
@@ -5672,6 +5936,116 @@ utf32_canonize(const uint32 *src0)
 	return dst;
 }
 
+/*
+ * For pure ASCII strings, utf32_canonize() boils down to case folding and
+ * filtering, both of which are per-character operations save for the
+ * handling of spaces.  The following table caches the outcome for each
+ * ASCII character, as computed by utf8_canon_ascii_init().
+ */
+
+enum utf8_canon_class {
+	UTF8_CANON_DROP = 0,	/* Character is removed */
+	UTF8_CANON_KEEP,		/* Folded character is kept, clears space state */
+	UTF8_CANON_PASS,		/* Folded character is kept, space state intact */
+	UTF8_CANON_SPACE		/* Replaced by a single space, unless trailing */
+};
+
+static struct utf8_canon_ascii {
+	uint8 c;				/* Folded character */
+	uint8 class;			/* An enum utf8_canon_class value */
+} utf8_canon_ascii[128];
+
+static bool utf8_canon_ascii_ok;	/* Whether table is valid */
+
+/**
+ * Build the utf8_canon_ascii[] table, checking that the per-character
+ * outcome of utf32_canonize() can be fully described by the table.
+ * Otherwise, the table is left unused and canonization always takes
+ * the general path.
+ */
+static void G_COLD
+utf8_canon_ascii_init(void)
+{
+	uint i, block = utf32_block_id(0x0001);
+
+	for (i = 1; i < N_ITEMS(utf8_canon_ascii); i++) {
+		struct utf8_canon_ascii *ca = &utf8_canon_ascii[i];
+		uint32 uc, c0, c1, c2;
+		const uint32 *d;
+		size_t d_len;
+		bool s0 = FALSE, s1 = TRUE, s2 = FALSE;
+
+		if (1 != utf32_case_fold_char(i, &uc, 1) || !UNICODE_IS_ASCII(uc))
+			return;
+
+		d = utf32_decompose_char(uc, &d_len, TRUE);
+		if (1 != d_len || d[0] != uc)
+			return;
+
+		if (utf32_block_id(uc) != block || utf32_block_id(i) != block)
+			return;
+
+		c0 = utf32_filter_char(uc, &s0, FALSE);
+		c1 = utf32_filter_char(uc, &s1, FALSE);
+		c2 = utf32_filter_char(uc, &s2, TRUE);
+
+		ca->c = uc;
+
+		if (uc == c0 && uc == c1 && uc == c2 && !s0 && !s1 && !s2)
+			ca->class = UTF8_CANON_KEEP;
+		else if (uc == c0 && uc == c1 && uc == c2 && !s0 && s1 && !s2)
+			ca->class = UTF8_CANON_PASS;
+		else if (0 == c0 && 0 == c1 && 0 == c2 && !s0 && s1 && !s2)
+			ca->class = UTF8_CANON_DROP;
+		else if (0x20 == c0 && 0 == c1 && 0 == c2 && s0 && s1 && s2)
+			ca->class = UTF8_CANON_SPACE;
+		else
+			return;
+	}
+
+	utf8_canon_ascii_ok = TRUE;
+}
+
+/**
+ * Canonize a pure ASCII string using the utf8_canon_ascii[] table.
+ *
+ * @return the canonized string, which is halloc()-ed.
+ */
+static char *
+utf8_canonize_ascii(const char *src, size_t len)
+{
+	const char *s;
+	char *dst, *p;
+	bool space = TRUE;		/* Prevents leading space */
+
+	p = dst = halloc(len + 1);
+
+	for (s = src; '\0' != *s; s++) {
+		const struct utf8_canon_ascii *ca = &utf8_canon_ascii[CHAR(*s)];
+
+		switch (ca->class) {
+		case UTF8_CANON_KEEP:
+			space = FALSE;
+			/* FALLTHRU */
+		case UTF8_CANON_PASS:
+			*p++ = ca->c;
+			break;
+		case UTF8_CANON_SPACE:
+			if (!space && '\0' != s[1])
+				*p++ = ' ';
+			space = TRUE;
+			break;
+		case UTF8_CANON_DROP:
+			break;
+		}
+	}
+	*p = '\0';
+
+	g_assert(ptr_diff(p, dst) <= len);
+
+	return dst;
+}
+
 /**
  * Apply the NFKD/NFC algo to have nomalized keywords (string is halloc()-ed)
  */
@@ -5682,6 +6056,13 @@ utf8_canonize(const char *src)
 
 	g_assert(utf8_is_valid_string(src));
 
+	if (utf8_fast && utf8_canon_ascii_ok) {
+		const char *end = utf8_ascii_skip(src);
+
+		if ('\0' == *end)
+			return utf8_canonize_ascii(src, ptr_diff(end, src));
+	}
+
 	{
 		size_t n;
 		uint32 buf[1024];
@@ -88,6 +88,7 @@ char *utf8_strupper_copy(const char *src);
 char *utf8_canonize(const char *src);
 char *utf8_normalize(const char *src, uni_norm_t norm);
 bool utf8_is_decomposed(const char *src, bool nfkd);
+void utf8_ascii_fast_path(bool on);
 uint NON_NULL_PARAM((2)) utf8_encode_char(uint32 uc, char *buf, size_t size);
 uint32 utf8_decode_char_buffer(const char *s, size_t len, uint *retlen)
 	NON_NULL_PARAM((1,3));
@@ -205,6 +205,8 @@ static unsigned kernel_pageshift = 0;
 static bool kernel_mapaddr_increasing;
 static once_flag_t vmm_early_inited;
 static once_flag_t vmm_inited;
+static once_flag_t vmm_huge_inited;
+static bool vmm_huge_available;
 static bool vmm_fully_inited;
 static bool vmm_crashing;
 static int vmm_oom_detected;
@@ -218,6 +220,9 @@ static int vmm_oom_detected;
 #define VMM_FOREIGN_MAXLEN	(512 * 1024)	/**< 512 KiB */
 #define VMM_WARN_THRESH		512	/**< Pages, 2 MiB with 4K pages */
 #define VMM_MOVE_THRESH		16	/**< Pages, user threshold if within region! */
+#define VMM_HUGE_SHIFT		21	/**< Huge pages are 2 MiB */
+#define VMM_HUGE_SIZE		(1UL << VMM_HUGE_SHIFT)
+#define VMM_HUGE_MASK		(VMM_HUGE_SIZE - 1)
 
 #define PMAP_FOREIGN_TRY	512	/**< Amount of foreign pages we try to allocate */
 
@@ -373,6 +378,12 @@ static struct vmm_stats {
 	size_t user_blocks;				/**< Amount of "user" memory blocks */
 	size_t core_memory;				/**< Amount of "core" memory allocated */
 	size_t core_pages;				/**< Amount of "core" memory pages used */
+	uint64 huge_allocations;		/**< Huge page class allocations */
+	uint64 huge_freeings;			/**< Huge page class freeings */
+	uint64 huge_fallbacks;			/**< Huge class served by regular pages */
+	AU64(huge_advise_failed);		/**< Failed MADV_HUGEPAGE requests */
+	size_t huge_memory;				/**< Memory in huge page class regions */
+	size_t huge_blocks;				/**< Amount of huge page class regions */
 	/* Tracking core blocks doesn't make sense: "core" can be fragmented */
 	memusage_t *user_mem;			/**< User memory usage statistics */
 	memusage_t *core_mem;			/**< Core usage statistics */
@@ -1339,6 +1350,71 @@ vmm_first_hole(const void **unused, bool discard)
 }
 #endif	/* HAS_MMAP || MINGW32 */
 
+/**
+ * Allocate anonymous memory aligned on a huge page boundary, advising the
+ * kernel to back it with huge pages.
+ *
+ * When compiled with VMM_HUGETLB, explicit huge pages are attempted first
+ * for sizes that are a multiple of the huge page size.  These must have
+ * been reserved by the administrator, hence we fall back to transparent
+ * huge pages when none are available.
+ *
+ * @param size		the size of the region, a multiple of the page size
+ *
+ * @return the start of the region, NULL if we cannot allocate memory.
+ */
+static void *
+vmm_valloc_huge(size_t size)
+#if defined(HAS_MMAP) && !defined(MINGW32)
+{
+	size_t len = size + VMM_HUGE_SIZE - kernel_pagesize;
+	size_t head, tail;
+	void *p, *start;
+
+#if defined(VMM_HUGETLB) && defined(MAP_HUGETLB) && defined(MAP_ANONYMOUS)
+	if (0 == (size & VMM_HUGE_MASK)) {
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+		if (p != MAP_FAILED)
+			return p;
+	}
+#endif	/* VMM_HUGETLB && MAP_HUGETLB */
+
+	/*
+	 * Over-allocate so that we can find an aligned region within the
+	 * mapping, then release the unaligned head and tail.
+	 */
+
+	p = vmm_valloc(NULL, len);
+
+	if G_UNLIKELY(MAP_FAILED == p)
+		return NULL;
+
+	start = ulong_to_pointer(
+		(pointer_to_ulong(p) + VMM_HUGE_MASK) & ~(ulong) VMM_HUGE_MASK);
+	head = ptr_diff(start, p);
+	tail = len - head - size;
+
+	if (head != 0)
+		vmm_free_fragment(G_STRFUNC, p, head);
+	if (tail != 0)
+		vmm_free_fragment(G_STRFUNC, ptr_add_offset(start, size), tail);
+
+#if defined(HAS_MADVISE) && defined(MADV_HUGEPAGE)
+	if G_UNLIKELY(0 != madvise(start, size, MADV_HUGEPAGE))
+		VMM_STATS_INCX(huge_advise_failed);
+#endif	/* MADV_HUGEPAGE */
+
+	return start;
+}
+#else	/* !HAS_MMAP || MINGW32 */
+{
+	(void) size;
+	return NULL;
+}
+#endif	/* HAS_MMAP && !MINGW32 */
+
 static inline void
 vmm_set_stop_freeing(bool val)
 {
@@ -5562,6 +5638,259 @@ vmm_core_free(void *p, size_t size)
 	vmm_free_internal(p, size, FALSE);
 }
 
+/**
+ * Determine whether huge pages can be requested from the kernel.
+ */
+static void
+vmm_huge_init_once(void)
+{
+	bool available = FALSE;
+
+	if G_UNLIKELY(0 == kernel_pagesize)
+		vmm_init();
+
+	if (kernel_pagesize > VMM_HUGE_SIZE || !IS_POWER_OF_2(kernel_pagesize))
+		goto done;
+
+#if defined(VMM_HUGETLB) && defined(MAP_HUGETLB)
+	available = TRUE;
+#elif defined(HAS_MMAP) && defined(HAS_MADVISE) && defined(MADV_HUGEPAGE)
+	{
+		char buf[128];
+		ssize_t r;
+		int fd;
+
+		/*
+		 * Transparent huge pages can be configured as "always", "madvise"
+		 * or "never", the current mode being enclosed within brackets.
+		 */
+
+		fd = open("/sys/kernel/mm/transparent_hugepage/enabled", O_RDONLY);
+		if (-1 == fd)
+			goto done;
+
+		r = read(fd, buf, sizeof buf - 1);
+		fd_close(&fd);
+
+		if (r > 0) {
+			buf[r] = '\0';
+			available = NULL == strstr(buf, "[never]");
+		}
+	}
+#endif	/* VMM_HUGETLB && MAP_HUGETLB */
+
+done:
+	vmm_huge_available = available;
+
+	if (vmm_debugging(0)) {
+		s_minidbg("VMM huge pages are %savailable",
+			available ? "" : "not ");
+	}
+}
+
+/**
+ * Fetch the amount of anonymous memory that the kernel backs with huge pages
+ * for the whole process.
+ *
+ * @param backed	where the amount of bytes is written
+ *
+ * @return TRUE if we could get the information.
+ */
+static bool
+vmm_huge_kernel_backed(size_t *backed)
+{
+#ifdef HAS_MMAP
+	static const char tag[] = "AnonHugePages:";
+	char buf[2048];
+	const char *p, *end;
+	ssize_t r;
+	size_t kib;
+	int fd, error;
+
+	fd = open("/proc/self/smaps_rollup", O_RDONLY);
+	if (-1 == fd)
+		return FALSE;
+
+	r = read(fd, buf, sizeof buf - 1);
+	fd_close(&fd);
+
+	if (r <= 0)
+		return FALSE;
+
+	buf[r] = '\0';
+	p = strstr(buf, tag);
+	if (NULL == p)
+		return FALSE;
+
+	p = skip_ascii_blanks(p + CONST_STRLEN(tag));
+	kib = parse_size(p, &end, 10, &error);
+	if (error != 0)
+		return FALSE;
+
+	*backed = kib * 1024;
+	return TRUE;
+#else
+	(void) backed;
+	return FALSE;
+#endif	/* HAS_MMAP */
+}
+
+/**
+ * Check whether a region of given size is allocated in the huge page class
+ * by vmm_alloc_huge().
+ *
+ * Regions in that class must not be moved or resized.
+ *
+ * @param size		the region size
+ *
+ * @return TRUE if vmm_alloc_huge() would use the huge page class.
+ */
+bool
+vmm_huge_size(size_t size)
+{
+	ONCE_FLAG_RUN(vmm_huge_inited, vmm_huge_init_once);
+
+	return vmm_huge_available && size >= VMM_HUGE_SIZE;
+}
+
+/**
+ * Whether region starts on a huge page boundary.
+ */
+static inline bool
+vmm_huge_aligned(const void *p)
+{
+	return 0 == (pointer_to_ulong(p) & VMM_HUGE_MASK);
+}
+
+/**
+ * Allocate "user" memory, backed by huge pages when possible.
+ *
+ * This is meant for large and hot data structures, whose random accesses
+ * cause TLB misses when backed by regular pages: regions of at least the
+ * huge page size are aligned on a huge page boundary and the kernel is
+ * advised to use huge pages for them.  Smaller regions, or all regions if
+ * the kernel cannot provide huge pages, are allocated via vmm_alloc().
+ *
+ * Regions of the huge page class bypass the page cache and the thread
+ * magazines, they are always mapped from and returned to the kernel.
+ * They cannot be moved, shrunk or resized.
+ *
+ * The returned memory is zeroed.
+ *
+ * @param size		the amount of bytes to allocate
+ *
+ * @return a region to be freed with vmm_free_huge().
+ */
+void *
+vmm_alloc_huge(size_t size)
+{
+	struct pmap *pm = vmm_pmap();
+	size_t n;
+	void *p;
+
+	if (!vmm_huge_size(size))
+		return vmm_alloc0(size);
+
+	size = round_pagesize_fast(size);
+	n = pagecount_fast(size);
+
+	if G_UNLIKELY(vmm_crashing)
+		return vmm_crashing_alloc(size, TRUE);
+
+	p = vmm_valloc_huge(size);
+
+	if G_UNLIKELY(NULL == p) {
+		/* Let the regular path handle memory shortage */
+		p = alloc_pages(size, TRUE);
+
+		if G_UNLIKELY(NULL == p) {
+			crash_oom("%s(): cannot allocate %'zu bytes: "
+				"out of virtual memory", G_STRFUNC, size);
+		}
+	} else {
+		rwlock_wlock(&pm->lock);
+		pmap_overrule(pm, p, size, VMF_NATIVE);
+		page_allocated(pm, p, size, TRUE);
+		rwlock_wunlock(&pm->lock);
+	}
+
+	vmm_rawdebug("%s(%zu): [K] p=%p", G_STRFUNC, size, p);
+	assert_vmm_is_allocated(p, size, VMF_NATIVE, FALSE);
+
+	/*
+	 * We cannot remember which regions were allocated in the huge page
+	 * class, hence we account them by alignment.  A regular fallback region
+	 * could happen to be aligned, which only distorts the statistics.
+	 */
+
+	VMM_STATS_LOCK;
+	vmm_stats.alloc_direct_core++;
+	vmm_stats.alloc_direct_core_pages += n;
+	update_allocation_stats(size, n, TRUE, FALSE);
+	if (vmm_huge_aligned(p)) {
+		vmm_stats.huge_allocations++;
+		vmm_stats.huge_memory += size;
+		vmm_stats.huge_blocks++;
+	} else {
+		vmm_stats.huge_fallbacks++;
+	}
+	VMM_STATS_UNLOCK;
+
+	return p;
+}
+
+/**
+ * Free memory allocated via vmm_alloc_huge().
+ *
+ * @param p			the start of the region
+ * @param size		the size that was requested at allocation time
+ */
+void
+vmm_free_huge(void *p, size_t size)
+{
+	size_t n;
+
+	if (!vmm_huge_size(size)) {
+		vmm_free(p, size);
+		return;
+	}
+
+	g_assert(p != NULL);
+	g_assert(page_start(p) == p);
+
+	if G_UNLIKELY(vmm_crashing)
+		return;
+
+	size = round_pagesize_fast(size);
+	n = pagecount_fast(size);
+
+	vmm_rawdebug("%s(%zu): p=%p", G_STRFUNC, size, p);
+	assert_pmap_allocated(p, size, VMF_NATIVE);
+	assert_not_cached(G_STRFUNC, p, size);
+
+	free_pages(p, size, TRUE);
+
+	VMM_STATS_LOCK;
+	vmm_stats.free_to_system++;
+	vmm_stats.free_to_system_pages += n;
+	vmm_stats.freeings++;
+	vmm_stats.freeings_user++;
+	vmm_stats.user_memory -= size;
+	vmm_stats.user_pages -= n;
+	vmm_stats.user_blocks--;
+	g_assert(size_is_non_negative(vmm_stats.user_pages));
+	g_assert(size_is_non_negative(vmm_stats.user_memory));
+	if (vmm_huge_aligned(p)) {
+		vmm_stats.huge_freeings++;
+		vmm_stats.huge_memory -= size;
+		vmm_stats.huge_blocks--;
+		g_assert(size_is_non_negative(vmm_stats.huge_memory));
+	}
+	VMM_STATS_UNLOCK;
+
+	memusage_remove(vmm_stats.user_mem, size);
+}
+
 /**
  * Shrink allocated space via vmm_alloc() or vmm_core_alloc() down to
  * specified size.
@@ -6232,6 +6561,10 @@ vmm_dump_stats_log(logagent_t *la, unsigned options)
 	DUMP64(cache_splits);
 	DUMP64(cache_high_coalescing);
 	DUMP64(cache_too_large);
+	DUMP(huge_allocations);
+	DUMP(huge_freeings);
+	DUMP(huge_fallbacks);
+	DUMP64(huge_advise_failed);
 
 	/*
 	 * Count cached entries -- this is a transient value, so no need to
@@ -6300,6 +6633,8 @@ vmm_dump_stats_log(logagent_t *la, unsigned options)
 	DUMP(user_blocks);
 	DUMP(core_memory);
 	DUMP(core_pages);
+	DUMP(huge_memory);
+	DUMP(huge_blocks);
 
 #undef DUMP
 
@@ -6349,6 +6684,22 @@ vmm_dump_stats_log(logagent_t *la, unsigned options)
 	DUMP("computed_native_pages",
 		cached_pages + stats.user_pages + stats.core_pages + local_pmap.pages);
 
+	/*
+	 * Huge page coverage: fraction of user memory that lies in the huge
+	 * page class, and how much anonymous memory the kernel actually backs
+	 * with huge pages, for the whole process.
+	 */
+
+	log_info(la, "VMM huge_coverage = %.2f%%", 0 == stats.user_memory ? 0.0 :
+		100.0 * (double) stats.huge_memory / (double) stats.user_memory);
+
+	{
+		size_t backed;
+
+		if (vmm_huge_kernel_backed(&backed))
+			DUMP("huge_kernel_backed", backed);
+	}
+
 	DUMP64(vmm_stats_digest);
 
 #undef DUMP64
@@ -169,6 +169,10 @@ void vmm_madvise_normal(void *p, size_t size);
 void vmm_madvise_sequential(void *p, size_t size);
 void vmm_madvise_willneed(void *p, size_t size);
 
+void *vmm_alloc_huge(size_t size) G_MALLOC G_NON_NULL;
+void vmm_free_huge(void *p, size_t size);
+bool vmm_huge_size(size_t size);
+
 void *vmm_mmap(void *addr, size_t length,
 	int prot, int flags, int fd, fileoffset_t offset);
 int vmm_munmap(void *addr, size_t length);
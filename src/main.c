@@ -45,6 +45,7 @@
 #include "core/bsched.h"
 #include "core/clock.h"
 #include "core/ctl.h"
+#include "core/deflate_dict.h"
 #include "core/dh.h"
 #include "core/dmesh.h"
 #include "core/downloads.h"
@@ -73,9 +74,11 @@
 #include "core/http.h"
 #include "core/ignore.h"
 #include "core/inet.h"
+#include "core/ipclass.h"
 #include "core/ipp_cache.h"
 #include "core/local_shell.h"
 #include "core/move.h"
+#include "core/netio.h"
 #include "core/nodes.h"
 #include "core/ntp.h"
 #include "core/oob.h"
@@ -95,11 +98,13 @@
 #include "core/tls_common.h"
 #include "core/topless.h"
 #include "core/tsync.h"
+#include "core/tth_cache.h"
 #include "core/tx.h"
 #include "core/udp.h"
 #include "core/uhc.h"
 #include "core/upload_stats.h"
 #include "core/urpc.h"
+#include "core/verify_huge.h"
 #include "core/verify_sha1.h"
 #include "core/verify_tth.h"
 #include "core/version.h"
@@ -138,6 +143,7 @@
 #include "lib/log.h"
 #include "lib/map.h"
 #include "lib/mem.h"
+#include "lib/memtag.h"
 #include "lib/mime_type.h"
 #include "lib/misc.h"
 #include "lib/mtwist.h"
@@ -203,6 +209,7 @@
 #include "lib/override.h"		/* Must be the last header included */
 
 #define SLOW_UPDATE_PERIOD		20	/**< Update period for `main_slow_update' */
+#define MEMTAG_SAMPLE_PERIOD	10	/**< Period for memory growth sampling */
 #define EXIT_GRACE				30	/**< Seconds to wait before exiting */
 #define ATEXIT_TIMEOUT			20	/**< Final cleanup must not take longer */
 
@@ -726,6 +733,7 @@ gtk_gnutella_exit(int exit_code)
 	DO(parq_close_pre);
 	DO(verify_sha1_close);
 	DO(verify_tth_shutdown);
+	DO(verify_huge_shutdown);
 	DO(download_close);
 	DO(file_info_store_if_dirty);	/* In case downloads had buffered data */
 	DO(parq_close);
@@ -949,6 +957,7 @@ gtk_gnutella_exit(int exit_code)
 	DO(node_close);
 	DO(g2_node_close);
 	DO(share_close);	/* After node_close() */
+	DO(tth_cache_close);
 	DO(udp_close);
 	DO(urpc_close);
 	DO(g2_rpc_close);
@@ -960,6 +969,8 @@ gtk_gnutella_exit(int exit_code)
 	DO(bogons_close);	/* Idem, since host_close() can touch the cache */
 	DO(tx_collect);		/* Prevent spurious leak notifications */
 	DO(rx_collect);		/* Idem */
+	DO(deflate_dict_close);	/* After TX/RX stacks are gone */
+	DO(netio_close);		/* After RX stacks are gone */
 	DO(hostiles_close);
 	DO(spam_close);
 	DO(gip_close);
@@ -967,6 +978,7 @@ gtk_gnutella_exit(int exit_code)
 	DO(inet_close);
 	DO(ctl_close);
 	DO(whitelist_close);
+	DO(ipclass_close);		/* After all the classification sources */
 	DO(features_close);
 	DO(clock_close);
 	DO(vmsg_close);
@@ -987,7 +999,6 @@ gtk_gnutella_exit(int exit_code)
 	DO(tls_global_close);
 	DO(misc_close);
 	DO(mingw_close);
-	DO(verify_tth_close);
 	DO(inputevt_close);
 	DO(locale_close);
 	DO(wq_close);
@@ -1589,6 +1600,27 @@ slow_main_timer(time_t now)
 		settings_create_listening_sockets();
 }
 
+/**
+ * Sample memory usage per accounting domain, logging it periodically when
+ * configured to.
+ */
+static void
+main_memtag_timer(time_t now)
+{
+	static time_t last_sample, last_dump;
+	uint32 period = GNET_PROPERTY(memtag_dump_period);
+
+	if (delta_time(now, last_sample) >= MEMTAG_SAMPLE_PERIOD) {
+		last_sample = now;
+		memtag_sample();
+	}
+
+	if (period != 0 && delta_time(now, last_dump) >= period) {
+		last_dump = now;
+		memtag_dump_samples_log(log_agent_stderr_get());
+	}
+}
+
 /**
  * Check CPU usage.
  *
@@ -1762,6 +1794,7 @@ main_timer(void *unused_data)
 	hsep_timer(now);			/* HSEP notify message timer */
 	pproxy_timer(now);			/* Push-proxy requests */
 	dh_timer(now);				/* Monitoring of query hits */
+	main_memtag_timer(now);	/* Memory accounting samples */
 
 	/*
 	 * GUI update
@@ -2496,6 +2529,7 @@ main(int argc, char **argv)
 	inputevt_init(OPT(use_poll));
 	teq_io_create();
 	teq_set_throttle(70, 50);	/* 70 ms max for TEQ events, every 50 ms */
+	sha1_check();
 	tiger_check();
 	tt_check();
 	tea_test();
@@ -2558,6 +2592,7 @@ main(int argc, char **argv)
 	ipp_cache_load_all();
 	tls_global_init();
 	pmsg_init();
+	ipclass_init();
 	hostiles_init();
 	spam_init();
 	bogons_init();
@@ -2568,6 +2603,7 @@ main(int argc, char **argv)
 	gwc_init();
 	verify_sha1_init();
 	verify_tth_init();
+	verify_huge_init();
 	move_init();
 	ignore_init();
 	word_vec_init();
@@ -2577,11 +2613,14 @@ main(int argc, char **argv)
 	gmsg_init();
 	bsched_init();
 	dump_init();
+	netio_init();
+	deflate_dict_init();
 	node_init();
 	g2_node_init();
     hcache_retrieve_all();	/* after settings_init() and node_init() */
 	routing_init();
 	search_init();
+	tth_cache_init();
 	share_init();
 	dmesh_init();			/* MUST be done BEFORE download_init() */
 	download_init();		/* MUST be done AFTER file_info_init() */
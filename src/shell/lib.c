@@ -52,6 +52,11 @@ static enum shell_reply
 shell_exec_lib_show_callout(struct gnutella_shell *sh,
 	int argc, const char *argv[])
 {
+	const char *opt_w;
+	const option_t options[] = {
+		{ "w", &opt_w },
+	};
+	int parsed;
 	pslist_t *info, *sl;
 	str_t *s;
 	size_t maxlen = 0;
@@ -60,10 +65,20 @@ shell_exec_lib_show_callout(struct gnutella_shell *sh,
 	g_assert(argv);
 	g_assert(argc > 0);
 
+	parsed = shell_options_parse(sh, argv, options, N_ITEMS(options));
+	if (parsed < 0)
+		return REPLY_ERROR;
+
 	shell_write(sh, "100~\n");
-	shell_write(sh,
-		"T  Events Per. Idle Last  Period  Heartbeat  Triggered Name (Parent)"
-		"\n");
+	if (opt_w != NULL) {
+		shell_write(sh,
+			"Level 0     Level 1     Level 2     Level 3       Max   "
+			"Cascades      Moved Name\n");
+	} else {
+		shell_write(sh,
+			"T  Events Per. Idle Last  Period  Heartbeat  Triggered "
+			"Name (Parent)\n");
+	}
 
 	info = cq_info_list();
 	s = str_new(80);
@@ -83,6 +98,27 @@ shell_exec_lib_show_callout(struct gnutella_shell *sh,
 
 		cq_info_check(cqi);
 
+		/*
+		 * With -w, show the timing wheel occupancy: for each level, the
+		 * amount of events and of non-empty slots.
+		 */
+
+		if (opt_w != NULL) {
+			uint i;
+
+			str_reset(s);
+			for (i = 0; i < CQ_INFO_LEVELS; i++) {
+				str_catf(s, "%5zu/%-5zu ",
+					cqi->level_count[i], cqi->level_slots[i]);
+			}
+			str_catf(s, "%5zu ", cqi->slot_max);
+			str_catf(s, "%10zu ", cqi->cascade_count);
+			str_catf(s, "%10zu ", cqi->cascaded_count);
+			str_catf(s, "\"%s\"\n", cqi->name);
+			shell_write(sh, str_2c(s));
+			continue;
+		}
+
 		if (THREAD_INVALID_ID == cqi->stid)
 			str_printf(s, "%-2s ", "-");
 		else
@@ -345,12 +381,13 @@ shell_help_lib(int argc, const char *argv[])
 		if (0 == ascii_strcasecmp(argv[1], "show")) {
 			if (2 == argc) {
 				return
-					"lib show callout      # display callout queues\n"
+					"lib show callout [-w] # display callout queues\n"
 					"lib show files [-duw] # display open files\n";
 			} else {
 				if (0 == ascii_strcasecmp(argv[2], "callout")) {
-					return "lib show callout\n"
-						"display information about all the callout queues\n";
+					return "lib show callout [-w]\n"
+						"display information about all the callout queues\n"
+						"-w: show timing wheel occupancy and cascades\n";
 				} else
 				if (0 == ascii_strcasecmp(argv[2], "files")) {
 					return "lib show files [-uw]\n"
@@ -45,6 +45,7 @@
 #include "lib/glib-missing.h"
 #include "lib/halloc.h"
 #include "lib/log.h"
+#include "lib/memtag.h"
 #include "lib/misc.h"
 #include "lib/omalloc.h"
 #include "lib/palloc.h"
@@ -505,6 +506,16 @@ shell_exec_memory_stats_omalloc(struct gnutella_shell *sh,
 	return memory_run_opt_shower(sh, omalloc_dump_stats_log, "OMALLOC ", opt);
 }
 
+static enum shell_reply
+shell_exec_memory_stats_tags(struct gnutella_shell *sh,
+	unsigned opt, unsigned which)
+{
+	if (which & STATS_USAGE)
+		return memory_run_opt_shower(sh, memtag_dump_usage_log, "MEMTAG ", opt);
+
+	return memory_run_opt_shower(sh, memtag_dump_stats_log, "MEMTAG ", opt);
+}
+
 static enum shell_reply
 shell_exec_memory_stats(struct gnutella_shell *sh,
 	int argc, const char *argv[])
@@ -542,6 +553,7 @@ shell_exec_memory_stats(struct gnutella_shell *sh,
 
 	CMD(halloc);
 	CMD(palloc);
+	CMD(tags);
 	CMD(tmalloc);
 	CMD(vmm);
 	CMD(xmalloc);
@@ -768,10 +780,12 @@ shell_help_memory(int argc, const char *argv[])
 				"memory show zones     # display zone usage\n";
 		} else if (0 == ascii_strcasecmp(argv[1], "stats")) {
 			return "memory stats [-pu] "
-				"halloc|omalloc|palloc|tmalloc|vmm|xmalloc|zalloc\n"
+				"halloc|omalloc|palloc|tags|tmalloc|vmm|xmalloc|zalloc\n"
 				"show statistics about specified memory sub-system\n"
 				"-p : pretty-print numbers with thousands separators\n"
-				"-u : show allocation usage statistics, if available\n";
+				"-u : show allocation usage statistics, if available\n"
+				"'tags' shows memory usage per accounting domain, sorted by\n"
+				"decreasing growth rate; -u details usage per allocator\n";
 		} else if (0 == ascii_strcasecmp(argv[1], "usage")) {
 			return "memory usage zone <size> on|off|show\n"
 				"show or turn on/off usage statistics for given zone\n";
@@ -783,7 +797,7 @@ shell_help_memory(int argc, const char *argv[])
 #endif
 		"memory check xmalloc\n"
 		"memory show hole|magazines|options|pmap|pools|xmalloc|zones\n"
-		"memory stats [-pu] omalloc|palloc|tmalloc|vmm|xmalloc|zalloc\n"
+		"memory stats [-pu] omalloc|palloc|tags|tmalloc|vmm|xmalloc|zalloc\n"
 		"memory usage zone <size> on|off|show\n"
 		;
 	}
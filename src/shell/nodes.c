@@ -95,6 +95,62 @@ print_node_info(struct gnutella_shell *sh, const gnutella_node_t *n)
 	shell_write(sh, "\n");	/* Terminate line */
 }
 
+static void
+print_node_compression(struct gnutella_shell *sh, const gnutella_node_t *n)
+{
+	char buf[1024];
+	char level_buf[4];
+	char tx_buf[8];
+	char rx_buf[8];
+	char cpu_buf[16];
+	char cost_buf[16];
+
+	g_return_if_fail(sh);
+	g_return_if_fail(n);
+
+	if (NODE_TX_COMPRESSED(n)) {
+		uint64 input = n->tx_given;
+
+		str_bprintf(ARYLEN(level_buf), "%u", n->tx_deflate_level);
+		str_bprintf(ARYLEN(tx_buf), "%.1f%%",
+			100.0 * NODE_TX_COMPRESSION_RATIO(n));
+		clamp_strcpy(ARYLEN(cpu_buf),
+			compact_time_ms(n->tx_deflate_ns / 1000000));
+		if (input != 0) {
+			str_bprintf(ARYLEN(cost_buf), "%.2f",
+				(double) n->tx_deflate_ns / input);
+		} else {
+			clamp_strcpy(ARYLEN(cost_buf), "-");
+		}
+	} else {
+		clamp_strcpy(ARYLEN(level_buf), "-");
+		clamp_strcpy(ARYLEN(tx_buf), "-");
+		clamp_strcpy(ARYLEN(cpu_buf), "-");
+		clamp_strcpy(ARYLEN(cost_buf), "-");
+	}
+
+	if (NODE_RX_COMPRESSED(n)) {
+		str_bprintf(ARYLEN(rx_buf), "%.1f%%",
+			100.0 * NODE_RX_COMPRESSION_RATIO(n));
+	} else {
+		clamp_strcpy(ARYLEN(rx_buf), "-");
+	}
+
+	str_bprintf(ARYLEN(buf),
+		"%-21.45s %3s %6s %6s %8s %8s %10s %10s",
+		node_gnet_addr(n),
+		level_buf,
+		tx_buf,
+		rx_buf,
+		cpu_buf,
+		cost_buf,
+		compact_size(n->tx_given, FALSE),
+		compact_size2(n->tx_deflated, FALSE));
+
+	shell_write(sh, buf);
+	shell_write(sh, "\n");	/* Terminate line */
+}
+
 /**
  * Displays all connected nodes
  */
@@ -102,21 +158,40 @@ enum shell_reply
 shell_exec_nodes(struct gnutella_shell *sh, int argc, const char *argv[])
 {
 	const pslist_t *sl;
+	const char *opt_c;
+	const option_t options[] = {
+		{ "c", &opt_c },			/* compression statistics */
+	};
+	int parsed;
 
 	shell_check(sh);
 	g_assert(argv);
 	g_assert(argc > 0);
 
+	parsed = shell_options_parse(sh, argv, options, N_ITEMS(options));
+	if (parsed < 0)
+		return REPLY_ERROR;
+
 	shell_set_msg(sh, "");
 
-	shell_write(sh,
-	  "100~ \n"
-	  "Node                  Flags       CC Since  Uptime User-Agent\n");
+	if (opt_c != NULL) {
+		shell_write(sh,
+		  "100~ \n"
+		  "Node                  Lvl     TX     RX      CPU  ns/byte"
+		  "      Given    Deflated\n");
+	} else {
+		shell_write(sh,
+		  "100~ \n"
+		  "Node                  Flags       CC Since  Uptime User-Agent\n");
+	}
 
 	PSLIST_FOREACH(node_all_nodes(), sl) {
 		const gnutella_node_t *n = sl->data;
 		node_check(n);
-		print_node_info(sh, n);
+		if (opt_c != NULL)
+			print_node_compression(sh, n);
+		else
+			print_node_info(sh, n);
 	}
 	shell_write(sh, ".\n");	/* Terminate message body */
 
@@ -135,7 +210,11 @@ shell_help_nodes(int argc, const char *argv[])
 	g_assert(argv);
 	g_assert(argc > 0);
 
-	return NULL;
+	return "nodes [-c]\n"
+		"displays connected Gnutella nodes.\n"
+		"-c : show compression statistics: current TX compression level,\n"
+		"     TX and RX compression ratios, CPU time spent compressing,\n"
+		"     CPU cost per given byte, bytes given and bytes deflated.\n";
 }
 
 /* vi: set ts=4 sw=4 cindent: */
@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2026, gtk-gnutella developers
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup shell
+ * @file
+ *
+ * The "verify" command.
+ *
+ * @author gtk-gnutella developers
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "cmd.h"
+
+#include "core/verify.h"
+
+#include "if/gnet_property.h"
+#include "if/gnet_property_priv.h"
+
+#include "lib/ascii.h"
+#include "lib/misc.h"				/* For compact_size() */
+#include "lib/str.h"
+#include "lib/stringify.h"			/* For compact_time_ms() */
+
+#include "lib/override.h"		/* Must be the last header included */
+
+#define VERIFY_DEVICES	64		/* Max amount of devices listed */
+
+static enum shell_reply
+shell_exec_verify_devices(struct gnutella_shell *sh,
+	int argc, const char *argv[])
+{
+	struct verify_device_stats vec[VERIFY_DEVICES];
+	bool metric = GNET_PROPERTY(display_metric_units);
+	size_t i, n;
+	str_t *s;
+
+	shell_check(sh);
+	g_assert(argv);
+	g_assert(argc > 0);
+
+	n = verify_device_stats(ARYLEN(vec));
+
+	shell_write(sh, "100~\n");
+	shell_write(sh,
+		"Device             Rd  Queued   Files Errors    Bytes  Run-time"
+		"      Rate\n");
+
+	s = str_new(80);
+
+	for (i = 0; i < n; i++) {
+		const struct verify_device_stats *vd = &vec[i];
+		uint64 rate = 0 == vd->busy_us ? 0 :
+			vd->bytes * 1000000 / vd->busy_us;
+
+		str_printf(s, "%-18s ", uint64_to_string(vd->dev));
+		str_catf(s, "%-2u ", vd->readers);
+		str_catf(s, "%7u ", vd->queued);
+		str_catf(s, "%7s ", uint64_to_string(vd->files));
+		str_catf(s, "%6s ", uint64_to_string(vd->errors));
+		str_catf(s, "%8s ", compact_size(vd->bytes, metric));
+		str_catf(s, "%9s ", compact_time_ms(vd->busy_us / 1000));
+		str_catf(s, "%9s", compact_rate(rate, metric));
+		str_putc(s, '\n');
+		shell_write(sh, str_2c(s));
+	}
+
+	str_destroy_null(&s);
+	shell_write(sh, ".\n");
+
+	return REPLY_READY;
+}
+
+/**
+ * Handles the verify command.
+ */
+enum shell_reply
+shell_exec_verify(struct gnutella_shell *sh, int argc, const char *argv[])
+{
+	shell_check(sh);
+	g_assert(argv);
+	g_assert(argc > 0);
+
+	if (argc < 2)
+		return REPLY_ERROR;
+
+#define CMD(name) G_STMT_START { \
+	if (0 == ascii_strcasecmp(argv[1], #name)) \
+		return shell_exec_verify_ ## name(sh, argc - 1, argv + 1); \
+} G_STMT_END
+
+	CMD(devices);
+
+#undef CMD
+
+	shell_set_formatted(sh, _("Unknown operation \"%s\""), argv[1]);
+	return REPLY_ERROR;
+}
+
+const char *
+shell_summary_verify(void)
+{
+	return "Hash verification monitoring interface";
+}
+
+const char *
+shell_help_verify(int argc, const char *argv[])
+{
+	g_assert(argv);
+	g_assert(argc > 0);
+
+	if (argc > 1) {
+		if (0 == ascii_strcasecmp(argv[1], "devices")) {
+			return "verify devices\n"
+				"show per-device hashing throughput\n"
+				"Rd: amount of files being read from the device\n";
+		}
+	} else {
+		return "verify devices\n";
+	}
+	return NULL;
+}
+
+/* vi: set ts=4 sw=4 cindent: */